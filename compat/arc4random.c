@@ -171,3 +171,18 @@ arc4random()
 	arc4_stir_if_needed(&rs);
 	return arc4_getword(&rs);
 }
+
+void
+arc4random_buf(void *buf, size_t n)
+{
+	uint8_t *p = buf;
+
+	arc4_stir_if_needed(&rs);
+	for (; n != 0; n--) {
+		if (rs.count <= 1)
+			arc4_stir(&rs);
+		else
+			rs.count--;
+		*p++ = arc4_getbyte(&rs);
+	}
+}
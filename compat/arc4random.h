@@ -10,7 +10,9 @@
 #ifndef ARC4RANDOM_H
 #define ARC4RANDOM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 uint32_t arc4random(void);
+void arc4random_buf(void *, size_t);
 #endif
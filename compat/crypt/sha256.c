@@ -110,7 +110,7 @@ be32dec_vect(uint32_t *dst, const unsigned char *src, size_t len)
  * the 512-bit input block to produce a new state.
  */
 static void
-SHA256_Transform(uint32_t * state, const unsigned char block[64])
+SHA256_Block(uint32_t * state, const unsigned char block[64])
 {
 	uint32_t W[64];
 	uint32_t S[8];
@@ -196,6 +196,224 @@ SHA256_Transform(uint32_t * state, const unsigned char block[64])
 		state[i] += S[i];
 }
 
+/* Portable transform of nblocks 64 byte blocks. */
+static void
+SHA256_Transform_c(uint32_t * state, const unsigned char *src, size_t nblocks)
+{
+
+	for (; nblocks != 0; nblocks--, src += 64)
+		SHA256_Block(state, src);
+}
+
+/*
+ * Where the CPU has SHA-256 instructions, use them for the compression
+ * function instead.  The choice is made at run time on the first block
+ * so one binary runs everywhere; the portable code above is the fallback.
+ */
+#if !defined(SHA256_NO_ACCEL) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define	SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/* The ARMv8 code has not been run yet, so only with SHA256_ARM_ACCEL. */
+#if !defined(SHA256_NO_ACCEL) && defined(SHA256_ARM_ACCEL) && \
+    defined(__aarch64__) && \
+    (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO) || \
+    (defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 7))
+#define	SHA256_ARM
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#elif defined(__FreeBSD__)
+#include <sys/auxv.h>
+#include <machine/elf.h>
+#endif
+#endif
+
+#if defined(SHA256_X86) || defined(SHA256_ARM)
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+#endif
+
+#ifdef SHA256_X86
+static int
+SHA256_Have_x86(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	/* SSSE3 and SSE4.1 for the shuffles, then the SHA extensions. */
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	if (!(ecx & (1U << 9)) || !(ecx & (1U << 19)))
+		return 0;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ebx & (1U << 29) ? 1 : 0;
+}
+
+/*
+ * The SHA extensions keep the state as ABEF and CDGH and do two rounds
+ * per sha256rnds2, so four rounds of the schedule go in each step.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+SHA256_Transform_x86(uint32_t * state, const unsigned char *src,
+    size_t nblocks)
+{
+	__m128i S0, S1, T, W, MASK, ABEF, CDGH, M[4];
+	int i;
+
+	T = _mm_loadu_si128((const __m128i *)(const void *)&state[0]);
+	S1 = _mm_loadu_si128((const __m128i *)(const void *)&state[4]);
+	T = _mm_shuffle_epi32(T, 0xb1);			/* CDAB */
+	S1 = _mm_shuffle_epi32(S1, 0x1b);		/* EFGH */
+	S0 = _mm_alignr_epi8(T, S1, 8);			/* ABEF */
+	S1 = _mm_blend_epi16(S1, T, 0xf0);		/* CDGH */
+	MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+
+	for (; nblocks != 0; nblocks--, src += 64) {
+		ABEF = S0;
+		CDGH = S1;
+
+		for (i = 0; i < 4; i++)
+			M[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+			    (const __m128i *)(const void *)(src + i * 16)),
+			    MASK);
+
+		for (i = 0; i < 16; i++) {
+			W = _mm_add_epi32(M[i & 3], _mm_loadu_si128(
+			    (const __m128i *)(const void *)&K[i * 4]));
+			S1 = _mm_sha256rnds2_epu32(S1, S0, W);
+			W = _mm_shuffle_epi32(W, 0x0e);
+			S0 = _mm_sha256rnds2_epu32(S0, S1, W);
+			if (i >= 12)
+				continue;
+			/* W[t] for the 4 rounds 16 ahead of these. */
+			T = _mm_alignr_epi8(M[(i + 3) & 3], M[(i + 2) & 3], 4);
+			M[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(
+			    _mm_sha256msg1_epu32(M[i & 3], M[(i + 1) & 3]), T),
+			    M[(i + 3) & 3]);
+		}
+
+		S0 = _mm_add_epi32(S0, ABEF);
+		S1 = _mm_add_epi32(S1, CDGH);
+	}
+
+	T = _mm_shuffle_epi32(S0, 0x1b);		/* FEBA */
+	S1 = _mm_shuffle_epi32(S1, 0xb1);		/* DCHG */
+	S0 = _mm_blend_epi16(T, S1, 0xf0);		/* DCBA */
+	S1 = _mm_alignr_epi8(S1, T, 8);			/* HGFE */
+	_mm_storeu_si128((__m128i *)(void *)&state[0], S0);
+	_mm_storeu_si128((__m128i *)(void *)&state[4], S1);
+}
+#endif /* SHA256_X86 */
+
+#ifdef SHA256_ARM
+static int
+SHA256_Have_arm(void)
+{
+#if defined(__linux__) && defined(HWCAP_SHA2)
+	return getauxval(AT_HWCAP) & HWCAP_SHA2 ? 1 : 0;
+#elif defined(__FreeBSD__) && defined(HWCAP_SHA2)
+	unsigned long hwcap;
+
+	if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)) != 0)
+		return 0;
+	return hwcap & HWCAP_SHA2 ? 1 : 0;
+#elif defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+	/* Built for a CPU with them, so they must be there. */
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* The ARMv8 instructions do four rounds on ABCD and EFGH at a time. */
+#if !defined(__ARM_FEATURE_SHA2) && !defined(__ARM_FEATURE_CRYPTO)
+__attribute__((target("+crypto")))
+#endif
+static void
+SHA256_Transform_arm(uint32_t * state, const unsigned char *src,
+    size_t nblocks)
+{
+	uint32x4_t S0, S1, T, W, ABCD, EFGH, M[4];
+	int i;
+
+	S0 = vld1q_u32(&state[0]);
+	S1 = vld1q_u32(&state[4]);
+
+	for (; nblocks != 0; nblocks--, src += 64) {
+		ABCD = S0;
+		EFGH = S1;
+
+		for (i = 0; i < 4; i++)
+			M[i] = vreinterpretq_u32_u8(vrev32q_u8(
+			    vld1q_u8(src + i * 16)));
+
+		for (i = 0; i < 16; i++) {
+			W = vaddq_u32(M[i & 3], vld1q_u32(&K[i * 4]));
+			T = S0;
+			S0 = vsha256hq_u32(S0, S1, W);
+			S1 = vsha256h2q_u32(S1, T, W);
+			if (i >= 12)
+				continue;
+			/* W[t] for the 4 rounds 16 ahead of these. */
+			M[i & 3] = vsha256su1q_u32(
+			    vsha256su0q_u32(M[i & 3], M[(i + 1) & 3]),
+			    M[(i + 2) & 3], M[(i + 3) & 3]);
+		}
+
+		S0 = vaddq_u32(S0, ABCD);
+		S1 = vaddq_u32(S1, EFGH);
+	}
+
+	vst1q_u32(&state[0], S0);
+	vst1q_u32(&state[4], S1);
+}
+#endif /* SHA256_ARM */
+
+static void SHA256_Transform_select(uint32_t *, const unsigned char *, size_t);
+static void (*SHA256_Transform)(uint32_t *, const unsigned char *, size_t) =
+    SHA256_Transform_select;
+
+/* Pick the best transform for this CPU, then use it from now on. */
+static void
+SHA256_Transform_select(uint32_t * state, const unsigned char *src,
+    size_t nblocks)
+{
+
+	SHA256_Transform = SHA256_Transform_c;
+#ifdef SHA256_X86
+	if (SHA256_Have_x86())
+		SHA256_Transform = SHA256_Transform_x86;
+#endif
+#ifdef SHA256_ARM
+	if (SHA256_Have_arm())
+		SHA256_Transform = SHA256_Transform_arm;
+#endif
+	SHA256_Transform(state, src, nblocks);
+}
 static unsigned char PAD[64] = {
 	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -269,15 +487,15 @@ SHA256_Update(SHA256_CTX * ctx, const void *in, size_t len)
 
 	/* Finish the current block */
 	memcpy(&ctx->buf[r], src, 64 - r);
-	SHA256_Transform(ctx->state, ctx->buf);
+	SHA256_Transform(ctx->state, ctx->buf, 1);
 	src += 64 - r;
 	len -= 64 - r;
 
-	/* Perform complete blocks */
-	while (len >= 64) {
-		SHA256_Transform(ctx->state, src);
-		src += 64;
-		len -= 64;
+	/* Perform complete blocks in one go */
+	if (len >= 64) {
+		SHA256_Transform(ctx->state, src, len / 64);
+		src += len & ~(size_t)0x3f;
+		len &= 0x3f;
 	}
 
 	/* Copy left over data into buffer */
@@ -0,0 +1,34 @@
+/* linux */
+#ifndef	SYSCONFDIR
+#define	SYSCONFDIR		"/etc"
+#define	SBINDIR			"/sbin"
+#define	LIBDIR			"/lib"
+#define	LIBEXECDIR		"/libexec"
+#define	DBDIR			"/var/db/dhcpcd"
+#define	RUNDIR			"/var/run/dhcpcd"
+#endif
+#include		<asm/types.h> /* fix broken headers */
+#include		<sys/socket.h> /* fix broken headers */
+#include		<linux/rtnetlink.h>
+#ifndef PRIVSEP_USER
+#define PRIVSEP_USER		 "dhcpcd"
+#endif
+#define	HAVE_NL80211_H
+#define	HAVE_IN6_ADDR_GEN_MODE_NONE
+#define	HAVE_OPEN_MEMSTREAM
+#define	HAVE_RECVMMSG
+#include			"compat/pidfile.h"
+#include			"compat/setproctitle.h"
+#include			"compat/strlcpy.h"
+#include			"compat/strtoi.h"
+#include			"compat/consttime_memequal.h"
+#include			<sys/queue.h>
+#include			"compat/queue.h"
+#define	RBTEST
+#include			"compat/rbtree.h"
+#define	HAVE_REALLOCARRAY
+#define	HAVE_PPOLL
+#include			"compat/endian.h"
+#include			"compat/crypt/md5.h"
+#include			"compat/crypt/sha256.h"
+#include			"compat/crypt/hmac.h"
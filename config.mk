@@ -0,0 +1,68 @@
+# linux
+SYSCONFDIR=	/etc
+SBINDIR=	/sbin
+LIBDIR=		/lib
+LIBEXECDIR=	/libexec
+DBDIR=		/var/db/dhcpcd
+RUNDIR=		/var/run/dhcpcd
+LIBDIR=		/lib
+MANDIR=		/usr/share/man
+DATADIR=	/usr/share
+CPPFLAGS+=	-DHAVE_CONFIG_H
+CFLAGS+=	-g -Wall -Wextra -Wundef
+CFLAGS+=	-Wmissing-prototypes -Wmissing-declarations
+CFLAGS+=	-Wmissing-format-attribute -Wnested-externs
+CFLAGS+=	-Winline -Wcast-align -Wcast-qual -Wpointer-arith
+CFLAGS+=	-Wreturn-type -Wswitch -Wshadow
+CFLAGS+=	-Wcast-qual -Wwrite-strings
+CFLAGS+=	-Wformat=2
+CFLAGS+=	-Wpointer-sign -Wmissing-noreturn
+CFLAGS+=	-Wredundant-decls
+CFLAGS+=	-Wconversion
+CFLAGS+=	-Wstrict-overflow
+CPPFLAGS+=	-D_GNU_SOURCE
+CPPFLAGS+=	-D_FILE_OFFSET_BITS=64
+CPPFLAGS+=	-D_LARGEFILE_SOURCE
+CPPFLAGS+=	-D_LARGEFILE64_SOURCE
+DHCPCD_SRCS+=	if-linux.c
+CKSUM=		sha256sum --tag
+PGP=		gpg2
+DEFAULT_HOSTNAME=		(none)
+CPPFLAGS+=	-DINET
+DHCPCD_SRCS+=	dhcp.c ipv4.c bpf.c
+CPPFLAGS+=	-DARP
+DHCPCD_SRCS+=	arp.c
+CPPFLAGS+=	-DARPING
+CPPFLAGS+=	-DIPV4LL
+DHCPCD_SRCS+=	ipv4ll.c
+CPPFLAGS+=	-DINET6
+DHCPCD_SRCS+=	ipv6.c ipv6nd.c
+CPPFLAGS+=	-DDHCP6
+DHCPCD_SRCS+=	dhcp6.c
+CPPFLAGS+=	-DAUTH
+SRCS+=		auth.c
+CPPFLAGS+=	-DPRIVSEP
+PRIVSEP_USER?=	dhcpcd
+PRIVSEP_SRCS=	privsep.c privsep-root.c
+PRIVSEP_SRCS+=	privsep-control.c privsep-inet.c
+PRIVSEP_SRCS+=	privsep-bpf.c
+PRIVSEP_SRCS+=	privsep-linux.c
+TEST_SUBDIRS+=	seccomp-bench
+DHCPCD_SRCS+=	dhcpcd-embedded.c
+COMPAT_SRCS+=	compat/pidfile.c
+COMPAT_SRCS+=	compat/setproctitle.c
+COMPAT_SRCS+=	compat/strlcpy.c
+COMPAT_SRCS+=	compat/strtoi.c compat/strtou.c
+COMPAT_SRCS+=	compat/rb.c
+MD5_SRC=	compat/crypt/md5.c
+SHA256_SRC=	compat/crypt/sha256.c
+HMAC_SRC=	compat/crypt/hmac.c
+CRYPT_SRCS+=	${HMAC_SRC}
+CRYPT_SRCS+=	${MD5_SRC}
+CRYPT_SRCS+=	${SHA256_SRC}
+SERVICEEXISTS=	
+SERVICECMD=	
+SERVICESTATUS=	
+STATUSARG=	
+HOOKSCRIPTS=	50-timesyncd.conf
+EGHOOKSCRIPTS=	50-yp.conf
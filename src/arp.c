@@ -65,30 +65,114 @@
 
 /* Assert the correct structure size for on wire */
 __CTASSERT(sizeof(struct arphdr) == 8);
+__CTASSERT(ARP_TXFRAME_LEN ==
+    sizeof(struct arphdr) + (2 * (HWADDR_LEN + sizeof(in_addr_t))));
+
+/* Frames are sent after arp_request returns, so report failures here
+ * with what it would have said. */
+static void
+arp_senderr(const struct interface *ifp, const struct arp_txframe *f)
+{
+
+	logerr("%s: arp_request: %s", ifp->name, inet_ntoa(f->tip));
+}
+
+static void
+arp_flush(void *arg)
+{
+	struct interface *ifp = arg;
+	struct iarp_state *state = ARP_STATE(ifp);
+	struct arp_state *astate;
+	struct arp_txframe *f;
+	size_t n;
+#ifdef __linux__
+	struct iovec iov[ARP_TXQ_LEN];
+	size_t i;
+	ssize_t r;
+#endif
+
+	eloop_timeout_delete(ifp->ctx->eloop, arp_flush, ifp);
+	if (state == NULL || state->arp_ntxq == 0)
+		return;
+	n = state->arp_ntxq;
+	state->arp_ntxq = 0;
+	ifp->stats.tx[IF_STAT_BPF] += n;
+
+#ifdef PRIVSEP
+	if (ifp->ctx->options & DHCPCD_PRIVSEP) {
+		for (f = state->arp_txq; n != 0; f++, n--) {
+			if (ps_bpf_sendarp(ifp, &f->tip, f->buf, f->len) == -1)
+				arp_senderr(ifp, f);
+		}
+		return;
+	}
+#endif
+
+#ifdef __linux__
+	/* There is no write filter on Linux, so any of our ARP sockets
+	 * can send the whole burst in one go. */
+	TAILQ_FOREACH(astate, &state->arp_states, next) {
+		if (astate->bpf != NULL)
+			break;
+	}
+	if (astate == NULL)
+		return;
+	for (i = 0, f = state->arp_txq; i < n; i++, f++) {
+		iov[i].iov_base = f->buf;
+		iov[i].iov_len = f->len;
+	}
+	/* Note that well formed ethernet will add extra padding
+	 * to ensure that the packet is at least 60 bytes (64 including FCS). */
+	r = bpf_sendv(astate->bpf, ETHERTYPE_ARP, iov, n);
+	/* Retry what did not go out one at a time to learn why. */
+	for (i = r == -1 ? 0 : (size_t)r, f = state->arp_txq + i;
+	     i < n;
+	     i++, f++)
+	{
+		if (bpf_send(astate->bpf, ETHERTYPE_ARP,
+		    f->buf, f->len) == -1)
+			arp_senderr(ifp, f);
+	}
+#else
+	/* The write filter only lets each socket send for its address. */
+	for (f = state->arp_txq; n != 0; f++, n--) {
+		astate = arp_find(ifp, &f->tip);
+		if (astate == NULL || astate->bpf == NULL)
+			continue;
+		if (bpf_send(astate->bpf, ETHERTYPE_ARP, f->buf, f->len) == -1)
+			arp_senderr(ifp, f);
+	}
+#endif
+}
 
 static ssize_t
 arp_request(const struct arp_state *astate,
     const struct in_addr *sip)
 {
-	const struct interface *ifp = astate->iface;
+	struct interface *ifp = astate->iface;
+	struct iarp_state *state = ARP_STATE(ifp);
 	const struct in_addr *tip = &astate->addr;
-	uint8_t arp_buffer[ARP_LEN];
+	struct arp_txframe *f;
 	struct arphdr ar;
 	size_t len;
 	uint8_t *p;
 
+	if (state->arp_ntxq == ARP_TXQ_LEN)
+		arp_flush(ifp);
+	f = &state->arp_txq[state->arp_ntxq];
+
 	ar.ar_hrd = htons(ifp->hwtype);
 	ar.ar_pro = htons(ETHERTYPE_IP);
 	ar.ar_hln = ifp->hwlen;
 	ar.ar_pln = sizeof(tip->s_addr);
 	ar.ar_op = htons(ARPOP_REQUEST);
 
-	p = arp_buffer;
+	p = f->buf;
 	len = 0;
 
 #define CHECK(fun, b, l)						\
 	do {								\
-		if (len + (l) > sizeof(arp_buffer))			\
+		if (len + (l) > sizeof(f->buf))				\
 			goto eexit;					\
 		fun(p, (b), (l));					\
 		p += (l);						\
@@ -106,19 +190,125 @@ arp_request(const struct arp_state *astate,
 	ZERO(ifp->hwlen);
 	APPEND(&tip->s_addr, sizeof(tip->s_addr));
 
-#ifdef PRIVSEP
-	if (ifp->ctx->options & DHCPCD_PRIVSEP)
-		return ps_bpf_sendarp(ifp, tip, arp_buffer, len);
-#endif
-	/* Note that well formed ethernet will add extra padding
-	 * to ensure that the packet is at least 60 bytes (64 including FCS). */
-	return bpf_send(astate->bpf, ETHERTYPE_ARP, arp_buffer, len);
+	/* Queue the frame so that everything due this eloop tick
+	 * goes out together once the expired timeouts have run.
+	 * arp_tick flushes every interface itself when done. */
+	f->tip = *tip;
+	f->len = len;
+	state->arp_ntxq++;
+	if (!ifp->ctx->arp_ticking)
+		eloop_timeout_add_sec(ifp->ctx->eloop, 0, arp_flush, ifp);
+	return (ssize_t)len;
 
 eexit:
 	errno = ENOBUFS;
 	return -1;
 }
 
+/*
+ * Probes and announcements for every interface are kept on one list
+ * ordered by when they are due, with a single eloop timeout for the
+ * first. Due times are rounded up to ARP_TICK_MSEC so that interfaces
+ * probing together, such as many falling back to IPv4LL at once,
+ * are handled in the same pass and their frames flushed together.
+ */
+static unsigned long long
+arp_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * MSEC_PER_SEC +
+	    (unsigned long long)now.tv_nsec / NSEC_PER_MSEC;
+}
+
+static void arp_tick(void *);
+
+static void
+arp_settimer(struct dhcpcd_ctx *ctx, unsigned long long now)
+{
+	struct arp_state *astate;
+
+	astate = TAILQ_FIRST(&ctx->arp_timers);
+	if (astate == NULL)
+		eloop_timeout_delete(ctx->eloop, arp_tick, ctx);
+	else if (eloop_timeout_add_msec(ctx->eloop,
+	    astate->due > now ? (unsigned long)(astate->due - now) : 0,
+	    arp_tick, ctx) == -1)
+		logerr(__func__);
+}
+
+static void
+arp_unschedule(struct arp_state *astate)
+{
+	struct dhcpcd_ctx *ctx = astate->iface->ctx;
+
+	if (astate->due_cb == NULL)
+		return;
+	TAILQ_REMOVE(&ctx->arp_timers, astate, tnext);
+	astate->due_cb = NULL;
+	if (!ctx->arp_ticking && TAILQ_FIRST(&ctx->arp_timers) == NULL)
+		eloop_timeout_delete(ctx->eloop, arp_tick, ctx);
+}
+
+static void
+arp_schedule(struct arp_state *astate, unsigned long msec,
+    void (*cb)(struct arp_state *))
+{
+	struct dhcpcd_ctx *ctx = astate->iface->ctx;
+	struct arp_state *a;
+	unsigned long long now;
+
+	arp_unschedule(astate);
+	now = arp_now();
+	astate->due = (now + msec + ARP_TICK_MSEC - 1) /
+	    ARP_TICK_MSEC * ARP_TICK_MSEC;
+	astate->due_cb = cb;
+
+	/* Nearly everything is due after what is already queued. */
+	TAILQ_FOREACH_REVERSE(a, &ctx->arp_timers, arp_timerhead, tnext) {
+		if (a->due <= astate->due)
+			break;
+	}
+	if (a == NULL)
+		TAILQ_INSERT_HEAD(&ctx->arp_timers, astate, tnext);
+	else
+		TAILQ_INSERT_AFTER(&ctx->arp_timers, a, astate, tnext);
+
+	if (!ctx->arp_ticking && TAILQ_FIRST(&ctx->arp_timers) == astate)
+		arp_settimer(ctx, now);
+}
+
+static void
+arp_tick(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	struct arp_state *astate;
+	struct interface *ifp;
+	struct iarp_state *state;
+	void (*cb)(struct arp_state *);
+	unsigned long long now;
+
+	now = arp_now();
+	ctx->arp_ticking = true;
+	while ((astate = TAILQ_FIRST(&ctx->arp_timers)) != NULL &&
+	    astate->due <= now)
+	{
+		TAILQ_REMOVE(&ctx->arp_timers, astate, tnext);
+		cb = astate->due_cb;
+		astate->due_cb = NULL;
+		cb(astate);
+	}
+	ctx->arp_ticking = false;
+
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		state = ARP_STATE(ifp);
+		if (state != NULL && state->arp_ntxq != 0)
+			arp_flush(ifp);
+	}
+	arp_settimer(ctx, now);
+}
+
 static void
 arp_report_conflicted(const struct arp_state *astate,
     const struct arp_msg *amsg)
@@ -221,6 +411,93 @@ arp_validate(const struct interface *ifp, struct arphdr *arp)
 	return true;
 }
 
+static size_t
+arp_hashslot(const struct iarp_state *state, const struct in_addr *addr)
+{
+	uint32_t h = (uint32_t)addr->s_addr * 0x9e3779b1U;
+
+	return (h ^ (h >> 16)) & (state->arp_hashlen - 1);
+}
+
+static struct arp_state *
+arp_lookup(const struct iarp_state *state, const struct in_addr *addr)
+{
+	struct arp_state *astate;
+	size_t i;
+
+	if (state->arp_hashlen == 0)
+		return NULL;
+	for (i = arp_hashslot(state, addr);
+	    (astate = state->arp_hash[i]) != NULL;
+	    i = (i + 1) & (state->arp_hashlen - 1))
+	{
+		if (astate->addr.s_addr == addr->s_addr)
+			return astate;
+	}
+	return NULL;
+}
+
+static void
+arp_hashinsert(struct iarp_state *state, struct arp_state *astate)
+{
+	size_t i;
+
+	for (i = arp_hashslot(state, &astate->addr);
+	    state->arp_hash[i] != NULL;
+	    i = (i + 1) & (state->arp_hashlen - 1))
+		;
+	state->arp_hash[i] = astate;
+}
+
+/* Ensure there is room for one more state. */
+static int
+arp_hashreserve(struct iarp_state *state)
+{
+	struct arp_state **hash, *astate;
+	size_t len;
+
+	if ((state->arp_nstates + 1) * 2 <= state->arp_hashlen)
+		return 0;
+
+	len = state->arp_hashlen != 0 ? state->arp_hashlen * 2 : ARP_HASH_MIN;
+	hash = calloc(len, sizeof(*hash));
+	if (hash == NULL)
+		return -1;
+	free(state->arp_hash);
+	state->arp_hash = hash;
+	state->arp_hashlen = len;
+	TAILQ_FOREACH(astate, &state->arp_states, next) {
+		arp_hashinsert(state, astate);
+	}
+	return 0;
+}
+
+static void
+arp_hashremove(struct iarp_state *state, const struct arp_state *astate)
+{
+	size_t mask = state->arp_hashlen - 1, i, j, k;
+
+	for (i = arp_hashslot(state, &astate->addr);
+	    state->arp_hash[i] != astate;
+	    i = (i + 1) & mask)
+		;
+	state->arp_hash[i] = NULL;
+
+	/* Shift back any following entries that can no longer be reached
+	 * so lookups can still stop at the first empty slot. */
+	for (j = (i + 1) & mask;
+	    state->arp_hash[j] != NULL;
+	    j = (j + 1) & mask)
+	{
+		k = arp_hashslot(state, &state->arp_hash[j]->addr);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		state->arp_hash[i] = state->arp_hash[j];
+		state->arp_hash[j] = NULL;
+		i = j;
+	}
+}
+
 void
 arp_packet(struct interface *ifp, uint8_t *data, size_t len,
     unsigned int bpf_flags)
@@ -230,9 +507,11 @@ arp_packet(struct interface *ifp, uint8_t *data, size_t len,
 	struct arphdr ar;
 	struct arp_msg arm;
 	const struct iarp_state *state;
-	struct arp_state *astate, *astaten;
+	struct arp_state *astate;
 	uint8_t *hw_s, *hw_t;
 
+	ifp->stats.rx[IF_STAT_BPF]++;
+
 	/* Copy the frame header source and destination out */
 	memset(&arm, 0, sizeof(arm));
 	if (fl != 0) {
@@ -249,14 +528,17 @@ arp_packet(struct interface *ifp, uint8_t *data, size_t len,
 	}
 
 	/* We must have a full ARP header */
-	if (len < sizeof(ar))
+	if (len < sizeof(ar)) {
+		ifp->stats.dropped[IF_STAT_BPF]++;
 		return;
+	}
 	memcpy(&ar, data, sizeof(ar));
 
 	if (!arp_validate(ifp, &ar)) {
 #ifdef BPF_DEBUG
 		logerrx("%s: ARP BPF validation failure", ifp->name);
 #endif
+		ifp->stats.dropped[IF_STAT_BPF]++;
 		return;
 	}
 
@@ -289,13 +571,12 @@ arp_packet(struct interface *ifp, uint8_t *data, size_t len,
 	state = ARP_CSTATE(ifp);
 	if (state == NULL)
 		return;
-	TAILQ_FOREACH_SAFE(astate, &state->arp_states, next, astaten) {
-		if (IN_ARE_ADDR_EQUAL(&arm.sip, &astate->addr) ||
-		    (IN_IS_ADDR_UNSPECIFIED(&arm.sip) &&
-		    IN_ARE_ADDR_EQUAL(&arm.tip, &astate->addr) &&
-		    bpf_flags & BPF_BCAST))
-			arp_found(astate, &arm);
-	}
+	astate = arp_lookup(state, &arm.sip);
+	if (astate == NULL && IN_IS_ADDR_UNSPECIFIED(&arm.sip) &&
+	    bpf_flags & BPF_BCAST)
+		astate = arp_lookup(state, &arm.tip);
+	if (astate != NULL)
+		arp_found(astate, &arm);
 }
 
 static void
@@ -331,30 +612,141 @@ arp_read(void *arg, unsigned short events)
 	}
 }
 
+#ifdef BPF_SHARED_SOCKET
 static void
-arp_probed(void *arg)
+arp_readshared(void *arg, unsigned short events)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	struct bpf *bpf = ctx->arp_bpf;
+	struct interface *ifp;
+	const struct iarp_state *state;
+	const struct arp_state *astate;
+	uint8_t buf[ARP_LEN];
+	ssize_t bytes;
+
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	bpf->bpf_flags &= ~BPF_EOF;
+	while (!(bpf->bpf_flags & BPF_EOF)) {
+		bytes = bpf_read(bpf, buf, sizeof(buf));
+		if (bytes == -1) {
+			logerr(__func__);
+			break;
+		}
+		/* Only pass it on if the interface is using this socket. */
+		ifp = if_findindex(ctx->ifaces, bpf->bpf_ifindex);
+		state = ifp != NULL ? ARP_CSTATE(ifp) : NULL;
+		astate = state != NULL ? TAILQ_FIRST(&state->arp_states) : NULL;
+		if (astate != NULL && astate->bpf != NULL &&
+		    astate->bpf->bpf_flags & BPF_SHARED)
+			arp_packet(ifp, buf, (size_t)bytes, bpf->bpf_flags);
+		/* The last address may have closed it. */
+		if ((bpf = ctx->arp_bpf) == NULL)
+			break;
+	}
+}
+
+/* Match the addresses of all interfaces on the shared socket.
+ * This runs once per eloop iteration after the addresses change. */
+static void
+arp_filtershared(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	struct interface *ifp;
+	const struct iarp_state *state;
+	const struct arp_state *astate;
+	struct in_addr addrs[BPF_ARP_ADDRS_MAX];
+	size_t naddrs = 0;
+
+	if (ctx->arp_bpf == NULL)
+		return;
+
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if ((state = ARP_CSTATE(ifp)) == NULL)
+			continue;
+		TAILQ_FOREACH(astate, &state->arp_states, next) {
+			if (astate->bpf == NULL ||
+			    !(astate->bpf->bpf_flags & BPF_SHARED))
+				continue;
+			/* Too many, so pass up all ARP. */
+			if (naddrs == BPF_ARP_ADDRS_MAX) {
+				naddrs++;
+				goto setfilter;
+			}
+			addrs[naddrs++] = astate->addr;
+		}
+	}
+
+setfilter:
+	if (bpf_arp_addrs(ctx->arp_bpf, addrs, naddrs) == -1)
+		logerr(__func__);
+}
+
+/* Called when an address drops its handle on the shared socket. */
+static void
+arp_closeshared(struct dhcpcd_ctx *ctx)
+{
+
+	if (ctx->arp_bpf == NULL)
+		return;
+	if (ctx->arp_bpf->bpf_refs != 0) {
+		eloop_timeout_add_sec(ctx->eloop, 0, arp_filtershared, ctx);
+		return;
+	}
+	eloop_timeout_delete(ctx->eloop, arp_filtershared, ctx);
+	eloop_event_delete(ctx->eloop, ctx->arp_bpf->bpf_fd);
+	bpf_close(ctx->arp_bpf);
+	ctx->arp_bpf = NULL;
+}
+
+static struct bpf *
+arp_openshared(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct bpf *bpf;
+
+	if (ctx->arp_bpf == NULL) {
+		ctx->arp_bpf = bpf_open(ctx, NULL, bpf_arp, NULL);
+		if (ctx->arp_bpf == NULL)
+			return NULL;
+		if (eloop_event_add(ctx->eloop, ctx->arp_bpf->bpf_fd,
+		    ELE_READ, arp_readshared, ctx) == -1)
+			logerr("%s: eloop_event_add", __func__);
+	}
+
+	bpf = bpf_share(ctx->arp_bpf, ifp);
+	if (bpf == NULL)
+		arp_closeshared(ctx);
+	else
+		eloop_timeout_add_sec(ctx->eloop, 0, arp_filtershared, ctx);
+	return bpf;
+}
+#endif
+
+static void
+arp_probed(struct arp_state *astate)
 {
-	struct arp_state *astate = arg;
 
 	timespecclear(&astate->defend);
 	astate->not_found_cb(astate);
 }
 
 static void
-arp_probe1(void *arg)
+arp_probe1(struct arp_state *astate)
 {
-	struct arp_state *astate = arg;
 	struct interface *ifp = astate->iface;
 	unsigned int delay;
 
 	if (++astate->probes < PROBE_NUM) {
+		/* Leave room to round up to the tick within PROBE_MAX. */
 		delay = (PROBE_MIN * MSEC_PER_SEC) +
-		    (arc4random_uniform(
-		    (PROBE_MAX - PROBE_MIN) * MSEC_PER_SEC));
-		eloop_timeout_add_msec(ifp->ctx->eloop, delay, arp_probe1, astate);
+		    (rndpool_uniform(ifp->ctx,
+		    (PROBE_MAX - PROBE_MIN) * MSEC_PER_SEC - ARP_TICK_MSEC));
+		arp_schedule(astate, delay, arp_probe1);
 	} else {
 		delay = ANNOUNCE_WAIT *	MSEC_PER_SEC;
-		eloop_timeout_add_msec(ifp->ctx->eloop, delay, arp_probed, astate);
+		arp_schedule(astate, delay, arp_probed);
 	}
 	logdebugx("%s: ARP probing %s (%d of %d), next in %0.1f seconds",
 	    ifp->name, inet_ntoa(astate->addr),
@@ -371,7 +763,8 @@ arp_probe(struct arp_state *astate)
 	astate->probes = 0;
 	logdebugx("%s: probing for %s",
 	    astate->iface->name, inet_ntoa(astate->addr));
-	arp_probe1(astate);
+	/* Join the next tick so probes started together stay together. */
+	arp_schedule(astate, 0, arp_probe1);
 }
 #endif	/* ARP */
 
@@ -381,21 +774,16 @@ arp_find(struct interface *ifp, const struct in_addr *addr)
 	struct iarp_state *state;
 	struct arp_state *astate;
 
-	if ((state = ARP_STATE(ifp)) == NULL)
-		goto out;
-	TAILQ_FOREACH(astate, &state->arp_states, next) {
-		if (astate->addr.s_addr == addr->s_addr && astate->iface == ifp)
-			return astate;
-	}
-out:
+	if ((state = ARP_STATE(ifp)) != NULL &&
+	    (astate = arp_lookup(state, addr)) != NULL)
+		return astate;
 	errno = ESRCH;
 	return NULL;
 }
 
 static void
-arp_announced(void *arg)
+arp_announced(struct arp_state *astate)
 {
-	struct arp_state *astate = arg;
 
 	if (astate->announced_cb) {
 		astate->announced_cb(astate);
@@ -406,9 +794,8 @@ arp_announced(void *arg)
 }
 
 static void
-arp_announce1(void *arg)
+arp_announce1(struct arp_state *astate)
 {
-	struct arp_state *astate = arg;
 	struct interface *ifp = astate->iface;
 	struct ipv4_addr *ia;
 
@@ -441,9 +828,8 @@ skip_request:
 	if (ia != NULL)
 		ia->flags |= ~IPV4_AF_NEW;
 
-	eloop_timeout_add_sec(ifp->ctx->eloop, ANNOUNCE_WAIT,
-	    astate->claims < ANNOUNCE_NUM ? arp_announce1 : arp_announced,
-	    astate);
+	arp_schedule(astate, ANNOUNCE_WAIT * MSEC_PER_SEC,
+	    astate->claims < ANNOUNCE_NUM ? arp_announce1 : arp_announced);
 }
 
 static void
@@ -452,30 +838,22 @@ arp_announce(struct arp_state *astate)
 	struct iarp_state *state;
 	struct interface *ifp;
 	struct arp_state *a2;
-	int r;
 
 	/* Cancel any other ARP announcements for this address. */
 	TAILQ_FOREACH(ifp, astate->iface->ctx->ifaces, next) {
 		state = ARP_STATE(ifp);
 		if (state == NULL)
 			continue;
-		TAILQ_FOREACH(a2, &state->arp_states, next) {
-			if (astate == a2 ||
-			    a2->addr.s_addr != astate->addr.s_addr)
-				continue;
-			r = eloop_timeout_delete(a2->iface->ctx->eloop,
-			    a2->claims < ANNOUNCE_NUM
-			    ? arp_announce1 : arp_announced,
-			    a2);
-			if (r == -1)
-				logerr(__func__);
-			else if (r != 0) {
-				logdebugx("%s: ARP announcement "
-				    "of %s cancelled",
-				    a2->iface->name,
-				    inet_ntoa(a2->addr));
-				arp_announced(a2);
-			}
+		a2 = arp_lookup(state, &astate->addr);
+		if (a2 == NULL || a2 == astate)
+			continue;
+		if (a2->due_cb == arp_announce1 ||
+		    a2->due_cb == arp_announced)
+		{
+			arp_unschedule(a2);
+			logdebugx("%s: ARP announcement of %s cancelled",
+			    a2->iface->name, inet_ntoa(a2->addr));
+			arp_announced(a2);
 		}
 	}
 
@@ -542,11 +920,20 @@ arp_new(struct interface *ifp, const struct in_addr *addr)
 			return NULL;
 		}
 		TAILQ_INIT(&state->arp_states);
+		state->arp_hash = NULL;
+		state->arp_hashlen = 0;
+		state->arp_nstates = 0;
+		state->arp_ntxq = 0;
 	} else {
 		if ((astate = arp_find(ifp, addr)) != NULL)
 			return astate;
 	}
 
+	if (arp_hashreserve(state) == -1) {
+		logerr(__func__);
+		return NULL;
+	}
+
 	if ((astate = calloc(1, sizeof(*astate))) == NULL) {
 		logerr(__func__);
 		return NULL;
@@ -564,20 +951,30 @@ arp_new(struct interface *ifp, const struct in_addr *addr)
 	} else
 #endif
 	{
-		astate->bpf = bpf_open(ifp, bpf_arp, addr);
+#ifdef BPF_SHARED_SOCKET
+		if (ifp->ctx->options & DHCPCD_SHARED_BPF &&
+		    ifp->hwtype == ARPHRD_ETHER)
+			astate->bpf = arp_openshared(ifp);
+		else
+#endif
+		astate->bpf = bpf_open(ifp->ctx, ifp, bpf_arp, addr);
 		if (astate->bpf == NULL) {
 			logerr(__func__);
 			free(astate);
 			return NULL;
 		}
-		if (eloop_event_add(ifp->ctx->eloop, astate->bpf->bpf_fd, ELE_READ,
-		    arp_read, astate) == -1)
+		/* A shared socket is read by arp_readshared. */
+		if (!(astate->bpf->bpf_flags & BPF_SHARED) &&
+		    eloop_event_add(ifp->ctx->eloop, astate->bpf->bpf_fd,
+		    ELE_READ, arp_read, astate) == -1)
 			logerr("%s: eloop_event_add", __func__);
 	}
 
 
 	state = ARP_STATE(ifp);
 	TAILQ_INSERT_TAIL(&state->arp_states, astate, next);
+	arp_hashinsert(state, astate);
+	state->arp_nstates++;
 	return astate;
 }
 
@@ -594,15 +991,26 @@ arp_free(struct arp_state *astate)
 	ifp = astate->iface;
 	ctx = ifp->ctx;
 	eloop_timeout_delete(ctx->eloop, NULL, astate);
+	arp_unschedule(astate);
 
 	state =	ARP_STATE(ifp);
+	/* Send anything queued while we still have the socket. */
+	arp_flush(ifp);
 	TAILQ_REMOVE(&state->arp_states, astate, next);
+	arp_hashremove(state, astate);
+	state->arp_nstates--;
 	if (astate->free_cb)
 		astate->free_cb(astate);
 
 #ifdef PRIVSEP
 	if (IN_PRIVSEP(ctx) && ps_bpf_closearp(ifp, &astate->addr) == -1)
 		logerr(__func__);
+#endif
+#ifdef BPF_SHARED_SOCKET
+	if (astate->bpf != NULL && astate->bpf->bpf_flags & BPF_SHARED) {
+		bpf_close(astate->bpf);
+		arp_closeshared(ctx);
+	} else
 #endif
 	if (astate->bpf != NULL) {
 		eloop_event_delete(ctx->eloop, astate->bpf->bpf_fd);
@@ -612,6 +1020,7 @@ arp_free(struct arp_state *astate)
 	free(astate);
 
 	if (TAILQ_FIRST(&state->arp_states) == NULL) {
+		free(state->arp_hash);
 		free(state);
 		ifp->if_data[IF_DATA_ARP] = NULL;
 	}
@@ -41,6 +41,10 @@
 #define RATE_LIMIT_INTERVAL	60
 #define DEFEND_INTERVAL		10
 
+/* Probes and announcements fall due on a grid of this many milliseconds
+ * so that those for different interfaces go out in the same pass. */
+#define	ARP_TICK_MSEC		100
+
 #include "bpf.h"
 #include "dhcpcd.h"
 #include "if.h"
@@ -75,6 +79,11 @@ struct arp_state {
 	int claims;
 	struct timespec defend;
 
+	/* Position on the shared timer, see arp_tick. */
+	TAILQ_ENTRY(arp_state) tnext;
+	unsigned long long due;
+	void (*due_cb)(struct arp_state *);
+
 	void (*found_cb)(struct arp_state *, const struct arp_msg *);
 	void (*not_found_cb)(struct arp_state *);
 	void (*announced_cb)(struct arp_state *);
@@ -83,8 +92,29 @@ struct arp_state {
 };
 TAILQ_HEAD(arp_statehead, arp_state);
 
+/* Frames due in the same eloop tick are queued on the interface
+ * and sent together by arp_flush. */
+#define	ARP_TXQ_LEN		16
+/* arphdr + 2 * (hwaddr + in_addr) */
+#define	ARP_TXFRAME_LEN		(8 + (2 * (HWADDR_LEN + 4)))
+
+struct arp_txframe {
+	struct in_addr tip;
+	size_t len;
+	uint8_t buf[ARP_TXFRAME_LEN];
+};
+
+/* States are also indexed by address in an open addressing hash
+ * of arp_hashlen slots, a power of two kept at most half full. */
+#define	ARP_HASH_MIN		8
+
 struct iarp_state {
 	struct arp_statehead arp_states;
+	struct arp_state **arp_hash;
+	size_t arp_hashlen;
+	size_t arp_nstates;
+	struct arp_txframe arp_txq[ARP_TXQ_LEN];
+	size_t arp_ntxq;
 };
 
 #define ARP_STATE(ifp)							       \
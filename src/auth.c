@@ -49,6 +49,9 @@
 #ifdef HAVE_HMAC_H
 #include <hmac.h>
 #endif
+#if defined(HAVE_MD5_H) && !defined(DEPGEN)
+#include <md5.h>
+#endif
 
 #ifdef __sun
 #define htonll
@@ -75,6 +78,18 @@
 
 #define HMAC_LENGTH	16
 
+#ifndef MD5_BLOCK_LENGTH
+#define	MD5_BLOCK_LENGTH	64
+#endif
+#define	HMAC_IPAD		0x36
+#define	HMAC_OPAD		0x5c
+
+/* The MD5 states after hashing the inner and outer key pads. */
+struct auth_hmac {
+	MD5_CTX ah_inner;
+	MD5_CTX ah_outer;
+};
+
 void
 dhcp_auth_reset(struct authstate *state)
 {
@@ -83,17 +98,77 @@ dhcp_auth_reset(struct authstate *state)
 	if (state->token) {
 		free(state->token->key);
 		free(state->token->realm);
+		free(state->token->hmac);
 		free(state->token);
 		state->token = NULL;
 	}
 	if (state->reconf) {
 		free(state->reconf->key);
 		free(state->reconf->realm);
+		free(state->reconf->hmac);
 		free(state->reconf);
 		state->reconf = NULL;
 	}
 }
 
+/*
+ * The key pads only depend on the key, so hash them once per token
+ * and each message resumes from a copy of those states.
+ * Must be called again if the key changes.
+ */
+int
+dhcp_auth_hmacinit(struct token *t)
+{
+	uint8_t k[MD5_BLOCK_LENGTH], pad[MD5_BLOCK_LENGTH];
+	size_t i, klen;
+	MD5_CTX c;
+
+	if (t->hmac == NULL &&
+	    (t->hmac = malloc(sizeof(*t->hmac))) == NULL)
+		return -1;
+
+	if (t->key_len > sizeof(k)) {
+		MD5Init(&c);
+		MD5Update(&c, t->key, (unsigned int)t->key_len);
+		MD5Final(k, &c);
+		klen = MD5_DIGEST_LENGTH;
+	} else {
+		memcpy(k, t->key, t->key_len);
+		klen = t->key_len;
+	}
+	memset(k + klen, 0, sizeof(k) - klen);
+
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] = k[i] ^ HMAC_IPAD;
+	MD5Init(&t->hmac->ah_inner);
+	MD5Update(&t->hmac->ah_inner, pad, sizeof(pad));
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] = k[i] ^ HMAC_OPAD;
+	MD5Init(&t->hmac->ah_outer);
+	MD5Update(&t->hmac->ah_outer, pad, sizeof(pad));
+	return 0;
+}
+
+static void
+dhcp_auth_hmac_md5(const struct token *t, const void *m, size_t mlen,
+    uint8_t *digest)
+{
+	uint8_t d[MD5_DIGEST_LENGTH];
+	MD5_CTX c;
+
+	if (t->hmac == NULL) {
+		hmac("md5", t->key, t->key_len, m, mlen, digest, HMAC_LENGTH);
+		return;
+	}
+
+	c = t->hmac->ah_inner;
+	MD5Update(&c, m, (unsigned int)mlen);
+	MD5Final(d, &c);
+	c = t->hmac->ah_outer;
+	MD5Update(&c, d, sizeof(d));
+	MD5Final(digest, &c);
+}
+
 /*
  * Authenticate a DHCP message.
  * m and mlen refer to the whole message.
@@ -256,8 +331,10 @@ dhcp_auth_validate(struct authstate *state, const struct auth *auth,
 					state->reconf->realm = NULL;
 					state->reconf->realm_len = 0;
 					state->reconf->key_len = 16;
+					state->reconf->hmac = NULL;
 				}
 				memcpy(state->reconf->key, d, 16);
+				dhcp_auth_hmacinit(state->reconf);
 			} else {
 				errno = EINVAL;
 				return NULL;
@@ -266,6 +343,7 @@ dhcp_auth_validate(struct authstate *state, const struct auth *auth,
 				errno = ENOENT;
 			/* Free the old token so we log acceptance */
 			if (state->token) {
+				free(state->token->hmac);
 				free(state->token);
 				state->token = NULL;
 			}
@@ -353,8 +431,7 @@ gottoken:
 	memset(hmac_code, 0, sizeof(hmac_code));
 	switch (algorithm) {
 	case AUTH_ALG_HMAC_MD5:
-		hmac("md5", t->key, t->key_len, mm, mlen,
-		     hmac_code, sizeof(hmac_code));
+		dhcp_auth_hmac_md5(t, mm, mlen, hmac_code);
 		break;
 	default:
 		errno = ENOSYS;
@@ -402,6 +479,8 @@ finish:
 				state->token->realm = NULL;
 				state->token->realm_len = 0;
 			}
+			state->token->hmac = NULL;
+			dhcp_auth_hmacinit(state->token);
 		}
 		/* If we cannot save the token, we must invalidate */
 		if (state->token == NULL)
@@ -719,8 +798,7 @@ dhcp_auth_encode(struct dhcpcd_ctx *ctx, struct auth *auth,
 	/* Create our hash and write it out */
 	switch(auth->algorithm) {
 	case AUTH_ALG_HMAC_MD5:
-		hmac("md5", t->key, t->key_len, m, mlen,
-		     hmac_code, sizeof(hmac_code));
+		dhcp_auth_hmac_md5(t, m, mlen, hmac_code);
 		memcpy(data, hmac_code, sizeof(hmac_code));
 		break;
 	}
@@ -51,6 +51,8 @@
 
 #define AUTH_RDM_MONOTONIC	0
 
+struct auth_hmac;
+
 struct token {
 	TAILQ_ENTRY(token) next;
 	uint32_t secretid;
@@ -59,6 +61,7 @@ struct token {
 	size_t key_len;
 	unsigned char *key;
 	time_t expire;
+	struct auth_hmac *hmac;		/* see dhcp_auth_hmacinit */
 };
 
 TAILQ_HEAD(token_head, token);
@@ -84,6 +87,7 @@ struct authstate {
 };
 
 void dhcp_auth_reset(struct authstate *);
+int dhcp_auth_hmacinit(struct token *);
 
 const struct token * dhcp_auth_validate(struct authstate *,
     const struct auth *,
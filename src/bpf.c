@@ -37,7 +37,9 @@
 
 #ifdef __linux__
 /* Special BPF snowflake. */
+#include <sys/mman.h>
 #include <linux/filter.h>
+#include <linux/if_packet.h>
 #define	bpf_insn		sock_filter
 #else
 #include <net/bpf.h>
@@ -147,7 +149,7 @@ bpf_frame_bcast(const struct interface *ifp, const void *frame)
 const char *bpf_name = "Berkley Packet Filter";
 
 struct bpf *
-bpf_open(const struct interface *ifp,
+bpf_open(__unused struct dhcpcd_ctx *ctx, const struct interface *ifp,
     int (*filter)(const struct bpf *, const struct in_addr *),
     const struct in_addr *ia)
 {
@@ -299,6 +301,14 @@ bpf_attach(int fd, void *filter, unsigned int filter_len)
 	return ioctl(fd, BIOCSETF, &pf);
 }
 
+/* BIOCLOCK is separate, so this is the same as bpf_attach. */
+int
+bpf_setfilter(int fd, void *filter, unsigned int filter_len)
+{
+
+	return bpf_attach(fd, filter, filter_len);
+}
+
 #ifdef BIOCSETWF
 static int
 bpf_wattach(int fd, void *filter, unsigned int filter_len)
@@ -311,6 +321,20 @@ bpf_wattach(int fd, void *filter, unsigned int filter_len)
 #endif
 #endif
 
+#ifdef BPF_SHARED_SOCKET
+/* A shared socket is not bound, so each frame says where it goes. */
+static void
+bpf_linkaddr(const struct bpf *bpf, uint16_t protocol,
+    struct sockaddr_ll *sll)
+{
+
+	memset(sll, 0, sizeof(*sll));
+	sll->sll_family = PF_PACKET;
+	sll->sll_protocol = htons(protocol);
+	sll->sll_ifindex = (int)bpf->bpf_ifp->index;
+}
+#endif
+
 #ifndef __sun
 /* SunOS is special too - sending via BPF goes nowhere. */
 ssize_t
@@ -336,15 +360,119 @@ bpf_send(const struct bpf *bpf, uint16_t protocol,
 	}
 	iov[1].iov_base = UNCONST(data);
 	iov[1].iov_len = len;
+#ifdef BPF_SHARED_SOCKET
+	if (bpf->bpf_flags & BPF_SHARED) {
+		struct sockaddr_ll sll;
+		struct msghdr msg = {
+			.msg_name = &sll,
+			.msg_namelen = sizeof(sll),
+			.msg_iov = iov,
+			.msg_iovlen = 2,
+		};
+
+		bpf_linkaddr(bpf, protocol, &sll);
+		return sendmsg(bpf->bpf_fd, &msg, 0);
+	}
+#endif
 	return writev(bpf->bpf_fd, iov, 2);
 }
 #endif
 
+#ifdef __linux__
+#define	BPF_SENDV_MAX	16
+/* Send a number of frames with as few syscalls as possible.
+ * Returns the number of frames sent. */
+ssize_t
+bpf_sendv(const struct bpf *bpf, uint16_t protocol,
+    const struct iovec *frames, size_t nframes)
+{
+	struct mmsghdr msgs[BPF_SENDV_MAX];
+	struct iovec iovs[BPF_SENDV_MAX][2];
+	struct ether_header eh;
+	struct sockaddr_ll sll;
+	size_t i, n, sent = 0;
+	int r;
+
+	switch(bpf->bpf_ifp->hwtype) {
+	case ARPHRD_ETHER:
+		memset(&eh.ether_dhost, 0xff, sizeof(eh.ether_dhost));
+		memcpy(&eh.ether_shost, bpf->bpf_ifp->hwaddr,
+		    sizeof(eh.ether_shost));
+		eh.ether_type = htons(protocol);
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (bpf->bpf_flags & BPF_SHARED)
+		bpf_linkaddr(bpf, protocol, &sll);
+
+	while (sent < nframes) {
+		n = nframes - sent;
+		if (n > BPF_SENDV_MAX)
+			n = BPF_SENDV_MAX;
+		memset(msgs, 0, sizeof(msgs[0]) * n);
+		for (i = 0; i < n; i++) {
+			iovs[i][0].iov_base = &eh;
+			iovs[i][0].iov_len = sizeof(eh);
+			iovs[i][1] = frames[sent + i];
+			msgs[i].msg_hdr.msg_iov = iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 2;
+			if (bpf->bpf_flags & BPF_SHARED) {
+				msgs[i].msg_hdr.msg_name = &sll;
+				msgs[i].msg_hdr.msg_namelen = sizeof(sll);
+			}
+		}
+		r = sendmmsg(bpf->bpf_fd, msgs, (unsigned int)n, 0);
+		if (r == -1)
+			return sent != 0 ? (ssize_t)sent : -1;
+		sent += (size_t)r;
+		if ((size_t)r != n)
+			break;
+	}
+	return (ssize_t)sent;
+}
+#endif
+
+#ifdef BPF_SHARED_SOCKET
+/* Returns a handle for ifp to send on a socket shared by all interfaces.
+ * Frames are read from the shared socket itself. */
+struct bpf *
+bpf_share(struct bpf *shared, const struct interface *ifp)
+{
+	struct bpf *bpf;
+
+	bpf = calloc(1, sizeof(*bpf));
+	if (bpf == NULL)
+		return NULL;
+	bpf->bpf_ifp = ifp;
+	bpf->bpf_fd = shared->bpf_fd;
+	bpf->bpf_flags = BPF_SHARED;
+	bpf->bpf_shared = shared;
+	shared->bpf_refs++;
+	return bpf;
+}
+#endif
+
+/* Closing a shared handle just drops the reference,
+ * the owner closes the shared socket once it reaches zero. */
 void
 bpf_close(struct bpf *bpf)
 {
 
+#ifdef BPF_SHARED_SOCKET
+	if (bpf->bpf_flags & BPF_SHARED) {
+		bpf->bpf_shared->bpf_refs--;
+		free(bpf);
+		return;
+	}
+#endif
 	close(bpf->bpf_fd);
+#ifdef __linux__
+	if (bpf->bpf_block_size != 0)
+		munmap(bpf->bpf_buffer, bpf->bpf_size);
+	else
+#endif
 	free(bpf->bpf_buffer);
 	free(bpf);
 }
@@ -485,6 +613,144 @@ static const struct bpf_insn bpf_arp_filter [] = {
 #define BPF_ARP_LEN		BPF_ARP_ETHER_LEN + BPF_ARP_FILTER_LEN + \
 				BPF_CMP_HWADDR_LEN + BPF_ARP_ADDRS_LEN
 
+#ifdef BPF_SHARED_SOCKET
+/*
+ * A socket shared by all interfaces matches the addresses of every
+ * interface using it. The set is searched as a binary tree which
+ * ends in leaves of up to BPF_ARP_SET_LEAF compares.
+ * Each leaf that misses jumps past the set, so we patch those after.
+ */
+#define	BPF_ARP_SET_LEAF	4
+#define	BPF_ARP_SET_LEN		(BPF_ARP_ADDRS_MAX * 4)
+#define	BPF_ARP_SHARED_LEN	3 + BPF_ARP_ETHER_LEN + BPF_ARP_FILTER_LEN + \
+				5 + (BPF_ARP_SET_LEN * 2)
+
+struct bpf_arp_miss {
+	struct bpf_insn *jmps[BPF_ARP_ADDRS_MAX];
+	size_t njmps;
+};
+
+static struct bpf_insn *
+bpf_arp_set(struct bpf_insn *bp, const uint32_t *addrs, size_t naddrs,
+    uint16_t arp_len, struct bpf_arp_miss *miss)
+{
+	struct bpf_insn *jge;
+	size_t i, mid;
+
+	if (naddrs <= BPF_ARP_SET_LEAF) {
+		for (i = 0; i < naddrs; i++) {
+			BPF_SET_JUMP(bp, BPF_JMP + BPF_JEQ + BPF_K,
+			    addrs[i], 0, 1);
+			bp++;
+			BPF_SET_STMT(bp, BPF_RET + BPF_K, arp_len);
+			bp++;
+		}
+		miss->jmps[miss->njmps++] = bp;
+		BPF_SET_STMT(bp, BPF_JMP + BPF_JA, 0);
+		bp++;
+		return bp;
+	}
+
+	/* Lower half first, so the upper half is a jump away. */
+	mid = naddrs / 2;
+	jge = bp++;
+	bp = bpf_arp_set(bp, addrs, mid, arp_len, miss);
+	BPF_SET_JUMP(jge, BPF_JMP + BPF_JGE + BPF_K, addrs[mid],
+	    (uint8_t)(bp - jge - 1), 0);
+	return bpf_arp_set(bp, addrs + mid, naddrs - mid, arp_len, miss);
+}
+
+static struct bpf_insn *
+bpf_arp_setmatch(struct bpf_insn *bp, const uint32_t *addrs, size_t naddrs,
+    uint16_t arp_len)
+{
+	struct bpf_arp_miss miss = { .njmps = 0 };
+	size_t i;
+
+	bp = bpf_arp_set(bp, addrs, naddrs, arp_len, &miss);
+	for (i = 0; i < miss.njmps; i++)
+		miss.jmps[i]->k = (uint32_t)(bp - miss.jmps[i] - 1);
+	return bp;
+}
+
+static int
+bpf_addrcmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Replace the filter on a shared socket to match addrs.
+ * If addrs is NULL or there are too many, all ARP is passed up. */
+int
+bpf_arp_addrs(const struct bpf *bpf, const struct in_addr *addrs,
+    size_t naddrs)
+{
+	struct bpf_insn buf[BPF_ARP_SHARED_LEN + 1];
+	struct bpf_insn *bp;
+	uint32_t set[BPF_ARP_ADDRS_MAX];
+	uint16_t arp_len;
+	size_t i, n;
+
+	if (naddrs > BPF_ARP_ADDRS_MAX)
+		addrs = NULL;
+
+	bp = buf;
+	/* We see what we send, but don't need it. */
+	BPF_SET_STMT(bp, BPF_LD + BPF_B + BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	bp++;
+	BPF_SET_JUMP(bp, BPF_JMP + BPF_JEQ + BPF_K, PACKET_OUTGOING, 0, 1);
+	bp++;
+	BPF_SET_STMT(bp, BPF_RET + BPF_K, 0);
+	bp++;
+	memcpy(bp, bpf_arp_ether, sizeof(bpf_arp_ether));
+	bp += BPF_ARP_ETHER_LEN;
+	memcpy(bp, bpf_arp_filter, sizeof(bpf_arp_filter));
+	bp += BPF_ARP_FILTER_LEN;
+	arp_len = sizeof(struct ether_header) + sizeof(struct ether_arp);
+
+	if (addrs == NULL) {
+		BPF_SET_STMT(bp, BPF_RET + BPF_K, arp_len);
+		bp++;
+		return bpf_setfilter(bpf->bpf_fd, buf,
+		    (unsigned int)(bp - buf));
+	}
+
+	/* Sort and remove duplicates for the search. */
+	for (i = 0; i < naddrs; i++)
+		set[i] = ntohl(addrs[i].s_addr);
+	qsort(set, naddrs, sizeof(set[0]), bpf_addrcmp);
+	for (i = n = 0; i < naddrs; i++) {
+		if (n == 0 || set[n - 1] != set[i])
+			set[n++] = set[i];
+	}
+
+	/* Match sender protocol address */
+	BPF_SET_STMT(bp, BPF_LD + BPF_W + BPF_IND,
+	    sizeof(struct arphdr) + ETHER_ADDR_LEN);
+	bp++;
+	bp = bpf_arp_setmatch(bp, set, n, arp_len);
+
+	/* Otherwise we only want probes, so check the null host sender. */
+	BPF_SET_JUMP(bp, BPF_JMP + BPF_JEQ + BPF_K, INADDR_ANY, 1, 0);
+	bp++;
+	BPF_SET_STMT(bp, BPF_RET + BPF_K, 0);
+	bp++;
+
+	/* Match target protocol address */
+	BPF_SET_STMT(bp, BPF_LD + BPF_W + BPF_IND,
+	    sizeof(struct arphdr) + (ETHER_ADDR_LEN * 2) + sizeof(in_addr_t));
+	bp++;
+	bp = bpf_arp_setmatch(bp, set, n, arp_len);
+
+	BPF_SET_STMT(bp, BPF_RET + BPF_K, 0);
+	bp++;
+
+	return bpf_setfilter(bpf->bpf_fd, buf, (unsigned int)(bp - buf));
+}
+#endif
+
 static int
 bpf_arp_rw(const struct bpf *bpf, const struct in_addr *ia, bool recv)
 {
@@ -493,6 +759,12 @@ bpf_arp_rw(const struct bpf *bpf, const struct in_addr *ia, bool recv)
 	struct bpf_insn *bp;
 	uint16_t arp_len;
 
+#ifdef BPF_SHARED_SOCKET
+	/* A socket shared by all interfaces has no addresses yet. */
+	if (ifp == NULL)
+		return bpf_arp_addrs(bpf, NULL, 0);
+#endif
+
 	bp = buf;
 	/* Check frame header. */
 	switch(ifp->hwtype) {
@@ -629,22 +901,44 @@ static const struct bpf_insn bpf_bootp_write[] = {
 #define BPF_BOOTP_WRITE_LEN	__arraycount(bpf_bootp_write)
 #endif
 
-#define BPF_BOOTP_CHADDR_LEN	((BOOTP_CHADDR_LEN / 4) * 3)
-#define	BPF_BOOTP_XID_LEN	4 /* BOUND check is 4 instructions */
+/* A word per 4 bytes of chaddr, then a halfword and a byte for the rest. */
+#define BPF_BOOTP_CHADDR_LEN	((BOOTP_CHADDR_LEN / 4 + 1) * 3)
+#define	BPF_BOOTP_XID_LEN	3
 
 #define BPF_BOOTP_LEN		BPF_BOOTP_ETHER_LEN + \
 				BPF_BOOTP_BASE_LEN + BPF_BOOTP_READ_LEN + \
 				BPF_BOOTP_XID_LEN + BPF_BOOTP_CHADDR_LEN + 4
 
+/*
+ * The manager can see the DHCP state and matches the current xid.
+ * dhcp_new_xid replaces that filter, so it is left unlocked; the manager
+ * needs no protection from itself, unlike the privileged BPF process.
+ * That process has no state and so does not match the xid,
+ * nor does a socket shared by all interfaces.
+ */
+static const struct dhcp_state *
+bpf_bootp_state(const struct bpf *bpf)
+{
+
+	return bpf->bpf_ifp != NULL ? D_CSTATE(bpf->bpf_ifp) : NULL;
+}
+
 static int
 bpf_bootp_rw(const struct bpf *bpf, bool read)
 {
+	const struct interface *ifp = bpf->bpf_ifp;
+	const struct dhcp_state *state = bpf_bootp_state(bpf);
 	struct bpf_insn buf[BPF_BOOTP_LEN + 1];
 	struct bpf_insn *bp;
+	const uint8_t *hwaddr;
+	size_t hwlen, maclen, off;
+	uint32_t mac32;
+	uint16_t mac16;
 
 	bp = buf;
-	/* Check frame header. */
-	switch(bpf->bpf_ifp->hwtype) {
+	/* Check frame header.
+	 * A socket shared by all interfaces only takes ethernet. */
+	switch(ifp != NULL ? ifp->hwtype : ARPHRD_ETHER) {
 #ifdef ARPHRD_NONE
 	case ARPHRD_NONE:
 		memcpy(bp, bpf_bootp_none, sizeof(bpf_bootp_none));
@@ -682,20 +976,79 @@ bpf_bootp_rw(const struct bpf *bpf, bool read)
 	memcpy(bp, bpf_bootp_read, sizeof(bpf_bootp_read));
 	bp += BPF_BOOTP_READ_LEN;
 
+	/* Make sure the reply is for our hardware address.
+	 * This mirrors the check in dhcp_handledhcp. */
+	if (ifp != NULL && ifp->hwlen <= BOOTP_CHADDR_LEN) {
+		off = sizeof(struct udphdr) + offsetof(struct bootp, chaddr);
+		for (hwaddr = ifp->hwaddr, hwlen = ifp->hwlen;
+		     hwlen > 0;
+		     hwaddr += maclen, hwlen -= maclen, off += maclen)
+		{
+			if (hwlen >= sizeof(mac32)) {
+				maclen = sizeof(mac32);
+				memcpy(&mac32, hwaddr, maclen);
+				BPF_SET_STMT(bp, BPF_LD + BPF_W + BPF_IND, off);
+				bp++;
+				BPF_SET_JUMP(bp, BPF_JMP + BPF_JEQ + BPF_K,
+				    htonl(mac32), 1, 0);
+			} else if (hwlen >= sizeof(mac16)) {
+				maclen = sizeof(mac16);
+				memcpy(&mac16, hwaddr, maclen);
+				BPF_SET_STMT(bp, BPF_LD + BPF_H + BPF_IND, off);
+				bp++;
+				BPF_SET_JUMP(bp, BPF_JMP + BPF_JEQ + BPF_K,
+				    htons(mac16), 1, 0);
+			} else {
+				maclen = sizeof(*hwaddr);
+				BPF_SET_STMT(bp, BPF_LD + BPF_B + BPF_IND, off);
+				bp++;
+				BPF_SET_JUMP(bp, BPF_JMP + BPF_JEQ + BPF_K,
+				    *hwaddr, 1, 0);
+			}
+			bp++;
+			BPF_SET_STMT(bp, BPF_RET + BPF_K, 0);
+			bp++;
+		}
+	}
+
+	/* If we can see the DHCP state, match the current xid as well. */
+	if (state != NULL) {
+		BPF_SET_STMT(bp, BPF_LD + BPF_W + BPF_IND,
+		    sizeof(struct udphdr) + offsetof(struct bootp, xid));
+		bp++;
+		BPF_SET_JUMP(bp, BPF_JMP + BPF_JEQ + BPF_K, state->xid, 1, 0);
+		bp++;
+		BPF_SET_STMT(bp, BPF_RET + BPF_K, 0);
+		bp++;
+	}
+
 	/* All passed, return the packet. */
 	BPF_SET_STMT(bp, BPF_RET + BPF_K, BPF_WHOLEPACKET);
 	bp++;
 
+	if (state != NULL)
+		return bpf_setfilter(bpf->bpf_fd, buf,
+		    (unsigned int)(bp - buf));
 	return bpf_attach(bpf->bpf_fd, buf, (unsigned int)(bp - buf));
 }
 
+/* Match a new xid, see bpf_bootp_state. */
+int
+bpf_bootp_xid(const struct bpf *bpf)
+{
+
+	return bpf_bootp_rw(bpf, true);
+}
+
 int
 bpf_bootp(const struct bpf *bpf, __unused const struct in_addr *ia)
 {
 
 #ifdef BIOCSETWF
 	if (bpf_bootp_rw(bpf, true) == -1 ||
-	    bpf_bootp_rw(bpf, false) == -1 ||
+	    bpf_bootp_rw(bpf, false) == -1)
+		return -1;
+	if (bpf_bootp_state(bpf) == NULL &&
 	    ioctl(bpf->bpf_fd, BIOCLOCK) == -1)
 		return -1;
 	return 0;
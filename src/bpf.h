@@ -32,6 +32,7 @@
 #define	BPF_EOF			0x01U
 #define	BPF_PARTIALCSUM		0x02U
 #define	BPF_BCAST		0x04U
+#define	BPF_SHARED		0x08U
 
 /*
  * Even though we program the BPF filter should we trust it?
@@ -52,6 +53,8 @@
  */
 //#define	BPF_DEBUG
 
+#include <sys/uio.h>
+
 #include "dhcpcd.h"
 
 struct bpf {
@@ -62,20 +65,50 @@ struct bpf {
 	size_t bpf_size;
 	size_t bpf_len;
 	size_t bpf_pos;
+#ifdef __linux__
+	/* When bpf_block_size is set, bpf_buffer is a mmapped
+	 * TPACKET_V3 receive ring of bpf_block_nr blocks. */
+	size_t bpf_block_size;
+	unsigned int bpf_block_nr;
+	unsigned int bpf_block;
+	unsigned int bpf_block_pkts;
+	void *bpf_frame;
+	/* A socket shared by all interfaces is not bound to one,
+	 * so each frame read records the interface it arrived on.
+	 * Interfaces send via a BPF_SHARED handle on it. */
+	unsigned int bpf_ifindex;
+	unsigned int bpf_refs;
+	struct bpf *bpf_shared;
+#endif
 };
 
+#ifdef __linux__
+#define	BPF_SHARED_SOCKET
+#endif
+
 extern const char *bpf_name;
 size_t bpf_frame_header_len(const struct interface *);
 void *bpf_frame_header_src(const struct interface *, void *, size_t *);
 void *bpf_frame_header_dst(const struct interface *, void *, size_t *);
 int bpf_frame_bcast(const struct interface *, const void *);
-struct bpf * bpf_open(const struct interface *,
+struct bpf * bpf_open(struct dhcpcd_ctx *, const struct interface *,
     int (*)(const struct bpf *, const struct in_addr *),
     const struct in_addr *);
 void bpf_close(struct bpf *);
 int bpf_attach(int, void *, unsigned int);
+int bpf_setfilter(int, void *, unsigned int);
 ssize_t bpf_send(const struct bpf *, uint16_t, const void *, size_t);
+#ifdef __linux__
+ssize_t bpf_sendv(const struct bpf *, uint16_t, const struct iovec *, size_t);
+#endif
+#ifdef BPF_SHARED_SOCKET
+/* Beyond this many addresses a shared ARP socket passes up all ARP. */
+#define	BPF_ARP_ADDRS_MAX	128
+struct bpf *bpf_share(struct bpf *, const struct interface *);
+int bpf_arp_addrs(const struct bpf *, const struct in_addr *, size_t);
+#endif
 ssize_t bpf_read(struct bpf *, void *, size_t);
 int bpf_arp(const struct bpf *, const struct in_addr *);
 int bpf_bootp(const struct bpf *, const struct in_addr *);
+int bpf_bootp_xid(const struct bpf *);
 #endif
@@ -26,8 +26,10 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <errno.h>
@@ -210,3 +212,131 @@ is_root_local(void)
 	return -1;
 #endif
 }
+
+struct recvmsgs_buf {
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[RECVMSGS_MAX];
+#else
+	struct msghdr msgs[1];
+#endif
+	struct iovec iovs[RECVMSGS_MAX];
+	struct sockaddr_storage names[RECVMSGS_MAX];
+	union {
+		struct cmsghdr hdr;
+		uint8_t buf[RECVMSGS_CMSGLEN];
+	} cmsgs[RECVMSGS_MAX];
+	uint8_t data[RECVMSGS_MAX][RECVMSGS_DATALEN];
+};
+
+/*
+ * Read up to nmsgs (at most RECVMSGS_MAX) datagrams with one recvmmsg(2)
+ * call and hand each to cb with msg_iov trimmed to the length read.
+ * If cb can free what cbarg points to, nmsgs should be 1.
+ * The buffer is kept in ctx, so cb must not call us again.
+ * It's large, but only the pages datagrams are read into get touched.
+ * Returns the number of datagrams read, or -1 on error.
+ */
+ssize_t
+recvmsgs(struct dhcpcd_ctx *ctx, int fd, size_t nmsgs,
+    void (*cb)(void *, struct msghdr *), void *cbarg)
+{
+	struct recvmsgs_buf *rb = ctx->rcvbuf;
+	struct msghdr *msg;
+	size_t i, n;
+#ifdef HAVE_RECVMMSG
+	int r;
+#else
+	ssize_t r;
+#endif
+
+	if (rb == NULL) {
+		rb = ctx->rcvbuf = malloc(sizeof(*rb));
+		if (rb == NULL)
+			return -1;
+	}
+
+	n = MIN(nmsgs, __arraycount(rb->msgs));
+	for (i = 0; i < n; i++) {
+#ifdef HAVE_RECVMMSG
+		msg = &rb->msgs[i].msg_hdr;
+#else
+		msg = &rb->msgs[i];
+#endif
+		memset(msg, 0, sizeof(*msg));
+		msg->msg_name = &rb->names[i];
+		msg->msg_namelen = sizeof(rb->names[i]);
+		msg->msg_iov = &rb->iovs[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = rb->cmsgs[i].buf;
+		msg->msg_controllen = sizeof(rb->cmsgs[i].buf);
+		rb->iovs[i].iov_base = rb->data[i];
+		rb->iovs[i].iov_len = sizeof(rb->data[i]);
+	}
+
+#ifdef HAVE_RECVMMSG
+	r = recvmmsg(fd, rb->msgs, (unsigned int)n, MSG_WAITFORONE, NULL);
+	if (r == -1)
+		return -1;
+	n = (size_t)r;
+	for (i = 0; i < n; i++) {
+		rb->iovs[i].iov_len = rb->msgs[i].msg_len;
+		cb(cbarg, &rb->msgs[i].msg_hdr);
+	}
+#else
+	r = recvmsg(fd, &rb->msgs[0], 0);
+	if (r == -1)
+		return -1;
+	n = 1;
+	rb->iovs[0].iov_len = (size_t)r;
+	cb(cbarg, &rb->msgs[0]);
+#endif
+	return (ssize_t)n;
+}
+
+/*
+ * XIDs, jitter and temporary addresses want four random bytes at a time.
+ * arc4random(3) can be a system call for each, so fetch them in bulk.
+ * Bytes are cleared as they are handed out so they cannot be read later.
+ */
+uint32_t
+rndpool_u32(struct dhcpcd_ctx *ctx)
+{
+	uint32_t r;
+	uint8_t *p;
+
+	if (ctx->rndpool_len < sizeof(r)) {
+		arc4random_buf(ctx->rndpool, sizeof(ctx->rndpool));
+		ctx->rndpool_len = sizeof(ctx->rndpool);
+	}
+	ctx->rndpool_len -= sizeof(r);
+	p = ctx->rndpool + ctx->rndpool_len;
+	memcpy(&r, p, sizeof(r));
+	memset(p, 0, sizeof(r));
+	return r;
+}
+
+/* As arc4random_uniform(3), avoiding modulo bias. */
+uint32_t
+rndpool_uniform(struct dhcpcd_ctx *ctx, uint32_t upper_bound)
+{
+	uint32_t r, min;
+
+	if (upper_bound < 2)
+		return 0;
+
+	/* 2**32 % x == (2**32 - x) % x */
+	min = -upper_bound % upper_bound;
+	do
+		r = rndpool_u32(ctx);
+	while (r < min);
+	return r % upper_bound;
+}
+
+/* A forked process must not hand out what its parent may also use. */
+void
+rndpool_forked(struct dhcpcd_ctx *ctx)
+{
+
+	memset(ctx->rndpool, 0, sizeof(ctx->rndpool));
+	ctx->rndpool_len = 0;
+}
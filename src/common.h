@@ -154,4 +154,18 @@ ssize_t writefile(const char *, mode_t, const void *, size_t);
 int filemtime(const char *, time_t *);
 char *get_line(char ** __restrict, ssize_t * __restrict);
 int is_root_local(void);
+
+/* Datagrams read per wakeup by recvmsgs. */
+#define	RECVMSGS_MAX		8
+#define	RECVMSGS_DATALEN	(64 * 1024)
+#define	RECVMSGS_CMSGLEN	256
+
+struct dhcpcd_ctx;
+struct msghdr;
+ssize_t recvmsgs(struct dhcpcd_ctx *, int, size_t,
+    void (*)(void *, struct msghdr *), void *);
+
+uint32_t rndpool_u32(struct dhcpcd_ctx *);
+uint32_t rndpool_uniform(struct dhcpcd_ctx *, uint32_t);
+void rndpool_forked(struct dhcpcd_ctx *);
 #endif
@@ -33,6 +33,8 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,6 +49,14 @@
 #include "if.h"
 #include "logerr.h"
 #include "privsep.h"
+#include "shard.h"
+
+/* Limit how many iovecs control_handle_write uses at once */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define	CONTROL_IOV_MAX		IOV_MAX
+#else
+#define	CONTROL_IOV_MAX		64
+#endif
 
 #ifndef SUN_LEN
 #define SUN_LEN(su) \
@@ -54,15 +64,33 @@
 #endif
 
 static void control_handle_data(void *, unsigned short);
+static const char *control_envget(const char *, size_t, const char *,
+    size_t, const char **);
+
+static void
+control_event_free(struct fd_list *fd)
+{
+	struct fd_event *fde;
+
+	while ((fde = TAILQ_FIRST(&fd->events))) {
+		TAILQ_REMOVE(&fd->events, fde, next);
+		free(fde->data);
+		free(fde);
+	}
+}
 
 static void
 control_queue_free(struct fd_list *fd)
 {
 	struct fd_data *fdp;
 
+	control_event_free(fd);
+
 	while ((fdp = TAILQ_FIRST(&fd->queue))) {
 		TAILQ_REMOVE(&fd->queue, fdp, next);
-		if (fdp->data_size != 0)
+		if (fdp->data_buf != NULL)
+			control_buf_free(fdp->data_buf);
+		else if (fdp->data_size != 0)
 			free(fdp->data);
 		free(fdp);
 	}
@@ -74,7 +102,43 @@ control_queue_free(struct fd_list *fd)
 			free(fdp->data);
 		free(fdp);
 	}
+	fd->free_len = 0;
+#endif
+	fd->queue_len = 0;
+	fd->queue_bytes = 0;
+	fd->queue_events = 0;
+	fd->queue_event_bytes = 0;
+}
+
+/* Take d off the queue, keeping it for reuse if we can. */
+static void
+control_data_free(struct fd_list *fd, struct fd_data *d)
+{
+
+	TAILQ_REMOVE(&fd->queue, d, next);
+	fd->queue_len--;
+	fd->queue_bytes -= d->data_len;
+	if (d->data_flags & FD_EVENT) {
+		fd->queue_events--;
+		fd->queue_event_bytes -= d->data_len;
+	}
+
+	if (d->data_buf != NULL) {
+		/* Shared buffers are not ours to recycle. */
+		control_buf_free(d->data_buf);
+		free(d);
+		return;
+	}
+#ifdef CTL_FREE_LIST
+	if (fd->free_len < CONTROL_FREE_MAX) {
+		TAILQ_INSERT_TAIL(&fd->free_queue, d, next);
+		fd->free_len++;
+		return;
+	}
 #endif
+	if (d->data_size != 0)
+		free(d->data);
+	free(d);
 }
 
 void
@@ -86,10 +150,15 @@ control_free(struct fd_list *fd)
 		fd->ctx->ps_control_client = NULL;
 #endif
 
+	if (fd->queue_dropped != 0)
+		loginfox("control fd %d: dropped %u events of %u",
+		    fd->fd, fd->queue_dropped, fd->queue_total);
+
 	eloop_event_delete(fd->ctx->eloop, fd->fd);
 	close(fd->fd);
 	TAILQ_REMOVE(&fd->ctx->control_fds, fd, next);
 	control_queue_free(fd);
+	free(fd->filter);
 	free(fd);
 }
 
@@ -139,41 +208,64 @@ control_handle_read(struct fd_list *fd)
 static void
 control_handle_write(struct fd_list *fd)
 {
-	struct iovec iov[2];
+	struct iovec iov[CONTROL_IOV_MAX], *iovp;
 	int iov_len;
 	struct fd_data *data;
+	size_t sent, len;
+	ssize_t n;
 
-	data = TAILQ_FIRST(&fd->queue);
+	/* The queue was dropped by control_queue_trim. */
+	if (TAILQ_FIRST(&fd->queue) == NULL)
+		return;
 
-	if (data->data_flags & FD_SENDLEN) {
-		iov[0].iov_base = &data->data_len;
-		iov[0].iov_len = sizeof(size_t);
-		iov[1].iov_base = data->data;
-		iov[1].iov_len = data->data_len;
-		iov_len = 2;
-	} else {
-		iov[0].iov_base = data->data;
-		iov[0].iov_len = data->data_len;
-		iov_len = 1;
+	/* Drain as much of the queue as we can in one go. */
+	iov_len = 0;
+	TAILQ_FOREACH(data, &fd->queue, next) {
+		if (iov_len + 2 > CONTROL_IOV_MAX)
+			break;
+		sent = data->data_sent;
+		if (data->data_flags & FD_SENDLEN) {
+			if (sent < sizeof(size_t)) {
+				iovp = &iov[iov_len++];
+				iovp->iov_base =
+				    (char *)&data->data_len + sent;
+				iovp->iov_len = sizeof(size_t) - sent;
+				sent = 0;
+			} else
+				sent -= sizeof(size_t);
+		}
+		iovp = &iov[iov_len++];
+		iovp->iov_base = (char *)data->data + sent;
+		iovp->iov_len = data->data_len - sent;
 	}
 
-	if (writev(fd->fd, iov, iov_len) == -1) {
+	n = writev(fd->fd, iov, iov_len);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
 		logerr("%s: write", __func__);
 		control_free(fd);
 		return;
 	}
 
-	TAILQ_REMOVE(&fd->queue, data, next);
-#ifdef CTL_FREE_LIST
-	TAILQ_INSERT_TAIL(&fd->free_queue, data, next);
-#else
-	if (data->data_size != 0)
-		free(data->data);
-	free(data);
-#endif
+	/* Release what has been written, remembering where we got to
+	 * in the last entry if the socket buffer filled. */
+	sent = (size_t)n;
+	while ((data = TAILQ_FIRST(&fd->queue)) != NULL) {
+		len = data->data_len - data->data_sent;
+		if (data->data_flags & FD_SENDLEN)
+			len += sizeof(size_t);
+		if (sent < len) {
+			data->data_sent += sent;
+			break;
+		}
+		sent -= len;
+		control_data_free(fd, data);
+	}
 
 	if (TAILQ_FIRST(&fd->queue) != NULL)
 		return;
+	fd->flags &= ~FD_BEHIND;
 
 #ifdef PRIVSEP
 	if (IN_PRIVSEP_SE(fd->ctx) && !(fd->flags & FD_LISTEN)) {
@@ -271,8 +363,14 @@ control_new(struct dhcpcd_ctx *ctx, int fd, unsigned int flags)
 	l->fd = fd;
 	l->flags = flags;
 	TAILQ_INIT(&l->queue);
+	l->queue_len = l->queue_total = l->queue_dropped = 0;
+	l->queue_events = 0;
+	l->queue_bytes = l->queue_event_bytes = 0;
+	TAILQ_INIT(&l->events);
+	l->filter = NULL;
 #ifdef CTL_FREE_LIST
 	TAILQ_INIT(&l->free_queue);
+	l->free_len = 0;
 #endif
 	TAILQ_INSERT_TAIL(&ctx->control_fds, l, next);
 	return l;
@@ -428,6 +526,17 @@ int
 control_start(struct dhcpcd_ctx *ctx, const char *ifname, sa_family_t family)
 {
 	int fd;
+#ifdef SHARDS
+	char shardname[IF_NAMESIZE];
+
+	/* The coordinator has the manager socket, see shard_handleargs. */
+	if (ifname == NULL && SHARD_WORKER(ctx)) {
+		snprintf(shardname, sizeof(shardname), SHARD_IFNAME,
+		    ctx->shard);
+		ifname = shardname;
+		family = AF_UNSPEC;
+	}
+#endif
 
 #ifdef PRIVSEP
 	if (IN_PRIVSEP_SE(ctx)) {
@@ -535,6 +644,14 @@ control_open(const char *ifname, sa_family_t family, bool unpriv)
 
 ssize_t
 control_send(struct dhcpcd_ctx *ctx, int argc, char * const *argv)
+{
+
+	return control_write(ctx->control_fd, argc, argv);
+}
+
+/* Write argv to fd as NUL separated arguments. */
+ssize_t
+control_write(int fd, int argc, char * const *argv)
 {
 	char buffer[1024];
 	int i;
@@ -554,14 +671,194 @@ control_send(struct dhcpcd_ctx *ctx, int argc, char * const *argv)
 		memcpy(buffer + len, argv[i], l);
 		len += l;
 	}
-	return write(ctx->control_fd, buffer, len);
+	return write(fd, buffer, len);
+}
+
+static bool
+control_queue_over(struct fd_list *fd)
+{
+	struct dhcpcd_ctx *ctx = fd->ctx;
+
+	if (ctx->control_queue_max != 0 &&
+	    fd->queue_events > ctx->control_queue_max)
+		return true;
+	if (ctx->control_queue_bytes != 0 &&
+	    fd->queue_event_bytes > ctx->control_queue_bytes)
+		return true;
+	return false;
+}
+
+/* Is d an event for the same interface and protocol as newest? */
+static bool
+control_queue_same(const struct fd_data *d, const struct fd_data *newest)
+{
+	const char *ifname, *protocol, *dv, *hint = NULL, *dhint = NULL;
+
+	ifname = control_envget(newest->data, newest->data_len,
+	    "interface", strlen("interface"), &hint);
+	protocol = control_envget(newest->data, newest->data_len,
+	    "protocol", strlen("protocol"), &hint);
+	if (ifname == NULL || protocol == NULL)
+		return false;
+	dv = control_envget(d->data, d->data_len,
+	    "interface", strlen("interface"), &dhint);
+	if (dv == NULL || strcmp(dv, ifname) != 0)
+		return false;
+	dv = control_envget(d->data, d->data_len,
+	    "protocol", strlen("protocol"), &dhint);
+	return dv != NULL && strcmp(dv, protocol) == 0;
+}
+
+/*
+ * A listener has more events queued than we allow, so apply
+ * control_queue_policy to make room for newest.
+ * Only events are dropped, never replies to commands the listener
+ * sent, and never entries which have started to be written.
+ * Returns -1 if the listener was disconnected.
+ */
+static int
+control_queue_trim(struct fd_list *fd, struct fd_data *newest)
+{
+	struct fd_data *d, *dn;
+	int policy = fd->ctx->control_queue_policy;
+
+	if (!(fd->flags & FD_BEHIND)) {
+		logwarnx("control fd %d: listener is not keeping up", fd->fd);
+		fd->flags |= FD_BEHIND;
+	}
+
+	if (policy == CONTROL_QUEUE_DISCONNECT) {
+		logwarnx("control fd %d: disconnecting listener", fd->fd);
+		fd->queue_dropped += fd->queue_len;
+		control_queue_free(fd);
+		/* Our read handler frees fd when it sees the shutdown. */
+		fd->flags &= ~(FD_LISTEN | FD_DELTA);
+		shutdown(fd->fd, SHUT_RDWR);
+		if (eloop_event_add(fd->ctx->eloop, fd->fd, ELE_READ,
+		    control_handle_data, fd) == -1)
+			logerr("%s: eloop_event_add", __func__);
+		return -1;
+	}
+
+	if (policy == CONTROL_QUEUE_COLLAPSE) {
+		TAILQ_FOREACH_SAFE(d, &fd->queue, next, dn) {
+			if (d == newest)
+				break;
+			if (d->data_flags & FD_EVENT && d->data_sent == 0 &&
+			    control_queue_same(d, newest))
+			{
+				control_data_free(fd, d);
+				fd->queue_dropped++;
+			}
+		}
+	}
+
+	while (control_queue_over(fd)) {
+		TAILQ_FOREACH(d, &fd->queue, next) {
+			if (d->data_flags & FD_EVENT && d->data_sent == 0)
+				break;
+		}
+		if (d == NULL || d == newest)
+			break;
+		control_data_free(fd, d);
+		fd->queue_dropped++;
+	}
+	return 0;
+}
+
+#ifndef SMALL
+static const char * const control_queue_policies[] = {
+	"drop", "collapse", "disconnect",
+};
+
+/*
+ * Write the queue counters of each listener to buf as NUL separated
+ * key=value pairs, like eloop_stats_format.
+ * Returns the length required, which is more than len when the
+ * counters did not fit.
+ */
+ssize_t
+control_stats_format(const struct dhcpcd_ctx *ctx, char *buf, size_t len)
+{
+	const struct fd_list *fd;
+	size_t idx, pos = 0;
+	int n;
+
+#define	STATPF(...)							      \
+	do {								      \
+		n = snprintf(pos < len ? buf + pos : NULL,		      \
+		    pos < len ? len - pos : 0, __VA_ARGS__);		      \
+		if (n == -1)						      \
+			return -1;					      \
+		pos += (size_t)n + 1;					      \
+	} while (0 /* CONSTCOND */)
+
+	STATPF("control_queue_max=%u", ctx->control_queue_max);
+	STATPF("control_queue_bytes=%zu", ctx->control_queue_bytes);
+	STATPF("control_queue_policy=%s",
+	    control_queue_policies[ctx->control_queue_policy]);
+	idx = 0;
+	TAILQ_FOREACH(fd, &ctx->control_fds, next) {
+		if (!(fd->flags & FD_LISTEN))
+			continue;
+		STATPF("control_listener%zu_fd=%d", idx, fd->fd);
+		STATPF("control_listener%zu_queued=%u", idx, fd->queue_len);
+		STATPF("control_listener%zu_queued_bytes=%zu", idx,
+		    fd->queue_bytes);
+		STATPF("control_listener%zu_total=%u", idx, fd->queue_total);
+		STATPF("control_listener%zu_dropped=%u", idx,
+		    fd->queue_dropped);
+		idx++;
+	}
+	STATPF("control_listeners=%zu", idx);
+#undef STATPF
+
+	return (ssize_t)pos;
+}
+#endif
+
+static int
+control_queue_data(struct fd_list *fd, struct fd_data *d, bool event)
+{
+	unsigned short events;
+
+	d->data_flags = fd->flags & FD_SENDLEN;
+	TAILQ_INSERT_TAIL(&fd->queue, d, next);
+	fd->queue_len++;
+	fd->queue_bytes += d->data_len;
+	MEMSAMPLE(fd->ctx, MEM_CONTROL);
+	if (event && fd->flags & FD_LISTEN) {
+		d->data_flags |= FD_EVENT;
+		fd->queue_events++;
+		fd->queue_event_bytes += d->data_len;
+		fd->queue_total++;
+		if (control_queue_over(fd) &&
+		    control_queue_trim(fd, d) == -1)
+			return 0;
+	}
+	events = ELE_WRITE;
+	if (fd->flags & FD_LISTEN)
+		events |= ELE_READ;
+	return eloop_event_add(fd->ctx->eloop, fd->fd, events,
+	    control_handle_data, fd);
+}
+
+/* A --dumpleases reply, led by CONTROL_DUMP_BULK so the client
+ * can tell it from the dump an older dhcpcd sends for -U. */
+int
+control_queue_bulk(struct fd_list *fd, void *data, size_t data_len)
+{
+	const size_t bulk = CONTROL_DUMP_BULK;
+
+	if (write(fd->fd, &bulk, sizeof(bulk)) != sizeof(bulk))
+		return -1;
+	return control_queue(fd, data, data_len);
 }
 
 int
 control_queue(struct fd_list *fd, void *data, size_t data_len)
 {
 	struct fd_data *d;
-	unsigned short events;
 
 	if (data_len == 0) {
 		errno = EINVAL;
@@ -579,9 +876,10 @@ control_queue(struct fd_list *fd, void *data, size_t data_len)
 				break;
 		}
 	}
-	if (d != NULL)
+	if (d != NULL) {
 		TAILQ_REMOVE(&fd->free_queue, d, next);
-	else
+		fd->free_len--;
+	} else
 #endif
 	{
 		d = calloc(1, sizeof(*d));
@@ -603,12 +901,371 @@ control_queue(struct fd_list *fd, void *data, size_t data_len)
 	}
 	memcpy(d->data, data, data_len);
 	d->data_len = data_len;
-	d->data_flags = fd->flags & FD_SENDLEN;
+	d->data_sent = 0;
+	return control_queue_data(fd, d, false);
+}
 
-	TAILQ_INSERT_TAIL(&fd->queue, d, next);
-	events = ELE_WRITE;
-	if (fd->flags & FD_LISTEN)
-		events |= ELE_READ;
-	return eloop_event_add(fd->ctx->eloop, fd->fd, events,
-	    control_handle_data, fd);
+/* data may be NULL for the caller to fill in after. */
+struct fd_buf *
+control_buf_new(const void *data, size_t len)
+{
+	struct fd_buf *b;
+
+	b = malloc(sizeof(*b) + len);
+	if (b == NULL)
+		return NULL;
+	b->refs = 1;
+	b->len = len;
+	b->data = (char *)(b + 1);
+	if (data != NULL)
+		memcpy(b->data, data, len);
+	return b;
+}
+
+void
+control_buf_free(struct fd_buf *b)
+{
+
+	if (--b->refs == 0)
+		free(b);
+}
+
+/* Queue a reference to b rather than a copy of it. */
+int
+control_queue_buf(struct fd_list *fd, struct fd_buf *b)
+{
+	struct fd_data *d;
+
+	if (b->len == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL)
+		return -1;
+	d->data = b->data;
+	d->data_len = b->len;
+	d->data_buf = b;
+	b->refs++;
+	return control_queue_data(fd, d, true);
+}
+
+/* Return the value of var in the NUL separated env, or NULL.
+ * The search starts at *hint and wraps around. As events are always
+ * built in the same order the next variable is normally found first. */
+static const char *
+control_envget(const char *env, size_t env_len, const char *var,
+    size_t var_len, const char **hint)
+{
+	const char *start, *p, *end = env + env_len;
+	size_t l;
+
+	if (env_len == 0)
+		return NULL;
+	start = p = *hint != NULL && *hint < end ? *hint : env;
+	do {
+		l = strnlen(p, (size_t)(end - p));
+		if (l > var_len && p[var_len] == '=' &&
+		    memcmp(p, var, var_len) == 0)
+		{
+			*hint = p + l + 1;
+			return p + var_len + 1;
+		}
+		p += l + 1;
+		if (p >= end)
+			p = env;
+	} while (p != start);
+	return NULL;
+}
+
+static bool
+control_envalways(const char *var, size_t var_len)
+{
+
+#define	ENVIS(a) (var_len == sizeof(a) - 1 && memcmp(var, a, var_len) == 0)
+	return ENVIS("interface") || ENVIS("protocol") || ENVIS("reason");
+#undef ENVIS
+}
+
+/*
+ * Write the variables in env which differ from the last event into buf,
+ * followed by the names of any variables it no longer has.
+ * interface, protocol and reason are always sent so the listener
+ * knows which state to apply the delta to.
+ */
+static size_t
+control_delta(char *buf, const struct fd_event *fde,
+    const char *env, size_t env_len)
+{
+	const char *p, *end, *eq, *val, *hint;
+	char *bp = buf;
+	size_t l, var_len;
+	int n;
+
+	n = snprintf(bp, 32, "delta=%u", fde->deltas);
+	bp += n + 1;
+
+	hint = NULL;
+	end = env + env_len;
+	for (p = env; p < end; p += l + 1) {
+		l = strnlen(p, (size_t)(end - p));
+		if ((eq = memchr(p, '=', l)) == NULL)
+			continue;
+		var_len = (size_t)(eq - p);
+		if (!control_envalways(p, var_len)) {
+			val = control_envget(fde->data, fde->data_len,
+			    p, var_len, &hint);
+			if (val != NULL && strcmp(val, eq + 1) == 0)
+				continue;
+		}
+		memcpy(bp, p, l + 1);
+		bp += l + 1;
+	}
+
+	hint = NULL;
+	end = fde->data + fde->data_len;
+	for (p = fde->data; p < end; p += l + 1) {
+		l = strnlen(p, (size_t)(end - p));
+		if ((eq = memchr(p, '=', l)) == NULL)
+			continue;
+		var_len = (size_t)(eq - p);
+		if (control_envget(env, env_len, p, var_len, &hint) != NULL)
+			continue;
+		memcpy(bp, p, var_len);
+		bp += var_len;
+		*bp++ = '\0';
+	}
+
+	return (size_t)(bp - buf);
+}
+
+static const char * const control_protocols[] = {
+	"link", "dhcp", "ipv4ll", "ra", "dhcp6", "static6",
+};
+
+static unsigned int
+control_protocol(const char *protocol)
+{
+	size_t i;
+
+	for (i = 0; i < __arraycount(control_protocols); i++) {
+		if (strcmp(control_protocols[i], protocol) == 0)
+			return 1U << i;
+	}
+	return 0;
+}
+
+/*
+ * Make fd a listener.
+ * argv is what followed --listen:
+ *   --delta              send only what changed, see control_queue_event
+ *   -4 | -6              only events for that address family
+ *   --protocol p[,p...]  only events for these protocols
+ *   pattern ...          only interfaces matching a pattern
+ */
+int
+control_listen(struct fd_list *fd, int argc, char * const *argv)
+{
+	struct fd_filter *filter;
+	unsigned int flags = FD_LISTEN, protocols = 0, afs = 0, p;
+	size_t ifnames_len = 0, l;
+	char *protos, *proto, *np;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (*argv[i] == '\0')
+			continue;
+		if (strcmp(argv[i], "--delta") == 0)
+			flags |= FD_DELTA;
+		else if (strcmp(argv[i], "-4") == 0)
+			afs |= CONTROL_PROTO_INET;
+		else if (strcmp(argv[i], "-6") == 0)
+			afs |= CONTROL_PROTO_INET6;
+		else if (strcmp(argv[i], "--protocol") == 0) {
+			if (++i == argc)
+				goto einval;
+			protos = strdup(argv[i]);
+			if (protos == NULL)
+				return -1;
+			np = protos;
+			while ((proto = strsep(&np, ",")) != NULL) {
+				if ((p = control_protocol(proto)) == 0) {
+					free(protos);
+					goto einval;
+				}
+				protocols |= p;
+			}
+			free(protos);
+		} else if (*argv[i] == '-')
+			goto einval;
+		else
+			ifnames_len += strlen(argv[i]) + 1;
+	}
+
+	free(fd->filter);
+	fd->filter = NULL;
+	if (protocols != 0 || afs != 0 || ifnames_len != 0) {
+		filter = malloc(sizeof(*filter) + ifnames_len);
+		if (filter == NULL)
+			return -1;
+		if (protocols == 0)
+			protocols = ~0U;
+		if (afs != 0)
+			protocols &= afs;
+		filter->protocols = protocols;
+		filter->ifnames_len = 0;
+		for (i = 0; i < argc; i++) {
+			if (*argv[i] == '-') {
+				if (strcmp(argv[i], "--protocol") == 0)
+					i++;
+				continue;
+			}
+			if (*argv[i] == '\0')
+				continue;
+			l = strlen(argv[i]) + 1;
+			memcpy(filter->ifnames + filter->ifnames_len,
+			    argv[i], l);
+			filter->ifnames_len += l;
+		}
+		fd->filter = filter;
+	}
+
+	fd->flags |= flags;
+	return 0;
+
+einval:
+	errno = EINVAL;
+	return -1;
+}
+
+/* Does ifname match one of the patterns the listener gave? */
+bool
+control_wants_interface(const struct fd_list *fd, const char *ifname)
+{
+	const struct fd_filter *filter = fd->filter;
+	const char *p, *end;
+
+	if (filter == NULL || filter->ifnames_len == 0)
+		return true;
+	end = filter->ifnames + filter->ifnames_len;
+	for (p = filter->ifnames; p < end; p += strlen(p) + 1) {
+		if (fnmatch(p, ifname, 0) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Is fd a listener which wants the event in env?
+ * This is checked before the event is copied for it. */
+bool
+control_wants_event(const struct fd_list *fd, const char *env, size_t len)
+{
+	const char *ifname, *protocol, *hint = NULL;
+
+	if (!(fd->flags & FD_LISTEN))
+		return false;
+	if (fd->filter == NULL)
+		return true;
+
+	ifname = control_envget(env, len, "interface", strlen("interface"),
+	    &hint);
+	protocol = control_envget(env, len, "protocol", strlen("protocol"),
+	    &hint);
+	if (protocol != NULL &&
+	    !(fd->filter->protocols & control_protocol(protocol)))
+		return false;
+	return ifname == NULL || control_wants_interface(fd, ifname);
+}
+
+/*
+ * Queue an event for a listener.
+ * FD_DELTA listeners are sent a full event first and every
+ * CONTROL_DELTA_SNAPSHOT events after, otherwise only what changed
+ * since the last event for the same interface and protocol.
+ */
+int
+control_queue_event(struct fd_list *fd, struct fd_buf *b)
+{
+	const char *ifname, *protocol, *reason, *hint = NULL;
+	struct fd_event *fde;
+	struct fd_buf *db;
+	char *buf;
+	unsigned int dropped;
+	int err;
+
+	if (!(fd->flags & FD_DELTA))
+		return control_queue_buf(fd, b);
+
+	ifname = control_envget(b->data, b->len,
+	    "interface", strlen("interface"), &hint);
+	protocol = control_envget(b->data, b->len,
+	    "protocol", strlen("protocol"), &hint);
+	reason = control_envget(b->data, b->len,
+	    "reason", strlen("reason"), &hint);
+	if (ifname == NULL || protocol == NULL)
+		return control_queue_buf(fd, b);
+
+	TAILQ_FOREACH(fde, &fd->events, next) {
+		if (strcmp(fde->ifname, ifname) == 0 &&
+		    strcmp(fde->protocol, protocol) == 0)
+			break;
+	}
+
+	/* No point in keeping state for an interface which has gone. */
+	if (reason != NULL && strcmp(reason, "DEPARTED") == 0) {
+		if (fde != NULL) {
+			TAILQ_REMOVE(&fd->events, fde, next);
+			free(fde->data);
+			free(fde);
+		}
+		return control_queue_buf(fd, b);
+	}
+
+	if (fde == NULL) {
+		fde = calloc(1, sizeof(*fde));
+		if (fde == NULL)
+			return -1;
+		strlcpy(fde->ifname, ifname, sizeof(fde->ifname));
+		strlcpy(fde->protocol, protocol, sizeof(fde->protocol));
+		TAILQ_INSERT_TAIL(&fd->events, fde, next);
+	} else if (++fde->deltas < CONTROL_DELTA_SNAPSHOT) {
+		/* Every variable, the removed names and our marker. */
+		db = control_buf_new(NULL, b->len + fde->data_len + 32);
+		if (db == NULL)
+			return -1;
+		db->len = control_delta(db->data, fde, b->data, b->len);
+		dropped = fd->queue_dropped;
+		err = control_queue_buf(fd, db);
+		control_buf_free(db);
+		goto save;
+	} else
+		fde->deltas = 0;
+
+	dropped = fd->queue_dropped;
+	err = control_queue_buf(fd, b);
+
+save:
+	if (err == -1)
+		return -1;
+	/* The listener has missed events, so start again with full ones. */
+	if (fd->queue_dropped != dropped) {
+		control_event_free(fd);
+		return err;
+	}
+	if (fde->data_size < b->len) {
+		buf = realloc(fde->data, b->len);
+		if (buf == NULL) {
+			/* Without the state the next event must be full. */
+			TAILQ_REMOVE(&fd->events, fde, next);
+			free(fde->data);
+			free(fde);
+			return err;
+		}
+		fde->data = buf;
+		fde->data_size = b->len;
+	}
+	memcpy(fde->data, b->data, b->len);
+	fde->data_len = b->len;
+	return err;
 }
@@ -39,8 +39,31 @@
 #undef	CTL_FREE_LIST
 #endif
 
-/* Limit queue size per fd */
+/* Default limits on what a listener can have queued, see control_queue */
 #define CONTROL_QUEUE_MAX	100
+#define CONTROL_QUEUE_BYTES	(1024 * 1024)
+
+/* What to do when a listener reaches a limit */
+#define	CONTROL_QUEUE_DROP	0	/* drop the oldest events */
+#define	CONTROL_QUEUE_COLLAPSE	1	/* keep the latest per interface */
+#define	CONTROL_QUEUE_DISCONNECT 2	/* drop the listener */
+
+/* Limit how many written entries are kept for reuse */
+#define	CONTROL_FREE_MAX	10
+
+/* Send a full event to delta listeners after this many deltas */
+#define CONTROL_DELTA_SNAPSHOT	16
+
+/* Leads the reply to --dumpleases, where the older dump leads with
+ * a count of replies, see dhcpcd_dumpleases. */
+#define	CONTROL_DUMP_BULK	SIZE_MAX
+
+/* An event queued to many listeners is only copied once */
+struct fd_buf {
+	unsigned int refs;
+	size_t len;
+	char *data;
+};
 
 struct fd_data {
 	TAILQ_ENTRY(fd_data) next;
@@ -48,17 +71,58 @@ struct fd_data {
 	size_t data_size;
 	size_t data_len;
 	unsigned int data_flags;
+	size_t data_sent;
+	struct fd_buf *data_buf;
 };
 TAILQ_HEAD(fd_data_head, fd_data);
 
+/* Last event sent to a delta listener for an interface and protocol */
+struct fd_event {
+	TAILQ_ENTRY(fd_event) next;
+	char ifname[IF_NAMESIZE];
+	char protocol[16];
+	char *data;
+	size_t data_size;
+	size_t data_len;
+	unsigned int deltas;
+};
+TAILQ_HEAD(fd_event_head, fd_event);
+
+/* Which events a listener asked for, see control_listen */
+struct fd_filter {
+	unsigned int protocols;		/* bit per CONTROL_PROTO_ */
+	size_t ifnames_len;		/* NUL separated fnmatch patterns */
+	char ifnames[];
+};
+
+#define	CONTROL_PROTO_LINK	0x01U
+#define	CONTROL_PROTO_DHCP	0x02U
+#define	CONTROL_PROTO_IPV4LL	0x04U
+#define	CONTROL_PROTO_RA	0x08U
+#define	CONTROL_PROTO_DHCP6	0x10U
+#define	CONTROL_PROTO_STATIC6	0x20U
+#define	CONTROL_PROTO_INET	\
+	(CONTROL_PROTO_LINK | CONTROL_PROTO_DHCP | CONTROL_PROTO_IPV4LL)
+#define	CONTROL_PROTO_INET6	(CONTROL_PROTO_LINK | CONTROL_PROTO_RA | \
+	CONTROL_PROTO_DHCP6 | CONTROL_PROTO_STATIC6)
+
 struct fd_list {
 	TAILQ_ENTRY(fd_list) next;
 	struct dhcpcd_ctx *ctx;
 	int fd;
 	unsigned int flags;
 	struct fd_data_head queue;
+	unsigned int queue_len;
+	size_t queue_bytes;
+	unsigned int queue_events;	/* what control_queue_max limits */
+	size_t queue_event_bytes;
+	unsigned int queue_total;	/* events queued to a listener */
+	unsigned int queue_dropped;	/* events dropped by our policy */
+	struct fd_event_head events;
+	struct fd_filter *filter;	/* NULL for every event */
 #ifdef CTL_FREE_LIST
 	struct fd_data_head free_queue;
+	unsigned int free_len;
 #endif
 };
 TAILQ_HEAD(fd_list_head, fd_list);
@@ -66,14 +130,29 @@ TAILQ_HEAD(fd_list_head, fd_list);
 #define	FD_LISTEN	0x01U
 #define	FD_UNPRIV	0x02U
 #define	FD_SENDLEN	0x04U
+#define	FD_DELTA	0x08U
+#define	FD_BEHIND	0x10U
+#define	FD_EVENT	0x20U	/* fd_data only, replies are never dropped */
 
 int control_start(struct dhcpcd_ctx *, const char *, sa_family_t);
 int control_stop(struct dhcpcd_ctx *);
 int control_open(const char *, sa_family_t, bool);
 ssize_t control_send(struct dhcpcd_ctx *, int, char * const *);
+ssize_t control_write(int, int, char * const *);
 struct fd_list *control_new(struct dhcpcd_ctx *, int, unsigned int);
 void control_free(struct fd_list *);
 void control_delete(struct fd_list *);
 int control_queue(struct fd_list *, void *, size_t);
+int control_queue_bulk(struct fd_list *, void *, size_t);
+struct fd_buf *control_buf_new(const void *, size_t);
+void control_buf_free(struct fd_buf *);
+int control_queue_buf(struct fd_list *, struct fd_buf *);
+int control_queue_event(struct fd_list *, struct fd_buf *);
 void control_recvdata(struct fd_list *fd, char *, size_t);
+int control_listen(struct fd_list *, int, char * const *);
+bool control_wants_event(const struct fd_list *, const char *, size_t);
+bool control_wants_interface(const struct fd_list *, const char *);
+#ifndef SMALL
+ssize_t control_stats_format(const struct dhcpcd_ctx *, char *, size_t);
+#endif
 #endif
@@ -56,12 +56,21 @@
 #ifndef LEASEFILE6
 # define LEASEFILE6		LEASEFILE "6"
 #endif
+#ifndef LEASEDB
+# define LEASEDB		DBDIR "/leases.db"
+#endif
 #ifndef PIDFILE
 # define PIDFILE		RUNDIR "/%s%s%spid"
 #endif
 #ifndef CONTROLSOCKET
 # define CONTROLSOCKET		RUNDIR "/%s%s%s%ssock"
 #endif
+#ifndef HANDOFFFILE
+# define HANDOFFFILE		RUNDIR "/%s.handoff"
+#endif
+#ifndef HOOKSFILE
+# define HOOKSFILE		RUNDIR "/hooks.handoff"
+#endif
 #ifndef RDM_MONOFILE
 # define RDM_MONOFILE		DBDIR "/rdm_monotonic"
 #endif
@@ -35,6 +35,8 @@
 #endif
 
 #include <libudev.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../common.h"
@@ -42,12 +44,28 @@
 #include "../if.h"
 #include "../logerr.h"
 
+/* Most devices a monitor wakeup handles before returning to the eloop. */
+#define	UDEV_BATCH	64
+
 static const char udev_name[] = "udev";
 static struct udev *udev;
 static struct udev_monitor *monitor;
 
 static struct dev_dhcpcd dhcpcd;
 
+/*
+ * The net devices udev knows, sorted by name.
+ * They are enumerated once when we start and then kept up to date
+ * by the monitor, so asking if an interface is initialised does not
+ * have udev read its database for each one.
+ */
+struct udev_netdev {
+	char un_name[IF_NAMESIZE];
+	bool un_initialised;
+};
+static struct udev_netdev *netdevs;
+static size_t netdevs_len, netdevs_size;
+
 static int
 udev_listening(void)
 {
@@ -56,22 +74,154 @@ udev_listening(void)
 }
 
 static int
-udev_initialised(const char *ifname)
+udev_netdevcmp(const void *key, const void *elem)
+{
+	const struct udev_netdev *un = elem;
+
+	return strcmp(key, un->un_name);
+}
+
+static struct udev_netdev *
+udev_netdev_find(const char *ifname)
+{
+
+	if (netdevs_len == 0)
+		return NULL;
+	return bsearch(ifname, netdevs, netdevs_len, sizeof(*netdevs),
+	    udev_netdevcmp);
+}
+
+static void
+udev_netdev_set(const char *ifname, bool initialised)
+{
+	struct udev_netdev *un;
+	size_t i;
+
+	if (ifname == NULL || strlen(ifname) >= sizeof(un->un_name))
+		return;
+	un = udev_netdev_find(ifname);
+	if (un != NULL) {
+		un->un_initialised = initialised;
+		return;
+	}
+
+	if (netdevs_len == netdevs_size) {
+		size_t n = netdevs_size == 0 ? 16 : netdevs_size * 2;
+
+		un = reallocarray(netdevs, n, sizeof(*netdevs));
+		if (un == NULL) {
+			logerr(__func__);
+			return;
+		}
+		netdevs = un;
+		netdevs_size = n;
+	}
+	for (i = 0; i < netdevs_len; i++) {
+		if (strcmp(ifname, netdevs[i].un_name) < 0)
+			break;
+	}
+	memmove(&netdevs[i + 1], &netdevs[i],
+	    (netdevs_len - i) * sizeof(*netdevs));
+	strlcpy(netdevs[i].un_name, ifname, sizeof(netdevs[i].un_name));
+	netdevs[i].un_initialised = initialised;
+	netdevs_len++;
+}
+
+static void
+udev_netdev_delete(const char *ifname)
+{
+	struct udev_netdev *un;
+	size_t i;
+
+	if (ifname == NULL || (un = udev_netdev_find(ifname)) == NULL)
+		return;
+	i = (size_t)(un - netdevs);
+	memmove(&netdevs[i], &netdevs[i + 1],
+	    (netdevs_len - i - 1) * sizeof(*netdevs));
+	netdevs_len--;
+}
+
+static bool
+udev_device_initialised(struct udev_device *device)
 {
-	struct udev_device *device;
-	int r;
 
-	device = udev_device_new_from_subsystem_sysname(udev, "net", ifname);
-	if (device) {
 #ifndef LIBUDEV_NOINIT
-		r = udev_device_get_is_initialized(device);
+	return udev_device_get_is_initialized(device) != 0;
 #else
-		r = 1;
+	UNUSED(device);
+	return true;
 #endif
+}
+
+static void
+udev_enumerate_netdevs(void)
+{
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *entry;
+	struct udev_device *device;
+
+	enumerate = udev_enumerate_new(udev);
+	if (enumerate == NULL) {
+		logerr("udev_enumerate_new");
+		return;
+	}
+	if (udev_enumerate_add_match_subsystem(enumerate, "net") != 0 ||
+	    udev_enumerate_scan_devices(enumerate) != 0)
+	{
+		logerr("udev_enumerate_scan_devices");
+		goto out;
+	}
+
+	udev_list_entry_foreach(entry,
+	    udev_enumerate_get_list_entry(enumerate))
+	{
+		device = udev_device_new_from_syspath(udev,
+		    udev_list_entry_get_name(entry));
+		if (device == NULL)
+			continue;
+		udev_netdev_set(udev_device_get_sysname(device),
+		    udev_device_initialised(device));
 		udev_device_unref(device);
-	} else
-		r = 0;
-	return r;
+	}
+	logdebugx("udev: %zu net devices", netdevs_len);
+
+out:
+	udev_enumerate_unref(enumerate);
+}
+
+static int
+udev_initialised(const char *ifname)
+{
+	struct udev_netdev *un;
+	struct udev_device *device;
+	bool initialised;
+
+	un = udev_netdev_find(ifname);
+	if (un != NULL && un->un_initialised)
+		return 1;
+
+	/* udev may still be working on it, or the monitor lost the
+	 * event saying it's done, so ask. */
+	device = udev_device_new_from_subsystem_sysname(udev, "net", ifname);
+	if (device == NULL)
+		return 0;
+	initialised = udev_device_initialised(device);
+	udev_device_unref(device);
+	udev_netdev_set(ifname, initialised);
+	return initialised ? 1 : 0;
+}
+
+/* A rename has the path it had before. */
+static void
+udev_handle_move(struct udev_device *device)
+{
+	const char *devpath, *oldname;
+
+	devpath = udev_device_get_property_value(device, "DEVPATH_OLD");
+	if (devpath == NULL)
+		return;
+	oldname = strrchr(devpath, '/');
+	udev_netdev_delete(oldname == NULL ? devpath : oldname + 1);
 }
 
 static int
@@ -79,34 +229,55 @@ udev_handle_device(void *ctx)
 {
 	struct udev_device *device;
 	const char *subsystem, *ifname, *action;
+	int n;
 
-	device = udev_monitor_receive_device(monitor);
-	if (device == NULL) {
-		logerrx("libudev: received NULL device");
-		return -1;
-	}
+	/* The monitor socket does not block, so take what is waiting. */
+	for (n = 0; n < UDEV_BATCH; n++) {
+		device = udev_monitor_receive_device(monitor);
+		if (device == NULL)
+			break;
 
-	subsystem = udev_device_get_subsystem(device);
-	ifname = udev_device_get_sysname(device);
-	action = udev_device_get_action(device);
+		subsystem = udev_device_get_subsystem(device);
+		ifname = udev_device_get_sysname(device);
+		action = udev_device_get_action(device);
 
-	/* udev filter documentation says "usually" so double check */
-	if (strcmp(subsystem, "net") == 0) {
-		logdebugx("%s: libudev: %s", ifname, action);
-		if (strcmp(action, "add") == 0 || strcmp(action, "move") == 0)
-			dhcpcd.handle_interface(ctx, 1, ifname);
-		else if (strcmp(action, "remove") == 0)
-			dhcpcd.handle_interface(ctx, -1, ifname);
+		/* udev filter documentation says "usually" so double check */
+		if (subsystem != NULL && ifname != NULL && action != NULL &&
+		    strcmp(subsystem, "net") == 0)
+		{
+			logdebugx("%s: libudev: %s", ifname, action);
+			if (strcmp(action, "add") == 0 ||
+			    strcmp(action, "move") == 0)
+			{
+				if (action[0] == 'm')
+					udev_handle_move(device);
+				/* Only sent once udev has finished. */
+				udev_netdev_set(ifname, true);
+				dhcpcd.handle_interface(ctx, 1, ifname);
+			} else if (strcmp(action, "remove") == 0) {
+				udev_netdev_delete(ifname);
+				dhcpcd.handle_interface(ctx, -1, ifname);
+			}
+		}
+
+		udev_device_unref(device);
 	}
 
-	udev_device_unref(device);
-	return 1;
+	if (n == 0) {
+		logerrx("libudev: received NULL device");
+		return -1;
+	}
+	return n;
 }
 
 static void
 udev_stop(void)
 {
 
+	free(netdevs);
+	netdevs = NULL;
+	netdevs_len = netdevs_size = 0;
+
 	if (monitor) {
 		udev_monitor_unref(monitor);
 		monitor = NULL;
@@ -162,6 +333,10 @@ udev_start(void)
 		logerr("udev_monitor_get_fd");
 		goto bad;
 	}
+
+	/* The monitor is already receiving, so any device which changes
+	 * while we look is reported as well. */
+	udev_enumerate_netdevs();
 	return fd;
 
 bad:
@@ -41,8 +41,11 @@
 #include "common.h"
 #include "dhcp-common.h"
 #include "dhcp.h"
+#include "dhcp6.h"
+#include "eloop.h"
 #include "if.h"
 #include "ipv6.h"
+#include "leasedb.h"
 #include "logerr.h"
 #include "script.h"
 
@@ -157,6 +160,90 @@ vivso_find(uint32_t iana_en, const void *arg)
 	return NULL;
 }
 
+/* Map option codes 0-255 directly to their definitions.
+ * The first definition of a code wins, as in a linear scan. */
+struct dhcp_opt **
+dhcp_optmap(struct dhcp_opt *opts, size_t opts_len)
+{
+	struct dhcp_opt **map, *opt;
+	size_t i;
+
+	map = calloc(UINT8_MAX + 1, sizeof(*map));
+	if (map == NULL)
+		return NULL;
+	for (i = 0, opt = opts; i < opts_len; i++, opt++) {
+		if (opt->option <= UINT8_MAX && map[opt->option] == NULL)
+			map[opt->option] = opt;
+	}
+	return map;
+}
+
+static int
+dhcp_optcmp(const void *a, const void *b)
+{
+	const struct dhcp_opt *oa = *(struct dhcp_opt * const *)a;
+	const struct dhcp_opt *ob = *(struct dhcp_opt * const *)b;
+
+	if (oa->option != ob->option)
+		return oa->option < ob->option ? -1 : 1;
+	/* Keep definition order for duplicate codes. */
+	if (oa != ob)
+		return oa < ob ? -1 : 1;
+	return 0;
+}
+
+/* Sort definitions by code for dhcp_optsearch. */
+struct dhcp_opt **
+dhcp_optsort(struct dhcp_opt *opts, size_t opts_len)
+{
+	struct dhcp_opt **sorted;
+	size_t i;
+
+	if (opts_len == 0)
+		return NULL;
+	sorted = reallocarray(NULL, opts_len, sizeof(*sorted));
+	if (sorted == NULL)
+		return NULL;
+	for (i = 0; i < opts_len; i++)
+		sorted[i] = &opts[i];
+	qsort(sorted, opts_len, sizeof(*sorted), dhcp_optcmp);
+	return sorted;
+}
+
+/* Find the first definition of code using a table from dhcp_optmap
+ * or dhcp_optsort, falling back to a scan if there is no table. */
+struct dhcp_opt *
+dhcp_optsearch(struct dhcp_opt **map, struct dhcp_opt **sorted,
+    struct dhcp_opt *opts, size_t opts_len, unsigned int code)
+{
+	size_t i, lo, hi;
+	struct dhcp_opt *opt;
+
+	if (map != NULL)
+		return code <= UINT8_MAX ? map[code] : NULL;
+
+	if (sorted == NULL) {
+		for (i = 0, opt = opts; i < opts_len; i++, opt++) {
+			if (opt->option == code)
+				return opt;
+		}
+		return NULL;
+	}
+
+	lo = 0;
+	hi = opts_len;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (sorted[i]->option < code)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	if (lo < opts_len && sorted[lo]->option == code)
+		return sorted[lo];
+	return NULL;
+}
+
 ssize_t
 dhcp_vendor(char *str, size_t len)
 {
@@ -412,6 +499,30 @@ decode_rfc1035(char *out, size_t len, const uint8_t *p, size_t pl)
 	return (ssize_t)o_len;
 }
 
+/*
+ * Character classes for the string fast paths, matching the C locale.
+ * Runs of characters that need no special handling are skipped or
+ * copied in one go, leaving the per character checks for the rest.
+ */
+#define	CC_ASCII	0x01	/* isascii */
+#define	CC_PRINT	0x02	/* isprint and not a backslash */
+#define	CC_FILE		0x04	/* CC_PRINT and not a slash or space */
+#define	CC_ALNUM	0x08	/* isalnum */
+#define	CC_ANY		0x10
+#define	CC(c)								\
+	(((c) < 0x80 ? CC_ASCII : 0) |					\
+	((c) >= 0x20 && (c) < 0x7f && (c) != '\\' ? CC_PRINT : 0) |	\
+	((c) > 0x20 && (c) < 0x7f && (c) != '\\' && (c) != '/' ?	\
+	CC_FILE : 0) |							\
+	(((c) >= '0' && (c) <= '9') || ((c) >= 'A' && (c) <= 'Z') ||	\
+	((c) >= 'a' && (c) <= 'z') ? CC_ALNUM : 0) | CC_ANY)
+#define	CC4(c)		CC(c), CC((c) + 1), CC((c) + 2), CC((c) + 3)
+#define	CC16(c)		CC4(c), CC4((c) + 4), CC4((c) + 8), CC4((c) + 12)
+#define	CC64(c)		CC16(c), CC16((c) + 16), CC16((c) + 32), CC16((c) + 48)
+static const uint8_t cclass[256] = {
+	CC64(0), CC64(64), CC64(128), CC64(192)
+};
+
 /* Check for a valid name as per RFC952 and RFC1123 section 2.1 */
 static int
 valid_domainname(char *lbl, int type)
@@ -431,6 +542,21 @@ valid_domainname(char *lbl, int type)
 	len = errset = 0;
 	for (;;) {
 		c = (unsigned char)*lbl++;
+		if (cclass[c] & CC_ALNUM) {
+			/* Skip the rest of the run of letters and digits */
+			len++;
+			while (cclass[(unsigned char)*lbl] & CC_ALNUM) {
+				lbl++;
+				len++;
+			}
+			if (len > NS_MAXLABEL) {
+				errno = ERANGE;
+				errset = 1;
+				break;
+			}
+			start = 0;
+			continue;
+		}
 		if (c == '\0')
 			return 1;
 		if (c == ' ') {
@@ -453,9 +579,8 @@ valid_domainname(char *lbl, int type)
 			len = 0;
 			continue;
 		}
-		if (((c == '-' || c == '_') &&
-		    !start && *lbl != ' ' && *lbl != '\0') ||
-		    isalnum(c))
+		if ((c == '-' || c == '_') &&
+		    !start && *lbl != ' ' && *lbl != '\0')
 		{
 			if (++len > NS_MAXLABEL) {
 				errno = ERANGE;
@@ -488,15 +613,47 @@ ssize_t
 print_string(char *dst, size_t len, int type, const uint8_t *data, size_t dl)
 {
 	char *odst;
-	uint8_t c;
-	const uint8_t *e;
-	size_t bytes;
+	uint8_t c, safe;
+	const uint8_t *e, *run;
+	size_t bytes, n;
 
 	odst = dst;
 	bytes = 0;
 	e = data + dl;
 
+	/* The class of characters copied as they are */
+	if (type & OT_BINHEX)
+		safe = 0;
+	else if (type & OT_ESCFILE)
+		safe = CC_FILE;
+	else if (type & OT_ESCSTRING)
+		safe = CC_PRINT;
+	else if (type & OT_RAW && !(type & OT_ASCII))
+		safe = CC_ANY;
+	else
+		safe = CC_ASCII;
+
 	while (data < e) {
+		if (cclass[*data] & safe) {
+			for (run = data + 1;
+			     run < e && cclass[*run] & safe;
+			     run++)
+				;
+			n = (size_t)(run - data);
+			if (dst) {
+				if (len < n) {
+					errno = ENOBUFS;
+					return -1;
+				}
+				memcpy(dst, data, n);
+				dst += n;
+				len -= n;
+			}
+			bytes += n;
+			data = run;
+			continue;
+		}
+
 		c = *data++;
 		if (type & OT_BINHEX) {
 			if (dst) {
@@ -621,73 +778,176 @@ dhcp_optlen(const struct dhcp_opt *opt, size_t dl)
 	return (ssize_t)sz;
 }
 
+/*
+ * Option values are formatted into a buffer kept in the context
+ * and written out in one go once complete.
+ * This means each value is only printed once and a failure part way
+ * through leaves nothing in the environment.
+ */
+char *
+dhcp_optbuf_reserve(struct dhcpcd_ctx *ctx, size_t len)
+{
+	char *nbuf;
+	size_t nlen;
+
+	if (ctx->opt_buflen - ctx->opt_bufpos >= len)
+		return ctx->opt_buf + ctx->opt_bufpos;
+
+	nlen = ctx->opt_buflen == 0 ? 1024 : ctx->opt_buflen;
+	while (nlen - ctx->opt_bufpos < len) {
+		if (nlen > SIZE_MAX / 2) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		nlen *= 2;
+	}
+	nbuf = realloc(ctx->opt_buf, nlen);
+	if (nbuf == NULL)
+		return NULL;
+	ctx->opt_buf = nbuf;
+	ctx->opt_buflen = nlen;
+	return ctx->opt_buf + ctx->opt_bufpos;
+}
+
+int
+dhcp_optbuf_puts(struct dhcpcd_ctx *ctx, const char *str)
+{
+	size_t len = strlen(str);
+	char *p;
+
+	if ((p = dhcp_optbuf_reserve(ctx, len)) == NULL)
+		return -1;
+	memcpy(p, str, len);
+	ctx->opt_bufpos += len;
+	return 0;
+}
+
+int
+dhcp_optbuf_putc(struct dhcpcd_ctx *ctx, char c)
+{
+	char *p;
+
+	if ((p = dhcp_optbuf_reserve(ctx, 1)) == NULL)
+		return -1;
+	*p = c;
+	ctx->opt_bufpos++;
+	return 0;
+}
+
+int
+dhcp_optbuf_uint(struct dhcpcd_ctx *ctx, unsigned long val)
+{
+	char buf[sizeof(val) * 3], *bp = buf + sizeof(buf), *p;
+	size_t len;
+
+	do {
+		*--bp = (char)('0' + val % 10);
+		val /= 10;
+	} while (val != 0);
+	len = (size_t)(buf + sizeof(buf) - bp);
+	if ((p = dhcp_optbuf_reserve(ctx, len)) == NULL)
+		return -1;
+	memcpy(p, bp, len);
+	ctx->opt_bufpos += len;
+	return 0;
+}
+
+int
+dhcp_optbuf_int(struct dhcpcd_ctx *ctx, long val)
+{
+
+	if (val >= 0)
+		return dhcp_optbuf_uint(ctx, (unsigned long)val);
+	if (dhcp_optbuf_putc(ctx, '-') == -1)
+		return -1;
+	return dhcp_optbuf_uint(ctx, -(unsigned long)val);
+}
+
+int
+dhcp_optbuf_addr(struct dhcpcd_ctx *ctx, int af, const void *addr)
+{
+	char *p;
+
+	if ((p = dhcp_optbuf_reserve(ctx, INET6_ADDRSTRLEN)) == NULL)
+		return -1;
+	if (inet_ntop(af, addr, p, INET6_ADDRSTRLEN) == NULL)
+		return -1;
+	ctx->opt_bufpos += strlen(p);
+	return 0;
+}
+
 static ssize_t
-print_option(FILE *fp, const char *prefix, const struct dhcp_opt *opt,
-    int vname,
+print_option(struct dhcpcd_ctx *ctx, FILE *fp, const char *prefix,
+    const struct dhcp_opt *opt, int vname,
     const uint8_t *data, size_t dl, const char *ifname)
 {
-	fpos_t fp_pos;
 	const uint8_t *e, *t;
 	uint16_t u16;
-	int16_t s16;
 	uint32_t u32;
-	int32_t s32;
-	struct in_addr addr;
 	ssize_t sl;
 	size_t l;
+	char *p;
 
 	/* Ensure a valid length */
 	dl = (size_t)dhcp_optlen(opt, dl);
 	if ((ssize_t)dl == -1)
 		return 0;
 
-	if (fgetpos(fp, &fp_pos) == -1)
+	ctx->opt_bufpos = 0;
+	if (dhcp_optbuf_puts(ctx, prefix) == -1)
 		return -1;
-	if (fprintf(fp, "%s", prefix) == -1)
-		goto err;
-
-	/* We printed something, so always goto err from now-on
-	 * to terminate the string. */
 	if (vname) {
-		if (fprintf(fp, "_%s", opt->var) == -1)
-			goto err;
+		if (dhcp_optbuf_putc(ctx, '_') == -1 ||
+		    dhcp_optbuf_puts(ctx, opt->var) == -1)
+			return -1;
 	}
-	if (fputc('=', fp) == EOF)
-		goto err;
+	if (dhcp_optbuf_putc(ctx, '=') == -1)
+		return -1;
 	if (dl == 0)
 		goto done;
 
 	if (opt->type & OT_RFC1035) {
-		char domain[NS_MAXDNAME];
-
-		sl = decode_rfc1035(domain, sizeof(domain), data, dl);
+		if ((p = dhcp_optbuf_reserve(ctx, NS_MAXDNAME)) == NULL)
+			return -1;
+		sl = decode_rfc1035(p, NS_MAXDNAME, data, dl);
 		if (sl == -1)
-			goto err;
+			return -1;
 		if (sl == 0)
 			goto done;
-		if (valid_domainname(domain, opt->type) == -1)
-			goto err;
-		return efprintf(fp, "%s", domain);
+		if (valid_domainname(p, opt->type) == -1)
+			return -1;
+		ctx->opt_bufpos += strlen(p);
+		goto done;
 	}
 
 #ifdef INET
-	if (opt->type & OT_RFC3361)
-		return print_rfc3361(fp, data, dl);
-
-	if (opt->type & OT_RFC3442)
-		return print_rfc3442(fp, data, dl);
+	if (opt->type & (OT_RFC3361 | OT_RFC3442)) {
+		if (opt->type & OT_RFC3361)
+			sl = print_rfc3361(ctx, data, dl);
+		else
+			sl = print_rfc3442(ctx, data, dl);
+		if (sl <= 0)
+			return sl;
+		goto done;
+	}
 #endif
 
 	if (opt->type & OT_STRING) {
-		char buf[1024];
-
-		if (print_string(buf, sizeof(buf), opt->type, data, dl) == -1)
-			goto err;
-		return efprintf(fp, "%s", buf);
+		/* Escaping a byte takes at most 4 characters */
+		l = dl * 4 + 1;
+		if ((p = dhcp_optbuf_reserve(ctx, l)) == NULL)
+			return -1;
+		if (print_string(p, l, opt->type, data, dl) == -1)
+			return -1;
+		ctx->opt_bufpos += strlen(p);
+		goto done;
 	}
 
-	if (opt->type & OT_FLAG)
-		return efprintf(fp, "1");
+	if (opt->type & OT_FLAG) {
+		if (dhcp_optbuf_putc(ctx, '1') == -1)
+			return -1;
+		goto done;
+	}
 
 	if (opt->type & OT_BITFLAG) {
 		/* bitflags are a string, MSB first, such as ABCDEFGH
@@ -701,8 +961,9 @@ print_option(FILE *fp, const char *prefix, const struct dhcp_opt *opt,
 			    opt->bitflags[l] != '0' &&
 			    *data & (1 << sl))
 			{
-				if (fputc(opt->bitflags[l], fp) == EOF)
-					goto err;
+				if (dhcp_optbuf_putc(ctx,
+				    opt->bitflags[l]) == -1)
+					return -1;
 			}
 		}
 		goto done;
@@ -712,72 +973,65 @@ print_option(FILE *fp, const char *prefix, const struct dhcp_opt *opt,
 	e = data + dl;
 	while (data < e) {
 		if (data != t) {
-			if (fputc(' ', fp) == EOF)
-				goto err;
+			if (dhcp_optbuf_putc(ctx, ' ') == -1)
+				return -1;
 		}
 		if (opt->type & OT_UINT8) {
-			if (fprintf(fp, "%u", *data) == -1)
-				goto err;
+			if (dhcp_optbuf_uint(ctx, *data) == -1)
+				return -1;
 			data++;
 		} else if (opt->type & OT_INT8) {
-			if (fprintf(fp, "%d", *data) == -1)
-				goto err;
+			if (dhcp_optbuf_int(ctx, *data) == -1)
+				return -1;
 			data++;
 		} else if (opt->type & OT_UINT16) {
 			memcpy(&u16, data, sizeof(u16));
 			u16 = ntohs(u16);
-			if (fprintf(fp, "%u", u16) == -1)
-				goto err;
+			if (dhcp_optbuf_uint(ctx, u16) == -1)
+				return -1;
 			data += sizeof(u16);
 		} else if (opt->type & OT_INT16) {
 			memcpy(&u16, data, sizeof(u16));
-			s16 = (int16_t)ntohs(u16);
-			if (fprintf(fp, "%d", s16) == -1)
-				goto err;
+			if (dhcp_optbuf_int(ctx,
+			    (int16_t)ntohs(u16)) == -1)
+				return -1;
 			data += sizeof(u16);
 		} else if (opt->type & OT_UINT32) {
 			memcpy(&u32, data, sizeof(u32));
-			u32 = ntohl(u32);
-			if (fprintf(fp, "%u", u32) == -1)
-				goto err;
+			if (dhcp_optbuf_uint(ctx, ntohl(u32)) == -1)
+				return -1;
 			data += sizeof(u32);
 		} else if (opt->type & OT_INT32) {
 			memcpy(&u32, data, sizeof(u32));
-			s32 = (int32_t)ntohl(u32);
-			if (fprintf(fp, "%d", s32) == -1)
-				goto err;
+			if (dhcp_optbuf_int(ctx,
+			    (int32_t)ntohl(u32)) == -1)
+				return -1;
 			data += sizeof(u32);
 		} else if (opt->type & OT_ADDRIPV4) {
-			memcpy(&addr.s_addr, data, sizeof(addr.s_addr));
-			if (fprintf(fp, "%s", inet_ntoa(addr)) == -1)
-				goto err;
-			data += sizeof(addr.s_addr);
+			if (dhcp_optbuf_addr(ctx, AF_INET, data) == -1)
+				return -1;
+			data += sizeof(u32);
 		} else if (opt->type & OT_ADDRIPV6) {
-			char buf[INET6_ADDRSTRLEN];
-
-			if (inet_ntop(AF_INET6, data, buf, sizeof(buf)) == NULL)
-				goto err;
-			if (fprintf(fp, "%s", buf) == -1)
-				goto err;
+			if (dhcp_optbuf_addr(ctx, AF_INET6, data) == -1)
+				return -1;
 			if (data[0] == 0xfe && (data[1] & 0xc0) == 0x80) {
-				if (fprintf(fp,"%%%s", ifname) == -1)
-					goto err;
+				if (dhcp_optbuf_putc(ctx, '%') == -1 ||
+				    dhcp_optbuf_puts(ctx, ifname) == -1)
+					return -1;
 			}
 			data += 16;
 		} else {
 			errno = EINVAL;
-			goto err;
+			return -1;
 		}
 	}
 
 done:
-	if (fputc('\0', fp) == EOF)
+	if (dhcp_optbuf_putc(ctx, '\0') == -1)
+		return -1;
+	if (fwrite(ctx->opt_buf, 1, ctx->opt_bufpos, fp) != ctx->opt_bufpos)
 		return -1;
 	return 1;
-
-err:
-	(void)fsetpos(fp, &fp_pos);
-	return -1;
 }
 
 int
@@ -832,7 +1086,8 @@ dhcp_envoption(struct dhcpcd_ctx *ctx, FILE *fp, const char *prefix,
 	if (opt->embopts_len == 0 && opt->encopts_len == 0) {
 		if (opt->type & OT_RESERVED)
 			return;
-		if (print_option(fp, prefix, opt, 1, od, ol, ifname) == -1)
+		if (print_option(ctx, fp, prefix, opt, 1, od, ol,
+		    ifname) == -1)
 			logerr("%s: %s %d", ifname, __func__, opt->option);
 		return;
 	}
@@ -880,8 +1135,8 @@ dhcp_envoption(struct dhcpcd_ctx *ctx, FILE *fp, const char *prefix,
 		 * This avoids new_fqdn_fqdn which would be silly. */
 		if (!(eopt->type & OT_RESERVED)) {
 			ov = strcmp(opt->var, eopt->var);
-			if (print_option(fp, pfx, eopt, ov, od, (size_t)eo,
-			    ifname) == -1)
+			if (print_option(ctx, fp, pfx, eopt, ov,
+			    od, (size_t)eo, ifname) == -1)
 				logerr("%s: %s %d.%d/%zu",
 				    ifname, __func__,
 				    opt->option, eopt->option, i);
@@ -948,15 +1203,16 @@ dhcp_zero_index(struct dhcp_opt *opt)
 ssize_t
 dhcp_readfile(struct dhcpcd_ctx *ctx, const char *file, void *data, size_t len)
 {
+	const char *key;
 
 #ifdef PRIVSEP
 	if (ctx->options & DHCPCD_PRIVSEP &&
 	    !(ctx->options & DHCPCD_PRIVSEPROOT))
 		return ps_root_readfile(ctx, file, data, len);
-#else
-	UNUSED(ctx);
 #endif
 
+	if ((key = leasedb_key(ctx, file)) != NULL)
+		return leasedb_read(ctx, file, key, data, len);
 	return readfile(file, data, len);
 }
 
@@ -964,48 +1220,202 @@ ssize_t
 dhcp_writefile(struct dhcpcd_ctx *ctx, const char *file, mode_t mode,
     const void *data, size_t len)
 {
+	const char *key;
 
 #ifdef PRIVSEP
 	if (ctx->options & DHCPCD_PRIVSEP &&
 	    !(ctx->options & DHCPCD_PRIVSEPROOT))
 		return ps_root_writefile(ctx, file, mode, data, len);
-#else
-	UNUSED(ctx);
 #endif
 
+	if ((key = leasedb_key(ctx, file)) != NULL)
+		return leasedb_write(ctx, file, key, data, len);
 	return writefile(file, mode, data, len);
 }
 
 int
 dhcp_filemtime(struct dhcpcd_ctx *ctx, const char *file, time_t *time)
 {
+	const char *key;
 
 #ifdef PRIVSEP
 	if (ctx->options & DHCPCD_PRIVSEP &&
 	    !(ctx->options & DHCPCD_PRIVSEPROOT))
 		return (int)ps_root_filemtime(ctx, file, time);
-#else
-	UNUSED(ctx);
 #endif
 
+	if ((key = leasedb_key(ctx, file)) != NULL)
+		return leasedb_mtime(ctx, file, key, time);
 	return filemtime(file, time);
 }
 
 int
 dhcp_unlink(struct dhcpcd_ctx *ctx, const char *file)
 {
+	const char *key;
 
 #ifdef PRIVSEP
 	if (ctx->options & DHCPCD_PRIVSEP &&
 	    !(ctx->options & DHCPCD_PRIVSEPROOT))
 		return (int)ps_root_unlink(ctx, file);
-#else
-	UNUSED(ctx);
 #endif
 
+	if ((key = leasedb_key(ctx, file)) != NULL)
+		return leasedb_unlink(ctx, file, key);
 	return unlink(file);
 }
 
+static void
+dhcp_writelease(struct interface *ifp, const char *file,
+    const void *data, size_t len)
+{
+
+	logdebugx("%s: writing lease: %s", ifp->name, file);
+#ifdef PRIVSEP
+	/* Nothing waits on the lease being written, so don't wait for it.
+	 * Reading it back is still ordered after the write. */
+	if (ifp->ctx->options & DHCPCD_PRIVSEP &&
+	    !(ifp->ctx->options & DHCPCD_PRIVSEPROOT))
+	{
+		if (ps_root_writefileasync(ifp->ctx, file, 0640,
+		    data, len) == -1)
+			logerr("ps_root_writefileasync: %s", file);
+		return;
+	}
+#endif
+	if (dhcp_writefile(ifp->ctx, file, 0640, data, len) == -1)
+		logerr("dhcp_writefile: %s", file);
+}
+
+static void
+dhcp_flushleases_cb(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+
+	ctx->lease_flush_pending = false;
+	dhcp_flushleases(ctx, false);
+}
+
+/*
+ * Persist a lease, or with lease_write_delay just remember it and have
+ * it written along with any others once the delay has passed.
+ * A lease which only differs from the last one by the xid at xidoff
+ * is a renewal of the same lease, so the bytes are not rewritten
+ * until we exit, which only serves to update its age.
+ */
+void
+dhcp_savelease(struct interface *ifp, struct dhcp_leasesave *ls,
+    const char *file, const void *data, size_t len,
+    size_t xidoff, size_t xidlen)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	uint32_t delay = ifp->options->lease_write_delay;
+	const uint8_t *p = data;
+	bool renewal;
+	uint8_t *nd;
+
+	if (delay == 0 || ctx->options & DHCPCD_TEST) {
+		dhcp_forgetlease(ls);
+		dhcp_writelease(ifp, file, data, len);
+		return;
+	}
+
+	renewal = ls->data != NULL && ls->len == len &&
+	    xidoff + xidlen <= len &&
+	    memcmp(ls->data, p, xidoff) == 0 &&
+	    memcmp(ls->data + xidoff + xidlen, p + xidoff + xidlen,
+	    len - xidoff - xidlen) == 0;
+
+	if (ls->len != len) {
+		nd = realloc(ls->data, len);
+		if (nd == NULL) {
+			logerr(__func__);
+			dhcp_forgetlease(ls);
+			dhcp_writelease(ifp, file, data, len);
+			return;
+		}
+		ls->data = nd;
+		ls->len = len;
+	}
+	memcpy(ls->data, data, len);
+
+	if (renewal) {
+		ls->stale = true;
+		return;
+	}
+	ls->dirty = true;
+	if (!ctx->lease_flush_pending) {
+		eloop_timeout_add_sec(ctx->eloop, delay,
+		    dhcp_flushleases_cb, ctx);
+		ctx->lease_flush_pending = true;
+	}
+}
+
+/* Write a remembered lease if the disk is behind.
+ * Leases which have only been renewed are written when all is true. */
+void
+dhcp_flushlease(struct interface *ifp, struct dhcp_leasesave *ls,
+    const char *file, bool all)
+{
+
+	/* Only the process which bound the lease may write it. */
+	if (ifp->ctx->options & DHCPCD_FORKED ||
+	    ls->data == NULL || !(ls->dirty || (all && ls->stale)))
+		return;
+	dhcp_writelease(ifp, file, ls->data, ls->len);
+	ls->dirty = ls->stale = false;
+}
+
+int
+dhcp_unlinklease(struct interface *ifp, struct dhcp_leasesave *ls,
+    const char *file)
+{
+
+	dhcp_forgetlease(ls);
+	return dhcp_unlink(ifp->ctx, file);
+}
+
+void
+dhcp_forgetlease(struct dhcp_leasesave *ls)
+{
+
+	free(ls->data);
+	ls->data = NULL;
+	ls->len = 0;
+	ls->dirty = ls->stale = false;
+}
+
+void
+dhcp_flushleases(struct dhcpcd_ctx *ctx, bool all)
+{
+	struct interface *ifp;
+#ifdef INET
+	struct dhcp_state *state;
+#endif
+#ifdef DHCP6
+	struct dhcp6_state *state6;
+#endif
+
+	if (all && ctx->lease_flush_pending) {
+		eloop_timeout_delete(ctx->eloop, dhcp_flushleases_cb, ctx);
+		ctx->lease_flush_pending = false;
+	}
+	if (ctx->ifaces == NULL)
+		return;
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+#ifdef INET
+		if ((state = D_STATE(ifp)) != NULL)
+			dhcp_flushlease(ifp, &state->leasesave,
+			    state->leasefile, all);
+#endif
+#ifdef DHCP6
+		if ((state6 = D6_STATE(ifp)) != NULL)
+			dhcp_flushlease(ifp, &state6->leasesave,
+			    state6->leasefile, all);
+#endif
+	}
+}
+
 size_t
 dhcp_read_hwaddr_aton(struct dhcpcd_ctx *ctx, uint8_t **data, const char *file)
 {
@@ -1027,3 +1437,79 @@ dhcp_read_hwaddr_aton(struct dhcpcd_ctx *ctx, uint8_t **data, const char *file)
 	hwaddr_aton(*data, buf);
 	return len;
 }
+
+/* FNV-1a, so a client moves its timers by the same amount every time. */
+uint32_t
+dhcp_spread_seed(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (; len != 0; len--, p++) {
+		h ^= *p;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * RFC 2131 4.4.5 asks for some fuzz around T1 and T2 so that clients
+ * which were bound together do not renew together for ever more.
+ * Move both by up to pct percent either way, as chosen by the seed.
+ * T2 is kept at least half way from where it was to the end of the
+ * lease and T1 is kept from passing T2.
+ * A zero or infinite timer is left alone.
+ */
+void
+dhcp_spread_timers(uint32_t *t1, uint32_t *t2, uint32_t lease,
+    unsigned int pct, uint32_t seed)
+{
+	uint32_t span;
+	long long d;
+	unsigned long long t;
+
+	if (pct == 0)
+		return;
+	if (pct > DHCP_SPREAD_MAX)
+		pct = DHCP_SPREAD_MAX;
+	/* Permille, so short leases still spread. */
+	span = pct * 10;
+	seed ^= seed >> 16;
+	d = (long long)(seed % (span * 2 + 1)) - (long long)span;
+
+	if (*t2 != 0 && *t2 != UINT32_MAX) {
+		t = (unsigned long long)((long long)*t2 +
+		    (long long)*t2 * d / 1000);
+		if (t >= UINT32_MAX)
+			t = UINT32_MAX - 1;
+		if (lease != UINT32_MAX && lease > *t2 &&
+		    t > *t2 + (lease - *t2) / 2)
+			t = *t2 + (lease - *t2) / 2;
+		*t2 = (uint32_t)t;
+	}
+	if (*t1 != 0 && *t1 != UINT32_MAX) {
+		t = (unsigned long long)((long long)*t1 +
+		    (long long)*t1 * d / 1000);
+		if (t >= UINT32_MAX)
+			t = UINT32_MAX - 1;
+		if (*t2 != 0 && t > *t2)
+			t = *t2;
+		*t1 = (uint32_t)t;
+	}
+}
+
+/*
+ * Renewing late is harmless and lets timer_slack batch the wakeups
+ * of many leases, but it must still happen before rebinding.
+ * eloop keeps the slack rounded deadline before rebind, or falls back
+ * to the exact renewal time.
+ */
+int
+dhcp_renew_timeout(struct eloop *eloop, uint32_t renew, uint32_t rebind,
+    unsigned int slack, void (*callback)(void *), void *arg)
+{
+
+	if (rebind <= renew)
+		slack = 0;
+	return eloop_timeout_add_sec_slack(eloop, renew, slack, rebind,
+	    callback, arg);
+}
@@ -32,10 +32,22 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include <arpa/nameser.h> /* after normal includes for sunos */
 
+/* The lease as last handed to the disk, see lease_write_delay.
+ * This is used by dhcp.h which dhcpcd.h can pull in before the end
+ * of this file. */
+struct dhcp_leasesave {
+	uint8_t *data;
+	size_t len;
+	bool dirty;	/* the bytes on disk are out of date */
+	bool stale;	/* only the age of the lease on disk is */
+};
+
 #include "common.h"
 #include "dhcpcd.h"
 
@@ -110,6 +122,10 @@ struct dhcp_opt {
 
 const char *dhcp_get_hostname(char *, size_t, const struct if_options *);
 struct dhcp_opt *vivso_find(uint32_t, const void *);
+struct dhcp_opt **dhcp_optmap(struct dhcp_opt *, size_t);
+struct dhcp_opt **dhcp_optsort(struct dhcp_opt *, size_t);
+struct dhcp_opt *dhcp_optsearch(struct dhcp_opt **, struct dhcp_opt **,
+    struct dhcp_opt *, size_t, unsigned int);
 
 ssize_t dhcp_vendor(char *, size_t);
 
@@ -127,6 +143,12 @@ int make_option_mask(const struct dhcp_opt *, size_t,
 size_t encode_rfc1035(const char *src, uint8_t *dst);
 ssize_t decode_rfc1035(char *, size_t, const uint8_t *, size_t);
 ssize_t print_string(char *, size_t, int, const uint8_t *, size_t);
+char *dhcp_optbuf_reserve(struct dhcpcd_ctx *, size_t);
+int dhcp_optbuf_puts(struct dhcpcd_ctx *, const char *);
+int dhcp_optbuf_putc(struct dhcpcd_ctx *, char);
+int dhcp_optbuf_uint(struct dhcpcd_ctx *, unsigned long);
+int dhcp_optbuf_int(struct dhcpcd_ctx *, long);
+int dhcp_optbuf_addr(struct dhcpcd_ctx *, int, const void *);
 int dhcp_set_leasefile(char *, size_t, int, const struct interface *);
 
 void dhcp_envoption(struct dhcpcd_ctx *,
@@ -137,10 +159,28 @@ void dhcp_envoption(struct dhcpcd_ctx *,
     const uint8_t *od, size_t ol);
 void dhcp_zero_index(struct dhcp_opt *);
 
+void dhcp_savelease(struct interface *, struct dhcp_leasesave *,
+    const char *, const void *, size_t, size_t, size_t);
+void dhcp_flushlease(struct interface *, struct dhcp_leasesave *,
+    const char *, bool);
+int dhcp_unlinklease(struct interface *, struct dhcp_leasesave *,
+    const char *);
+void dhcp_forgetlease(struct dhcp_leasesave *);
+void dhcp_flushleases(struct dhcpcd_ctx *, bool);
+
 ssize_t dhcp_readfile(struct dhcpcd_ctx *, const char *, void *, size_t);
 ssize_t dhcp_writefile(struct dhcpcd_ctx *, const char *, mode_t,
     const void *, size_t);
 int dhcp_filemtime(struct dhcpcd_ctx *, const char *, time_t *);
 int dhcp_unlink(struct dhcpcd_ctx *, const char *);
 size_t dhcp_read_hwaddr_aton(struct dhcpcd_ctx *, uint8_t **, const char *);
+
+#define	DHCP_SPREAD_SEED	2166136261U
+#define	DHCP_SPREAD_MAX		50	/* percent */
+uint32_t dhcp_spread_seed(uint32_t, const void *, size_t);
+void dhcp_spread_timers(uint32_t *, uint32_t *, uint32_t, unsigned int,
+    uint32_t);
+struct eloop;
+int dhcp_renew_timeout(struct eloop *, uint32_t, uint32_t, unsigned int,
+    void (*)(void *), void *);
 #endif
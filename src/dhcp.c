@@ -49,6 +49,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -67,6 +68,7 @@
 #include "dhcp-common.h"
 #include "duid.h"
 #include "eloop.h"
+#include "handoff.h"
 #include "if.h"
 #include "ipv4.h"
 #include "ipv4ll.h"
@@ -126,6 +128,7 @@ static const char * const dhcp_params[] = {
 };
 
 static int dhcp_openbpf(struct interface *);
+static void dhcp_closebpf(struct interface *);
 static void dhcp_start1(void *);
 #if defined(ARP) && (!defined(KERNEL_RFC5227) || defined(ARPING))
 static void dhcp_arp_found(struct arp_state *, const struct arp_msg *);
@@ -162,67 +165,65 @@ dhcp_printoptions(const struct dhcpcd_ctx *ctx,
 	}
 }
 
-static const uint8_t *
-get_option(struct dhcpcd_ctx *ctx,
-    const struct bootp *bootp, size_t bootp_len,
-    unsigned int opt, size_t *opt_len)
-{
+/* Walks the options, following overloads into file and sname. */
+struct dhcp_optiter {
+	const struct bootp *bootp;
 	const uint8_t *p, *e;
-	uint8_t l, o, ol, overl, *bp;
-	const uint8_t *op;
-	size_t bl;
+	uint8_t overl;
+};
 
-	if (bootp == NULL || bootp_len < DHCP_MIN_LEN) {
-		errno = EINVAL;
-		return NULL;
-	}
+static void
+dhcp_optiter_init(struct dhcp_optiter *it,
+    const struct bootp *bootp, size_t bootp_len)
+{
 
-	/* Check we have the magic cookie */
-	if (!IS_DHCP(bootp)) {
-		errno = ENOTSUP;
-		return NULL;
-	}
+	it->bootp = bootp;
+	it->p = bootp->vend + 4; /* options after the 4 byte cookie */
+	it->e = (const uint8_t *)bootp + bootp_len;
+	it->overl = 0;
+}
 
-	p = bootp->vend + 4; /* options after the 4 byte cookie */
-	e = (const uint8_t *)bootp + bootp_len;
-	ol = o = overl = 0;
-	bp = NULL;
-	op = NULL;
-	bl = 0;
-	while (p < e) {
-		o = *p++;
+/* Returns 1 for an option, 0 at the end or -1 with errno set. */
+static int
+dhcp_optiter_next(struct dhcp_optiter *it,
+    uint8_t *opt, const uint8_t **data, uint8_t *len)
+{
+	uint8_t o, l;
+
+	while (it->p < it->e) {
+		o = *it->p++;
 		switch (o) {
 		case DHO_PAD:
 			/* No length to read */
 			continue;
 		case DHO_END:
-			if (overl & 1) {
+			if (it->overl & 1) {
 				/* bit 1 set means parse boot file */
-				overl = (uint8_t)(overl & ~1);
-				p = bootp->file;
-				e = p + sizeof(bootp->file);
-			} else if (overl & 2) {
+				it->overl = (uint8_t)(it->overl & ~1);
+				it->p = it->bootp->file;
+				it->e = it->p + sizeof(it->bootp->file);
+			} else if (it->overl & 2) {
 				/* bit 2 set means parse server name */
-				overl = (uint8_t)(overl & ~2);
-				p = bootp->sname;
-				e = p + sizeof(bootp->sname);
+				it->overl = (uint8_t)(it->overl & ~2);
+				it->p = it->bootp->sname;
+				it->e = it->p + sizeof(it->bootp->sname);
 			} else
-				goto exit;
+				return 0;
 			/* No length to read */
 			continue;
 		}
 
 		/* Check we can read the length */
-		if (p == e) {
+		if (it->p == it->e) {
 			errno = EINVAL;
-			return NULL;
+			return -1;
 		}
-		l = *p++;
+		l = *it->p++;
 
 		/* Check we can read the option data, if present */
-		if (p + l > e) {
+		if (it->p + l > it->e) {
 			errno = EINVAL;
-			return NULL;
+			return -1;
 		}
 
 		if (o == DHO_OPTSOVERLOADED) {
@@ -230,42 +231,210 @@ get_option(struct dhcpcd_ctx *ctx,
 			 * the last bit as well as the value.
 			 * This is valid because only the first two bits
 			 * actually mean anything in RFC2132 Section 9.3 */
-			if (l == 1 && !overl)
-				overl = 0x80 | p[0];
+			if (l == 1 && !it->overl)
+				it->overl = 0x80 | it->p[0];
 		}
 
-		if (o == opt) {
-			if (op) {
-				/* We must concatonate the options. */
-				if (bl + l > ctx->opt_buffer_len) {
-					size_t pos;
-					uint8_t *nb;
-
-					if (bp)
-						pos = (size_t)
-						    (bp - ctx->opt_buffer);
-					else
-						pos = 0;
-					nb = realloc(ctx->opt_buffer, bl + l);
-					if (nb == NULL)
-						return NULL;
-					ctx->opt_buffer = nb;
-					ctx->opt_buffer_len = bl + l;
-					bp = ctx->opt_buffer + pos;
-				}
-				if (bp == NULL)
-					bp = ctx->opt_buffer;
-				memcpy(bp, op, ol);
-				bp += ol;
+		*opt = o;
+		*data = it->p;
+		*len = l;
+		it->p += l;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * An index of where each option is in a message, built in one pass.
+ * While pushed onto ctx, get_option answers lookups on that message
+ * from the index rather than walking the options again.
+ * Options split over many instances (RFC 3396) are concatenated into buf.
+ */
+struct dhcp_optindex {
+	struct dhcp_optindex *prev;
+	const struct bootp *bootp;
+	size_t bootp_len;
+	int error;
+	uint8_t *buf;
+	uint8_t present[256 / NBBY];
+	uint8_t concat[256 / NBBY];
+	uint16_t off[256];
+	uint16_t len[256];
+};
+
+static void
+dhcp_optindex_build(struct dhcp_optindex *idx)
+{
+	struct dhcp_optiter it;
+	uint16_t pos[256];
+	uint8_t o, l;
+	const uint8_t *p;
+	size_t buflen;
+	unsigned int i;
+	int r;
+
+	if (idx->bootp == NULL || idx->bootp_len < DHCP_MIN_LEN) {
+		idx->error = EINVAL;
+		return;
+	}
+	if (!IS_DHCP(idx->bootp)) {
+		idx->error = ENOTSUP;
+		return;
+	}
+
+	buflen = 0;
+	dhcp_optiter_init(&it, idx->bootp, idx->bootp_len);
+	while ((r = dhcp_optiter_next(&it, &o, &p, &l)) == 1) {
+		if (has_option_mask(idx->present, o)) {
+			add_option_mask(idx->concat, o);
+			idx->len[o] = (uint16_t)(idx->len[o] + l);
+			continue;
+		}
+		add_option_mask(idx->present, o);
+		idx->off[o] = (uint16_t)(p - (const uint8_t *)idx->bootp);
+		idx->len[o] = l;
+	}
+	if (r == -1) {
+		idx->error = errno;
+		return;
+	}
+
+	/* Concatenate split options with a second pass. */
+	for (i = 0; i < 256; i++) {
+		if (!has_option_mask(idx->concat, i))
+			continue;
+		pos[i] = idx->off[i] = (uint16_t)buflen;
+		buflen += idx->len[i];
+	}
+	if (buflen == 0)
+		return;
+	if ((idx->buf = malloc(buflen)) == NULL) {
+		/* Let get_option walk the options instead. */
+		idx->bootp = NULL;
+		return;
+	}
+	dhcp_optiter_init(&it, idx->bootp, idx->bootp_len);
+	while (dhcp_optiter_next(&it, &o, &p, &l) == 1) {
+		if (!has_option_mask(idx->concat, o))
+			continue;
+		memcpy(idx->buf + pos[o], p, l);
+		pos[o] = (uint16_t)(pos[o] + l);
+	}
+}
+
+static void
+dhcp_optindex_push(struct dhcpcd_ctx *ctx, struct dhcp_optindex *idx,
+    const struct bootp *bootp, size_t bootp_len)
+{
+
+	memset(idx, 0, offsetof(struct dhcp_optindex, off));
+	idx->prev = ctx->dhcp_optidx;
+	ctx->dhcp_optidx = idx;
+
+	/* Offsets are 16 bits, which covers any message we read. */
+	if (bootp_len > UINT16_MAX)
+		return;
+	idx->bootp = bootp;
+	idx->bootp_len = bootp_len;
+	dhcp_optindex_build(idx);
+}
+
+static void
+dhcp_optindex_pop(struct dhcpcd_ctx *ctx, struct dhcp_optindex *idx)
+{
+
+	ctx->dhcp_optidx = idx->prev;
+	free(idx->buf);
+}
+
+static const uint8_t *
+dhcp_optindex_get(const struct dhcp_optindex *idx,
+    unsigned int opt, size_t *opt_len)
+{
+
+	if (idx->error != 0) {
+		errno = idx->error;
+		return NULL;
+	}
+	if (opt > UINT8_MAX || !has_option_mask(idx->present, opt)) {
+		if (opt_len)
+			*opt_len = 0;
+		errno = ENOENT;
+		return NULL;
+	}
+	if (opt_len)
+		*opt_len = idx->len[opt];
+	if (has_option_mask(idx->concat, opt))
+		return idx->buf + idx->off[opt];
+	return (const uint8_t *)idx->bootp + idx->off[opt];
+}
+
+static const uint8_t *
+get_option(struct dhcpcd_ctx *ctx,
+    const struct bootp *bootp, size_t bootp_len,
+    unsigned int opt, size_t *opt_len)
+{
+	const struct dhcp_optindex *idx;
+	struct dhcp_optiter it;
+	const uint8_t *p;
+	uint8_t l, o, ol, *bp;
+	const uint8_t *op;
+	size_t bl;
+	int r;
+
+	for (idx = ctx->dhcp_optidx; idx != NULL; idx = idx->prev) {
+		if (idx->bootp == bootp && idx->bootp_len == bootp_len)
+			return dhcp_optindex_get(idx, opt, opt_len);
+	}
+
+	if (bootp == NULL || bootp_len < DHCP_MIN_LEN) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Check we have the magic cookie */
+	if (!IS_DHCP(bootp)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	ol = 0;
+	bp = NULL;
+	op = NULL;
+	bl = 0;
+	dhcp_optiter_init(&it, bootp, bootp_len);
+	while ((r = dhcp_optiter_next(&it, &o, &p, &l)) == 1) {
+		if (o != opt)
+			continue;
+		if (op) {
+			/* We must concatonate the options. */
+			if (bl + l > ctx->opt_buffer_len) {
+				size_t pos;
+				uint8_t *nb;
+
+				if (bp)
+					pos = (size_t)(bp - ctx->opt_buffer);
+				else
+					pos = 0;
+				nb = realloc(ctx->opt_buffer, bl + l);
+				if (nb == NULL)
+					return NULL;
+				ctx->opt_buffer = nb;
+				ctx->opt_buffer_len = bl + l;
+				bp = ctx->opt_buffer + pos;
 			}
-			ol = l;
-			op = p;
-			bl += ol;
+			if (bp == NULL)
+				bp = ctx->opt_buffer;
+			memcpy(bp, op, ol);
+			bp += ol;
 		}
-		p += l;
+		ol = l;
+		op = p;
+		bl += ol;
 	}
+	if (r == -1)
+		return NULL;
 
-exit:
 	if (opt_len)
 		*opt_len = bl;
 	if (bp) {
@@ -343,7 +512,7 @@ get_option_uint8(struct dhcpcd_ctx *ctx,
 }
 
 ssize_t
-print_rfc3442(FILE *fp, const uint8_t *data, size_t data_len)
+print_rfc3442(struct dhcpcd_ctx *ctx, const uint8_t *data, size_t data_len)
 {
 	const uint8_t *p = data, *e;
 	size_t ocets;
@@ -359,7 +528,7 @@ print_rfc3442(FILE *fp, const uint8_t *data, size_t data_len)
 	e = p + data_len;
 	while (p < e) {
 		if (p != data) {
-			if (fputc(' ', fp) == EOF)
+			if (dhcp_optbuf_putc(ctx, ' ') == -1)
 				return -1;
 		}
 		cidr = *p++;
@@ -378,30 +547,63 @@ print_rfc3442(FILE *fp, const uint8_t *data, size_t data_len)
 			memcpy(&addr.s_addr, p, ocets);
 			p += ocets;
 		}
-		if (fprintf(fp, "%s/%d", inet_ntoa(addr), cidr) == -1)
+		if (dhcp_optbuf_addr(ctx, AF_INET, &addr) == -1 ||
+		    dhcp_optbuf_putc(ctx, '/') == -1 ||
+		    dhcp_optbuf_uint(ctx, cidr) == -1)
 			return -1;
 
 		/* Finally, snag the router */
 		memcpy(&addr.s_addr, p, 4);
 		p += 4;
-		if (fprintf(fp, " %s", inet_ntoa(addr)) == -1)
+		if (dhcp_optbuf_putc(ctx, ' ') == -1 ||
+		    dhcp_optbuf_addr(ctx, AF_INET, &addr) == -1)
 			return -1;
 	}
 
-	if (fputc('\0', fp) == EOF)
-		return -1;
+	return 1;
+}
+
+/* Add a route to the ones decoded from the lease.
+ * Only the first route to a destination is kept as the others
+ * would be discarded by rt_build anyway. */
+static int
+dhcp_addroute(struct dhcp_state *state, struct in_addr dest,
+    struct in_addr netmask, struct in_addr gateway)
+{
+	struct dhcp_route *r, *re;
+
+	for (r = state->routes, re = r + state->routes_len; r != re; r++) {
+		if (r->netmask.s_addr == netmask.s_addr &&
+		    (r->dest.s_addr & netmask.s_addr) ==
+		    (dest.s_addr & netmask.s_addr))
+			return 0;
+	}
+
+	if (state->routes_len == state->routes_size) {
+		size_t size = state->routes_size == 0 ?
+		    8 : state->routes_size * 2;
+
+		r = reallocarray(state->routes, size, sizeof(*r));
+		if (r == NULL)
+			return -1;
+		state->routes = r;
+		state->routes_size = size;
+	}
+	r = &state->routes[state->routes_len++];
+	r->dest = dest;
+	r->netmask = netmask;
+	r->gateway = gateway;
 	return 1;
 }
 
 static int
-decode_rfc3442_rt(rb_tree_t *routes, struct interface *ifp,
+decode_rfc3442_rt(struct dhcp_state *state,
     const uint8_t *data, size_t dl, const struct bootp *bootp)
 {
 	const uint8_t *p = data;
 	const uint8_t *e;
 	uint8_t cidr;
 	size_t ocets;
-	struct rt *rt = NULL;
 	struct in_addr dest, netmask, gateway;
 	int n;
 
@@ -426,9 +628,6 @@ decode_rfc3442_rt(rb_tree_t *routes, struct interface *ifp,
 			return -1;
 		}
 
-		if ((rt = rt_new(ifp)) == NULL)
-			return -1;
-
 		/* If we have ocets then we have a destination and netmask */
 		dest.s_addr = 0;
 		if (ocets > 0) {
@@ -451,23 +650,23 @@ decode_rfc3442_rt(rb_tree_t *routes, struct interface *ifp,
 			gateway.s_addr = INADDR_ANY;
 			netmask.s_addr = INADDR_BROADCAST;
 		}
-		if (netmask.s_addr == INADDR_BROADCAST)
-			rt->rt_flags = RTF_HOST;
 
-		sa_in_init(&rt->rt_dest, &dest);
-		sa_in_init(&rt->rt_netmask, &netmask);
-		sa_in_init(&rt->rt_gateway, &gateway);
-		if (rt_proto_add(routes, rt))
+		switch (dhcp_addroute(state, dest, netmask, gateway)) {
+		case -1:
+			return -1;
+		case 1:
 			n = 1;
+			break;
+		}
 	}
 	return n;
 }
 
 ssize_t
-print_rfc3361(FILE *fp, const uint8_t *data, size_t dl)
+print_rfc3361(struct dhcpcd_ctx *ctx, const uint8_t *data, size_t dl)
 {
 	uint8_t enc;
-	char sip[NS_MAXDNAME];
+	char *sip;
 	struct in_addr addr;
 
 	if (dl < 2) {
@@ -479,15 +678,16 @@ print_rfc3361(FILE *fp, const uint8_t *data, size_t dl)
 	dl--;
 	switch (enc) {
 	case 0:
-		if (decode_rfc1035(sip, sizeof(sip), data, dl) == -1)
+		if ((sip = dhcp_optbuf_reserve(ctx, NS_MAXDNAME)) == NULL)
 			return -1;
-		if (efprintf(fp, "%s", sip) == -1)
+		if (decode_rfc1035(sip, NS_MAXDNAME, data, dl) == -1)
 			return -1;
+		ctx->opt_bufpos += strlen(sip);
 		break;
 	case 1:
 		if (dl % 4 != 0) {
 			errno = EINVAL;
-			break;
+			return 0;
 		}
 		addr.s_addr = INADDR_BROADCAST;
 		for (;
@@ -495,15 +695,13 @@ print_rfc3361(FILE *fp, const uint8_t *data, size_t dl)
 		    data += sizeof(addr.s_addr), dl -= sizeof(addr.s_addr))
 		{
 			memcpy(&addr.s_addr, data, sizeof(addr.s_addr));
-			if (fprintf(fp, "%s", inet_ntoa(addr)) == -1)
+			if (dhcp_optbuf_addr(ctx, AF_INET, &addr) == -1)
 				return -1;
 			if (dl != sizeof(addr.s_addr)) {
-				if (fputc(' ', fp) == EOF)
+				if (dhcp_optbuf_putc(ctx, ' ') == -1)
 					return -1;
 			}
 		}
-		if (fputc('\0', fp) == EOF)
-			return -1;
 		break;
 	default:
 		errno = EINVAL;
@@ -564,19 +762,22 @@ route_netmask(uint32_t ip_in)
 
 /* We need to obey routing options.
  * If we have a CSR then we only use that.
- * Otherwise we add static routes and then routers. */
+ * Otherwise we add static routes and then routers.
+ * The routes are decoded into state->routes once for each lease
+ * as rt_build asks for them far more often than the lease changes. */
 static int
-get_option_routes(rb_tree_t *routes, struct interface *ifp,
-    const struct bootp *bootp, size_t bootp_len)
+get_option_routes(struct interface *ifp, struct dhcp_state *state)
 {
 	struct if_options *ifo = ifp->options;
+	const struct bootp *bootp = state->new;
+	size_t bootp_len = state->new_len;
 	const uint8_t *p;
 	const uint8_t *e;
-	struct rt *rt = NULL;
 	struct in_addr dest, netmask, gateway;
 	size_t len;
 	const char *csr = "";
-	int n;
+
+	state->routes_len = 0;
 
 	/* If we have CSR's then we MUST use these only */
 	if (!has_option_mask(ifo->nomask, DHO_CSR))
@@ -589,10 +790,7 @@ get_option_routes(rb_tree_t *routes, struct interface *ifp,
 		if (p)
 			csr = "MS ";
 	}
-	if (p && (n = decode_rfc3442_rt(routes, ifp, p, len, bootp)) != -1) {
-		const struct dhcp_state *state;
-
-		state = D_CSTATE(ifp);
+	if (p && decode_rfc3442_rt(state, p, len, bootp) != -1) {
 		if (!(ifo->options & DHCPCD_CSR_WARNED) &&
 		    !(state->added & STATE_FAKE))
 		{
@@ -600,10 +798,10 @@ get_option_routes(rb_tree_t *routes, struct interface *ifp,
 			    ifp->name, csr);
 			ifo->options |= DHCPCD_CSR_WARNED;
 		}
-		return n;
+		return 0;
 	}
+	state->routes_len = 0;
 
-	n = 0;
 	/* OK, get our static routes first. */
 	if (!has_option_mask(ifo->nomask, DHO_STATICROUTE))
 		p = get_option(ifp->ctx, bootp, bootp_len,
@@ -622,8 +820,6 @@ get_option_routes(rb_tree_t *routes, struct interface *ifp,
 			 * illegal */
 			if (gateway.s_addr == INADDR_ANY)
 				continue;
-			if ((rt = rt_new(ifp)) == NULL)
-				return -1;
 
 			/* A on-link host route is normally set by having the
 			 * gateway match the destination or assigned address */
@@ -635,14 +831,8 @@ get_option_routes(rb_tree_t *routes, struct interface *ifp,
 				netmask.s_addr = INADDR_BROADCAST;
 			} else
 				netmask.s_addr = route_netmask(dest.s_addr);
-			if (netmask.s_addr == INADDR_BROADCAST)
-				rt->rt_flags = RTF_HOST;
-
-			sa_in_init(&rt->rt_dest, &dest);
-			sa_in_init(&rt->rt_netmask, &netmask);
-			sa_in_init(&rt->rt_gateway, &gateway);
-			if (rt_proto_add(routes, rt))
-				n++;
+			if (dhcp_addroute(state, dest, netmask, gateway) == -1)
+				return -1;
 		}
 	}
 
@@ -656,19 +846,14 @@ get_option_routes(rb_tree_t *routes, struct interface *ifp,
 		dest.s_addr = INADDR_ANY;
 		netmask.s_addr = INADDR_ANY;
 		while (p < e) {
-			if ((rt = rt_new(ifp)) == NULL)
-				return -1;
 			memcpy(&gateway.s_addr, p, sizeof(gateway.s_addr));
 			p += 4;
-			sa_in_init(&rt->rt_dest, &dest);
-			sa_in_init(&rt->rt_netmask, &netmask);
-			sa_in_init(&rt->rt_gateway, &gateway);
-			if (rt_proto_add(routes, rt))
-				n++;
+			if (dhcp_addroute(state, dest, netmask, gateway) == -1)
+				return -1;
 		}
 	}
 
-	return n;
+	return 0;
 }
 
 uint16_t
@@ -693,11 +878,34 @@ dhcp_get_mtu(const struct interface *ifp)
 int
 dhcp_get_routes(rb_tree_t *routes, struct interface *ifp)
 {
-	const struct dhcp_state *state;
+	struct dhcp_state *state;
+	const struct dhcp_route *r, *re;
+	struct rt *rt;
+	int n;
 
-	if ((state = D_CSTATE(ifp)) == NULL || !(state->added & STATE_ADDED))
+	if ((state = D_STATE(ifp)) == NULL || !(state->added & STATE_ADDED))
 		return 0;
-	return get_option_routes(routes, ifp, state->new, state->new_len);
+	if (!state->routes_valid) {
+		if (get_option_routes(ifp, state) == -1) {
+			state->routes_len = 0;
+			return -1;
+		}
+		state->routes_valid = true;
+	}
+
+	n = 0;
+	for (r = state->routes, re = r + state->routes_len; r != re; r++) {
+		if ((rt = rt_new(ifp)) == NULL)
+			return -1;
+		if (r->netmask.s_addr == INADDR_BROADCAST)
+			rt->rt_flags = RTF_HOST;
+		sa_in_init(&rt->rt_dest, &r->dest);
+		sa_in_init(&rt->rt_netmask, &r->netmask);
+		sa_in_init(&rt->rt_gateway, &r->gateway);
+		if (rt_proto_add(routes, rt))
+			n = 1;
+	}
+	return n;
 }
 
 /* Assumes DHCP options */
@@ -728,8 +936,23 @@ dhcp_message_add_addr(struct bootp *bootp,
 	return 0;
 }
 
+static void
+dhcp_setsecs(struct bootp *bootp, const struct dhcp_state *state)
+{
+	struct timespec tv;
+	unsigned long long secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	secs = eloop_timespec_diff(&tv, &state->started, NULL);
+	if (secs > UINT16_MAX)
+		bootp->secs = htons((uint16_t)UINT16_MAX);
+	else
+		bootp->secs = htons((uint16_t)secs);
+}
+
 static ssize_t
-make_message(struct bootp **bootpm, const struct interface *ifp, uint8_t type)
+make_message(struct bootp **bootpm, const struct interface *ifp, uint8_t type,
+    int mtu)
 {
 	struct bootp *bootp;
 	uint8_t *lp, *p, *e;
@@ -744,19 +967,10 @@ make_message(struct bootp **bootpm, const struct interface *ifp, uint8_t type)
 	char hbuf[HOSTNAME_MAX_LEN + 1];
 	const char *hostname;
 	const struct vivco *vivco;
-	int mtu;
 #ifdef AUTH
 	uint8_t *auth, auth_len;
 #endif
 
-	if ((mtu = if_getmtu(ifp)) == -1)
-		logerr("%s: if_getmtu", ifp->name);
-	else if (mtu < MTU_MIN) {
-		if (if_setmtu(ifp, MTU_MIN) == -1)
-			logerr("%s: if_setmtu", ifp->name);
-		mtu = MTU_MIN;
-	}
-
 	if (ifo->options & DHCPCD_BOOTP)
 		bootp = calloc(1, sizeof (*bootp));
 	else
@@ -788,17 +1002,8 @@ make_message(struct bootp **bootpm, const struct interface *ifp, uint8_t type)
 	    type != DHCP_RELEASE)
 		bootp->flags = htons(BROADCAST_FLAG);
 
-	if (type != DHCP_DECLINE && type != DHCP_RELEASE) {
-		struct timespec tv;
-		unsigned long long secs;
-
-		clock_gettime(CLOCK_MONOTONIC, &tv);
-		secs = eloop_timespec_diff(&tv, &state->started, NULL);
-		if (secs > UINT16_MAX)
-			bootp->secs = htons((uint16_t)UINT16_MAX);
-		else
-			bootp->secs = htons((uint16_t)secs);
-	}
+	if (type != DHCP_DECLINE && type != DHCP_RELEASE)
+		dhcp_setsecs(bootp, state);
 
 	bootp->xid = htonl(state->xid);
 
@@ -1136,6 +1341,123 @@ toobig:
 	return -1;
 }
 
+static struct dhcp_msgtmpl *
+dhcp_msgtmpl(struct dhcp_state *state, uint8_t type)
+{
+
+	switch (type) {
+	case DHCP_DISCOVER:
+		return &state->tmpl[0];
+	case DHCP_REQUEST:
+		return &state->tmpl[1];
+	case DHCP_INFORM:
+		return &state->tmpl[2];
+	default:
+		return NULL;
+	}
+}
+
+static void
+dhcp_freemsgtmpl(struct dhcp_state *state)
+{
+	size_t i;
+
+	for (i = 0; i < DHCP_MSGTMPL_MAX; i++) {
+		free(state->tmpl[i].bootp);
+		state->tmpl[i].bootp = NULL;
+	}
+}
+
+static void
+dhcp_makemsgkey(struct dhcp_msgkey *key, const struct interface *ifp, int mtu)
+{
+	const struct dhcp_state *state = D_CSTATE(ifp);
+	const struct if_options *ifo = ifp->options;
+
+	/* Zero padding as well so keys can be compared with memcmp. */
+	memset(key, 0, sizeof(*key));
+	key->ifo = ifo;
+	key->options = ifo->options | (ifp->ctx->options & DHCPCD_TEST);
+	key->mtu = mtu;
+	key->hwtype = ifp->hwtype;
+	key->hwlen = ifp->hwlen;
+	memcpy(key->hwaddr, ifp->hwaddr, sizeof(key->hwaddr));
+	if (state->addr != NULL) {
+		key->hasaddr = true;
+		key->addr = state->addr->addr;
+		key->mask = state->addr->mask;
+	}
+	key->newdhcp = state->new == NULL || IS_DHCP(state->new);
+	key->added = state->added;
+	key->lease.addr = state->lease.addr;
+	key->lease.mask = state->lease.mask;
+	key->lease.server = state->lease.server;
+	key->lease.cookie = state->lease.cookie;
+	if (dhcp_get_hostname(key->hostname, sizeof(key->hostname), ifo)
+	    == NULL)
+		memset(key->hostname, 0, sizeof(key->hostname));
+}
+
+/*
+ * Make a message to send.
+ * Messages we retransmit are kept per type and reused with just secs
+ * and xid patched while nothing else they were made from changes.
+ * If *tmplp is set on return the message belongs to the template.
+ */
+static ssize_t
+dhcp_message(struct bootp **bootpm, struct interface *ifp, uint8_t type,
+    bool *tmplp)
+{
+	struct dhcp_state *state = D_STATE(ifp);
+	const struct if_options *ifo = ifp->options;
+	struct dhcp_msgtmpl *tmpl;
+	struct dhcp_msgkey key;
+	ssize_t len;
+	int mtu;
+
+	*tmplp = false;
+	if ((mtu = if_getmtu(ifp)) == -1)
+		logerr("%s: if_getmtu", ifp->name);
+	else if (mtu < MTU_MIN) {
+		if (if_setmtu(ifp, MTU_MIN) == -1)
+			logerr("%s: if_setmtu", ifp->name);
+		mtu = MTU_MIN;
+	}
+
+	tmpl = dhcp_msgtmpl(state, type);
+	/* Authentication covers the whole message and changes each time. */
+	if (tmpl == NULL || ifo->options & DHCPCD_BOOTP
+#ifdef AUTH
+	    || ifo->auth.options & DHCPCD_AUTH_SEND
+#endif
+	    )
+		return make_message(bootpm, ifp, type, mtu);
+
+	dhcp_makemsgkey(&key, ifp, mtu);
+	if (tmpl->bootp != NULL &&
+	    memcmp(&tmpl->key, &key, sizeof(key)) == 0)
+	{
+		dhcp_setsecs(tmpl->bootp, state);
+		tmpl->bootp->xid = htonl(state->xid);
+		*bootpm = tmpl->bootp;
+		*tmplp = true;
+		return (ssize_t)tmpl->len;
+	}
+
+	free(tmpl->bootp);
+	tmpl->bootp = NULL;
+	len = make_message(&tmpl->bootp, ifp, type, mtu);
+	if (len == -1) {
+		tmpl->bootp = NULL;
+		return -1;
+	}
+	tmpl->len = (size_t)len;
+	tmpl->key = key;
+	*bootpm = tmpl->bootp;
+	*tmplp = true;
+	return len;
+}
+
 static size_t
 read_lease(struct interface *ifp, struct bootp **bootp)
 {
@@ -1144,6 +1466,7 @@ read_lease(struct interface *ifp, struct bootp **bootp)
 		uint8_t buf[FRAMELEN_MAX];
 	} buf;
 	struct dhcp_state *state = D_STATE(ifp);
+	const struct handoff_msg *hm;
 	ssize_t sbytes;
 	size_t bytes;
 	uint8_t type;
@@ -1158,6 +1481,15 @@ read_lease(struct interface *ifp, struct bootp **bootp)
 	if (state->leasefile[0] == '\0') {
 		logdebugx("reading standard input");
 		sbytes = read(fileno(stdin), buf.buf, sizeof(buf.buf));
+	} else if ((hm = handoff_find(ifp, HANDOFF_DHCP, NULL)) != NULL) {
+		logdebugx("%s: reading lease from handoff", ifp->name);
+		if (hm->len > sizeof(buf.buf)) {
+			errno = ENOBUFS;
+			sbytes = -1;
+		} else {
+			memcpy(buf.buf, hm->data, hm->len);
+			sbytes = (ssize_t)hm->len;
+		}
 	} else {
 		logdebugx("%s: reading lease: %s",
 		    ifp->name, state->leasefile);
@@ -1226,17 +1558,9 @@ out:
 static const struct dhcp_opt *
 dhcp_getoverride(const struct if_options *ifo, unsigned int o)
 {
-	size_t i;
-	const struct dhcp_opt *opt;
 
-	for (i = 0, opt = ifo->dhcp_override;
-	    i < ifo->dhcp_override_len;
-	    i++, opt++)
-	{
-		if (opt->option == o)
-			return opt;
-	}
-	return NULL;
+	return dhcp_optsearch(ifo->dhcp_overmap, NULL,
+	    ifo->dhcp_override, ifo->dhcp_override_len, o);
 }
 
 static const uint8_t *
@@ -1244,8 +1568,6 @@ dhcp_getoption(struct dhcpcd_ctx *ctx,
     size_t *os, unsigned int *code, size_t *len,
     const uint8_t *od, size_t ol, struct dhcp_opt **oopt)
 {
-	size_t i;
-	struct dhcp_opt *opt;
 
 	if (od) {
 		if (ol < 2) {
@@ -1261,19 +1583,13 @@ dhcp_getoption(struct dhcpcd_ctx *ctx,
 		}
 	}
 
-	*oopt = NULL;
-	for (i = 0, opt = ctx->dhcp_opts; i < ctx->dhcp_opts_len; i++, opt++) {
-		if (opt->option == *code) {
-			*oopt = opt;
-			break;
-		}
-	}
-
+	*oopt = dhcp_optsearch(ctx->dhcp_optmap, NULL,
+	    ctx->dhcp_opts, ctx->dhcp_opts_len, *code);
 	return od;
 }
 
-ssize_t
-dhcp_env(FILE *fenv, const char *prefix, const struct interface *ifp,
+static ssize_t
+dhcp_env1(FILE *fenv, const char *prefix, const struct interface *ifp,
     const struct bootp *bootp, size_t bootp_len)
 {
 	const struct if_options *ifo;
@@ -1394,14 +1710,29 @@ dhcp_env(FILE *fenv, const char *prefix, const struct interface *ifp,
 	return 1;
 }
 
+ssize_t
+dhcp_env(FILE *fenv, const char *prefix, const struct interface *ifp,
+    const struct bootp *bootp, size_t bootp_len)
+{
+	struct dhcp_optindex idx;
+	ssize_t r;
+
+	dhcp_optindex_push(ifp->ctx, &idx, bootp, bootp_len);
+	r = dhcp_env1(fenv, prefix, ifp, bootp, bootp_len);
+	dhcp_optindex_pop(ifp->ctx, &idx);
+	return r;
+}
+
 static void
 get_lease(struct interface *ifp,
     struct dhcp_lease *lease, const struct bootp *bootp, size_t len)
 {
 	struct dhcpcd_ctx *ctx;
+	struct dhcp_optindex idx;
 
 	assert(bootp != NULL);
 
+	dhcp_optindex_push(ifp->ctx, &idx, bootp, len);
 	memcpy(&lease->cookie, bootp->vend, sizeof(lease->cookie));
 	/* BOOTP does not set yiaddr for replies when ciaddr is set. */
 	lease->addr.s_addr = bootp->yiaddr ? bootp->yiaddr : bootp->ciaddr;
@@ -1443,6 +1774,7 @@ get_lease(struct interface *ifp,
 		lease->rebindtime = 0;
 	if (get_option_addr(ctx, &lease->server, bootp, len, DHO_SERVERID) != 0)
 		lease->server.s_addr = INADDR_ANY;
+	dhcp_optindex_pop(ifp->ctx, &idx);
 }
 
 static const char *
@@ -1482,7 +1814,7 @@ dhcp_new_xid(struct interface *ifp)
 		    sizeof(state->xid));
 	else {
 again:
-		state->xid = arc4random();
+		state->xid = rndpool_u32(ifp->ctx);
 	}
 
 	/* Ensure it's unique */
@@ -1505,15 +1837,25 @@ again:
 		goto again;
 	}
 
-	/* We can't do this when sharing leases across interfaes */
-#if 0
-	/* As the XID changes, re-apply the filter. */
-	if (state->bpf_fd != -1) {
-		if (bpf_bootp(ifp, state->bpf_fd) == -1)
-			logerr(__func__); /* try to continue */
-	}
-#endif
+	/* Match the new xid in the BPF filter.
+	 * A shared socket does not match the xid. */
+	if (state->bpf != NULL && !(state->bpf->bpf_flags & BPF_SHARED) &&
+	    bpf_bootp_xid(state->bpf) == -1)
+		logerr("%s: bpf_bootp_xid", ifp->name);
+}
+
+#ifdef BPF_SHARED_SOCKET
+static void
+dhcp_closesharedbpf(struct dhcpcd_ctx *ctx)
+{
+
+	if (ctx->dhcp_bpf == NULL || ctx->dhcp_bpf->bpf_refs != 0)
+		return;
+	eloop_event_delete(ctx->eloop, ctx->dhcp_bpf->bpf_fd);
+	bpf_close(ctx->dhcp_bpf);
+	ctx->dhcp_bpf = NULL;
 }
+#endif
 
 static void
 dhcp_closebpf(struct interface *ifp)
@@ -1526,11 +1868,21 @@ dhcp_closebpf(struct interface *ifp)
 		ps_bpf_closebootp(ifp);
 #endif
 
-	if (state->bpf != NULL) {
-		eloop_event_delete(ctx->eloop, state->bpf->bpf_fd);
+	if (state->bpf == NULL)
+		return;
+
+#ifdef BPF_SHARED_SOCKET
+	if (state->bpf->bpf_flags & BPF_SHARED) {
 		bpf_close(state->bpf);
 		state->bpf = NULL;
+		dhcp_closesharedbpf(ctx);
+		return;
 	}
+#endif
+
+	eloop_event_delete(ctx->eloop, state->bpf->bpf_fd);
+	bpf_close(state->bpf);
+	state->bpf = NULL;
 }
 
 static void
@@ -1607,21 +1959,45 @@ errexit:
 	return -1;
 }
 
+/*
+ * Sum 32 bits at a time into a 64 bit accumulator.
+ * One's complement addition doesn't care about byte order or where the
+ * carries land, so folding the result gives the same answer as summing
+ * 16 bit words, with a quarter of the loop iterations.
+ * The data may not be aligned, so load it via memcpy.
+ */
 static uint16_t
 in_cksum(const void *data, size_t len, uint32_t *isum)
 {
-	const uint16_t *word = data;
-	uint32_t sum = isum != NULL ? *isum : 0;
-
-	for (; len > 1; len -= sizeof(*word))
-		sum += *word++;
+	const uint8_t *p = data;
+	uint64_t sum = isum != NULL ? *isum : 0;
+	uint32_t w[4];
+	uint16_t w16;
 
+	for (; len >= sizeof(w); len -= sizeof(w), p += sizeof(w)) {
+		memcpy(w, p, sizeof(w));
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+	}
+	for (; len >= sizeof(w[0]); len -= sizeof(w[0]), p += sizeof(w[0])) {
+		memcpy(w, p, sizeof(w[0]));
+		sum += w[0];
+	}
+	if (len >= sizeof(w16)) {
+		memcpy(&w16, p, sizeof(w16));
+		sum += w16;
+		len -= sizeof(w16);
+		p += sizeof(w16);
+	}
 	if (len == 1)
-		sum += htons((uint16_t)(*(const uint8_t *)word << 8));
+		sum += htons((uint16_t)(*p << 8));
 
+	/* Fold to 32 bits so the caller can carry on summing. */
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
 	if (isum != NULL)
-		*isum = sum;
+		*isum = (uint32_t)sum;
 
+	sum = (sum >> 16) + (sum & 0xffff);
 	sum = (sum >> 16) + (sum & 0xffff);
 	sum += (sum >> 16);
 
@@ -1629,7 +2005,8 @@ in_cksum(const void *data, size_t len, uint32_t *isum)
 }
 
 static struct bootp_pkt *
-dhcp_makeudppacket(size_t *sz, const uint8_t *data, size_t length,
+dhcp_makeudppacket(struct dhcpcd_ctx *ctx, size_t *sz,
+	const uint8_t *data, size_t length,
 	struct in_addr source, struct in_addr dest)
 {
 	struct bootp_pkt *udpp;
@@ -1667,7 +2044,7 @@ dhcp_makeudppacket(size_t *sz, const uint8_t *data, size_t length,
 
 	ip->ip_v = IPVERSION;
 	ip->ip_hl = sizeof(*ip) >> 2;
-	ip->ip_id = (uint16_t)arc4random_uniform(UINT16_MAX);
+	ip->ip_id = (uint16_t)rndpool_uniform(ctx, UINT16_MAX);
 	ip->ip_ttl = IPDEFTTL;
 	ip->ip_len = htons((uint16_t)(sizeof(*ip) + sizeof(*udp) + length));
 	ip->ip_sum = in_cksum(ip, sizeof(*ip), NULL);
@@ -1713,6 +2090,42 @@ dhcp_sendudp(struct interface *ifp, struct in_addr *to, void *data, size_t len)
 	return sendmsg(ctx->udp_wfd, &msg, 0);
 }
 
+/* Seeded from what the server knows us by. */
+static uint32_t
+dhcp_spreadseed(const struct interface *ifp)
+{
+	const struct dhcp_state *state = D_CSTATE(ifp);
+
+	if (state->clientid != NULL)
+		return dhcp_spread_seed(DHCP_SPREAD_SEED,
+		    state->clientid + 1, state->clientid[0]);
+	return dhcp_spread_seed(DHCP_SPREAD_SEED, ifp->hwaddr, ifp->hwlen);
+}
+
+/* RFC 2131 4.4.5: wait half the time left until T2 when renewing,
+ * or until the lease expires when rebinding, down to 60 seconds.
+ * Retrying every 64 seconds for hours only adds to the load on a
+ * server which is already struggling. */
+static unsigned int
+dhcp_renewinterval(const struct dhcp_state *state)
+{
+	const struct timespec *deadline;
+	struct timespec now;
+	unsigned long long left;
+
+	deadline = state->state == DHS_REBIND ?
+	    &state->expire_at : &state->rebind_at;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec >= deadline->tv_sec)
+		return DHCP_RENEW_MIN_RT;
+	left = eloop_timespec_diff(deadline, &now, NULL) / 2;
+	if (left < DHCP_RENEW_MIN_RT)
+		return DHCP_RENEW_MIN_RT;
+	if (left > UINT_MAX / MSEC_PER_SEC - 1)
+		return UINT_MAX / MSEC_PER_SEC - 1;
+	return (unsigned int)left;
+}
+
 static void
 send_message(struct interface *ifp, uint8_t type,
     void (*callback)(void *))
@@ -1723,8 +2136,11 @@ send_message(struct interface *ifp, uint8_t type,
 	struct bootp_pkt *udp;
 	size_t len, ulen;
 	ssize_t r;
+	bool tmpl;
 	struct in_addr from, to;
 	unsigned int RT;
+	bool resend = false;
+	int stat;
 
 	if (callback == NULL) {
 		/* No carrier? Don't bother sending the packet. */
@@ -1739,12 +2155,17 @@ send_message(struct interface *ifp, uint8_t type,
 		if (state->interval == 0)
 			state->interval = 4;
 		else {
+			resend = true;
 			state->interval *= 2;
 			if (state->interval > 64)
 				state->interval = 64;
 		}
+		if (ifo->renew_spread != 0 &&
+		    (state->state == DHS_RENEW || state->state == DHS_REBIND))
+			state->interval = dhcp_renewinterval(state);
 		RT = (state->interval * MSEC_PER_SEC) +
-		    (arc4random_uniform(MSEC_PER_SEC * 2) - MSEC_PER_SEC);
+		    (rndpool_uniform(ifp->ctx, MSEC_PER_SEC * 2) -
+		    MSEC_PER_SEC);
 		/* No carrier? Don't bother sending the packet.
 		 * However, we do need to advance the timeout. */
 		if (!if_is_link_up(ifp))
@@ -1756,7 +2177,7 @@ send_message(struct interface *ifp, uint8_t type,
 		    (float)RT / MSEC_PER_SEC);
 	}
 
-	r = make_message(&bootp, ifp, type);
+	r = dhcp_message(&bootp, ifp, type, &tmpl);
 	if (r == -1)
 		goto fail;
 	len = (size_t)r;
@@ -1787,18 +2208,21 @@ send_message(struct interface *ifp, uint8_t type,
 	 * interface via IP_PKTINFO unlike for IPv6.
 	 */
 	if (to.s_addr != INADDR_BROADCAST) {
-		if (dhcp_sendudp(ifp, &to, bootp, len) != -1)
-			goto out;
+		if (dhcp_sendudp(ifp, &to, bootp, len) != -1) {
+			stat = IF_STAT_UDP;
+			goto sent;
+		}
 		logerr("%s: dhcp_sendudp", ifp->name);
 	}
 
 	if (dhcp_openbpf(ifp) == -1)
 		goto out;
 
-	udp = dhcp_makeudppacket(&ulen, (uint8_t *)bootp, len, from, to);
+	udp = dhcp_makeudppacket(ifp->ctx, &ulen, (uint8_t *)bootp, len,
+	    from, to);
 	if (udp == NULL) {
 		logerr("%s: dhcp_makeudppacket", ifp->name);
-		r = 0;
+		goto out;
 #ifdef PRIVSEP
 	} else if (ifp->ctx->options & DHCPCD_PRIVSEP) {
 		r = ps_bpf_sendbootp(ifp, udp, ulen);
@@ -1828,10 +2252,18 @@ send_message(struct interface *ifp, uint8_t type,
 			    NULL, ifp);
 			callback = NULL;
 		}
+		goto out;
 	}
+	stat = IF_STAT_BPF;
+
+sent:
+	ifp->stats.tx[stat]++;
+	if (resend)
+		ifp->stats.retrans[stat]++;
 
 out:
-	free(bootp);
+	if (!tmpl)
+		free(bootp);
 
 fail:
 	/* Even if we fail to send a packet we should continue as we are
@@ -1926,7 +2358,7 @@ dhcp_expire(void *arg)
 	} else {
 		logerrx("%s: DHCP lease expired", ifp->name);
 		dhcp_drop(ifp, "EXPIRE");
-		dhcp_unlink(ifp->ctx, state->leasefile);
+		dhcp_unlinklease(ifp, &state->leasesave, state->leasefile);
 	}
 	state->interval = 0;
 	dhcp_discover(ifp);
@@ -2017,10 +2449,12 @@ dhcp_finish_dad(struct interface *ifp, struct in_addr *ia)
 		len = state->new_len;
 		state->new = state->offer;
 		state->new_len = state->offer_len;
+		state->routes_valid = false;
 		get_lease(ifp, &state->lease, state->new, state->new_len);
 		ipv4_applyaddr(ifp);
 		state->new = bootp;
 		state->new_len = len;
+		state->routes_valid = false;
 	}
 #endif
 
@@ -2051,7 +2485,7 @@ dhcp_addr_duplicated(struct interface *ifp, struct in_addr *ia)
 
 	/* RFC 2131 3.1.5, Client-server interaction */
 	logerrx("%s: DAD detected %s", ifp->name, inet_ntoa(*ia));
-	dhcp_unlink(ifp->ctx, state->leasefile);
+	dhcp_unlinklease(ifp, &state->leasesave, state->leasefile);
 	if (!(opts & DHCPCD_STATIC) && !state->lease.frominfo)
 		dhcp_decline(ifp);
 #ifdef IN_IFF_DUPLICATED
@@ -2228,11 +2662,14 @@ dhcp_bind(struct interface *ifp)
 	/* If we don't have an offer, we are re-binding a lease on preference,
 	 * normally when two interfaces have a lease matching IP addresses. */
 	if (state->offer) {
-		free(state->old);
+		free(state->spare);
+		state->spare = state->old;
+		state->spare_len = state->old_len;
 		state->old = state->new;
 		state->old_len = state->new_len;
 		state->new = state->offer;
 		state->new_len = state->offer_len;
+		state->routes_valid = false;
 		state->offer = NULL;
 		state->offer_len = 0;
 	}
@@ -2250,7 +2687,7 @@ dhcp_bind(struct interface *ifp)
 		state->reason = "INFORM";
 	} else {
 		if (lease->frominfo)
-			state->reason = "TIMEOUT";
+			state->reason = ifp->warm ? "REBOOT" : "TIMEOUT";
 		if (lease->leasetime == DHCP_INFINITE_LIFETIME) {
 			lease->renewaltime =
 			    lease->rebindtime =
@@ -2283,6 +2720,10 @@ dhcp_bind(struct interface *ifp)
 				    "rebind time, forcing to %"PRIu32" seconds",
 				    ifp->name, lease->renewaltime);
 			}
+			if (ifo->renew_spread != 0)
+				dhcp_spread_timers(&lease->renewaltime,
+				    &lease->rebindtime, lease->leasetime,
+				    ifo->renew_spread, dhcp_spreadseed(ifp));
 			if (state->state == DHS_RENEW && state->addr &&
 			    lease->addr.s_addr == state->addr->addr.s_addr &&
 			    !(state->added & STATE_FAKE))
@@ -2316,15 +2757,39 @@ dhcp_bind(struct interface *ifp)
 		else
 			state->reason = "BOUND";
 	}
+	if (!lease->frominfo)
+		clock_gettime(CLOCK_MONOTONIC, &state->bound);
+	else if (ifp->warm && lease->leasetime != DHCP_INFINITE_LIFETIME) {
+		struct timespec now;
+		uint32_t elapsed;
+
+		/* Resumed, so only what is left of the lease counts. */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (uint32_t)eloop_timespec_diff(&now,
+		    &state->bound, NULL);
+		lease->renewaltime = lease->renewaltime > elapsed ?
+		    lease->renewaltime - elapsed : 0;
+		lease->rebindtime = lease->rebindtime > elapsed ?
+		    lease->rebindtime - elapsed : 0;
+		lease->leasetime = lease->leasetime > elapsed ?
+		    lease->leasetime - elapsed : 0;
+	}
 	if (lease->leasetime == DHCP_INFINITE_LIFETIME)
 		lease->renewaltime = lease->rebindtime = lease->leasetime;
 	else {
-		eloop_timeout_add_sec(ctx->eloop,
-		    lease->renewaltime, dhcp_startrenew, ifp);
+		dhcp_renew_timeout(ctx->eloop, lease->renewaltime,
+		    lease->rebindtime, ifo->timer_slack,
+		    dhcp_startrenew, ifp);
 		eloop_timeout_add_sec(ctx->eloop,
 		    lease->rebindtime, dhcp_rebind, ifp);
 		eloop_timeout_add_sec(ctx->eloop,
 		    lease->leasetime, dhcp_expire, ifp);
+		if (ifo->renew_spread != 0) {
+			clock_gettime(CLOCK_MONOTONIC, &state->rebind_at);
+			state->expire_at = state->rebind_at;
+			state->rebind_at.tv_sec += (time_t)lease->rebindtime;
+			state->expire_at.tv_sec += (time_t)lease->leasetime;
+		}
 		logdebugx("%s: renew in %"PRIu32" seconds, rebind in %"PRIu32
 		    " seconds",
 		    ifp->name, lease->renewaltime, lease->rebindtime);
@@ -2332,11 +2797,9 @@ dhcp_bind(struct interface *ifp)
 	state->state = DHS_BOUND;
 	if (!state->lease.frominfo &&
 	    !(ifo->options & (DHCPCD_INFORM | DHCPCD_STATIC))) {
-		logdebugx("%s: writing lease: %s",
-		    ifp->name, state->leasefile);
-		if (dhcp_writefile(ifp->ctx, state->leasefile, 0640,
-		    state->new, state->new_len) == -1)
-			logerr("dhcp_writefile: %s", state->leasefile);
+		dhcp_savelease(ifp, &state->leasesave, state->leasefile,
+		    state->new, state->new_len,
+		    offsetof(struct bootp, xid), sizeof(state->new->xid));
 	}
 
 	old_state = state->added;
@@ -2345,7 +2808,7 @@ dhcp_bind(struct interface *ifp)
 		struct ipv4_addr *ia;
 
 		script_runreason(ifp, state->reason);
-		dhcpcd_daemonise(ifp->ctx);
+		dhcpcd_bound(ifp);
 
 		/* We we are not configuring the address, we need to keep
 		 * the BPF socket open if the address does not exist. */
@@ -2626,6 +3089,8 @@ dhcp_reboot_newopts(struct interface *ifp, unsigned long long oldopts)
 
 	if (state == NULL || state->state == DHS_NONE)
 		return;
+	dhcp_freemsgtmpl(state);
+	state->routes_valid = false;
 	ifo = ifp->options;
 	if ((ifo->options & (DHCPCD_INFORM | DHCPCD_STATIC) &&
 		(state->addr == NULL ||
@@ -2776,7 +3241,7 @@ dhcp_drop(struct interface *ifp, const char *reason)
 			return;
 		state->state = DHS_RELEASE;
 
-		dhcp_unlink(ifp->ctx, state->leasefile);
+		dhcp_unlinklease(ifp, &state->leasesave, state->leasefile);
 		if (if_is_link_up(ifp) &&
 		    state->new != NULL &&
 		    state->lease.server.s_addr != INADDR_ANY)
@@ -2796,7 +3261,7 @@ dhcp_drop(struct interface *ifp, const char *reason)
 		 * If dhcpcd is restarted, the token is lost.
 		 * XXX persist this in another file?
 		 */
-		dhcp_unlink(ifp->ctx, state->leasefile);
+		dhcp_unlinklease(ifp, &state->leasesave, state->leasefile);
 	}
 #endif
 
@@ -2814,6 +3279,7 @@ dhcp_drop(struct interface *ifp, const char *reason)
 	state->old_len = state->new_len;
 	state->new = NULL;
 	state->new_len = 0;
+	state->routes_valid = false;
 	state->reason = reason;
 	if (ifp->options->options & DHCPCD_CONFIGURE)
 		ipv4_applyaddr(ifp);
@@ -2958,6 +3424,32 @@ dhcp_redirect_dhcp(struct interface *ifp, struct bootp *bootp, size_t bootp_len,
 	}
 }
 
+/* Keep a copy of the reply as our offer.
+ * Reuse the current offer or the message recycled by dhcp_bind
+ * so a lease exchange doesn't allocate for each reply. */
+static int
+dhcp_saveoffer(struct dhcp_state *state, const struct bootp *bootp,
+    size_t bootp_len)
+{
+
+	if (state->offer == NULL && state->spare != NULL) {
+		state->offer = state->spare;
+		state->offer_len = state->spare_len;
+		state->spare = NULL;
+		state->spare_len = 0;
+	}
+	if (state->offer_len < bootp_len) {
+		free(state->offer);
+		if ((state->offer = malloc(bootp_len)) == NULL) {
+			state->offer_len = 0;
+			return -1;
+		}
+	}
+	state->offer_len = bootp_len;
+	memcpy(state->offer, bootp, bootp_len);
+	return 0;
+}
+
 static void
 dhcp_handledhcp(struct interface *ifp, struct bootp *bootp, size_t bootp_len,
     const struct in_addr *from)
@@ -2996,6 +3488,7 @@ dhcp_handledhcp(struct interface *ifp, struct bootp *bootp, size_t bootp_len,
 	}
 
 	if (state->xid != ntohl(bootp->xid)) {
+		ifp->stats.xid_mismatch++;
 		if (IS_STATE_ACTIVE(state))
 			logdebugx("%s: wrong xid 0x%x (expecting 0x%x) from %s",
 			    ifp->name, ntohl(bootp->xid), state->xid,
@@ -3047,6 +3540,8 @@ dhcp_handledhcp(struct interface *ifp, struct bootp *bootp, size_t bootp_len,
 		    ifp->name);
 		return;
 	}
+	TRACE_EVENT(ifp->ctx, TRACE_DHCP_RECV, ifp,
+	    (uint32_t)type << 8 | state->state);
 
 #ifdef AUTH
 	/* Authenticate the message */
@@ -3155,7 +3650,8 @@ dhcp_handledhcp(struct interface *ifp, struct bootp *bootp, size_t bootp_len,
 			return;
 		if (!(ifp->ctx->options & DHCPCD_TEST)) {
 			dhcp_drop(ifp, "NAK");
-			dhcp_unlink(ifp->ctx, state->leasefile);
+			dhcp_unlinklease(ifp, &state->leasesave,
+			    state->leasefile);
 		}
 
 		/* If we constantly get NAKS then we should slowly back off */
@@ -3249,7 +3745,7 @@ dhcp_handledhcp(struct interface *ifp, struct bootp *bootp, size_t bootp_len,
 
 	if (use_v6only) {
 		dhcp_drop(ifp, "EXPIRE");
-		dhcp_unlink(ifp->ctx, state->leasefile);
+		dhcp_unlinklease(ifp, &state->leasesave, state->leasefile);
 		eloop_timeout_delete(ifp->ctx->eloop, NULL, ifp);
 		eloop_timeout_add_sec(ifp->ctx->eloop, v6only_time,
 		    dhcp_discover, ifp);
@@ -3301,16 +3797,10 @@ dhcp_handledhcp(struct interface *ifp, struct bootp *bootp, size_t bootp_len,
 		}
 
 		LOGDHCP(LOG_INFO, "offered");
-		if (state->offer_len < bootp_len) {
-			free(state->offer);
-			if ((state->offer = malloc(bootp_len)) == NULL) {
-				logerr(__func__);
-				state->offer_len = 0;
-				return;
-			}
+		if (dhcp_saveoffer(state, bootp, bootp_len) == -1) {
+			logerr(__func__);
+			return;
 		}
-		state->offer_len = bootp_len;
-		memcpy(state->offer, bootp, bootp_len);
 		bootp_copied = true;
 		if (ifp->ctx->options & DHCPCD_TEST) {
 			free(state->old);
@@ -3318,6 +3808,7 @@ dhcp_handledhcp(struct interface *ifp, struct bootp *bootp, size_t bootp_len,
 			state->old_len = state->new_len;
 			state->new = state->offer;
 			state->new_len = state->offer_len;
+			state->routes_valid = false;
 			state->offer = NULL;
 			state->offer_len = 0;
 			state->reason = "TEST";
@@ -3378,17 +3869,9 @@ rapidcommit:
 	state->nakoff = 0;
 
 	/* BOOTP could have already assigned this above. */
-	if (!bootp_copied) {
-		if (state->offer_len < bootp_len) {
-			free(state->offer);
-			if ((state->offer = malloc(bootp_len)) == NULL) {
-				logerr(__func__);
-				state->offer_len = 0;
-				return;
-			}
-		}
-		state->offer_len = bootp_len;
-		memcpy(state->offer, bootp, bootp_len);
+	if (!bootp_copied && dhcp_saveoffer(state, bootp, bootp_len) == -1) {
+		logerr(__func__);
+		return;
 	}
 
 	lease->frominfo = 0;
@@ -3513,6 +3996,8 @@ static void
 dhcp_handlebootp(struct interface *ifp, struct bootp *bootp, size_t len,
     struct in_addr *from)
 {
+	struct dhcpcd_ctx *ctx;
+	struct dhcp_optindex idx;
 	size_t v;
 
 	if (len < offsetof(struct bootp, vend)) {
@@ -3536,7 +4021,12 @@ dhcp_handlebootp(struct interface *ifp, struct bootp *bootp, size_t len,
 		len++;
 	}
 
+	/* ifp may not survive handling the message, but ctx will. */
+	ctx = ifp->ctx;
+	dhcp_optindex_push(ctx, &idx, bootp, len);
 	dhcp_handledhcp(ifp, bootp, len, from);
+	dhcp_optindex_pop(ctx, &idx);
+	MEMSAMPLE(ctx, MEM_LEASE);
 }
 
 void
@@ -3572,11 +4062,14 @@ dhcp_packet(struct interface *ifp, uint8_t *data, size_t len,
 	}
 #endif
 
+	ifp->stats.rx[IF_STAT_BPF]++;
+
 	/* Trim frame header */
 	if (fl != 0) {
 		if (len < fl) {
 			logerrx("%s: %s: short frame header %zu",
 			    __func__, ifp->name, len);
+			ifp->stats.dropped[IF_STAT_BPF]++;
 			return;
 		}
 		len -= fl;
@@ -3589,12 +4082,15 @@ dhcp_packet(struct interface *ifp, uint8_t *data, size_t len,
 #ifdef BPF_DEBUG
 		logerrx("%s: DHCP BPF validation failure", ifp->name);
 #endif
+		ifp->stats.dropped[IF_STAT_BPF]++;
 		return;
 	}
 
 	if (!checksums_valid(data, &from, bpf_flags)) {
 		logerrx("%s: checksum failure from %s",
 		    ifp->name, inet_ntoa(from));
+		ifp->stats.cksum_fail++;
+		ifp->stats.dropped[IF_STAT_BPF]++;
 		return;
 	}
 
@@ -3640,6 +4136,61 @@ dhcp_readbpf(void *arg, unsigned short events)
 	}
 }
 
+#ifdef BPF_SHARED_SOCKET
+static void
+dhcp_readsharedbpf(void *arg, unsigned short events)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	struct bpf *bpf = ctx->dhcp_bpf;
+	struct interface *ifp;
+	const struct dhcp_state *state;
+	uint8_t buf[FRAMELEN_MAX];
+	ssize_t bytes;
+
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	bpf->bpf_flags &= ~BPF_EOF;
+	while (!(bpf->bpf_flags & BPF_EOF)) {
+		bytes = bpf_read(bpf, buf, sizeof(buf));
+		if (bytes == -1) {
+			logerr(__func__);
+			break;
+		}
+		/* Only pass it on if the interface is using this socket. */
+		ifp = if_findindex(ctx->ifaces, bpf->bpf_ifindex);
+		state = ifp != NULL ? D_CSTATE(ifp) : NULL;
+		if (state != NULL && state->bpf != NULL &&
+		    state->bpf->bpf_flags & BPF_SHARED)
+			dhcp_packet(ifp, buf, (size_t)bytes, bpf->bpf_flags);
+		/* The last interface may have closed it. */
+		if ((bpf = ctx->dhcp_bpf) == NULL)
+			break;
+	}
+}
+
+static struct bpf *
+dhcp_opensharedbpf(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct bpf *bpf;
+
+	if (ctx->dhcp_bpf == NULL) {
+		ctx->dhcp_bpf = bpf_open(ctx, NULL, bpf_bootp, NULL);
+		if (ctx->dhcp_bpf == NULL)
+			return NULL;
+		if (eloop_event_add(ctx->eloop, ctx->dhcp_bpf->bpf_fd,
+		    ELE_READ, dhcp_readsharedbpf, ctx) == -1)
+			logerr("%s: eloop_event_add", __func__);
+	}
+
+	bpf = bpf_share(ctx->dhcp_bpf, ifp);
+	if (bpf == NULL)
+		dhcp_closesharedbpf(ctx);
+	return bpf;
+}
+#endif
+
 void
 dhcp_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg)
 {
@@ -3653,6 +4204,7 @@ dhcp_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg)
 		logerr(__func__);
 		return;
 	}
+	ifp->stats.rx[IF_STAT_UDP]++;
 	state = D_CSTATE(ifp);
 	if (state == NULL) {
 		/* Try re-directing it to another interface. */
@@ -3663,6 +4215,7 @@ dhcp_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg)
 
 	if (state->bpf != NULL) {
 		/* Avoid a duplicate read if BPF is open for the interface. */
+		ifp->stats.dropped[IF_STAT_UDP]++;
 		return;
 	}
 #ifdef PRIVSEP
@@ -3768,7 +4321,13 @@ dhcp_openbpf(struct interface *ifp)
 	if (state->bpf != NULL)
 		return 0;
 
-	state->bpf = bpf_open(ifp, bpf_bootp, NULL);
+#ifdef BPF_SHARED_SOCKET
+	if (ifp->ctx->options & DHCPCD_SHARED_BPF &&
+	    ifp->hwtype == ARPHRD_ETHER)
+		state->bpf = dhcp_opensharedbpf(ifp);
+	else
+#endif
+	state->bpf = bpf_open(ifp->ctx, ifp, bpf_bootp, NULL);
 	if (state->bpf == NULL) {
 		if (errno == ENOENT) {
 			logerrx("%s not found", bpf_name);
@@ -3780,6 +4339,10 @@ dhcp_openbpf(struct interface *ifp)
 		return -1;
 	}
 
+	/* A shared socket is read by dhcp_readsharedbpf. */
+	if (state->bpf->bpf_flags & BPF_SHARED)
+		return 0;
+
 	if (eloop_event_add(ifp->ctx->eloop, state->bpf->bpf_fd, ELE_READ,
 	    dhcp_readbpf, ifp) == -1)
 		logerr("%s: eloop_event_add", __func__);
@@ -3798,10 +4361,15 @@ dhcp_free(struct interface *ifp)
 #endif
 	if (state) {
 		state->state = DHS_NONE;
+		dhcp_flushlease(ifp, &state->leasesave, state->leasefile, true);
+		dhcp_forgetlease(&state->leasesave);
 		free(state->old);
 		free(state->new);
 		free(state->offer);
+		free(state->spare);
 		free(state->clientid);
+		free(state->routes);
+		dhcp_freemsgtmpl(state);
 		free(state);
 	}
 
@@ -3876,10 +4444,12 @@ dhcp_init(struct interface *ifp)
 	/* We need to drop the leasefile so that dhcp_start
 	 * doesn't load it. */
 	if (ifo->options & DHCPCD_REQUEST)
-		dhcp_unlink(ifp->ctx, state->leasefile);
+		dhcp_unlinklease(ifp, &state->leasesave, state->leasefile);
 
 	free(state->clientid);
 	state->clientid = NULL;
+	dhcp_freemsgtmpl(state);
+	state->routes_valid = false;
 
 	if (ifo->options & DHCPCD_ANONYMOUS) {
 		/* Removing the option could show that we want anonymous.
@@ -3940,6 +4510,7 @@ dhcp_start1(void *arg)
 	struct dhcpcd_ctx *ctx = ifp->ctx;
 	struct if_options *ifo = ifp->options;
 	struct dhcp_state *state;
+	const struct handoff_msg *hm = NULL;
 	uint32_t l;
 	int nolease;
 
@@ -3962,6 +4533,12 @@ dhcp_start1(void *arg)
 		    dhcp_handleudp, ctx) == -1)
 			logerr("%s: eloop_event_add", __func__);
 	}
+#ifdef PRIVSEP
+	if ((ctx->options & (DHCPCD_MANAGER|DHCPCD_PRIVSEP)) ==
+	    (DHCPCD_MANAGER|DHCPCD_PRIVSEP) &&
+	    ps_inet_listen(ctx, PS_BOOTP) == -1)
+		logerr("%s: ps_inet_listen", __func__);
+#endif
 	if (!IN_PRIVSEP(ctx) && ctx->udp_wfd == -1) {
 		ctx->udp_wfd = xsocket(PF_INET, SOCK_RAW|SOCK_CXNB,IPPROTO_UDP);
 		if (ctx->udp_wfd == -1) {
@@ -4003,6 +4580,7 @@ dhcp_start1(void *arg)
 	nolease = state->offer && ifp->ctx->options & DHCPCD_TEST;
 	if (!nolease && ifo->options & DHCPCD_DHCP) {
 		state->offer_len = read_lease(ifp, &state->offer);
+		MEMSAMPLE(ifp->ctx, MEM_LEASE);
 		/* Check the saved lease matches the type we want */
 		if (state->offer) {
 #ifdef IN_IFF_DUPLICATED
@@ -4033,6 +4611,16 @@ dhcp_start1(void *arg)
 
 		get_lease(ifp, &state->lease, state->offer, state->offer_len);
 		state->lease.frominfo = 1;
+		hm = handoff_find(ifp, HANDOFF_DHCP, NULL);
+		if (hm != NULL)
+			state->bound = hm->acquired;
+		else if (dhcp_filemtime(ifp->ctx, state->leasefile,
+		    &mtime) == 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &state->bound);
+			state->bound.tv_sec -= time(NULL) - mtime;
+		} else
+			clock_gettime(CLOCK_MONOTONIC, &state->bound);
 		if (state->new == NULL &&
 		    (ia = ipv4_iffindaddr(ifp,
 		    &state->lease.addr, &state->lease.mask)) != NULL)
@@ -4045,9 +4633,10 @@ dhcp_start1(void *arg)
 				memcpy(state->new,
 				    state->offer, state->offer_len);
 				state->new_len = state->offer_len;
+				state->routes_valid = false;
 				state->addr = ia;
 				state->added |= STATE_ADDED | STATE_FAKE;
-				rt_build(ifp->ctx, AF_INET);
+				rt_deferif(ifp, AF_INET);
 			} else
 				logerr(__func__);
 		}
@@ -4056,16 +4645,15 @@ dhcp_start1(void *arg)
 			state->offer = NULL;
 			state->offer_len = 0;
 		} else if (!(ifo->options & DHCPCD_LASTLEASE_EXTEND) &&
-		    state->lease.leasetime != DHCP_INFINITE_LIFETIME &&
-		    dhcp_filemtime(ifp->ctx, state->leasefile, &mtime) == 0)
+		    state->lease.leasetime != DHCP_INFINITE_LIFETIME)
 		{
-			time_t now;
+			struct timespec now;
 
 			/* Offset lease times and check expiry */
-			now = time(NULL);
-			if (now == -1 ||
-			    (time_t)state->lease.leasetime < now - mtime)
-			{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			l = (uint32_t)eloop_timespec_diff(&now,
+			    &state->bound, NULL);
+			if (state->lease.leasetime < l) {
 				logdebugx("%s: discarding expired lease",
 				    ifp->name);
 				free(state->offer);
@@ -4089,7 +4677,6 @@ dhcp_start1(void *arg)
 					dhcp_drop(ifp, "EXPIRE");
 #endif
 			} else {
-				l = (uint32_t)(now - mtime);
 				state->lease.leasetime -= l;
 				state->lease.renewaltime -= l;
 				state->lease.rebindtime -= l;
@@ -4097,6 +4684,20 @@ dhcp_start1(void *arg)
 		}
 	}
 
+	/* The address is still there from the last dhcpcd,
+	 * so carry on where it left off. */
+	if (hm != NULL && state->offer != NULL &&
+	    state->added & STATE_FAKE &&
+	    !(ifo->options & DHCPCD_ANONYMOUS))
+	{
+		bool warm = ifp->warm;
+
+		ifp->warm = true;
+		dhcp_bind(ifp);
+		ifp->warm = warm;
+		return;
+	}
+
 #ifdef IPV4LL
 	if (!(ifo->options & DHCPCD_DHCP)) {
 		if (ifo->options & DHCPCD_IPV4LL)
@@ -4155,9 +4756,11 @@ dhcp_start(struct interface *ifp)
 	if (ifp->options->options & DHCPCD_LASTLEASE_EXTEND)
 		ifp->options->options |= DHCPCD_ARP;
 
-	/* No point in delaying a static configuration */
+	/* No point in delaying a static configuration
+	 * or a lease we are resuming. */
 	if (ifp->options->options & DHCPCD_STATIC ||
-	    !(ifp->options->options & DHCPCD_INITIAL_DELAY))
+	    !(ifp->options->options & DHCPCD_INITIAL_DELAY) ||
+	    handoff_find(ifp, HANDOFF_DHCP, NULL) != NULL)
 	{
 		dhcp_start1(ifp);
 		return;
@@ -4172,7 +4775,7 @@ dhcp_start(struct interface *ifp)
 	}
 #endif
 	delay = MSEC_PER_SEC +
-		(arc4random_uniform(MSEC_PER_SEC * 2) - MSEC_PER_SEC);
+		(rndpool_uniform(ifp->ctx, MSEC_PER_SEC * 2) - MSEC_PER_SEC);
 	logdebugx("%s: delaying IPv4 for %0.1f seconds",
 	    ifp->name, (float)delay / MSEC_PER_SEC);
 
@@ -4193,7 +4796,7 @@ dhcp_abort(struct interface *ifp)
 	eloop_timeout_delete(ifp->ctx->eloop, dhcp_start1, ifp);
 
 	if (state != NULL && state->added) {
-		rt_build(ifp->ctx, AF_INET);
+		rt_deferif(ifp, AF_INET);
 #ifdef ARP
 		if (ifp->options->options & DHCPCD_ARP)
 			arp_announceaddr(ifp->ctx, &state->addr->addr);
@@ -4273,6 +4876,7 @@ dhcp_handleifa(int cmd, struct ipv4_addr *ia, pid_t pid)
 	free(state->old);
 	state->old = state->new;
 	state->new_len = dhcp_message_new(&state->new, &ia->addr, &ia->mask);
+	state->routes_valid = false;
 	if (state->new == NULL)
 		return ia;
 
@@ -4283,7 +4887,7 @@ dhcp_handleifa(int cmd, struct ipv4_addr *ia, pid_t pid)
 	}
 
 	state->reason = "STATIC";
-	rt_build(ifp->ctx, AF_INET);
+	rt_deferif(ifp, AF_INET);
 	script_runreason(ifp, state->reason);
 
 	return ia;
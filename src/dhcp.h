@@ -38,6 +38,7 @@
 #undef __FAVOR_BSD
 
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "arp.h"
@@ -74,6 +75,7 @@
 #define DHCP_MAX		64
 #define DHCP_RAND_MIN		-1
 #define DHCP_RAND_MAX		1
+#define DHCP_RENEW_MIN_RT	60
 
 #ifdef RFC2131_STRICT
 /* Be strictly conformant for section 4.1.1 */
@@ -193,6 +195,32 @@ struct dhcp_lease {
 #  define DHCP_INFINITE_LIFETIME	(~0U)
 #endif
 
+/* What a cached message was made from, see dhcp_message. */
+struct dhcp_msgkey {
+	const struct if_options *ifo;
+	unsigned long long options;
+	int mtu;
+	uint16_t hwtype;
+	uint8_t hwlen;
+	uint8_t hwaddr[HWADDR_LEN];
+	bool hasaddr;
+	bool newdhcp;
+	uint8_t added;
+	struct in_addr addr;
+	struct in_addr mask;
+	struct dhcp_lease lease;
+	char hostname[HOSTNAME_MAX_LEN + 1];
+};
+
+struct dhcp_msgtmpl {
+	struct bootp *bootp;
+	size_t len;
+	struct dhcp_msgkey key;
+};
+
+/* DISCOVER, REQUEST and INFORM are retransmitted */
+#define	DHCP_MSGTMPL_MAX	3
+
 enum DHS {
 	DHS_NONE,
 	DHS_INIT,
@@ -208,6 +236,13 @@ enum DHS {
 	DHS_RELEASE
 };
 
+/* A route from the lease, see dhcp_get_routes */
+struct dhcp_route {
+	struct in_addr dest;
+	struct in_addr netmask;
+	struct in_addr gateway;
+};
+
 struct dhcp_state {
 	enum DHS state;
 	struct bootp *sent;
@@ -218,6 +253,8 @@ struct dhcp_state {
 	size_t new_len;
 	struct bootp *old;
 	size_t old_len;
+	struct bootp *spare;	/* recycled old, reused for the next offer */
+	size_t spare_len;
 	struct dhcp_lease lease;
 	const char *reason;
 	unsigned int interval;
@@ -230,8 +267,18 @@ struct dhcp_state {
 	struct ipv4_addr *addr;
 	uint8_t added;
 
+	struct dhcp_msgtmpl tmpl[DHCP_MSGTMPL_MAX];
+	struct dhcp_route *routes;	/* decoded from new */
+	size_t routes_len;
+	size_t routes_size;
+	bool routes_valid;
+
 	char leasefile[sizeof(LEASEFILE) + IF_NAMESIZE + (IF_SSIDLEN * 4)];
+	struct dhcp_leasesave leasesave;
 	struct timespec started;
+	struct timespec bound;	/* when the lease in new was acquired */
+	struct timespec rebind_at;	/* for renew_spread retransmits */
+	struct timespec expire_at;
 	unsigned char *clientid;
 	struct authstate auth;
 #ifdef ARPING
@@ -255,8 +302,8 @@ struct dhcp_state {
 #include "dhcpcd.h"
 #include "if-options.h"
 
-ssize_t print_rfc3361(FILE *, const uint8_t *, size_t);
-ssize_t print_rfc3442(FILE *, const uint8_t *, size_t);
+ssize_t print_rfc3361(struct dhcpcd_ctx *, const uint8_t *, size_t);
+ssize_t print_rfc3442(struct dhcpcd_ctx *, const uint8_t *, size_t);
 
 int dhcp_openudp(struct in_addr *);
 void dhcp_packet(struct interface *, uint8_t *, size_t, unsigned int);
@@ -52,6 +52,7 @@
 #include "dhcp6.h"
 #include "duid.h"
 #include "eloop.h"
+#include "handoff.h"
 #include "if.h"
 #include "if-options.h"
 #include "ipv6nd.h"
@@ -321,12 +322,249 @@ dhcp6_makevendor(void *data, const struct interface *ifp)
 	return sizeof(o) + len;
 }
 
+/*
+ * An index of the options in a DHCPv6 message, including those nested in
+ * IA, IA Address and IA Prefix options, built in one pass over it.
+ * While pushed onto ctx, dhcp6_findoption answers lookups which start at
+ * an option of the message from the index rather than walking the options.
+ */
+#define	DHCP6_OPTINDEX_DEPTH	3
+
+struct dhcp6_optent {
+	uint32_t off;		/* of the option header in the message */
+	uint32_t region;
+	uint16_t code;
+	uint16_t len;
+};
+
+struct dhcp6_optregion {
+	uint32_t end;
+	int error;
+};
+
+struct dhcp6_optindex {
+	struct dhcp6_optindex *prev;
+	const uint8_t *msg;
+	size_t msg_len;
+	struct dhcp6_optent *ents;	/* in message order */
+	struct dhcp6_optent *bycode;	/* by region, code then order */
+	size_t ents_len, ents_size;
+	struct dhcp6_optregion *regions;
+	size_t regions_len, regions_size;
+};
+
+static int
+dhcp6_optindex_region(struct dhcp6_optindex *idx,
+    size_t off, size_t end, unsigned int depth)
+{
+	struct dhcp6_option o;
+	struct dhcp6_optent *ent;
+	struct dhcp6_optregion *rg;
+	size_t region, nl;
+	void *n;
+
+	if (idx->regions_len == idx->regions_size) {
+		n = reallocarray(idx->regions, idx->regions_size + 8,
+		    sizeof(*idx->regions));
+		if (n == NULL)
+			return -1;
+		idx->regions = n;
+		idx->regions_size += 8;
+	}
+	region = idx->regions_len++;
+	rg = &idx->regions[region];
+	rg->end = (uint32_t)end;
+	rg->error = 0;
+
+	while (off != end) {
+		if (end - off < sizeof(o)) {
+			idx->regions[region].error = EINVAL;
+			break;
+		}
+		memcpy(&o, idx->msg + off, sizeof(o));
+		o.len = ntohs(o.len);
+		o.code = ntohs(o.code);
+		if (end - off - sizeof(o) < o.len) {
+			idx->regions[region].error = EINVAL;
+			break;
+		}
+
+		if (idx->ents_len == idx->ents_size) {
+			n = reallocarray(idx->ents, idx->ents_size + 32,
+			    sizeof(*idx->ents));
+			if (n == NULL)
+				return -1;
+			idx->ents = n;
+			idx->ents_size += 32;
+		}
+		ent = &idx->ents[idx->ents_len++];
+		ent->off = (uint32_t)off;
+		ent->region = (uint32_t)region;
+		ent->code = o.code;
+		ent->len = o.len;
+		off += sizeof(o);
+
+		switch (o.code) {
+		case D6_OPTION_IA_TA:
+			nl = 4;
+			break;
+		case D6_OPTION_IA_NA:
+		case D6_OPTION_IA_PD:
+			nl = 12;
+			break;
+		case D6_OPTION_IA_ADDR:
+			nl = sizeof(struct dhcp6_ia_addr);
+			break;
+		case D6_OPTION_IAPREFIX:
+			nl = sizeof(struct dhcp6_pd_addr);
+			break;
+		default:
+			nl = 0;
+			break;
+		}
+		if (nl != 0 && o.len > nl && depth < DHCP6_OPTINDEX_DEPTH) {
+			if (dhcp6_optindex_region(idx,
+			    off + nl, off + o.len, depth + 1) == -1)
+				return -1;
+		}
+		off += o.len;
+	}
+
+	return 0;
+}
+
+static int
+dhcp6_optindex_cmp(const void *a, const void *b)
+{
+	const struct dhcp6_optent *ea = a, *eb = b;
+
+	if (ea->region != eb->region)
+		return ea->region < eb->region ? -1 : 1;
+	if (ea->code != eb->code)
+		return ea->code < eb->code ? -1 : 1;
+	if (ea->off != eb->off)
+		return ea->off < eb->off ? -1 : 1;
+	return 0;
+}
+
+static void
+dhcp6_optindex_push(struct dhcpcd_ctx *ctx, struct dhcp6_optindex *idx,
+    const struct dhcp6_message *m, size_t len)
+{
+
+	memset(idx, 0, sizeof(*idx));
+	idx->prev = ctx->dhcp6_optidx;
+	ctx->dhcp6_optidx = idx;
+
+	if (m == NULL || len < sizeof(*m) || len > UINT32_MAX)
+		return;
+	idx->msg = (const uint8_t *)m;
+	idx->msg_len = len;
+	if (dhcp6_optindex_region(idx, sizeof(*m), len, 0) == -1)
+		goto fail;
+
+	if (idx->ents_len == 0)
+		return;
+	idx->bycode = reallocarray(NULL, idx->ents_len, sizeof(*idx->bycode));
+	if (idx->bycode == NULL)
+		goto fail;
+	memcpy(idx->bycode, idx->ents, idx->ents_len * sizeof(*idx->bycode));
+	qsort(idx->bycode, idx->ents_len, sizeof(*idx->bycode),
+	    dhcp6_optindex_cmp);
+	return;
+
+fail:
+	/* Let dhcp6_findoption walk the options instead. */
+	logerr(__func__);
+	idx->msg = NULL;
+}
+
+static void
+dhcp6_optindex_pop(struct dhcpcd_ctx *ctx, struct dhcp6_optindex *idx)
+{
+
+	ctx->dhcp6_optidx = idx->prev;
+	free(idx->ents);
+	free(idx->bycode);
+	free(idx->regions);
+}
+
+/* Returns 1 if the index can answer, otherwise 0 to walk the options. */
+static int
+dhcp6_optindex_find(const struct dhcp6_optindex *idx,
+    const uint8_t *d, size_t data_len, uint16_t code,
+    uint8_t **opt, uint16_t *len)
+{
+	const struct dhcp6_optent *ent;
+	size_t off, lo, hi, i;
+	uint32_t region;
+
+	if (idx->msg == NULL || idx->ents_len == 0 ||
+	    d < idx->msg || d >= idx->msg + idx->msg_len)
+		return 0;
+	off = (size_t)(d - idx->msg);
+
+	/* d must be the start of an indexed option in a region
+	 * which ends where the data does. */
+	lo = 0;
+	hi = idx->ents_len;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (idx->ents[i].off < off)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	if (lo == idx->ents_len || idx->ents[lo].off != off)
+		return 0;
+	region = idx->ents[lo].region;
+	if (idx->regions[region].end != off + data_len)
+		return 0;
+
+	/* Find the first option of code in the region at or after d. */
+	lo = 0;
+	hi = idx->ents_len;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		ent = &idx->bycode[i];
+		if (ent->region < region ||
+		    (ent->region == region &&
+		    (ent->code < code ||
+		    (ent->code == code && ent->off < off))))
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	if (lo != idx->ents_len) {
+		ent = &idx->bycode[lo];
+		if (ent->region == region && ent->code == code) {
+			if (len != NULL)
+				*len = ent->len;
+			*opt = UNCONST(idx->msg + ent->off +
+			    sizeof(struct dhcp6_option));
+			return 1;
+		}
+	}
+
+	*opt = NULL;
+	errno = idx->regions[region].error ?
+	    idx->regions[region].error : ENOENT;
+	return 1;
+}
+
 static void *
-dhcp6_findoption(void *data, size_t data_len, uint16_t code, uint16_t *len)
+dhcp6_findoption(struct dhcpcd_ctx *ctx,
+    void *data, size_t data_len, uint16_t code, uint16_t *len)
 {
+	const struct dhcp6_optindex *idx;
 	uint8_t *d;
 	struct dhcp6_option o;
 
+	for (idx = ctx->dhcp6_optidx; idx != NULL; idx = idx->prev) {
+		if (dhcp6_optindex_find(idx, data, data_len, code, &d, len))
+			return d;
+	}
+
 	code = htons(code);
 	for (d = data; data_len != 0; d += o.len, data_len -= o.len) {
 		if (data_len < sizeof(o)) {
@@ -353,8 +591,8 @@ dhcp6_findoption(void *data, size_t data_len, uint16_t code, uint16_t *len)
 }
 
 static void *
-dhcp6_findmoption(void *data, size_t data_len, uint16_t code,
-    uint16_t *len)
+dhcp6_findmoption(struct dhcpcd_ctx *ctx,
+    void *data, size_t data_len, uint16_t code, uint16_t *len)
 {
 	uint8_t *d;
 
@@ -365,7 +603,7 @@ dhcp6_findmoption(void *data, size_t data_len, uint16_t code,
 	d = data;
 	d += sizeof(struct dhcp6_message);
 	data_len -= sizeof(struct dhcp6_message);
-	return dhcp6_findoption(d, data_len, code, len);
+	return dhcp6_findoption(ctx, d, data_len, code, len);
 }
 
 static const uint8_t *
@@ -374,8 +612,6 @@ dhcp6_getoption(struct dhcpcd_ctx *ctx,
     const uint8_t *od, size_t ol, struct dhcp_opt **oopt)
 {
 	struct dhcp6_option o;
-	size_t i;
-	struct dhcp_opt *opt;
 
 	if (od != NULL) {
 		*os = sizeof(o);
@@ -392,15 +628,8 @@ dhcp6_getoption(struct dhcpcd_ctx *ctx,
 		*code = ntohs(o.code);
 	}
 
-	*oopt = NULL;
-	for (i = 0, opt = ctx->dhcp6_opts;
-	    i < ctx->dhcp6_opts_len; i++, opt++)
-	{
-		if (opt->option == *code) {
-			*oopt = opt;
-			break;
-		}
-	}
+	*oopt = dhcp_optsearch(NULL, ctx->dhcp6_optsort,
+	    ctx->dhcp6_opts, ctx->dhcp6_opts_len, *code);
 
 	if (od != NULL)
 		return od + sizeof(o);
@@ -417,7 +646,7 @@ dhcp6_updateelapsed(struct interface *ifp, struct dhcp6_message *m, size_t len)
 	unsigned long long hsec;
 	uint16_t sec;
 
-	opt = dhcp6_findmoption(m, len, D6_OPTION_ELAPSED, &opt_len);
+	opt = dhcp6_findmoption(ifp->ctx, m, len, D6_OPTION_ELAPSED, &opt_len);
 	if (opt == NULL)
 		return false;
 	if (opt_len != sizeof(sec)) {
@@ -467,7 +696,7 @@ dhcp6_newxid(const struct interface *ifp, struct dhcp6_message *m)
 		    sizeof(xid));
 	else {
 again:
-		xid = arc4random();
+		xid = rndpool_u32(ifp->ctx);
 	}
 
 	m->xid[0] = (xid >> 16) & 0xff;
@@ -626,72 +855,63 @@ dhcp6_delegateaddr(struct in6_addr *addr, struct interface *ifp,
 }
 #endif
 
+#define COPYIN1(_code, _len)		{	\
+	o.code = htons((_code));		\
+	o.len = htons((_len));			\
+	memcpy(p, &o, sizeof(o));		\
+	p += sizeof(o);				\
+}
+#define COPYIN(_code, _data, _len)	do {	\
+	COPYIN1((_code), (_len));		\
+	if ((_len) != 0) {			\
+		memcpy(p, (_data), (_len));	\
+		p += (_len);			\
+	}					\
+} while (0 /* CONSTCOND */)
+#define NEXTLEN (p + offsetof(struct dhcp6_option, len))
+
+static void
+dhcp6_makeoptskey(struct dhcp6_optskey *key, struct interface *ifp,
+    uint8_t type, bool rapid)
+{
+	const struct if_options *ifo = ifp->options;
+
+	/* Zero padding as well so keys can be compared with memcmp. */
+	memset(key, 0, sizeof(*key));
+	key->ifo = ifo;
+	key->options = ifo->options;
+	key->type = type;
+	key->rapid = rapid;
+#ifndef SMALL
+	key->selfsla = dhcp6_findselfsla(ifp) != NULL;
+#endif
+	if (dhcp_get_hostname(key->hostname, sizeof(key->hostname), ifo)
+	    == NULL)
+		memset(key->hostname, 0, sizeof(key->hostname));
+}
+
+/*
+ * Make the options which follow the IAs and only depend on the message
+ * type and our configuration: ORO, Elapsed Time, Rapid Commit,
+ * User and Vendor Class, FQDN, MUD URL and Reconfigure Accept.
+ */
 static int
-dhcp6_makemessage(struct interface *ifp)
+dhcp6_makeopts(struct dhcp6_msgopts *mo, const struct interface *ifp)
 {
-	struct dhcp6_state *state;
-	struct dhcp6_message *m;
+	const struct if_options *ifo = ifp->options;
+	const struct if_optmasks *om = ifo->optmasks;
+	const struct dhcp6_optskey *key = &mo->key;
 	struct dhcp6_option o;
-	uint8_t *p, *si, *unicast, IA;
-	size_t n, l, len, ml, hl;
-	uint8_t type;
-	uint16_t si_len, uni_len, n_options;
-	uint8_t *o_lenp;
-	struct if_options *ifo = ifp->options;
 	const struct dhcp_opt *opt, *opt2;
-	const struct ipv6_addr *ap;
-	char hbuf[HOSTNAME_MAX_LEN + 1];
 	const char *hostname;
+	uint8_t *p, *o_lenp;
+	uint16_t n_options, u16;
+	size_t n, l, len, hl;
 	int fqdn;
-	struct dhcp6_ia_na ia_na;
-	uint16_t ia_na_len;
-	struct if_ia *ifia;
-#ifdef AUTH
-	uint16_t auth_len;
-#endif
-	uint8_t duid[DUID_LEN];
-	size_t duid_len = 0;
-
-	state = D6_STATE(ifp);
-	if (state->send) {
-		free(state->send);
-		state->send = NULL;
-	}
-
-	switch(state->state) {
-	case DH6S_INIT: /* FALLTHROUGH */
-	case DH6S_DISCOVER:
-		type = DHCP6_SOLICIT;
-		break;
-	case DH6S_REQUEST:
-		type = DHCP6_REQUEST;
-		break;
-	case DH6S_CONFIRM:
-		type = DHCP6_CONFIRM;
-		break;
-	case DH6S_REBIND:
-		type = DHCP6_REBIND;
-		break;
-	case DH6S_RENEW:
-		type = DHCP6_RENEW;
-		break;
-	case DH6S_INFORM:
-		type = DHCP6_INFORMATION_REQ;
-		break;
-	case DH6S_RELEASE:
-		type = DHCP6_RELEASE;
-		break;
-	case DH6S_DECLINE:
-		type = DHCP6_DECLINE;
-		break;
-	default:
-		errno = EINVAL;
-		return -1;
-	}
 
 	/* RFC 4704 Section 5 says we can only send FQDN for these
 	 * message types. */
-	switch(type) {
+	switch(key->type) {
 	case DHCP6_SOLICIT:
 	case DHCP6_REQUEST:
 	case DHCP6_RENEW:
@@ -709,17 +929,16 @@ dhcp6_makemessage(struct interface *ifp)
 		 * hostname and FQDN according to RFC4702 */
 		fqdn = FQDN_BOTH;
 	}
-	if (fqdn != FQDN_DISABLE)
-		hostname = dhcp_get_hostname(hbuf, sizeof(hbuf), ifo);
+	if (fqdn != FQDN_DISABLE && key->hostname[0] != '\0')
+		hostname = key->hostname;
 	else
-		hostname = NULL; /* appearse gcc */
+		hostname = NULL;
 
 	/* Work out option size first */
 	n_options = 0;
 	len = 0;
-	si = NULL;
-	hl = 0; /* Appease gcc */
-	if (state->state != DH6S_RELEASE && state->state != DH6S_DECLINE) {
+	hl = 0;
+	if (key->type != DHCP6_RELEASE && key->type != DHCP6_DECLINE) {
 		for (l = 0, opt = ifp->ctx->dhcp6_opts;
 		    l < ifp->ctx->dhcp6_opts_len;
 		    l++, opt++)
@@ -733,7 +952,7 @@ dhcp6_makemessage(struct interface *ifp)
 			}
 			if (n < ifo->dhcp6_override_len)
 				continue;
-			if (!DHC_REQOPT(opt, ifo->requestmask6, ifo->nomask6))
+			if (!DHC_REQOPT(opt, om->requestmask6, om->nomask6))
 				continue;
 			n_options++;
 			len += sizeof(o.len);
@@ -743,12 +962,12 @@ dhcp6_makemessage(struct interface *ifp)
 		    l < ifo->dhcp6_override_len;
 		    l++, opt++)
 		{
-			if (!DHC_REQOPT(opt, ifo->requestmask6, ifo->nomask6))
+			if (!DHC_REQOPT(opt, om->requestmask6, om->nomask6))
 				continue;
 			n_options++;
 			len += sizeof(o.len);
 		}
-		if (dhcp6_findselfsla(ifp)) {
+		if (key->selfsla) {
 			n_options++;
 			len += sizeof(o.len);
 		}
@@ -761,21 +980,251 @@ dhcp6_makemessage(struct interface *ifp)
 			len += sizeof(o) + 1 + hl;
 		}
 
-		if (!has_option_mask(ifo->nomask6, D6_OPTION_MUDURL) &&
+		if (!has_option_mask(om->nomask6, D6_OPTION_MUDURL) &&
 		    ifo->mudurl[0])
 			len += sizeof(o) + ifo->mudurl[0];
 
 #ifdef AUTH
 		if ((ifo->auth.options & DHCPCD_AUTH_SENDREQUIRE) !=
 		    DHCPCD_AUTH_SENDREQUIRE &&
-		    DHC_REQ(ifo->requestmask6, ifo->nomask6,
+		    DHC_REQ(om->requestmask6, om->nomask6,
 		    D6_OPTION_RECONF_ACCEPT))
 			len += sizeof(o); /* Reconfigure Accept */
 #endif
 	}
 
-	len += sizeof(*state->send);
 	len += sizeof(o) + sizeof(uint16_t); /* elapsed */
+	if (key->rapid)
+		len += sizeof(o);
+	if (!has_option_mask(om->nomask6, D6_OPTION_USER_CLASS))
+		len += dhcp6_makeuser(NULL, ifp);
+	if (!has_option_mask(om->nomask6, D6_OPTION_VENDOR_CLASS))
+		len += dhcp6_makevendor(NULL, ifp);
+
+	free(mo->data);
+	mo->data = p = malloc(len);
+	if (p == NULL)
+		return -1;
+	mo->len = len;
+
+	if (key->type != DHCP6_RELEASE &&
+	    key->type != DHCP6_DECLINE &&
+	    n_options)
+	{
+		o_lenp = NEXTLEN;
+		o.len = 0;
+		COPYIN1(D6_OPTION_ORO, 0);
+		for (l = 0, opt = ifp->ctx->dhcp6_opts;
+		    l < ifp->ctx->dhcp6_opts_len;
+		    l++, opt++)
+		{
+			for (n = 0, opt2 = ifo->dhcp6_override;
+			    n < ifo->dhcp6_override_len;
+			    n++, opt2++)
+			{
+				if (opt->option == opt2->option)
+					break;
+			}
+			if (n < ifo->dhcp6_override_len)
+			    continue;
+			if (!DHC_REQOPT(opt, om->requestmask6, om->nomask6))
+				continue;
+			o.code = htons((uint16_t)opt->option);
+			memcpy(p, &o.code, sizeof(o.code));
+			p += sizeof(o.code);
+			o.len = (uint16_t)(o.len + sizeof(o.code));
+		}
+#ifndef SMALL
+		for (l = 0, opt = ifo->dhcp6_override;
+		    l < ifo->dhcp6_override_len;
+		    l++, opt++)
+		{
+			if (!DHC_REQOPT(opt, om->requestmask6, om->nomask6))
+				continue;
+			o.code = htons((uint16_t)opt->option);
+			memcpy(p, &o.code, sizeof(o.code));
+			p += sizeof(o.code);
+			o.len = (uint16_t)(o.len + sizeof(o.code));
+		}
+		if (key->selfsla) {
+			o.code = htons(D6_OPTION_PD_EXCLUDE);
+			memcpy(p, &o.code, sizeof(o.code));
+			p += sizeof(o.code);
+			o.len = (uint16_t)(o.len + sizeof(o.code));
+		}
+#endif
+		o.len = htons(o.len);
+		memcpy(o_lenp, &o.len, sizeof(o.len));
+	}
+
+	u16 = 0;
+	COPYIN(D6_OPTION_ELAPSED, &u16, sizeof(u16));
+
+	if (key->rapid)
+		COPYIN1(D6_OPTION_RAPID_COMMIT, 0);
+
+	if (!has_option_mask(om->nomask6, D6_OPTION_USER_CLASS))
+		p += dhcp6_makeuser(p, ifp);
+	if (!has_option_mask(om->nomask6, D6_OPTION_VENDOR_CLASS))
+		p += dhcp6_makevendor(p, ifp);
+
+	if (key->type != DHCP6_RELEASE &&
+	    key->type != DHCP6_DECLINE)
+	{
+		if (fqdn != FQDN_DISABLE) {
+			o_lenp = NEXTLEN;
+			COPYIN1(D6_OPTION_FQDN, 0);
+			if (hl == 0)
+				*p = D6_FQDN_NONE;
+			else {
+				switch (fqdn) {
+				case FQDN_BOTH:
+					*p = D6_FQDN_BOTH;
+					break;
+				case FQDN_PTR:
+					*p = D6_FQDN_PTR;
+					break;
+				default:
+					*p = D6_FQDN_NONE;
+					break;
+				}
+			}
+			p++;
+			encode_rfc1035(hostname, p);
+			p += hl;
+			o.len = htons((uint16_t)(hl + 1));
+			memcpy(o_lenp, &o.len, sizeof(o.len));
+		}
+
+		if (!has_option_mask(om->nomask6, D6_OPTION_MUDURL) &&
+		    ifo->mudurl[0])
+			COPYIN(D6_OPTION_MUDURL,
+			    ifo->mudurl + 1, ifo->mudurl[0]);
+
+#ifdef AUTH
+		if ((ifo->auth.options & DHCPCD_AUTH_SENDREQUIRE) !=
+		    DHCPCD_AUTH_SENDREQUIRE &&
+		    DHC_REQ(om->requestmask6, om->nomask6,
+		    D6_OPTION_RECONF_ACCEPT))
+			COPYIN1(D6_OPTION_RECONF_ACCEPT, 0);
+#endif
+	}
+
+	assert((size_t)(p - mo->data) == len);
+	return 0;
+}
+
+/*
+ * Return the options following the IAs for a message of type.
+ * These are kept per type and only made again when something they
+ * are made from changes.
+ */
+static const uint8_t *
+dhcp6_msgopts(struct interface *ifp, uint8_t type, size_t *len)
+{
+	struct dhcp6_state *state = D6_STATE(ifp);
+	struct dhcp6_msgopts *mo;
+	struct dhcp6_optskey key;
+	bool rapid;
+
+	assert(type != 0 && type <= DHCP6_MSGOPTS_MAX);
+	mo = &state->msgopts[type - 1];
+	rapid = state->state == DH6S_DISCOVER &&
+	    !(ifp->ctx->options & DHCPCD_TEST) &&
+	    DHC_REQ(ifp->options->optmasks->requestmask6,
+	    ifp->options->optmasks->nomask6, D6_OPTION_RAPID_COMMIT);
+	dhcp6_makeoptskey(&key, ifp, type, rapid);
+	if (mo->data == NULL || memcmp(&mo->key, &key, sizeof(key)) != 0) {
+		mo->key = key;
+		if (dhcp6_makeopts(mo, ifp) == -1) {
+			mo->data = NULL;
+			return NULL;
+		}
+	}
+	*len = mo->len;
+	return mo->data;
+}
+
+static void
+dhcp6_freemsgopts(struct dhcp6_state *state)
+{
+	size_t i;
+
+	for (i = 0; i < DHCP6_MSGOPTS_MAX; i++) {
+		free(state->msgopts[i].data);
+		state->msgopts[i].data = NULL;
+	}
+}
+
+static int
+dhcp6_makemessage(struct interface *ifp)
+{
+	struct dhcp6_state *state;
+	struct dhcp6_message *m;
+	struct dhcp6_option o;
+	uint8_t *p, *si, *unicast, IA;
+	const uint8_t *opts;
+	size_t n, l, len, ml, opts_len;
+	uint8_t type;
+	uint16_t si_len, uni_len;
+	uint8_t *o_lenp;
+	struct if_options *ifo = ifp->options;
+	const struct ipv6_addr *ap;
+	struct dhcp6_ia_na ia_na;
+	uint16_t ia_na_len;
+	struct if_ia *ifia;
+#ifdef AUTH
+	uint16_t auth_len;
+#endif
+	uint8_t duid[DUID_LEN];
+	size_t duid_len = 0;
+
+	state = D6_STATE(ifp);
+	if (state->send) {
+		free(state->send);
+		state->send = NULL;
+	}
+
+	switch(state->state) {
+	case DH6S_INIT: /* FALLTHROUGH */
+	case DH6S_DISCOVER:
+		type = DHCP6_SOLICIT;
+		break;
+	case DH6S_REQUEST:
+		type = DHCP6_REQUEST;
+		break;
+	case DH6S_CONFIRM:
+		type = DHCP6_CONFIRM;
+		break;
+	case DH6S_REBIND:
+		type = DHCP6_REBIND;
+		break;
+	case DH6S_RENEW:
+		type = DHCP6_RENEW;
+		break;
+	case DH6S_INFORM:
+		type = DHCP6_INFORMATION_REQ;
+		break;
+	case DH6S_RELEASE:
+		type = DHCP6_RELEASE;
+		break;
+	case DH6S_DECLINE:
+		type = DHCP6_DECLINE;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The options which only depend on type and our configuration */
+	opts = dhcp6_msgopts(ifp, type, &opts_len);
+	if (opts == NULL)
+		return -1;
+
+	/* Work out option size first */
+	len = opts_len;
+	si = NULL;
+	len += sizeof(*state->send);
 
 	if (ifo->options & DHCPCD_ANONYMOUS) {
 		duid_len = duid_make(duid, ifp, DUID_LL);
@@ -784,11 +1233,6 @@ dhcp6_makemessage(struct interface *ifp)
 		len += sizeof(o) + ifp->ctx->duid_len;
 	}
 
-	if (!has_option_mask(ifo->nomask6, D6_OPTION_USER_CLASS))
-		len += dhcp6_makeuser(NULL, ifp);
-	if (!has_option_mask(ifo->nomask6, D6_OPTION_VENDOR_CLASS))
-		len += dhcp6_makevendor(NULL, ifp);
-
 	/* IA */
 	m = NULL;
 	ml = 0;
@@ -806,7 +1250,8 @@ dhcp6_makemessage(struct interface *ifp)
 			m = state->new;
 			ml = state->new_len;
 		}
-		si = dhcp6_findmoption(m, ml, D6_OPTION_SERVERID, &si_len);
+		si = dhcp6_findmoption(ifp->ctx, m, ml,
+		    D6_OPTION_SERVERID, &si_len);
 		if (si == NULL)
 			return -1;
 		len += sizeof(o) + si_len;
@@ -854,11 +1299,6 @@ dhcp6_makemessage(struct interface *ifp)
 		IA = 0;
 	}
 
-	if (state->state == DH6S_DISCOVER &&
-	    !(ifp->ctx->options & DHCPCD_TEST) &&
-	    DHC_REQ(ifo->requestmask6, ifo->nomask6, D6_OPTION_RAPID_COMMIT))
-		len += sizeof(o);
-
 	if (m == NULL) {
 		m = state->new;
 		ml = state->new_len;
@@ -868,11 +1308,14 @@ dhcp6_makemessage(struct interface *ifp)
 	case DH6S_REQUEST: /* FALLTHROUGH */
 	case DH6S_RENEW:   /* FALLTHROUGH */
 	case DH6S_RELEASE:
-		if (has_option_mask(ifo->nomask6, D6_OPTION_UNICAST)) {
+		if (has_option_mask(ifo->optmasks->nomask6,
+		    D6_OPTION_UNICAST))
+		{
 			unicast = NULL;
 			break;
 		}
-		unicast = dhcp6_findmoption(m, ml, D6_OPTION_UNICAST, &uni_len);
+		unicast = dhcp6_findmoption(ifp->ctx, m, ml,
+		    D6_OPTION_UNICAST, &uni_len);
 		break;
 	default:
 		unicast = NULL;
@@ -921,21 +1364,6 @@ dhcp6_makemessage(struct interface *ifp)
 
 	dhcp6_newxid(ifp, state->send);
 
-#define COPYIN1(_code, _len)		{	\
-	o.code = htons((_code));		\
-	o.len = htons((_len));			\
-	memcpy(p, &o, sizeof(o));		\
-	p += sizeof(o);				\
-}
-#define COPYIN(_code, _data, _len)	do {	\
-	COPYIN1((_code), (_len));		\
-	if ((_len) != 0) {			\
-		memcpy(p, (_data), (_len));	\
-		p += (_len);			\
-	}					\
-} while (0 /* CONSTCOND */)
-#define NEXTLEN (p + offsetof(struct dhcp6_option, len))
-
 	/* Options are listed in numerical order as per RFC 7844 Section 4.1
 	 * XXX: They should be randomised. */
 
@@ -1015,146 +1443,41 @@ dhcp6_makemessage(struct interface *ifp)
 					if (u8)
 						n--;
 					while (n-- > 0)
-						*ep++ = *pp--;
-					if (u8)
-						*ep = (uint8_t)(*pp << u8);
-					n++;
-					COPYIN(D6_OPTION_PD_EXCLUDE, exb,
-					    (uint16_t)n);
-					ia_na_len = (uint16_t)
-					    (ia_na_len + sizeof(o) + n);
-				}
-#endif
-			} else {
-				struct dhcp6_ia_addr ia = {
-				    .addr = ap->addr,
-				    /*
-				     * RFC 8415 21.6 states that the
-				     * valid and preferred lifetimes sent by
-				     * the client SHOULD be zero and MUST
-				     * be ignored by the server.
-				     */
-				};
-
-				COPYIN(D6_OPTION_IA_ADDR, &ia, sizeof(ia));
-				ia_na_len = (uint16_t)
-				    (ia_na_len + sizeof(o) + sizeof(ia));
-			}
-		}
-
-		/* Update the total option lenth. */
-		ia_na_len = htons(ia_na_len);
-		memcpy(o_lenp, &ia_na_len, sizeof(ia_na_len));
-	}
-
-	if (state->send->type != DHCP6_RELEASE &&
-	    state->send->type != DHCP6_DECLINE &&
-	    n_options)
-	{
-		o_lenp = NEXTLEN;
-		o.len = 0;
-		COPYIN1(D6_OPTION_ORO, 0);
-		for (l = 0, opt = ifp->ctx->dhcp6_opts;
-		    l < ifp->ctx->dhcp6_opts_len;
-		    l++, opt++)
-		{
-#ifndef SMALL
-			for (n = 0, opt2 = ifo->dhcp6_override;
-			    n < ifo->dhcp6_override_len;
-			    n++, opt2++)
-			{
-				if (opt->option == opt2->option)
-					break;
-			}
-			if (n < ifo->dhcp6_override_len)
-			    continue;
-#endif
-			if (!DHC_REQOPT(opt, ifo->requestmask6, ifo->nomask6))
-				continue;
-			o.code = htons((uint16_t)opt->option);
-			memcpy(p, &o.code, sizeof(o.code));
-			p += sizeof(o.code);
-			o.len = (uint16_t)(o.len + sizeof(o.code));
-		}
-#ifndef SMALL
-		for (l = 0, opt = ifo->dhcp6_override;
-		    l < ifo->dhcp6_override_len;
-		    l++, opt++)
-		{
-			if (!DHC_REQOPT(opt, ifo->requestmask6, ifo->nomask6))
-				continue;
-			o.code = htons((uint16_t)opt->option);
-			memcpy(p, &o.code, sizeof(o.code));
-			p += sizeof(o.code);
-			o.len = (uint16_t)(o.len + sizeof(o.code));
-		}
-		if (dhcp6_findselfsla(ifp)) {
-			o.code = htons(D6_OPTION_PD_EXCLUDE);
-			memcpy(p, &o.code, sizeof(o.code));
-			p += sizeof(o.code);
-			o.len = (uint16_t)(o.len + sizeof(o.code));
-		}
+						*ep++ = *pp--;
+					if (u8)
+						*ep = (uint8_t)(*pp << u8);
+					n++;
+					COPYIN(D6_OPTION_PD_EXCLUDE, exb,
+					    (uint16_t)n);
+					ia_na_len = (uint16_t)
+					    (ia_na_len + sizeof(o) + n);
+				}
 #endif
-		o.len = htons(o.len);
-		memcpy(o_lenp, &o.len, sizeof(o.len));
-	}
-
-	si_len = 0;
-	COPYIN(D6_OPTION_ELAPSED, &si_len, sizeof(si_len));
-
-	if (state->state == DH6S_DISCOVER &&
-	    !(ifp->ctx->options & DHCPCD_TEST) &&
-	    DHC_REQ(ifo->requestmask6, ifo->nomask6, D6_OPTION_RAPID_COMMIT))
-		COPYIN1(D6_OPTION_RAPID_COMMIT, 0);
-
-	if (!has_option_mask(ifo->nomask6, D6_OPTION_USER_CLASS))
-		p += dhcp6_makeuser(p, ifp);
-	if (!has_option_mask(ifo->nomask6, D6_OPTION_VENDOR_CLASS))
-		p += dhcp6_makevendor(p, ifp);
+			} else {
+				struct dhcp6_ia_addr ia = {
+				    .addr = ap->addr,
+				    /*
+				     * RFC 8415 21.6 states that the
+				     * valid and preferred lifetimes sent by
+				     * the client SHOULD be zero and MUST
+				     * be ignored by the server.
+				     */
+				};
 
-	if (state->send->type != DHCP6_RELEASE &&
-	    state->send->type != DHCP6_DECLINE)
-	{
-		if (fqdn != FQDN_DISABLE) {
-			o_lenp = NEXTLEN;
-			COPYIN1(D6_OPTION_FQDN, 0);
-			if (hl == 0)
-				*p = D6_FQDN_NONE;
-			else {
-				switch (fqdn) {
-				case FQDN_BOTH:
-					*p = D6_FQDN_BOTH;
-					break;
-				case FQDN_PTR:
-					*p = D6_FQDN_PTR;
-					break;
-				default:
-					*p = D6_FQDN_NONE;
-					break;
-				}
+				COPYIN(D6_OPTION_IA_ADDR, &ia, sizeof(ia));
+				ia_na_len = (uint16_t)
+				    (ia_na_len + sizeof(o) + sizeof(ia));
 			}
-			p++;
-			encode_rfc1035(hostname, p);
-			p += hl;
-			o.len = htons((uint16_t)(hl + 1));
-			memcpy(o_lenp, &o.len, sizeof(o.len));
 		}
 
-		if (!has_option_mask(ifo->nomask6, D6_OPTION_MUDURL) &&
-		    ifo->mudurl[0])
-			COPYIN(D6_OPTION_MUDURL,
-			    ifo->mudurl + 1, ifo->mudurl[0]);
-
-#ifdef AUTH
-		if ((ifo->auth.options & DHCPCD_AUTH_SENDREQUIRE) !=
-		    DHCPCD_AUTH_SENDREQUIRE &&
-		    DHC_REQ(ifo->requestmask6, ifo->nomask6,
-		    D6_OPTION_RECONF_ACCEPT))
-			COPYIN1(D6_OPTION_RECONF_ACCEPT, 0);
-#endif
-
+		/* Update the total option lenth. */
+		ia_na_len = htons(ia_na_len);
+		memcpy(o_lenp, &ia_na_len, sizeof(ia_na_len));
 	}
 
+	memcpy(p, opts, opts_len);
+	p += opts_len;
+
 #ifdef AUTH
 	/* This has to be the last option */
 	if (ifo->auth.options & DHCPCD_AUTH_SEND && auth_len != 0) {
@@ -1187,7 +1510,7 @@ dhcp6_freedrop_addrs(struct interface *ifp, int drop,
 	if (state) {
 		ipv6_freedrop_addrs(&state->addrs, drop, ifd);
 		if (drop)
-			rt_build(ifp->ctx, AF_INET6);
+			rt_defer(ifp->ctx, AF_INET6);
 	}
 }
 
@@ -1213,7 +1536,7 @@ dhcp6_update_auth(struct interface *ifp, struct dhcp6_message *m, size_t len)
 	uint8_t *opt;
 	uint16_t opt_len;
 
-	opt = dhcp6_findmoption(m, len, D6_OPTION_AUTH, &opt_len);
+	opt = dhcp6_findmoption(ifp->ctx, m, len, D6_OPTION_AUTH, &opt_len);
 	if (opt == NULL)
 		return -1;
 
@@ -1313,7 +1636,7 @@ dhcp6_sendmessage(struct interface *ifp, void (*callback)(void *))
 		}
 
 		/* Add -.1 to .1 * RT randomness as per RFC8415 section 15 */
-		uint32_t lru = arc4random_uniform(
+		uint32_t lru = rndpool_uniform(ifp->ctx,
 		    state->RTC == 0 ? DHCP6_RAND_MAX
 		    : DHCP6_RAND_MAX - DHCP6_RAND_MIN);
 		int lr = (int)lru - (state->RTC == 0 ? 0 : DHCP6_RAND_MAX);
@@ -1394,6 +1717,9 @@ dhcp6_sendmessage(struct interface *ifp, void (*callback)(void *))
 #ifdef PRIVSEP
 sent:
 #endif
+	ifp->stats.tx[IF_STAT_DHCP6]++;
+	if (state->RTC != 0)
+		ifp->stats.retrans[IF_STAT_DHCP6]++;
 	state->RTC++;
 	if (callback) {
 		state->RT = RT * 2;
@@ -1524,12 +1850,7 @@ static void
 dhcp6_dadcallback(void *arg)
 {
 	struct ipv6_addr *ia = arg;
-	struct interface *ifp;
-	struct dhcp6_state *state;
-	struct ipv6_addr *ia2;
-	bool completed, valid, oneduplicated;
 
-	completed = (ia->flags & IPV6_AF_DADCOMPLETED);
 	ia->flags |= IPV6_AF_DADCOMPLETED;
 	if (ia->addr_flags & IN6_IFF_DUPLICATED)
 		logwarnx("%s: DAD detected %s", ia->iface->name, ia->saddr);
@@ -1538,11 +1859,37 @@ dhcp6_dadcallback(void *arg)
 	else
 		ipv6nd_advertise(ia);
 #endif
-	if (completed)
-		return;
+}
+
+/* Called by ipv6_daddone for the addresses which have
+ * finished DAD since the last time. */
+void
+dhcp6_daddone(struct interface *ifp)
+{
+	struct dhcp6_state *state;
+	struct ipv6_addr *ia, *ia2;
+	bool completed, valid, oneduplicated;
 
-	ifp = ia->iface;
 	state = D6_STATE(ifp);
+	if (state == NULL)
+		return;
+
+	/* The last address to complete decides the reason. */
+	ia = NULL;
+	TAILQ_FOREACH(ia2, &state->addrs, next) {
+		if (!(ia2->flags & IPV6_AF_DADPENDING))
+			continue;
+		ia2->flags &= ~IPV6_AF_DADPENDING;
+		if (ia2->flags & IPV6_AF_DADCOMPLETED)
+			continue;
+		if (ia2->dadcallback)
+			ia2->dadcallback(ia2);
+		ia2->flags |= IPV6_AF_DADCOMPLETED;
+		ia = ia2;
+	}
+	if (ia == NULL)
+		return;
+
 	if (state->state != DH6S_BOUND && state->state != DH6S_DELEGATED)
 		return;
 
@@ -1560,7 +1907,7 @@ dhcp6_dadcallback(void *arg)
 			completed = false;
 			break;
 		}
-		if (DECLINE_IA(ia))
+		if (DECLINE_IA(ia2))
 			oneduplicated = true;
 	}
 	if (!completed)
@@ -1579,7 +1926,7 @@ dhcp6_dadcallback(void *arg)
 #endif
 	    state->reason);
 	if (valid)
-		dhcpcd_daemonise(ifp->ctx);
+		dhcpcd_bound(ifp);
 }
 
 static void
@@ -1748,7 +2095,7 @@ dhcp6_fail(struct interface *ifp)
 		state->new_len = 0;
 		if (state->old != NULL)
 			script_runreason(ifp, "EXPIRE6");
-		dhcp_unlink(ifp->ctx, state->leasefile);
+		dhcp_unlinklease(ifp, &state->leasesave, state->leasefile);
 		dhcp6_addrequestedaddrs(ifp);
 	}
 
@@ -2028,7 +2375,8 @@ dhcp6_checkstatusok(const struct interface *ifp,
 	uint8_t *opt;
 	uint16_t opt_len, code;
 	size_t mlen;
-	void * (*f)(void *, size_t, uint16_t, uint16_t *), *farg;
+	void * (*f)(struct dhcpcd_ctx *, void *, size_t, uint16_t, uint16_t *);
+	void *farg;
 	char buf[32], *sbuf;
 	const char *status;
 	int loglevel;
@@ -2039,7 +2387,8 @@ dhcp6_checkstatusok(const struct interface *ifp,
 		farg = p;
 	else
 		farg = m;
-	if ((opt = f(farg, len, D6_OPTION_STATUS_CODE, &opt_len)) == NULL) {
+	opt = f(ifp->ctx, farg, len, D6_OPTION_STATUS_CODE, &opt_len);
+	if (opt == NULL) {
 		//logdebugx("%s: no status", ifp->name);
 		state->lerror = 0;
 		errno = ESRCH;
@@ -2130,20 +2479,49 @@ dhcp6_findaddr(struct dhcpcd_ctx *ctx, const struct in6_addr *addr,
 	return NULL;
 }
 
+/*
+ * While a reply is reconciled with what we hold, the addresses and
+ * prefixes are indexed so a reply carrying many of them does not need
+ * to search the list for each one.
+ * Addresses are keyed by address and prefixes by prefix, as they
+ * can be moved between IAIDs and the server can change the length.
+ */
 static int
-dhcp6_findna(struct interface *ifp, uint16_t ot, const uint8_t *iaid,
-    uint8_t *d, size_t l, const struct timespec *acquired)
+dhcp6_iacompare(__unused void *context, const void *n1, const void *n2)
+{
+	const struct ipv6_addr *ia1 = n1, *ia2 = n2;
+	bool pd1 = ia1->ia_type == D6_OPTION_IA_PD;
+	bool pd2 = ia2->ia_type == D6_OPTION_IA_PD;
+
+	if (pd1 != pd2)
+		return pd1 ? 1 : -1;
+	if (pd1)
+		return memcmp(&ia1->prefix, &ia2->prefix, sizeof(ia1->prefix));
+	return memcmp(&ia1->addr, &ia2->addr, sizeof(ia1->addr));
+}
+
+static const rb_tree_ops_t dhcp6_ia_ops = {
+	.rbto_compare_nodes = dhcp6_iacompare,
+	.rbto_compare_key = dhcp6_iacompare,
+	.rbto_node_offset = offsetof(struct ipv6_addr, ia_tree),
+	.rbto_context = NULL
+};
+
+static int
+dhcp6_findna(struct interface *ifp, rb_tree_t *ias, uint16_t ot,
+    const uint8_t *iaid, uint8_t *d, size_t l,
+    const struct timespec *acquired)
 {
 	struct dhcp6_state *state;
 	uint8_t *o, *nd;
 	uint16_t ol;
-	struct ipv6_addr *a;
+	struct ipv6_addr *a, key;
 	int i;
 	struct dhcp6_ia_addr ia;
 
 	i = 0;
 	state = D6_STATE(ifp);
-	while ((o = dhcp6_findoption(d, l, D6_OPTION_IA_ADDR, &ol))) {
+	while ((o = dhcp6_findoption(ifp->ctx, d, l, D6_OPTION_IA_ADDR, &ol))) {
 		/* Set d and l first to ensure we find the next option. */
 		nd = o + ol;
 		l -= (size_t)(nd - d);
@@ -2164,9 +2542,13 @@ dhcp6_findna(struct interface *ifp, uint16_t ot, const uint8_t *iaid,
 			    ifp->name, ia.pltime, ia.vltime);
 			continue;
 		}
-		TAILQ_FOREACH(a, &state->addrs, next) {
-			if (ipv6_findaddrmatch(a, &ia.addr, 0))
-				break;
+		key.ia_type = ot;
+		key.addr = ia.addr;
+		a = rb_tree_find_node(ias, &key);
+		if (a != NULL && a->prefix_vltime == 0) {
+			/* Lost its lifetime earlier in this reply. */
+			rb_tree_remove_node(ias, a);
+			a = NULL;
 		}
 		if (a == NULL) {
 			/*
@@ -2183,6 +2565,7 @@ dhcp6_findna(struct interface *ifp, uint16_t ot, const uint8_t *iaid,
 			a->created = *acquired;
 
 			TAILQ_INSERT_TAIL(&state->addrs, a, next);
+			rb_tree_insert_node(ias, a);
 		} else {
 			if (!(a->flags & IPV6_AF_ONLINK))
 				a->flags |= IPV6_AF_ONLINK | IPV6_AF_NEW;
@@ -2205,12 +2588,12 @@ dhcp6_findna(struct interface *ifp, uint16_t ot, const uint8_t *iaid,
 
 #ifndef SMALL
 static int
-dhcp6_findpd(struct interface *ifp, const uint8_t *iaid,
+dhcp6_findpd(struct interface *ifp, rb_tree_t *ias, const uint8_t *iaid,
     uint8_t *d, size_t l, const struct timespec *acquired)
 {
 	struct dhcp6_state *state;
 	uint8_t *o, *nd;
-	struct ipv6_addr *a;
+	struct ipv6_addr *a, key;
 	int i;
 	uint8_t nb, *pw;
 	uint16_t ol;
@@ -2219,7 +2602,9 @@ dhcp6_findpd(struct interface *ifp, const uint8_t *iaid,
 
 	i = 0;
 	state = D6_STATE(ifp);
-	while ((o = dhcp6_findoption(d, l, D6_OPTION_IAPREFIX, &ol))) {
+	while ((o = dhcp6_findoption(ifp->ctx, d, l,
+	    D6_OPTION_IAPREFIX, &ol)))
+	{
 		/* Set d and l first to ensure we find the next option. */
 		nd = o + ol;
 		l -= (size_t)(nd - d);
@@ -2247,11 +2632,9 @@ dhcp6_findpd(struct interface *ifp, const uint8_t *iaid,
 
 		/* pdp.prefix is not aligned so copy it out. */
 		memcpy(&pdp_prefix, &pdp.prefix, sizeof(pdp_prefix));
-		TAILQ_FOREACH(a, &state->addrs, next) {
-			if (IN6_ARE_ADDR_EQUAL(&a->prefix, &pdp_prefix))
-				break;
-		}
-
+		key.ia_type = D6_OPTION_IA_PD;
+		key.prefix = pdp_prefix;
+		a = rb_tree_find_node(ias, &key);
 		if (a == NULL) {
 			a = ipv6_newaddr(ifp, &pdp_prefix, pdp.prefix_len,
 			    IPV6_AF_DELEGATEDPFX);
@@ -2262,6 +2645,7 @@ dhcp6_findpd(struct interface *ifp, const uint8_t *iaid,
 			a->ia_type = D6_OPTION_IA_PD;
 			memcpy(a->iaid, iaid, sizeof(a->iaid));
 			TAILQ_INSERT_TAIL(&state->addrs, a, next);
+			rb_tree_insert_node(ias, a);
 		} else {
 			if (!(a->flags & IPV6_AF_DELEGATEDPFX))
 				a->flags |= IPV6_AF_NEW | IPV6_AF_DELEGATEDPFX;
@@ -2284,7 +2668,8 @@ dhcp6_findpd(struct interface *ifp, const uint8_t *iaid,
 
 		a->prefix_exclude_len = 0;
 		memset(&a->prefix_exclude, 0, sizeof(a->prefix_exclude));
-		o = dhcp6_findoption(o, ol, D6_OPTION_PD_EXCLUDE, &ol);
+		o = dhcp6_findoption(ifp->ctx, o, ol,
+		    D6_OPTION_PD_EXCLUDE, &ol);
 		if (o == NULL)
 			continue;
 
@@ -2343,6 +2728,7 @@ dhcp6_findia(struct interface *ifp, struct dhcp6_message *m, size_t l,
 	char buf[sizeof(iaid) * 3];
 	struct ipv6_addr *ap;
 	struct if_ia *ifia;
+	rb_tree_t ias;
 
 	if (l < sizeof(*m)) {
 		/* Should be impossible with guards at packet in
@@ -2354,9 +2740,16 @@ dhcp6_findia(struct interface *ifp, struct dhcp6_message *m, size_t l,
 	ifo = ifp->options;
 	i = e = 0;
 	state = D6_STATE(ifp);
+	rb_tree_init(&ias, &dhcp6_ia_ops);
 	TAILQ_FOREACH(ap, &state->addrs, next) {
-		if (!(ap->flags & IPV6_AF_DELEGATED))
-			ap->flags |= IPV6_AF_STALE;
+		if (ap->flags & IPV6_AF_DELEGATED)
+			continue;
+		ap->flags |= IPV6_AF_STALE;
+		/* An address without a lifetime is never matched.
+		 * For duplicates the first one wins as it did
+		 * when searching the list. */
+		if (ap->ia_type == D6_OPTION_IA_PD || ap->prefix_vltime != 0)
+			rb_tree_insert_node(&ias, ap);
 	}
 
 	d = (uint8_t *)m + sizeof(*m);
@@ -2433,7 +2826,7 @@ dhcp6_findia(struct interface *ifp, struct dhcp6_message *m, size_t l,
 		}
 		if (o.code == D6_OPTION_IA_PD) {
 #ifndef SMALL
-			if (dhcp6_findpd(ifp, ia.iaid, p, o.len,
+			if (dhcp6_findpd(ifp, &ias, ia.iaid, p, o.len,
 					 acquired) == 0)
 			{
 				logwarnx("%s: %s: DHCPv6 REPLY missing Prefix",
@@ -2442,7 +2835,7 @@ dhcp6_findia(struct interface *ifp, struct dhcp6_message *m, size_t l,
 			}
 #endif
 		} else {
-			if (dhcp6_findna(ifp, o.code, ia.iaid, p, o.len,
+			if (dhcp6_findna(ifp, &ias, o.code, ia.iaid, p, o.len,
 					 acquired) == 0)
 			{
 				logwarnx("%s: %s: DHCPv6 REPLY missing "
@@ -2471,7 +2864,7 @@ dhcp6_findia(struct interface *ifp, struct dhcp6_message *m, size_t l,
 static void
 dhcp6_deprecatedele(struct ipv6_addr *ia)
 {
-	struct ipv6_addr *da, *dan, *dda;
+	struct ipv6_addr *da, *dan;
 	struct timespec now;
 	struct dhcp6_state *state;
 
@@ -2490,19 +2883,12 @@ dhcp6_deprecatedele(struct ipv6_addr *ia)
 		if (ipv6_doaddr(da, &now) != -1)
 			continue;
 
-		/* Delegation deleted, forget it. */
-		TAILQ_REMOVE(&ia->pd_pfxs, da, pd_next);
-
-		/* Delete it from the interface. */
+		/* Delegation deleted, forget it.
+		 * It is the same object the interface holds and
+		 * ipv6_freeaddr removes it from pd_pfxs. */
 		state = D6_STATE(da->iface);
-		TAILQ_FOREACH(dda, &state->addrs, next) {
-			if (IN6_ARE_ADDR_EQUAL(&dda->addr, &da->addr))
-				break;
-		}
-		if (dda != NULL) {
-			TAILQ_REMOVE(&state->addrs, dda, next);
-			ipv6_freeaddr(dda);
-		}
+		TAILQ_REMOVE(&state->addrs, da, next);
+		ipv6_freeaddr(da);
 	}
 }
 #endif
@@ -2603,6 +2989,8 @@ dhcp6_readlease(struct interface *ifp, int validate)
 		uint8_t buf[UDPLEN_MAX];
 	} buf;
 	struct dhcp6_state *state;
+	struct dhcp6_optindex idx;
+	const struct handoff_msg *hm;
 	ssize_t bytes;
 	int fd;
 	time_t mtime, now;
@@ -2612,9 +3000,19 @@ dhcp6_readlease(struct interface *ifp, int validate)
 #endif
 
 	state = D6_STATE(ifp);
+	hm = handoff_find(ifp, HANDOFF_DHCP6, NULL);
 	if (state->leasefile[0] == '\0') {
 		logdebugx("reading standard input");
 		bytes = read(fileno(stdin), buf.buf, sizeof(buf.buf));
+	} else if (hm != NULL) {
+		logdebugx("%s: reading lease from handoff", ifp->name);
+		if (hm->len > sizeof(buf.buf)) {
+			errno = ENOBUFS;
+			bytes = -1;
+		} else {
+			memcpy(buf.buf, hm->data, hm->len);
+			bytes = (ssize_t)hm->len;
+		}
 	} else {
 		logdebugx("%s: reading lease: %s",
 		    ifp->name, state->leasefile);
@@ -2635,16 +3033,27 @@ dhcp6_readlease(struct interface *ifp, int validate)
 	if (!validate)
 		goto auth;
 
-	if (dhcp_filemtime(ifp->ctx, state->leasefile, &mtime) == -1)
-		goto ex;
-	clock_gettime(CLOCK_MONOTONIC, &state->acquired);
 	if ((now = time(NULL)) == -1)
 		goto ex;
-	state->acquired.tv_sec -= now - mtime;
+	if (hm != NULL) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		state->acquired = hm->acquired;
+		mtime = now - (time_t)eloop_timespec_diff(&ts,
+		    &state->acquired, NULL);
+	} else {
+		if (dhcp_filemtime(ifp->ctx, state->leasefile, &mtime) == -1)
+			goto ex;
+		clock_gettime(CLOCK_MONOTONIC, &state->acquired);
+		state->acquired.tv_sec -= now - mtime;
+	}
 
 	/* Check to see if the lease is still valid */
+	dhcp6_optindex_push(ifp->ctx, &idx, &buf.dhcp6, (size_t)bytes);
 	fd = dhcp6_validatelease(ifp, &buf.dhcp6, (size_t)bytes, NULL,
 	    &state->acquired);
+	dhcp6_optindex_pop(ifp->ctx, &idx);
 	if (fd == -1)
 		goto ex;
 
@@ -2660,7 +3069,8 @@ dhcp6_readlease(struct interface *ifp, int validate)
 auth:
 #ifdef AUTH
 	/* Authenticate the message */
-	o = dhcp6_findmoption(&buf.dhcp6, (size_t)bytes, D6_OPTION_AUTH, &ol);
+	o = dhcp6_findmoption(ifp->ctx, &buf.dhcp6, (size_t)bytes,
+	    D6_OPTION_AUTH, &ol);
 	if (o) {
 		if (dhcp_auth_validate(&state->auth, &ifp->options->auth,
 		    buf.buf, (size_t)bytes, 6, buf.dhcp6.type, o, ol) == NULL)
@@ -2692,11 +3102,12 @@ out:
 
 	memcpy(state->new, buf.buf, (size_t)bytes);
 	state->new_len = (size_t)bytes;
+	MEMSAMPLE(ifp->ctx, MEM_LEASE);
 	return bytes;
 
 ex:
 	dhcp6_freedrop_addrs(ifp, 0, NULL);
-	dhcp_unlink(ifp->ctx, state->leasefile);
+	dhcp_unlinklease(ifp, &state->leasesave, state->leasefile);
 	free(state->new);
 	state->new = NULL;
 	state->new_len = 0;
@@ -2740,6 +3151,16 @@ dhcp6_startinit(struct interface *ifp)
 		} else if (r != 0 &&
 		    !(ifp->options->options & DHCPCD_ANONYMOUS))
 		{
+			/* Carry on where the last dhcpcd left off. */
+			if (handoff_find(ifp, HANDOFF_DHCP6, NULL) != NULL) {
+				bool warm = ifp->warm;
+
+				ifp->warm = true;
+				state->state = DH6S_CONFIRM;
+				dhcp6_bind(ifp, NULL, NULL);
+				ifp->warm = warm;
+				return;
+			}
 			/* RFC 3633 section 12.1 */
 #ifndef SMALL
 			if (dhcp6_hasprefixdelegation(ifp))
@@ -2869,7 +3290,7 @@ dhcp6_script_try_run(struct interface *ifp, int delegated)
 	if (completed) {
 		script_runreason(ifp, delegated ? "DELEGATED6" : state->reason);
 		if (!delegated)
-			dhcpcd_daemonise(ifp->ctx);
+			dhcpcd_bound(ifp);
 	} else
 		logdebugx("%s: waiting for DHCPv6 DAD to complete", ifp->name);
 }
@@ -2882,104 +3303,107 @@ dhcp6_find_delegates(__unused struct interface *ifp)
 	return 0;
 }
 #else
+/* Give ifd the addresses it gets from the prefixes delegated
+ * to ifp for ia. The addresses are added by dhcp6_delegate_done. */
+static void
+dhcp6_delegate_ia(struct interface *ifp, struct interface *ifd,
+    struct if_ia *ia, const struct if_sla *sla)
+{
+	struct dhcp6_state *state = D6_STATE(ifp);
+	struct ipv6_addr *ap;
+
+	if (!ifd->active || !(ifd->options->options & DHCPCD_CONFIGURE))
+		return;
+
+	TAILQ_FOREACH(ap, &state->addrs, next) {
+		if (!(ap->flags & IPV6_AF_DELEGATEDPFX))
+			continue;
+		if (memcmp(ia->iaid, ap->iaid, sizeof(ia->iaid)))
+			continue;
+		if (!if_is_link_up(ifd)) {
+			logdebugx("%s: has no carrier, cannot"
+			    " delegate addresses", ifd->name);
+			return;
+		}
+		/* This creates the DHCPv6 state for ifd if needed. */
+		if (dhcp6_ifdelegateaddr(ifd, ap, sla, ia))
+			D6_STATE(ifd)->pd_pending = true;
+	}
+}
+
+static void
+dhcp6_delegate_done(struct interface *ifd)
+{
+	struct dhcp6_state *s = D6_STATE(ifd);
+
+	if (s == NULL || !s->pd_pending)
+		return;
+	s->pd_pending = false;
+	ipv6_addaddrs(&s->addrs);
+	dhcp6_script_try_run(ifd, 1);
+}
+
 static void
 dhcp6_delegate_prefix(struct interface *ifp)
 {
 	struct if_options *ifo;
 	struct dhcp6_state *state;
 	struct ipv6_addr *ap;
-	size_t i, j, k;
+	size_t i, j;
 	struct if_ia *ia;
-	struct if_sla *sla;
 	struct interface *ifd;
-	bool carrier_warned;
+	int pass, loglevel;
 
 	ifo = ifp->options;
 	state = D6_STATE(ifp);
 
-	/* Clear the logged flag. */
 	TAILQ_FOREACH(ap, &state->addrs, next) {
-		ap->flags &= ~IPV6_AF_DELEGATEDLOG;
-	}
-
-	TAILQ_FOREACH(ifd, ifp->ctx->ifaces, next) {
-		if (!ifd->active)
-			continue;
-		if (!(ifd->options->options & DHCPCD_CONFIGURE))
+		if (!(ap->flags & IPV6_AF_DELEGATEDPFX))
 			continue;
-		k = 0;
-		carrier_warned = false;
-		TAILQ_FOREACH(ap, &state->addrs, next) {
-			if (!(ap->flags & IPV6_AF_DELEGATEDPFX))
+		if (ap->flags & IPV6_AF_NEW)
+			loglevel = LOG_INFO;
+		else
+			loglevel = LOG_DEBUG;
+		logmessage(loglevel, "%s: delegated prefix %s",
+		    ifp->name, ap->saddr);
+		ap->flags &= ~IPV6_AF_NEW;
+	}
+
+	/* Each SLA names the interface it delegates to, so only that
+	 * interface needs visiting. Without a SLA we delegate to all.
+	 * The first pass makes the addresses, the second adds them so
+	 * each interface is only added to and reported once. */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < ifo->ia_len; i++) {
+			ia = &ifo->ia[i];
+			if (ia->ia_type != D6_OPTION_IA_PD)
+				continue;
+			if (ia->sla_len == 0) {
+				TAILQ_FOREACH(ifd, ifp->ctx->ifaces, next) {
+					if (pass == 0)
+						dhcp6_delegate_ia(ifp, ifd,
+						    ia, NULL);
+					else
+						dhcp6_delegate_done(ifd);
+				}
 				continue;
-			if (!(ap->flags & IPV6_AF_DELEGATEDLOG)) {
-				int loglevel;
-
-				if (ap->flags & IPV6_AF_NEW)
-					loglevel = LOG_INFO;
-				else
-					loglevel = LOG_DEBUG;
-				/* We only want to log this the once as we loop
-				 * through many interfaces first. */
-				ap->flags |= IPV6_AF_DELEGATEDLOG;
-				logmessage(loglevel, "%s: delegated prefix %s",
-				    ifp->name, ap->saddr);
-				ap->flags &= ~IPV6_AF_NEW;
 			}
-			for (i = 0; i < ifo->ia_len; i++) {
-				ia = &ifo->ia[i];
-				if (ia->ia_type != D6_OPTION_IA_PD)
+			for (j = 0; j < ia->sla_len; j++) {
+				ifd = if_find(ifp->ctx->ifaces,
+				    ia->sla[j].ifname);
+				if (ifd == NULL)
 					continue;
-				if (memcmp(ia->iaid, ap->iaid,
-				    sizeof(ia->iaid)))
-					continue;
-				if (ia->sla_len == 0) {
-					/* no SLA configured, so lets
-					 * automate it */
-					if (!if_is_link_up(ifd)) {
-						logdebugx(
-						    "%s: has no carrier, cannot"
-						    " delegate addresses",
-						    ifd->name);
-						carrier_warned = true;
-						break;
-					}
-					if (dhcp6_ifdelegateaddr(ifd, ap,
-					    NULL, ia))
-						k++;
-				}
-				for (j = 0; j < ia->sla_len; j++) {
-					sla = &ia->sla[j];
-					if (strcmp(ifd->name, sla->ifname))
-						continue;
-					if (!if_is_link_up(ifd)) {
-						logdebugx(
-						    "%s: has no carrier, cannot"
-						    " delegate addresses",
-						    ifd->name);
-						carrier_warned = true;
-						break;
-					}
-					if (dhcp6_ifdelegateaddr(ifd, ap,
-					    sla, ia))
-						k++;
-				}
-				if (carrier_warned)
-					break;
+				if (pass == 0)
+					dhcp6_delegate_ia(ifp, ifd,
+					    ia, &ia->sla[j]);
+				else
+					dhcp6_delegate_done(ifd);
 			}
-			if (carrier_warned)
-				break;
-		}
-		if (k && !carrier_warned) {
-			struct dhcp6_state *s = D6_STATE(ifd);
-
-			ipv6_addaddrs(&s->addrs);
-			dhcp6_script_try_run(ifd, 1);
 		}
 	}
 
 	/* Now all addresses have been added, rebuild the routing table. */
-	rt_build(ifp->ctx, AF_INET6);
+	rt_defer(ifp->ctx, AF_INET6);
 }
 
 static void
@@ -3010,19 +3434,19 @@ dhcp6_find_delegates(struct interface *ifp)
 		state = D6_STATE(ifd);
 		if (state == NULL || state->state != DH6S_BOUND)
 			continue;
-		TAILQ_FOREACH(ap, &state->addrs, next) {
-			if (!(ap->flags & IPV6_AF_DELEGATEDPFX))
+		for (i = 0; i < ifo->ia_len; i++) {
+			ia = &ifo->ia[i];
+			if (ia->ia_type != D6_OPTION_IA_PD)
 				continue;
-			for (i = 0; i < ifo->ia_len; i++) {
-				ia = &ifo->ia[i];
-				if (ia->ia_type != D6_OPTION_IA_PD)
-					continue;
-				if (memcmp(ia->iaid, ap->iaid,
-				    sizeof(ia->iaid)))
+			for (j = 0; j < ia->sla_len; j++) {
+				sla = &ia->sla[j];
+				if (strcmp(ifp->name, sla->ifname))
 					continue;
-				for (j = 0; j < ia->sla_len; j++) {
-					sla = &ia->sla[j];
-					if (strcmp(ifp->name, sla->ifname))
+				TAILQ_FOREACH(ap, &state->addrs, next) {
+					if (!(ap->flags &
+					    IPV6_AF_DELEGATEDPFX) ||
+					    memcmp(ia->iaid, ap->iaid,
+					    sizeof(ia->iaid)))
 						continue;
 					if (ipv6_linklocal(ifp) == NULL) {
 						logdebugx(
@@ -3047,13 +3471,28 @@ dhcp6_find_delegates(struct interface *ifp)
 		state = D6_STATE(ifp);
 		state->state = DH6S_DELEGATED;
 		ipv6_addaddrs(&state->addrs);
-		rt_build(ifp->ctx, AF_INET6);
+		rt_defer(ifp->ctx, AF_INET6);
 		dhcp6_script_try_run(ifp, 1);
 	}
 	return k;
 }
 #endif
 
+/* Seeded from the DUID and the first IAID. */
+static uint32_t
+dhcp6_spreadseed(const struct interface *ifp)
+{
+	const struct if_options *ifo = ifp->options;
+	uint32_t h;
+
+	h = dhcp_spread_seed(DHCP_SPREAD_SEED,
+	    ifp->ctx->duid, ifp->ctx->duid_len);
+	if (ifo->ia_len != 0)
+		h = dhcp_spread_seed(h, ifo->ia[0].iaid,
+		    sizeof(ifo->ia[0].iaid));
+	return h;
+}
+
 static void
 dhcp6_bind(struct interface *ifp, const char *op, const char *sfrom)
 {
@@ -3088,7 +3527,9 @@ dhcp6_bind(struct interface *ifp, const char *op, const char *sfrom)
 			dhcp6_delete_delegates(ifp);
 #endif
 		state->reason = NULL;
-	} else
+	} else if (ifp->warm)
+		state->reason = NULL; /* REBOOT6, resumed not timed out */
+	else
 		state->reason = "TIMEOUT6";
 
 	eloop_timeout_delete(ifp->ctx->eloop, NULL, ifp);
@@ -3102,7 +3543,7 @@ dhcp6_bind(struct interface *ifp, const char *op, const char *sfrom)
 
 		if (state->reason == NULL)
 			state->reason = "INFORM6";
-		o = dhcp6_findmoption(state->new, state->new_len,
+		o = dhcp6_findmoption(ifp->ctx, state->new, state->new_len,
 				      D6_OPTION_INFO_REFRESH_TIME, &ol);
 		if (o == NULL || ol != sizeof(uint32_t))
 			state->renew = IRT_DEFAULT;
@@ -3178,6 +3619,11 @@ dhcp6_bind(struct interface *ifp, const char *op, const char *sfrom)
 		break;
 	}
 
+	if (ifp->options->renew_spread != 0)
+		dhcp_spread_timers(&state->renew, &state->rebind,
+		    state->expire, ifp->options->renew_spread,
+		    dhcp6_spreadseed(ifp));
+
 	if (state->state != DH6S_CONFIRM && !timedout) {
 		state->acquired = now;
 		free(state->old);
@@ -3225,8 +3671,9 @@ dhcp6_bind(struct interface *ifp, const char *op, const char *sfrom)
 		state->failed = false;
 
 		if (state->renew && state->renew != ND6_INFINITE_LIFETIME)
-			eloop_timeout_add_sec(ifp->ctx->eloop,
-			    state->renew,
+			dhcp_renew_timeout(ifp->ctx->eloop,
+			    state->renew, state->rebind,
+			    ifp->options->timer_slack,
 			    state->state == DH6S_INFORMED ?
 			    dhcp6_startinform : dhcp6_startrenew, ifp);
 		if (state->rebind && state->rebind != ND6_INFINITE_LIFETIME)
@@ -3259,13 +3706,12 @@ dhcp6_bind(struct interface *ifp, const char *op, const char *sfrom)
 		else
 			logmessage(loglevel, "%s: expire in %"PRIu32" seconds",
 			    ifp->name, state->expire);
-		rt_build(ifp->ctx, AF_INET6);
+		rt_defer(ifp->ctx, AF_INET6);
 		if (!confirmed && !timedout) {
-			logdebugx("%s: writing lease: %s",
-			    ifp->name, state->leasefile);
-			if (dhcp_writefile(ifp->ctx, state->leasefile, 0640,
-			    state->new, state->new_len) == -1)
-				logerr("dhcp_writefile: %s",state->leasefile);
+			dhcp_savelease(ifp, &state->leasesave,
+			    state->leasefile, state->new, state->new_len,
+			    offsetof(struct dhcp6_message, xid),
+			    sizeof(state->new->xid));
 		}
 #ifndef SMALL
 		dhcp6_delegate_prefix(ifp);
@@ -3282,7 +3728,7 @@ dhcp6_bind(struct interface *ifp, const char *op, const char *sfrom)
 }
 
 static void
-dhcp6_recvif(struct interface *ifp, const char *sfrom,
+dhcp6_recvif1(struct interface *ifp, const char *sfrom,
     struct dhcp6_message *r, size_t len)
 {
 	struct dhcpcd_ctx *ctx;
@@ -3306,6 +3752,8 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 		    ifp->name);
 		return;
 	}
+	TRACE_EVENT(ctx, TRACE_DHCP6_RECV, ifp,
+	    (uint32_t)r->type << 8 | state->state);
 
 	/* We're already bound and this message is for another machine */
 	/* XXX DELEGATED? */
@@ -3317,7 +3765,9 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 		return;
 	}
 
-	if (dhcp6_findmoption(r, len, D6_OPTION_SERVERID, NULL) == NULL) {
+	if (dhcp6_findmoption(ifp->ctx, r, len,
+	    D6_OPTION_SERVERID, NULL) == NULL)
+	{
 		logdebugx("%s: no DHCPv6 server ID from %s", ifp->name, sfrom);
 		return;
 	}
@@ -3327,15 +3777,19 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 	    i < ctx->dhcp6_opts_len;
 	    i++, opt++)
 	{
-		if (has_option_mask(ifo->requiremask6, opt->option) &&
-		    !dhcp6_findmoption(r, len, (uint16_t)opt->option, NULL))
+		if (has_option_mask(ifo->optmasks->requiremask6,
+		    opt->option) &&
+		    !dhcp6_findmoption(ifp->ctx, r, len,
+		    (uint16_t)opt->option, NULL))
 		{
 			logwarnx("%s: reject DHCPv6 (no option %s) from %s",
 			    ifp->name, opt->var, sfrom);
 			return;
 		}
-		if (has_option_mask(ifo->rejectmask6, opt->option) &&
-		    dhcp6_findmoption(r, len, (uint16_t)opt->option, NULL))
+		if (has_option_mask(ifo->optmasks->rejectmask6,
+		    opt->option) &&
+		    dhcp6_findmoption(ifp->ctx, r, len,
+		    (uint16_t)opt->option, NULL))
 		{
 			logwarnx("%s: reject DHCPv6 (option %s) from %s",
 			    ifp->name, opt->var, sfrom);
@@ -3345,7 +3799,7 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 
 #ifdef AUTH
 	/* Authenticate the message */
-	auth = dhcp6_findmoption(r, len, D6_OPTION_AUTH, &auth_len);
+	auth = dhcp6_findmoption(ifp->ctx, r, len, D6_OPTION_AUTH, &auth_len);
 	if (auth != NULL) {
 		if (dhcp_auth_validate(&state->auth, &ifo->auth,
 		    (uint8_t *)r, len, 6, r->type, auth, auth_len) == NULL)
@@ -3388,10 +3842,10 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 		case DH6S_DISCOVER:
 			/* Only accept REPLY in DISCOVER for RAPID_COMMIT.
 			 * Normally we get an ADVERTISE for a DISCOVER. */
-			if (!has_option_mask(ifo->requestmask6,
+			if (!has_option_mask(ifo->optmasks->requestmask6,
 			    D6_OPTION_RAPID_COMMIT) ||
-			    !dhcp6_findmoption(r, len, D6_OPTION_RAPID_COMMIT,
-					      NULL))
+			    !dhcp6_findmoption(ifp->ctx, r, len,
+			    D6_OPTION_RAPID_COMMIT, NULL))
 			{
 				valid_op = false;
 				break;
@@ -3452,7 +3906,8 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 			break;
 		}
 		/* RFC7083 */
-		o = dhcp6_findmoption(r, len, D6_OPTION_SOL_MAX_RT, &ol);
+		o = dhcp6_findmoption(ifp->ctx, r, len,
+		    D6_OPTION_SOL_MAX_RT, &ol);
 		if (o && ol == sizeof(uint32_t)) {
 			uint32_t max_rt;
 
@@ -3468,7 +3923,8 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 				logerr("%s: invalid SOL_MAX_RT %u",
 				    ifp->name, max_rt);
 		}
-		o = dhcp6_findmoption(r, len, D6_OPTION_INF_MAX_RT, &ol);
+		o = dhcp6_findmoption(ifp->ctx, r, len,
+		    D6_OPTION_INF_MAX_RT, &ol);
 		if (o && ol == sizeof(uint32_t)) {
 			uint32_t max_rt;
 
@@ -3498,7 +3954,8 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 #ifdef AUTH
 		}
 		loginfox("%s: %s from %s", ifp->name, op, sfrom);
-		o = dhcp6_findmoption(r, len, D6_OPTION_RECONF_MSG, &ol);
+		o = dhcp6_findmoption(ifp->ctx, r, len,
+		    D6_OPTION_RECONF_MSG, &ol);
 		if (o == NULL) {
 			logerrx("%s: missing Reconfigure Message option",
 			    ifp->name);
@@ -3558,6 +4015,7 @@ dhcp6_recvif(struct interface *ifp, const char *sfrom,
 	}
 	memcpy(state->recv, r, len);
 	state->recv_len = len;
+	MEMSAMPLE(ifp->ctx, MEM_LEASE);
 
 	if (r->type == DHCP6_ADVERTISE) {
 		struct ipv6_addr *ia;
@@ -3584,6 +4042,19 @@ bind:
 	dhcp6_bind(ifp, op, sfrom);
 }
 
+static void
+dhcp6_recvif(struct interface *ifp, const char *sfrom,
+    struct dhcp6_message *r, size_t len)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct dhcp6_optindex idx;
+
+	/* ifp may not survive handling the message, but ctx will. */
+	dhcp6_optindex_push(ctx, &idx, r, len);
+	dhcp6_recvif1(ifp, sfrom, r, len);
+	dhcp6_optindex_pop(ctx, &idx);
+}
+
 void
 dhcp6_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg, struct ipv6_addr *ia)
 {
@@ -3611,12 +4082,13 @@ dhcp6_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg, struct ipv6_addr *ia)
 			return;
 		}
 	}
+	ifp->stats.rx[IF_STAT_DHCP6]++;
 
 	r = (struct dhcp6_message *)msg->msg_iov[0].iov_base;
 
 	uint8_t duid[DUID_LEN], *dp;
 	size_t duid_len;
-	o = dhcp6_findmoption(r, len, D6_OPTION_CLIENTID, &ol);
+	o = dhcp6_findmoption(ctx, r, len, D6_OPTION_CLIENTID, &ol);
 	if (ifp->options->options & DHCPCD_ANONYMOUS) {
 		duid_len = duid_make(duid, ifp, DUID_LL);
 		dp = duid;
@@ -3627,12 +4099,14 @@ dhcp6_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg, struct ipv6_addr *ia)
 	if (o == NULL || ol != duid_len || memcmp(o, dp, ol) != 0) {
 		logdebugx("%s: incorrect client ID from %s",
 		    ifp->name, sfrom);
+		ifp->stats.dropped[IF_STAT_DHCP6]++;
 		return;
 	}
 
-	if (dhcp6_findmoption(r, len, D6_OPTION_SERVERID, NULL) == NULL) {
+	if (dhcp6_findmoption(ctx, r, len, D6_OPTION_SERVERID, NULL) == NULL) {
 		logdebugx("%s: no DHCPv6 server ID from %s",
 		    ifp->name, sfrom);
+		ifp->stats.dropped[IF_STAT_DHCP6]++;
 		return;
 	}
 
@@ -3640,6 +4114,7 @@ dhcp6_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg, struct ipv6_addr *ia)
 		if (!IN6_IS_ADDR_LINKLOCAL(&from->sin6_addr)) {
 			logerrx("%s: RECONFIGURE6 recv from %s, not LL",
 			    ifp->name, sfrom);
+			ifp->stats.dropped[IF_STAT_DHCP6]++;
 			return;
 		}
 		goto recvif;
@@ -3666,6 +4141,8 @@ dhcp6_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg, struct ipv6_addr *ia)
 		}
 
 		if (ifp1 == NULL) {
+			ifp->stats.xid_mismatch++;
+			ifp->stats.dropped[IF_STAT_DHCP6]++;
 			if (state != NULL)
 				logdebugx("%s: wrong xid 0x%02x%02x%02x"
 				    " (expecting 0x%02x%02x%02x) from %s",
@@ -3709,8 +4186,8 @@ dhcp6_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg, struct ipv6_addr *ia)
 	close(fd);
 
 	/* Copy across ServerID so we can work with our own server. */
-	si1 = dhcp6_findmoption(r, len, D6_OPTION_SERVERID, &si_len1);
-	si2 = dhcp6_findmoption(tbuf, (size_t)tlen,
+	si1 = dhcp6_findmoption(ctx, r, len, D6_OPTION_SERVERID, &si_len1);
+	si2 = dhcp6_findmoption(ctx, tbuf, (size_t)tlen,
 	    D6_OPTION_SERVERID, &si_len2);
 	if (si1 != NULL && si2 != NULL && si_len1 == si_len2)
 		memcpy(si2, si1, si_len2);
@@ -3723,49 +4200,32 @@ recvif:
 }
 
 static void
-dhcp6_recv(struct dhcpcd_ctx *ctx, struct ipv6_addr *ia, unsigned short events)
+dhcp6_recvaddrmsg(void *arg, struct msghdr *msg)
 {
-	struct sockaddr_in6 from;
-	union {
-		struct dhcp6_message dhcp6;
-		uint8_t buf[UDPLEN_MAX]; /* Maximum UDP message size */
-	} iovbuf;
-	struct iovec iov = {
-		.iov_base = iovbuf.buf, .iov_len = sizeof(iovbuf.buf),
-	};
-	union {
-		struct cmsghdr hdr;
-		uint8_t buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-	} cmsgbuf = { .buf = { 0 } };
-	struct msghdr msg = {
-	    .msg_name = &from, .msg_namelen = sizeof(from),
-	    .msg_iov = &iov, .msg_iovlen = 1,
-	    .msg_control = cmsgbuf.buf, .msg_controllen = sizeof(cmsgbuf.buf),
-	};
-	int s;
-	ssize_t bytes;
+	struct ipv6_addr *ia = arg;
 
-	if (events != ELE_READ)
-		logerrx("%s: unexpected event 0x%04x", __func__, events);
+	dhcp6_recvmsg(ia->iface->ctx, msg, ia);
+}
 
-	s = ia != NULL ? ia->dhcp6_fd : ctx->dhcp6_rfd;
-	bytes = recvmsg(s, &msg, 0);
-	if (bytes == -1) {
-		logerr(__func__);
-		return;
-	}
+static void
+dhcp6_recvctxmsg(void *arg, struct msghdr *msg)
+{
 
-	iov.iov_len = (size_t)bytes;
-	dhcp6_recvmsg(ctx, &msg, ia);
+	dhcp6_recvmsg(arg, msg, NULL);
 }
 
 static void
-
 dhcp6_recvaddr(void *arg, unsigned short events)
 {
 	struct ipv6_addr *ia = arg;
 
-	dhcp6_recv(ia->iface->ctx, ia, events);
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	/* Handling a message can free ia, so read one at a time. */
+	if (recvmsgs(ia->iface->ctx, ia->dhcp6_fd, 1,
+	    dhcp6_recvaddrmsg, ia) == -1)
+		logerr(__func__);
 }
 
 static void
@@ -3773,7 +4233,12 @@ dhcp6_recvctx(void *arg, unsigned short events)
 {
 	struct dhcpcd_ctx *ctx = arg;
 
-	dhcp6_recv(ctx, NULL, events);
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	if (recvmsgs(ctx, ctx->dhcp6_rfd, RECVMSGS_MAX,
+	    dhcp6_recvctxmsg, ctx) == -1)
+		logerr(__func__);
 }
 
 int
@@ -3881,10 +4346,7 @@ dhcp6_start1(void *arg)
 {
 	struct interface *ifp = arg;
 	struct dhcpcd_ctx *ctx = ifp->ctx;
-	struct if_options *ifo = ifp->options;
 	struct dhcp6_state *state;
-	size_t i;
-	const struct dhcp_compat *dhc;
 
 	if ((ctx->options & (DHCPCD_MANAGER|DHCPCD_PRIVSEP)) == DHCPCD_MANAGER &&
 	    ctx->dhcp6_rfd == -1)
@@ -3898,6 +4360,12 @@ dhcp6_start1(void *arg)
 		    dhcp6_recvctx, ctx) == -1)
 			logerr("%s: eloop_event_add", __func__);
 	}
+#ifdef PRIVSEP
+	if ((ctx->options & (DHCPCD_MANAGER|DHCPCD_PRIVSEP)) ==
+	    (DHCPCD_MANAGER|DHCPCD_PRIVSEP) &&
+	    ps_inet_listen(ctx, PS_DHCP6) == -1)
+		logerr("%s: ps_inet_listen", __func__);
+#endif
 
 	if (!IN_PRIVSEP(ctx) && ctx->dhcp6_wfd == -1) {
 		ctx->dhcp6_wfd = dhcp6_openraw();
@@ -3907,40 +4375,67 @@ dhcp6_start1(void *arg)
 		}
 	}
 
+	if (dhcp6_optmasks(ifp) == -1) {
+		logerr(__func__);
+		return;
+	}
+
 	state = D6_STATE(ifp);
+	if (state->state == DH6S_INFORM)
+		dhcp6_startinform(ifp);
+	else
+		dhcp6_startinit(ifp);
+
+#ifndef SMALL
+	dhcp6_activateinterfaces(ifp);
+#endif
+}
+
+/* Work out what to request from the configured options.
+ * configure_interface does the same for new options so they
+ * can be compared with the ones in use. */
+int
+dhcp6_optmasks(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct if_options *ifo = ifp->options;
+	const struct dhcp6_state *state = D6_CSTATE(ifp);
+	struct if_optmasks *om;
+	size_t i;
+	const struct dhcp_compat *dhc;
+
+	if (if_optmasks_unshare(ctx, ifo) == -1)
+		return -1;
+	om = ifo->optmasks;
+
 	/* If no DHCPv6 options are configured,
 	   match configured DHCPv4 options to DHCPv6 equivalents. */
-	for (i = 0; i < sizeof(ifo->requestmask6); i++) {
-		if (ifo->requestmask6[i] != '\0')
+	for (i = 0; i < sizeof(om->requestmask6); i++) {
+		if (om->requestmask6[i] != '\0')
 			break;
 	}
-	if (i == sizeof(ifo->requestmask6)) {
+	if (i == sizeof(om->requestmask6)) {
 		for (dhc = dhcp_compats; dhc->dhcp_opt; dhc++) {
 			if (DHC_REQ(ifo->requestmask, ifo->nomask, dhc->dhcp_opt))
-				add_option_mask(ifo->requestmask6,
+				add_option_mask(om->requestmask6,
 				    dhc->dhcp6_opt);
 		}
 		if (ifo->fqdn != FQDN_DISABLE || ifo->options & DHCPCD_HOSTNAME)
-			add_option_mask(ifo->requestmask6, D6_OPTION_FQDN);
+			add_option_mask(om->requestmask6, D6_OPTION_FQDN);
 	}
 
 #ifndef SMALL
 	/* Rapid commit won't work with Prefix Delegation Exclusion */
 	if (dhcp6_findselfsla(ifp))
-		del_option_mask(ifo->requestmask6, D6_OPTION_RAPID_COMMIT);
+		del_option_mask(om->requestmask6, D6_OPTION_RAPID_COMMIT);
 #endif
 
-	if (state->state == DH6S_INFORM) {
-		add_option_mask(ifo->requestmask6, D6_OPTION_INFO_REFRESH_TIME);
-		dhcp6_startinform(ifp);
-	} else {
-		del_option_mask(ifo->requestmask6, D6_OPTION_INFO_REFRESH_TIME);
-		dhcp6_startinit(ifp);
-	}
-
-#ifndef SMALL
-	dhcp6_activateinterfaces(ifp);
-#endif
+	if (state != NULL && state->state == DH6S_INFORM)
+		add_option_mask(om->requestmask6, D6_OPTION_INFO_REFRESH_TIME);
+	else
+		del_option_mask(om->requestmask6, D6_OPTION_INFO_REFRESH_TIME);
+	if_optmasks_intern(ctx, ifo);
+	return 0;
 }
 
 int
@@ -4040,6 +4535,8 @@ dhcp6_reboot(struct interface *ifp)
 		return;
 
 	state->lerror = 0;
+	/* Our options may have changed. */
+	dhcp6_freemsgopts(state);
 	switch (state->state) {
 	case DH6S_BOUND:
 		dhcp6_startrebind(ifp);
@@ -4092,7 +4589,8 @@ dhcp6_freedrop(struct interface *ifp, int drop, const char *reason)
 				dhcp6_startrelease(ifp);
 				return;
 			}
-			dhcp_unlink(ifp->ctx, state->leasefile);
+			dhcp_unlinklease(ifp, &state->leasesave,
+			    state->leasefile);
 		}
 #ifdef AUTH
 		else if (state->auth.reconf != NULL) {
@@ -4103,7 +4601,8 @@ dhcp6_freedrop(struct interface *ifp, int drop, const char *reason)
 			 * If dhcpcd is restarted, the token is lost.
 			 * XXX persist this in another file?
 			 */
-			dhcp_unlink(ifp->ctx, state->leasefile);
+			dhcp_unlinklease(ifp, &state->leasesave,
+			    state->leasefile);
 		}
 #endif
 
@@ -4123,6 +4622,9 @@ dhcp6_freedrop(struct interface *ifp, int drop, const char *reason)
 		free(state->old);
 		free(state->send);
 		free(state->recv);
+		dhcp6_freemsgopts(state);
+		dhcp_flushlease(ifp, &state->leasesave, state->leasefile, true);
+		dhcp_forgetlease(&state->leasesave);
 		free(state);
 		ifp->if_data[IF_DATA_DHCP6] = NULL;
 	}
@@ -4290,7 +4792,7 @@ dhcp6_env(FILE *fp, const char *prefix, const struct interface *ifp,
 			break;
 		}
 		o.code = ntohs(o.code);
-		if (has_option_mask(ifo->nomask6, o.code))
+		if (has_option_mask(ifo->optmasks->nomask6, o.code))
 			continue;
 		for (i = 0, opt = ifo->dhcp6_override;
 		    i < ifo->dhcp6_override_len;
@@ -4306,15 +4808,9 @@ dhcp6_env(FILE *fp, const char *prefix, const struct interface *ifp,
 			vo = vivso_find(en, ifp);
 		} else
 			vo = NULL;
-		if (i == ifo->dhcp6_override_len) {
-			for (i = 0, opt = ctx->dhcp6_opts;
-			    i < ctx->dhcp6_opts_len;
-			    i++, opt++)
-				if (opt->option == o.code)
-					break;
-			if (i == ctx->dhcp6_opts_len)
-				opt = NULL;
-		}
+		if (i == ifo->dhcp6_override_len)
+			opt = dhcp_optsearch(NULL, ctx->dhcp6_optsort,
+			    ctx->dhcp6_opts, ctx->dhcp6_opts_len, o.code);
 		if (opt) {
 			dhcp_envoption(ifp->ctx,
 			    fp, pfx, ifp->name,
@@ -174,6 +174,25 @@ enum DH6S {
 	DH6S_RELEASED,
 };
 
+/* What cached message options were made from, see dhcp6_msgopts. */
+struct dhcp6_optskey {
+	const struct if_options *ifo;
+	unsigned long long options;
+	uint8_t type;
+	bool rapid;
+	bool selfsla;
+	char hostname[HOSTNAME_MAX_LEN + 1];
+};
+
+struct dhcp6_msgopts {
+	uint8_t *data;
+	size_t len;
+	struct dhcp6_optskey key;
+};
+
+/* One set for each message type we send */
+#define	DHCP6_MSGOPTS_MAX	DHCP6_INFORMATION_REQ
+
 struct dhcp6_state {
 	enum DH6S state;
 	struct timespec started;
@@ -199,6 +218,7 @@ struct dhcp6_state {
 	size_t new_len;
 	struct dhcp6_message *old;
 	size_t old_len;
+	struct dhcp6_msgopts msgopts[DHCP6_MSGOPTS_MAX];
 
 	struct timespec acquired;
 	uint32_t renew;
@@ -209,11 +229,13 @@ struct dhcp6_state {
 	uint32_t lowpl;
 	/* The +3 is for the possible .pd extension for prefix delegation */
 	char leasefile[sizeof(LEASEFILE6) + IF_NAMESIZE + (IF_SSIDLEN * 4) +3];
+	struct dhcp_leasesave leasesave;
 	const char *reason;
 	uint16_t lerror; /* Last error received from DHCPv6 reply. */
 	bool has_no_binding;
 	bool failed; /* Entered the failed state - used to rate limit log. */
 	bool new_start; /* New external start, to determine log type. */
+	bool pd_pending; /* see dhcp6_delegate_prefix */
 #ifdef AUTH
 	struct authstate auth;
 #endif
@@ -237,6 +259,7 @@ const struct ipv6_addr *dhcp6_iffindaddr(const struct interface *ifp,
 struct ipv6_addr *dhcp6_findaddr(struct dhcpcd_ctx *, const struct in6_addr *,
     unsigned int);
 size_t dhcp6_find_delegates(struct interface *);
+int dhcp6_optmasks(struct interface *);
 int dhcp6_start(struct interface *, enum DH6S);
 void dhcp6_reboot(struct interface *);
 void dhcp6_renew(struct interface *);
@@ -245,6 +268,7 @@ ssize_t dhcp6_env(FILE *, const char *, const struct interface *,
 void dhcp6_free(struct interface *);
 void dhcp6_handleifa(int, struct ipv6_addr *, pid_t);
 bool dhcp6_dadcompleted(const struct interface *);
+void dhcp6_daddone(struct interface *);
 void dhcp6_abort(struct interface *);
 void dhcp6_drop(struct interface *, const char *);
 int dhcp6_dump(struct interface *);
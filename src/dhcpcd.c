@@ -62,15 +62,19 @@ static const char dhcpcd_copyright[] = "Copyright (c) 2006-2021 Roy Marples";
 #include "dhcp6.h"
 #include "duid.h"
 #include "eloop.h"
+#include "handoff.h"
+#include "hooks.h"
 #include "if.h"
 #include "if-options.h"
 #include "ipv4.h"
 #include "ipv4ll.h"
 #include "ipv6.h"
 #include "ipv6nd.h"
+#include "leasedb.h"
 #include "logerr.h"
 #include "privsep.h"
 #include "script.h"
+#include "shard.h"
 
 #ifdef HAVE_CAPSICUM
 #include <sys/capsicum.h>
@@ -99,6 +103,11 @@ const size_t dhcpcd_signals_ignore_len = __arraycount(dhcpcd_signals_ignore);
 
 const char *dhcpcd_default_script = SCRIPT;
 
+static void dhcpcd_startnext(void *);
+#ifndef SMALL
+static void dhcpcd_memlog(struct dhcpcd_ctx *);
+#endif
+
 static void
 usage(void)
 {
@@ -122,13 +131,16 @@ printf("usage: "PACKAGE"\t[-146ABbDdEGgHJKLMNPpqTV]\n"
 	"       "PACKAGE"\t-k, --release [interface]\n"
 	"       "PACKAGE"\t-U, --dumplease interface\n"
 	"       "PACKAGE"\t--version\n"
+#ifndef SMALL
+	"       "PACKAGE"\t--stats eloop | control | counters | memory |\n"
+	"\t\tprivsep | trace [interface]\n"
+#endif
 	"       "PACKAGE"\t-x, --exit [interface]\n");
 }
 
 static void
 free_globals(struct dhcpcd_ctx *ctx)
 {
-	struct dhcp_opt *opt;
 
 	if (ctx->ifac) {
 		for (; ctx->ifac > 0; ctx->ifac--)
@@ -149,44 +161,7 @@ free_globals(struct dhcpcd_ctx *ctx)
 		ctx->ifcv = NULL;
 	}
 
-#ifdef INET
-	if (ctx->dhcp_opts) {
-		for (opt = ctx->dhcp_opts;
-		    ctx->dhcp_opts_len > 0;
-		    opt++, ctx->dhcp_opts_len--)
-			free_dhcp_opt_embenc(opt);
-		free(ctx->dhcp_opts);
-		ctx->dhcp_opts = NULL;
-	}
-#endif
-#ifdef INET6
-	if (ctx->nd_opts) {
-		for (opt = ctx->nd_opts;
-		    ctx->nd_opts_len > 0;
-		    opt++, ctx->nd_opts_len--)
-			free_dhcp_opt_embenc(opt);
-		free(ctx->nd_opts);
-		ctx->nd_opts = NULL;
-	}
-#ifdef DHCP6
-	if (ctx->dhcp6_opts) {
-		for (opt = ctx->dhcp6_opts;
-		    ctx->dhcp6_opts_len > 0;
-		    opt++, ctx->dhcp6_opts_len--)
-			free_dhcp_opt_embenc(opt);
-		free(ctx->dhcp6_opts);
-		ctx->dhcp6_opts = NULL;
-	}
-#endif
-#endif
-	if (ctx->vivso) {
-		for (opt = ctx->vivso;
-		    ctx->vivso_len > 0;
-		    opt++, ctx->vivso_len--)
-			free_dhcp_opt_embenc(opt);
-		free(ctx->vivso);
-		ctx->vivso = NULL;
-	}
+	leasedb_free(ctx);
 }
 
 static void
@@ -356,8 +331,10 @@ dhcpcd_daemonise(struct dhcpcd_ctx *ctx)
 	    !(ctx->options & DHCPCD_DAEMONISE))
 		return;
 
-	/* Don't use loginfo because this makes no sense in a log. */
-	if (!(logopts & LOGERR_QUIET) && ctx->stderr_valid)
+	/* Don't use loginfo because this makes no sense in a log.
+	 * Shards leave it to the coordinator. */
+	if (!(logopts & LOGERR_QUIET) && ctx->stderr_valid &&
+	    !SHARD_WORKER(ctx))
 		(void)fprintf(stderr,
 		    "forked to background, child pid %d\n", getpid());
 	i = EXIT_SUCCESS;
@@ -425,6 +402,11 @@ stop_interface(struct interface *ifp, const char *reason)
 
 	/* De-activate the interface */
 	ifp->active = IF_INACTIVE;
+	if (ifp->start_state == IF_START_RUNNING) {
+		ctx->start_running--;
+		eloop_timeout_add_sec(ctx->eloop, 0, dhcpcd_startnext, ctx);
+	}
+	ifp->start_state = IF_START_NONE;
 	ifp->options->options &= ~DHCPCD_STOPPING;
 
 	if (!(ctx->options & (DHCPCD_MANAGER | DHCPCD_TEST)))
@@ -543,7 +525,7 @@ configure_interface1(struct interface *ifp)
 	if (ifo->ia_len == 0 && ifo->options & DHCPCD_IPV6 &&
 	    ifp->name[0] != '\0')
 	{
-		ifo->ia = malloc(sizeof(*ifo->ia));
+		ifo->ia = calloc(1, sizeof(*ifo->ia));
 		if (ifo->ia == NULL)
 			logerr(__func__);
 		else {
@@ -606,6 +588,7 @@ dhcpcd_selectprofile(struct interface *ifp, const char *profile)
 
 	free_options(ifp->ctx, ifp->options);
 	ifp->options = ifo;
+	MEMSAMPLE(ifp->ctx, MEM_OPTIONS);
 	if (profile) {
 		add_options(ifp->ctx, ifp->name, ifp->options,
 		    ifp->ctx->argc, ifp->ctx->argv);
@@ -614,29 +597,69 @@ dhcpcd_selectprofile(struct interface *ifp, const char *profile)
 	return 1;
 }
 
-static void
+/* Returns what has to be restarted for the new options,
+ * see if_options_diff. */
+static unsigned int
 configure_interface(struct interface *ifp, int argc, char **argv,
     unsigned long long options)
 {
-	time_t old;
+	struct if_options *old;
+	unsigned int changed;
 
-	old = ifp->options ? ifp->options->mtime : 0;
+	old = ifp->options;
+	ifp->options = NULL;
 	dhcpcd_selectprofile(ifp, NULL);
+	if (ifp->options == NULL) {
+		ifp->options = old;
+		old = NULL;
+	}
 	if (ifp->options == NULL) {
 		/* dhcpcd cannot continue with this interface. */
 		ifp->active = IF_INACTIVE;
-		return;
+		return IFO_CHANGED_ALL;
 	}
 	add_options(ifp->ctx, ifp->name, ifp->options, argc, argv);
 	ifp->options->options |= options;
 	configure_interface1(ifp);
+#ifdef DHCP6
+	/* Derive the DHCPv6 options to request now rather than when
+	 * DHCPv6 starts so that reloaded options compare the same. */
+	if (dhcp6_optmasks(ifp) == -1)
+		logerr(__func__);
+#endif
 
-	/* If the mtime has changed drop any old lease */
-	if (old != 0 && ifp->options->mtime != old) {
-		logwarnx("%s: config file changed, expiring leases",
-		    ifp->name);
-		dhcpcd_drop(ifp, 0);
+	if (old == NULL)
+		return IFO_CHANGED_ALL;
+	changed = if_options_diff(old, ifp->options);
+
+	/* If the config file has changed drop any old lease
+	 * learned with settings that are now different. */
+	if (ifp->options->mtime != old->mtime) {
+		if (changed & IFO_CHANGED_IF) {
+			logwarnx("%s: config file changed, expiring leases",
+			    ifp->name);
+			dhcpcd_drop(ifp, 0);
+		} else {
+#ifdef DHCP6
+			if (changed & IFO_CHANGED_DHCP6)
+				dhcp6_drop(ifp, "EXPIRE6");
+#endif
+#ifdef INET6
+			if (changed & IFO_CHANGED_IPV6)
+				ipv6nd_drop(ifp);
+#endif
+#ifdef INET
+			if (changed & IFO_CHANGED_DHCP) {
+#ifdef IPV4LL
+				ipv4ll_drop(ifp);
+#endif
+				dhcp_drop(ifp, "EXPIRE");
+			}
+#endif
+		}
 	}
+	free_options(ifp->ctx, old);
+	return changed;
 }
 
 static void
@@ -650,7 +673,7 @@ dhcpcd_initstate2(struct interface *ifp, unsigned long long options)
 			return;
 		}
 		ifo->options |= options;
-		free(ifp->options);
+		free_options(ifp->ctx, ifp->options);
 		ifp->options = ifo;
 	} else
 		ifo = ifp->options;
@@ -663,14 +686,16 @@ dhcpcd_initstate2(struct interface *ifp, unsigned long long options)
 #endif
 }
 
-static void
+static unsigned int
 dhcpcd_initstate1(struct interface *ifp, int argc, char **argv,
     unsigned long long options)
 {
+	unsigned int changed;
 
-	configure_interface(ifp, argc, argv, options);
+	changed = configure_interface(ifp, argc, argv, options);
 	if (ifp->active)
 		dhcpcd_initstate2(ifp, 0);
+	return changed;
 }
 
 static void
@@ -711,18 +736,13 @@ dhcpcd_nocarrier_roaming(struct interface *ifp)
 	dhcp6_abort(ifp);
 #endif
 
-	rt_build(ifp->ctx, AF_UNSPEC);
+	rt_defer(ifp->ctx, AF_UNSPEC);
 	script_runreason(ifp, "NOCARRIER_ROAMING");
 }
 
-void
-dhcpcd_handlecarrier(struct interface *ifp, int carrier, unsigned int flags)
+static void
+dhcpcd_carrierchange(struct interface *ifp, bool was_link_up, bool was_roaming)
 {
-	bool was_link_up = if_is_link_up(ifp);
-	bool was_roaming = if_roaming(ifp);
-
-	ifp->carrier = carrier;
-	ifp->flags = flags;
 
 	if (!if_is_link_up(ifp)) {
 		if (!ifp->active || (!was_link_up && !was_roaming))
@@ -768,7 +788,7 @@ dhcpcd_handlecarrier(struct interface *ifp, int carrier, unsigned int flags)
 		return;
 
 	if (ifp->active) {
-		if (carrier == LINK_UNKNOWN)
+		if (ifp->carrier == LINK_UNKNOWN)
 			loginfox("%s: carrier unknown, assuming up", ifp->name);
 		else
 			loginfox("%s: carrier acquired", ifp->name);
@@ -789,6 +809,12 @@ dhcpcd_handlecarrier(struct interface *ifp, int carrier, unsigned int flags)
 		memcpy(ossid, ifp->ssid, ifp->ssid_len);
 		if_getssid(ifp);
 
+#ifdef INET6
+		if (ifp->ssid_len != olen ||
+		    memcmp(ifp->ssid, ossid, ifp->ssid_len))
+			ipv6_flushstableprivate(ifp);
+#endif
+
 		/* If we changed SSID network, drop leases */
 		if ((ifp->ssid_len != olen ||
 		    memcmp(ifp->ssid, ossid, ifp->ssid_len)) && ifp->active)
@@ -820,6 +846,176 @@ dhcpcd_handlecarrier(struct interface *ifp, int carrier, unsigned int flags)
 	dhcpcd_startinterface(ifp);
 }
 
+/*
+ * Carrier damping works much like BGP route flap damping.
+ * A lost carrier is held back for carrier_holddown seconds, so a link
+ * which comes straight back costs nothing.
+ * Each loss also adds CARRIER_PENALTY to a penalty which halves every
+ * carrier_halflife seconds. Once it reaches carrier_suppress every
+ * change is held until it decays to carrier_reuse.
+ * The penalty is capped so this lasts no more than four half lives.
+ * When a hold ends the link is compared with how it was when the
+ * hold started, so any number of flaps cost at most one change.
+ */
+static unsigned int
+dhcpcd_carrierpenalty(const struct interface *ifp, const struct timespec *now)
+{
+	unsigned int halflife = ifp->options->carrier_halflife;
+	unsigned int penalty = ifp->carrier_penalty;
+	unsigned long long secs;
+
+	if (penalty == 0 || halflife == 0)
+		return 0;
+
+	/* Halve for each half life, then fall linearly which is
+	 * close enough to the curve in between. */
+	secs = eloop_timespec_diff(now, &ifp->carrier_penalised, NULL);
+	for (; secs >= halflife && penalty != 0; secs -= halflife)
+		penalty /= 2;
+	return penalty - (unsigned int)(penalty * secs / (2ULL * halflife));
+}
+
+/* Seconds until the penalty decays to carrier_reuse. */
+static unsigned long long
+dhcpcd_carrierreuse(const struct interface *ifp, const struct timespec *now)
+{
+	unsigned int halflife = ifp->options->carrier_halflife;
+	unsigned int reuse = ifp->options->carrier_reuse;
+	unsigned int penalty = dhcpcd_carrierpenalty(ifp, now);
+	unsigned long long secs = 0;
+
+	if (penalty <= reuse)
+		return 0;
+	for (; penalty / 2 > reuse; penalty /= 2)
+		secs += halflife;
+	secs += (2ULL * halflife * (penalty - reuse) + penalty - 1) / penalty;
+	return secs;
+}
+
+/* Seconds until the hold on the interface can end, 0 if now. */
+static unsigned long long
+dhcpcd_carrierwait(struct interface *ifp, const struct timespec *now)
+{
+	unsigned long long secs, reuse;
+
+	secs = eloop_timespec_diff(now, &ifp->carrier_heldtime, NULL);
+	secs = secs < ifp->options->carrier_holddown ?
+	    ifp->options->carrier_holddown - secs : 0;
+
+	if (ifp->carrier_suppressed) {
+		reuse = dhcpcd_carrierreuse(ifp, now);
+		if (reuse == 0) {
+			loginfox("%s: carrier damping ended", ifp->name);
+			ifp->carrier_suppressed = false;
+		} else if (reuse > secs)
+			secs = reuse;
+	}
+	return secs;
+}
+
+static void
+dhcpcd_carrierrelease(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	struct interface *ifp;
+	struct timespec now;
+	unsigned long long secs, wait = 0;
+
+	if (ctx->ifaces == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if (!ifp->carrier_held)
+			continue;
+		secs = dhcpcd_carrierwait(ifp, &now);
+		if (secs != 0) {
+			if (wait == 0 || secs < wait)
+				wait = secs;
+			continue;
+		}
+
+		ifp->carrier_held = false;
+		if (if_is_link_up(ifp) != ifp->carrier_heldup)
+			dhcpcd_carrierchange(ifp, ifp->carrier_heldup, false);
+		else
+			logdebugx("%s: carrier unchanged after hold",
+			    ifp->name);
+	}
+
+	if (wait != 0)
+		eloop_timeout_add_sec(ctx->eloop,
+		    wait > UINT_MAX ? UINT_MAX : (unsigned int)wait,
+		    dhcpcd_carrierrelease, ctx);
+}
+
+/* Returns true if the change to the link is held back. */
+static bool
+dhcpcd_carrierdamp(struct interface *ifp, bool was_link_up)
+{
+	struct if_options *ifo = ifp->options;
+	struct timespec now;
+	bool is_link_up = if_is_link_up(ifp);
+	unsigned long long penalty, cap;
+
+	if (!ifp->carrier_held &&
+	    (!ifp->active || ifo == NULL || is_link_up == was_link_up ||
+	    (ifo->carrier_holddown == 0 && ifo->carrier_halflife == 0)))
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (was_link_up && !is_link_up && ifo->carrier_halflife != 0) {
+		penalty = dhcpcd_carrierpenalty(ifp, &now) + CARRIER_PENALTY;
+		cap = (unsigned long long)ifo->carrier_reuse << 4;
+		ifp->carrier_penalty = (unsigned int)MIN(penalty, cap);
+		ifp->carrier_penalised = now;
+		if (!ifp->carrier_suppressed &&
+		    ifp->carrier_penalty >= ifo->carrier_suppress)
+		{
+			loginfox("%s: carrier flapping, damping changes",
+			    ifp->name);
+			ifp->carrier_suppressed = true;
+		}
+	}
+
+	if (!ifp->carrier_held) {
+		if (!ifp->carrier_suppressed &&
+		    (is_link_up || ifo->carrier_holddown == 0))
+			return false;
+		logdebugx("%s: carrier lost, holding", ifp->name);
+		ifp->carrier_held = true;
+		ifp->carrier_heldup = was_link_up;
+		ifp->carrier_heldtime = now;
+	} else if (!ifp->carrier_suppressed &&
+	    is_link_up == ifp->carrier_heldup)
+	{
+		logdebugx("%s: carrier restored within hold", ifp->name);
+		ifp->carrier_held = false;
+		return true;
+	}
+
+	dhcpcd_carrierrelease(ifp->ctx);
+	return true;
+}
+
+void
+dhcpcd_handlecarrier(struct interface *ifp, int carrier, unsigned int flags)
+{
+	bool was_link_up = if_is_link_up(ifp);
+	bool was_roaming = if_roaming(ifp);
+
+	/* The kernel may flush routes without telling us. */
+	if ((ifp->flags ^ flags) & IFF_UP)
+		rt_kinvalidate(ifp->ctx, AF_UNSPEC);
+
+	ifp->carrier = carrier;
+	ifp->flags = flags;
+
+	if (dhcpcd_carrierdamp(ifp, was_link_up))
+		return;
+	dhcpcd_carrierchange(ifp, was_link_up, was_roaming);
+}
+
 static void
 warn_iaid_conflict(struct interface *ifp, uint16_t ia_type, uint8_t *iaid)
 {
@@ -874,10 +1070,10 @@ log:
 	    hwaddr_ntoa(ctx->duid, ctx->duid_len, buf, sizeof(buf)));
 }
 
-void
-dhcpcd_startinterface(void *arg)
+/* Start the protocols in changed, see if_options_diff. */
+static void
+dhcpcd_startinterface1(struct interface *ifp, unsigned int changed)
 {
-	struct interface *ifp = arg;
 	struct if_options *ifo = ifp->options;
 
 	if (ifo->options & DHCPCD_LINK && !if_is_link_up(ifp)) {
@@ -885,7 +1081,8 @@ dhcpcd_startinterface(void *arg)
 		return;
 	}
 
-	if (ifo->options & (DHCPCD_DUID | DHCPCD_IPV6) &&
+	if (changed & (IFO_CHANGED_IF | IFO_CHANGED_DHCP | IFO_CHANGED_DHCP6) &&
+	    ifo->options & (DHCPCD_DUID | DHCPCD_IPV6) &&
 	    !(ifo->options & DHCPCD_ANONYMOUS))
 	{
 		char buf[sizeof(ifo->iaid) * 3];
@@ -918,13 +1115,18 @@ dhcpcd_startinterface(void *arg)
 	}
 
 #ifdef INET6
+	if (!(changed &
+	    (IFO_CHANGED_IF | IFO_CHANGED_DHCP6 | IFO_CHANGED_IPV6)))
+		goto inet;
 	if (ifo->options & DHCPCD_IPV6 && ipv6_start(ifp) == -1) {
 		logerr("%s: ipv6_start", ifp->name);
 		ifo->options &= ~DHCPCD_IPV6;
 	}
 
 	if (ifo->options & DHCPCD_IPV6) {
-		if (ifp->active == IF_ACTIVE_USER) {
+		if (ifp->active == IF_ACTIVE_USER &&
+		    changed & (IFO_CHANGED_IF | IFO_CHANGED_IPV6))
+		{
 			ipv6_startstatic(ifp);
 
 			if (ifo->options & DHCPCD_IPV6RS)
@@ -932,6 +1134,9 @@ dhcpcd_startinterface(void *arg)
 		}
 
 #ifdef DHCP6
+		if (!(changed & (IFO_CHANGED_IF | IFO_CHANGED_DHCP6)))
+			goto inet;
+
 		/* DHCPv6 could be turned off, but the interface
 		 * is still delegated to. */
 		if (ifp->active)
@@ -953,15 +1158,28 @@ dhcpcd_startinterface(void *arg)
 		}
 #endif
 	}
+
+inet:
 #endif
 
 #ifdef INET
-	if (ifo->options & DHCPCD_IPV4 && ifp->active == IF_ACTIVE_USER) {
+	if (ifo->options & DHCPCD_IPV4 && ifp->active == IF_ACTIVE_USER &&
+	    changed & (IFO_CHANGED_IF | IFO_CHANGED_DHCP))
+	{
 		/* Ensure we have an IPv4 state before starting DHCP */
 		if (ipv4_getstate(ifp) != NULL)
 			dhcp_start(ifp);
 	}
 #endif
+
+	handoff_done(ifp);
+}
+
+void
+dhcpcd_startinterface(void *arg)
+{
+
+	dhcpcd_startinterface1(arg, IFO_CHANGED_ALL);
 }
 
 static void
@@ -994,6 +1212,144 @@ dhcpcd_prestartinterface(void *arg)
 	dhcpcd_startinterface(ifp);
 }
 
+/* How long a started interface holds its slot without binding. */
+static unsigned int
+dhcpcd_starttimeout(const struct interface *ifp)
+{
+
+	return ifp->options->timeout != 0 ?
+	    ifp->options->timeout : DEFAULT_TIMEOUT;
+}
+
+/*
+ * Start the interfaces queued in main, at most start_max at once and
+ * start_interval milliseconds apart.
+ * An interface gives up its slot when it binds, when it has no carrier
+ * to start on or once its timeout has passed.
+ * With neither set, everything starts at once as it always did.
+ */
+static void
+dhcpcd_startnext(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	struct interface *ifp;
+	struct timespec now;
+	unsigned long long secs, wait;
+	unsigned int nsecs, ms, timeout;
+	bool queued;
+
+	if (ctx->ifaces == NULL || ctx->options & DHCPCD_EXITING)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if (ifp->start_state != IF_START_RUNNING)
+			continue;
+		timeout = dhcpcd_starttimeout(ifp);
+		if (eloop_timespec_diff(&now, &ifp->start_time, NULL) >=
+		    timeout)
+		{
+			logdebugx("%s: not bound after %u seconds, "
+			    "giving up its start slot", ifp->name, timeout);
+			ifp->start_state = IF_START_SLOW;
+			ctx->start_running--;
+		}
+	}
+
+	queued = false;
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if (ifp->start_state != IF_START_QUEUED)
+			continue;
+		if (!ifp->active) {
+			ifp->start_state = IF_START_NONE;
+			continue;
+		}
+		if (ctx->start_max != 0 &&
+		    ctx->start_running >= ctx->start_max)
+		{
+			queued = true;
+			break;
+		}
+		if (ctx->start_interval != 0 &&
+		    timespecisset(&ctx->start_last))
+		{
+			secs = eloop_timespec_diff(&now, &ctx->start_last,
+			    &nsecs);
+			ms = nsecs / 1000000;
+			if (secs < ctx->start_interval / 1000 ||
+			    (secs == ctx->start_interval / 1000 &&
+			    ms < ctx->start_interval % 1000))
+			{
+				wait = ctx->start_interval -
+				    (secs * 1000 + ms);
+				eloop_timeout_add_msec(ctx->eloop,
+				    (unsigned long)wait, dhcpcd_startnext, ctx);
+				return;
+			}
+		}
+
+		ifp->start_state = IF_START_RUNNING;
+		ifp->start_time = now;
+		ctx->start_running++;
+		ctx->start_last = now;
+		dhcpcd_prestartinterface(ifp);
+
+		if (ifp->options->options & DHCPCD_LINK &&
+		    !if_is_link_up(ifp))
+		{
+			/* dhcpcd_handlecarrier will start it later. */
+			ifp->start_state = IF_START_SLOW;
+			ctx->start_running--;
+		}
+		if (ctx->start_interval != 0)
+			clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+	if (!queued)
+		return;
+
+	/* All slots are busy, so wake when the first of them times out. */
+	wait = 0;
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if (ifp->start_state != IF_START_RUNNING)
+			continue;
+		timeout = dhcpcd_starttimeout(ifp);
+		secs = eloop_timespec_diff(&now, &ifp->start_time, NULL);
+		secs = secs < timeout ? timeout - secs : 1;
+		if (wait == 0 || secs < wait)
+			wait = secs;
+	}
+	if (wait != 0)
+		eloop_timeout_add_sec(ctx->eloop, (unsigned int)wait,
+		    dhcpcd_startnext, ctx);
+}
+
+/* An interface has an address, report how long that took from start. */
+void
+dhcpcd_bound(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct timespec now;
+	unsigned long long secs;
+	unsigned int nsecs;
+
+	if (ifp->start_state == IF_START_RUNNING ||
+	    ifp->start_state == IF_START_SLOW)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = eloop_timespec_diff(&now, &ifp->start_time, &nsecs);
+		logdebugx("%s: bound %llu.%03u seconds after starting",
+		    ifp->name, secs, nsecs / 1000000);
+		if (ifp->start_state == IF_START_RUNNING) {
+			ctx->start_running--;
+			eloop_timeout_add_sec(ctx->eloop, 0,
+			    dhcpcd_startnext, ctx);
+		}
+		ifp->start_state = IF_START_DONE;
+	}
+
+	dhcpcd_daemonise(ctx);
+}
+
 static void
 run_preinit(struct interface *ifp)
 {
@@ -1001,12 +1357,16 @@ run_preinit(struct interface *ifp)
 	if (ifp->ctx->options & DHCPCD_TEST)
 		return;
 
+	/* The last dhcpcd has set up an interface it handed off,
+	 * which each protocol resumes as it starts. */
+	ifp->warm = handoff_load(ifp) == 1;
 	script_runreason(ifp, "PREINIT");
 	if (ifp->wireless && if_is_link_up(ifp))
 		dhcpcd_reportssid(ifp);
 	if (ifp->options->options & DHCPCD_LINK && ifp->carrier != LINK_UNKNOWN)
 		script_runreason(ifp,
 		    ifp->carrier == LINK_UP ? "CARRIER" : "NOCARRIER");
+	ifp->warm = false;
 }
 
 void
@@ -1015,6 +1375,10 @@ dhcpcd_activateinterface(struct interface *ifp, unsigned long long options)
 
 	if (ifp->active)
 		return;
+	if (!shard_owns(ifp->ctx, ifp->name)) {
+		logwarnx("%s: is looked after by another shard", ifp->name);
+		return;
+	}
 
 	ifp->active = IF_ACTIVE;
 	dhcpcd_initstate2(ifp, options);
@@ -1049,7 +1413,7 @@ dhcpcd_handleinterface(void *arg, int action, const char *ifname)
 			logdebugx("%s: interface departed", ifp->name);
 			stop_interface(ifp, "DEPARTED");
 		}
-		TAILQ_REMOVE(ctx->ifaces, ifp, next);
+		if_remove(ifp);
 		if_free(ifp);
 		return 0;
 	}
@@ -1078,12 +1442,19 @@ dhcpcd_handleinterface(void *arg, int action, const char *ifname)
 			logdebugx("%s: interface updated", iff->name);
 		/* The flags and hwaddr could have changed */
 		iff->flags = ifp->flags;
+#ifdef INET6
+		if (iff->hwlen != ifp->hwlen ||
+		    memcmp(iff->hwaddr, ifp->hwaddr, iff->hwlen) != 0)
+			ipv6_flushstableprivate(iff);
+#endif
 		iff->hwlen = ifp->hwlen;
 		if (ifp->hwlen != 0)
 			memcpy(iff->hwaddr, ifp->hwaddr, iff->hwlen);
 	} else {
 		TAILQ_REMOVE(ifs, ifp, next);
-		TAILQ_INSERT_TAIL(ctx->ifaces, ifp, next);
+		if_insert(ctx, ifp);
+		/* We have not been tracking routes on this interface. */
+		rt_kinvalidate(ctx, AF_UNSPEC);
 		if (ifp->active) {
 			logdebugx("%s: interface added", ifp->name);
 			dhcpcd_initstate(ifp, 0);
@@ -1127,45 +1498,212 @@ dhcpcd_handlelink(void *arg, unsigned short events)
 	}
 }
 
+#ifndef SMALL
+static void
+dhcpcd_setlinkrcvbuf(struct dhcpcd_ctx *ctx)
+{
+	socklen_t socklen;
+
+	if (ctx->link_rcvbuf == 0)
+		return;
+
+	logdebugx("setting route socket receive buffer size to %d bytes",
+	    ctx->link_rcvbuf);
+
+	socklen = sizeof(ctx->link_rcvbuf);
+	if (setsockopt(ctx->link_fd, SOL_SOCKET,
+	    SO_RCVBUF, &ctx->link_rcvbuf, socklen) == -1)
+		logerr(__func__);
+}
+#endif
+
+static void
+dhcpcd_runprestartinterface(void *arg)
+{
+	struct interface *ifp = arg;
+
+	run_preinit(ifp);
+	dhcpcd_prestartinterface(ifp);
+}
+
+struct dhcpcd_carrier {
+	struct interface *ifp;
+	int carrier;
+	unsigned int flags;
+};
+
+struct dhcpcd_linkresync {
+	struct dhcpcd_carrier *cv;
+	size_t ncv;
+	bool arrived;
+};
+
+static void
+dhcpcd_linkresyncifa(struct dhcpcd_ctx *ctx, void *arg,
+    const struct ifaddrs *ifa)
+{
+	struct dhcpcd_linkresync *lr = arg;
+	struct interface *ifp;
+	unsigned int flags;
+	int carrier;
+
+	ifp = if_find(ctx->ifaces, ifa->ifa_name);
+	if (ifp == NULL) {
+		lr->arrived = true;
+		return;
+	}
+	if (ifp->link_seen)
+		return;
+	ifp->link_seen = true;
+	if (!ifp->active || lr->cv == NULL)
+		return;
+
+	/* if_carrier works from ifp->flags. */
+	flags = ifp->flags;
+	ifp->flags = ifa->ifa_flags;
+	carrier = if_carrier(ifp, ifa->ifa_data);
+	ifp->flags = flags;
+	if (carrier != ifp->carrier) {
+		lr->cv[lr->ncv].ifp = ifp;
+		lr->cv[lr->ncv].carrier = carrier;
+		lr->cv[lr->ncv].flags = ifa->ifa_flags;
+		lr->ncv++;
+	}
+}
+
+/*
+ * Learn the state of the interfaces we know after link messages may
+ * have been lost.
+ * Only links and addresses are read now, kernel routes are dumped
+ * again on the next build and interfaces we don't manage are just
+ * checked for departure.
+ * A full discovery is only needed if an interface has arrived.
+ */
 static void
-dhcpcd_checkcarrier(void *arg)
+dhcpcd_linkresync(struct dhcpcd_ctx *ctx)
 {
-	struct interface *ifp0 = arg, *ifp;
+	struct ifaddrs *ifaddrs = NULL, *nifaddrs;
+#ifndef IF_NETLINK_DUMP
+	struct ifaddrs *ifa;
+#endif
+	struct if_head *ifaces;
+	struct interface *ifp, *ifn;
+	struct dhcpcd_linkresync lr = { .ncv = 0 };
+	size_t i, nifaces = 0;
 
-	ifp = if_find(ifp0->ctx->ifaces, ifp0->name);
-	if (ifp == NULL || ifp->carrier == ifp0->carrier)
+	ctx->stats.link_resyncs++;
+	rt_kinvalidate(ctx, AF_UNSPEC);
+
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		ifp->link_seen = false;
+		nifaces++;
+	}
+	/* Without this we only miss carrier changes. */
+	lr.cv = reallocarray(NULL, nifaces, sizeof(*lr.cv));
+	if (lr.cv == NULL && nifaces != 0)
+		logerr(__func__);
+
+#ifdef IF_NETLINK_DUMP
+	if (if_dumplinks(ctx, NULL, dhcpcd_linkresyncifa, &lr) == -1) {
+		logerr("if_dumplinks");
+		free(lr.cv);
 		return;
+	}
+#else
+#ifdef PRIVSEP_GETIFADDRS
+	if (IN_PRIVSEP(ctx)) {
+		if (ps_root_getifaddrs(ctx, NULL, AF_UNSPEC, &ifaddrs) == -1) {
+			logerr("ps_root_getifaddrs");
+			free(lr.cv);
+			return;
+		}
+	} else
+#endif
+	if (getifaddrs(&ifaddrs) == -1) {
+		logerr("getifaddrs");
+		free(lr.cv);
+		return;
+	}
+
+	for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr != NULL) {
+#ifdef AF_LINK
+			if (ifa->ifa_addr->sa_family != AF_LINK)
+				continue;
+#elif defined(AF_PACKET)
+			if (ifa->ifa_addr->sa_family != AF_PACKET)
+				continue;
+#endif
+		}
+		dhcpcd_linkresyncifa(ctx, &lr, ifa);
+	}
+#endif
+
+	/* Punt departed interfaces */
+	TAILQ_FOREACH_SAFE(ifp, ctx->ifaces, next, ifn) {
+		if (!ifp->link_seen)
+			dhcpcd_handleinterface(ctx, -1, ifp->name);
+	}
+
+	/* Add new interfaces */
+	if (lr.arrived &&
+	    (ifaces = if_discover(ctx, &nifaddrs, ctx->ifc, ctx->ifv)) != NULL)
+	{
+		if (ifaddrs != NULL) {
+#ifdef PRIVSEP_GETIFADDRS
+			if (IN_PRIVSEP(ctx))
+				free(ifaddrs);
+			else
+#endif
+				freeifaddrs(ifaddrs);
+		}
+		ifaddrs = nifaddrs;
+
+		while ((ifp = TAILQ_FIRST(ifaces)) != NULL) {
+			TAILQ_REMOVE(ifaces, ifp, next);
+			if (if_find(ctx->ifaces, ifp->name) != NULL) {
+				if_free(ifp);
+				continue;
+			}
+			if_insert(ctx, ifp);
+			if (ifp->active) {
+				dhcpcd_initstate(ifp, 0);
+				eloop_timeout_add_sec(ctx->eloop, 0,
+				    dhcpcd_runprestartinterface, ifp);
+			}
+		}
+		free(ifaces);
+	} else if (lr.arrived)
+		logerr("%s: if_discover", __func__);
+
+	/* Update address state. */
+	if_markaddrsstale(ctx->ifaces);
+	if_learnaddrs(ctx, ctx->ifaces, &ifaddrs);
+	if_deletestaleaddrs(ctx->ifaces);
 
-	dhcpcd_handlecarrier(ifp, ifp0->carrier, ifp0->flags);
-	if_free(ifp0);
+	/* Now the addresses are known, act on carrier changes. */
+	for (i = 0; i < lr.ncv; i++)
+		dhcpcd_handlecarrier(lr.cv[i].ifp, lr.cv[i].carrier,
+		    lr.cv[i].flags);
+	free(lr.cv);
 }
 
 #ifndef SMALL
 static void
-dhcpcd_setlinkrcvbuf(struct dhcpcd_ctx *ctx)
+dhcpcd_linkresynctimer(void *arg)
 {
-	socklen_t socklen;
-
-	if (ctx->link_rcvbuf == 0)
-		return;
-
-	logdebugx("setting route socket receive buffer size to %d bytes",
-	    ctx->link_rcvbuf);
+	struct dhcpcd_ctx *ctx = arg;
 
-	socklen = sizeof(ctx->link_rcvbuf);
-	if (setsockopt(ctx->link_fd, SOL_SOCKET,
-	    SO_RCVBUF, &ctx->link_rcvbuf, socklen) == -1)
-		logerr(__func__);
+	dhcpcd_linkresync(ctx);
+	eloop_timeout_add_sec(ctx->eloop, ctx->link_resync,
+	    dhcpcd_linkresynctimer, ctx);
 }
 #endif
 
 static void
-dhcpcd_runprestartinterface(void *arg)
+dhcpcd_linkdrained(__unused void *arg, __unused struct msghdr *msg)
 {
-	struct interface *ifp = arg;
 
-	run_preinit(ifp);
-	dhcpcd_prestartinterface(ifp);
 }
 
 void
@@ -1173,13 +1711,10 @@ dhcpcd_linkoverflow(struct dhcpcd_ctx *ctx)
 {
 	socklen_t socklen;
 	int rcvbuflen;
-	char buf[2048];
-	ssize_t rlen;
-	size_t rcnt;
-	struct if_head *ifaces;
-	struct ifaddrs *ifaddrs;
-	struct interface *ifp, *ifn, *ifp1;
+	ssize_t n;
+	size_t rcnt, rlog;
 
+	ctx->stats.link_overflows++;
 	socklen = sizeof(rcvbuflen);
 	if (getsockopt(ctx->link_fd, SOL_SOCKET,
 	    SO_RCVBUF, &rcvbuflen, &socklen) == -1) {
@@ -1194,56 +1729,23 @@ dhcpcd_linkoverflow(struct dhcpcd_ctx *ctx)
 	logerrx("route socket overflowed (rcvbuflen %d)"
 	    " - learning interface state", rcvbuflen);
 
-	/* Drain the socket.
+	/* Drain the socket, a batch of whole datagrams at a time.
 	 * We cannot open a new one due to privsep. */
-	rcnt = 0;
+	rcnt = rlog = 0;
 	do {
-		rlen = read(ctx->link_fd, buf, sizeof(buf));
-		if (++rcnt % 1000 == 0)
+		n = recvmsgs(ctx, ctx->link_fd, RECVMSGS_MAX,
+		    dhcpcd_linkdrained, NULL);
+		if (n > 0)
+			rcnt += (size_t)n;
+		if (rcnt - rlog >= 1000) {
 			logwarnx("drained %zu messages", rcnt);
-	} while (rlen != -1 || errno == ENOBUFS || errno == ENOMEM);
-	if (rcnt % 1000 != 0)
-		logwarnx("drained %zu messages", rcnt);
-
-	/* Work out the current interfaces. */
-	ifaces = if_discover(ctx, &ifaddrs, ctx->ifc, ctx->ifv);
-	if (ifaces == NULL) {
-		logerr(__func__);
-		return;
-	}
-
-	/* Punt departed interfaces */
-	TAILQ_FOREACH_SAFE(ifp, ctx->ifaces, next, ifn) {
-		if (if_find(ifaces, ifp->name) != NULL)
-			continue;
-		dhcpcd_handleinterface(ctx, -1, ifp->name);
-	}
-
-	/* Add new interfaces */
-	while ((ifp = TAILQ_FIRST(ifaces)) != NULL ) {
-		TAILQ_REMOVE(ifaces, ifp, next);
-		ifp1 = if_find(ctx->ifaces, ifp->name);
-		if (ifp1 != NULL) {
-			/* If the interface already exists,
-			 * check carrier state.
-			 * dhcpcd_checkcarrier will free ifp. */
-			eloop_timeout_add_sec(ctx->eloop, 0,
-			    dhcpcd_checkcarrier, ifp);
-			continue;
-		}
-		TAILQ_INSERT_TAIL(ctx->ifaces, ifp, next);
-		if (ifp->active) {
-			dhcpcd_initstate(ifp, 0);
-			eloop_timeout_add_sec(ctx->eloop, 0,
-			    dhcpcd_runprestartinterface, ifp);
+			rlog = rcnt;
 		}
-	}
-	free(ifaces);
+	} while (n != -1 || errno == ENOBUFS || errno == ENOMEM);
+	if (rcnt != rlog)
+		logwarnx("drained %zu messages", rcnt);
 
-	/* Update address state. */
-	if_markaddrsstale(ctx->ifaces);
-	if_learnaddrs(ctx, ctx->ifaces, &ifaddrs);
-	if_deletestaleaddrs(ctx->ifaces);
+	dhcpcd_linkresync(ctx);
 }
 
 void
@@ -1281,25 +1783,44 @@ dhcpcd_handlehwaddr(struct interface *ifp,
 	ifp->hwlen = hwlen;
 	if (hwaddr != NULL)
 		memcpy(ifp->hwaddr, hwaddr, hwlen);
+#ifdef INET6
+	ipv6_flushstableprivate(ifp);
+#endif
 }
 
+/* Restart only what the new options change, so reloading the same
+ * configuration leaves the interface alone. */
 static void
 if_reboot(struct interface *ifp, int argc, char **argv)
 {
+	unsigned int changed;
 #ifdef INET
 	unsigned long long oldopts;
 
 	oldopts = ifp->options->options;
 #endif
+	changed = dhcpcd_initstate1(ifp, argc, argv, 0);
+	if (changed == 0) {
+		logdebugx("%s: configuration unchanged", ifp->name);
+		return;
+	}
+
 	script_runreason(ifp, "RECONFIGURE");
-	dhcpcd_initstate1(ifp, argc, argv, 0);
 #ifdef INET
-	dhcp_reboot_newopts(ifp, oldopts);
+	if (changed & (IFO_CHANGED_IF | IFO_CHANGED_DHCP))
+		dhcp_reboot_newopts(ifp, oldopts);
 #endif
 #ifdef DHCP6
-	dhcp6_reboot(ifp);
+	if (changed & (IFO_CHANGED_IF | IFO_CHANGED_DHCP6))
+		dhcp6_reboot(ifp);
 #endif
-	dhcpcd_prestartinterface(ifp);
+	if (changed & IFO_CHANGED_IF) {
+		dhcpcd_prestartinterface(ifp);
+		return;
+	}
+	dhcpcd_startinterface1(ifp, changed);
+	if (changed & IFO_CHANGED_ROUTES)
+		rt_build(ifp->ctx, AF_UNSPEC);
 }
 
 static void
@@ -1344,7 +1865,7 @@ reconf_reboot(struct dhcpcd_ctx *ctx, int action, int argc, char **argv, int oi)
 			else
 				ipv4_applyaddr(ifp);
 #endif
-		} else if (i != argc) {
+		} else if (i != argc && shard_owns(ctx, ifp->name)) {
 			ifp->active = IF_ACTIVE_USER;
 			dhcpcd_initstate1(ifp, argc, argv, 0);
 			run_preinit(ifp);
@@ -1369,6 +1890,11 @@ stop_all_interfaces(struct dhcpcd_ctx *ctx, unsigned long long opts)
 		ifp->options->options |= opts;
 		if (ifp->options->options & DHCPCD_RELEASE)
 			ifp->options->options &= ~DHCPCD_PERSISTENT;
+		else if (ctx->warm_restart && handoff_save(ifp) > 0) {
+			/* Leave it all for the next dhcpcd to resume. */
+			ifp->options->options |= DHCPCD_PERSISTENT;
+			ifp->warm = true;
+		}
 		ifp->options->options |= DHCPCD_EXITING;
 		stop_interface(ifp, NULL);
 	}
@@ -1415,6 +1941,10 @@ dhcpcd_signal_cb(int sig, void *arg)
 	struct dhcpcd_ctx *ctx = arg;
 	unsigned long long opts;
 	int exit_code;
+#ifndef PRIVSEP
+	pid_t pid;
+	int status;
+#endif
 
 	if (ctx->options & DHCPCD_DUMPLEASE) {
 		eloop_exit(ctx->eloop, EXIT_FAILURE);
@@ -1457,6 +1987,9 @@ dhcpcd_signal_cb(int sig, void *arg)
 		return;
 	case SIGUSR2:
 		loginfox(sigmsg, "SIGUSR2", "reopening log");
+#ifndef SMALL
+		dhcpcd_memlog(ctx);
+#endif
 #ifdef PRIVSEP
 		if (IN_PRIVSEP(ctx)) {
 			if (ps_root_logreopen(ctx) == -1)
@@ -1471,8 +2004,8 @@ dhcpcd_signal_cb(int sig, void *arg)
 #ifdef PRIVSEP
 		ps_root_signalcb(sig, ctx);
 #else
-		while (waitpid(-1, NULL, WNOHANG) > 0)
-			;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			script_reap(ctx, pid, status);
 #endif
 		return;
 	default:
@@ -1487,6 +2020,356 @@ dhcpcd_signal_cb(int sig, void *arg)
 }
 #endif
 
+#ifndef SMALL
+static const char * const dhcpcd_ifstats[IF_STAT_MAX] = {
+	"bpf", "udp", "nd", "dhcp6",
+};
+
+/* Write our counters to buf as NUL separated key=value pairs,
+ * like eloop_stats_format. */
+static ssize_t
+dhcpcd_counters_format(const struct dhcpcd_ctx *ctx, char *buf, size_t len)
+{
+	const struct dhcpcd_stats *st = &ctx->stats;
+	const struct interface *ifp;
+	const struct if_stats *ifs;
+	const struct pool *pools[] = {
+		&ctx->rt_pool,
+#ifdef INET
+		&ctx->ia_pool,
+#endif
+#ifdef INET6
+		&ctx->ia6_pool,
+#endif
+	};
+	const struct pool *pl;
+	size_t i, idx, pos = 0;
+	int n;
+
+#define	STATPF(...)							      \
+	do {								      \
+		n = snprintf(pos < len ? buf + pos : NULL,		      \
+		    pos < len ? len - pos : 0, __VA_ARGS__);		      \
+		if (n == -1)						      \
+			return -1;					      \
+		pos += (size_t)n + 1;					      \
+	} while (0 /* CONSTCOND */)
+
+	STATPF("script_runs=%llu", st->script_runs);
+	STATPF("script_total_usec=%llu", st->script_usec);
+	STATPF("script_max_usec=%llu", st->script_max_usec);
+	STATPF("link_msgs=%llu", st->link_msgs);
+	STATPF("link_overflows=%llu", st->link_overflows);
+	STATPF("link_resyncs=%llu", st->link_resyncs);
+	STATPF("route_adds=%llu", st->route_adds);
+	STATPF("route_changes=%llu", st->route_changes);
+	STATPF("route_deletes=%llu", st->route_deletes);
+	STATPF("route_errors=%llu", st->route_errors);
+	STATPF("route_dumps=%llu", st->route_dumps);
+	STATPF("route_nhmoves=%llu", st->route_nhmoves);
+	STATPF("route_builds=%llu", st->route_builds);
+	STATPF("route_coalesced=%llu", st->route_coalesced);
+	STATPF("privsep_msgs_sent=%llu", st->ps_msgs_sent);
+	STATPF("privsep_msgs_recv=%llu", st->ps_msgs_recv);
+	STATPF("privsep_ring_recv=%llu", st->ps_ring_recv);
+	STATPF("log_dropped=%llu", loggetdropped());
+
+	for (i = 0; i < __arraycount(pools); i++) {
+		pl = pools[i];
+		STATPF("pool_%s_inuse=%zu", pl->pl_name, pl->pl_inuse);
+		STATPF("pool_%s_peak=%zu", pl->pl_name, pl->pl_peak);
+		STATPF("pool_%s_free=%zu", pl->pl_name, pl->pl_nfree);
+		STATPF("pool_%s_gets=%llu", pl->pl_name, pl->pl_gets);
+		STATPF("pool_%s_hits=%llu", pl->pl_name, pl->pl_hits);
+	}
+
+	idx = 0;
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if (!ifp->active)
+			continue;
+		ifs = &ifp->stats;
+		STATPF("if%zu_name=%s", idx, ifp->name);
+		for (i = 0; i < IF_STAT_MAX; i++) {
+			STATPF("if%zu_%s_rx=%llu", idx, dhcpcd_ifstats[i],
+			    ifs->rx[i]);
+			STATPF("if%zu_%s_tx=%llu", idx, dhcpcd_ifstats[i],
+			    ifs->tx[i]);
+			STATPF("if%zu_%s_dropped=%llu", idx,
+			    dhcpcd_ifstats[i], ifs->dropped[i]);
+			STATPF("if%zu_%s_retrans=%llu", idx,
+			    dhcpcd_ifstats[i], ifs->retrans[i]);
+		}
+		STATPF("if%zu_xid_mismatch=%llu", idx, ifs->xid_mismatch);
+		STATPF("if%zu_cksum_fail=%llu", idx, ifs->cksum_fail);
+		STATPF("if%zu_ra_unchanged=%llu", idx, ifs->ra_unchanged);
+		idx++;
+	}
+	STATPF("interfaces=%zu", idx);
+#undef STATPF
+
+	return (ssize_t)pos;
+}
+
+static const char * const dhcpcd_memnames[MEM_MAX] = {
+	"lease", "ra", "addr", "route", "options", "control", "script",
+};
+
+static size_t
+dhcpcd_poolsize(const struct pool *pl)
+{
+
+	return (pl->pl_inuse + pl->pl_nfree) * pl->pl_size;
+}
+
+/* Bytes held by a MEM_ subsystem right now. */
+static size_t
+dhcpcd_memsize(const struct dhcpcd_ctx *ctx, unsigned int mem)
+{
+	const struct interface *ifp;
+#ifdef INET
+	const struct dhcp_state *state;
+#endif
+#ifdef DHCP6
+	const struct dhcp6_state *state6;
+#endif
+#ifdef INET6
+	const struct ra *rap;
+#endif
+	const struct if_optmasks *om;
+	const struct fd_list *fd;
+	size_t size = 0;
+
+	switch (mem) {
+	case MEM_LEASE:
+		if (ctx->ifaces == NULL)
+			break;
+		TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+#ifdef INET
+			if ((state = D_CSTATE(ifp)) != NULL)
+				size += state->sent_len + state->offer_len +
+				    state->new_len + state->old_len +
+				    state->spare_len;
+#endif
+#ifdef DHCP6
+			if ((state6 = D6_CSTATE(ifp)) != NULL)
+				size += state6->send_len + state6->recv_len +
+				    state6->new_len + state6->old_len;
+#endif
+		}
+		break;
+	case MEM_RA:
+#ifdef INET6
+		if (ctx->ra_routers == NULL)
+			break;
+		TAILQ_FOREACH(rap, ctx->ra_routers, next)
+			size += sizeof(*rap) + rap->data_len;
+#endif
+		break;
+	case MEM_ADDR:
+#ifdef INET
+		size += dhcpcd_poolsize(&ctx->ia_pool);
+#endif
+#ifdef INET6
+		size += dhcpcd_poolsize(&ctx->ia6_pool);
+#endif
+		break;
+	case MEM_ROUTE:
+		size = dhcpcd_poolsize(&ctx->rt_pool);
+		break;
+	case MEM_OPTIONS:
+		if (ctx->ifaces != NULL) {
+			TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+				if (ifp->options != NULL)
+					size += sizeof(*ifp->options);
+			}
+		}
+		TAILQ_FOREACH(om, &ctx->optmasks, next)
+			size += sizeof(*om);
+		size += config_cache_size(ctx);
+		break;
+	case MEM_CONTROL:
+		TAILQ_FOREACH(fd, &ctx->control_fds, next)
+			size += fd->queue_bytes;
+		break;
+	case MEM_SCRIPT:
+		size = ctx->script_buflen +
+		    ctx->script_envlen * sizeof(*ctx->script_env);
+		break;
+	}
+	return size;
+}
+
+void
+dhcpcd_memsample(struct dhcpcd_ctx *ctx, unsigned int mem)
+{
+	size_t size = dhcpcd_memsize(ctx, mem);
+
+	if (size > ctx->stats.mem_peak[mem])
+		ctx->stats.mem_peak[mem] = size;
+}
+
+/* Write the bytes held by each subsystem and their peaks to buf as
+ * NUL separated key=value pairs, like eloop_stats_format. */
+static ssize_t
+dhcpcd_memory_format(const struct dhcpcd_ctx *ctx, char *buf, size_t len)
+{
+	size_t mem, size, peak, total = 0, pos = 0;
+	int n;
+
+#define	STATPF(...)							      \
+	do {								      \
+		n = snprintf(pos < len ? buf + pos : NULL,		      \
+		    pos < len ? len - pos : 0, __VA_ARGS__);		      \
+		if (n == -1)						      \
+			return -1;					      \
+		pos += (size_t)n + 1;					      \
+	} while (0 /* CONSTCOND */)
+
+	for (mem = 0; mem < MEM_MAX; mem++) {
+		size = dhcpcd_memsize(ctx, (unsigned int)mem);
+		peak = ctx->stats.mem_peak[mem];
+		if (size > peak)
+			peak = size;
+		STATPF("mem_%s_bytes=%zu", dhcpcd_memnames[mem], size);
+		STATPF("mem_%s_peak=%zu", dhcpcd_memnames[mem], peak);
+		total += size;
+	}
+	STATPF("mem_total_bytes=%zu", total);
+#undef STATPF
+
+	return (ssize_t)pos;
+}
+
+/* Log what dhcpcd --stats memory shows, for SIGUSR2. */
+static void
+dhcpcd_memlog(struct dhcpcd_ctx *ctx)
+{
+	char buf[256], *p = buf;
+	size_t mem, size;
+	int n;
+
+	for (mem = 0; mem < MEM_MAX; mem++) {
+		dhcpcd_memsample(ctx, (unsigned int)mem);
+		size = dhcpcd_memsize(ctx, (unsigned int)mem);
+		n = snprintf(p, sizeof(buf) - (size_t)(p - buf), " %s=%zu/%zu",
+		    dhcpcd_memnames[mem], size, ctx->stats.mem_peak[mem]);
+		if (n == -1 || (size_t)n >= sizeof(buf) - (size_t)(p - buf))
+			break;
+		p += n;
+	}
+	loginfox("memory bytes/peak:%s", buf);
+}
+
+static ssize_t
+dhcpcd_eloop_format(const struct dhcpcd_ctx *ctx, char *buf, size_t len)
+{
+
+	return eloop_stats_format(ctx->eloop, buf, len);
+}
+
+static int
+dhcpcd_sendstats(struct dhcpcd_ctx *ctx, struct fd_list *fd,
+    int argc, char **argv)
+{
+	ssize_t (*format)(const struct dhcpcd_ctx *, char *, size_t);
+	ssize_t len;
+	char *buf;
+	int err;
+
+	if (argc != 2)
+		format = NULL;
+	else if (strcmp(argv[1], "eloop") == 0)
+		format = dhcpcd_eloop_format;
+	else if (strcmp(argv[1], "control") == 0)
+		format = control_stats_format;
+	else if (strcmp(argv[1], "counters") == 0)
+		format = dhcpcd_counters_format;
+	else if (strcmp(argv[1], "memory") == 0)
+		format = dhcpcd_memory_format;
+#ifdef TRACE
+	else if (strcmp(argv[1], "trace") == 0)
+		format = trace_format;
+#endif
+#ifdef PS_STATS
+	else if (strcmp(argv[1], "privsep") == 0)
+		format = ps_stats_format;
+#endif
+	else
+		format = NULL;
+	if (format == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = format(ctx, NULL, 0);
+	if (len == -1)
+		return -1;
+	buf = malloc((size_t)len);
+	if (buf == NULL)
+		return -1;
+	if (format(ctx, buf, (size_t)len) == -1) {
+		free(buf);
+		return -1;
+	}
+	err = control_queue(fd, buf, (size_t)len);
+	free(buf);
+	return err;
+}
+#endif
+
+/*
+ * Send the state of every interface, or just those named, as one reply
+ * so dhcpcd -U needs a single round trip however many there are.
+ * See dump_interface for the layout.
+ * The client also sends -U, so an older dhcpcd which does not know
+ * --dumpleases skips it as the program name and dumps as before.
+ * A worker replies to its coordinator, which adds CONTROL_DUMP_BULK.
+ */
+static int
+dhcpcd_dumpleases(struct dhcpcd_ctx *ctx, struct fd_list *fd,
+    int argc, char **argv)
+{
+	struct dump_buf db = { .buf = NULL };
+	struct interface *ifp;
+	int i, err = -1, af = AF_UNSPEC, nifs = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-4") == 0)
+			af = AF_INET;
+		else if (strcmp(argv[i], "-6") == 0)
+			af = AF_INET6;
+		else if (*argv[i] != '-')
+			nifs++;
+	}
+
+	ctx->options |= DHCPCD_DUMPLEASE;
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if (!ifp->active || !control_wants_interface(fd, ifp->name))
+			continue;
+		if (nifs != 0) {
+			for (i = 1; i < argc; i++) {
+				if (strcmp(ifp->name, argv[i]) == 0)
+					break;
+			}
+			if (i == argc)
+				continue;
+		}
+		if (dump_interface(&db, ifp, af) == -1)
+			goto out;
+	}
+	if (dump_interface_end(&db) == -1)
+		goto out;
+	if (SHARD_WORKER(ctx))
+		err = control_queue(fd, db.buf, db.len);
+	else
+		err = control_queue_bulk(fd, db.buf, db.len);
+
+out:
+	ctx->options &= ~DHCPCD_DUMPLEASE;
+	free(db.buf);
+	return err;
+}
+
 int
 dhcpcd_handleargs(struct dhcpcd_ctx *ctx, struct fd_list *fd,
     int argc, char **argv)
@@ -1508,12 +2391,21 @@ dhcpcd_handleargs(struct dhcpcd_ctx *ctx, struct fd_list *fd,
 	} else if (strcmp(*argv, "--getconfigfile") == 0) {
 		return control_queue(fd, UNCONST(fd->ctx->cffile),
 		    strlen(fd->ctx->cffile) + 1);
+#ifdef SHARDS
+	} else if (SHARD_COORDINATOR(ctx)) {
+		return shard_handleargs(ctx, fd, argc, argv);
+#endif
 	} else if (strcmp(*argv, "--getinterfaces") == 0) {
 		optind = argc = 0;
 		goto dumplease;
+	} else if (strcmp(*argv, "--dumpleases") == 0) {
+		return dhcpcd_dumpleases(ctx, fd, argc, argv);
+#ifndef SMALL
+	} else if (strcmp(*argv, "--stats") == 0) {
+		return dhcpcd_sendstats(ctx, fd, argc, argv);
+#endif
 	} else if (strcmp(*argv, "--listen") == 0) {
-		fd->flags |= FD_LISTEN;
-		return 0;
+		return control_listen(fd, argc - 1, argv + 1);
 	}
 
 	/* Log the command */
@@ -1577,7 +2469,8 @@ dhcpcd_handleargs(struct dhcpcd_ctx *ctx, struct fd_list *fd,
 dumplease:
 		nifaces = 0;
 		TAILQ_FOREACH(ifp, ctx->ifaces, next) {
-			if (!ifp->active)
+			if (!ifp->active ||
+			    !control_wants_interface(fd, ifp->name))
 				continue;
 			for (oi = optind; oi < argc; oi++) {
 				if (strcmp(ifp->name, argv[oi]) == 0)
@@ -1593,7 +2486,8 @@ dumplease:
 		if (write(fd->fd, &nifaces, sizeof(nifaces)) != sizeof(nifaces))
 			goto dumperr;
 		TAILQ_FOREACH(ifp, ctx->ifaces, next) {
-			if (!ifp->active)
+			if (!ifp->active ||
+			    !control_wants_interface(fd, ifp->name))
 				continue;
 			for (oi = optind; oi < argc; oi++) {
 				if (strcmp(ifp->name, argv[oi]) == 0)
@@ -1679,6 +2573,15 @@ dhcpcd_readdump2(void *arg, unsigned short events)
 		return;
 	}
 
+	if (ctx->ctl_bulk) {
+		if (script_dumpbulk(ctx->ctl_buf, ctx->ctl_buflen) == -1) {
+			logerr(__func__);
+			goto finished;
+		}
+		fflush(stdout);
+		exit_code = EXIT_SUCCESS;
+		goto finished;
+	}
 	if (ctx->ctl_buf[ctx->ctl_buflen - 1] != '\0') /* unlikely */
 		ctx->ctl_buf[ctx->ctl_buflen - 1] = '\0';
 	script_dump(ctx->ctl_buf, ctx->ctl_buflen);
@@ -1755,6 +2658,11 @@ dhcpcd_readdump0(void *arg, unsigned short events)
 		eloop_exit(ctx->eloop, EXIT_SUCCESS);
 		return;
 	}
+	/* A single reply for every interface, see dhcpcd_dumpleases. */
+	if (ctx->ctl_extra == CONTROL_DUMP_BULK) {
+		ctx->ctl_bulk = true;
+		ctx->ctl_extra = 1;
+	}
 
 	if (eloop_event_add(ctx->eloop, ctx->control_fd, ELE_READ,
 	    dhcpcd_readdump1, ctx) == -1)
@@ -1782,6 +2690,22 @@ dhcpcd_readdump(struct dhcpcd_ctx *ctx)
 	    dhcpcd_readdump0, ctx);
 }
 
+#ifndef SMALL
+/* Statistics are sent as a single block of key=value pairs. */
+static int
+dhcpcd_readstats(struct dhcpcd_ctx *ctx)
+{
+
+	ctx->options |=	DHCPCD_FORKED;
+	ctx->ctl_extra = 1;
+	if (eloop_timeout_add_sec(ctx->eloop, 5,
+	    dhcpcd_readdumptimeout, ctx) == -1)
+		return -1;
+	return eloop_event_add(ctx->eloop, ctx->control_fd, ELE_READ,
+	    dhcpcd_readdump1, ctx);
+}
+#endif
+
 static void
 dhcpcd_fork_cb(void *arg, unsigned short events)
 {
@@ -1866,6 +2790,9 @@ main(int argc, char **argv, char **envp)
 	const char *siga = NULL;
 	size_t si;
 #endif
+#ifndef SMALL
+	char *stats = NULL;
+#endif
 
 #ifdef SETPROCTITLE_H
 	setproctitle_init(argc, argv, envp);
@@ -1916,12 +2843,25 @@ main(int argc, char **argv, char **envp)
 	ctx.cffile = CONFIG;
 	ctx.script = UNCONST(dhcpcd_default_script);
 	ctx.control_fd = ctx.control_unpriv_fd = ctx.link_fd = -1;
+	ctx.hook_runner_fd = -1;
+#ifndef SMALL
+	ctx.shard = -1;
+#endif
 	ctx.pf_inet_fd = -1;
 #ifdef PF_LINK
 	ctx.pf_link_fd = -1;
 #endif
 
 	TAILQ_INIT(&ctx.control_fds);
+	TAILQ_INIT(&ctx.optmasks);
+	ctx.control_queue_max = CONTROL_QUEUE_MAX;
+	ctx.control_queue_bytes = CONTROL_QUEUE_BYTES;
+	TAILQ_INIT(&ctx.script_jobs);
+	TAILQ_INIT(&ctx.script_holds);
+#ifdef ARP
+	TAILQ_INIT(&ctx.arp_timers);
+#endif
+	TAILQ_INIT(&ctx.hooks_resolv);
 #ifdef USE_SIGNALS
 	ctx.fork_fd = -1;
 #endif
@@ -1941,7 +2881,15 @@ main(int argc, char **argv, char **envp)
 #endif
 #ifdef PRIVSEP
 	ctx.ps_log_fd = -1;
+	ctx.ps_ring_wfd = -1;
+	ctx.ps_ring_bell[0] = ctx.ps_ring_bell[1] = -1;
 	TAILQ_INIT(&ctx.ps_processes);
+	TAILQ_INIT(&ctx.ps_async);
+	TAILQ_INIT(&ctx.ps_async_done);
+	TAILQ_INIT(&ctx.ps_files);
+#ifdef PS_STATS
+	TAILQ_INIT(&ctx.ps_stats);
+#endif
 #endif
 
 	/* Check our streams for validity */
@@ -2015,6 +2963,11 @@ main(int argc, char **argv, char **envp)
 		case 'V':
 			i = 2;
 			break;
+#ifndef SMALL
+		case O_STATS:
+			stats = optarg;
+			break;
+#endif
 		case '?':
 			if (ctx.options & DHCPCD_PRINT_PIDFILE)
 				continue;
@@ -2035,6 +2988,12 @@ main(int argc, char **argv, char **envp)
 	ctx.ifv = argv + optind;
 
 	rt_init(&ctx);
+#ifdef INET
+	pool_init(&ctx.ia_pool, "ipv4_addr", sizeof(struct ipv4_addr));
+#endif
+#ifdef INET6
+	pool_init(&ctx.ia6_pool, "ipv6_addr", sizeof(struct ipv6_addr));
+#endif
 
 	ifo = read_config(&ctx, NULL, NULL, NULL);
 	if (ifo == NULL) {
@@ -2197,6 +3156,37 @@ printpidfile:
 #endif
 
 #ifndef SMALL
+	if (stats != NULL) {
+		char *sargv[] = { UNCONST("--stats"), stats, NULL };
+
+		ctx.options |= DHCPCD_FORKED; /* avoid socket unlink */
+		if (!(ctx.options & DHCPCD_MANAGER))
+			ctx.control_fd = control_open(argv[optind], family,
+			    true);
+		if (ctx.control_fd == -1)
+			ctx.control_fd = control_open(NULL, AF_UNSPEC, true);
+		if (ctx.control_fd == -1) {
+			if (errno == ENOENT)
+				logerrx(PACKAGE" is not running");
+			else
+				logerr("%s: control_open", __func__);
+			goto exit_failure;
+		}
+#ifdef PRIVSEP
+		if (IN_PRIVSEP(&ctx) && ps_managersandbox(&ctx, NULL) == -1)
+			goto exit_failure;
+#endif
+		if (control_send(&ctx, 2, sargv) == -1) {
+			logerr("%s: control_send", __func__);
+			goto exit_failure;
+		}
+		if (dhcpcd_readstats(&ctx) == -1) {
+			logerr("%s: dhcpcd_readstats", __func__);
+			goto exit_failure;
+		}
+		goto run_loop;
+	}
+
 	if (ctx.options & DHCPCD_DUMPLEASE &&
 	    ioctl(fileno(stdin), FIONREAD, &i, sizeof(i)) == 0 &&
 	    i > 0)
@@ -2260,7 +3250,17 @@ printpidfile:
 #endif
 			if (!(ctx.options & DHCPCD_DUMPLEASE))
 				loginfox("sending commands to dhcpcd process");
-			len = control_send(&ctx, argc, argv);
+			if (ctx.options & DHCPCD_DUMPLEASE && optind == argc) {
+				char *dargv[] = { UNCONST("--dumpleases"),
+				    UNCONST("-U"),
+				    family == AF_INET ? UNCONST("-4") :
+				    family == AF_INET6 ? UNCONST("-6") : NULL,
+				    NULL };
+
+				len = control_send(&ctx,
+				    dargv[2] == NULL ? 2 : 3, dargv);
+			} else
+				len = control_send(&ctx, argc, argv);
 			if (len > 0)
 				logdebugx("send OK");
 			else {
@@ -2334,6 +3334,7 @@ printpidfile:
 	case 0:
 		ctx.fork_fd = fork_fd[1];
 		close(fork_fd[0]);
+		rndpool_forked(&ctx);
 #ifdef PRIVSEP_RIGHTS
 		if (ps_rights_limit_fd(ctx.fork_fd) == -1) {
 			logerr("ps_rights_limit_fdpair");
@@ -2437,6 +3438,19 @@ start_manager:
 		if_disable_rtadv();
 #endif
 
+	switch (shard_start(&ctx)) {
+	case -1:
+		logerr("shard_start");
+		goto exit_failure;
+	case 0:
+		break;
+	default:
+		goto run_loop;
+	}
+
+#ifdef SHARDS
+start_shard:
+#endif
 #ifdef PRIVSEP
 	if (IN_PRIVSEP(&ctx) && ps_start(&ctx) == -1) {
 		logerr("ps_start");
@@ -2465,6 +3479,13 @@ start_manager:
 		dev_start(&ctx, dhcpcd_handleinterface);
 #endif
 
+#ifdef SHARDS
+	if (SHARD_WORKER(&ctx))
+		setproctitle("[shard %d]%s%s", ctx.shard,
+		    ctx.options & DHCPCD_IPV4 ? " [ip4]" : "",
+		    ctx.options & DHCPCD_IPV6 ? " [ip6]" : "");
+	else
+#endif
 	setproctitle("%s%s%s",
 	    ctx.options & DHCPCD_MANAGER ? "[manager]" : argv[optind],
 	    ctx.options & DHCPCD_IPV4 ? " [ip4]" : "",
@@ -2490,9 +3511,15 @@ start_manager:
 	if (eloop_event_add(ctx.eloop, ctx.link_fd, ELE_READ,
 	    dhcpcd_handlelink, &ctx) == -1)
 		logerr("%s: eloop_event_add", __func__);
+#ifndef SMALL
+	if (ctx.link_resync != 0)
+		eloop_timeout_add_sec(ctx.eloop, ctx.link_resync,
+		    dhcpcd_linkresynctimer, &ctx);
+#endif
 
 #ifdef PRIVSEP
-	if (IN_PRIVSEP(&ctx) && ps_managersandbox(&ctx, "stdio route") == -1)
+	if (IN_PRIVSEP(&ctx) &&
+	    ps_managersandbox(&ctx, "stdio recvfd route") == -1)
 		goto exit_failure;
 #endif
 
@@ -2510,7 +3537,7 @@ start_manager:
 		if ((ifp = if_find(ctx.ifaces, ctx.ifv[i])) == NULL)
 			logerrx("%s: interface not found",
 			    ctx.ifv[i]);
-		else if (!ifp->active)
+		else if (!ifp->active && shard_owns(&ctx, ifp->name))
 			logerrx("%s: interface has an invalid configuration",
 			    ctx.ifv[i]);
 	}
@@ -2519,7 +3546,8 @@ start_manager:
 			break;
 	}
 	if (ifp == NULL) {
-		if (ctx.ifc == 0) {
+		/* The interfaces asked for may all be in other shards. */
+		if (ctx.ifc == 0 || SHARD_WORKER(&ctx)) {
 			int loglevel;
 
 			loglevel = ctx.options & DHCPCD_INACTIVE ?
@@ -2582,17 +3610,31 @@ start_manager:
 			    handle_exit_timeout, &ctx);
 		}
 	}
+	ctx.start_max = ifo->start_max;
+	ctx.start_interval = ifo->start_interval;
 	free_options(&ctx, ifo);
 	ifo = NULL;
 
 	TAILQ_FOREACH(ifp, ctx.ifaces, next) {
 		if (ifp->active)
-			eloop_timeout_add_sec(ctx.eloop, 0,
-			    dhcpcd_prestartinterface, ifp);
+			ifp->start_state = IF_START_QUEUED;
 	}
+	eloop_timeout_add_sec(ctx.eloop, 0, dhcpcd_startnext, &ctx);
 
 run_loop:
 	i = eloop_start(ctx.eloop, &ctx.sigset);
+#ifdef SHARDS
+	if (shard_restarted(&ctx)) {
+		ctx.shard_restart = false;
+		eloop_enter(ctx.eloop);
+#ifdef USE_SIGNALS
+		eloop_signal_set_cb(ctx.eloop,
+		    dhcpcd_signals, dhcpcd_signals_len,
+		    dhcpcd_signal_cb, &ctx);
+#endif
+		goto start_shard;
+	}
+#endif
 	if (i < 0) {
 		logerr("%s: eloop_start", __func__);
 		goto exit_failure;
@@ -2609,6 +3651,7 @@ exit_failure:
 exit1:
 	if (!(ctx.options & DHCPCD_TEST) && control_stop(&ctx) == -1)
 		logerr("%s: control_stop", __func__);
+	shard_stop(&ctx);
 	if (ifaddrs != NULL) {
 #ifdef PRIVSEP_GETIFADDRS
 		if (IN_PRIVSEP(&ctx))
@@ -2617,26 +3660,37 @@ exit1:
 #endif
 			freeifaddrs(ifaddrs);
 	}
+	/* Write any pending leases while privsep can still do so. */
+	dhcp_flushleases(&ctx, true);
+	script_runholds(&ctx);
 #ifdef PRIVSEP
 	ps_stop(&ctx);
 #endif
 	/* Free memory and close fd's */
 	if (ctx.ifaces) {
 		while ((ifp = TAILQ_FIRST(ctx.ifaces))) {
-			TAILQ_REMOVE(ctx.ifaces, ifp, next);
+			if_remove(ifp);
 			if_free(ifp);
 		}
 		free(ctx.ifaces);
 		ctx.ifaces = NULL;
 	}
 	free_options(&ctx, ifo);
-#ifdef HAVE_OPEN_MEMSTREAM
+	script_wait(&ctx);
+	script_runner_stop(&ctx);
 	if (ctx.script_fp)
 		fclose(ctx.script_fp);
-#endif
 	free(ctx.script_buf);
 	free(ctx.script_env);
+	free(ctx.opt_buf);
+	free(ctx.rcvbuf);
 	rt_dispose(&ctx);
+#ifdef INET
+	pool_clear(&ctx.ia_pool);
+#endif
+#ifdef INET6
+	pool_clear(&ctx.ia6_pool);
+#endif
 	free(ctx.duid);
 	if (ctx.link_fd != -1) {
 		eloop_event_delete(ctx.eloop, ctx.link_fd);
@@ -2644,6 +3698,10 @@ exit1:
 	}
 	if_closesockets(&ctx);
 	free_globals(&ctx);
+	hooks_save(&ctx);
+	hooks_free(&ctx);
+	free_definitions(&ctx);
+	free_config_cache(&ctx);
 #ifdef INET6
 	ipv6_ctxfree(&ctx);
 #endif
@@ -2662,6 +3720,17 @@ exit1:
 	if (ps_root_stop(&ctx) == -1)
 		i = EXIT_FAILURE;
 	eloop_free(ctx.ps_eloop);
+	ps_ring_free(&ctx);
+	ps_root_closefiles(&ctx);
+#ifdef PRIVSEP_GETIFADDRS
+	free(ctx.ps_ifaddrs);
+#endif
+#ifdef PS_STATS
+	ps_stats_free(&ctx);
+#endif
+#endif
+#ifdef TRACE
+	trace_free(&ctx);
 #endif
 	eloop_free(ctx.eloop);
 	logclose();
@@ -33,6 +33,7 @@
 #include <net/if.h>
 
 #include <stdio.h>
+#include <time.h>
 
 #include "config.h"
 #ifdef HAVE_SYS_QUEUE_H
@@ -42,6 +43,8 @@
 #include "defs.h"
 #include "control.h"
 #include "if-options.h"
+#include "pool.h"
+#include "trace.h"
 
 #define HWADDR_LEN	20
 #define IF_SSIDLEN	32
@@ -52,6 +55,13 @@
 #define IF_ACTIVE	1
 #define IF_ACTIVE_USER	2
 
+/* Progress through the start scheduler, see dhcpcd_startnext */
+#define IF_START_NONE		0
+#define IF_START_QUEUED		1
+#define IF_START_RUNNING	2
+#define IF_START_SLOW		3	/* gave up its slot, not bound yet */
+#define IF_START_DONE		4
+
 #define	LINK_UP		1
 #define	LINK_UNKNOWN	0
 #define	LINK_DOWN	-1
@@ -65,11 +75,30 @@
 #define IF_DATA_DHCP6	6
 #define IF_DATA_MAX	7
 
+/* Router Solicitations sent together, see ipv6nd_flushrs */
+#define	ND_RSQ_LEN	16
+
 #ifdef __QNX__
 /* QNX carries defines for, but does not actually support PF_LINK */
 #undef IFLR_ACTIVE
 #endif
 
+/* Packet counters for dhcpcd --stats counters, indexed by IF_STAT_ */
+#define	IF_STAT_BPF	0	/* DHCP and ARP over BPF */
+#define	IF_STAT_UDP	1	/* DHCP over UDP */
+#define	IF_STAT_ND	2
+#define	IF_STAT_DHCP6	3
+#define	IF_STAT_MAX	4
+struct if_stats {
+	unsigned long long rx[IF_STAT_MAX];
+	unsigned long long tx[IF_STAT_MAX];
+	unsigned long long dropped[IF_STAT_MAX];
+	unsigned long long retrans[IF_STAT_MAX];
+	unsigned long long xid_mismatch;
+	unsigned long long cksum_fail;
+	unsigned long long ra_unchanged;	/* see ipv6nd_rasame */
+};
+
 struct interface {
 	struct dhcpcd_ctx *ctx;
 	TAILQ_ENTRY(interface) next;
@@ -84,14 +113,33 @@ struct interface {
 	unsigned int metric;
 	int carrier;
 	bool wireless;
+	bool rt_dirty;	/* routes need rebuilding, see rt_deferif */
+	bool link_seen;	/* see dhcpcd_linkresync */
 	uint8_t ssid[IF_SSIDLEN];
 	unsigned int ssid_len;
+	bool ssid_valid;	/* see if_getssid */
 
 	char profile[PROFILE_LEN];
 	struct if_options *options;
 	void *if_data[IF_DATA_MAX];
+
+	unsigned int start_state;
+	struct timespec start_time;
+	unsigned int carrier_penalty;	/* see dhcpcd_carrierdamp */
+	struct timespec carrier_penalised;
+	struct timespec carrier_heldtime;
+	bool carrier_held;
+	bool carrier_heldup;
+	bool carrier_suppressed;
+	struct if_stats stats;
+	struct handoff *handoff;	/* see warm_restart */
+	bool warm;	/* resuming or handing off, so no script */
 };
 TAILQ_HEAD(if_head, interface);
+TAILQ_HEAD(script_jobhead, script_job);
+TAILQ_HEAD(script_holdhead, script_hold);
+TAILQ_HEAD(arp_timerhead, arp_state);
+TAILQ_HEAD(hooks_resolvhead, hooks_resolv);
 
 #include "privsep.h"
 
@@ -111,7 +159,51 @@ TAILQ_HEAD(if_head, interface);
 #define	CMSG_SPACE(len)	(ALIGN(sizeof(struct cmsghdr)) + ALIGN(len))
 #endif
 
+struct bpf;
+struct cf_cache;
+struct dhcp_optindex;
+struct dhcp6_optindex;
+struct handoff;
+struct leasedb;
 struct passwd;
+struct ps_batch;
+struct ps_ring;
+struct shard;
+
+/* What dhcpcd --stats memory breaks the heap down by. */
+#define	MEM_LEASE	0	/* DHCP and DHCPv6 message copies */
+#define	MEM_RA		1	/* Router Advertisements */
+#define	MEM_ADDR	2	/* address pools */
+#define	MEM_ROUTE	3	/* route pool */
+#define	MEM_OPTIONS	4	/* if_options, option masks, config cache */
+#define	MEM_CONTROL	5	/* control socket queues */
+#define	MEM_SCRIPT	6	/* script buffer and environment */
+#define	MEM_MAX		7
+
+/* Counters for dhcpcd --stats counters which are not per interface */
+struct dhcpcd_stats {
+	unsigned long long script_runs;
+	unsigned long long script_usec;
+	unsigned long long script_max_usec;
+	unsigned long long link_msgs;		/* netlink or route socket */
+	unsigned long long link_overflows;
+	unsigned long long link_resyncs;	/* see link_resync */
+	unsigned long long route_adds;
+	unsigned long long route_changes;
+	unsigned long long route_deletes;
+	unsigned long long route_errors;
+	unsigned long long route_dumps;		/* kernel routing table dumps */
+	unsigned long long route_nhmoves;	/* gateways moved by nexthop */
+	unsigned long long route_builds;
+	unsigned long long route_coalesced;	/* see rt_defer */
+	unsigned long long ps_msgs_sent;
+	unsigned long long ps_msgs_recv;
+	unsigned long long ps_ring_recv;	/* of ps_msgs_recv */
+	size_t mem_peak[MEM_MAX];		/* bytes, see MEMSAMPLE */
+};
+
+/* Random bytes fetched at a time by rndpool_u32. */
+#define	RNDPOOL_LEN		256
 
 struct dhcpcd_ctx {
 	char pidfile[sizeof(PIDFILE) + IF_NAMESIZE + 1];
@@ -122,6 +214,9 @@ struct dhcpcd_ctx {
 	int stderr_fd;	/* FD for logging to stderr */
 	int fork_fd;	/* FD for the fork init signal pipe */
 	const char *cffile;
+	struct cf_cache *cf_cache;	/* see read_config */
+	struct cf_cache *cf_embedded;
+	struct if_optmasks_head optmasks;	/* see if_optmasks_intern */
 	unsigned long long options;
 	char *logfile;
 	int argc;
@@ -137,18 +232,40 @@ struct dhcpcd_ctx {
 	uint8_t duid_type;
 	unsigned char *duid;
 	size_t duid_len;
+	struct leasedb *leasedb;	/* see lease_db */
+	bool lease_flush_pending;	/* see lease_write_delay */
+
+	/* See start_concurrency and start_interval */
+	unsigned int start_max;
+	unsigned int start_interval;	/* milliseconds */
+	unsigned int start_running;
+	struct timespec start_last;
 	struct if_head *ifaces;
+	struct interface **if_idxhash;	/* see if_insert */
+	struct interface **if_namehash;
+	size_t if_hashlen;
+	size_t if_nhashed;
 
 	char *ctl_buf;
 	size_t ctl_buflen;
 	size_t ctl_bufpos;
 	size_t ctl_extra;
+	bool ctl_bulk;		/* see dhcpcd_dumpleases */
+
+	struct recvmsgs_buf *rcvbuf;	/* see recvmsgs */
+	uint8_t rndpool[RNDPOOL_LEN];	/* see rndpool_u32 */
+	size_t rndpool_len;
 
 	rb_tree_t routes;	/* our routes */
-#ifdef RT_FREE_ROUTE_TABLE
-	rb_tree_t froutes;	/* free routes for re-use */
-#endif
+	rb_tree_t kroutes;	/* kernel routes, see rt_kinvalidate */
+	unsigned int rt_kvalid;	/* families kroutes is valid for */
+	struct pool rt_pool;	/* free routes for re-use */
 	size_t rt_order;	/* route order storage */
+	bool rt_scoped;		/* rt_build only rebuilds dirty interfaces */
+	unsigned int rt_pending;	/* families to build, see rt_defer */
+	unsigned int rt_pendfull;	/* and those to build in full */
+	unsigned int rt_shadowed; /* families where interfaces share routes */
+	bool rt_multipath;	/* see multipath */
 
 	int pf_inet_fd;
 #ifdef PF_LINK
@@ -158,6 +275,18 @@ struct dhcpcd_ctx {
 	int link_fd;
 #ifndef SMALL
 	int link_rcvbuf;
+	unsigned int link_resync;	/* seconds */
+	unsigned int shards;		/* see shard_start */
+	int shard;			/* the one we work on or -1 */
+	struct shard *shard_procs;	/* the coordinator's workers */
+	bool shard_exiting;		/* workers were told to exit */
+	int shard_status;
+	unsigned long long shard_options;	/* to start workers with */
+	bool shard_restart;		/* see shard_restarted */
+#endif
+#ifdef TRACE
+	bool trace;			/* see trace_event */
+	struct trace_ring *trace_ring;
 #endif
 	int seq;	/* route message sequence no */
 	int sseq;	/* successful seq no sent */
@@ -166,19 +295,36 @@ struct dhcpcd_ctx {
 	sigset_t sigset;
 #endif
 	struct eloop *eloop;
+	struct dhcpcd_stats stats;
 
 	char *script;
-#ifdef HAVE_OPEN_MEMSTREAM
 	FILE *script_fp;
-#endif
 	char *script_buf;
 	size_t script_buflen;
+	char *opt_buf;		/* option values are formatted here */
+	size_t opt_buflen;
+	size_t opt_bufpos;
 	char **script_env;
 	size_t script_envlen;
+	struct script_jobhead script_jobs;
+	struct script_holdhead script_holds;	/* see script_debounce */
+	bool hook_runner;	/* see hook_runner */
+	int hook_runner_fd;
+	pid_t hook_runner_pid;
+	unsigned int builtin_hooks;	/* see builtin_hook */
+	struct hooks_resolvhead hooks_resolv;
+	char *hooks_iforder;
+	char *hooks_resolvconf;		/* as we last wrote it */
+	bool hooks_loaded;		/* see hooks_load */
+	bool warm_restart;		/* see warm_restart */
+	bool bpf_ring;			/* see bpf_ring */
 
 	int control_fd;
 	int control_unpriv_fd;
 	struct fd_list_head control_fds;
+	unsigned int control_queue_max;	/* see control_queue */
+	size_t control_queue_bytes;
+	int control_queue_policy;
 	char control_sock[sizeof(CONTROLSOCKET) + IF_NAMESIZE];
 	char control_sock_unpriv[sizeof(CONTROLSOCKET) + IF_NAMESIZE + 7];
 	gid_t control_group;
@@ -200,9 +346,30 @@ struct dhcpcd_ctx {
 	struct passwd *ps_user;	/* struct passwd for privsep user */
 	struct ps_process_head ps_processes;	/* List of spawned processes */
 	struct ps_process *ps_root;
-	struct ps_process *ps_inet;
+	unsigned int ps_inet_listening;	/* see ps_inet_listen */
 	struct ps_process *ps_ctl;
 	int ps_data_fd;		/* data returned from processes */
+	struct ps_batch *ps_batch;	/* see ps_root_batch_begin */
+	unsigned int ps_sigdeferred;	/* signals the inner eloop got */
+	struct ps_async_head ps_async;	/* awaiting a reply from root */
+	struct ps_async_head ps_async_done;	/* awaiting dispatch */
+	struct ps_file_head ps_files;	/* see ps_root_filefd */
+#ifdef PRIVSEP_GETIFADDRS
+	void *ps_ifaddrs;		/* last getifaddrs result */
+	size_t ps_ifaddrs_len;
+	unsigned int ps_ifaddrs_gen;
+#endif
+#ifdef PS_STATS
+	struct ps_stat_head ps_stats;	/* see ps_stats_add */
+	uint16_t ps_stat_cmd;		/* last command sent to root */
+	size_t ps_stat_len;
+	struct timespec ps_stat_started;
+#endif
+	struct ps_ring *ps_rings;	/* shared with all processes */
+	struct ps_ring *ps_ring;	/* our ring to the manager */
+	int ps_ring_wfd;		/* fd our ring stands in for */
+	int ps_ring_bell[2];		/* doorbell for the manager */
+	unsigned int ps_ring_used;	/* rings we cannot hand out */
 	int ps_log_fd;		/* chroot logging */
 	int ps_log_root_fd;	/* outside chroot log reader */
 	struct eloop *ps_eloop;	/* eloop for polling root data */
@@ -213,32 +380,60 @@ struct dhcpcd_ctx {
 #ifdef INET
 	struct dhcp_opt *dhcp_opts;
 	size_t dhcp_opts_len;
+	struct dhcp_opt **dhcp_optmap;	/* by code, see dhcp_optmap */
 
 	int udp_rfd;
 	int udp_wfd;
 
+	/* Packet sockets shared by all interfaces, see shared_bpf. */
+	struct bpf *dhcp_bpf;
+	struct bpf *arp_bpf;
+
+#ifdef ARP
+	/* ARP probes and announcements due, see arp_tick. */
+	struct arp_timerhead arp_timers;
+	bool arp_ticking;
+#endif
+
 	/* Our aggregate option buffer.
 	 * We ONLY use this when options are split, which for most purposes is
 	 * practically never. See RFC3396 for details. */
 	uint8_t *opt_buffer;
 	size_t opt_buffer_len;
+	struct dhcp_optindex *dhcp_optidx;	/* see get_option */
+	struct pool ia_pool;	/* free ipv4_addr for re-use */
+	struct ipv4_addr **ia_hash;	/* see ipv4_insertaddr */
+	size_t ia_hashlen;
+	size_t ia_naddrs;
 #endif
 #ifdef INET6
+	struct pool ia6_pool;	/* free ipv6_addr for re-use */
+	struct ipv6_addr **ia6_hash;	/* see ipv6_insertaddr */
+	size_t ia6_hashlen;
+	size_t ia6_naddrs;
 	uint8_t *secret;
 	size_t secret_len;
 
 #ifndef __sun
 	int nd_fd;
+	struct interface *nd_rsq[ND_RSQ_LEN];	/* see ipv6nd_flushrs */
+	size_t nd_rsq_len;
+	struct timespec nd_rsstart;	/* delayed solicitations are due */
 #endif
 	struct ra_head *ra_routers;
+	rb_tree_t ra_tree;	/* ra_routers by preference */
+	uint64_t ra_seq;
 
 	struct dhcp_opt *nd_opts;
 	size_t nd_opts_len;
+	struct dhcp_opt **nd_optsort;	/* by code, see dhcp_optsort */
 #ifdef DHCP6
 	int dhcp6_rfd;
 	int dhcp6_wfd;
 	struct dhcp_opt *dhcp6_opts;
 	size_t dhcp6_opts_len;
+	struct dhcp_opt **dhcp6_optsort;
+	struct dhcp6_optindex *dhcp6_optidx;	/* see dhcp6_findoption */
 #endif
 
 #ifndef __linux__
@@ -266,6 +461,7 @@ extern const char *dhcpcd_default_script;
 int dhcpcd_ifafwaiting(const struct interface *);
 int dhcpcd_afwaiting(const struct dhcpcd_ctx *);
 void dhcpcd_daemonise(struct dhcpcd_ctx *);
+void dhcpcd_bound(struct interface *);
 
 void dhcpcd_signal_cb(int, void *);
 
@@ -280,4 +476,16 @@ int dhcpcd_selectprofile(struct interface *, const char *);
 void dhcpcd_startinterface(void *);
 void dhcpcd_activateinterface(struct interface *, unsigned long long);
 
+/*
+ * The bytes held by each MEM_ subsystem are worked out from the structures
+ * that hold them when asked for, so only the peaks need keeping up to date.
+ * MEMSAMPLE is called where a subsystem can grow.
+ */
+#ifndef SMALL
+void dhcpcd_memsample(struct dhcpcd_ctx *, unsigned int);
+#define	MEMSAMPLE(ctx, mem)	dhcpcd_memsample((ctx), (mem))
+#else
+#define	MEMSAMPLE(ctx, mem)	do { } while (0 /* CONSTCOND */)
+#endif
+
 #endif
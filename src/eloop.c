@@ -52,6 +52,15 @@
  * signalfd(2) is available for Linux which probably works in a similar way
  * but it's yet another fd to use.
  *
+ * io_uring(7) can be used on Linux and allows the changes to the fds we
+ * poll to be submitted with the wait, saving syscalls when many fds are
+ * added or removed. Like epoll, it has to be explicitly selected.
+ *
+ * With HAVE_TIMERFD, epoll drives timeouts from a timerfd(2) armed to the
+ * absolute deadline of the next timeout rather than converting it into a
+ * relative wait each time around the loop. The timer is only re-armed
+ * when the next deadline changes.
+ *
  * Taking this all into account, ppoll(2) is the default mechanism used here.
  */
 
@@ -63,11 +72,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -80,16 +91,23 @@
 /* Prioritise which mechanism we want to use.*/
 #if defined(HAVE_PPOLL)
 #undef HAVE_EPOLL
+#undef HAVE_IO_URING
 #undef HAVE_KQUEUE
 #undef HAVE_PSELECT
 #elif defined(HAVE_POLLTS)
 #define HAVE_PPOLL
 #define ppoll pollts
 #undef HAVE_EPOLL
+#undef HAVE_IO_URING
 #undef HAVE_KQUEUE
 #undef HAVE_PSELECT
 #elif defined(HAVE_KQUEUE)
 #undef HAVE_EPOLL
+#undef HAVE_IO_URING
+#undef HAVE_PSELECT
+#elif defined(HAVE_IO_URING)
+#undef HAVE_EPOLL
+#undef HAVE_KQUEUE
 #undef HAVE_PSELECT
 #elif defined(HAVE_EPOLL)
 #undef HAVE_KQUEUE
@@ -107,8 +125,18 @@
 #define	_kevent kevent
 #endif
 #define NFD 2
+#elif defined(HAVE_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#define	NFD 1
 #elif defined(HAVE_EPOLL)
 #include <sys/epoll.h>
+#ifdef HAVE_TIMERFD
+#include <sys/timerfd.h>
+#define	ELOOP_TIMERFD
+#endif
 #define	NFD 1
 #elif defined(HAVE_PPOLL)
 #include <poll.h>
@@ -122,6 +150,16 @@
 #ifndef UNUSED
 #define UNUSED(a) (void)((a))
 #endif
+#ifndef __arraycount
+#define __arraycount(__x)	(sizeof(__x) / sizeof(__x[0]))
+#endif
+#ifndef __printflike
+#ifdef __GNUC__
+#define	__printflike(a, b) __attribute__((format(printf, a, b)))
+#else
+#define	__printflike(a, b)
+#endif
+#endif
 #ifndef __unused
 #ifdef __GNUC__
 #define __unused   __attribute__((__unused__))
@@ -183,38 +221,127 @@ struct eloop_event {
 #ifdef HAVE_PPOLL
 	struct pollfd *pollfd;
 #endif
+#ifdef HAVE_IO_URING
+	uint32_t uring_gen;
+	bool uring_armed;
+#endif
 };
 
+/*
+ * Timeouts are kept in a binary min-heap ordered by an absolute deadline
+ * measured from the epoch taken when the eloop was created.
+ * This avoids having to walk and rewrite every timeout when one is added
+ * and makes adding, removing and expiring a timeout O(log n).
+ * The sequence number is a tie breaker so that timeouts with the same
+ * deadline still fire in the order they were added.
+ *
+ * Each timeout is also hashed by callback and argument so that finding
+ * an existing timeout is O(1), and by argument alone so that deleting
+ * every timeout for an argument only walks the timeouts for that argument.
+ */
 struct eloop_timeout {
-	TAILQ_ENTRY(eloop_timeout) next;
-	unsigned int seconds;
+	TAILQ_ENTRY(eloop_timeout) next;	/* free list */
+	TAILQ_ENTRY(eloop_timeout) hnext;	/* callback + arg hash */
+	TAILQ_ENTRY(eloop_timeout) anext;	/* arg hash */
+	unsigned long long seconds;
 	unsigned int nseconds;
+	unsigned long long seq;
+	size_t heapidx;
 	void (*callback)(void *);
 	void *arg;
 	int queue;
 };
 
+#ifdef ELOOP_STATS
+/*
+ * Dispatch statistics for each fd or timeout callback, keyed by the
+ * address of the callback.
+ * Bucket 0 of the histogram counts dispatches taking under 1us and
+ * bucket n counts those taking under 2^n us.
+ */
+#define	ELOOP_STATS_HASHLEN	64
+#define	ELOOP_STATS_NHIST	24
+
+#define	ELOOP_STAT_EVENT	1
+#define	ELOOP_STAT_TIMEOUT	2
+
+struct eloop_stat {
+	TAILQ_ENTRY(eloop_stat) next;
+	uintptr_t callback;
+	int type;
+	unsigned long long count;
+	unsigned long long total_usec;
+	unsigned long long max_usec;
+	unsigned long long hist[ELOOP_STATS_NHIST];
+};
+#endif
+
+#ifdef HAVE_IO_URING
+/* The mmapped submission and completion rings. */
+struct eloop_uring {
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int to_submit;
+	uint32_t gen;
+};
+#endif
+
 struct eloop {
 	TAILQ_HEAD (event_head, eloop_event) events;
 	size_t nevents;
 	struct event_head free_events;
-
-	struct timespec now;
-	TAILQ_HEAD (timeout_head, eloop_timeout) timeouts;
-	struct timeout_head free_timeouts;
+	/* Sparse array indexed by fd for O(1) lookup of the event. */
+	struct eloop_event **fdtable;
+	size_t fdtable_len;
+
+	struct timespec epoch;
+	struct eloop_timeout **timeouts;
+	size_t ntimeouts;
+	size_t timeouts_len;
+	unsigned long long timeout_seq;
+	TAILQ_HEAD (timeout_head, eloop_timeout) free_timeouts;
+	struct timeout_head *timeout_hash;
+	struct timeout_head *timeout_arghash;
+	size_t timeout_hashlen;
+
+#ifdef ELOOP_STATS
+	TAILQ_HEAD (stat_head, eloop_stat) stats[ELOOP_STATS_HASHLEN];
+	size_t nstats;
+#endif
 
 	const int *signals;
 	size_t nsignals;
 	void (*signal_cb)(int, void *);
 	void *signal_cb_ctx;
 
-#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL) || defined(HAVE_IO_URING)
 	int fd;
 #endif
 #if defined(HAVE_KQUEUE)
 	struct kevent *fds;
+#elif defined(HAVE_IO_URING)
+	struct eloop_uring uring;
+	struct io_uring_cqe *fds;
 #elif defined(HAVE_EPOLL)
 	struct epoll_event *fds;
+#ifdef ELOOP_TIMERFD
+	int timerfd;
+	unsigned long long timerfd_seconds;
+	unsigned int timerfd_nseconds;
+	bool timerfd_armed;
+#endif
 #elif defined(HAVE_PPOLL)
 	struct pollfd *fds;
 #endif
@@ -247,6 +374,248 @@ eloop_realloca(void *ptr, size_t n, size_t size)
 #endif
 
 
+static inline struct eloop_event *
+eloop_event_find(const struct eloop *eloop, int fd)
+{
+
+	if ((size_t)fd >= eloop->fdtable_len)
+		return NULL;
+	return eloop->fdtable[fd];
+}
+
+static int
+eloop_event_setfd(struct eloop *eloop, int fd, struct eloop_event *e)
+{
+
+	if ((size_t)fd >= eloop->fdtable_len) {
+		struct eloop_event **ft;
+		size_t len = eloop->fdtable_len == 0 ? 64 : eloop->fdtable_len;
+
+		if (e == NULL)
+			return 0;
+		while (len <= (size_t)fd)
+			len *= 2;
+		ft = eloop_realloca(eloop->fdtable, len, sizeof(*ft));
+		if (ft == NULL)
+			return -1;
+		memset(ft + eloop->fdtable_len, 0,
+		    (len - eloop->fdtable_len) * sizeof(*ft));
+		eloop->fdtable = ft;
+		eloop->fdtable_len = len;
+	}
+	eloop->fdtable[fd] = e;
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring(7) is driven by raw syscalls so we don't need liburing.
+ * Multishot poll requests are edge triggered and the kernel refuses
+ * IORING_POLL_ADD_LEVEL from userland. Our callbacks assume level
+ * triggered readiness as most only read one message per call, so each fd
+ * is watched by a oneshot poll request which is re-armed once the
+ * callback returns. The re-arm is submitted with the next wait, so we
+ * still only make one syscall per loop iteration.
+ * The user_data for a request is the fd and a generation so that
+ * completions for a request we have since replaced or removed
+ * can be ignored.
+ */
+#define	ELOOP_URING_ENTRIES	256
+#define	ELOOP_URING_IGNORE	UINT64_MAX
+
+static inline uint64_t
+eloop_uring_data(const struct eloop_event *e)
+{
+
+	return (uint64_t)(unsigned int)e->fd << 32 | e->uring_gen;
+}
+
+static int
+eloop_uring_enter(struct eloop *eloop, unsigned int min_complete,
+    const struct timespec *ts, const sigset_t *signals)
+{
+	struct __kernel_timespec kts;
+	struct io_uring_getevents_arg arg = { .sigmask = 0 };
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	long n;
+
+	if (signals != NULL) {
+		arg.sigmask = (uint64_t)(uintptr_t)signals;
+		arg.sigmask_sz = _NSIG / NBBY;
+	}
+	if (ts != NULL) {
+		kts.tv_sec = ts->tv_sec;
+		kts.tv_nsec = ts->tv_nsec;
+		arg.ts = (uint64_t)(uintptr_t)&kts;
+	}
+	if (min_complete != 0)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	n = syscall(__NR_io_uring_enter, eloop->fd, eloop->uring.to_submit,
+	    min_complete, flags, &arg, sizeof(arg));
+	if (n == -1)
+		return -1;
+	eloop->uring.to_submit -= (unsigned int)n;
+	return 0;
+}
+
+static struct io_uring_sqe *
+eloop_uring_getsqe(struct eloop *eloop)
+{
+	struct eloop_uring *u = &eloop->uring;
+	unsigned int tail, idx;
+	struct io_uring_sqe *sqe;
+
+	tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >
+	    *u->sq_mask)
+	{
+		/* Submission ring is full, so flush it. */
+		if (eloop_uring_enter(eloop, 0, NULL, NULL) == -1)
+			return NULL;
+	}
+
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return sqe;
+}
+
+static int
+eloop_uring_arm(struct eloop *eloop, struct eloop_event *e)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t events = 0;
+
+	if (e->events & ELE_READ)
+		events |= POLLIN;
+	if (e->events & ELE_WRITE)
+		events |= POLLOUT;
+	if (events == 0)
+		return 0;
+
+	if ((sqe = eloop_uring_getsqe(eloop)) == NULL)
+		return -1;
+	if (++eloop->uring.gen == 0)
+		eloop->uring.gen++;
+	e->uring_gen = eloop->uring.gen;
+	e->uring_armed = true;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = e->fd;
+#if BYTE_ORDER == BIG_ENDIAN
+	events = events << 16 | events >> 16;
+#endif
+	sqe->poll32_events = events;
+	sqe->user_data = eloop_uring_data(e);
+	return 0;
+}
+
+static int
+eloop_uring_disarm(struct eloop *eloop, struct eloop_event *e)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!e->uring_armed)
+		return 0;
+	if ((sqe = eloop_uring_getsqe(eloop)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = eloop_uring_data(e);
+	sqe->user_data = ELOOP_URING_IGNORE;
+	e->uring_armed = false;
+	e->uring_gen = 0;
+	return 0;
+}
+
+static void
+eloop_uring_close(struct eloop *eloop)
+{
+	struct eloop_uring *u = &eloop->uring;
+
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != NULL && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != NULL)
+		munmap(u->sq_ring, u->sq_ring_size);
+	memset(u, 0, sizeof(*u));
+	if (eloop->fd != -1) {
+		close(eloop->fd);
+		eloop->fd = -1;
+	}
+}
+
+static int
+eloop_uring_open(struct eloop *eloop)
+{
+	struct io_uring_params p = { .flags = 0 };
+	struct eloop_uring *u = &eloop->uring;
+	long fd;
+	char *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	eloop->fd = -1;
+	fd = syscall(__NR_io_uring_setup, ELOOP_URING_ENTRIES, &p);
+	if (fd == -1)
+		return -1;
+	eloop->fd = (int)fd;
+
+	/* We need to pass a signal mask and a timeout when waiting. */
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		goto err;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->sq_ring_size = u->cq_ring_size =
+		    MAX(u->sq_ring_size, u->cq_ring_size);
+
+	sq = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, eloop->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	u->sq_ring = sq;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, eloop->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err;
+	}
+	u->cq_ring = cq;
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, eloop->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto err;
+	}
+
+	u->sq_head = (void *)(sq + p.sq_off.head);
+	u->sq_tail = (void *)(sq + p.sq_off.tail);
+	u->sq_mask = (void *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (void *)(sq + p.sq_off.array);
+	u->cq_head = (void *)(cq + p.cq_off.head);
+	u->cq_tail = (void *)(cq + p.cq_off.tail);
+	u->cq_mask = (void *)(cq + p.cq_off.ring_mask);
+	u->cqes = (void *)(cq + p.cq_off.cqes);
+	return eloop->fd;
+
+err:
+	eloop_uring_close(eloop);
+	return -1;
+}
+#endif
+
 static int
 eloop_event_setup_fds(struct eloop *eloop)
 {
@@ -254,9 +623,17 @@ eloop_event_setup_fds(struct eloop *eloop)
 #if defined(HAVE_KQUEUE)
 	struct kevent *pfd;
 	size_t nfds = eloop->nsignals;
+#elif defined(HAVE_IO_URING)
+	/* Always have room to consume stale completions. */
+	struct io_uring_cqe *pfd;
+	size_t nfds = 1;
 #elif defined(HAVE_EPOLL)
 	struct epoll_event *pfd;
+#ifdef ELOOP_TIMERFD
+	size_t nfds = 1;
+#else
 	size_t nfds = 0;
+#endif
 #elif defined(HAVE_PPOLL)
 	struct pollfd *pfd;
 	size_t nfds = 0;
@@ -318,20 +695,18 @@ eloop_event_add(struct eloop *eloop, int fd, unsigned short events,
 #elif defined(HAVE_EPOLL)
 	struct epoll_event epe;
 	int op;
+#elif defined(HAVE_IO_URING)
+	unsigned short oevents;
 #endif
 
 	assert(eloop != NULL);
 	assert(cb != NULL && cb_arg != NULL);
-	if (fd == -1 || !(events & (ELE_READ | ELE_WRITE | ELE_HANGUP))) {
+	if (fd < 0 || !(events & (ELE_READ | ELE_WRITE | ELE_HANGUP))) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	TAILQ_FOREACH(e, &eloop->events, next) {
-		if (e->fd == fd)
-			break;
-	}
-
+	e = eloop_event_find(eloop, fd);
 	if (e == NULL) {
 		added = true;
 		e = TAILQ_FIRST(&eloop->free_events);
@@ -343,16 +718,31 @@ eloop_event_add(struct eloop *eloop, int fd, unsigned short events,
 				return -1;
 			}
 		}
+		if (eloop_event_setfd(eloop, fd, e) == -1) {
+			TAILQ_INSERT_TAIL(&eloop->free_events, e, next);
+			return -1;
+		}
 		TAILQ_INSERT_HEAD(&eloop->events, e, next);
 		eloop->nevents++;
 		e->fd = fd;
 		e->events = 0;
+#ifdef HAVE_PPOLL
+		e->pollfd = NULL;
+#endif
+#ifdef HAVE_IO_URING
+		e->uring_gen = 0;
+		e->uring_armed = false;
+#endif
 	} else
 		added = false;
 
 	e->cb = cb;
 	e->cb_arg = cb_arg;
 
+	/* Nothing to do if we are just changing the callback. */
+	if (!added && e->events == events)
+		return 0;
+
 #if defined(HAVE_KQUEUE)
 	n = 2;
 	if (events & ELE_READ && !(e->events & ELE_READ))
@@ -378,6 +768,8 @@ eloop_event_add(struct eloop *eloop, int fd, unsigned short events,
 		if (added) {
 			TAILQ_REMOVE(&eloop->events, e, next);
 			TAILQ_INSERT_TAIL(&eloop->free_events, e, next);
+			eloop->fdtable[fd] = NULL;
+			eloop->nevents--;
 		}
 		return -1;
 	}
@@ -393,17 +785,42 @@ eloop_event_add(struct eloop *eloop, int fd, unsigned short events,
 		if (added) {
 			TAILQ_REMOVE(&eloop->events, e, next);
 			TAILQ_INSERT_TAIL(&eloop->free_events, e, next);
+			eloop->fdtable[fd] = NULL;
+			eloop->nevents--;
+		}
+		return -1;
+	}
+#elif defined(HAVE_IO_URING)
+	/* Replace any existing poll request.
+	 * Errors from the request itself are reported by completion. */
+	oevents = e->events;
+	e->events = events;
+	if (eloop_uring_disarm(eloop, e) == -1 ||
+	    eloop_uring_arm(eloop, e) == -1)
+	{
+		e->events = oevents;
+		if (added) {
+			TAILQ_REMOVE(&eloop->events, e, next);
+			TAILQ_INSERT_TAIL(&eloop->free_events, e, next);
+			eloop->fdtable[fd] = NULL;
+			eloop->nevents--;
 		}
 		return -1;
 	}
 #elif defined(HAVE_PPOLL)
-	e->pollfd = NULL;
-	UNUSED(added);
-#else
-	UNUSED(added);
+	/* Update the existing pollfd in place if we can. */
+	if (!added && e->pollfd != NULL) {
+		e->pollfd->events = 0;
+		if (events & ELE_READ)
+			e->pollfd->events |= POLLIN;
+		if (events & ELE_WRITE)
+			e->pollfd->events |= POLLOUT;
+	}
 #endif
 	e->events = events;
-	eloop->events_need_setup = true;
+	/* Only a change to the set of fds needs a rebuild. */
+	if (added)
+		eloop->events_need_setup = true;
 	return 0;
 }
 
@@ -417,15 +834,12 @@ eloop_event_delete(struct eloop *eloop, int fd)
 #endif
 
 	assert(eloop != NULL);
-	if (fd == -1) {
+	if (fd < 0) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	TAILQ_FOREACH(e, &eloop->events, next) {
-		if (e->fd == fd)
-			break;
-	}
+	e = eloop_event_find(eloop, fd);
 	if (e == NULL) {
 		errno = ENOENT;
 		return -1;
@@ -446,7 +860,14 @@ eloop_event_delete(struct eloop *eloop, int fd)
 #elif defined(HAVE_EPOLL)
 	if (epoll_ctl(eloop->fd, EPOLL_CTL_DEL, fd, NULL) == -1)
 		return -1;
+#elif defined(HAVE_IO_URING)
+	/* The poll request holds a reference to the file, so make sure
+	 * the kernel drops it before the caller closes the fd. */
+	if (eloop_uring_disarm(eloop, e) == -1 ||
+	    eloop_uring_enter(eloop, 0, NULL, NULL) == -1)
+		return -1;
 #endif
+	eloop->fdtable[fd] = NULL;
 	e->fd = -1;
 	eloop->nevents--;
 	eloop->events_need_setup = true;
@@ -488,37 +909,214 @@ eloop_timespec_diff(const struct timespec *tsp, const struct timespec *usp,
 	return secs;
 }
 
+/* Seconds and nanoseconds elapsed since the eloop epoch. */
 static void
-eloop_reduce_timers(struct eloop *eloop)
+eloop_getnow(struct eloop *eloop, unsigned long long *secs,
+    unsigned int *nsecs)
 {
 	struct timespec now;
-	unsigned long long secs;
-	unsigned int nsecs;
-	struct eloop_timeout *t;
 
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	secs = eloop_timespec_diff(&now, &eloop->now, &nsecs);
+	*secs = eloop_timespec_diff(&now, &eloop->epoch, nsecs);
+}
 
-	TAILQ_FOREACH(t, &eloop->timeouts, next) {
-		if (secs > t->seconds) {
-			t->seconds = 0;
-			t->nseconds = 0;
-		} else {
-			t->seconds -= (unsigned int)secs;
-			if (nsecs > t->nseconds) {
-				if (t->seconds == 0)
-					t->nseconds = 0;
-				else {
-					t->seconds--;
-					t->nseconds = NSEC_PER_SEC
-					    - (nsecs - t->nseconds);
-				}
-			} else
-				t->nseconds -= nsecs;
-		}
+static inline bool
+eloop_timeout_before(const struct eloop_timeout *a,
+    const struct eloop_timeout *b)
+{
+
+	if (a->seconds != b->seconds)
+		return a->seconds < b->seconds;
+	if (a->nseconds != b->nseconds)
+		return a->nseconds < b->nseconds;
+	return a->seq < b->seq;
+}
+
+static inline void
+eloop_timeout_heapset(struct eloop *eloop, size_t idx, struct eloop_timeout *t)
+{
+
+	eloop->timeouts[idx] = t;
+	t->heapidx = idx;
+}
+
+static void
+eloop_timeout_siftup(struct eloop *eloop, size_t idx)
+{
+	struct eloop_timeout *t = eloop->timeouts[idx], *p;
+	size_t pidx;
+
+	while (idx != 0) {
+		pidx = (idx - 1) / 2;
+		p = eloop->timeouts[pidx];
+		if (!eloop_timeout_before(t, p))
+			break;
+		eloop_timeout_heapset(eloop, idx, p);
+		idx = pidx;
+	}
+	eloop_timeout_heapset(eloop, idx, t);
+}
+
+static void
+eloop_timeout_siftdown(struct eloop *eloop, size_t idx)
+{
+	struct eloop_timeout *t = eloop->timeouts[idx], *c;
+	size_t cidx;
+
+	for (;;) {
+		cidx = idx * 2 + 1;
+		if (cidx >= eloop->ntimeouts)
+			break;
+		c = eloop->timeouts[cidx];
+		if (cidx + 1 < eloop->ntimeouts &&
+		    eloop_timeout_before(eloop->timeouts[cidx + 1], c))
+			c = eloop->timeouts[++cidx];
+		if (!eloop_timeout_before(c, t))
+			break;
+		eloop_timeout_heapset(eloop, idx, c);
+		idx = cidx;
+	}
+	eloop_timeout_heapset(eloop, idx, t);
+}
+
+static inline size_t
+eloop_hashptr(uintptr_t v)
+{
+
+	v ^= v >> 16;
+	v *= 0x45d9f3b;
+	v ^= v >> 16;
+	return (size_t)v;
+}
+
+static inline size_t
+eloop_timeout_hash(const struct eloop *eloop,
+    void (*callback)(void *), const void *arg)
+{
+
+	return (eloop_hashptr((uintptr_t)callback) * 31 +
+	    eloop_hashptr((uintptr_t)arg)) & (eloop->timeout_hashlen - 1);
+}
+
+static inline size_t
+eloop_timeout_arghash(const struct eloop *eloop, const void *arg)
+{
+
+	return eloop_hashptr((uintptr_t)arg) & (eloop->timeout_hashlen - 1);
+}
+
+static void
+eloop_timeout_link(struct eloop *eloop, struct eloop_timeout *t)
+{
+
+	TAILQ_INSERT_TAIL(&eloop->timeout_hash[
+	    eloop_timeout_hash(eloop, t->callback, t->arg)], t, hnext);
+	TAILQ_INSERT_TAIL(&eloop->timeout_arghash[
+	    eloop_timeout_arghash(eloop, t->arg)], t, anext);
+}
+
+static void
+eloop_timeout_unlink(struct eloop *eloop, struct eloop_timeout *t)
+{
+
+	TAILQ_REMOVE(&eloop->timeout_hash[
+	    eloop_timeout_hash(eloop, t->callback, t->arg)], t, hnext);
+	TAILQ_REMOVE(&eloop->timeout_arghash[
+	    eloop_timeout_arghash(eloop, t->arg)], t, anext);
+}
+
+static struct eloop_timeout *
+eloop_timeout_find(struct eloop *eloop, void (*callback)(void *), void *arg)
+{
+	struct eloop_timeout *t;
+
+	if (eloop->timeout_hashlen == 0)
+		return NULL;
+	TAILQ_FOREACH(t, &eloop->timeout_hash[
+	    eloop_timeout_hash(eloop, callback, arg)], hnext)
+	{
+		if (t->callback == callback && t->arg == arg)
+			return t;
+	}
+	return NULL;
+}
+
+/* Keep the load factor of the hashes at or below one. */
+static int
+eloop_timeout_hashgrow(struct eloop *eloop)
+{
+	struct timeout_head *h, *ah;
+	size_t i, len;
+
+	if (eloop->ntimeouts < eloop->timeout_hashlen)
+		return 0;
+
+	len = eloop->timeout_hashlen == 0 ? 16 : eloop->timeout_hashlen * 2;
+	h = eloop_realloca(NULL, len, sizeof(*h));
+	if (h == NULL)
+		return -1;
+	ah = eloop_realloca(NULL, len, sizeof(*ah));
+	if (ah == NULL) {
+		free(h);
+		return -1;
+	}
+	for (i = 0; i < len; i++) {
+		TAILQ_INIT(&h[i]);
+		TAILQ_INIT(&ah[i]);
+	}
+
+	free(eloop->timeout_hash);
+	free(eloop->timeout_arghash);
+	eloop->timeout_hash = h;
+	eloop->timeout_arghash = ah;
+	eloop->timeout_hashlen = len;
+	for (i = 0; i < eloop->ntimeouts; i++)
+		eloop_timeout_link(eloop, eloop->timeouts[i]);
+	return 0;
+}
+
+static int
+eloop_timeout_insert(struct eloop *eloop, struct eloop_timeout *t)
+{
+
+	if (eloop_timeout_hashgrow(eloop) == -1)
+		return -1;
+
+	if (eloop->ntimeouts == eloop->timeouts_len) {
+		struct eloop_timeout **nt;
+		size_t nlen;
+
+		nlen = eloop->timeouts_len == 0 ? 16 : eloop->timeouts_len * 2;
+		nt = eloop_realloca(eloop->timeouts, nlen, sizeof(*nt));
+		if (nt == NULL)
+			return -1;
+		eloop->timeouts = nt;
+		eloop->timeouts_len = nlen;
 	}
 
-	eloop->now = now;
+	eloop_timeout_heapset(eloop, eloop->ntimeouts++, t);
+	eloop_timeout_siftup(eloop, t->heapidx);
+	eloop_timeout_link(eloop, t);
+	return 0;
+}
+
+static void
+eloop_timeout_remove(struct eloop *eloop, struct eloop_timeout *t)
+{
+	size_t idx = t->heapidx;
+	struct eloop_timeout *last;
+
+	assert(idx < eloop->ntimeouts && eloop->timeouts[idx] == t);
+	eloop_timeout_unlink(eloop, t);
+	last = eloop->timeouts[--eloop->ntimeouts];
+	if (last == t)
+		return;
+	eloop_timeout_heapset(eloop, idx, last);
+	if (idx != 0 && eloop_timeout_before(last,
+	    eloop->timeouts[(idx - 1) / 2]))
+		eloop_timeout_siftup(eloop, idx);
+	else
+		eloop_timeout_siftdown(eloop, idx);
 }
 
 /*
@@ -526,26 +1124,29 @@ eloop_reduce_timers(struct eloop *eloop)
  * where time_t is INT32_MAX. It should also cope with the monotonic timer
  * wrapping, although this is highly unlikely.
  * unsigned int should match or be greater than any on wire specified timeout.
+ *
+ * If slack is given, the deadline is rounded up to the next multiple of
+ * slack seconds from the epoch so that timeouts which can tolerate
+ * firing late are batched into a single wakeup.
+ * If limit is also given, the rounded deadline must fall before limit
+ * seconds from now, otherwise the exact deadline is used.
  */
 static int
 eloop_q_timeout_add(struct eloop *eloop, int queue,
     unsigned int seconds, unsigned int nseconds,
+    unsigned int slack, unsigned int limit,
     void (*callback)(void *), void *arg)
 {
-	struct eloop_timeout *t, *tt = NULL;
+	struct eloop_timeout *t;
+	unsigned long long secs, rsecs, now;
+	unsigned int nsecs;
+	bool added;
 
 	assert(eloop != NULL);
 	assert(callback != NULL);
 	assert(nseconds <= NSEC_PER_SEC);
 
-	/* Remove existing timeout if present. */
-	TAILQ_FOREACH(t, &eloop->timeouts, next) {
-		if (t->callback == callback && t->arg == arg) {
-			TAILQ_REMOVE(&eloop->timeouts, t, next);
-			break;
-		}
-	}
-
+	t = eloop_timeout_find(eloop, callback, arg);
 	if (t == NULL) {
 		/* No existing, so allocate or grab one from the free pool. */
 		if ((t = TAILQ_FIRST(&eloop->free_timeouts))) {
@@ -554,27 +1155,48 @@ eloop_q_timeout_add(struct eloop *eloop, int queue,
 			if ((t = malloc(sizeof(*t))) == NULL)
 				return -1;
 		}
-	}
+		added = true;
+	} else
+		added = false;
 
-	eloop_reduce_timers(eloop);
+	eloop_getnow(eloop, &secs, &nsecs);
+	now = secs;
+	secs += seconds;
+	nsecs += nseconds;
+	if (nsecs >= NSEC_PER_SEC) {
+		secs++;
+		nsecs -= NSEC_PER_SEC;
+	}
+	if (slack > 1) {
+		rsecs = nsecs != 0 ? secs + 1 : secs;
+		rsecs = (rsecs + slack - 1) / slack * slack;
+		if (limit == 0 || rsecs < now + limit) {
+			secs = rsecs;
+			nsecs = 0;
+		}
+	}
 
-	t->seconds = seconds;
-	t->nseconds = nseconds;
+	t->seconds = secs;
+	t->nseconds = nsecs;
+	t->seq = eloop->timeout_seq++;
 	t->callback = callback;
 	t->arg = arg;
 	t->queue = queue;
 
-	/* The timeout list should be in chronological order,
-	 * soonest first. */
-	TAILQ_FOREACH(tt, &eloop->timeouts, next) {
-		if (t->seconds < tt->seconds ||
-		    (t->seconds == tt->seconds && t->nseconds < tt->nseconds))
-		{
-			TAILQ_INSERT_BEFORE(tt, t, next);
-			return 0;
-		}
+	if (!added) {
+		/* Existing timeout, so just restore heap order. */
+		if (t->heapidx != 0 && eloop_timeout_before(t,
+		    eloop->timeouts[(t->heapidx - 1) / 2]))
+			eloop_timeout_siftup(eloop, t->heapidx);
+		else
+			eloop_timeout_siftdown(eloop, t->heapidx);
+		return 0;
+	}
+
+	if (eloop_timeout_insert(eloop, t) == -1) {
+		TAILQ_INSERT_TAIL(&eloop->free_timeouts, t, next);
+		return -1;
 	}
-	TAILQ_INSERT_TAIL(&eloop->timeouts, t, next);
 	return 0;
 }
 
@@ -593,7 +1215,7 @@ eloop_q_timeout_add_tv(struct eloop *eloop, int queue,
 	}
 
 	return eloop_q_timeout_add(eloop, queue,
-	    (unsigned int)when->tv_sec, (unsigned int)when->tv_sec,
+	    (unsigned int)when->tv_sec, (unsigned int)when->tv_nsec, 0, 0,
 	    callback, arg);
 }
 
@@ -602,7 +1224,18 @@ eloop_q_timeout_add_sec(struct eloop *eloop, int queue, unsigned int seconds,
     void (*callback)(void *), void *arg)
 {
 
-	return eloop_q_timeout_add(eloop, queue, seconds, 0, callback, arg);
+	return eloop_q_timeout_add(eloop, queue, seconds, 0, 0, 0,
+	    callback, arg);
+}
+
+int
+eloop_q_timeout_add_sec_slack(struct eloop *eloop, int queue,
+    unsigned int seconds, unsigned int slack, unsigned int limit,
+    void (*callback)(void *), void *arg)
+{
+
+	return eloop_q_timeout_add(eloop, queue, seconds, 0, slack, limit,
+	    callback, arg);
 }
 
 int
@@ -619,7 +1252,8 @@ eloop_q_timeout_add_msec(struct eloop *eloop, int queue, unsigned long when,
 
 	nseconds = (when % MSEC_PER_SEC) * NSEC_PER_MSEC;
 	return eloop_q_timeout_add(eloop, queue,
-		(unsigned int)seconds, (unsigned int)nseconds, callback, arg);
+		(unsigned int)seconds, (unsigned int)nseconds, 0, 0,
+		callback, arg);
 }
 
 int
@@ -627,17 +1261,28 @@ eloop_q_timeout_delete(struct eloop *eloop, int queue,
     void (*callback)(void *), void *arg)
 {
 	struct eloop_timeout *t, *tt;
+	struct timeout_head *ah;
 	int n;
 
 	assert(eloop != NULL);
 
+	if (callback != NULL) {
+		t = eloop_timeout_find(eloop, callback, arg);
+		if (t == NULL || (queue != 0 && t->queue != queue))
+			return 0;
+		eloop_timeout_remove(eloop, t);
+		TAILQ_INSERT_TAIL(&eloop->free_timeouts, t, next);
+		return 1;
+	}
+
+	if (eloop->timeout_hashlen == 0)
+		return 0;
+
 	n = 0;
-	TAILQ_FOREACH_SAFE(t, &eloop->timeouts, next, tt) {
-		if ((queue == 0 || t->queue == queue) &&
-		    t->arg == arg &&
-		    (!callback || t->callback == callback))
-		{
-			TAILQ_REMOVE(&eloop->timeouts, t, next);
+	ah = &eloop->timeout_arghash[eloop_timeout_arghash(eloop, arg)];
+	TAILQ_FOREACH_SAFE(t, ah, anext, tt) {
+		if ((queue == 0 || t->queue == queue) && t->arg == arg) {
+			eloop_timeout_remove(eloop, t);
 			TAILQ_INSERT_TAIL(&eloop->free_timeouts, t, next);
 			n++;
 		}
@@ -664,11 +1309,106 @@ eloop_enter(struct eloop *eloop)
 	eloop->exitnow = false;
 }
 
+#ifdef ELOOP_TIMERFD
+static int
+eloop_timerfd_open(struct eloop *eloop)
+{
+	struct epoll_event epe = { .events = EPOLLIN };
+
+	eloop->timerfd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_CLOEXEC | TFD_NONBLOCK);
+	if (eloop->timerfd == -1)
+		return -1;
+	eloop->timerfd_armed = false;
+
+	/* A NULL event marks the timer. */
+	epe.data.ptr = NULL;
+	if (epoll_ctl(eloop->fd, EPOLL_CTL_ADD, eloop->timerfd, &epe) == -1) {
+		close(eloop->timerfd);
+		eloop->timerfd = -1;
+		return -1;
+	}
+	/* Ensure we have room to receive it. */
+	eloop->events_need_setup = true;
+	return 0;
+}
+
+static void
+eloop_timerfd_close(struct eloop *eloop)
+{
+
+	if (eloop->timerfd != -1) {
+		close(eloop->timerfd);
+		eloop->timerfd = -1;
+	}
+	eloop->timerfd_armed = false;
+}
+
+/* Arm the timer to the absolute deadline of t unless already there. */
+static int
+eloop_timerfd_arm(struct eloop *eloop, const struct eloop_timeout *t)
+{
+	struct itimerspec its = { .it_interval = { .tv_sec = 0 } };
+
+	if (eloop->timerfd_armed &&
+	    eloop->timerfd_seconds == t->seconds &&
+	    eloop->timerfd_nseconds == t->nseconds)
+		return 0;
+
+	its.it_value.tv_sec = eloop->epoch.tv_sec +
+	    (time_t)(t->seconds > INT_MAX ? INT_MAX : t->seconds);
+	its.it_value.tv_nsec = eloop->epoch.tv_nsec + (long)t->nseconds;
+	if (its.it_value.tv_nsec >= NSEC_PER_SEC) {
+		its.it_value.tv_sec++;
+		its.it_value.tv_nsec -= NSEC_PER_SEC;
+	}
+	/* A zero value would disarm the timer. */
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+	if (timerfd_settime(eloop->timerfd, TFD_TIMER_ABSTIME,
+	    &its, NULL) == -1)
+		return -1;
+
+	eloop->timerfd_seconds = t->seconds;
+	eloop->timerfd_nseconds = t->nseconds;
+	eloop->timerfd_armed = true;
+	return 0;
+}
+
+static int
+eloop_timerfd_disarm(struct eloop *eloop)
+{
+	struct itimerspec its = { .it_value = { .tv_sec = 0 } };
+
+	if (!eloop->timerfd_armed)
+		return 0;
+	eloop->timerfd_armed = false;
+	return timerfd_settime(eloop->timerfd, 0, &its, NULL);
+}
+#endif
+
 /* Must be called after fork(2) */
 int
 eloop_forked(struct eloop *eloop)
 {
-#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+#if defined(HAVE_IO_URING)
+	struct eloop_event *e;
+
+	assert(eloop != NULL);
+	/* The rings are shared with our parent, so make our own. */
+	eloop_uring_close(eloop);
+	if (eloop_open(eloop) == -1)
+		return -1;
+
+	TAILQ_FOREACH(e, &eloop->events, next) {
+		if (e->fd == -1)
+			continue;
+		e->uring_armed = false;
+		if (eloop_uring_arm(eloop, e) == -1)
+			return -1;
+	}
+	return 0;
+#elif defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
 	struct eloop_event *e;
 #if defined(HAVE_KQUEUE)
 	struct kevent *pfds, *pfd;
@@ -679,6 +1419,10 @@ eloop_forked(struct eloop *eloop)
 
 	assert(eloop != NULL);
 #if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+#ifdef ELOOP_TIMERFD
+	/* The timer is shared with our parent, so make our own. */
+	eloop_timerfd_close(eloop);
+#endif
 	if (eloop->fd != -1)
 		close(eloop->fd);
 	if (eloop_open(eloop) == -1)
@@ -740,7 +1484,10 @@ eloop_forked(struct eloop *eloop)
 int
 eloop_open(struct eloop *eloop)
 {
-#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+#if defined(HAVE_IO_URING)
+	assert(eloop != NULL);
+	return eloop_uring_open(eloop);
+#elif defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
 	int fd;
 
 	assert(eloop != NULL);
@@ -762,6 +1509,13 @@ eloop_open(struct eloop *eloop)
 #endif
 
 	eloop->fd = fd;
+#ifdef ELOOP_TIMERFD
+	if (fd != -1 && eloop_timerfd_open(eloop) == -1) {
+		close(fd);
+		eloop->fd = -1;
+		return -1;
+	}
+#endif
 	return fd;
 #else
 	UNUSED(eloop);
@@ -870,28 +1624,172 @@ eloop_signal_mask(struct eloop *eloop, sigset_t *oldset)
 	return 0;
 }
 
+#ifdef ELOOP_STATS
+static void
+eloop_stats_add(struct eloop *eloop, int type, uintptr_t callback,
+    const struct timespec *start)
+{
+	struct timespec now;
+	struct stat_head *head;
+	struct eloop_stat *st;
+	unsigned long long secs, usec;
+	unsigned int nsecs;
+	size_t bucket;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = eloop_timespec_diff(&now, start, &nsecs);
+	usec = secs * 1000000ULL + nsecs / 1000;
+
+	head = &eloop->stats[eloop_hashptr(callback) &
+	    (ELOOP_STATS_HASHLEN - 1)];
+	TAILQ_FOREACH(st, head, next) {
+		if (st->callback == callback && st->type == type)
+			break;
+	}
+	if (st == NULL) {
+		/* Statistics are best effort, so just drop on failure. */
+		st = calloc(1, sizeof(*st));
+		if (st == NULL)
+			return;
+		st->callback = callback;
+		st->type = type;
+		TAILQ_INSERT_HEAD(head, st, next);
+		eloop->nstats++;
+	}
+
+	for (bucket = 0; usec >> bucket != 0 &&
+	    bucket < ELOOP_STATS_NHIST - 1; bucket++)
+		;
+	st->count++;
+	st->total_usec += usec;
+	if (usec > st->max_usec)
+		st->max_usec = usec;
+	st->hist[bucket]++;
+}
+
+static void
+eloop_stats_free(struct eloop *eloop)
+{
+	struct eloop_stat *st;
+	size_t i;
+
+	for (i = 0; i < ELOOP_STATS_HASHLEN; i++) {
+		while ((st = TAILQ_FIRST(&eloop->stats[i]))) {
+			TAILQ_REMOVE(&eloop->stats[i], st, next);
+			free(st);
+		}
+	}
+	eloop->nstats = 0;
+}
+
+__printflike(4, 5) static int
+eloop_stats_printf(char *buf, size_t len, size_t *pos, const char *fmt, ...)
+{
+	va_list va;
+	int n;
+
+	va_start(va, fmt);
+	if (*pos < len)
+		n = vsnprintf(buf + *pos, len - *pos, fmt, va);
+	else
+		n = vsnprintf(NULL, 0, fmt, va);
+	va_end(va);
+	if (n == -1)
+		return -1;
+	*pos += (size_t)n;
+	return 0;
+}
+
+/*
+ * Write the statistics to buf as NUL separated key=value pairs,
+ * like a script environment.
+ * Returns the length required, which is more than len when the
+ * statistics did not fit.
+ */
+ssize_t
+eloop_stats_format(const struct eloop *eloop, char *buf, size_t len)
+{
+	const struct eloop_stat *st;
+	size_t i, j, n, idx, pos = 0;
+
+#define	STATPF(...)							      \
+	do {								      \
+		if (eloop_stats_printf(buf, len, &pos, __VA_ARGS__) == -1)   \
+			return -1;					      \
+	} while (0 /* CONSTCOND */)
+
+	STATPF("eloop_stats=%zu", eloop->nstats);
+	pos++;
+	for (i = 0, idx = 0; i < ELOOP_STATS_HASHLEN; i++) {
+		TAILQ_FOREACH(st, &eloop->stats[i], next) {
+			STATPF("eloop_stat%zu_type=%s", idx,
+			    st->type == ELOOP_STAT_EVENT ? "event" : "timeout");
+			pos++;
+			STATPF("eloop_stat%zu_callback=0x%" PRIxPTR, idx,
+			    st->callback);
+			pos++;
+			STATPF("eloop_stat%zu_count=%llu", idx, st->count);
+			pos++;
+			STATPF("eloop_stat%zu_total_usec=%llu", idx,
+			    st->total_usec);
+			pos++;
+			STATPF("eloop_stat%zu_max_usec=%llu", idx,
+			    st->max_usec);
+			pos++;
+			/* Trailing empty buckets are omitted. */
+			for (n = ELOOP_STATS_NHIST; n > 1; n--) {
+				if (st->hist[n - 1] != 0)
+					break;
+			}
+			STATPF("eloop_stat%zu_histogram=%llu",
+			    idx, st->hist[0]);
+			for (j = 1; j < n; j++)
+				STATPF(" %llu", st->hist[j]);
+			pos++;
+			idx++;
+		}
+	}
+#undef STATPF
+
+	if (pos > SSIZE_MAX) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	return (ssize_t)pos;
+}
+#endif
+
 struct eloop *
 eloop_new(void)
 {
 	struct eloop *eloop;
+#ifdef ELOOP_STATS
+	size_t i;
+#endif
 
 	eloop = calloc(1, sizeof(*eloop));
 	if (eloop == NULL)
 		return NULL;
 
 	/* Check we have a working monotonic clock. */
-	if (clock_gettime(CLOCK_MONOTONIC, &eloop->now) == -1) {
+	if (clock_gettime(CLOCK_MONOTONIC, &eloop->epoch) == -1) {
 		free(eloop);
 		return NULL;
 	}
 
 	TAILQ_INIT(&eloop->events);
 	TAILQ_INIT(&eloop->free_events);
-	TAILQ_INIT(&eloop->timeouts);
 	TAILQ_INIT(&eloop->free_timeouts);
+#ifdef ELOOP_STATS
+	for (i = 0; i < ELOOP_STATS_HASHLEN; i++)
+		TAILQ_INIT(&eloop->stats[i]);
+#endif
 	eloop->exitcode = EXIT_FAILURE;
+#ifdef ELOOP_TIMERFD
+	eloop->timerfd = -1;
+#endif
 
-#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL) || defined(HAVE_IO_URING)
 	if (eloop_open(eloop) == -1) {
 		eloop_free(eloop);
 		return NULL;
@@ -912,6 +1810,10 @@ eloop_clear(struct eloop *eloop, ...)
 	if (eloop == NULL)
 		return;
 
+	if (eloop->fdtable_len != 0)
+		memset(eloop->fdtable, 0,
+		    eloop->fdtable_len * sizeof(*eloop->fdtable));
+
 	va_start(va1, eloop);
 	TAILQ_FOREACH_SAFE(e, &eloop->events, next, ne) {
 		va_copy(va2, va1);
@@ -919,8 +1821,10 @@ eloop_clear(struct eloop *eloop, ...)
 			except_fd = va_arg(va2, int);
 		while (except_fd != -1 && except_fd != e->fd);
 		va_end(va2);
-		if (e->fd == except_fd && e->fd != -1)
+		if (e->fd == except_fd && e->fd != -1) {
+			eloop->fdtable[e->fd] = e;
 			continue;
+		}
 		TAILQ_REMOVE(&eloop->events, e, next);
 		if (e->fd != -1) {
 			close(e->fd);
@@ -944,14 +1848,22 @@ eloop_clear(struct eloop *eloop, ...)
 		TAILQ_REMOVE(&eloop->free_events, e, next);
 		free(e);
 	}
-	while ((t = TAILQ_FIRST(&eloop->timeouts))) {
-		TAILQ_REMOVE(&eloop->timeouts, t, next);
-		free(t);
-	}
+	while (eloop->ntimeouts != 0)
+		free(eloop->timeouts[--eloop->ntimeouts]);
+	free(eloop->timeouts);
+	eloop->timeouts = NULL;
+	eloop->timeouts_len = 0;
+	free(eloop->timeout_hash);
+	free(eloop->timeout_arghash);
+	eloop->timeout_hash = eloop->timeout_arghash = NULL;
+	eloop->timeout_hashlen = 0;
 	while ((t = TAILQ_FIRST(&eloop->free_timeouts))) {
 		TAILQ_REMOVE(&eloop->free_timeouts, t, next);
 		free(t);
 	}
+#ifdef ELOOP_STATS
+	eloop_stats_free(eloop);
+#endif
 	eloop->cleared = true;
 }
 
@@ -960,13 +1872,55 @@ eloop_free(struct eloop *eloop)
 {
 
 	eloop_clear(eloop, -1);
-#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+	if (eloop != NULL)
+		free(eloop->fdtable);
+#if defined(HAVE_IO_URING)
+	if (eloop != NULL)
+		eloop_uring_close(eloop);
+#elif defined(HAVE_KQUEUE) || defined(HAVE_EPOLL)
+#ifdef ELOOP_TIMERFD
+	if (eloop != NULL)
+		eloop_timerfd_close(eloop);
+#endif
 	if (eloop != NULL && eloop->fd != -1)
 		close(eloop->fd);
 #endif
 	free(eloop);
 }
 
+static void
+eloop_event_dispatch(struct eloop *eloop, struct eloop_event *e,
+    unsigned short events)
+{
+#ifdef ELOOP_STATS
+	struct timespec start;
+	uintptr_t callback = (uintptr_t)e->cb;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	e->cb(e->cb_arg, events);
+	eloop_stats_add(eloop, ELOOP_STAT_EVENT, callback, &start);
+#else
+	UNUSED(eloop);
+	e->cb(e->cb_arg, events);
+#endif
+}
+
+static void
+eloop_timeout_dispatch(struct eloop *eloop, struct eloop_timeout *t)
+{
+#ifdef ELOOP_STATS
+	struct timespec start;
+	uintptr_t callback = (uintptr_t)t->callback;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	t->callback(t->arg);
+	eloop_stats_add(eloop, ELOOP_STAT_TIMEOUT, callback, &start);
+#else
+	UNUSED(eloop);
+	t->callback(t->arg);
+#endif
+}
+
 #if defined(HAVE_KQUEUE)
 static int
 eloop_run_kqueue(struct eloop *eloop, const struct timespec *ts)
@@ -1007,7 +1961,7 @@ eloop_run_kqueue(struct eloop *eloop, const struct timespec *ts)
 			events |= ELE_HANGUP;
 		if (ke->flags & EV_ERROR)
 			events |= ELE_ERROR;
-		e->cb(e->cb_arg, events);
+		eloop_event_dispatch(eloop, e, events);
 	}
 	return n;
 }
@@ -1018,7 +1972,7 @@ static int
 eloop_run_epoll(struct eloop *eloop,
     const struct timespec *ts, const sigset_t *signals)
 {
-	int timeout, n, nn;
+	int timeout, maxevents, n, nn;
 	struct epoll_event *epe;
 	struct eloop_event *e;
 	unsigned short events;
@@ -1034,12 +1988,18 @@ eloop_run_epoll(struct eloop *eloop,
 	} else
 		timeout = -1;
 
+#ifdef ELOOP_TIMERFD
+	/* The buffer has room for the timer as well. */
+	maxevents = (int)eloop->nfds;
+#else
+	maxevents = (int)eloop->nevents;
+#endif
 	if (signals != NULL)
 		n = epoll_pwait(eloop->fd, eloop->fds,
-		    (int)eloop->nevents, timeout, signals);
+		    maxevents, timeout, signals);
 	else
 		n = epoll_wait(eloop->fd, eloop->fds,
-		    (int)eloop->nevents, timeout);
+		    maxevents, timeout);
 	if (n == -1)
 		return -1;
 
@@ -1047,6 +2007,18 @@ eloop_run_epoll(struct eloop *eloop,
 		if (eloop->cleared || eloop->exitnow)
 			break;
 		e = (struct eloop_event *)epe->data.ptr;
+#ifdef ELOOP_TIMERFD
+		if (e == NULL) {
+			uint64_t expirations;
+
+			/* Expired timeouts are run from eloop_start. */
+			if (read(eloop->timerfd, &expirations,
+			    sizeof(expirations)) == -1 && errno != EAGAIN)
+				return -1;
+			eloop->timerfd_armed = false;
+			continue;
+		}
+#endif
 		if (e->fd == -1)
 			continue;
 		events = 0;
@@ -1058,11 +2030,87 @@ eloop_run_epoll(struct eloop *eloop,
 			events |= ELE_HANGUP;
 		if (epe->events & EPOLLERR)
 			events |= ELE_ERROR;
-		e->cb(e->cb_arg, events);
+		eloop_event_dispatch(eloop, e, events);
 	}
 	return n;
 }
 
+#elif defined(HAVE_IO_URING)
+
+static int
+eloop_run_uring(struct eloop *eloop,
+    const struct timespec *ts, const sigset_t *signals)
+{
+	struct eloop_uring *u = &eloop->uring;
+	struct io_uring_cqe *cqe;
+	struct eloop_event *e;
+	unsigned int head, tail, n, nn;
+	unsigned short events;
+	uint64_t data;
+
+	/* Submit any pending requests and wait for a completion. */
+	if (eloop_uring_enter(eloop, 1, ts, signals) == -1) {
+		if (errno == ETIME)
+			return 0;
+		return -1;
+	}
+
+	/* Copy the completions out as callbacks can submit more. */
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (n = 0; head != tail && n < eloop->nfds; head++, n++)
+		eloop->fds[n] = u->cqes[head & *u->cq_mask];
+	if (eloop->nfds == 0)
+		head = tail;
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	for (nn = 0, cqe = eloop->fds; nn < n; nn++, cqe++) {
+		data = cqe->user_data;
+		if (data == ELOOP_URING_IGNORE)
+			continue;
+		e = eloop_event_find(eloop, (int)(data >> 32));
+		if (e == NULL || e->uring_gen != (uint32_t)data)
+			continue;
+		e->uring_armed = false;
+		if (cqe->res == -ECANCELED)
+			continue;
+
+		if (eloop->cleared || eloop->exitnow) {
+			/* Re-arm what we won't dispatch. */
+			eloop_uring_arm(eloop, e);
+			continue;
+		}
+
+		events = 0;
+		if (cqe->res < 0) {
+			if (cqe->res == -EBADF)
+				events |= ELE_NVAL;
+			else
+				events |= ELE_ERROR;
+		} else {
+			if (cqe->res & POLLIN)
+				events |= ELE_READ;
+			if (cqe->res & POLLOUT)
+				events |= ELE_WRITE;
+			if (cqe->res & POLLHUP)
+				events |= ELE_HANGUP;
+			if (cqe->res & POLLERR)
+				events |= ELE_ERROR;
+			if (cqe->res & POLLNVAL)
+				events |= ELE_NVAL;
+		}
+		if (events)
+			eloop_event_dispatch(eloop, e, events);
+
+		/* Re-arm unless the callback changed or removed it. */
+		if (cqe->res >= 0 && !eloop->cleared &&
+		    eloop_event_find(eloop, (int)(data >> 32)) == e &&
+		    e->uring_gen == (uint32_t)data && !e->uring_armed)
+			eloop_uring_arm(eloop, e);
+	}
+	return (int)n;
+}
+
 #elif defined(HAVE_PPOLL)
 
 static int
@@ -1099,7 +2147,7 @@ eloop_run_ppoll(struct eloop *eloop,
 			if (pfd->revents & POLLNVAL)
 				events |= ELE_NVAL;
 			if (events)
-				e->cb(e->cb_arg, events);
+				eloop_event_dispatch(eloop, e, events);
 		}
 		if (nn == 0)
 			break;
@@ -1152,7 +2200,7 @@ eloop_run_pselect(struct eloop *eloop,
 		if (FD_ISSET(e->fd, &write_fds))
 			events |= ELE_WRITE;
 		if (events)
-			e->cb(e->cb_arg, events);
+			eloop_event_dispatch(eloop, e, events);
 	}
 
 	return n;
@@ -1164,7 +2212,12 @@ eloop_start(struct eloop *eloop, sigset_t *signals)
 {
 	int error;
 	struct eloop_timeout *t;
-	struct timespec ts, *tsp;
+#ifndef ELOOP_TIMERFD
+	struct timespec ts;
+#endif
+	struct timespec *tsp;
+	unsigned long long secs;
+	unsigned int nsecs;
 
 	assert(eloop != NULL);
 #ifdef HAVE_KQUEUE
@@ -1185,31 +2238,49 @@ eloop_start(struct eloop *eloop, sigset_t *signals)
 		}
 #endif
 
-		t = TAILQ_FIRST(&eloop->timeouts);
+		t = eloop->ntimeouts != 0 ? eloop->timeouts[0] : NULL;
 		if (t == NULL && eloop->nevents == 0)
 			break;
 
-		if (t != NULL)
-			eloop_reduce_timers(eloop);
-
-		if (t != NULL && t->seconds == 0 && t->nseconds == 0) {
-			TAILQ_REMOVE(&eloop->timeouts, t, next);
-			t->callback(t->arg);
-			TAILQ_INSERT_TAIL(&eloop->free_timeouts, t, next);
-			continue;
-		}
-
 		if (t != NULL) {
-			if (t->seconds > INT_MAX) {
+			eloop_getnow(eloop, &secs, &nsecs);
+			if (t->seconds < secs ||
+			    (t->seconds == secs && t->nseconds <= nsecs))
+			{
+				eloop_timeout_remove(eloop, t);
+				eloop_timeout_dispatch(eloop, t);
+				TAILQ_INSERT_TAIL(&eloop->free_timeouts,
+				    t, next);
+				continue;
+			}
+
+#ifdef ELOOP_TIMERFD
+			if (eloop_timerfd_arm(eloop, t) == -1)
+				return -errno;
+			tsp = NULL;
+#else
+			secs = t->seconds - secs;
+			if (t->nseconds < nsecs) {
+				secs--;
+				nsecs = NSEC_PER_SEC - (nsecs - t->nseconds);
+			} else
+				nsecs = t->nseconds - nsecs;
+			if (secs > INT_MAX) {
 				ts.tv_sec = (time_t)INT_MAX;
 				ts.tv_nsec = 0;
 			} else {
-				ts.tv_sec = (time_t)t->seconds;
-				ts.tv_nsec = (long)t->nseconds;
+				ts.tv_sec = (time_t)secs;
+				ts.tv_nsec = (long)nsecs;
 			}
 			tsp = &ts;
-		} else
+#endif
+		} else {
+#ifdef ELOOP_TIMERFD
+			if (eloop_timerfd_disarm(eloop) == -1)
+				return -errno;
+#endif
 			tsp = NULL;
+		}
 
 		eloop->cleared = false;
 		if (eloop->events_need_setup)
@@ -1218,6 +2289,8 @@ eloop_start(struct eloop *eloop, sigset_t *signals)
 #if defined(HAVE_KQUEUE)
 		UNUSED(signals);
 		error = eloop_run_kqueue(eloop, tsp);
+#elif defined(HAVE_IO_URING)
+		error = eloop_run_uring(eloop, tsp, signals);
 #elif defined(HAVE_EPOLL)
 		error = eloop_run_epoll(eloop, tsp, signals);
 #elif defined(HAVE_PPOLL)
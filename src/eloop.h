@@ -29,6 +29,8 @@
 #ifndef ELOOP_H
 #define ELOOP_H
 
+#include <sys/types.h>
+
 #include <time.h>
 
 /* Handy macros to create subsecond timeouts */
@@ -49,6 +51,11 @@
 /* Used for deleting a timeout for all queues. */
 #define	ELOOP_QUEUE_ALL	0
 
+/* Record dispatch statistics for each callback. */
+#if !defined(SMALL) && !defined(ELOOP_STATS)
+#define	ELOOP_STATS
+#endif
+
 /* Forward declare eloop - the content should be invisible to the outside */
 struct eloop;
 
@@ -69,6 +76,9 @@ unsigned long long eloop_timespec_diff(const struct timespec *tsp,
     eloop_q_timeout_add_tv((eloop), ELOOP_QUEUE, (tv), (cb), (ctx))
 #define eloop_timeout_add_sec(eloop, tv, cb, ctx) \
     eloop_q_timeout_add_sec((eloop), ELOOP_QUEUE, (tv), (cb), (ctx))
+#define eloop_timeout_add_sec_slack(eloop, tv, slack, limit, cb, ctx) \
+    eloop_q_timeout_add_sec_slack((eloop), ELOOP_QUEUE, (tv), (slack), \
+    (limit), (cb), (ctx))
 #define eloop_timeout_add_msec(eloop, ms, cb, ctx) \
     eloop_q_timeout_add_msec((eloop), ELOOP_QUEUE, (ms), (cb), (ctx))
 #define eloop_timeout_delete(eloop, cb, ctx) \
@@ -77,10 +87,16 @@ int eloop_q_timeout_add_tv(struct eloop *, int,
     const struct timespec *, void (*)(void *), void *);
 int eloop_q_timeout_add_sec(struct eloop *, int,
     unsigned int, void (*)(void *), void *);
+int eloop_q_timeout_add_sec_slack(struct eloop *, int,
+    unsigned int, unsigned int, unsigned int, void (*)(void *), void *);
 int eloop_q_timeout_add_msec(struct eloop *, int,
     unsigned long, void (*)(void *), void *);
 int eloop_q_timeout_delete(struct eloop *, int, void (*)(void *), void *);
 
+#ifdef ELOOP_STATS
+ssize_t eloop_stats_format(const struct eloop *, char *, size_t);
+#endif
+
 int eloop_signal_set_cb(struct eloop *, const int *, size_t,
     void (*)(int, void *), void *);
 int eloop_signal_mask(struct eloop *, sigset_t *oldset);
@@ -0,0 +1,325 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcp.h"
+#include "dhcp6.h"
+#include "dhcp-common.h"
+#include "dhcpcd.h"
+#include "eloop.h"
+#include "handoff.h"
+#include "ipv6nd.h"
+#include "logerr.h"
+
+/*
+ * The handoff file holds whole messages as they were received, so
+ * resuming them goes through the same validation as a lease file.
+ * It is only ever read by the dhcpcd which replaces the one that wrote
+ * it on the same host, so it is in host byte order.
+ * Ages are written rather than times so the monotonic clock of the
+ * old process does not matter; the time between writing and reading
+ * is added from the wall clock.
+ */
+#define	HANDOFF_MAGIC		0x64686f31	/* dho1 */
+/* Fits a privilege separation message. */
+#define	HANDOFF_MAX		(64 * 1024)
+
+struct handoff_hdr {
+	uint32_t hh_magic;
+	uint32_t hh_nmsgs;
+	int64_t hh_written;	/* time(3) */
+	uint8_t hh_hwlen;
+	uint8_t hh_hwaddr[HWADDR_LEN];
+};
+
+struct handoff_rec {
+	uint32_t hr_type;
+	uint32_t hr_age;	/* seconds */
+	struct in6_addr hr_from;
+	uint32_t hr_len;
+};
+
+/* A message which does not fit is left out, the rest are still useful. */
+static int
+handoff_add(const char *ifname, uint8_t *buf, size_t *len, int type,
+    const struct timespec *now, const struct timespec *acquired,
+    const struct in6_addr *from, const void *data, size_t dlen)
+{
+	struct handoff_rec hr = { .hr_type = (uint32_t)type };
+
+	if (*len + sizeof(hr) > HANDOFF_MAX ||
+	    dlen > HANDOFF_MAX - sizeof(hr) - *len)
+	{
+		logwarnx("%s: no room to hand off a %zu byte message",
+		    ifname, dlen);
+		return -1;
+	}
+	hr.hr_age = (uint32_t)eloop_timespec_diff(now, acquired, NULL);
+	if (from != NULL)
+		hr.hr_from = *from;
+	hr.hr_len = (uint32_t)dlen;
+	memcpy(buf + *len, &hr, sizeof(hr));
+	memcpy(buf + *len + sizeof(hr), data, dlen);
+	*len += sizeof(hr) + dlen;
+	return 0;
+}
+
+/* Write what we have learned for the interface for the next dhcpcd. */
+int
+handoff_save(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	char file[sizeof(HANDOFFFILE) + IF_NAMESIZE];
+	struct handoff_hdr hh = { .hh_magic = HANDOFF_MAGIC };
+	struct timespec now;
+	uint8_t *buf;
+	size_t len;
+#ifdef INET
+	const struct dhcp_state *state;
+#endif
+#ifdef DHCP6
+	const struct dhcp6_state *state6;
+#endif
+#ifdef INET6
+	const struct ra *rap;
+#endif
+
+	snprintf(file, sizeof(file), HANDOFFFILE, ifp->name);
+	if ((buf = malloc(HANDOFF_MAX)) == NULL)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	len = sizeof(hh);
+
+#ifdef INET
+	state = D_CSTATE(ifp);
+	if (state != NULL && state->state == DHS_BOUND &&
+	    state->new != NULL && IS_DHCP(state->new) &&
+	    state->added & STATE_ADDED && !(state->added & STATE_FAKE))
+	{
+		if (handoff_add(ifp->name, buf, &len, HANDOFF_DHCP, &now,
+		    &state->bound, NULL, state->new, state->new_len) == 0)
+			hh.hh_nmsgs++;
+	}
+#endif
+
+#ifdef DHCP6
+	state6 = D6_CSTATE(ifp);
+	if (state6 != NULL && state6->new != NULL &&
+	    (state6->state == DH6S_BOUND ||
+	    state6->state == DH6S_RENEW ||
+	    state6->state == DH6S_REBIND))
+	{
+		if (handoff_add(ifp->name, buf, &len, HANDOFF_DHCP6, &now,
+		    &state6->acquired, NULL, state6->new,
+		    state6->new_len) == 0)
+			hh.hh_nmsgs++;
+	}
+#endif
+
+#ifdef INET6
+	if (ctx->ra_routers != NULL) {
+		TAILQ_FOREACH(rap, ctx->ra_routers, next) {
+			if (rap->iface != ifp || rap->expired)
+				continue;
+			if (handoff_add(ifp->name, buf, &len, HANDOFF_RA,
+			    &now, &rap->acquired, &rap->from,
+			    rap->data, rap->data_len) == 0)
+				hh.hh_nmsgs++;
+		}
+	}
+#endif
+
+	if (hh.hh_nmsgs == 0) {
+		/* Don't let the next dhcpcd find an older one. */
+		if (dhcp_unlink(ctx, file) == -1 && errno != ENOENT)
+			logerr("%s: %s", __func__, file);
+		free(buf);
+		return 0;
+	}
+
+	hh.hh_written = (int64_t)time(NULL);
+	hh.hh_hwlen = ifp->hwlen;
+	memcpy(hh.hh_hwaddr, ifp->hwaddr, sizeof(hh.hh_hwaddr));
+	memcpy(buf, &hh, sizeof(hh));
+	logdebugx("%s: writing handoff: %s", ifp->name, file);
+	if (dhcp_writefile(ctx, file, 0600, buf, len) == -1)
+		goto err;
+	free(buf);
+	return (int)hh.hh_nmsgs;
+
+err:
+	logerr("%s: %s", __func__, file);
+	free(buf);
+	return -1;
+}
+
+/* Read what the last dhcpcd left for the interface.
+ * The file is removed so it can only be resumed once. */
+int
+handoff_load(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	char file[sizeof(HANDOFFFILE) + IF_NAMESIZE];
+	struct handoff *ho;
+	struct handoff_hdr hh;
+	struct handoff_rec hr;
+	struct handoff_msg *hm;
+	struct timespec now;
+	ssize_t bytes;
+	size_t len, i;
+	time_t gap;
+
+	if (!ctx->warm_restart)
+		return 0;
+
+	handoff_free(ifp);
+	snprintf(file, sizeof(file), HANDOFFFILE, ifp->name);
+	if ((ho = calloc(1, sizeof(*ho))) == NULL ||
+	    (ho->buf = malloc(HANDOFF_MAX)) == NULL)
+		goto err;
+	bytes = dhcp_readfile(ctx, file, ho->buf, HANDOFF_MAX);
+	if (bytes == -1) {
+		if (errno == ENOENT) {
+			free(ho->buf);
+			free(ho);
+			return 0;
+		}
+		goto err;
+	}
+	if (dhcp_unlink(ctx, file) == -1)
+		logerr("%s: %s", __func__, file);
+
+	len = (size_t)bytes;
+	if (len < sizeof(hh))
+		goto invalid;
+	memcpy(&hh, ho->buf, sizeof(hh));
+	if (hh.hh_magic != HANDOFF_MAGIC || hh.hh_nmsgs == 0 ||
+	    hh.hh_nmsgs > HANDOFF_MAX / sizeof(hr))
+		goto invalid;
+	if (hh.hh_hwlen != ifp->hwlen ||
+	    memcmp(hh.hh_hwaddr, ifp->hwaddr, ifp->hwlen) != 0)
+	{
+		logwarnx("%s: hardware address changed, not resuming",
+		    ifp->name);
+		goto discard;
+	}
+
+	ho->msgs = calloc(hh.hh_nmsgs, sizeof(*ho->msgs));
+	if (ho->msgs == NULL)
+		goto err;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	gap = time(NULL) - (time_t)hh.hh_written;
+	if (gap < 0)
+		gap = 0;
+
+	len -= sizeof(hh);
+	for (i = 0; i < hh.hh_nmsgs; i++) {
+		if (len < sizeof(hr))
+			goto invalid;
+		memcpy(&hr, ho->buf + (size_t)bytes - len, sizeof(hr));
+		len -= sizeof(hr);
+		if (hr.hr_len > len)
+			goto invalid;
+		hm = &ho->msgs[i];
+		hm->type = (int)hr.hr_type;
+		hm->acquired = now;
+		hm->acquired.tv_sec -= (time_t)hr.hr_age + gap;
+		hm->from = hr.hr_from;
+		hm->data = ho->buf + (size_t)bytes - len;
+		hm->len = hr.hr_len;
+		len -= hr.hr_len;
+	}
+	ho->nmsgs = hh.hh_nmsgs;
+	ifp->handoff = ho;
+	loginfox("%s: resuming from handoff", ifp->name);
+	return 1;
+
+invalid:
+	logerrx("%s: %s: invalid handoff", ifp->name, file);
+discard:
+	errno = EINVAL;
+	free(ho->msgs);
+	free(ho->buf);
+	free(ho);
+	return -1;
+
+err:
+	logerr("%s: %s", __func__, file);
+	if (ho != NULL) {
+		free(ho->buf);
+		free(ho);
+	}
+	return -1;
+}
+
+/* Find the next message of type after prev, or the first if NULL. */
+const struct handoff_msg *
+handoff_find(const struct interface *ifp, int type,
+    const struct handoff_msg *prev)
+{
+	const struct handoff *ho = ifp->handoff;
+	size_t i;
+
+	if (ho == NULL)
+		return NULL;
+	i = prev == NULL ? 0 : (size_t)(prev - ho->msgs) + 1;
+	for (; i < ho->nmsgs; i++) {
+		if (ho->msgs[i].type == type)
+			return &ho->msgs[i];
+	}
+	return NULL;
+}
+
+/* The interface has started, so anything not resumed by now is stale. */
+void
+handoff_done(struct interface *ifp)
+{
+
+	if (ifp->handoff != NULL && !ifp->handoff->held)
+		handoff_free(ifp);
+}
+
+void
+handoff_free(struct interface *ifp)
+{
+	struct handoff *ho = ifp->handoff;
+
+	if (ho == NULL)
+		return;
+	free(ho->msgs);
+	free(ho->buf);
+	free(ho);
+	ifp->handoff = NULL;
+}
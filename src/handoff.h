@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <netinet/in.h>
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "dhcpcd.h"
+
+/*
+ * With warm_restart, an exiting dhcpcd leaves what it has learned for
+ * each interface in a handoff file and the addresses and routes in the
+ * kernel. The next dhcpcd resumes the DHCP, DHCPv6 and Router
+ * Advertisement messages from it instead of asking the network again,
+ * without running the script.
+ */
+#define	HANDOFF_DHCP		1
+#define	HANDOFF_DHCP6		2
+#define	HANDOFF_RA		3
+
+struct handoff_msg {
+	int type;
+	struct timespec acquired;	/* CLOCK_MONOTONIC */
+	struct in6_addr from;		/* Router Advertisements */
+	void *data;
+	size_t len;
+};
+
+struct handoff {
+	uint8_t *buf;
+	struct handoff_msg *msgs;
+	size_t nmsgs;
+	bool held;	/* resumed from the event loop, see ipv6nd_startrs */
+};
+
+int handoff_save(struct interface *);
+int handoff_load(struct interface *);
+const struct handoff_msg *handoff_find(const struct interface *, int,
+    const struct handoff_msg *);
+void handoff_done(struct interface *);
+void handoff_free(struct interface *);
+
+#endif
@@ -0,0 +1,979 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcpcd.h"
+#include "hooks.h"
+#include "logerr.h"
+#include "script.h"
+
+/*
+ * 20-resolv.conf and 30-hostname run for every event.
+ * Each time, they read the per interface files they keep in the
+ * hook-state directory and rebuild /etc/resolv.conf from them.
+ * These are the same hooks built into dhcpcd.
+ * They read the environment the script would be given, in the
+ * privileged process when privilege separation is on.
+ * The resolv.conf lines for each interface are kept in memory, and the
+ * file is only written when they change.
+ * Only /etc/resolv.conf is written; resolvconf(8) is not supported, so
+ * leave the 20-resolv.conf hook to it.
+ */
+
+#define	HOOKS_SIGNATURE		"# Generated by dhcpcd"
+
+#ifndef DEFAULT_HOSTNAME
+#ifdef __linux__
+#define	DEFAULT_HOSTNAME	"(none)"
+#else
+#define	DEFAULT_HOSTNAME	""
+#endif
+#endif
+
+/* resolv.conf lines for interface.protocol, as 20-resolv.conf
+ * would keep in hook-state/resolv.conf/interface.protocol */
+struct hooks_resolv {
+	TAILQ_ENTRY(hooks_resolv) next;
+	char name[IF_NAMESIZE + 16];
+	char *conf;
+	bool done;
+};
+
+struct hooks_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static const struct {
+	const char *name;
+	unsigned int hook;
+} hooks_names[] = {
+	{ "resolv.conf", HOOK_RESOLV_CONF },
+	{ "hostname", HOOK_HOSTNAME },
+};
+
+/* Parse a list of hook names for builtin_hook. */
+int
+hooks_parse(unsigned int *hooks, const char *arg)
+{
+	const char *p;
+	size_t i, len;
+
+	for (p = arg; *p != '\0'; p += len) {
+		p += strspn(p, ", ");
+		len = strcspn(p, ", ");
+		if (len == 0)
+			continue;
+		for (i = 0; i < __arraycount(hooks_names); i++) {
+			if (strlen(hooks_names[i].name) == len &&
+			    strncmp(hooks_names[i].name, p, len) == 0)
+				break;
+		}
+		if (i == __arraycount(hooks_names)) {
+			logerrx("unknown builtin_hook %.*s", (int)len, p);
+			return -1;
+		}
+		*hooks |= hooks_names[i].hook;
+	}
+	return 0;
+}
+
+/* Write skip_hooks to the environment, adding the hooks we run. */
+int
+hooks_skip(const struct dhcpcd_ctx *ctx, FILE *fp, const char *skip)
+{
+	bool sep;
+	size_t i;
+
+	if (skip == NULL)
+		skip = "";
+	if (fprintf(fp, "skip_hooks=%s", skip) == -1)
+		return -1;
+	sep = *skip != '\0';
+	for (i = 0; i < __arraycount(hooks_names); i++) {
+		if (!(ctx->builtin_hooks & hooks_names[i].hook))
+			continue;
+		if (fprintf(fp, "%s%s", sep ? " " : "",
+		    hooks_names[i].name) == -1)
+			return -1;
+		sep = true;
+	}
+	return fputc('\0', fp) == EOF ? -1 : 0;
+}
+
+static const char *
+hooks_findenv(const char *env, size_t len, const char *var)
+{
+	const char *ep = env + len;
+	size_t vlen = strlen(var);
+
+	for (; env < ep; env += strlen(env) + 1) {
+		if (strncmp(env, var, vlen) == 0 && env[vlen] == '=')
+			return env + vlen + 1;
+	}
+	return NULL;
+}
+
+/* Like the hooks, treat an empty variable as unset. */
+static const char *
+hooks_getenv(const char *env, size_t len, const char *var)
+{
+	const char *val;
+
+	val = hooks_findenv(env, len, var);
+	return val == NULL || *val == '\0' ? NULL : val;
+}
+
+static bool
+hooks_istrue(const char *val)
+{
+
+	return val != NULL &&
+	    (strcasecmp(val, "yes") == 0 || strcasecmp(val, "true") == 0 ||
+	    strcmp(val, "1") == 0);
+}
+
+static __printflike(2, 3) int
+hooks_printf(struct hooks_buf *hb, const char *fmt, ...)
+{
+	va_list va;
+	int len;
+	size_t size;
+	char *nb;
+
+	va_start(va, fmt);
+	len = vsnprintf(hb->buf + hb->len, hb->size - hb->len, fmt, va);
+	va_end(va);
+	if (len < 0)
+		return -1;
+	if ((size_t)len < hb->size - hb->len) {
+		hb->len += (size_t)len;
+		return len;
+	}
+
+	size = hb->len + (size_t)len + 1;
+	if (size < hb->size * 2)
+		size = hb->size * 2;
+	nb = realloc(hb->buf, size);
+	if (nb == NULL)
+		return -1;
+	hb->buf = nb;
+	hb->size = size;
+	va_start(va, fmt);
+	len = vsnprintf(hb->buf + hb->len, hb->size - hb->len, fmt, va);
+	va_end(va);
+	hb->len += (size_t)len;
+	return len;
+}
+
+/* Append the file to hb. */
+static int
+hooks_catfile(struct hooks_buf *hb, const char *file)
+{
+	FILE *fp;
+	char buf[BUFSIZ];
+	size_t len;
+	int err = 0;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+	while ((len = fread(buf, 1, sizeof(buf), fp)) != 0) {
+		if (hooks_printf(hb, "%.*s", (int)len, buf) == -1) {
+			err = -1;
+			break;
+		}
+	}
+	if (ferror(fp))
+		err = -1;
+	fclose(fp);
+	return err;
+}
+
+/* Is the word in the space separated list? */
+static bool
+hooks_hasword(const char *list, const char *word, size_t len)
+{
+	const char *p;
+
+	for (p = list; p != NULL && *p != '\0'; p += strcspn(p, " ")) {
+		p += strspn(p, " ");
+		if (strncmp(p, word, len) == 0 &&
+		    (p[len] == ' ' || p[len] == '\0'))
+			return true;
+	}
+	return false;
+}
+
+/* Append each word not already in hb, like uniqify in the hooks. */
+static int
+hooks_addwords(struct hooks_buf *hb, const char *words)
+{
+	const char *p;
+	size_t len;
+
+	for (p = words; p != NULL && *p != '\0'; p += len) {
+		p += strspn(p, " \t\n");
+		len = strcspn(p, " \t\n");
+		if (len == 0 || hooks_hasword(hb->buf, p, len))
+			continue;
+		if (hooks_printf(hb, "%s%.*s", hb->len == 0 ? "" : " ",
+		    (int)len, p) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* valid_domainname from dhcpcd-run-hooks */
+static bool
+hooks_validdomain(const char *name, size_t len)
+{
+	const char *p, *label;
+	size_t llen;
+
+	if (len == 0 || len > 255)
+		return false;
+	for (p = label = name; ; p++) {
+		if (p == name + len || *p == '.') {
+			llen = (size_t)(p - label);
+			if (llen == 0 || llen > 63 ||
+			    *label == '-' || *label == '_' ||
+			    label[llen - 1] == '-' || label[llen - 1] == '_')
+				return false;
+			if (p == name + len)
+				return true;
+			label = p + 1;
+		} else if (!isalnum((unsigned char)*p) &&
+		    *p != '-' && *p != '_')
+			return false;
+	}
+}
+
+static bool
+hooks_validdomains(const char *names)
+{
+	const char *p;
+	size_t len;
+
+	for (p = names; *p != '\0'; p += len) {
+		p += strspn(p, " ");
+		len = strcspn(p, " ");
+		if (len != 0 && !hooks_validdomain(p, len))
+			return false;
+	}
+	return true;
+}
+
+static bool
+hooks_dhcp6(const char *reason)
+{
+
+	return strcmp(reason, "BOUND6") == 0 ||
+	    strcmp(reason, "RENEW6") == 0 ||
+	    strcmp(reason, "REBIND6") == 0 ||
+	    strcmp(reason, "REBOOT6") == 0 ||
+	    strcmp(reason, "INFORM6") == 0;
+}
+
+/* Add RDNSS and DNSSL options from the RA which have not expired. */
+static int
+hooks_nddns(struct hooks_buf *srv, struct hooks_buf *search,
+    const char *env, size_t len)
+{
+	char var[64];
+	const char *val, *lifetime;
+	long long acquired, now;
+	int i, j;
+
+	for (i = 1; ; i++) {
+		snprintf(var, sizeof(var), "nd%d_acquired", i);
+		if ((val = hooks_getenv(env, len, var)) == NULL)
+			break;
+		acquired = strtoll(val, NULL, 10);
+		snprintf(var, sizeof(var), "nd%d_now", i);
+		if ((val = hooks_getenv(env, len, var)) == NULL)
+			break;
+		now = strtoll(val, NULL, 10);
+
+		for (j = 1; ; j++) {
+			snprintf(var, sizeof(var), "nd%d_rdnss%d_lifetime",
+			    i, j);
+			if ((lifetime = hooks_getenv(env, len, var)) == NULL)
+				break;
+			if (strtoll(lifetime, NULL, 10) - (now - acquired) <= 0)
+				continue;
+			snprintf(var, sizeof(var), "nd%d_rdnss%d_servers",
+			    i, j);
+			if (hooks_addwords(srv,
+			    hooks_getenv(env, len, var)) == -1)
+				return -1;
+		}
+		for (j = 1; ; j++) {
+			snprintf(var, sizeof(var), "nd%d_dnssl%d_lifetime",
+			    i, j);
+			if ((lifetime = hooks_getenv(env, len, var)) == NULL)
+				break;
+			if (strtoll(lifetime, NULL, 10) - (now - acquired) <= 0)
+				continue;
+			snprintf(var, sizeof(var), "nd%d_dnssl%d_search",
+			    i, j);
+			if (hooks_addwords(search,
+			    hooks_getenv(env, len, var)) == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Make the resolv.conf lines for one event as add_resolv_conf does.
+ * Returns NULL with errno 0 if there are none.
+ */
+static char *
+hooks_resolvent(const char *name, const char *reason,
+    const char *env, size_t len)
+{
+	struct hooks_buf conf = { NULL, 0, 0 };
+	struct hooks_buf srv = { NULL, 0, 0 };
+	struct hooks_buf search = { NULL, 0, 0 };
+	const char *domain, *p;
+	size_t dlen;
+	int err;
+
+	if (hooks_dhcp6(reason)) {
+		err = hooks_addwords(&srv,
+		    hooks_getenv(env, len, "new_dhcp6_name_servers"));
+		if (err == 0)
+			err = hooks_addwords(&search,
+			    hooks_getenv(env, len, "new_dhcp6_domain_search"));
+	} else {
+		err = hooks_addwords(&srv,
+		    hooks_getenv(env, len, "new_domain_name_servers"));
+		if (err == 0)
+			err = hooks_addwords(&search,
+			    hooks_getenv(env, len, "new_domain_search"));
+	}
+	if (err == -1 || hooks_nddns(&srv, &search, env, len) == -1)
+		goto err;
+
+	/* Derive a domain from our various hostname options */
+	domain = hooks_getenv(env, len, "new_domain_name");
+	if (domain == NULL) {
+		if ((p = hooks_getenv(env, len, "new_dhcp6_fqdn")) != NULL &&
+		    (p = strchr(p, '.')) != NULL && p[1] != '\0')
+			domain = p + 1;
+		else if ((p = hooks_getenv(env, len, "new_fqdn")) != NULL &&
+		    (p = strchr(p, '.')) != NULL && p[1] != '\0')
+			domain = p + 1;
+		else if ((p = hooks_getenv(env, len,
+		    "new_host_name")) != NULL &&
+		    (p = strchr(p, '.')) != NULL && p[1] != '\0')
+			domain = p + 1;
+	}
+
+	if (srv.len == 0 && search.len == 0 && domain == NULL) {
+		errno = 0;
+		goto err;
+	}
+
+	if (hooks_printf(&conf, "%s from %s\n", HOOKS_SIGNATURE, name) == -1)
+		goto err;
+	if (domain != NULL) {
+		domain += strspn(domain, " ");
+		dlen = strcspn(domain, " ");
+		if (hooks_validdomain(domain, dlen)) {
+			if (hooks_printf(&conf, "domain %.*s\n",
+			    (int)dlen, domain) == -1)
+				goto err;
+		} else
+			logerrx("%s: invalid domain name: %.*s",
+			    name, (int)dlen, domain);
+		/* If there is no search, make this one */
+		if (search.len == 0 && hooks_addwords(&search, domain) == -1)
+			goto err;
+	}
+	if (search.len != 0 && hooks_validdomains(search.buf)) {
+		if (hooks_printf(&conf, "search %s\n", search.buf) == -1)
+			goto err;
+	}
+	for (p = srv.buf; p != NULL && *p != '\0'; p += dlen) {
+		p += strspn(p, " ");
+		dlen = strcspn(p, " ");
+		if (hooks_printf(&conf, "nameserver %.*s\n",
+		    (int)dlen, p) == -1)
+			goto err;
+	}
+
+	free(srv.buf);
+	free(search.buf);
+	return conf.buf;
+
+err:
+	free(conf.buf);
+	free(srv.buf);
+	free(search.buf);
+	return NULL;
+}
+
+/* Returns true if the lines for name changed. conf is taken. */
+static bool
+hooks_resolvset(struct dhcpcd_ctx *ctx, const char *name, char *conf)
+{
+	struct hooks_resolv *hr, *hn;
+
+	TAILQ_FOREACH(hr, &ctx->hooks_resolv, next) {
+		if (strcmp(hr->name, name) >= 0)
+			break;
+	}
+	if (hr != NULL && strcmp(hr->name, name) == 0) {
+		if (conf != NULL && strcmp(hr->conf, conf) == 0) {
+			free(conf);
+			return false;
+		}
+		free(hr->conf);
+		if (conf != NULL) {
+			hr->conf = conf;
+			return true;
+		}
+		TAILQ_REMOVE(&ctx->hooks_resolv, hr, next);
+		free(hr);
+		return true;
+	}
+	if (conf == NULL)
+		return false;
+
+	hn = malloc(sizeof(*hn));
+	if (hn == NULL) {
+		logerr(__func__);
+		free(conf);
+		return false;
+	}
+	strlcpy(hn->name, name, sizeof(hn->name));
+	hn->conf = conf;
+	if (hr != NULL)
+		TAILQ_INSERT_BEFORE(hr, hn, next);
+	else
+		TAILQ_INSERT_TAIL(&ctx->hooks_resolv, hn, next);
+	return true;
+}
+
+/* Add the words after key from each line of conf starting with it. */
+static int
+hooks_keywords(struct hooks_buf *hb, const char *conf, const char *key)
+{
+	const char *p, *e;
+	size_t klen = strlen(key);
+	char *words;
+	int err;
+
+	for (p = conf; *p != '\0'; p = e + 1) {
+		e = strchr(p, '\n');
+		if (e == NULL)
+			break;
+		if (strncmp(p, key, klen) != 0)
+			continue;
+		words = strndup(p + klen, (size_t)(e - p) - klen);
+		if (words == NULL)
+			return -1;
+		err = hooks_addwords(hb, words);
+		free(words);
+		if (err == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Interfaces in interface_order first, then the rest by name. */
+static struct hooks_resolv *
+hooks_resolvnext(struct dhcpcd_ctx *ctx, const char **order)
+{
+	struct hooks_resolv *hr;
+	const char *p;
+	size_t len;
+
+	for (p = *order; p != NULL && *p != '\0'; p += len) {
+		p += strspn(p, " ");
+		len = strcspn(p, " ");
+		TAILQ_FOREACH(hr, &ctx->hooks_resolv, next) {
+			if (!hr->done && strncmp(hr->name, p, len) == 0 &&
+			    hr->name[len] == '.')
+			{
+				*order = p;
+				return hr;
+			}
+		}
+	}
+	*order = NULL;
+	TAILQ_FOREACH(hr, &ctx->hooks_resolv, next) {
+		if (!hr->done)
+			return hr;
+	}
+	return NULL;
+}
+
+/* Write file, replacing it so readers never see it half written. */
+static int
+hooks_writefile(const char *file, const char *data, size_t len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd;
+	ssize_t n;
+
+	/* Replace what a symlink points to, not the symlink. */
+	if (realpath(file, path) == NULL) {
+		if (errno != ENOENT)
+			return -1;
+		strlcpy(path, file, sizeof(path));
+	}
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.dhcpcd-XXXXXX", path) >=
+	    sizeof(tmp))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		goto inplace;
+	if (fchmod(fd, 0644) == -1 ||
+	    (n = write(fd, data, len)) == -1 || (size_t)n != len ||
+	    fsync(fd) == -1)
+	{
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, path) == 0)
+		return 0;
+	unlink(tmp);
+
+inplace:
+	/* A bind mounted file, as in many containers, cannot be
+	 * replaced, nor can anything in a read only directory. */
+	if (errno != EBUSY && errno != EXDEV && errno != EACCES &&
+	    errno != EROFS)
+		return -1;
+	n = writefile(path, 0644, data, len);
+	if (n == -1)
+		return -1;
+	if ((size_t)n != len) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* build_resolv_conf from 20-resolv.conf */
+static void
+hooks_resolvwrite(struct dhcpcd_ctx *ctx)
+{
+	struct hooks_buf rc = { NULL, 0, 0 };
+	struct hooks_buf domain = { NULL, 0, 0 };
+	struct hooks_buf search = { NULL, 0, 0 };
+	struct hooks_buf srv = { NULL, 0, 0 };
+	struct hooks_buf old = { NULL, 0, 0 };
+	struct hooks_resolv *hr;
+	const char *order, *p;
+	size_t len;
+	bool first = true;
+
+	if (hooks_printf(&rc, "%s", HOOKS_SIGNATURE) == -1)
+		goto err;
+	TAILQ_FOREACH(hr, &ctx->hooks_resolv, next)
+		hr->done = false;
+	order = ctx->hooks_iforder;
+	while ((hr = hooks_resolvnext(ctx, &order)) != NULL) {
+		hr->done = true;
+		if (hooks_printf(&rc, "%s%s", first ? " from " : ", ",
+		    hr->name) == -1 ||
+		    hooks_keywords(&domain, hr->conf, "domain ") == -1 ||
+		    hooks_keywords(&search, hr->conf, "search ") == -1 ||
+		    hooks_keywords(&srv, hr->conf, "nameserver ") == -1)
+			goto err;
+		first = false;
+	}
+	if (hooks_printf(&rc, "\n") == -1)
+		goto err;
+	if (hooks_catfile(&rc, RESOLV_CONF ".head") == -1 &&
+	    hooks_printf(&rc, "# %s.head can replace this line\n",
+	    RESOLV_CONF) == -1)
+		goto err;
+
+	/* The first domain is the domain, any others are searched. */
+	if (domain.len != 0) {
+		len = strcspn(domain.buf, " ");
+		if (domain.buf[len] != '\0' &&
+		    hooks_addwords(&search, domain.buf + len + 1) == -1)
+			goto err;
+		domain.buf[len] = '\0';
+		if (hooks_printf(&rc, "domain %s\n", domain.buf) == -1)
+			goto err;
+	}
+	if (search.len != 0 &&
+	    (domain.len == 0 || strcmp(domain.buf, search.buf) != 0))
+	{
+		if (hooks_printf(&rc, "search %s\n", search.buf) == -1)
+			goto err;
+	}
+	for (p = srv.buf; p != NULL && *p != '\0'; p += len) {
+		p += strspn(p, " ");
+		len = strcspn(p, " ");
+		if (hooks_printf(&rc, "nameserver %.*s\n", (int)len, p) == -1)
+			goto err;
+	}
+	if (hooks_catfile(&rc, RESOLV_CONF ".tail") == -1 &&
+	    hooks_printf(&rc, "# %s.tail can replace this line\n",
+	    RESOLV_CONF) == -1)
+		goto err;
+
+	/* When we start, we have not written anything yet, but the file
+	 * could be left from the last time we ran. */
+	if (ctx->hooks_resolvconf == NULL &&
+	    hooks_catfile(&old, RESOLV_CONF) == 0 &&
+	    old.len == rc.len && memcmp(old.buf, rc.buf, rc.len) == 0)
+		goto keep;
+	if (ctx->hooks_resolvconf != NULL &&
+	    strcmp(ctx->hooks_resolvconf, rc.buf) == 0)
+		goto done;
+
+	logdebugx("writing %s", RESOLV_CONF);
+	if (hooks_writefile(RESOLV_CONF, rc.buf, rc.len) == -1) {
+		logerr("%s: %s", __func__, RESOLV_CONF);
+		goto done;
+	}
+
+keep:
+	free(ctx->hooks_resolvconf);
+	ctx->hooks_resolvconf = rc.buf;
+	rc.buf = NULL;
+	goto done;
+
+err:
+	logerr(__func__);
+done:
+	free(rc.buf);
+	free(domain.buf);
+	free(search.buf);
+	free(srv.buf);
+	free(old.buf);
+}
+
+static bool
+hooks_isdefault(const char *name, const char *dflt)
+{
+
+	return *name == '\0' || strcmp(name, dflt) == 0 ||
+	    strcmp(name, "localhost") == 0 ||
+	    strcmp(name, "localhost.localdomain") == 0;
+}
+
+/* Does hostname match name, as it would have been set from name? */
+static bool
+hooks_hostmatch(const char *hostname, const char *name, const char *domain,
+    bool hfqdn, bool hshort)
+{
+	size_t len;
+
+	if (hshort && !hfqdn) {
+		len = strcspn(name, ".");
+		return strncmp(hostname, name, len) == 0 &&
+		    hostname[len] == '\0';
+	}
+	if (hfqdn && domain != NULL && strchr(name, '.') == NULL) {
+		len = strlen(name);
+		return strncmp(hostname, name, len) == 0 &&
+		    hostname[len] == '.' &&
+		    strcmp(hostname + len + 1, domain) == 0;
+	}
+	return strcmp(hostname, name) == 0;
+}
+
+/* set_hostname from 30-hostname */
+static void
+hooks_hostname(const char *ifname, const char *reason,
+    const char *env, size_t len)
+{
+	char hostname[HOSTNAME_MAX_LEN + 1], name[HOSTNAME_MAX_LEN + 1];
+	const char *fqdn, *old_fqdn, *host, *old_host, *domain, *val;
+	const char *dflt;
+	bool hfqdn, hshort;
+
+	val = hooks_getenv(env, len, "hostname_fqdn");
+	if (val == NULL || hooks_istrue(val)) {
+		hfqdn = true;
+		hshort = false;
+	} else {
+		hfqdn = false;
+		hshort = strcasecmp(val, "server") != 0;
+	}
+	/* An empty hostname_default is not the same as none */
+	dflt = hooks_findenv(env, len, "hostname_default");
+	if (dflt == NULL)
+		dflt = DEFAULT_HOSTNAME;
+
+	if (hooks_dhcp6(reason)) {
+		fqdn = hooks_getenv(env, len, "new_dhcp6_fqdn");
+		old_fqdn = hooks_getenv(env, len, "old_dhcp6_fqdn");
+	} else {
+		fqdn = hooks_getenv(env, len, "new_fqdn");
+		old_fqdn = hooks_getenv(env, len, "old_fqdn");
+	}
+	old_host = hooks_getenv(env, len, "old_host_name");
+
+	if (gethostname(hostname, sizeof(hostname)) == -1) {
+		logerr("%s: gethostname", __func__);
+		return;
+	}
+	hostname[sizeof(hostname) - 1] = '\0';
+
+	/* need_hostname */
+	if (!hooks_isdefault(hostname, dflt) &&
+	    !hooks_istrue(hooks_getenv(env, len, "force_hostname")))
+	{
+		if (old_fqdn != NULL) {
+			if (!hooks_hostmatch(hostname, old_fqdn, NULL,
+			    hfqdn, hshort))
+				return;
+		} else if (old_host != NULL) {
+			if (!hooks_hostmatch(hostname, old_host,
+			    hooks_getenv(env, len, "old_domain_name"),
+			    hfqdn, hshort))
+				return;
+		} else
+			return;
+	}
+
+	host = hooks_getenv(env, len, "new_host_name");
+	domain = hooks_getenv(env, len, "new_domain_name");
+	if (fqdn != NULL) {
+		if (hfqdn || !hshort)
+			strlcpy(name, fqdn, sizeof(name));
+		else
+			snprintf(name, sizeof(name), "%.*s",
+			    (int)strcspn(fqdn, "."), fqdn);
+	} else if (host != NULL) {
+		if (hfqdn && domain != NULL && strchr(host, '.') == NULL)
+			snprintf(name, sizeof(name), "%s.%s", host, domain);
+		else if (hshort && !hfqdn)
+			snprintf(name, sizeof(name), "%.*s",
+			    (int)strcspn(host, "."), host);
+		else
+			strlcpy(name, host, sizeof(name));
+	} else if (!hooks_isdefault(hostname, dflt)) {
+		/* We set it before but now relinquish control.
+		 * The default may not be a valid name, (none) on Linux. */
+		loginfox("%s: setting hostname: %s", ifname, dflt);
+		if (sethostname(dflt, strlen(dflt)) == -1)
+			logerr("%s: sethostname", __func__);
+		return;
+	} else
+		return;
+
+	if (strcmp(hostname, name) == 0)
+		return;
+	if (!hooks_validdomain(name, strlen(name))) {
+		logerrx("%s: invalid hostname: %s", ifname, name);
+		return;
+	}
+	loginfox("%s: setting hostname: %s", ifname, name);
+	if (sethostname(name, strlen(name)) == -1)
+		logerr("%s: sethostname", __func__);
+}
+
+/*
+ * With warm_restart, dhcpcd does not run the hooks for what it resumes,
+ * so the lines for each interface are handed to it in HOOKSFILE:
+ *	interface_order order
+ *	interface.protocol
+ *		resolv.conf line
+ * It is read when the hooks first run and written at exit by the
+ * process which read it.
+ */
+static void
+hooks_load(struct dhcpcd_ctx *ctx)
+{
+	struct hooks_buf hb = { NULL, 0, 0 };
+	struct hooks_buf conf = { NULL, 0, 0 };
+	char *p, *e, *name = NULL;
+
+	ctx->hooks_loaded = true;
+	if (!ctx->warm_restart)
+		return;
+	if (hooks_catfile(&hb, HOOKSFILE) == -1) {
+		if (errno != ENOENT)
+			logerr("%s: %s", __func__, HOOKSFILE);
+		goto out;
+	}
+	unlink(HOOKSFILE);
+
+	for (p = hb.buf; p != NULL; p = e + 1) {
+		e = strchr(p, '\n');
+		if (e == NULL || *p != '\t') {
+			if (name != NULL && conf.len != 0) {
+				hooks_resolvset(ctx, name, conf.buf);
+				conf.buf = NULL;
+				conf.len = conf.size = 0;
+			}
+			name = NULL;
+		}
+		if (e == NULL)
+			break;
+		*e = '\0';
+		if (strncmp(p, "interface_order ", 16) == 0) {
+			free(ctx->hooks_iforder);
+			ctx->hooks_iforder = strdup(p + 16);
+		} else if (*p != '\t')
+			name = p;
+		else if (name != NULL &&
+		    hooks_printf(&conf, "%s\n", p + 1) == -1)
+			logerr(__func__);
+	}
+
+out:
+	free(conf.buf);
+	free(hb.buf);
+}
+
+void
+hooks_save(struct dhcpcd_ctx *ctx)
+{
+	struct hooks_buf hb = { NULL, 0, 0 };
+	struct hooks_resolv *hr;
+	const char *p, *e;
+
+	if (!ctx->warm_restart || !ctx->hooks_loaded ||
+	    !(ctx->builtin_hooks & HOOK_RESOLV_CONF))
+		return;
+
+	if (ctx->hooks_iforder != NULL &&
+	    hooks_printf(&hb, "interface_order %s\n",
+	    ctx->hooks_iforder) == -1)
+		goto err;
+	TAILQ_FOREACH(hr, &ctx->hooks_resolv, next) {
+		if (hooks_printf(&hb, "%s\n", hr->name) == -1)
+			goto err;
+		for (p = hr->conf; (e = strchr(p, '\n')) != NULL; p = e + 1) {
+			if (hooks_printf(&hb, "\t%.*s\n",
+			    (int)(e - p), p) == -1)
+				goto err;
+		}
+	}
+	if (hb.len == 0) {
+		free(hb.buf);
+		return;
+	}
+	if (writefile(HOOKSFILE, 0600, hb.buf, hb.len) != -1) {
+		free(hb.buf);
+		return;
+	}
+
+err:
+	logerr("%s: %s", __func__, HOOKSFILE);
+	free(hb.buf);
+}
+
+/* Run our builtin hooks for the script environment env. */
+void
+hooks_run(struct dhcpcd_ctx *ctx, const char *env, size_t len)
+{
+	const char *reason, *ifname, *protocol, *order;
+	char name[sizeof(((struct hooks_resolv *)0)->name)], *conf;
+	bool up, down, changed = false;
+
+	if (!ctx->hooks_loaded)
+		hooks_load(ctx);
+
+	reason = hooks_getenv(env, len, "reason");
+	ifname = hooks_getenv(env, len, "interface");
+	if (reason == NULL || ifname == NULL ||
+	    !hooks_istrue(hooks_getenv(env, len, "if_configured")))
+		return;
+	protocol = hooks_getenv(env, len, "protocol");
+	snprintf(name, sizeof(name), "%s%s%s", ifname,
+	    protocol == NULL ? "" : ".", protocol == NULL ? "" : protocol);
+	up = hooks_istrue(hooks_getenv(env, len, "if_up"));
+	down = hooks_istrue(hooks_getenv(env, len, "if_down"));
+
+	if (ctx->builtin_hooks & HOOK_RESOLV_CONF) {
+		order = hooks_getenv(env, len, "interface_order");
+		if (order != NULL && (ctx->hooks_iforder == NULL ||
+		    strcmp(ctx->hooks_iforder, order) != 0))
+		{
+			free(ctx->hooks_iforder);
+			ctx->hooks_iforder = strdup(order);
+			changed = TAILQ_FIRST(&ctx->hooks_resolv) !=
+			    TAILQ_LAST(&ctx->hooks_resolv, hooks_resolvhead);
+		}
+		if (up || strcmp(reason, "ROUTERADVERT") == 0) {
+			conf = hooks_resolvent(name, reason, env, len);
+			if (conf == NULL && errno != 0)
+				logerr("%s: %s", __func__, name);
+			else if (hooks_resolvset(ctx, name, conf))
+				changed = true;
+		} else if (down && hooks_resolvset(ctx, name, NULL))
+			changed = true;
+		if (changed)
+			hooks_resolvwrite(ctx);
+	}
+
+	if (ctx->builtin_hooks & HOOK_HOSTNAME &&
+	    up && strcmp(reason, "ROUTERADVERT") != 0)
+		hooks_hostname(ifname, reason, env, len);
+}
+
+void
+hooks_free(struct dhcpcd_ctx *ctx)
+{
+	struct hooks_resolv *hr;
+
+	while ((hr = TAILQ_FIRST(&ctx->hooks_resolv)) != NULL) {
+		TAILQ_REMOVE(&ctx->hooks_resolv, hr, next);
+		free(hr->conf);
+		free(hr);
+	}
+	free(ctx->hooks_iforder);
+	ctx->hooks_iforder = NULL;
+	free(ctx->hooks_resolvconf);
+	ctx->hooks_resolvconf = NULL;
+}
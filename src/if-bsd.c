@@ -973,6 +973,39 @@ if_initrt(struct dhcpcd_ctx *ctx, rb_tree_t *kroutes, int af)
 	return p == end ? 0 : -1;
 }
 
+/* Route socket messages are not acknowledged,
+ * so there is nothing to gain from a transaction. */
+int
+if_txn_begin(__unused struct dhcpcd_ctx *ctx)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+bool
+if_txn_active(__unused const struct dhcpcd_ctx *ctx)
+{
+
+	return false;
+}
+
+size_t
+if_txn_count(__unused const struct dhcpcd_ctx *ctx)
+{
+
+	return 0;
+}
+
+ssize_t
+if_txn_end(__unused struct dhcpcd_ctx *ctx,
+    __unused const struct psr_result **results)
+{
+
+	errno = EINVAL;
+	return -1;
+}
+
 #ifdef INET
 int
 if_address(unsigned char cmd, const struct ipv4_addr *ia)
@@ -981,6 +1014,9 @@ if_address(unsigned char cmd, const struct ipv4_addr *ia)
 	struct in_aliasreq ifra;
 	struct dhcpcd_ctx *ctx = ia->iface->ctx;
 
+	/* The kernel adds and removes prefix routes for the address. */
+	rt_kinvalidate(ctx, AF_INET);
+
 	memset(&ifra, 0, sizeof(ifra));
 	strlcpy(ifra.ifra_name, ia->iface->name, sizeof(ifra.ifra_name));
 
@@ -1048,6 +1084,8 @@ if_address6(unsigned char cmd, const struct ipv6_addr *ia)
 	struct in6_addr mask;
 	struct dhcpcd_ctx *ctx = ia->iface->ctx;
 
+	rt_kinvalidate(ctx, AF_INET6);
+
 	strlcpy(ifa.ifra_name, ia->iface->name, sizeof(ifa.ifra_name));
 #if defined(__FreeBSD__) || defined(__DragonFly__)
 	/* This is a bug - the kernel should work this out. */
@@ -1406,7 +1444,9 @@ if_ifa(struct dhcpcd_ctx *ctx, const struct ifa_msghdr *ifam)
 		sa = rti_info[RTAX_IFA];
 #ifdef PRIVSEP_GETIFADDRS
 		if (IN_PRIVSEP(ctx)) {
-			if (ps_root_getifaddrs(ctx, &ifaddrs) == -1) {
+			if (ps_root_getifaddrs(ctx, ifp->name,
+			    sa->sa_family, &ifaddrs) == -1)
+			{
 				logerr("ps_root_getifaddrs");
 				break;
 			}
@@ -1500,6 +1540,7 @@ if_dispatch(struct dhcpcd_ctx *ctx, const struct rt_msghdr *rtm)
 	if (rtm->rtm_version != RTM_VERSION)
 		return 0;
 
+	ctx->stats.link_msgs++;
 	switch(rtm->rtm_type) {
 #ifdef RTM_IFANNOUNCE
 	case RTM_IFANNOUNCE:
@@ -30,6 +30,7 @@
 
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/stat.h>
@@ -77,6 +78,7 @@
 #include "common.h"
 #include "dev.h"
 #include "dhcp.h"
+#include "eloop.h"
 #include "if.h"
 #include "ipv4.h"
 #include "ipv4ll.h"
@@ -86,14 +88,20 @@
 #include "privsep.h"
 #include "route.h"
 #include "sa.h"
+#include "shard.h"
 
 #ifdef HAVE_NL80211_H
 #include <linux/genetlink.h>
 #include <linux/nl80211.h>
+static void if_opennl80211(struct dhcpcd_ctx *);
 #else
 int if_getssid_wext(const char *ifname, uint8_t *ssid);
 #endif
 
+#ifdef HAVE_ROUTE_NEXTHOP
+#include <linux/nexthop.h>
+#endif
+
 /* Support older kernels */
 #ifndef IFLA_WIRELESS
 #define IFLA_WIRELESS (IFLA_MASTER + 1)
@@ -429,15 +437,30 @@ os_init(void)
 	return 0;
 }
 
+/*
+ * Netlink messages are read into buffers kept in priv.
+ * The kernel sizes each part of a dump to fit the largest read it has
+ * seen, up to about 32k, so reading that much halves the reads for a
+ * big dump compared to 16k.
+ */
+#define	NL_BUFLEN	(32 * 1024)
+#define	NL_RCVBUF	(256 * 1024)
+
 int
 if_opensockets_os(struct dhcpcd_ctx *ctx)
 {
 	struct priv *priv;
 	struct sockaddr_nl snl;
 	socklen_t len;
-#ifdef NETLINK_BROADCAST_ERROR
+	int rcvbuf = NL_RCVBUF;
+#if defined(NETLINK_BROADCAST_ERROR) || \
+    defined(NETLINK_GET_STRICT_CHK) || \
+    (defined(NETLINK_NO_ENOBUFS) && !defined(SMALL))
 	int on = 1;
 #endif
+#ifdef HAVE_ROUTE_NEXTHOP
+	int group;
+#endif
 
 #ifdef PRIVSEP
 	if (ctx->options & DHCPCD_PRIVSEPROOT) {
@@ -467,6 +490,22 @@ if_opensockets_os(struct dhcpcd_ctx *ctx)
 	    &on, sizeof(on)) == -1)
 		logerr("%s: NETLINK_BROADCAST_ERROR", __func__);
 #endif
+#if defined(NETLINK_NO_ENOBUFS) && !defined(SMALL)
+	/* Rather than overflowing, messages are lost and
+	 * dhcpcd_linkresync finds out what changed. */
+	if (ctx->link_resync != 0 &&
+	    setsockopt(ctx->link_fd, SOL_NETLINK, NETLINK_NO_ENOBUFS,
+	    &on, sizeof(on)) == -1)
+		logerr("%s: NETLINK_NO_ENOBUFS", __func__);
+#endif
+#ifdef HAVE_ROUTE_NEXTHOP
+	/* The kernel removes nexthops when their interface goes down.
+	 * The group is too big for nl_groups. */
+	group = RTNLGRP_NEXTHOP;
+	if (setsockopt(ctx->link_fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+	    &group, sizeof(group)) == -1)
+		logerr("%s: RTNLGRP_NEXTHOP", __func__);
+#endif
 
 #ifdef PRIVSEP
 setup_priv:
@@ -475,6 +514,10 @@ setup_priv:
 		return -1;
 
 	ctx->priv = priv;
+	TAILQ_INIT(&priv->nexthops);
+#ifdef HAVE_NL80211_H
+	priv->nl80211_fd = -1;
+#endif
 	memset(&snl, 0, sizeof(snl));
 	priv->route_fd = if_linksocket(&snl, NETLINK_ROUTE, 0);
 	if (priv->route_fd == -1)
@@ -483,15 +526,145 @@ setup_priv:
 	if (getsockname(priv->route_fd, (struct sockaddr *)&snl, &len) == -1)
 		return -1;
 	priv->route_pid = snl.nl_pid;
+	/* Room for a transaction's acks and the start of a dump.
+	 * The kernel caps this at net.core.rmem_max. */
+	if (setsockopt(priv->route_fd, SOL_SOCKET, SO_RCVBUF,
+	    &rcvbuf, sizeof(rcvbuf)) == -1)
+		logerr("%s: SO_RCVBUF", __func__);
+#ifdef NETLINK_GET_STRICT_CHK
+	/* Have the kernel filter dumps by the interface and table we ask
+	 * for rather than sending everything.
+	 * Older kernels ignore the filter, so replies are still checked. */
+	if (setsockopt(priv->route_fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
+	    &on, sizeof(on)) == -1 && errno != ENOPROTOOPT)
+		logerr("%s: NETLINK_GET_STRICT_CHK", __func__);
+#endif
 
 	memset(&snl, 0, sizeof(snl));
 	priv->generic_fd = if_linksocket(&snl, NETLINK_GENERIC, 0);
 	if (priv->generic_fd == -1)
 		return -1;
 
+#ifdef HAVE_NL80211_H
+	if (!(ctx->options & DHCPCD_PRIVSEPROOT))
+		if_opennl80211(ctx);
+#endif
 	return 0;
 }
 
+/*
+ * A netlink transaction packs route and address changes into one
+ * sendmsg. The kernel runs each message in turn and acknowledges each
+ * one, so the results are matched back to the messages by sequence.
+ */
+#define	NLTXN_BUFLEN	(32 * 1024)
+/* Each ack costs far more than its size in the socket receive
+ * buffer, so limit how many we ask for at once. */
+#define	NLTXN_MAX	64
+
+struct nltxn {
+	bool nt_active;
+	uint8_t *nt_buf;		/* messages not yet sent */
+	size_t nt_len;
+	uint32_t nt_seqs[NLTXN_MAX];	/* of messages not yet sent */
+	size_t nt_count;
+	struct psr_result *nt_results;	/* of messages sent */
+	size_t nt_nresults;
+	size_t nt_resultslen;
+};
+
+static void
+if_txn_free(struct priv *priv)
+{
+	struct nltxn *nt = priv->nltxn;
+
+	if (nt == NULL)
+		return;
+	free(nt->nt_buf);
+	free(nt->nt_results);
+	free(nt);
+	priv->nltxn = NULL;
+}
+
+#ifdef HAVE_ROUTE_NEXTHOP
+/*
+ * Gateway routes share a kernel nexthop object for each interface
+ * and gateway, so when the gateway changes only the nexthop has to.
+ * The nexthops are made on-link so they can be made before the
+ * route to the gateway is added.
+ */
+#ifdef RTPROT_DHCP
+#define	NH_PROTOCOL	RTPROT_DHCP
+#else
+#define	NH_PROTOCOL	RTPROT_BOOT
+#endif
+/* How many ids to try if someone else has taken the next one. */
+#define	NH_TRIES	8
+
+#define	NH_UNKNOWN	0
+#define	NH_LOADED	1
+#define	NH_UNSUPPORTED	-1
+
+struct nexthop {
+	TAILQ_ENTRY(nexthop) nh_next;
+	uint32_t nh_id;
+	unsigned int nh_ifindex;
+	union sa_ss nh_ss_gateway;
+#define	nh_gateway	nh_ss_gateway.sa
+};
+
+static struct nexthop *
+if_nhfind(struct priv *priv, unsigned int ifindex, const struct sockaddr *gw)
+{
+	struct nexthop *nh;
+
+	TAILQ_FOREACH(nh, &priv->nexthops, nh_next) {
+		if (nh->nh_ifindex == ifindex &&
+		    sa_cmp(&nh->nh_gateway, gw) == 0)
+			return nh;
+	}
+	return NULL;
+}
+
+static struct nexthop *
+if_nhfindid(struct priv *priv, uint32_t id)
+{
+	struct nexthop *nh;
+
+	TAILQ_FOREACH(nh, &priv->nexthops, nh_next) {
+		if (nh->nh_id == id)
+			return nh;
+	}
+	return NULL;
+}
+
+static struct nexthop *
+if_nhnew(struct priv *priv, uint32_t id, unsigned int ifindex,
+    const struct sockaddr *gw)
+{
+	struct nexthop *nh;
+
+	if ((nh = calloc(1, sizeof(*nh))) == NULL)
+		return NULL;
+	nh->nh_id = id;
+	nh->nh_ifindex = ifindex;
+	memcpy(&nh->nh_ss_gateway, gw, sa_len(gw));
+	TAILQ_INSERT_TAIL(&priv->nexthops, nh, nh_next);
+	return nh;
+}
+
+static void
+if_nhfree(struct priv *priv)
+{
+	struct nexthop *nh;
+
+	while ((nh = TAILQ_FIRST(&priv->nexthops)) != NULL) {
+		TAILQ_REMOVE(&priv->nexthops, nh, nh_next);
+		free(nh);
+	}
+}
+#endif
+
 void
 if_closesockets_os(struct dhcpcd_ctx *ctx)
 {
@@ -503,6 +676,19 @@ if_closesockets_os(struct dhcpcd_ctx *ctx)
 			close(priv->route_fd);
 		if (priv->generic_fd != -1)
 			close(priv->generic_fd);
+		if_txn_free(priv);
+#ifdef HAVE_ROUTE_NEXTHOP
+		if_nhfree(priv);
+#endif
+#ifdef HAVE_NL80211_H
+		if (priv->nl80211_fd != -1) {
+			eloop_event_delete(ctx->eloop, priv->nl80211_fd);
+			close(priv->nl80211_fd);
+		}
+		free(priv->nl80211_buf.nb_buf);
+#endif
+		free(priv->nl_buf.nb_buf);
+		free(priv->nl_linkbuf.nb_buf);
 	}
 }
 
@@ -545,23 +731,68 @@ if_roaming(struct interface *ifp)
 #endif
 }
 
+/* Make sure the receive buffer can hold len bytes. */
+static int
+if_nlbuf(struct nlbuf *nb, size_t len, struct iovec *iov)
+{
+	void *nbuf;
+
+	if (len > nb->nb_len) {
+		len = (len + NL_BUFLEN - 1) / NL_BUFLEN * NL_BUFLEN;
+		nbuf = realloc(nb->nb_buf, len);
+		if (nbuf == NULL)
+			return -1;
+		nb->nb_buf = nbuf;
+		nb->nb_len = len;
+	}
+	iov->iov_base = nb->nb_buf;
+	iov->iov_len = nb->nb_len;
+	return 0;
+}
+
 int
-if_getnetlink(struct dhcpcd_ctx *ctx, struct iovec *iov, int fd, int flags,
+if_getnetlink(struct dhcpcd_ctx *ctx, int fd, int flags,
     int (*cb)(struct dhcpcd_ctx *, void *, struct nlmsghdr *), void *cbarg)
 {
+	struct priv *priv = (struct priv *)ctx->priv;
+	/* Handling an event can send a request. */
+	struct nlbuf *nb = &priv->nl_buf;
+	bool events = false;
 	struct sockaddr_nl nladdr = { .nl_pid = 0 };
+	struct iovec iov;
 	struct msghdr msg = {
-	    .msg_name = &nladdr, .msg_namelen = sizeof(nladdr),
-	    .msg_iov = iov, .msg_iovlen = 1,
+	    .msg_name = &nladdr,
+	    .msg_iov = &iov, .msg_iovlen = 1,
 	};
 	ssize_t len;
 	struct nlmsghdr *nlm;
 	int r = 0;
 	unsigned int again;
-	bool terminated;
+	bool terminated, truncated = false;
+
+	if (fd == ctx->link_fd) {
+		nb = &priv->nl_linkbuf;
+		events = true;
+	}
+#ifdef HAVE_NL80211_H
+	else if (fd == priv->nl80211_fd) {
+		nb = &priv->nl80211_buf;
+		events = true;
+	}
+#endif
 
 recv_again:
-	len = recvmsg(fd, &msg, flags);
+	if (if_nlbuf(nb, NL_BUFLEN, &iov) == -1)
+		return -1;
+	msg.msg_namelen = sizeof(nladdr);
+	len = recvmsg(fd, &msg, flags | MSG_TRUNC);
+	if (truncated) {
+		if (len != -1)
+			goto recv_again;
+		if (errno == EAGAIN)
+			errno = EMSGSIZE;
+		return -1;
+	}
 	if (len == -1 || len == 0)
 		return (int)len;
 
@@ -575,9 +806,26 @@ recv_again:
 	if (nladdr.nl_pid != 0)
 		return 0;
 
+	/* MSG_TRUNC gives the real length of a message too big for the
+	 * buffer, so grow it for next time.
+	 * A lost event is an overflow and the caller resyncs.
+	 * Otherwise throw away the rest of the reply, which the kernel
+	 * has already queued, so it can be asked for again. */
+	if ((size_t)len > iov.iov_len) {
+		if (if_nlbuf(nb, (size_t)len, &iov) == -1)
+			return -1;
+		if (events) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		truncated = true;
+		flags |= MSG_DONTWAIT;
+		goto recv_again;
+	}
+
 	again = 0;
 	terminated = false;
-	for (nlm = iov->iov_base;
+	for (nlm = iov.iov_base;
 	     nlm && NLMSG_OK(nlm, (size_t)len);
 	     nlm = NLMSG_NEXT(nlm, len))
 	{
@@ -608,19 +856,80 @@ recv_again:
 		}
 		if (cb == NULL)
 			continue;
-		if (nlm->nlmsg_seq != (uint32_t)ctx->seq && fd != ctx->link_fd)
+		if (nlm->nlmsg_seq != (uint32_t)ctx->seq && !events)
 			logwarnx("%s: received sequence %u, expecting %d",
 			    __func__, nlm->nlmsg_seq, ctx->seq);
 		else
 			r = cb(ctx, cbarg, nlm);
 	}
 
-	if ((again || !terminated) && (ctx != NULL && ctx->link_fd != fd))
+	if ((again || !terminated) && !events)
 		goto recv_again;
 
 	return r;
 }
 
+#ifdef HAVE_ROUTE_MULTIPATH
+/* RTNH_ALIGN is signed which upsets -Wsign-conversion. */
+#define RTNH_ALIGNU(len) (((len) + RTNH_ALIGNTO - 1U) & ~(RTNH_ALIGNTO - 1U))
+
+/* The first path goes in rt and the others are added to it. */
+static int
+if_copyrtmultipath(struct dhcpcd_ctx *ctx, struct rt *rt,
+    struct rtattr *mp, unsigned char family)
+{
+	struct rtnexthop *rtnh;
+	struct rtattr *rta;
+	struct interface *ifp;
+	struct rt *p, **tail;
+	size_t len, rlen;
+	struct sockaddr *sa;
+
+	p = NULL;
+	tail = &rt->rt_mpath;
+	rtnh = RTA_DATA(mp);
+	len = RTA_PAYLOAD(mp);
+	for (; RTNH_OK(rtnh, len);
+	    len -= RTNH_ALIGNU(rtnh->rtnh_len),
+	    rtnh = (void *)((char *)rtnh + RTNH_ALIGNU(rtnh->rtnh_len)))
+	{
+		ifp = if_findindex(ctx->ifaces,
+		    (unsigned int)rtnh->rtnh_ifindex);
+		if (ifp == NULL)
+			goto err;
+		if (p == NULL) {
+			p = rt;
+			p->rt_ifp = ifp;
+		} else {
+			if ((p = rt_new(ifp)) == NULL)
+				goto err;
+			*tail = p;
+			tail = &p->rt_mpath;
+		}
+
+		rta = (struct rtattr *)(rtnh + 1);
+		rlen = rtnh->rtnh_len - sizeof(*rtnh);
+		for (; RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen)) {
+			if (rta->rta_type != RTA_GATEWAY)
+				continue;
+			sa = &p->rt_gateway;
+			sa->sa_family = family;
+			/* coverity[overrun-buffer-arg] */
+			memcpy((char *)sa + sa_addroffset(sa), RTA_DATA(rta),
+			    MIN(sa_addrlen(sa), RTA_PAYLOAD(rta)));
+		}
+	}
+	return 0;
+
+err:
+	/* We cannot tell this route apart from others. */
+	rt_mpfree(rt);
+	rt->rt_ifp = NULL;
+	errno = ESRCH;
+	return -1;
+}
+#endif
+
 static int
 if_copyrt(struct dhcpcd_ctx *ctx, struct rt *rt, struct nlmsghdr *nlm)
 {
@@ -629,6 +938,9 @@ if_copyrt(struct dhcpcd_ctx *ctx, struct rt *rt, struct nlmsghdr *nlm)
 	struct rtattr *rta;
 	unsigned int ifindex;
 	struct sockaddr *sa;
+#ifdef HAVE_ROUTE_MULTIPATH
+	struct rtattr *mp = NULL;
+#endif
 
 	len = nlm->nlmsg_len - sizeof(*nlm);
 	if (len < sizeof(*rtm)) {
@@ -664,6 +976,16 @@ if_copyrt(struct dhcpcd_ctx *ctx, struct rt *rt, struct nlmsghdr *nlm)
 		case RTA_PRIORITY:
 			rt->rt_metric = *(unsigned int *)RTA_DATA(rta);
 			break;
+#ifdef HAVE_ROUTE_NEXTHOP
+		case RTA_NH_ID:
+			rt->rt_nhid = *(uint32_t *)RTA_DATA(rta);
+			break;
+#endif
+#ifdef HAVE_ROUTE_MULTIPATH
+		case RTA_MULTIPATH:
+			mp = rta;
+			break;
+#endif
 		case RTA_METRICS:
 		{
 			struct rtattr *r2;
@@ -703,6 +1025,26 @@ if_copyrt(struct dhcpcd_ctx *ctx, struct rt *rt, struct nlmsghdr *nlm)
 	if (sa_is_allones(&rt->rt_netmask))
 		rt->rt_flags |= RTF_HOST;
 
+#ifdef HAVE_ROUTE_MULTIPATH
+	if (mp != NULL && rt->rt_ifp == NULL &&
+	    if_copyrtmultipath(ctx, rt, mp, rtm->rtm_family) == -1)
+		return -1;
+#endif
+
+#ifdef HAVE_ROUTE_NEXTHOP
+	/* Without nexthop compat mode the kernel only gives us the id. */
+	if (rt->rt_nhid != 0 && rt->rt_ifp == NULL) {
+		struct nexthop *nh;
+
+		nh = if_nhfindid((struct priv *)ctx->priv, rt->rt_nhid);
+		if (nh != NULL) {
+			memcpy(&rt->rt_ss_gateway, &nh->nh_ss_gateway,
+			    sizeof(rt->rt_ss_gateway));
+			rt->rt_ifp = if_findindex(ctx->ifaces, nh->nh_ifindex);
+		}
+	}
+#endif
+
 	#if 0
 	if (rt->rtp_ifp == NULL && rt->src.s_addr != INADDR_ANY) {
 		struct ipv4_addr *ap;
@@ -758,8 +1100,12 @@ link_route(struct dhcpcd_ctx *ctx, __unused struct interface *ifp,
 	if (nlm->nlmsg_pid == priv->route_pid)
 		return 0;
 
-	if (if_copyrt(ctx, &rt, nlm) == 0)
+	if (if_copyrt(ctx, &rt, nlm) == 0) {
 		rt_recvrt(cmd, &rt, (pid_t)nlm->nlmsg_pid);
+#ifdef HAVE_ROUTE_MULTIPATH
+		rt_mpfree(&rt);
+#endif
+	}
 
 	return 0;
 }
@@ -942,6 +1288,39 @@ link_neigh(struct dhcpcd_ctx *ctx, __unused struct interface *ifp,
 }
 #endif
 
+#ifdef HAVE_ROUTE_NEXTHOP
+static int
+link_nexthop(struct dhcpcd_ctx *ctx, struct nlmsghdr *nlm)
+{
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct nhmsg *nhm;
+	struct rtattr *rta;
+	struct nexthop *nh;
+	size_t len;
+
+	if (nlm->nlmsg_type != RTM_DELNEXTHOP)
+		return 0;
+	if (nlm->nlmsg_len < NLMSG_LENGTH(sizeof(*nhm)))
+		return -1;
+
+	nhm = NLMSG_DATA(nlm);
+	rta = (struct rtattr *)((char *)nhm + NLMSG_ALIGN(sizeof(*nhm)));
+	len = NLMSG_PAYLOAD(nlm, sizeof(*nhm));
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type != NHA_ID)
+			continue;
+		nh = if_nhfindid(priv, *(uint32_t *)RTA_DATA(rta));
+		if (nh == NULL)
+			continue;
+		/* The kernel took the routes using it away as well. */
+		rt_kinvalidate(ctx, nh->nh_gateway.sa_family);
+		TAILQ_REMOVE(&priv->nexthops, nh, nh_next);
+		free(nh);
+	}
+	return 0;
+}
+#endif
+
 static int
 link_netlink(struct dhcpcd_ctx *ctx, void *arg, struct nlmsghdr *nlm)
 {
@@ -952,6 +1331,7 @@ link_netlink(struct dhcpcd_ctx *ctx, void *arg, struct nlmsghdr *nlm)
 	struct ifinfomsg *ifi;
 	char ifn[IF_NAMESIZE + 1];
 
+	ctx->stats.link_msgs++;
 	r = link_route(ctx, ifp, nlm);
 	if (r != 0)
 		return r;
@@ -963,6 +1343,11 @@ link_netlink(struct dhcpcd_ctx *ctx, void *arg, struct nlmsghdr *nlm)
 	if (r != 0)
 		return r;
 #endif
+#ifdef HAVE_ROUTE_NEXTHOP
+	r = link_nexthop(ctx, nlm);
+	if (r != 0)
+		return r;
+#endif
 
 	if (nlm->nlmsg_type != RTM_NEWLINK && nlm->nlmsg_type != RTM_DELLINK)
 		return 0;
@@ -1053,13 +1438,8 @@ link_netlink(struct dhcpcd_ctx *ctx, void *arg, struct nlmsghdr *nlm)
 int
 if_handlelink(struct dhcpcd_ctx *ctx)
 {
-	unsigned char buf[16 * 1024];
-	struct iovec iov = {
-		.iov_base = buf,
-		.iov_len = sizeof(buf),
-	};
 
-	return if_getnetlink(ctx, &iov, ctx->link_fd, MSG_DONTWAIT,
+	return if_getnetlink(ctx, ctx->link_fd, MSG_DONTWAIT,
 	    &link_netlink, NULL);
 }
 
@@ -1076,6 +1456,10 @@ if_netlinkpriv(int protocol, struct nlmsghdr *nlm)
 	case RTM_DELADDR:	/* FALLTHROUGH */
 	case RTM_NEWROUTE:	/* FALLTHROUGH */
 	case RTM_DELROUTE:	/* FALLTHROUGH */
+#ifdef HAVE_ROUTE_NEXTHOP
+	case RTM_NEWNEXTHOP:	/* FALLTHROUGH */
+	case RTM_DELNEXTHOP:	/* FALLTHROUGH */
+#endif
 	case RTM_NEWLINK:
 		return true;
 	default:
@@ -1084,6 +1468,202 @@ if_netlinkpriv(int protocol, struct nlmsghdr *nlm)
 }
 #endif
 
+/* Until if_txn_end, route and address changes are queued
+ * rather than sent and report success. */
+int
+if_txn_begin(struct dhcpcd_ctx *ctx)
+{
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct nltxn *nt = priv->nltxn;
+
+	if (nt == NULL) {
+		nt = calloc(1, sizeof(*nt));
+		if (nt == NULL)
+			return -1;
+		nt->nt_buf = malloc(NLTXN_BUFLEN);
+		if (nt->nt_buf == NULL) {
+			free(nt);
+			return -1;
+		}
+		priv->nltxn = nt;
+	} else if (nt->nt_active) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	nt->nt_active = true;
+	nt->nt_len = 0;
+	nt->nt_count = 0;
+	nt->nt_nresults = 0;
+	return 0;
+}
+
+bool
+if_txn_active(const struct dhcpcd_ctx *ctx)
+{
+	const struct priv *priv = (const struct priv *)ctx->priv;
+
+	return priv != NULL && priv->nltxn != NULL && priv->nltxn->nt_active;
+}
+
+/* The index the next queued message will have in the results. */
+size_t
+if_txn_count(const struct dhcpcd_ctx *ctx)
+{
+	const struct nltxn *nt = ((const struct priv *)ctx->priv)->nltxn;
+
+	return nt->nt_nresults + nt->nt_count;
+}
+
+static int
+if_txn_flush(struct dhcpcd_ctx *ctx)
+{
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct nltxn *nt = priv->nltxn;
+	struct psr_result *results;
+	struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
+	struct iovec iov = { .iov_base = nt->nt_buf, .iov_len = nt->nt_len };
+	struct msghdr msg = {
+	    .msg_name = &snl, .msg_namelen = sizeof(snl),
+	    .msg_iov = &iov, .msg_iovlen = 1,
+	};
+	struct nlmsghdr *nlm;
+	struct nlmsgerr *err;
+	size_t need, acked, i, j;
+	ssize_t len;
+	int error = 0;
+
+	if (nt->nt_count == 0)
+		return 0;
+
+	need = nt->nt_nresults + nt->nt_count;
+	if (need > nt->nt_resultslen) {
+		results = reallocarray(nt->nt_results, need, sizeof(*results));
+		if (results == NULL)
+			return -1;
+		nt->nt_results = results;
+		nt->nt_resultslen = need;
+	}
+	results = nt->nt_results + nt->nt_nresults;
+
+	for (i = 0; i < nt->nt_count; i++) {
+		results[i].psr_result = -1;
+		results[i].psr_errno = 0;
+	}
+
+	acked = 0;
+	if (sendmsg(priv->route_fd, &msg, 0) == -1) {
+		error = errno;
+		goto out;
+	}
+
+	/* Acks for an earlier transaction we gave up on
+	 * may still be queued, so match on sequence. */
+	while (acked < nt->nt_count) {
+		if (if_nlbuf(&priv->nl_buf, NL_BUFLEN, &iov) == -1) {
+			error = errno;
+			goto out;
+		}
+		msg.msg_namelen = sizeof(snl);
+		len = recvmsg(priv->route_fd, &msg, 0);
+		if (len == -1 || len == 0) {
+			error = len == 0 ? EIO : errno;
+			goto out;
+		}
+		if (snl.nl_pid != 0)
+			continue;
+		for (nlm = iov.iov_base;
+		     NLMSG_OK(nlm, (size_t)len);
+		     nlm = NLMSG_NEXT(nlm, len))
+		{
+			if (nlm->nlmsg_type != NLMSG_ERROR ||
+			    nlm->nlmsg_len - sizeof(*nlm) < sizeof(*err))
+				continue;
+			for (j = 0; j < nt->nt_count; j++) {
+				if (nt->nt_seqs[j] == nlm->nlmsg_seq)
+					break;
+			}
+			/* Unacknowledged results are -1 with no errno. */
+			if (j == nt->nt_count || results[j].psr_errno != 0 ||
+			    results[j].psr_result != -1)
+				continue;
+			err = (struct nlmsgerr *)NLMSG_DATA(nlm);
+			if (err->error == 0)
+				results[j].psr_result = 0;
+			else
+				results[j].psr_errno = -err->error;
+			acked++;
+		}
+	}
+
+out:
+	if (acked != nt->nt_count) {
+		logerrx("%s: %zu of %zu changes unacknowledged: %s",
+		    __func__, nt->nt_count - acked, nt->nt_count,
+		    strerror(error));
+		for (i = 0; i < nt->nt_count; i++) {
+			if (results[i].psr_result == -1 &&
+			    results[i].psr_errno == 0)
+				results[i].psr_errno = error;
+		}
+		/* We don't know what the kernel did. */
+		rt_kinvalidate(ctx, AF_UNSPEC);
+	}
+	nt->nt_nresults = need;
+	nt->nt_len = 0;
+	nt->nt_count = 0;
+	return 0;
+}
+
+/* Queue a netlink message for if_txn_end. */
+int
+if_txn_queue(struct dhcpcd_ctx *ctx, void *data, size_t len)
+{
+	struct nltxn *nt = ((struct priv *)ctx->priv)->nltxn;
+	struct nlmsghdr *nlm = data;
+	size_t alen = NLMSG_ALIGN(len);
+
+	/* A message the kernel cannot parse would stop it
+	 * processing the rest, so we would never get our acks. */
+	if (len < sizeof(*nlm) || nlm->nlmsg_len != len ||
+	    alen > NLTXN_BUFLEN)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((nt->nt_len + alen > NLTXN_BUFLEN || nt->nt_count == NLTXN_MAX) &&
+	    if_txn_flush(ctx) == -1)
+		return -1;
+
+	nlm->nlmsg_flags |= NLM_F_ACK;
+	memcpy(nt->nt_buf + nt->nt_len, data, len);
+	memset(nt->nt_buf + nt->nt_len + len, 0, alen - len);
+	nt->nt_len += alen;
+	nt->nt_seqs[nt->nt_count++] = nlm->nlmsg_seq;
+	return 0;
+}
+
+/* Send what's queued and stop queueing.
+ * results points to a result for each message queued, in order,
+ * and is valid until the next if_txn_begin. */
+ssize_t
+if_txn_end(struct dhcpcd_ctx *ctx, const struct psr_result **results)
+{
+	struct nltxn *nt = ((struct priv *)ctx->priv)->nltxn;
+	int r;
+
+	if (nt == NULL || !nt->nt_active) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nt->nt_active = false;
+	r = if_txn_flush(ctx);
+	*results = nt->nt_results;
+	return r == -1 ? -1 : (ssize_t)nt->nt_nresults;
+}
+
 static int
 if_sendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct nlmsghdr *hdr,
     int (*cb)(struct dhcpcd_ctx *, void *, struct nlmsghdr *), void *cbarg)
@@ -1096,11 +1676,7 @@ if_sendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct nlmsghdr *hdr,
 	    .msg_iov = &iov, .msg_iovlen = 1
 	};
 	struct priv *priv = (struct priv *)ctx->priv;
-	unsigned char buf[16 * 1024];
-	struct iovec riov = {
-		.iov_base = buf,
-		.iov_len = sizeof(buf),
-	};
+	int r;
 
 	/* Request a reply */
 	hdr->nlmsg_flags |= NLM_F_ACK;
@@ -1113,23 +1689,15 @@ if_sendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct nlmsghdr *hdr,
 		return (int)ps_root_sendnetlink(ctx, protocol, &msg);
 #endif
 
+	if (protocol == NETLINK_ROUTE && cb == NULL && if_txn_active(ctx))
+		return if_txn_queue(ctx, hdr, hdr->nlmsg_len);
+
 	switch (protocol) {
 	case NETLINK_ROUTE:
 		s = priv->route_fd;
 		break;
 	case NETLINK_GENERIC:
 		s = priv->generic_fd;
-#if 0
-#ifdef NETLINK_GET_STRICT_CHK
-		if (hdr->nlmsg_type == RTM_GETADDR) {
-			int on = 1;
-
-			if (setsockopt(s, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
-			    &on, sizeof(on)) == -1 && errno != ENOPROTOOPT)
-				logerr("%s: NETLINK_GET_STRICT_CHK", __func__);
-		}
-#endif
-#endif
 		break;
 	default:
 		errno = EINVAL;
@@ -1139,7 +1707,17 @@ if_sendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct nlmsghdr *hdr,
 	if (sendmsg(s, &msg, 0) == -1)
 		return -1;
 
-	return if_getnetlink(ctx, &riov, s, 0, cb, cbarg);
+	r = if_getnetlink(ctx, s, 0, cb, cbarg);
+	/* The reply did not fit, but the buffer has grown so ask again. */
+	if (r == -1 && errno == EMSGSIZE) {
+		hdr->nlmsg_seq = (uint32_t)++ctx->seq;
+		if ((unsigned int)ctx->seq > UINT32_MAX)
+			ctx->seq = 0;
+		if (sendmsg(s, &msg, 0) == -1)
+			return -1;
+		r = if_getnetlink(ctx, s, 0, cb, cbarg);
+	}
+	return r;
 }
 
 #define NLMSG_TAIL(nmsg)						\
@@ -1216,6 +1794,48 @@ rta_add_attr_32(struct rtattr *rta, unsigned short maxlen,
 	return 0;
 }
 
+#ifdef HAVE_ROUTE_MULTIPATH
+/* RTA_MULTIPATH is a struct rtnexthop for each path,
+ * each followed by the RTA_GATEWAY of the path. */
+static int
+add_attr_multipath(struct nlmsghdr *n, unsigned short maxlen,
+    const struct rt *rt)
+{
+	struct rtattr *rta, *gw;
+	struct rtnexthop *rtnh;
+	unsigned short alen, len;
+
+	rta = NLMSG_TAIL(n);
+	if (add_attr_l(n, maxlen, RTA_MULTIPATH, NULL, 0) == -1)
+		return -1;
+
+	for (; rt != NULL; rt = rt->rt_mpath) {
+		alen = (unsigned short)sa_addrlen(&rt->rt_gateway);
+		len = (unsigned short)(sizeof(*rtnh) + RTA_LENGTH(alen));
+		if (NLMSG_ALIGN(n->nlmsg_len) + RTNH_ALIGNU(len) > maxlen) {
+			errno = ENOBUFS;
+			return -1;
+		}
+
+		rtnh = (struct rtnexthop *)NLMSG_TAIL(n);
+		memset(rtnh, 0, sizeof(*rtnh));
+		rtnh->rtnh_len = len;
+		rtnh->rtnh_ifindex = (int)rt->rt_ifp->index;
+		gw = (struct rtattr *)(rtnh + 1);
+		gw->rta_type = RTA_GATEWAY;
+		gw->rta_len = (unsigned short)RTA_LENGTH(alen);
+		/* coverity[overrun-buffer-arg] */
+		memcpy(RTA_DATA(gw),
+		    (const char *)&rt->rt_gateway +
+		    sa_addroffset(&rt->rt_gateway), alen);
+		n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTNH_ALIGNU(len);
+	}
+
+	rta->rta_len = (unsigned short)((char *)NLMSG_TAIL(n) - (char *)rta);
+	return 0;
+}
+#endif
+
 #ifdef HAVE_NL80211_H
 static struct nlattr *
 nla_next(struct nlattr *nla, size_t *rem)
@@ -1318,25 +1938,55 @@ genl_parse(struct nlmsghdr *nlm, struct nlattr *tb[], int maxtype)
 	return nla_parse(tb, head, len, maxtype);
 }
 
+struct gnl_group {
+	const char *gg_name;
+	uint32_t gg_id;
+};
+
 static int
-_gnl_getfamily(__unused struct dhcpcd_ctx *ctx, __unused void *arg,
+_gnl_getfamily(__unused struct dhcpcd_ctx *ctx, void *arg,
     struct nlmsghdr *nlm)
 {
-	struct nlattr *tb[CTRL_ATTR_FAMILY_ID + 1];
+	struct gnl_group *gg = arg;
+	struct nlattr *tb[CTRL_ATTR_MCAST_GROUPS + 1];
+	struct nlattr *gtb[CTRL_ATTR_MCAST_GRP_ID + 1], *head, *grp;
 	uint16_t family;
+	const char *name;
+	size_t rem;
 
-	if (genl_parse(nlm, tb, CTRL_ATTR_FAMILY_ID) == -1)
+	if (genl_parse(nlm, tb, CTRL_ATTR_MCAST_GROUPS) == -1)
 		return -1;
 	if (tb[CTRL_ATTR_FAMILY_ID] == NULL) {
 		errno = ENOENT;
 		return -1;
 	}
 	memcpy(&family, NLA_DATA(tb[CTRL_ATTR_FAMILY_ID]), sizeof(family));
+
+	if (gg == NULL || tb[CTRL_ATTR_MCAST_GROUPS] == NULL)
+		return (int)family;
+	head = NLA_DATA(tb[CTRL_ATTR_MCAST_GROUPS]);
+	NLA_FOR_EACH_ATTR(grp, head, NLA_LEN(tb[CTRL_ATTR_MCAST_GROUPS]), rem) {
+		nla_parse(gtb, NLA_DATA(grp), NLA_LEN(grp),
+		    CTRL_ATTR_MCAST_GRP_ID);
+		if (gtb[CTRL_ATTR_MCAST_GRP_NAME] == NULL ||
+		    gtb[CTRL_ATTR_MCAST_GRP_ID] == NULL)
+			continue;
+		name = NLA_DATA(gtb[CTRL_ATTR_MCAST_GRP_NAME]);
+		if (strnlen(name, NLA_LEN(gtb[CTRL_ATTR_MCAST_GRP_NAME])) ==
+		    NLA_LEN(gtb[CTRL_ATTR_MCAST_GRP_NAME]) ||
+		    strcmp(name, gg->gg_name) != 0)
+			continue;
+		memcpy(&gg->gg_id, NLA_DATA(gtb[CTRL_ATTR_MCAST_GRP_ID]),
+		    sizeof(gg->gg_id));
+		break;
+	}
 	return (int)family;
 }
 
+/* If gg is not NULL, the id of the multicast group it names is
+ * filled in. */
 static int
-gnl_getfamily(struct dhcpcd_ctx *ctx, const char *name)
+gnl_getfamily(struct dhcpcd_ctx *ctx, const char *name, struct gnl_group *gg)
 {
 	struct nlmg nlm;
 
@@ -1350,17 +2000,106 @@ gnl_getfamily(struct dhcpcd_ctx *ctx, const char *name)
 	    CTRL_ATTR_FAMILY_NAME, name) == -1)
 		return -1;
 	return if_sendnetlink(ctx, NETLINK_GENERIC, &nlm.hdr,
-	    &_gnl_getfamily, NULL);
+	    &_gnl_getfamily, gg);
 }
 
+/*
+ * nl80211 announces connects, roams and disconnects to the mlme group.
+ * Listening to it lets the SSID found for an interface be kept until
+ * one of these says it may have changed.
+ */
 static int
-_if_getssid_nl80211(__unused struct dhcpcd_ctx *ctx, void *arg,
+_if_nl80211_event(struct dhcpcd_ctx *ctx, __unused void *arg,
     struct nlmsghdr *nlm)
 {
-	struct interface *ifp = arg;
-	struct nlattr *tb[NL80211_ATTR_BSS + 1];
-	struct nlattr *bss[NL80211_BSS_STATUS + 1];
-	uint32_t status;
+	struct nlattr *tb[NL80211_ATTR_IFINDEX + 1];
+	struct interface *ifp;
+	uint32_t ifindex;
+
+	if (ctx->ifaces == NULL ||
+	    genl_parse(nlm, tb, NL80211_ATTR_IFINDEX) == -1 ||
+	    tb[NL80211_ATTR_IFINDEX] == NULL)
+		return 0;
+
+	memcpy(&ifindex, NLA_DATA(tb[NL80211_ATTR_IFINDEX]), sizeof(ifindex));
+	ifp = if_findindex(ctx->ifaces, ifindex);
+	if (ifp != NULL)
+		ifp->ssid_valid = false;
+	return 0;
+}
+
+static void
+if_nl80211_drain(struct dhcpcd_ctx *ctx)
+{
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct interface *ifp;
+
+	while (if_getnetlink(ctx, priv->nl80211_fd, MSG_DONTWAIT,
+	    &_if_nl80211_event, NULL) != -1)
+		;
+	if (errno == EAGAIN)
+		return;
+	if (errno != ENOBUFS)
+		logerr(__func__);
+
+	/* We could have missed an event, so trust nothing. */
+	if (ctx->ifaces == NULL)
+		return;
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		ifp->ssid_valid = false;
+	}
+}
+
+static void
+if_nl80211_handle(void *arg, unsigned short events)
+{
+	struct dhcpcd_ctx *ctx = arg;
+
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+	if_nl80211_drain(ctx);
+}
+
+static void
+if_opennl80211(struct dhcpcd_ctx *ctx)
+{
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct gnl_group gg = { .gg_name = NL80211_MULTICAST_GROUP_MLME };
+	struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
+	int family, fd;
+
+	/* Without nl80211 there is nothing to listen to and
+	 * the SSID is looked up each time. */
+	family = gnl_getfamily(ctx, "nl80211", &gg);
+	if (family == -1 || gg.gg_id == 0)
+		return;
+	priv->nl80211_family = family;
+
+	fd = if_linksocket(&snl, NETLINK_GENERIC, SOCK_NONBLOCK);
+	if (fd == -1) {
+		logerr("%s: if_linksocket", __func__);
+		return;
+	}
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+	    &gg.gg_id, sizeof(gg.gg_id)) == -1 ||
+	    eloop_event_add(ctx->eloop, fd, ELE_READ,
+	    if_nl80211_handle, ctx) == -1)
+	{
+		logerr(__func__);
+		close(fd);
+		return;
+	}
+	priv->nl80211_fd = fd;
+}
+
+static int
+_if_getssid_nl80211(__unused struct dhcpcd_ctx *ctx, void *arg,
+    struct nlmsghdr *nlm)
+{
+	struct interface *ifp = arg;
+	struct nlattr *tb[NL80211_ATTR_BSS + 1];
+	struct nlattr *bss[NL80211_BSS_STATUS + 1];
+	uint32_t status;
 	unsigned char *ie;
 	int ie_len;
 
@@ -1410,13 +2149,19 @@ _if_getssid_nl80211(__unused struct dhcpcd_ctx *ctx, void *arg,
 static int
 if_getssid_nl80211(struct interface *ifp)
 {
+	struct priv *priv = (struct priv *)ifp->ctx->priv;
 	int family;
 	struct nlmg nlm;
 
 	errno = 0;
-	family = gnl_getfamily(ifp->ctx, "nl80211");
-	if (family == -1)
-		return -1;
+	if (priv->nl80211_family != 0)
+		family = priv->nl80211_family;
+	else {
+		family = gnl_getfamily(ifp->ctx, "nl80211", NULL);
+		if (family == -1)
+			return -1;
+		priv->nl80211_family = family;
+	}
 
 	/* Is this a wireless interface? */
 	memset(&nlm, 0, sizeof(nlm));
@@ -1449,9 +2194,21 @@ if_getssid(struct interface *ifp)
 	int r;
 
 #ifdef HAVE_NL80211_H
+	struct priv *priv = (struct priv *)ifp->ctx->priv;
+
+	/* Catch up on events first as the carrier change which brought
+	 * us here can be read before the roam which caused it. */
+	if (priv->nl80211_fd != -1) {
+		if_nl80211_drain(ifp->ctx);
+		if (ifp->ssid_valid)
+			return (int)ifp->ssid_len;
+	}
+
 	r = if_getssid_nl80211(ifp);
 	if (r == -1)
 		ifp->ssid_len = 0;
+	else
+		ifp->ssid_valid = priv->nl80211_fd != -1;
 #else
 	r = if_getssid_wext(ifp->name, ifp->ssid);
 	if (r != -1)
@@ -1462,6 +2219,13 @@ if_getssid(struct interface *ifp)
 	return r;
 }
 
+struct nlml
+{
+	struct nlmsghdr hdr;
+	struct ifinfomsg i;
+	char buffer[32];
+};
+
 struct nlma
 {
 	struct nlmsghdr hdr;
@@ -1531,18 +2295,545 @@ if_addressexists(struct interface *ifp, struct in_addr *addr)
 }
 #endif
 
+/*
+ * glibc getifaddrs(3) dumps links and addresses over netlink, allocates
+ * a list of them and then dhcpcd walks that list.
+ * Instead the dumps are read here and each link or address handed on
+ * as it comes.
+ * The replies are kept until the dump is done as acting on them can
+ * send requests of our own which would be mixed up with the dump.
+ */
+struct nldump {
+	struct nlbuf nd_buf;
+	size_t nd_len;
+	uint32_t nd_seq;
+};
+
+static int
+if_dumpmsg(__unused struct dhcpcd_ctx *ctx, void *arg, struct nlmsghdr *nlm)
+{
+	struct nldump *nd = arg;
+	struct iovec iov;
+	size_t len = NLMSG_ALIGN(nlm->nlmsg_len);
+
+	/* If the reply did not fit, the dump is asked for again. */
+	if (nlm->nlmsg_seq != nd->nd_seq) {
+		nd->nd_len = 0;
+		nd->nd_seq = nlm->nlmsg_seq;
+	}
+	if (if_nlbuf(&nd->nd_buf, nd->nd_len + len, &iov) == -1)
+		return -1;
+	memcpy(nd->nd_buf.nb_buf + nd->nd_len, nlm, nlm->nlmsg_len);
+	nd->nd_len += len;
+	return 0;
+}
+
+static int
+if_dump(struct dhcpcd_ctx *ctx, struct nlmsghdr *hdr, struct nldump *nd)
+{
+
+	nd->nd_len = 0;
+	nd->nd_seq = 0;
+	if (if_sendnetlink(ctx, NETLINK_ROUTE, hdr, if_dumpmsg, nd) == -1) {
+		free(nd->nd_buf.nb_buf);
+		return -1;
+	}
+	return 0;
+}
+
+int
+if_dumplinks(struct dhcpcd_ctx *ctx, const char *ifname,
+    void (*cb)(struct dhcpcd_ctx *, void *, const struct ifaddrs *),
+    void *cbarg)
+{
+	struct nlml nlm = {
+	    .hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+	    .hdr.nlmsg_type = RTM_GETLINK,
+	    .hdr.nlmsg_flags = NLM_F_REQUEST,
+	    .i.ifi_family = AF_UNSPEC,
+	};
+	struct nldump nd = { .nd_buf.nb_len = 0 };
+	struct nlmsghdr *n;
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	size_t len, rlen;
+	char ifn[IF_NAMESIZE];
+	/* Like sockaddr_ll, but big enough for any hardware address. */
+	union {
+		struct sockaddr_ll sll;
+		uint8_t buf[sizeof(struct sockaddr_ll) + HWADDR_LEN];
+	} sa;
+	struct ifaddrs ifa;
+
+	/* Just ask for the one link rather than dumping them all. */
+	if (ifname != NULL) {
+		if (add_attr_l(&nlm.hdr, sizeof(nlm), IFLA_IFNAME,
+		    ifname, (unsigned short)(strlen(ifname) + 1)) == -1)
+			return -1;
+	} else
+		nlm.hdr.nlmsg_flags |= NLM_F_DUMP;
+
+	if (if_dump(ctx, &nlm.hdr, &nd) == -1) {
+		/* It has gone already. */
+		if (ifname != NULL && errno == ENODEV)
+			return 0;
+		return -1;
+	}
+
+	len = nd.nd_len;
+	for (n = (void *)nd.nd_buf.nb_buf;
+	     len != 0 && NLMSG_OK(n, len);
+	     n = NLMSG_NEXT(n, len))
+	{
+		if (n->nlmsg_type != RTM_NEWLINK ||
+		    n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+			continue;
+		ifi = NLMSG_DATA(n);
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sll.sll_family = AF_PACKET;
+		sa.sll.sll_ifindex = ifi->ifi_index;
+		sa.sll.sll_hatype = ifi->ifi_type;
+		*ifn = '\0';
+		rta = IFLA_RTA(ifi);
+		rlen = NLMSG_PAYLOAD(n, sizeof(*ifi));
+		for (; RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen)) {
+			switch (rta->rta_type) {
+			case IFLA_IFNAME:
+				strlcpy(ifn, RTA_DATA(rta), sizeof(ifn));
+				break;
+			case IFLA_ADDRESS:
+				if (RTA_PAYLOAD(rta) > HWADDR_LEN)
+					break;
+				sa.sll.sll_halen =
+				    (unsigned char)RTA_PAYLOAD(rta);
+				memcpy(sa.buf +
+				    offsetof(struct sockaddr_ll, sll_addr),
+				    RTA_DATA(rta), sa.sll.sll_halen);
+				break;
+			}
+		}
+		if (*ifn == '\0')
+			continue;
+
+		memset(&ifa, 0, sizeof(ifa));
+		ifa.ifa_name = ifn;
+		ifa.ifa_flags = ifi->ifi_flags;
+		ifa.ifa_addr = (struct sockaddr *)(void *)&sa;
+		cb(ctx, cbarg, &ifa);
+	}
+
+	free(nd.nd_buf.nb_buf);
+	return 0;
+}
+
+int
+if_dumpaddrs(struct dhcpcd_ctx *ctx, struct if_head *ifs)
+{
+	struct nlma nlm = {
+	    .hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg)),
+	    .hdr.nlmsg_type = RTM_GETADDR,
+	    .hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+	    .ifa.ifa_family = AF_UNSPEC,
+	};
+	struct nldump nd = { .nd_buf.nb_len = 0 };
+	struct nlmsghdr *n;
+	struct ifaddrmsg *ifa;
+	struct rtattr *rta;
+	struct interface *ifp;
+	size_t len, rlen;
+	uint32_t flags;
+#ifdef INET
+	struct in_addr addr, net, brd;
+	bool has_local, has_brd;
+	const char *label;
+#endif
+#ifdef INET6
+	struct in6_addr addr6;
+#endif
+
+	/* Learning about one interface is common as each one arrives,
+	 * so have the kernel filter the dump for it. */
+	ifp = TAILQ_FIRST(ifs);
+	if (ifp != NULL && TAILQ_NEXT(ifp, next) == NULL)
+		nlm.ifa.ifa_index = ifp->index;
+
+	if (if_dump(ctx, &nlm.hdr, &nd) == -1)
+		return -1;
+
+	len = nd.nd_len;
+	for (n = (void *)nd.nd_buf.nb_buf;
+	     len != 0 && NLMSG_OK(n, len);
+	     n = NLMSG_NEXT(n, len))
+	{
+		if (n->nlmsg_type != RTM_NEWADDR ||
+		    n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+			continue;
+		ifa = NLMSG_DATA(n);
+		if ((ifp = if_findindex(ifs, ifa->ifa_index)) == NULL)
+			continue;
+
+		flags = ifa->ifa_flags;
+		rta = IFA_RTA(ifa);
+		rlen = NLMSG_PAYLOAD(n, sizeof(*ifa));
+		switch (ifa->ifa_family) {
+#ifdef INET
+		case AF_INET:
+			addr.s_addr = brd.s_addr = INADDR_ANY;
+			has_local = has_brd = false;
+			label = ifp->name;
+			inet_cidrtoaddr(ifa->ifa_prefixlen, &net);
+			for (; RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen)) {
+				switch (rta->rta_type) {
+				case IFA_ADDRESS:
+					if (ifp->flags & IFF_POINTOPOINT) {
+						memcpy(&brd.s_addr,
+						    RTA_DATA(rta),
+						    sizeof(brd.s_addr));
+						has_brd = true;
+					}
+					if (!has_local)
+						memcpy(&addr.s_addr,
+						    RTA_DATA(rta),
+						    sizeof(addr.s_addr));
+					break;
+				case IFA_BROADCAST:
+					memcpy(&brd.s_addr, RTA_DATA(rta),
+					    sizeof(brd.s_addr));
+					has_brd = true;
+					break;
+				case IFA_LOCAL:
+					memcpy(&addr.s_addr, RTA_DATA(rta),
+					    sizeof(addr.s_addr));
+					has_local = true;
+					break;
+				case IFA_LABEL:
+					/* An alias is named by its label. */
+					label = RTA_DATA(rta);
+					break;
+				case IFA_FLAGS:
+					memcpy(&flags, RTA_DATA(rta),
+					    sizeof(flags));
+					break;
+				}
+			}
+			ipv4_handleifa(ctx, RTM_NEWADDR, ifs, label,
+			    &addr, &net, has_brd ? &brd : NULL,
+			    (int)flags, 0);
+			break;
+#endif
+#ifdef INET6
+		case AF_INET6:
+			memset(&addr6, 0, sizeof(addr6));
+			for (; RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen)) {
+				switch (rta->rta_type) {
+				case IFA_ADDRESS:
+					memcpy(&addr6.s6_addr, RTA_DATA(rta),
+					    sizeof(addr6.s6_addr));
+					break;
+				case IFA_FLAGS:
+					memcpy(&flags, RTA_DATA(rta),
+					    sizeof(flags));
+					break;
+				}
+			}
+			ipv6_handleifa(ctx, RTM_NEWADDR, ifs, ifp->name,
+			    &addr6, ifa->ifa_prefixlen, (int)flags, 0);
+			break;
+#endif
+		}
+	}
+
+	free(nd.nd_buf.nb_buf);
+	return 0;
+}
+
 struct nlmr
 {
 	struct nlmsghdr hdr;
 	struct rtmsg rt;
+#ifdef HAVE_ROUTE_MULTIPATH
+	char buffer[512];	/* room for RT_MAXPATHS paths */
+#else
 	char buffer[256];
+#endif
+};
+
+#ifdef HAVE_ROUTE_NEXTHOP
+struct nlnh
+{
+	struct nlmsghdr hdr;
+	struct nhmsg nh;
+	char buffer[64];
 };
 
+static int
+if_nhsend(struct dhcpcd_ctx *ctx, uint16_t type, uint16_t flags,
+    uint32_t id, unsigned int ifindex, const struct sockaddr *gw)
+{
+	struct nlnh nlm = {
+	    .hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct nhmsg)),
+	    .hdr.nlmsg_type = type,
+	    .hdr.nlmsg_flags = NLM_F_REQUEST | flags,
+	};
+
+	add_attr_32(&nlm.hdr, sizeof(nlm), NHA_ID, id);
+	if (type == RTM_NEWNEXTHOP) {
+		nlm.nh.nh_family = (unsigned char)gw->sa_family;
+		nlm.nh.nh_protocol = NH_PROTOCOL;
+		nlm.nh.nh_flags = RTNH_F_ONLINK;
+		add_attr_32(&nlm.hdr, sizeof(nlm), NHA_OIF, ifindex);
+		add_attr_l(&nlm.hdr, sizeof(nlm), NHA_GATEWAY,
+		    (const char *)gw + sa_addroffset(gw),
+		    (unsigned short)sa_addrlen(gw));
+	}
+	return if_sendnetlink(ctx, NETLINK_ROUTE, &nlm.hdr, NULL, NULL);
+}
+
+static int
+_if_initnexthops(struct dhcpcd_ctx *ctx, __unused void *arg,
+    struct nlmsghdr *nlm)
+{
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct nhmsg *nhm;
+	struct rtattr *rta;
+	size_t len;
+	uint32_t id = 0;
+	unsigned int ifindex = 0;
+	union sa_ss gw = { .sa.sa_family = AF_UNSPEC };
+
+	if (nlm->nlmsg_type != RTM_NEWNEXTHOP ||
+	    nlm->nlmsg_len < NLMSG_LENGTH(sizeof(*nhm)))
+		return 0;
+
+	nhm = NLMSG_DATA(nlm);
+	rta = (struct rtattr *)((char *)nhm + NLMSG_ALIGN(sizeof(*nhm)));
+	len = NLMSG_PAYLOAD(nlm, sizeof(*nhm));
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case NHA_ID:
+			id = *(uint32_t *)RTA_DATA(rta);
+			break;
+		case NHA_OIF:
+			ifindex = *(unsigned int *)RTA_DATA(rta);
+			break;
+		case NHA_GATEWAY:
+			gw.sa.sa_family = nhm->nh_family;
+			memcpy((char *)&gw + sa_addroffset(&gw.sa),
+			    RTA_DATA(rta),
+			    MIN(sa_addrlen(&gw.sa), RTA_PAYLOAD(rta)));
+			break;
+		}
+	}
+
+	/* Pick ids after any already in use. */
+	if (id >= priv->nh_nextid)
+		priv->nh_nextid = id + 1;
+
+	/* Adopt the ones we left behind last time. */
+	if (nhm->nh_protocol == NH_PROTOCOL && id != 0 && ifindex != 0 &&
+	    gw.sa.sa_family != AF_UNSPEC &&
+	    if_nhfind(priv, ifindex, &gw.sa) == NULL &&
+	    if_nhnew(priv, id, ifindex, &gw.sa) == NULL)
+		return -1;
+	return 0;
+}
+
+static int
+if_initnexthops(struct dhcpcd_ctx *ctx)
+{
+	struct nlnh nlm = {
+	    .hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct nhmsg)),
+	    .hdr.nlmsg_type = RTM_GETNEXTHOP,
+	    .hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+	    .nh.nh_family = AF_UNSPEC,
+	};
+
+	return if_sendnetlink(ctx, NETLINK_ROUTE, &nlm.hdr,
+	    &_if_initnexthops, NULL);
+}
+
+/* Our nexthops are on-link, so only use them for gateways we know
+ * are. Otherwise the kernel would accept a gateway it cannot reach. */
+static bool
+if_nhonlink(struct interface *ifp, const struct sockaddr *gw)
+{
+
+	switch (gw->sa_family) {
+#ifdef INET
+	case AF_INET:
+		return ipv4_iffindmaskaddr(ifp,
+		    &satocsin(gw)->sin_addr) != NULL;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		return IN6_IS_ADDR_LINKLOCAL(&satocsin6(gw)->sin6_addr);
+#endif
+	default:
+		return false;
+	}
+}
+
+/* Find or make the nexthop for a gateway route and put its id
+ * in rt_nhid. Routes which cannot share one keep their gateway. */
+int
+if_nexthop(struct rt *rt)
+{
+	struct interface *ifp = rt->rt_ifp;
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct nexthop *nh;
+	uint32_t id;
+	int i;
+
+	rt->rt_nhid = 0;
+	if (priv->nh_state == NH_UNSUPPORTED ||
+#ifdef HAVE_ROUTE_MULTIPATH
+	    rt->rt_mpath != NULL ||
+#endif
+	    rt->rt_flags & RTF_REJECT ||
+	    ifp->flags & IFF_LOOPBACK ||
+	    rt->rt_gateway.sa_family != rt->rt_dest.sa_family ||
+	    sa_is_unspecified(&rt->rt_gateway) ||
+	    !if_nhonlink(ifp, &rt->rt_gateway))
+		return 0;
+	/* Whatever we send now would be batched with the routes. */
+	if (if_batching(ctx))
+		return 0;
+
+	if (priv->nh_state == NH_UNKNOWN) {
+		/* Shards would race each other for ids and prune
+		 * nexthops the others are about to use. */
+		if (SHARD_WORKER(ctx)) {
+			priv->nh_state = NH_UNSUPPORTED;
+			return 0;
+		}
+		if (if_initnexthops(ctx) == -1) {
+			if (errno != EOPNOTSUPP && errno != EINVAL)
+				return -1;
+			priv->nh_state = NH_UNSUPPORTED;
+			return 0;
+		}
+		priv->nh_state = NH_LOADED;
+	}
+
+	nh = if_nhfind(priv, ifp->index, &rt->rt_gateway);
+	if (nh != NULL) {
+		rt->rt_nhid = nh->nh_id;
+		return 0;
+	}
+
+	for (i = 0; i < NH_TRIES; i++) {
+		id = priv->nh_nextid++;
+		if (id == 0)
+			id = priv->nh_nextid++;
+		if (if_nhsend(ctx, RTM_NEWNEXTHOP, NLM_F_CREATE | NLM_F_EXCL,
+		    id, ifp->index, &rt->rt_gateway) != -1)
+			break;
+		if (errno != EEXIST)
+			return -1;
+	}
+	if (i == NH_TRIES)
+		return -1;
+
+	if ((nh = if_nhnew(priv, id, ifp->index, &rt->rt_gateway)) == NULL) {
+		if_nhsend(ctx, RTM_DELNEXTHOP, 0, id, 0, NULL);
+		return -1;
+	}
+	rt->rt_nhid = id;
+	return 0;
+}
+
+/* Point the nexthop at a new gateway, moving every route using it. */
+int
+if_nexthop_move(struct dhcpcd_ctx *ctx, uint32_t id,
+    const struct sockaddr *gw)
+{
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct nexthop *nh;
+	struct interface *ifp;
+
+	if ((nh = if_nhfindid(priv, id)) == NULL ||
+	    (ifp = if_findindex(ctx->ifaces, nh->nh_ifindex)) == NULL)
+	{
+		errno = ESRCH;
+		return -1;
+	}
+	if (!if_nhonlink(ifp, gw)) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+	/* Two nexthops with the same gateway would confuse if_nexthop. */
+	if (if_nhfind(priv, nh->nh_ifindex, gw) != NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (if_nhsend(ctx, RTM_NEWNEXTHOP, NLM_F_REPLACE,
+	    id, nh->nh_ifindex, gw) == -1)
+		return -1;
+	memcpy(&nh->nh_ss_gateway, gw, sa_len(gw));
+	return 0;
+}
+
+/* Delete our nexthops for the family which no kernel route uses.
+ * ctx->kroutes must be valid for the family. */
+void
+if_nexthop_prune(struct dhcpcd_ctx *ctx, int af)
+{
+	struct priv *priv = (struct priv *)ctx->priv;
+	struct nexthop *nh, *nhn;
+	struct rt *rt;
+
+	TAILQ_FOREACH_SAFE(nh, &priv->nexthops, nh_next, nhn) {
+		if (af != AF_UNSPEC && nh->nh_gateway.sa_family != af)
+			continue;
+		RB_TREE_FOREACH(rt, &ctx->kroutes) {
+			if (rt->rt_nhid == nh->nh_id)
+				break;
+		}
+		if (rt != NULL)
+			continue;
+		if (if_nhsend(ctx, RTM_DELNEXTHOP, 0,
+		    nh->nh_id, 0, NULL) == -1 && errno != ENOENT)
+			logerr("%s: %u", __func__, nh->nh_id);
+		TAILQ_REMOVE(&priv->nexthops, nh, nh_next);
+		free(nh);
+	}
+}
+
+/* The nexthop to send with the route.
+ * For a deletion it's the nexthop the kernel has the route through. */
+static uint32_t
+if_rtnhid(unsigned char cmd, const struct rt *rt)
+{
+	struct dhcpcd_ctx *ctx = rt->rt_ifp->ctx;
+	const struct rt *krt;
+
+	if (rt->rt_nhid != 0 || cmd != RTM_DELETE)
+		return rt->rt_nhid;
+	krt = rb_tree_find_node(&ctx->kroutes, rt);
+	if (krt == NULL || krt->rt_ifp != rt->rt_ifp ||
+	    sa_cmp(&krt->rt_gateway, &rt->rt_gateway) != 0)
+		return 0;
+	return krt->rt_nhid;
+}
+#endif
+
 int
 if_route(unsigned char cmd, const struct rt *rt)
 {
 	struct nlmr nlm;
 	bool gateway_unspec;
+#ifdef HAVE_ROUTE_NEXTHOP
+	uint32_t nhid = if_rtnhid(cmd, rt);
+#else
+	const uint32_t nhid = 0;
+#endif
+#ifdef HAVE_ROUTE_MULTIPATH
+	bool multipath = rt->rt_mpath != NULL;
+#else
+	const bool multipath = false;
+#endif
 
 	memset(&nlm, 0, sizeof(nlm));
 	nlm.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
@@ -1606,8 +2897,20 @@ if_route(unsigned char cmd, const struct rt *rt)
 	 * generic sockaddr and coverity thinks this will overrun. */
 	/* coverity[overrun-buffer-arg] */
 	ADDSA(RTA_DST, &rt->rt_dest);
+#ifdef HAVE_ROUTE_NEXTHOP
+	/* The nexthop has the gateway and interface. */
+	if (nhid != 0)
+		add_attr_32(&nlm.hdr, sizeof(nlm), RTA_NH_ID, nhid);
+#endif
+#ifdef HAVE_ROUTE_MULTIPATH
+	/* Each path has its own gateway and interface.
+	 * The kernel needs them all to delete the route as well. */
+	if (multipath &&
+	    add_attr_multipath(&nlm.hdr, sizeof(nlm), rt) == -1)
+		return -1;
+#endif
 	if (cmd == RTM_ADD || cmd == RTM_CHANGE) {
-		if (!gateway_unspec) {
+		if (!gateway_unspec && nhid == 0 && !multipath) {
 			/* coverity[overrun-buffer-arg] */
 			ADDSA(RTA_GATEWAY, &rt->rt_gateway);
 		}
@@ -1652,7 +2955,7 @@ if_route(unsigned char cmd, const struct rt *rt)
 #endif
 	}
 
-	if (!sa_is_loopback(&rt->rt_gateway))
+	if (!sa_is_loopback(&rt->rt_gateway) && nhid == 0 && !multipath)
 		add_attr_32(&nlm.hdr, sizeof(nlm), RTA_OIF, rt->rt_ifp->index);
 
 	if (rt->rt_metric != 0)
@@ -1689,6 +2992,7 @@ if_initrt(struct dhcpcd_ctx *ctx, rb_tree_t *kroutes, int af)
 	    .hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg)),
 	    .hdr.nlmsg_type = RTM_GETROUTE,
 	    .hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_MATCH,
+	    /* With NETLINK_GET_STRICT_CHK only this table is dumped. */
 	    .rt.rtm_table = RT_TABLE_MAIN,
 	    .rt.rtm_family = (unsigned char)af,
 	};
@@ -1701,9 +3005,165 @@ if_initrt(struct dhcpcd_ctx *ctx, rb_tree_t *kroutes, int af)
 /* Linux is a special snowflake when it comes to BPF. */
 const char *bpf_name = "Packet Socket";
 
-/* Linux is a special snowflake for opening BPF. */
+/*
+ * Without a receive ring, read up to BPF_BATCH frames per recvmmsg(2)
+ * so a flood of packets costs one syscall per batch rather than per frame.
+ */
+#define	BPF_BATCH		16
+
+struct bpf_batch {
+	struct mmsghdr msgs[BPF_BATCH];
+	struct iovec iovs[BPF_BATCH];
+	struct sockaddr_ll names[BPF_BATCH];
+#ifdef PACKET_AUXDATA
+	union {
+		struct cmsghdr hdr;
+		uint8_t buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+	} cmsgs[BPF_BATCH];
+#endif
+	uint8_t frames[BPF_BATCH][ETH_DATA_LEN];
+};
+
+/* Note where the frame came from.
+ * A shared socket has no interface to compare the destination with. */
+static void
+bpf_frame_info(struct bpf *bpf, const struct sockaddr_ll *sll,
+    const void *frame)
+{
+	bool bcast;
+
+	bpf->bpf_ifindex = (unsigned int)sll->sll_ifindex;
+	if (bpf->bpf_ifp == NULL)
+		bcast = sll->sll_pkttype == PACKET_BROADCAST;
+	else
+		bcast = bpf_frame_bcast(bpf->bpf_ifp, frame) == 0;
+	if (bcast)
+		bpf->bpf_flags |= BPF_BCAST;
+	else
+		bpf->bpf_flags &= ~BPF_BCAST;
+}
+
+#ifdef TPACKET3_HDRLEN
+/*
+ * A TPACKET_V3 ring lets the kernel pack frames into blocks which we
+ * walk from userland, so draining a block costs no syscalls.
+ * A block is handed to us when full or when it has been open for
+ * BPF_RING_TIMEOUT milliseconds, whichever comes first.
+ * That memory and latency is only worth it on busy hosts, see bpf_ring.
+ */
+#define	BPF_RING_BLOCK_SIZE	(1 << 15)
+#define	BPF_RING_BLOCK_NR	4
+#define	BPF_RING_FRAME_SIZE	(1 << 11)
+#define	BPF_RING_TIMEOUT	10
+/* Each frame header is followed by the sockaddr_ll it arrived on. */
+#define	BPF_RING_SLL		((sizeof(struct tpacket3_hdr) + \
+				TPACKET_ALIGNMENT - 1) & \
+				~(size_t)(TPACKET_ALIGNMENT - 1))
+
+static int
+bpf_open_ring(struct bpf *bpf)
+{
+	struct tpacket_req3 req = {
+		.tp_block_size = BPF_RING_BLOCK_SIZE,
+		.tp_block_nr = BPF_RING_BLOCK_NR,
+		.tp_frame_size = BPF_RING_FRAME_SIZE,
+		.tp_frame_nr = BPF_RING_BLOCK_NR *
+		    (BPF_RING_BLOCK_SIZE / BPF_RING_FRAME_SIZE),
+		.tp_retire_blk_tov = BPF_RING_TIMEOUT,
+	};
+	int n = TPACKET_V3;
+	size_t size;
+	void *ring;
+
+	if (setsockopt(bpf->bpf_fd, SOL_PACKET, PACKET_VERSION,
+	    &n, sizeof(n)) == -1)
+		return -1;
+	if (setsockopt(bpf->bpf_fd, SOL_PACKET, PACKET_RX_RING,
+	    &req, sizeof(req)) == -1)
+		return -1;
+
+	size = (size_t)req.tp_block_size * req.tp_block_nr;
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    bpf->bpf_fd, 0);
+	if (ring == MAP_FAILED) {
+		/* Remove the ring so recvmsg(2) works again. */
+		memset(&req, 0, sizeof(req));
+		setsockopt(bpf->bpf_fd, SOL_PACKET, PACKET_RX_RING,
+		    &req, sizeof(req));
+		return -1;
+	}
+
+	bpf->bpf_buffer = ring;
+	bpf->bpf_size = size;
+	bpf->bpf_block_size = req.tp_block_size;
+	bpf->bpf_block_nr = req.tp_block_nr;
+	return 0;
+}
+
+static inline struct tpacket_block_desc *
+bpf_ring_block(const struct bpf *bpf)
+{
+
+	return (void *)((char *)bpf->bpf_buffer +
+	    bpf->bpf_block * bpf->bpf_block_size);
+}
+
+static ssize_t
+bpf_read_ring(struct bpf *bpf, void *data, size_t len)
+{
+	struct tpacket_block_desc *bd = bpf_ring_block(bpf);
+	struct tpacket3_hdr *tp;
+	const char *frame;
+	ssize_t bytes = 0;
+
+	if (bpf->bpf_frame == NULL) {
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+			bpf->bpf_flags |= BPF_EOF;
+			return 0;
+		}
+		/* Don't read the block until we know we own it. */
+		__sync_synchronize();
+		bpf->bpf_block_pkts = bd->hdr.bh1.num_pkts;
+		bpf->bpf_frame = (char *)bd + bd->hdr.bh1.offset_to_first_pkt;
+	}
+
+	if (bpf->bpf_block_pkts != 0) {
+		tp = bpf->bpf_frame;
+		frame = (const char *)tp + tp->tp_mac;
+		bytes = (ssize_t)tp->tp_snaplen;
+		if ((size_t)bytes > len)
+			bytes = (ssize_t)len;
+		bpf_frame_info(bpf,
+		    (const void *)((const char *)tp + BPF_RING_SLL), frame);
+		if (tp->tp_status & TP_STATUS_CSUMNOTREADY)
+			bpf->bpf_flags |= BPF_PARTIALCSUM;
+		else
+			bpf->bpf_flags &= ~BPF_PARTIALCSUM;
+		memcpy(data, frame, (size_t)bytes);
+		bpf->bpf_frame = (char *)tp + tp->tp_next_offset;
+		bpf->bpf_block_pkts--;
+	}
+
+	if (bpf->bpf_block_pkts == 0) {
+		/* Hand the block back to the kernel and move on. */
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		bpf->bpf_frame = NULL;
+		bpf->bpf_block = (bpf->bpf_block + 1) % bpf->bpf_block_nr;
+		bd = bpf_ring_block(bpf);
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+			bpf->bpf_flags |= BPF_EOF;
+	}
+
+	return bytes;
+}
+#endif
+
+/* Linux is a special snowflake for opening BPF.
+ * Without an interface the socket is shared by all interfaces
+ * and bpf_read records where each frame arrived. */
 struct bpf *
-bpf_open(const struct interface *ifp,
+bpf_open(struct dhcpcd_ctx *ctx, const struct interface *ifp,
     int (*filter)(const struct bpf *, const struct in_addr *),
     const struct in_addr *ia)
 {
@@ -1716,7 +3176,7 @@ bpf_open(const struct interface *ifp,
 		.sll = {
 			.sll_family = PF_PACKET,
 			.sll_protocol = htons(ETH_P_ALL),
-			.sll_ifindex = (int)ifp->index,
+			.sll_ifindex = ifp != NULL ? (int)ifp->index : 0,
 		}
 	};
 #ifdef PACKET_AUXDATA
@@ -1728,12 +3188,6 @@ bpf_open(const struct interface *ifp,
 		return NULL;
 	bpf->bpf_ifp = ifp;
 
-	/* Allocate a suitably large buffer for a single packet. */
-	bpf->bpf_size = ETH_DATA_LEN;
-	bpf->bpf_buffer = malloc(bpf->bpf_size);
-	if (bpf->bpf_buffer == NULL)
-		goto eexit;
-
 	bpf->bpf_fd = xsocket(PF_PACKET, SOCK_RAW|SOCK_CXNB,htons(ETH_P_ALL));
 	if (bpf->bpf_fd == -1)
 		goto eexit;
@@ -1756,6 +3210,19 @@ bpf_open(const struct interface *ifp,
 	}
 #endif
 
+	/* Use a receive ring if asked, otherwise read a batch at a time. */
+#ifdef TPACKET3_HDRLEN
+	if (!ctx->bpf_ring || bpf_open_ring(bpf) == -1)
+#else
+	UNUSED(ctx);
+#endif
+	{
+		bpf->bpf_size = sizeof(struct bpf_batch);
+		bpf->bpf_buffer = malloc(bpf->bpf_size);
+		if (bpf->bpf_buffer == NULL)
+			goto eexit;
+	}
+
 	/*
 	 * At this point we could have received packets for the wrong
 	 * interface or which don't pass the filter.
@@ -1780,43 +3247,64 @@ eexit:
 ssize_t
 bpf_read(struct bpf *bpf, void *data, size_t len)
 {
+	struct bpf_batch *batch = bpf->bpf_buffer;
+	struct mmsghdr *mm;
 	ssize_t bytes;
-	struct iovec iov = {
-		.iov_base = bpf->bpf_buffer,
-		.iov_len = bpf->bpf_size,
-	};
-	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	int n;
 #ifdef PACKET_AUXDATA
-	union {
-		struct cmsghdr hdr;
-		uint8_t buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
-	} cmsgbuf = { .buf = { 0 } };
 	struct cmsghdr *cmsg;
 	struct tpacket_auxdata *aux;
 #endif
 
+#ifdef TPACKET3_HDRLEN
+	if (bpf->bpf_block_size != 0)
+		return bpf_read_ring(bpf, data, len);
+#endif
+
+	if (bpf->bpf_pos >= bpf->bpf_len) {
+		/* recvmmsg(2) updates these, so reset them each time. */
+		for (n = 0; n < BPF_BATCH; n++) {
+			mm = &batch->msgs[n];
+			memset(&mm->msg_hdr, 0, sizeof(mm->msg_hdr));
+			mm->msg_hdr.msg_iov = &batch->iovs[n];
+			mm->msg_hdr.msg_iovlen = 1;
+			mm->msg_hdr.msg_name = &batch->names[n];
+			mm->msg_hdr.msg_namelen = sizeof(batch->names[n]);
 #ifdef PACKET_AUXDATA
-	msg.msg_control = cmsgbuf.buf;
-	msg.msg_controllen = sizeof(cmsgbuf.buf);
+			mm->msg_hdr.msg_control = batch->cmsgs[n].buf;
+			mm->msg_hdr.msg_controllen =
+			    sizeof(batch->cmsgs[n].buf);
 #endif
+			batch->iovs[n].iov_base = batch->frames[n];
+			batch->iovs[n].iov_len = sizeof(batch->frames[n]);
+		}
+		n = recvmmsg(bpf->bpf_fd, batch->msgs, BPF_BATCH,
+		    MSG_DONTWAIT, NULL);
+		if (n == -1)
+			return -1;
+		bpf->bpf_len = (size_t)n;
+		bpf->bpf_pos = 0;
+		if (n == 0) {
+			bpf->bpf_flags |= BPF_EOF;
+			return 0;
+		}
+	}
 
-	bytes = recvmsg(bpf->bpf_fd, &msg, 0);
-	if (bytes == -1)
-		return -1;
-	bpf->bpf_flags |= BPF_EOF; /* We only ever read one packet. */
+	n = (int)bpf->bpf_pos++;
+	if (bpf->bpf_pos >= bpf->bpf_len)
+		bpf->bpf_flags |= BPF_EOF;
+	mm = &batch->msgs[n];
+	bytes = (ssize_t)mm->msg_len;
 	bpf->bpf_flags &= ~BPF_PARTIALCSUM;
 	if (bytes) {
-		if (bpf_frame_bcast(bpf->bpf_ifp, bpf->bpf_buffer) == 0)
-			bpf->bpf_flags |= BPF_BCAST;
-		else
-			bpf->bpf_flags &= ~BPF_BCAST;
+		bpf_frame_info(bpf, &batch->names[n], batch->frames[n]);
 		if ((size_t)bytes > len)
 			bytes = (ssize_t)len;
-		memcpy(data, bpf->bpf_buffer, (size_t)bytes);
+		memcpy(data, batch->frames[n], (size_t)bytes);
 #ifdef PACKET_AUXDATA
-		for (cmsg = CMSG_FIRSTHDR(&msg);
+		for (cmsg = CMSG_FIRSTHDR(&mm->msg_hdr);
 		     cmsg;
-		     cmsg = CMSG_NXTHDR(&msg, cmsg))
+		     cmsg = CMSG_NXTHDR(&mm->msg_hdr, cmsg))
 		{
 			if (cmsg->cmsg_level == SOL_PACKET &&
 			    cmsg->cmsg_type == PACKET_AUXDATA) {
@@ -1830,16 +3318,23 @@ bpf_read(struct bpf *bpf, void *data, size_t len)
 	return bytes;
 }
 
+/* Install the filter, leaving it unlocked so it can be replaced. */
 int
-bpf_attach(int s, void *filter, unsigned int filter_len)
+bpf_setfilter(int s, void *filter, unsigned int filter_len)
 {
 	struct sock_fprog pf = {
 		.filter = filter,
 		.len = (unsigned short)filter_len,
 	};
 
-	/* Install the filter. */
-	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &pf, sizeof(pf)) == -1)
+	return setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &pf, sizeof(pf));
+}
+
+int
+bpf_attach(int s, void *filter, unsigned int filter_len)
+{
+
+	if (bpf_setfilter(s, filter, filter_len) == -1)
 		return -1;
 
 #ifdef SO_LOCK_FILTER
@@ -1903,6 +3398,12 @@ if_address(unsigned char cmd, const struct ipv4_addr *ia)
 	if (if_sendnetlink(ia->iface->ctx, NETLINK_ROUTE, &nlm.hdr,
 	    NULL, NULL) == -1)
 		retval = -1;
+
+	/* Removing an address silently flushes the routes using it. */
+#ifdef IFA_F_NOPREFIXROUTE
+	if (cmd == RTM_DELADDR)
+#endif
+		rt_kinvalidate(ia->iface->ctx, AF_INET);
 	return retval;
 }
 
@@ -1964,6 +3465,13 @@ if_address6(unsigned char cmd, const struct ipv6_addr *ia)
 		if (!IN6_IS_ADDR_LINKLOCAL(&ia->addr))
 			flags |= IFA_F_NOPREFIXROUTE;
 #endif
+#if defined(IFA_F_OPTIMISTIC) && defined(IFA_F_NOPREFIXROUTE)
+		/* RFC 4429 forbids the source link-layer address option
+		 * our solicitations carry from an optimistic address. */
+		if (ia->iface->options->optimistic_dad &&
+		    !IN6_IS_ADDR_LINKLOCAL(&ia->addr))
+			flags |= IFA_F_OPTIMISTIC;
+#endif
 #if defined(IFA_F_MANAGETEMPADDR) || defined(IFA_F_NOPREFIXROUTE)
 		add_attr_32(&nlm.hdr, sizeof(nlm), IFA_FLAGS, flags);
 #endif
@@ -1975,6 +3483,12 @@ if_address6(unsigned char cmd, const struct ipv6_addr *ia)
 		    &cinfo, sizeof(cinfo));
 	}
 
+	/* The kernel manages prefix routes for addresses we delete
+	 * and for link-local addresses. */
+#ifdef IFA_F_NOPREFIXROUTE
+	if (cmd == RTM_DELADDR || IN6_IS_ADDR_LINKLOCAL(&ia->addr))
+#endif
+		rt_kinvalidate(ia->iface->ctx, AF_INET6);
 	return if_sendnetlink(ia->iface->ctx, NETLINK_ROUTE, &nlm.hdr,
 	    NULL, NULL);
 }
@@ -2029,17 +3543,20 @@ if_addrflags6(const struct interface *ifp, const struct in6_addr *addr,
 		.ifa_addr = *addr,
 		.ifa_found = false,
 	};
+	/* Ask for just the address rather than dumping them all.
+	 * The kernel returns EADDRNOTAVAIL if it does not have it. */
 	struct nlma nlm = {
 	    .hdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg)),
 	    .hdr.nlmsg_type = RTM_GETADDR,
-	    .hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_MATCH,
+	    .hdr.nlmsg_flags = NLM_F_REQUEST,
 	    .ifa.ifa_family = AF_INET6,
 	    .ifa.ifa_index = ifp->index,
 	};
 
-	int error = if_sendnetlink(ifp->ctx, NETLINK_ROUTE, &nlm.hdr,
-	    &_if_addrflags6, &ia);
-	if (error == -1)
+	if (add_attr_l(&nlm.hdr, sizeof(nlm), IFA_ADDRESS,
+	    addr->s6_addr, sizeof(addr->s6_addr)) == -1 ||
+	    if_sendnetlink(ifp->ctx, NETLINK_ROUTE, &nlm.hdr,
+	    &_if_addrflags6, &ia) == -1)
 		return -1;
 	if (!ia.ifa_found) {
 		errno = ESRCH;
@@ -2057,13 +3574,6 @@ if_getlifetime6(__unused struct ipv6_addr *ia)
 	return -1;
 }
 
-struct nlml
-{
-	struct nlmsghdr hdr;
-	struct ifinfomsg i;
-	char buffer[32];
-};
-
 #ifdef HAVE_IN6_ADDR_GEN_MODE_NONE
 static struct rtattr *
 add_attr_nest(struct nlmsghdr *n, unsigned short maxlen, unsigned short type)
@@ -2129,6 +3639,21 @@ if_setup_inet6(const struct interface *ifp)
 	    errno != ENODEV && errno != ENOTSUP && errno != EINVAL)
 		logdebug("%s: if_disable_autolinklocal", ifp->name);
 
+	/* The kernel ignores IFA_F_OPTIMISTIC unless optimistic_dad is set
+	 * and only announces optimistic addresses with use_optimistic. */
+	if (ifp->options->optimistic_dad) {
+		snprintf(path, sizeof(path), "%s/%s/optimistic_dad",
+		    p_conf, ifp->name);
+		if (check_proc_int(ctx, path) == 0 &&
+		    if_writepathuint(ctx, path, 1) == -1)
+			logerr("%s: %s", __func__, path);
+		snprintf(path, sizeof(path), "%s/%s/use_optimistic",
+		    p_conf, ifp->name);
+		if (check_proc_int(ctx, path) == 0 &&
+		    if_writepathuint(ctx, path, 1) == -1)
+			logerr("%s: %s", __func__, path);
+	}
+
 	/*
 	 * If not doing autoconf, don't disable the kernel from doing it.
 	 * If we need to, we should have another option actively disable it.
@@ -38,6 +38,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <paths.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,11 +51,13 @@
 #include "dhcp6.h"
 #include "dhcpcd-embedded.h"
 #include "duid.h"
+#include "hooks.h"
 #include "if.h"
 #include "if-options.h"
 #include "ipv4.h"
 #include "logerr.h"
 #include "sa.h"
+#include "shard.h"
 
 #define	IN_CONFIG_BLOCK(ifo)	((ifo)->options & DHCPCD_FORKED)
 #define	SET_CONFIG_BLOCK(ifo)	((ifo)->options |= DHCPCD_FORKED)
@@ -166,8 +169,33 @@ const struct option cf_options[] = {
 	{"inactive",        no_argument,       NULL, O_INACTIVE},
 	{"mudurl",          required_argument, NULL, O_MUDURL},
 	{"link_rcvbuf",     required_argument, NULL, O_LINK_RCVBUF},
+	{"link_resync",     required_argument, NULL, O_LINK_RESYNC},
 	{"configure",       no_argument,       NULL, O_CONFIGURE},
 	{"noconfigure",     no_argument,       NULL, O_NOCONFIGURE},
+	{"timer_slack",     required_argument, NULL, O_TIMER_SLACK},
+	{"renew_spread",    required_argument, NULL, O_RENEW_SPREAD},
+	{"shared_bpf",      no_argument,       NULL, O_SHARED_BPF},
+	{"bpf_ring",        no_argument,       NULL, O_BPF_RING},
+	{"lease_db",        no_argument,       NULL, O_LEASE_DB},
+	{"lease_write_delay", required_argument, NULL, O_LEASE_WRITE_DELAY},
+	{"start_concurrency", required_argument, NULL, O_START_CONCURRENCY},
+	{"start_interval",  required_argument, NULL, O_START_INTERVAL},
+	{"hook_runner",     no_argument,       NULL, O_HOOK_RUNNER},
+	{"builtin_hook",    required_argument, NULL, O_BUILTIN_HOOK},
+	{"warm_restart",    no_argument,       NULL, O_WARM_RESTART},
+	{"script_debounce", required_argument, NULL, O_SCRIPT_DEBOUNCE},
+	{"control_queue",   required_argument, NULL, O_CONTROL_QUEUE},
+	{"control_queue_policy", required_argument, NULL,
+	    O_CONTROL_QUEUE_POLICY},
+	{"multipath",       no_argument,       NULL, O_MULTIPATH},
+	{"carrier_holddown", required_argument, NULL, O_CARRIER_HOLDDOWN},
+	{"carrier_damping", required_argument, NULL, O_CARRIER_DAMPING},
+	{"shards",          required_argument, NULL, O_SHARDS},
+	{"optimistic_dad",  no_argument,       NULL, O_OPTIMISTIC_DAD},
+	{"trace",           no_argument,       NULL, O_TRACE},
+#ifndef SMALL
+	{"stats",           required_argument, NULL, O_STATS},
+#endif
 	{NULL,              0,                 NULL, '\0'}
 };
 
@@ -512,10 +540,10 @@ set_option_space(struct dhcpcd_ctx *ctx,
 		*dl = ctx->nd_opts_len;
 		*od = ifo->nd_override;
 		*odl = ifo->nd_override_len;
-		*request = ifo->requestmasknd;
-		*require = ifo->requiremasknd;
-		*no = ifo->nomasknd;
-		*reject = ifo->rejectmasknd;
+		*request = ifo->optmasks->requestmasknd;
+		*require = ifo->optmasks->requiremasknd;
+		*no = ifo->optmasks->nomasknd;
+		*reject = ifo->optmasks->rejectmasknd;
 		return;
 	}
 
@@ -525,10 +553,10 @@ set_option_space(struct dhcpcd_ctx *ctx,
 		*dl = ctx->dhcp6_opts_len;
 		*od = ifo->dhcp6_override;
 		*odl = ifo->dhcp6_override_len;
-		*request = ifo->requestmask6;
-		*require = ifo->requiremask6;
-		*no = ifo->nomask6;
-		*reject = ifo->rejectmask6;
+		*request = ifo->optmasks->requestmask6;
+		*require = ifo->optmasks->requiremask6;
+		*no = ifo->optmasks->nomask6;
+		*reject = ifo->optmasks->rejectmask6;
 		return;
 	}
 #endif
@@ -680,7 +708,8 @@ parse_option(struct dhcpcd_ctx *ctx, const char *ifname, struct if_options *ifo,
 	case 'P': /* FALLTHROUGH */
 	case 'T': /* FALLTHROUGH */
 	case 'U': /* FALLTHROUGH */
-	case 'V': /* We need to handle non interface options */
+	case 'V': /* FALLTHROUGH */
+	case O_STATS: /* We need to handle non interface options */
 		break;
 	case 'b':
 		ifo->options |= DHCPCD_BACKGROUND;
@@ -1317,7 +1346,8 @@ parse_option(struct dhcpcd_ctx *ctx, const char *ifname, struct if_options *ifo,
 
 		/* Block everything */
 		memset(ifo->nomask, 0xff, sizeof(ifo->nomask));
-		memset(ifo->nomask6, 0xff, sizeof(ifo->nomask6));
+		memset(ifo->optmasks->nomask6, 0xff,
+		    sizeof(ifo->optmasks->nomask6));
 
 		/* Allow the bare minimum through */
 #ifdef INET
@@ -1335,10 +1365,10 @@ parse_option(struct dhcpcd_ctx *ctx, const char *ifname, struct if_options *ifo,
 #endif
 
 #ifdef DHCP6
-		del_option_mask(ifo->nomask6, D6_OPTION_DNS_SERVERS);
-		del_option_mask(ifo->nomask6, D6_OPTION_DOMAIN_LIST);
-		del_option_mask(ifo->nomask6, D6_OPTION_SOL_MAX_RT);
-		del_option_mask(ifo->nomask6, D6_OPTION_INF_MAX_RT);
+		del_option_mask(ifo->optmasks->nomask6, D6_OPTION_DNS_SERVERS);
+		del_option_mask(ifo->optmasks->nomask6, D6_OPTION_DOMAIN_LIST);
+		del_option_mask(ifo->optmasks->nomask6, D6_OPTION_SOL_MAX_RT);
+		del_option_mask(ifo->optmasks->nomask6, D6_OPTION_INF_MAX_RT);
 #endif
 
 		break;
@@ -1421,6 +1451,67 @@ parse_option(struct dhcpcd_ctx *ctx, const char *ifname, struct if_options *ifo,
 	case O_NOALIAS:
 		ifo->options |= DHCPCD_NOALIAS;
 		break;
+	case O_SHARED_BPF:
+		ifo->options |= DHCPCD_SHARED_BPF;
+		break;
+	case O_LEASE_DB:
+		ifo->options |= DHCPCD_LEASEDB;
+		break;
+	case O_HOOK_RUNNER:
+		/* All the option bits are taken and the privileged
+		 * process only has the ctx, so keep it there. */
+		ctx->hook_runner = true;
+		break;
+	case O_BUILTIN_HOOK:
+		ARG_REQUIRED;
+		if (hooks_parse(&ctx->builtin_hooks, arg) == -1)
+			return -1;
+		break;
+	case O_WARM_RESTART:
+		ctx->warm_restart = true;
+		break;
+	case O_BPF_RING:
+		ctx->bpf_ring = true;
+		break;
+	case O_CONTROL_QUEUE:
+		ARG_REQUIRED;
+		fp = strwhite(arg);
+		if (fp != NULL) {
+			*fp++ = '\0';
+			fp = strskipwhite(fp);
+		}
+		ctx->control_queue_max = (unsigned int)strtou(arg, NULL, 0,
+		    0, UINT_MAX, &e);
+		if (e) {
+			logerrx("failed to convert control_queue %s", arg);
+			return -1;
+		}
+		if (fp == NULL)
+			break;
+		ctx->control_queue_bytes = (size_t)strtou(fp, NULL, 0,
+		    0, SIZE_MAX, &e);
+		if (e) {
+			logerrx("failed to convert control_queue %s", fp);
+			return -1;
+		}
+		break;
+	case O_CONTROL_QUEUE_POLICY:
+		ARG_REQUIRED;
+		if (strcmp(arg, "drop") == 0)
+			ctx->control_queue_policy = CONTROL_QUEUE_DROP;
+		else if (strcmp(arg, "collapse") == 0)
+			ctx->control_queue_policy = CONTROL_QUEUE_COLLAPSE;
+		else if (strcmp(arg, "disconnect") == 0)
+			ctx->control_queue_policy = CONTROL_QUEUE_DISCONNECT;
+		else {
+			logerrx("invalid control_queue_policy %s", arg);
+			return -1;
+		}
+		break;
+	case O_MULTIPATH:
+		/* Routes span interfaces, so this is for the ctx. */
+		ctx->rt_multipath = true;
+		break;
 #ifdef DHCP6
 	case O_IA_NA:
 		i = D6_OPTION_IA_NA;
@@ -2159,6 +2250,7 @@ err_sla:
 			goto invalid_token;
 		}
 		parse_string((char *)token->key, token->key_len, arg);
+		dhcp_auth_hmacinit(token);
 		TAILQ_INSERT_TAIL(&ifo->auth.tokens, token, next);
 		break;
 
@@ -2315,6 +2407,17 @@ invalid_token:
 			logerrx("failed to convert link_rcvbuf %s", arg);
 			return -1;
 		}
+#endif
+		break;
+	case O_LINK_RESYNC:
+#ifndef SMALL
+		ARG_REQUIRED;
+		ctx->link_resync = (unsigned int)strtou(arg, NULL, 0,
+		    0, UINT32_MAX, &e);
+		if (e) {
+			logerrx("failed to convert link_resync %s", arg);
+			return -1;
+		}
 #endif
 		break;
 	case O_CONFIGURE:
@@ -2323,6 +2426,134 @@ invalid_token:
 	case O_NOCONFIGURE:
 		ifo->options &= ~DHCPCD_CONFIGURE;
 		break;
+	case O_TIMER_SLACK:
+		ARG_REQUIRED;
+		ifo->timer_slack = (uint32_t)strtou(arg, NULL, 0, 0, UINT32_MAX,
+		    &e);
+		if (e) {
+			logerrx("failed to convert timer_slack %s", arg);
+			return -1;
+		}
+		break;
+	case O_RENEW_SPREAD:
+		ARG_REQUIRED;
+		ifo->renew_spread = (uint32_t)strtou(arg, NULL, 0,
+		    0, DHCP_SPREAD_MAX, &e);
+		if (e) {
+			logerrx("failed to convert renew_spread %s", arg);
+			return -1;
+		}
+		break;
+	case O_LEASE_WRITE_DELAY:
+		ARG_REQUIRED;
+		ifo->lease_write_delay = (uint32_t)strtou(arg, NULL, 0, 0,
+		    UINT32_MAX, &e);
+		if (e) {
+			logerrx("failed to convert lease_write_delay %s", arg);
+			return -1;
+		}
+		break;
+	case O_START_CONCURRENCY:
+		ARG_REQUIRED;
+		ifo->start_max = (uint32_t)strtou(arg, NULL, 0, 0,
+		    UINT32_MAX, &e);
+		if (e) {
+			logerrx("failed to convert start_concurrency %s", arg);
+			return -1;
+		}
+		break;
+	case O_START_INTERVAL:
+		ARG_REQUIRED;
+		ifo->start_interval = (uint32_t)strtou(arg, NULL, 0, 0,
+		    UINT32_MAX, &e);
+		if (e) {
+			logerrx("failed to convert start_interval %s", arg);
+			return -1;
+		}
+		break;
+	case O_SCRIPT_DEBOUNCE:
+		ARG_REQUIRED;
+		ifo->script_debounce = (uint32_t)strtou(arg, NULL, 0, 0,
+		    UINT32_MAX, &e);
+		if (e) {
+			logerrx("failed to convert script_debounce %s", arg);
+			return -1;
+		}
+		break;
+	case O_CARRIER_HOLDDOWN:
+		ARG_REQUIRED;
+		ifo->carrier_holddown = (uint32_t)strtou(arg, NULL, 0, 0,
+		    UINT32_MAX, &e);
+		if (e) {
+			logerrx("failed to convert carrier_holddown %s", arg);
+			return -1;
+		}
+		break;
+	case O_CARRIER_DAMPING:
+		ARG_REQUIRED;
+		ifo->carrier_suppress = CARRIER_SUPPRESS;
+		ifo->carrier_reuse = CARRIER_REUSE;
+		fp = strwhite(arg);
+		if (fp != NULL) {
+			*fp++ = '\0';
+			fp = strskipwhite(fp);
+		}
+		ifo->carrier_halflife = (uint32_t)strtou(arg, NULL, 0, 0,
+		    UINT32_MAX, &e);
+		if (e) {
+			logerrx("failed to convert carrier_damping %s", arg);
+			return -1;
+		}
+		if (fp == NULL)
+			break;
+		arg = fp;
+		fp = strwhite(arg);
+		if (fp != NULL) {
+			*fp++ = '\0';
+			fp = strskipwhite(fp);
+		}
+		ifo->carrier_suppress = (uint32_t)strtou(arg, NULL, 0,
+		    CARRIER_PENALTY, UINT16_MAX, &e);
+		if (e) {
+			logerrx("failed to convert carrier_damping %s", arg);
+			return -1;
+		}
+		if (fp != NULL) {
+			ifo->carrier_reuse = (uint32_t)strtou(fp, NULL, 0,
+			    1, UINT16_MAX, &e);
+			if (e) {
+				logerrx("failed to convert carrier_damping %s",
+				    fp);
+				return -1;
+			}
+		}
+		if (ifo->carrier_reuse >= ifo->carrier_suppress) {
+			logerrx("carrier_damping: "
+			    "reuse must be below suppress");
+			return -1;
+		}
+		break;
+	case O_SHARDS:
+#ifdef SHARDS
+		ARG_REQUIRED;
+		u = (unsigned long)strtou(arg, NULL, 0, 0, SHARDS_MAX, &e);
+		if (e) {
+			logerrx("failed to convert shards %s", arg);
+			return -1;
+		}
+		/* Workers are not added or removed once running. */
+		if (!(ctx->options & DHCPCD_STARTED))
+			ctx->shards = (unsigned int)u;
+#endif
+		break;
+	case O_OPTIMISTIC_DAD:
+		ifo->optimistic_dad = true;
+		break;
+	case O_TRACE:
+#ifdef TRACE
+		ctx->trace = true;
+#endif
+		break;
 	default:
 		return 0;
 	}
@@ -2337,30 +2568,291 @@ arg_required:
 #endif
 }
 
+/*
+ * A config file split into lines with each option name looked up once.
+ * read_config walks this rather than reading and splitting the file again
+ * for every interface and it's only rebuilt when the file mtime changes.
+ */
+#define	CF_OPTION	0
+#define	CF_INTERFACE	1
+#define	CF_SSID		2
+#define	CF_PROFILE	3
+
+struct cf_line {
+	int cl_type;
+	int cl_opt;		/* index into cf_options, -1 if unknown */
+	const char *cl_name;
+	const char *cl_arg;
+};
+
+struct cf_cache {
+	char *cc_buf;		/* the file, split into lines */
+	struct cf_line *cc_lines;
+	size_t cc_len;
+	char *cc_arg;		/* parse_option may modify its argument */
+	size_t cc_arglen;
+	time_t cc_mtime;
+	bool cc_defined;	/* definitions are loaded into ctx */
+	size_t cc_size;		/* bytes allocated, see config_cache_size */
+};
+
+static void
+cf_cache_free(struct cf_cache *cc)
+{
+
+	if (cc == NULL)
+		return;
+	free(cc->cc_buf);
+	free(cc->cc_lines);
+	free(cc->cc_arg);
+	free(cc);
+}
+
+void
+free_config_cache(struct dhcpcd_ctx *ctx)
+{
+
+	cf_cache_free(ctx->cf_cache);
+	ctx->cf_cache = NULL;
+	cf_cache_free(ctx->cf_embedded);
+	ctx->cf_embedded = NULL;
+}
+
+/* Bytes held by the cached config files. */
+size_t
+config_cache_size(const struct dhcpcd_ctx *ctx)
+{
+	size_t size = 0;
+
+	if (ctx->cf_cache != NULL)
+		size += ctx->cf_cache->cc_size;
+	if (ctx->cf_embedded != NULL)
+		size += ctx->cf_embedded->cc_size;
+	return size;
+}
+
+/* Free the option definitions loaded from the embedded config. */
+void
+free_definitions(struct dhcpcd_ctx *ctx)
+{
+	struct dhcp_opt *opt;
+
+#ifdef INET
+	if (ctx->dhcp_opts) {
+		for (opt = ctx->dhcp_opts;
+		    ctx->dhcp_opts_len > 0;
+		    opt++, ctx->dhcp_opts_len--)
+			free_dhcp_opt_embenc(opt);
+		free(ctx->dhcp_opts);
+		ctx->dhcp_opts = NULL;
+	}
+	free(ctx->dhcp_optmap);
+	ctx->dhcp_optmap = NULL;
+#endif
+#ifdef INET6
+	if (ctx->nd_opts) {
+		for (opt = ctx->nd_opts;
+		    ctx->nd_opts_len > 0;
+		    opt++, ctx->nd_opts_len--)
+			free_dhcp_opt_embenc(opt);
+		free(ctx->nd_opts);
+		ctx->nd_opts = NULL;
+	}
+	free(ctx->nd_optsort);
+	ctx->nd_optsort = NULL;
+#ifdef DHCP6
+	if (ctx->dhcp6_opts) {
+		for (opt = ctx->dhcp6_opts;
+		    ctx->dhcp6_opts_len > 0;
+		    opt++, ctx->dhcp6_opts_len--)
+			free_dhcp_opt_embenc(opt);
+		free(ctx->dhcp6_opts);
+		ctx->dhcp6_opts = NULL;
+	}
+	free(ctx->dhcp6_optsort);
+	ctx->dhcp6_optsort = NULL;
+#endif
+#endif
+	if (ctx->vivso) {
+		for (opt = ctx->vivso;
+		    ctx->vivso_len > 0;
+		    opt++, ctx->vivso_len--)
+			free_dhcp_opt_embenc(opt);
+		free(ctx->vivso);
+		ctx->vivso = NULL;
+	}
+}
+
+/* buf must be NUL terminated and is owned by the cache afterwards. */
+static struct cf_cache *
+cf_compile(char *buf, ssize_t buflen)
+{
+	struct cf_cache *cc;
+	struct cf_line *cl;
+	char *bp, *line, *option, *p;
+	size_t i, n, len;
+
+	if ((cc = calloc(1, sizeof(*cc))) == NULL) {
+		free(buf);
+		return NULL;
+	}
+	cc->cc_buf = buf;
+	cc->cc_size = (size_t)buflen;
+
+	n = 0;
+	bp = buf;
+	while ((line = get_line(&bp, &buflen)) != NULL) {
+		option = strsep(&line, " \t");
+		if (line)
+			line = strskipwhite(line);
+		/* Trim trailing whitespace */
+		if (line) {
+			p = line + strlen(line) - 1;
+			while (p != line &&
+			    (*p == ' ' || *p == '\t') &&
+			    *(p - 1) != '\\')
+				*p-- = '\0';
+		}
+
+		if (cc->cc_len == n) {
+			n = n == 0 ? 32 : n * 2;
+			cl = reallocarray(cc->cc_lines, n, sizeof(*cl));
+			if (cl == NULL)
+				goto err;
+			cc->cc_lines = cl;
+		}
+		cl = &cc->cc_lines[cc->cc_len++];
+		cl->cl_name = option;
+		cl->cl_arg = line;
+		cl->cl_opt = -1;
+		if (strcmp(option, "interface") == 0)
+			cl->cl_type = CF_INTERFACE;
+		else if (strcmp(option, "ssid") == 0)
+			cl->cl_type = CF_SSID;
+		else if (strcmp(option, "profile") == 0)
+			cl->cl_type = CF_PROFILE;
+		else {
+			cl->cl_type = CF_OPTION;
+			for (i = 0; i < __arraycount(cf_options); i++) {
+				if (cf_options[i].name != NULL &&
+				    strcmp(cf_options[i].name, option) == 0)
+				{
+					cl->cl_opt = (int)i;
+					break;
+				}
+			}
+		}
+
+		if (line != NULL) {
+			len = strlen(line) + 1;
+			if (len > cc->cc_arglen)
+				cc->cc_arglen = len;
+		}
+	}
+
+	if (cc->cc_arglen != 0 &&
+	    (cc->cc_arg = malloc(cc->cc_arglen)) == NULL)
+		goto err;
+	cc->cc_size = sizeof(*cc) + cc->cc_size + n * sizeof(*cl) +
+	    cc->cc_arglen;
+	return cc;
+
+err:
+	cf_cache_free(cc);
+	return NULL;
+}
+
+/* Return the compiled file, only reading it again if it has changed. */
+static struct cf_cache *
+cf_load(struct dhcpcd_ctx *ctx, struct cf_cache **ccp, const char *file)
+{
+	struct cf_cache *cc;
+	time_t mtime;
+	char *buf, *nbuf;
+	ssize_t buflen;
+
+	if (dhcp_filemtime(ctx, file, &mtime) == -1)
+		mtime = 0;
+	else if (*ccp != NULL && (*ccp)->cc_mtime == mtime && mtime != 0)
+		return *ccp;
+
+	cf_cache_free(*ccp);
+	*ccp = NULL;
+
+	if ((buf = malloc(UDPLEN_MAX)) == NULL) /* 64k max config file size */
+		return NULL;
+	buflen = dhcp_readfile(ctx, file, buf, UDPLEN_MAX);
+	if (buflen == -1) {
+		free(buf);
+		return NULL;
+	}
+	if (buflen == 0 || buf[buflen - 1] != '\0') {
+		if ((size_t)buflen < UDPLEN_MAX - 1)
+			buflen++;
+		buf[buflen - 1] = '\0';
+	}
+	if ((nbuf = realloc(buf, (size_t)buflen)) != NULL)
+		buf = nbuf;
+
+	if ((cc = cf_compile(buf, buflen)) == NULL)
+		return NULL;
+	/* If we could not date the file it's read again next time. */
+	cc->cc_mtime = mtime;
+	*ccp = cc;
+	return cc;
+}
+
 static int
-parse_config_line(struct dhcpcd_ctx *ctx, const char *ifname,
-    struct if_options *ifo, const char *opt, char *line,
+cf_parse(struct dhcpcd_ctx *ctx, const char *ifname,
+    struct if_options *ifo, struct cf_cache *cc, const struct cf_line *cl,
     struct dhcp_opt **ldop, struct dhcp_opt **edop)
 {
-	unsigned int i;
+	const struct option *o;
+	char *arg;
 
-	for (i = 0; i < sizeof(cf_options) / sizeof(cf_options[0]); i++) {
-		if (!cf_options[i].name ||
-		    strcmp(cf_options[i].name, opt) != 0)
-			continue;
+	if (cl->cl_opt == -1) {
+		if (!(ctx->options & DHCPCD_PRINT_PIDFILE))
+			logerrx("unknown option: %s", cl->cl_name);
+		return -1;
+	}
 
-		if (cf_options[i].has_arg == required_argument && !line) {
-			logerrx("option requires an argument -- %s", opt);
+	o = &cf_options[cl->cl_opt];
+	if (cl->cl_arg == NULL) {
+		if (o->has_arg == required_argument) {
+			logerrx("option requires an argument -- %s",
+			    cl->cl_name);
 			return -1;
 		}
-
-		return parse_option(ctx, ifname, ifo, cf_options[i].val, line,
-		    ldop, edop);
+		arg = NULL;
+	} else {
+		arg = cc->cc_arg;
+		strlcpy(arg, cl->cl_arg, cc->cc_arglen);
 	}
 
-	if (!(ctx->options & DHCPCD_PRINT_PIDFILE))
-		logerrx("unknown option: %s", opt);
-	return -1;
+	return parse_option(ctx, ifname, ifo, o->val, arg, ldop, edop);
+}
+
+static struct cf_cache *
+cf_embedded(struct dhcpcd_ctx *ctx)
+{
+
+#ifdef EMBEDDED_CONFIG
+	if (cf_load(ctx, &ctx->cf_embedded, EMBEDDED_CONFIG) == NULL)
+		logerr("%s: %s", __func__, EMBEDDED_CONFIG);
+#else
+	if (ctx->cf_embedded == NULL) {
+		char *buf;
+
+		/* Our embedded config is NULL terminated */
+		buf = strdup(dhcpcd_embedded_conf);
+		if (buf != NULL)
+			ctx->cf_embedded = cf_compile(buf,
+			    (ssize_t)strlen(buf) + 1);
+		if (ctx->cf_embedded == NULL)
+			logerr(__func__);
+	}
+#endif
+	return ctx->cf_embedded;
 }
 
 static void
@@ -2391,6 +2883,72 @@ finish_config(struct if_options *ifo)
 	if (!(ifo->options & DHCPCD_IPV6RS))
 		ifo->options &=
 		    ~(DHCPCD_IPV6RA_AUTOCONF | DHCPCD_IPV6RA_REQRDNSS);
+
+	/* Index any option overrides by code. */
+	free(ifo->dhcp_overmap);
+	if (ifo->dhcp_override_len != 0)
+		ifo->dhcp_overmap = dhcp_optmap(ifo->dhcp_override,
+		    ifo->dhcp_override_len);
+	else
+		ifo->dhcp_overmap = NULL;
+}
+
+static void
+if_optmasks_put(struct dhcpcd_ctx *ctx, struct if_optmasks *om)
+{
+
+	if (om == NULL || --om->refs != 0)
+		return;
+	if (om->interned)
+		TAILQ_REMOVE(&ctx->optmasks, om, next);
+	free(om);
+}
+
+/* Give ifo a private copy of its masks so they can be changed. */
+int
+if_optmasks_unshare(struct dhcpcd_ctx *ctx, struct if_options *ifo)
+{
+	struct if_optmasks *om = ifo->optmasks, *nom;
+
+	if (!om->interned)
+		return 0;
+	if (om->refs == 1) {
+		TAILQ_REMOVE(&ctx->optmasks, om, next);
+		om->interned = false;
+		return 0;
+	}
+
+	if ((nom = malloc(sizeof(*nom))) == NULL)
+		return -1;
+	memcpy(nom, om, sizeof(*nom));
+	nom->refs = 1;
+	nom->interned = false;
+	if_optmasks_put(ctx, om);
+	ifo->optmasks = nom;
+	return 0;
+}
+
+/* Share the masks of ifo with any interface that has the same. */
+void
+if_optmasks_intern(struct dhcpcd_ctx *ctx, struct if_options *ifo)
+{
+	struct if_optmasks *om = ifo->optmasks, *m;
+	const size_t off = offsetof(struct if_optmasks, requestmasknd);
+
+	if (om->interned)
+		return;
+	TAILQ_FOREACH(m, &ctx->optmasks, next) {
+		if (memcmp((char *)m + off, (char *)om + off,
+		    sizeof(*m) - off) == 0)
+		{
+			m->refs++;
+			free(om);
+			ifo->optmasks = m;
+			return;
+		}
+	}
+	om->interned = true;
+	TAILQ_INSERT_TAIL(&ctx->optmasks, om, next);
 }
 
 struct if_options *
@@ -2403,6 +2961,12 @@ default_config(struct dhcpcd_ctx *ctx)
 		logerr(__func__);
 		return NULL;
 	}
+	if ((ifo->optmasks = calloc(1, sizeof(*ifo->optmasks))) == NULL) {
+		logerr(__func__);
+		free(ifo);
+		return NULL;
+	}
+	ifo->optmasks->refs = 1;
 	ifo->options |= DHCPCD_IF_UP | DHCPCD_LINK | DHCPCD_INITIAL_DELAY;
 	ifo->timeout = DEFAULT_TIMEOUT;
 	ifo->reboot = DEFAULT_REBOOT;
@@ -2429,9 +2993,8 @@ read_config(struct dhcpcd_ctx *ctx,
     const char *ifname, const char *ssid, const char *profile)
 {
 	struct if_options *ifo;
-	char buf[UDPLEN_MAX], *bp; /* 64k max config file size */
-	char *line, *option, *p;
-	ssize_t buflen;
+	struct cf_cache *cc;
+	const struct cf_line *cl, *cle;
 	size_t vlen;
 	int skip, have_profile, new_block, had_block;
 #if !defined(INET) || !defined(INET6)
@@ -2478,8 +3041,13 @@ read_config(struct dhcpcd_ctx *ctx,
 	/* Reset route order */
 	ctx->rt_order = 0;
 
-	/* Parse our embedded options file */
-	if (ifname == NULL && !(ctx->options & DHCPCD_PRINT_PIDFILE)) {
+	/* Parse our embedded options file.
+	 * The definitions are kept over a reload unless the file changes. */
+	if (ifname == NULL && !(ctx->options & DHCPCD_PRINT_PIDFILE) &&
+	    (cc = cf_embedded(ctx)) != NULL && !cc->cc_defined)
+	{
+		free_definitions(ctx);
+
 		/* Space for initial estimates */
 #if defined(INET) && defined(INITDEFINES)
 		ifo->dhcp_override =
@@ -2507,47 +3075,16 @@ read_config(struct dhcpcd_ctx *ctx,
 			ifo->dhcp6_override_len = INITDEFINE6S;
 #endif
 
-		/* Now load our embedded config */
-#ifdef EMBEDDED_CONFIG
-		buflen = dhcp_readfile(ctx, EMBEDDED_CONFIG, buf, sizeof(buf));
-		if (buflen == -1) {
-			logerr("%s: %s", __func__, EMBEDDED_CONFIG);
-			return ifo;
-		}
-		if (buf[buflen - 1] != '\0') {
-			if ((size_t)buflen < sizeof(buf) - 1)
-				buflen++;
-			buf[buflen - 1] = '\0';
-		}
-#else
-		buflen = (ssize_t)strlcpy(buf, dhcpcd_embedded_conf,
-		    sizeof(buf));
-		if ((size_t)buflen >= sizeof(buf)) {
-			logerrx("%s: embedded config too big", __func__);
-			return ifo;
-		}
-		/* Our embedded config is NULL terminated */
-#endif
-		bp = buf;
-		while ((line = get_line(&bp, &buflen)) != NULL) {
-			option = strsep(&line, " \t");
-			if (line)
-				line = strskipwhite(line);
-			/* Trim trailing whitespace */
-			if (line) {
-				p = line + strlen(line) - 1;
-				while (p != line &&
-				    (*p == ' ' || *p == '\t') &&
-				    *(p - 1) != '\\')
-					*p-- = '\0';
-			}
-			parse_config_line(ctx, NULL, ifo, option, line,
-			    &ldop, &edop);
-		}
+		ldop = edop = NULL;
+		for (cl = cc->cc_lines, cle = cl + cc->cc_len; cl != cle; cl++)
+			cf_parse(ctx, NULL, ifo, cc, cl, &ldop, &edop);
 
 #ifdef INET
 		ctx->dhcp_opts = ifo->dhcp_override;
 		ctx->dhcp_opts_len = ifo->dhcp_override_len;
+		free(ctx->dhcp_optmap);
+		ctx->dhcp_optmap = dhcp_optmap(ctx->dhcp_opts,
+		    ctx->dhcp_opts_len);
 #else
 		for (i = 0, opt = ifo->dhcp_override;
 		    i < ifo->dhcp_override_len;
@@ -2561,9 +3098,14 @@ read_config(struct dhcpcd_ctx *ctx,
 #ifdef INET6
 		ctx->nd_opts = ifo->nd_override;
 		ctx->nd_opts_len = ifo->nd_override_len;
+		free(ctx->nd_optsort);
+		ctx->nd_optsort = dhcp_optsort(ctx->nd_opts, ctx->nd_opts_len);
 #ifdef DHCP6
 		ctx->dhcp6_opts = ifo->dhcp6_override;
 		ctx->dhcp6_opts_len = ifo->dhcp6_override_len;
+		free(ctx->dhcp6_optsort);
+		ctx->dhcp6_optsort = dhcp_optsort(ctx->dhcp6_opts,
+		    ctx->dhcp6_opts_len);
 #endif
 #else
 		for (i = 0, opt = ifo->nd_override;
@@ -2586,39 +3128,23 @@ read_config(struct dhcpcd_ctx *ctx,
 		ctx->vivso_len = ifo->vivso_override_len;
 		ifo->vivso_override = NULL;
 		ifo->vivso_override_len = 0;
+		cc->cc_defined = true;
 	}
 
 	/* Parse our options file */
-	buflen = dhcp_readfile(ctx, ctx->cffile, buf, sizeof(buf));
-	if (buflen == -1) {
+	cc = cf_load(ctx, &ctx->cf_cache, ctx->cffile);
+	if (cc == NULL) {
 		/* dhcpcd can continue without it, but no DNS options
 		 * would be requested ... */
 		logerr("%s: %s", __func__, ctx->cffile);
 		return ifo;
 	}
-	if (buf[buflen - 1] != '\0') {
-		if ((size_t)buflen < sizeof(buf) - 1)
-			buflen++;
-		buf[buflen - 1] = '\0';
-	}
-	dhcp_filemtime(ctx, ctx->cffile, &ifo->mtime);
+	ifo->mtime = cc->cc_mtime;
 
 	ldop = edop = NULL;
 	skip = have_profile = new_block = 0;
 	had_block = ifname == NULL ? 1 : 0;
-	bp = buf;
-	while ((line = get_line(&bp, &buflen)) != NULL) {
-		option = strsep(&line, " \t");
-		if (line)
-			line = strskipwhite(line);
-		/* Trim trailing whitespace */
-		if (line) {
-			p = line + strlen(line) - 1;
-			while (p != line &&
-			    (*p == ' ' || *p == '\t') &&
-			    *(p - 1) != '\\')
-				*p-- = '\0';
-		}
+	for (cl = cc->cc_lines, cle = cl + cc->cc_len; cl != cle; cl++) {
 		if (skip == 0 && new_block) {
 			had_block = 1;
 			new_block = 0;
@@ -2627,16 +3153,16 @@ read_config(struct dhcpcd_ctx *ctx,
 		}
 
 		/* Start of an interface block, skip if not ours */
-		if (strcmp(option, "interface") == 0) {
+		if (cl->cl_type == CF_INTERFACE) {
 			char **n;
 
 			new_block = 1;
-			if (line == NULL) {
+			if (cl->cl_arg == NULL) {
 				/* No interface given */
 				skip = 1;
 				continue;
 			}
-			if (ifname && strcmp(line, ifname) == 0)
+			if (ifname && strcmp(cl->cl_arg, ifname) == 0)
 				skip = 0;
 			else
 				skip = 1;
@@ -2650,7 +3176,7 @@ read_config(struct dhcpcd_ctx *ctx,
 				continue;
 			}
 			ctx->ifcv = n;
-			ctx->ifcv[ctx->ifcc] = strdup(line);
+			ctx->ifcv[ctx->ifcc] = strdup(cl->cl_arg);
 			if (ctx->ifcv[ctx->ifcc] == NULL) {
 				logerr(__func__);
 				continue;
@@ -2659,18 +3185,21 @@ read_config(struct dhcpcd_ctx *ctx,
 			continue;
 		}
 		/* Start of an ssid block, skip if not ours */
-		if (strcmp(option, "ssid") == 0) {
+		if (cl->cl_type == CF_SSID) {
 			new_block = 1;
-			if (ssid && line && strcmp(line, ssid) == 0)
+			if (ssid && cl->cl_arg &&
+			    strcmp(cl->cl_arg, ssid) == 0)
 				skip = 0;
 			else
 				skip = 1;
 			continue;
 		}
 		/* Start of a profile block, skip if not ours */
-		if (strcmp(option, "profile") == 0) {
+		if (cl->cl_type == CF_PROFILE) {
 			new_block = 1;
-			if (profile && line && strcmp(line, profile) == 0) {
+			if (profile && cl->cl_arg &&
+			    strcmp(cl->cl_arg, profile) == 0)
+			{
 				skip = 0;
 				have_profile = 1;
 			} else
@@ -2679,12 +3208,13 @@ read_config(struct dhcpcd_ctx *ctx,
 		}
 		/* Skip arping if we have selected a profile but not parsing
 		 * one. */
-		if (profile && !have_profile && strcmp(option, "arping") == 0)
+		if (profile && !have_profile && cl->cl_opt != -1 &&
+		    cf_options[cl->cl_opt].val == O_ARPING)
 			continue;
 		if (skip)
 			continue;
 
-		parse_config_line(ctx, ifname, ifo, option, line, &ldop, &edop);
+		cf_parse(ctx, ifname, ifo, cc, cl, &ldop, &edop);
 	}
 
 	if (profile && !have_profile) {
@@ -2697,6 +3227,8 @@ read_config(struct dhcpcd_ctx *ctx,
 		ifo->options &= ~DHCPCD_WAITOPTS;
 	CLEAR_CONFIG_BLOCK(ifo);
 	finish_config(ifo);
+	if_optmasks_intern(ctx, ifo);
+	MEMSAMPLE(ctx, MEM_OPTIONS);
 	return ifo;
 }
 
@@ -2709,6 +3241,10 @@ add_options(struct dhcpcd_ctx *ctx, const char *ifname,
 
 	if (argc == 0)
 		return 1;
+	if (if_optmasks_unshare(ctx, ifo) == -1) {
+		logerr(__func__);
+		return -1;
+	}
 
 	optind = 0;
 	r = 1;
@@ -2730,17 +3266,308 @@ add_options(struct dhcpcd_ctx *ctx, const char *ifname,
 	}
 
 	finish_config(ifo);
+	if_optmasks_intern(ctx, ifo);
 	return r;
 }
 
+/*
+ * Options which only change how dhcpcd itself runs and so never need
+ * an interface restarting.
+ * The timers, debounces and script environment are read each time
+ * they are used so they are left out of if_options_diff as well.
+ */
+#define	IFO_RUNOPTS	(DHCPCD_RELEASE | DHCPCD_RTBUILD | DHCPCD_DEBUG | \
+			 DHCPCD_PERSISTENT | DHCPCD_DAEMONISE | \
+			 DHCPCD_DAEMONISED | DHCPCD_TEST | DHCPCD_MANAGER | \
+			 DHCPCD_BACKGROUND | DHCPCD_NOWAITIP | \
+			 DHCPCD_WAITOPTS | DHCPCD_WARNINGS | \
+			 DHCPCD_DUMPLEASE | DHCPCD_PRIVSEP | DHCPCD_FORKED | \
+			 DHCPCD_STARTED | DHCPCD_STOPPING | \
+			 DHCPCD_LAUNCHER | DHCPCD_EXITING | \
+			 DHCPCD_INITIAL_DELAY | DHCPCD_PRINT_PIDFILE | \
+			 DHCPCD_ONESHOT | DHCPCD_INACTIVE | \
+			 DHCPCD_PRIVSEPROOT)
+#define	IFO_DHCPOPTS	(DHCPCD_ARP | DHCPCD_STATIC | DHCPCD_SHARED_BPF | \
+			 DHCPCD_LASTLEASE | DHCPCD_INFORM | DHCPCD_REQUEST | \
+			 DHCPCD_IPV4LL | DHCPCD_VENDORRAW | \
+			 DHCPCD_XID_HWADDR | DHCPCD_BROADCAST | \
+			 DHCPCD_NOALIAS | DHCPCD_DHCP | DHCPCD_WANTDHCP | \
+			 DHCPCD_LASTLEASE_EXTEND | DHCPCD_BOOTP)
+#define	IFO_DHCP6OPTS	(DHCPCD_IA_FORCED | DHCPCD_DHCP6 | DHCPCD_INFORM6)
+#define	IFO_BOTHOPTS	(DHCPCD_HOSTNAME | DHCPCD_HOSTNAME_SHORT | \
+			 DHCPCD_CLIENTID | DHCPCD_DUID | DHCPCD_IAID)
+#define	IFO_IPV6OPTS	(DHCPCD_IPV6RS | DHCPCD_IPV6RA_REQRDNSS | \
+			 DHCPCD_IPV6RA_AUTOCONF | DHCPCD_SLAACPRIVATE | \
+			 DHCPCD_SLAACTEMP)
+
+static bool
+ifo_strveq(char *const *v1, char *const *v2)
+{
+
+	if (v1 == NULL || v2 == NULL)
+		return v1 == v2;
+	for (; *v1 != NULL && *v2 != NULL; v1++, v2++) {
+		if (strcmp(*v1, *v2) != 0)
+			return false;
+	}
+	return *v1 == *v2;
+}
+
+static bool
+ifo_opteq(const struct dhcp_opt *o1, size_t len1,
+    const struct dhcp_opt *o2, size_t len2)
+{
+
+	if (len1 != len2)
+		return false;
+	for (; len1 > 0; o1++, o2++, len1--) {
+		if (o1->option != o2->option ||
+		    o1->type != o2->type ||
+		    o1->len != o2->len ||
+		    memcmp(o1->bitflags, o2->bitflags,
+		    sizeof(o1->bitflags)) != 0 ||
+		    (o1->var == NULL) != (o2->var == NULL) ||
+		    (o1->var != NULL && strcmp(o1->var, o2->var) != 0) ||
+		    !ifo_opteq(o1->embopts, o1->embopts_len,
+		    o2->embopts, o2->embopts_len) ||
+		    !ifo_opteq(o1->encopts, o1->encopts_len,
+		    o2->encopts, o2->encopts_len))
+			return false;
+	}
+	return true;
+}
+
+static bool
+ifo_routeseq(const struct if_options *o1, const struct if_options *o2)
+{
+	rb_tree_t *t1 = UNCONST(&o1->routes), *t2 = UNCONST(&o2->routes);
+	const struct rt *r1, *r2;
+
+	for (r1 = RB_TREE_MIN(t1), r2 = RB_TREE_MIN(t2);
+	    r1 != NULL && r2 != NULL;
+	    r1 = RB_TREE_NEXT(t1, UNCONST(r1)),
+	    r2 = RB_TREE_NEXT(t2, UNCONST(r2)))
+	{
+		if (sa_cmp(&r1->rt_dest, &r2->rt_dest) != 0 ||
+		    sa_cmp(&r1->rt_netmask, &r2->rt_netmask) != 0 ||
+		    sa_cmp(&r1->rt_gateway, &r2->rt_gateway) != 0 ||
+		    r1->rt_mtu != r2->rt_mtu)
+			return false;
+	}
+	return r1 == r2;
+}
+
+#ifdef INET6
+static bool
+ifo_iaeq(const struct if_options *o1, const struct if_options *o2)
+{
+	const struct if_ia *ia1, *ia2;
+	size_t i;
+#ifndef SMALL
+	const struct if_sla *sla1, *sla2;
+	size_t j;
+#endif
+
+	if (o1->ia_len != o2->ia_len)
+		return false;
+	for (i = 0; i < o1->ia_len; i++) {
+		ia1 = &o1->ia[i];
+		ia2 = &o2->ia[i];
+		if (memcmp(ia1->iaid, ia2->iaid, sizeof(ia1->iaid)) != 0 ||
+		    ia1->ia_type != ia2->ia_type ||
+		    ia1->iaid_set != ia2->iaid_set ||
+		    !IN6_ARE_ADDR_EQUAL(&ia1->addr, &ia2->addr) ||
+		    ia1->prefix_len != ia2->prefix_len)
+			return false;
+#ifndef SMALL
+		if (ia1->sla_max != ia2->sla_max ||
+		    ia1->sla_len != ia2->sla_len)
+			return false;
+		for (j = 0; j < ia1->sla_len; j++) {
+			sla1 = &ia1->sla[j];
+			sla2 = &ia2->sla[j];
+			if (strcmp(sla1->ifname, sla2->ifname) != 0 ||
+			    sla1->sla != sla2->sla ||
+			    sla1->prefix_len != sla2->prefix_len ||
+			    sla1->suffix != sla2->suffix ||
+			    sla1->sla_set != sla2->sla_set)
+				return false;
+		}
+#endif
+	}
+	return true;
+}
+#endif
+
+static bool
+ifo_vivcoeq(const struct if_options *o1, const struct if_options *o2)
+{
+	size_t i;
+
+	if (o1->vivco_en != o2->vivco_en || o1->vivco_len != o2->vivco_len)
+		return false;
+	for (i = 0; i < o1->vivco_len; i++) {
+		if (o1->vivco[i].len != o2->vivco[i].len ||
+		    memcmp(o1->vivco[i].data, o2->vivco[i].data,
+		    o1->vivco[i].len) != 0)
+			return false;
+	}
+	return true;
+}
+
+static bool
+ifo_autheq(const struct auth *a1, const struct auth *a2)
+{
+#ifdef AUTH
+	const struct token *t1, *t2;
+#endif
+
+	if (a1->options != a2->options)
+		return false;
+#ifdef AUTH
+	if (a1->protocol != a2->protocol ||
+	    a1->algorithm != a2->algorithm ||
+	    a1->rdm != a2->rdm ||
+	    a1->token_snd_secretid != a2->token_snd_secretid ||
+	    a1->token_rcv_secretid != a2->token_rcv_secretid)
+		return false;
+	for (t1 = TAILQ_FIRST(&a1->tokens), t2 = TAILQ_FIRST(&a2->tokens);
+	    t1 != NULL && t2 != NULL;
+	    t1 = TAILQ_NEXT(t1, next), t2 = TAILQ_NEXT(t2, next))
+	{
+		if (t1->secretid != t2->secretid ||
+		    t1->expire != t2->expire ||
+		    t1->realm_len != t2->realm_len ||
+		    t1->key_len != t2->key_len ||
+		    (t1->realm_len > 0 &&
+		    memcmp(t1->realm, t2->realm, t1->realm_len) != 0) ||
+		    memcmp(t1->key, t2->key, t1->key_len) != 0)
+			return false;
+	}
+	return t1 == t2;
+#else
+	return true;
+#endif
+}
+
+/*
+ * Work out which protocols have to be restarted to move an interface
+ * from the options in o1 to those in o2, so a reload only disturbs
+ * what has changed. Anything not known to belong to one protocol
+ * restarts the whole interface.
+ */
+unsigned int
+if_options_diff(const struct if_options *o1, const struct if_options *o2)
+{
+	const struct if_optmasks *m1 = o1->optmasks, *m2 = o2->optmasks;
+	unsigned long long opts;
+	unsigned int changed = 0;
+
+	opts = (o1->options ^ o2->options) & ~IFO_RUNOPTS;
+	if (opts & IFO_DHCPOPTS)
+		changed |= IFO_CHANGED_DHCP;
+	if (opts & IFO_DHCP6OPTS)
+		changed |= IFO_CHANGED_DHCP6;
+	if (opts & IFO_BOTHOPTS)
+		changed |= IFO_CHANGED_DHCP | IFO_CHANGED_DHCP6;
+	if (opts & IFO_IPV6OPTS)
+		changed |= IFO_CHANGED_IPV6;
+	if (opts & DHCPCD_GATEWAY)
+		changed |= IFO_CHANGED_ROUTES;
+	if (opts & ~(IFO_DHCPOPTS | IFO_DHCP6OPTS | IFO_BOTHOPTS |
+	    IFO_IPV6OPTS | DHCPCD_GATEWAY))
+		changed |= IFO_CHANGED_IF;
+
+	if (o1->metric != o2->metric ||
+	    o1->randomise_hwaddr != o2->randomise_hwaddr)
+		changed |= IFO_CHANGED_IF;
+
+	if (memcmp(o1->iaid, o2->iaid, sizeof(o1->iaid)) != 0 ||
+	    strcmp(o1->hostname, o2->hostname) != 0 ||
+	    o1->fqdn != o2->fqdn ||
+	    memcmp(o1->vendorclassid, o2->vendorclassid,
+	    sizeof(o1->vendorclassid)) != 0 ||
+	    memcmp(o1->clientid, o2->clientid, sizeof(o1->clientid)) != 0 ||
+	    memcmp(o1->userclass, o2->userclass, sizeof(o1->userclass)) != 0 ||
+	    memcmp(o1->vendor, o2->vendor, sizeof(o1->vendor)) != 0 ||
+	    memcmp(o1->mudurl, o2->mudurl, sizeof(o1->mudurl)) != 0 ||
+	    o1->timeout != o2->timeout ||
+	    o1->reboot != o2->reboot ||
+	    !ifo_vivcoeq(o1, o2) ||
+	    !ifo_opteq(o1->vivso_override, o1->vivso_override_len,
+	    o2->vivso_override, o2->vivso_override_len) ||
+	    !ifo_autheq(&o1->auth, &o2->auth))
+		changed |= IFO_CHANGED_DHCP | IFO_CHANGED_DHCP6;
+
+	if (memcmp(o1->requestmask, o2->requestmask,
+	    sizeof(o1->requestmask)) != 0 ||
+	    memcmp(o1->requiremask, o2->requiremask,
+	    sizeof(o1->requiremask)) != 0 ||
+	    memcmp(o1->nomask, o2->nomask, sizeof(o1->nomask)) != 0 ||
+	    memcmp(o1->rejectmask, o2->rejectmask,
+	    sizeof(o1->rejectmask)) != 0 ||
+	    memcmp(o1->dstmask, o2->dstmask, sizeof(o1->dstmask)) != 0 ||
+	    o1->leasetime != o2->leasetime ||
+	    o1->req_addr.s_addr != o2->req_addr.s_addr ||
+	    o1->req_mask.s_addr != o2->req_mask.s_addr ||
+	    o1->req_brd.s_addr != o2->req_brd.s_addr ||
+	    o1->mtu != o2->mtu ||
+	    !ifo_strveq(o1->config, o2->config) ||
+	    o1->blacklist_len != o2->blacklist_len ||
+	    (o1->blacklist_len > 0 && memcmp(o1->blacklist, o2->blacklist,
+	    o1->blacklist_len * sizeof(*o1->blacklist)) != 0) ||
+	    o1->whitelist_len != o2->whitelist_len ||
+	    (o1->whitelist_len > 0 && memcmp(o1->whitelist, o2->whitelist,
+	    o1->whitelist_len * sizeof(*o1->whitelist)) != 0) ||
+	    o1->arping_len != o2->arping_len ||
+	    (o1->arping_len > 0 && memcmp(o1->arping, o2->arping,
+	    (size_t)o1->arping_len * sizeof(*o1->arping)) != 0) ||
+	    (o1->fallback == NULL) != (o2->fallback == NULL) ||
+	    (o1->fallback != NULL &&
+	    strcmp(o1->fallback, o2->fallback) != 0) ||
+	    !ifo_opteq(o1->dhcp_override, o1->dhcp_override_len,
+	    o2->dhcp_override, o2->dhcp_override_len))
+		changed |= IFO_CHANGED_DHCP;
+
+	/* Interned masks are the same if they are shared. */
+	if (m1 != m2 &&
+	    memcmp(m1->requestmask6, m2->requestmask6,
+	    sizeof(*m1) - offsetof(struct if_optmasks, requestmask6)) != 0)
+		changed |= IFO_CHANGED_DHCP6;
+	if (!ifo_opteq(o1->dhcp6_override, o1->dhcp6_override_len,
+	    o2->dhcp6_override, o2->dhcp6_override_len))
+		changed |= IFO_CHANGED_DHCP6;
+#ifdef INET6
+	if (!ifo_iaeq(o1, o2))
+		changed |= IFO_CHANGED_DHCP6;
+#endif
+
+	if (m1 != m2 &&
+	    memcmp(m1->requestmasknd, m2->requestmasknd,
+	    offsetof(struct if_optmasks, requestmask6) -
+	    offsetof(struct if_optmasks, requestmasknd)) != 0)
+		changed |= IFO_CHANGED_IPV6;
+	if (!IN6_ARE_ADDR_EQUAL(&o1->req_addr6, &o2->req_addr6) ||
+	    o1->req_prefix_len != o2->req_prefix_len ||
+#ifdef INET6
+	    !IN6_ARE_ADDR_EQUAL(&o1->token, &o2->token) ||
+#endif
+	    !ifo_opteq(o1->nd_override, o1->nd_override_len,
+	    o2->nd_override, o2->nd_override_len))
+		changed |= IFO_CHANGED_IPV6;
+	if (o1->optimistic_dad != o2->optimistic_dad)
+		changed |= IFO_CHANGED_IPV6 | IFO_CHANGED_DHCP6;
+
+	if (!ifo_routeseq(o1, o2))
+		changed |= IFO_CHANGED_ROUTES;
+
+	return changed;
+}
+
 void
 free_options(struct dhcpcd_ctx *ctx, struct if_options *ifo)
 {
 	size_t i;
-#ifdef RT_FREE_ROUTE_TABLE
-	struct interface *ifp;
-	struct rt *rt;
-#endif
 	struct dhcp_opt *opt;
 	struct vivco *vo;
 #ifdef AUTH
@@ -2750,6 +3577,7 @@ free_options(struct dhcpcd_ctx *ctx, struct if_options *ifo)
 	if (ifo == NULL)
 		return;
 
+	if_optmasks_put(ctx, ifo->optmasks);
 	if (ifo->environ) {
 		i = 0;
 		while (ifo->environ[i])
@@ -2763,18 +3591,6 @@ free_options(struct dhcpcd_ctx *ctx, struct if_options *ifo)
 		free(ifo->config);
 	}
 
-#ifdef RT_FREE_ROUTE_TABLE
-	/* Stupidly, we don't know the interface when creating the options.
-	 * As such, make sure each route has one so they can goto the
-	 * free list. */
-	ifp = ctx->ifaces != NULL ? TAILQ_FIRST(ctx->ifaces) : NULL;
-	if (ifp != NULL) {
-		RB_TREE_FOREACH(rt, &ifo->routes) {
-			if (rt->rt_ifp == NULL)
-				rt->rt_ifp = ifp;
-		}
-	}
-#endif
 	rt_headclear0(ctx, &ifo->routes, AF_UNSPEC);
 
 	free(ifo->arping);
@@ -2786,6 +3602,7 @@ free_options(struct dhcpcd_ctx *ctx, struct if_options *ifo)
 	    opt++, ifo->dhcp_override_len--)
 		free_dhcp_opt_embenc(opt);
 	free(ifo->dhcp_override);
+	free(ifo->dhcp_overmap);
 	for (opt = ifo->nd_override;
 	    ifo->nd_override_len > 0;
 	    opt++, ifo->nd_override_len--)
@@ -2819,6 +3636,7 @@ free_options(struct dhcpcd_ctx *ctx, struct if_options *ifo)
 		if (token->realm_len)
 			free(token->realm);
 		free(token->key);
+		free(token->hmac);
 		free(token);
 	}
 #endif
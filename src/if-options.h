@@ -50,6 +50,11 @@
 #define DEFAULT_TIMEOUT		30
 #define DEFAULT_REBOOT		5
 
+/* Each carrier loss costs this, as BGP route flap damping does. */
+#define CARRIER_PENALTY		1000
+#define CARRIER_SUPPRESS	2000
+#define CARRIER_REUSE		750
+
 #ifndef HOSTNAME_MAX_LEN
 #define HOSTNAME_MAX_LEN	250	/* 255 - 3 (FQDN) - 2 (DNS enc) */
 #endif
@@ -65,12 +70,14 @@
 #define DHCPCD_GATEWAY			(1ULL << 3)
 #define DHCPCD_STATIC			(1ULL << 4)
 #define DHCPCD_DEBUG			(1ULL << 5)
+#define DHCPCD_SHARED_BPF		(1ULL << 6)
 #define DHCPCD_LASTLEASE		(1ULL << 7)
 #define DHCPCD_INFORM			(1ULL << 8)
 #define DHCPCD_REQUEST			(1ULL << 9)
 #define DHCPCD_IPV4LL			(1ULL << 10)
 #define DHCPCD_DUID			(1ULL << 11)
 #define DHCPCD_PERSISTENT		(1ULL << 12)
+#define DHCPCD_LEASEDB			(1ULL << 13)
 #define DHCPCD_DAEMONISE		(1ULL << 14)
 #define DHCPCD_DAEMONISED		(1ULL << 15)
 #define DHCPCD_TEST			(1ULL << 16)
@@ -183,6 +190,28 @@
 #define O_CONFIGURE		O_BASE + 50
 #define O_NOCONFIGURE		O_BASE + 51
 #define O_RANDOMISE_HWADDR	O_BASE + 52
+#define O_STATS			O_BASE + 53
+#define O_TIMER_SLACK		O_BASE + 54
+#define O_SHARED_BPF		O_BASE + 55
+#define O_LEASE_DB		O_BASE + 56
+#define O_LEASE_WRITE_DELAY	O_BASE + 57
+#define O_START_CONCURRENCY	O_BASE + 58
+#define O_START_INTERVAL	O_BASE + 59
+#define O_HOOK_RUNNER		O_BASE + 60
+#define O_SCRIPT_DEBOUNCE	O_BASE + 61
+#define O_CONTROL_QUEUE		O_BASE + 62
+#define O_CONTROL_QUEUE_POLICY	O_BASE + 63
+#define O_MULTIPATH		O_BASE + 64
+#define O_LINK_RESYNC		O_BASE + 65
+#define O_CARRIER_HOLDDOWN	O_BASE + 66
+#define O_CARRIER_DAMPING	O_BASE + 67
+#define O_SHARDS		O_BASE + 68
+#define O_OPTIMISTIC_DAD	O_BASE + 69
+#define O_TRACE			O_BASE + 70
+#define O_BUILTIN_HOOK		O_BASE + 71
+#define O_WARM_RESTART		O_BASE + 72
+#define O_RENEW_SPREAD		O_BASE + 73
+#define O_BPF_RING		O_BASE + 74
 
 extern const struct option cf_options[];
 
@@ -214,6 +243,35 @@ struct vivco {
 	uint8_t *data;
 };
 
+/*
+ * The 16 bit option masks take 64k, so interfaces with the same masks
+ * share one read only copy, see if_optmasks_intern.
+ */
+struct if_optmasks {
+	TAILQ_ENTRY(if_optmasks) next;
+	unsigned int refs;
+	bool interned;
+	uint8_t requestmasknd[(UINT16_MAX + 1) / NBBY];
+	uint8_t requiremasknd[(UINT16_MAX + 1) / NBBY];
+	uint8_t nomasknd[(UINT16_MAX + 1) / NBBY];
+	uint8_t rejectmasknd[(UINT16_MAX + 1) / NBBY];
+	uint8_t requestmask6[(UINT16_MAX + 1) / NBBY];
+	uint8_t requiremask6[(UINT16_MAX + 1) / NBBY];
+	uint8_t nomask6[(UINT16_MAX + 1) / NBBY];
+	uint8_t rejectmask6[(UINT16_MAX + 1) / NBBY];
+};
+TAILQ_HEAD(if_optmasks_head, if_optmasks);
+
+/* What has to be restarted for a change of options, see if_options_diff */
+#define	IFO_CHANGED_IF		(1U << 0)	/* the whole interface */
+#define	IFO_CHANGED_DHCP	(1U << 1)	/* DHCP, IPv4LL and ARP */
+#define	IFO_CHANGED_DHCP6	(1U << 2)
+#define	IFO_CHANGED_IPV6	(1U << 3)	/* RS, SLAAC and static */
+#define	IFO_CHANGED_ROUTES	(1U << 4)	/* just rebuild the routes */
+#define	IFO_CHANGED_ALL		(IFO_CHANGED_IF | IFO_CHANGED_DHCP | \
+				 IFO_CHANGED_DHCP6 | IFO_CHANGED_IPV6 | \
+				 IFO_CHANGED_ROUTES)
+
 struct if_options {
 	time_t mtime;
 	uint8_t iaid[4];
@@ -223,19 +281,23 @@ struct if_options {
 	uint8_t nomask[256 / NBBY];
 	uint8_t rejectmask[256 / NBBY];
 	uint8_t dstmask[256 / NBBY];
-	uint8_t requestmasknd[(UINT16_MAX + 1) / NBBY];
-	uint8_t requiremasknd[(UINT16_MAX + 1) / NBBY];
-	uint8_t nomasknd[(UINT16_MAX + 1) / NBBY];
-	uint8_t rejectmasknd[(UINT16_MAX + 1) / NBBY];
-	uint8_t requestmask6[(UINT16_MAX + 1) / NBBY];
-	uint8_t requiremask6[(UINT16_MAX + 1) / NBBY];
-	uint8_t nomask6[(UINT16_MAX + 1) / NBBY];
-	uint8_t rejectmask6[(UINT16_MAX + 1) / NBBY];
+	struct if_optmasks *optmasks;
 	uint32_t leasetime;
 	uint32_t timeout;
 	uint32_t reboot;
+	uint32_t timer_slack;
+	uint32_t renew_spread;		/* percent */
+	uint32_t lease_write_delay;
+	uint32_t start_max;
+	uint32_t start_interval;
+	uint32_t script_debounce;
+	uint32_t carrier_holddown;	/* see dhcpcd_carrierdamp */
+	uint32_t carrier_halflife;
+	uint32_t carrier_suppress;
+	uint32_t carrier_reuse;
 	unsigned long long options;
 	bool randomise_hwaddr;
+	bool optimistic_dad;
 
 	struct in_addr req_addr;
 	struct in_addr req_mask;
@@ -272,6 +334,7 @@ struct if_options {
 
 	struct dhcp_opt *dhcp_override;
 	size_t dhcp_override_len;
+	struct dhcp_opt **dhcp_overmap;
 	struct dhcp_opt *nd_override;
 	size_t nd_override_len;
 	struct dhcp_opt *dhcp6_override;
@@ -292,5 +355,12 @@ int add_options(struct dhcpcd_ctx *, const char *,
     struct if_options *, int, char **);
 void free_dhcp_opt_embenc(struct dhcp_opt *);
 void free_options(struct dhcpcd_ctx *, struct if_options *);
+void free_definitions(struct dhcpcd_ctx *);
+void free_config_cache(struct dhcpcd_ctx *);
+size_t config_cache_size(const struct dhcpcd_ctx *);
+int if_optmasks_unshare(struct dhcpcd_ctx *, struct if_options *);
+void if_optmasks_intern(struct dhcpcd_ctx *, struct if_options *);
+unsigned int if_options_diff(const struct if_options *,
+    const struct if_options *);
 
 #endif
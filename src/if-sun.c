@@ -1603,6 +1603,39 @@ if_initrt(struct dhcpcd_ctx *ctx, rb_tree_t *routes, int af)
 	return 0;
 }
 
+/* Route socket messages are not acknowledged,
+ * so there is nothing to gain from a transaction. */
+int
+if_txn_begin(__unused struct dhcpcd_ctx *ctx)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+bool
+if_txn_active(__unused const struct dhcpcd_ctx *ctx)
+{
+
+	return false;
+}
+
+size_t
+if_txn_count(__unused const struct dhcpcd_ctx *ctx)
+{
+
+	return 0;
+}
+
+ssize_t
+if_txn_end(__unused struct dhcpcd_ctx *ctx,
+    __unused const struct psr_result **results)
+{
+
+	errno = EINVAL;
+	return -1;
+}
+
 
 #ifdef INET
 /* XXX We should fix this to write via the BPF interface. */
@@ -1632,6 +1665,9 @@ if_address(unsigned char cmd, const struct ipv4_addr *ia)
 	} addr, mask, brd;
 	int fd = ia->iface->ctx->pf_inet_fd;
 
+	/* The kernel adds and removes prefix routes for the address. */
+	rt_kinvalidate(ia->iface->ctx, AF_INET);
+
 	/* Either remove the alias or ensure it exists. */
 	if (if_plumb(cmd, ia->iface->ctx, AF_INET, ia->alias) == -1 &&
 	    errno != EEXIST)
@@ -1675,6 +1711,8 @@ if_address6(unsigned char cmd, const struct ipv6_addr *ia)
 	} addr, mask;
 	int			fd, r;
 
+	rt_kinvalidate(ia->iface->ctx, AF_INET6);
+
 	/* Either remove the alias or ensure it exists. */
 	if (if_plumb(cmd, ia->iface->ctx, AF_INET6, ia->alias) == -1 &&
 	    errno != EEXIST)
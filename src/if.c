@@ -70,6 +70,7 @@
 #include "dev.h"
 #include "dhcp.h"
 #include "dhcp6.h"
+#include "handoff.h"
 #include "if.h"
 #include "if-options.h"
 #include "ipv4.h"
@@ -77,6 +78,7 @@
 #include "ipv6nd.h"
 #include "logerr.h"
 #include "privsep.h"
+#include "shard.h"
 
 void
 if_free(struct interface *ifp)
@@ -99,6 +101,7 @@ if_free(struct interface *ifp)
 	ipv6_free(ifp);
 #endif
 	rt_freeif(ifp);
+	handoff_free(ifp);
 	free_options(ifp->ctx, ifp->options);
 	free(ifp);
 }
@@ -270,6 +273,16 @@ if_markaddrsstale(struct if_head *ifs)
 	}
 }
 
+#ifdef IF_NETLINK_DUMP
+void
+if_learnaddrs(struct dhcpcd_ctx *ctx, struct if_head *ifs,
+    __unused struct ifaddrs **ifaddrs)
+{
+
+	if (if_dumpaddrs(ctx, ifs) == -1)
+		logerr("if_dumpaddrs");
+}
+#else
 void
 if_learnaddrs(struct dhcpcd_ctx *ctx, struct if_head *ifs,
     struct ifaddrs **ifaddrs)
@@ -365,6 +378,7 @@ if_learnaddrs(struct dhcpcd_ctx *ctx, struct if_head *ifs,
 		freeifaddrs(*ifaddrs);
 	*ifaddrs = NULL;
 }
+#endif
 
 void
 if_deletestaleaddrs(struct if_head *ifs)
@@ -437,14 +451,13 @@ if_check_arphrd(struct interface *ifp, unsigned int active, bool if_noconf)
 }
 #endif
 
-struct if_head *
-if_discover(struct dhcpcd_ctx *ctx, struct ifaddrs **ifaddrs,
-    int argc, char * const *argv)
+/* Adds the interface ifa describes to ifs unless it's unsuitable. */
+static int
+if_discoverifa(struct dhcpcd_ctx *ctx, struct if_head *ifs,
+    int argc, char * const *argv, const struct ifaddrs *ifa)
 {
-	struct ifaddrs *ifa;
 	int i;
 	unsigned int active;
-	struct if_head *ifs;
 	struct interface *ifp;
 	struct if_spec spec;
 	bool if_noconf;
@@ -460,255 +473,298 @@ if_discover(struct dhcpcd_ctx *ctx, struct ifaddrs **ifaddrs,
 	struct ifreq ifr;
 #endif
 
-	if ((ifs = malloc(sizeof(*ifs))) == NULL) {
-		logerr(__func__);
-		return NULL;
-	}
-	TAILQ_INIT(ifs);
+	if (if_nametospec(ifa->ifa_name, &spec) != 0)
+		return 0;
 
-#ifdef PRIVSEP_GETIFADDRS
-	if (ctx->options & DHCPCD_PRIVSEP) {
-		if (ps_root_getifaddrs(ctx, ifaddrs) == -1) {
-			logerr("ps_root_getifaddrs");
-			free(ifs);
-			return NULL;
-		}
-	} else
-#endif
-	if (getifaddrs(ifaddrs) == -1) {
-		logerr("getifaddrs");
-		free(ifs);
-		return NULL;
+	/* It's possible for an interface to have >1 AF_LINK.
+	 * For our purposes, we use the first one. */
+	TAILQ_FOREACH(ifp, ifs, next) {
+		if (strcmp(ifp->name, spec.devname) == 0)
+			break;
 	}
+	if (ifp)
+		return 0;
 
-	for (ifa = *ifaddrs; ifa; ifa = ifa->ifa_next) {
-		if (ifa->ifa_addr != NULL) {
-#ifdef AF_LINK
-			if (ifa->ifa_addr->sa_family != AF_LINK)
-				continue;
-#elif defined(AF_PACKET)
-			if (ifa->ifa_addr->sa_family != AF_PACKET)
-				continue;
-#endif
-		}
-		if (if_nametospec(ifa->ifa_name, &spec) != 0)
-			continue;
-
-		/* It's possible for an interface to have >1 AF_LINK.
-		 * For our purposes, we use the first one. */
-		TAILQ_FOREACH(ifp, ifs, next) {
-			if (strcmp(ifp->name, spec.devname) == 0)
+	if (argc > 0) {
+		for (i = 0; i < argc; i++) {
+			if (strcmp(argv[i], spec.devname) == 0)
 				break;
 		}
-		if (ifp)
-			continue;
-
-		if (argc > 0) {
-			for (i = 0; i < argc; i++) {
-				if (strcmp(argv[i], spec.devname) == 0)
-					break;
-			}
-			active = (i == argc) ? IF_INACTIVE : IF_ACTIVE_USER;
-		} else {
-			/* -1 means we're discovering against a specific
-			 * interface, but we still need the below rules
-			 * to apply. */
-			if (argc == -1 && strcmp(argv[0], spec.devname) != 0)
-				continue;
-			active = ctx->options & DHCPCD_INACTIVE ?
-			    IF_INACTIVE: IF_ACTIVE_USER;
-		}
+		active = (i == argc) ? IF_INACTIVE : IF_ACTIVE_USER;
+	} else {
+		/* -1 means we're discovering against a specific
+		 * interface, but we still need the below rules
+		 * to apply. */
+		if (argc == -1 && strcmp(argv[0], spec.devname) != 0)
+			return 0;
+		active = ctx->options & DHCPCD_INACTIVE ?
+		    IF_INACTIVE: IF_ACTIVE_USER;
+	}
 
-		for (i = 0; i < ctx->ifdc; i++)
-			if (fnmatch(ctx->ifdv[i], spec.devname, 0) == 0)
-				break;
-		if (i < ctx->ifdc)
-			active = IF_INACTIVE;
-		for (i = 0; i < ctx->ifc; i++)
-			if (fnmatch(ctx->ifv[i], spec.devname, 0) == 0)
-				break;
-		if (ctx->ifc && i == ctx->ifc)
-			active = IF_INACTIVE;
-		for (i = 0; i < ctx->ifac; i++)
-			if (fnmatch(ctx->ifav[i], spec.devname, 0) == 0)
-				break;
-		if (ctx->ifac && i == ctx->ifac)
-			active = IF_INACTIVE;
+	for (i = 0; i < ctx->ifdc; i++)
+		if (fnmatch(ctx->ifdv[i], spec.devname, 0) == 0)
+			break;
+	if (i < ctx->ifdc)
+		active = IF_INACTIVE;
+	for (i = 0; i < ctx->ifc; i++)
+		if (fnmatch(ctx->ifv[i], spec.devname, 0) == 0)
+			break;
+	if (ctx->ifc && i == ctx->ifc)
+		active = IF_INACTIVE;
+	for (i = 0; i < ctx->ifac; i++)
+		if (fnmatch(ctx->ifav[i], spec.devname, 0) == 0)
+			break;
+	if (ctx->ifac && i == ctx->ifac)
+		active = IF_INACTIVE;
+	/* Another shard looks after it. */
+	if (!shard_owns(ctx, spec.devname))
+		active = IF_INACTIVE;
 
 #ifdef PLUGIN_DEV
-		/* Ensure that the interface name has settled */
-		if (!dev_initialised(ctx, spec.devname)) {
-			logdebugx("%s: waiting for interface to initialise",
-			    spec.devname);
-			continue;
-		}
+	/* Ensure that the interface name has settled */
+	if (!dev_initialised(ctx, spec.devname)) {
+		logdebugx("%s: waiting for interface to initialise",
+		    spec.devname);
+		return 0;
+	}
 #endif
 
-		if (if_vimaster(ctx, spec.devname) == 1) {
-			int loglevel = argc != 0 ? LOG_ERR : LOG_DEBUG;
-			logmessage(loglevel,
-			    "%s: is a Virtual Interface Master, skipping",
-			    spec.devname);
-			continue;
-		}
+	if (if_vimaster(ctx, spec.devname) == 1) {
+		int loglevel = argc != 0 ? LOG_ERR : LOG_DEBUG;
+		logmessage(loglevel,
+		    "%s: is a Virtual Interface Master, skipping",
+		    spec.devname);
+		return 0;
+	}
 
-		if_noconf = ((argc == 0 || argc == -1) && ctx->ifac == 0 &&
-		    !if_hasconf(ctx, spec.devname));
+	if_noconf = ((argc == 0 || argc == -1) && ctx->ifac == 0 &&
+	    !if_hasconf(ctx, spec.devname));
 
-		/* Don't allow some reserved interface names unless explicit. */
-		if (if_noconf && if_ignore(ctx, spec.devname)) {
-			logdebugx("%s: ignoring due to interface type and"
-			    " no config", spec.devname);
-			active = IF_INACTIVE;
-		}
+	/* Don't allow some reserved interface names unless explicit. */
+	if (if_noconf && if_ignore(ctx, spec.devname)) {
+		logdebugx("%s: ignoring due to interface type and"
+		    " no config", spec.devname);
+		active = IF_INACTIVE;
+	}
 
-		ifp = calloc(1, sizeof(*ifp));
-		if (ifp == NULL) {
-			logerr(__func__);
-			break;
-		}
-		ifp->ctx = ctx;
-		strlcpy(ifp->name, spec.devname, sizeof(ifp->name));
-		ifp->flags = ifa->ifa_flags;
+	ifp = calloc(1, sizeof(*ifp));
+	if (ifp == NULL) {
+		logerr(__func__);
+		return -1;
+	}
+	ifp->ctx = ctx;
+	strlcpy(ifp->name, spec.devname, sizeof(ifp->name));
+	ifp->flags = ifa->ifa_flags;
 
-		if (ifa->ifa_addr != NULL) {
+	if (ifa->ifa_addr != NULL) {
 #ifdef AF_LINK
-			sdl = (const void *)ifa->ifa_addr;
+		sdl = (const void *)ifa->ifa_addr;
 
 #ifdef IFLR_ACTIVE
-			/* We need to check for active address */
-			strlcpy(iflr.iflr_name, ifp->name,
-			    sizeof(iflr.iflr_name));
-			memcpy(&iflr.addr, ifa->ifa_addr,
-			    MIN(ifa->ifa_addr->sa_len, sizeof(iflr.addr)));
-			iflr.flags = IFLR_PREFIX;
-			iflr.prefixlen = (unsigned int)sdl->sdl_alen * NBBY;
-			if (ioctl(ctx->pf_link_fd, SIOCGLIFADDR, &iflr) == -1 ||
-			    !(iflr.flags & IFLR_ACTIVE))
-			{
-				if_free(ifp);
-				continue;
-			}
+		/* We need to check for active address */
+		strlcpy(iflr.iflr_name, ifp->name,
+		    sizeof(iflr.iflr_name));
+		memcpy(&iflr.addr, ifa->ifa_addr,
+		    MIN(ifa->ifa_addr->sa_len, sizeof(iflr.addr)));
+		iflr.flags = IFLR_PREFIX;
+		iflr.prefixlen = (unsigned int)sdl->sdl_alen * NBBY;
+		if (ioctl(ctx->pf_link_fd, SIOCGLIFADDR, &iflr) == -1 ||
+		    !(iflr.flags & IFLR_ACTIVE))
+		{
+			if_free(ifp);
+			return 0;
+		}
 #endif
 
-			ifp->index = sdl->sdl_index;
-			switch(sdl->sdl_type) {
+		ifp->index = sdl->sdl_index;
+		switch(sdl->sdl_type) {
 #ifdef IFT_BRIDGE
-			case IFT_BRIDGE: /* FALLTHROUGH */
+		case IFT_BRIDGE: /* FALLTHROUGH */
 #endif
 #ifdef IFT_PROPVIRTUAL
-			case IFT_PROPVIRTUAL: /* FALLTHROUGH */
+		case IFT_PROPVIRTUAL: /* FALLTHROUGH */
 #endif
 #ifdef IFT_TUNNEL
-			case IFT_TUNNEL: /* FALLTHROUGH */
-#endif
-			case IFT_LOOP: /* FALLTHROUGH */
-			case IFT_PPP:
-				/* Don't allow unless explicit */
-				if (if_noconf && active) {
-					logdebugx("%s: ignoring due to"
-					    " interface type and"
-					    " no config",
-					    ifp->name);
-					active = IF_INACTIVE;
-				}
-				__fallthrough; /* appease gcc */
-				/* FALLTHROUGH */
+		case IFT_TUNNEL: /* FALLTHROUGH */
+#endif
+		case IFT_LOOP: /* FALLTHROUGH */
+		case IFT_PPP:
+			/* Don't allow unless explicit */
+			if (if_noconf && active) {
+				logdebugx("%s: ignoring due to"
+				    " interface type and"
+				    " no config",
+				    ifp->name);
+				active = IF_INACTIVE;
+			}
+			__fallthrough; /* appease gcc */
+			/* FALLTHROUGH */
 #ifdef IFT_L2VLAN
-			case IFT_L2VLAN: /* FALLTHROUGH */
+		case IFT_L2VLAN: /* FALLTHROUGH */
 #endif
 #ifdef IFT_L3IPVLAN
-			case IFT_L3IPVLAN: /* FALLTHROUGH */
+		case IFT_L3IPVLAN: /* FALLTHROUGH */
 #endif
-			case IFT_ETHER:
-				ifp->hwtype = ARPHRD_ETHER;
-				break;
+		case IFT_ETHER:
+			ifp->hwtype = ARPHRD_ETHER;
+			break;
 #ifdef IFT_IEEE1394
-			case IFT_IEEE1394:
-				ifp->hwtype = ARPHRD_IEEE1394;
-				break;
+		case IFT_IEEE1394:
+			ifp->hwtype = ARPHRD_IEEE1394;
+			break;
 #endif
 #ifdef IFT_INFINIBAND
-			case IFT_INFINIBAND:
-				ifp->hwtype = ARPHRD_INFINIBAND;
-				break;
+		case IFT_INFINIBAND:
+			ifp->hwtype = ARPHRD_INFINIBAND;
+			break;
 #endif
-			default:
-				/* Don't allow unless explicit */
-				if (active) {
-					if (if_noconf)
-						active = IF_INACTIVE;
-					i = active ? LOG_WARNING : LOG_DEBUG;
-					logmessage(i, "%s: unsupported"
-					    " interface type 0x%.2x",
-					    ifp->name, sdl->sdl_type);
-				}
-				/* Pretend it's ethernet */
-				ifp->hwtype = ARPHRD_ETHER;
-				break;
+		default:
+			/* Don't allow unless explicit */
+			if (active) {
+				if (if_noconf)
+					active = IF_INACTIVE;
+				i = active ? LOG_WARNING : LOG_DEBUG;
+				logmessage(i, "%s: unsupported"
+				    " interface type 0x%.2x",
+				    ifp->name, sdl->sdl_type);
 			}
-			ifp->hwlen = sdl->sdl_alen;
-			memcpy(ifp->hwaddr, CLLADDR(sdl), ifp->hwlen);
-#elif defined(AF_PACKET)
-			sll = (const void *)ifa->ifa_addr;
-			ifp->index = (unsigned int)sll->sll_ifindex;
-			ifp->hwtype = sll->sll_hatype;
-			ifp->hwlen = sll->sll_halen;
-			if (ifp->hwlen != 0)
-				memcpy(ifp->hwaddr, sll->sll_addr, ifp->hwlen);
-			active = if_check_arphrd(ifp, active, if_noconf);
-#endif
-		}
-#ifdef __linux__
-		else {
-			struct ifreq ifr = { .ifr_flags = 0 };
-
-			/* This is a huge bug in getifaddrs(3) as there
-			 * is no reason why this can't be returned in
-			 * ifa_addr. */
-			strlcpy(ifr.ifr_name, ifa->ifa_name,
-			    sizeof(ifr.ifr_name));
-			if (ioctl(ctx->pf_inet_fd, SIOCGIFHWADDR, &ifr) == -1)
-				logerr("%s: SIOCGIFHWADDR", ifa->ifa_name);
-			ifp->hwtype = ifr.ifr_hwaddr.sa_family;
-			if (ioctl(ctx->pf_inet_fd, SIOCGIFINDEX, &ifr) == -1)
-				logerr("%s: SIOCGIFINDEX", ifa->ifa_name);
-			ifp->index = (unsigned int)ifr.ifr_ifindex;
-			if_check_arphrd(ifp, active, if_noconf);
+			/* Pretend it's ethernet */
+			ifp->hwtype = ARPHRD_ETHER;
+			break;
 		}
+		ifp->hwlen = sdl->sdl_alen;
+		memcpy(ifp->hwaddr, CLLADDR(sdl), ifp->hwlen);
+#elif defined(AF_PACKET)
+		sll = (const void *)ifa->ifa_addr;
+		ifp->index = (unsigned int)sll->sll_ifindex;
+		ifp->hwtype = sll->sll_hatype;
+		ifp->hwlen = sll->sll_halen;
+		if (ifp->hwlen != 0)
+			memcpy(ifp->hwaddr, sll->sll_addr, ifp->hwlen);
+		active = if_check_arphrd(ifp, active, if_noconf);
 #endif
+	}
 
-		if (!(ctx->options & (DHCPCD_DUMPLEASE | DHCPCD_TEST))) {
-			/* Handle any platform init for the interface */
-			if (active != IF_INACTIVE && if_init(ifp) == -1) {
-				logerr("%s: if_init", ifp->name);
-				if_free(ifp);
-				continue;
-			}
+	if (!(ctx->options & (DHCPCD_DUMPLEASE | DHCPCD_TEST))) {
+		/* Handle any platform init for the interface */
+		if (active != IF_INACTIVE && if_init(ifp) == -1) {
+			logerr("%s: if_init", ifp->name);
+			if_free(ifp);
+			return 0;
 		}
+	}
 
-		ifp->vlanid = if_vlanid(ifp);
+	ifp->vlanid = if_vlanid(ifp);
 
 #ifdef SIOCGIFPRIORITY
-		/* Respect the interface priority */
-		memset(&ifr, 0, sizeof(ifr));
-		strlcpy(ifr.ifr_name, ifp->name, sizeof(ifr.ifr_name));
-		if (pioctl(ctx, SIOCGIFPRIORITY, &ifr, sizeof(ifr)) == 0)
-			ifp->metric = (unsigned int)ifr.ifr_metric;
-		if_getssid(ifp);
+	/* Respect the interface priority */
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, ifp->name, sizeof(ifr.ifr_name));
+	if (pioctl(ctx, SIOCGIFPRIORITY, &ifr, sizeof(ifr)) == 0)
+		ifp->metric = (unsigned int)ifr.ifr_metric;
+	if_getssid(ifp);
+#else
+	/* Leave a low portion for user config */
+	ifp->metric = RTMETRIC_BASE + ifp->index;
+	if (if_getssid(ifp) != -1) {
+		ifp->wireless = true;
+		ifp->metric += RTMETRIC_WIRELESS;
+	}
+#endif
+
+	ifp->active = active;
+	ifp->carrier = if_carrier(ifp, ifa->ifa_data);
+	TAILQ_INSERT_TAIL(ifs, ifp, next);
+	return 0;
+}
+
+#ifdef IF_NETLINK_DUMP
+struct if_discoverarg {
+	struct if_head *ifs;
+	int argc;
+	char * const *argv;
+	int error;
+};
+
+static void
+if_discoverlink(struct dhcpcd_ctx *ctx, void *arg, const struct ifaddrs *ifa)
+{
+	struct if_discoverarg *da = arg;
+
+	if (da->error == 0 &&
+	    if_discoverifa(ctx, da->ifs, da->argc, da->argv, ifa) == -1)
+		da->error = -1;
+}
+#endif
+
+struct if_head *
+if_discover(struct dhcpcd_ctx *ctx, struct ifaddrs **ifaddrs,
+    int argc, char * const *argv)
+{
+	struct if_head *ifs;
+#ifdef IF_NETLINK_DUMP
+	struct if_discoverarg da = { .argc = argc, .argv = argv };
+	struct interface *ifp;
 #else
-		/* Leave a low portion for user config */
-		ifp->metric = RTMETRIC_BASE + ifp->index;
-		if (if_getssid(ifp) != -1) {
-			ifp->wireless = true;
-			ifp->metric += RTMETRIC_WIRELESS;
+	struct ifaddrs *ifa;
+#endif
+
+	if ((ifs = malloc(sizeof(*ifs))) == NULL) {
+		logerr(__func__);
+		return NULL;
+	}
+	TAILQ_INIT(ifs);
+
+#ifdef IF_NETLINK_DUMP
+	/* Links are added as the dump is read and if_learnaddrs
+	 * reads the addresses, so there is no list to hand back.
+	 * -1 means we only want the one interface. */
+	*ifaddrs = NULL;
+	da.ifs = ifs;
+	if (if_dumplinks(ctx, argc == -1 ? argv[0] : NULL,
+	    if_discoverlink, &da) == -1)
+	{
+		logerr("if_dumplinks");
+		while ((ifp = TAILQ_FIRST(ifs)) != NULL) {
+			TAILQ_REMOVE(ifs, ifp, next);
+			if_free(ifp);
 		}
+		free(ifs);
+		return NULL;
+	}
+#else
+#ifdef PRIVSEP_GETIFADDRS
+	if (ctx->options & DHCPCD_PRIVSEP) {
+		/* -1 means we only want the one interface. */
+		if (ps_root_getifaddrs(ctx, argc == -1 ? argv[0] : NULL,
+		    AF_UNSPEC, ifaddrs) == -1)
+		{
+			logerr("ps_root_getifaddrs");
+			free(ifs);
+			return NULL;
+		}
+	} else
 #endif
+	if (getifaddrs(ifaddrs) == -1) {
+		logerr("getifaddrs");
+		free(ifs);
+		return NULL;
+	}
 
-		ifp->active = active;
-		ifp->carrier = if_carrier(ifp, ifa->ifa_data);
-		TAILQ_INSERT_TAIL(ifs, ifp, next);
+	for (ifa = *ifaddrs; ifa; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr != NULL) {
+#ifdef AF_LINK
+			if (ifa->ifa_addr->sa_family != AF_LINK)
+				continue;
+#elif defined(AF_PACKET)
+			if (ifa->ifa_addr->sa_family != AF_PACKET)
+				continue;
+#endif
+		}
+		if (if_discoverifa(ctx, ifs, argc, argv, ifa) == -1)
+			break;
 	}
+#endif
 
 	return ifs;
 }
@@ -793,6 +849,202 @@ if_nametospec(const char *ifname, struct if_spec *spec)
 	return 0;
 }
 
+/*
+ * ctx->ifaces is also indexed by ifindex and by name in open addressing
+ * hashes of if_hashlen slots, a power of two kept at most half full.
+ * They are built on the first lookup and kept by if_insert and
+ * if_remove, so anything else changing ctx->ifaces must drop them
+ * with if_hashfree.
+ */
+#define	IF_HASH_MIN	16
+
+static size_t
+if_idxslot(const struct dhcpcd_ctx *ctx, unsigned int idx)
+{
+	uint32_t h = (uint32_t)idx * 0x9e3779b1U;
+
+	return (h ^ (h >> 16)) & (ctx->if_hashlen - 1);
+}
+
+static size_t
+if_nameslot(const struct dhcpcd_ctx *ctx, const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *name != '\0'; name++) {
+		h ^= (uint8_t)*name;
+		h *= 16777619U;
+	}
+	return (h ^ (h >> 16)) & (ctx->if_hashlen - 1);
+}
+
+static size_t
+if_hashslot(const struct dhcpcd_ctx *ctx, const struct interface *ifp,
+    bool byname)
+{
+
+	return byname ? if_nameslot(ctx, ifp->name) :
+	    if_idxslot(ctx, ifp->index);
+}
+
+static void
+if_hashinsert(struct dhcpcd_ctx *ctx, struct interface *ifp)
+{
+	size_t mask = ctx->if_hashlen - 1, i;
+
+	for (i = if_idxslot(ctx, ifp->index);
+	    ctx->if_idxhash[i] != NULL;
+	    i = (i + 1) & mask)
+		;
+	ctx->if_idxhash[i] = ifp;
+	for (i = if_nameslot(ctx, ifp->name);
+	    ctx->if_namehash[i] != NULL;
+	    i = (i + 1) & mask)
+		;
+	ctx->if_namehash[i] = ifp;
+	ctx->if_nhashed++;
+}
+
+static void
+if_hashremove0(struct dhcpcd_ctx *ctx, struct interface **hash,
+    const struct interface *ifp, bool byname)
+{
+	size_t mask = ctx->if_hashlen - 1, i, j, k;
+
+	for (i = if_hashslot(ctx, ifp, byname);
+	    hash[i] != ifp;
+	    i = (i + 1) & mask)
+	{
+		if (hash[i] == NULL)
+			return;
+	}
+	hash[i] = NULL;
+
+	/* Shift back any following entries that can no longer be reached
+	 * so lookups can still stop at the first empty slot. */
+	for (j = (i + 1) & mask; hash[j] != NULL; j = (j + 1) & mask) {
+		k = if_hashslot(ctx, hash[j], byname);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		hash[i] = hash[j];
+		hash[j] = NULL;
+		i = j;
+	}
+}
+
+void
+if_hashfree(struct dhcpcd_ctx *ctx)
+{
+
+	free(ctx->if_idxhash);
+	free(ctx->if_namehash);
+	ctx->if_idxhash = ctx->if_namehash = NULL;
+	ctx->if_hashlen = ctx->if_nhashed = 0;
+}
+
+/* Ensure there is room for n interfaces, rebuilding from ctx->ifaces
+ * if not. */
+static int
+if_hashreserve(struct dhcpcd_ctx *ctx, size_t n)
+{
+	struct interface **idxhash, **namehash, *ifp;
+	size_t len;
+
+	if (ctx->if_hashlen != 0 && n * 2 <= ctx->if_hashlen)
+		return 0;
+
+	for (len = IF_HASH_MIN; len < n * 2; len *= 2)
+		;
+	idxhash = calloc(len, sizeof(*idxhash));
+	namehash = calloc(len, sizeof(*namehash));
+	if (idxhash == NULL || namehash == NULL) {
+		free(idxhash);
+		free(namehash);
+		if_hashfree(ctx);
+		return -1;
+	}
+	if_hashfree(ctx);
+	ctx->if_idxhash = idxhash;
+	ctx->if_namehash = namehash;
+	ctx->if_hashlen = len;
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if_hashinsert(ctx, ifp);
+	}
+	return 0;
+}
+
+static int
+if_hashbuild(struct dhcpcd_ctx *ctx)
+{
+	struct interface *ifp;
+	size_t n = 0;
+
+	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		n++;
+	}
+	return if_hashreserve(ctx, n);
+}
+
+/* Add ifp to ctx->ifaces. */
+void
+if_insert(struct dhcpcd_ctx *ctx, struct interface *ifp)
+{
+
+	/* Without room the hash is dropped and built again on lookup. */
+	if (ctx->if_hashlen != 0 &&
+	    if_hashreserve(ctx, ctx->if_nhashed + 1) == -1)
+		logerr(__func__);
+	TAILQ_INSERT_TAIL(ctx->ifaces, ifp, next);
+	if (ctx->if_hashlen != 0)
+		if_hashinsert(ctx, ifp);
+}
+
+/* Remove ifp from ctx->ifaces, but don't free it. */
+void
+if_remove(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+
+	TAILQ_REMOVE(ctx->ifaces, ifp, next);
+	if (ctx->if_hashlen == 0)
+		return;
+	if (TAILQ_FIRST(ctx->ifaces) == NULL) {
+		if_hashfree(ctx);
+		return;
+	}
+	if_hashremove0(ctx, ctx->if_idxhash, ifp, false);
+	if_hashremove0(ctx, ctx->if_namehash, ifp, true);
+	ctx->if_nhashed--;
+}
+
+static struct interface *
+if_hashfind(struct dhcpcd_ctx *ctx, unsigned int idx, const char *name)
+{
+	struct interface *ifp;
+	size_t mask = ctx->if_hashlen - 1, i;
+
+	if (name != NULL) {
+		for (i = if_nameslot(ctx, name);
+		    (ifp = ctx->if_namehash[i]) != NULL;
+		    i = (i + 1) & mask)
+		{
+			if (strcmp(ifp->name, name) == 0)
+				return ifp;
+		}
+	} else {
+		for (i = if_idxslot(ctx, idx);
+		    (ifp = ctx->if_idxhash[i]) != NULL;
+		    i = (i + 1) & mask)
+		{
+			if (ifp->index == idx)
+				return ifp;
+		}
+	}
+
+	errno = ENXIO;
+	return NULL;
+}
+
 static struct interface *
 if_findindexname(struct if_head *ifaces, unsigned int idx, const char *name)
 {
@@ -800,12 +1052,26 @@ if_findindexname(struct if_head *ifaces, unsigned int idx, const char *name)
 	if (ifaces != NULL) {
 		struct if_spec spec;
 		struct interface *ifp;
+		struct dhcpcd_ctx *ctx;
+
+		/* Only an alias needs parsing to find the device. */
+		if (name != NULL && (*name == '\0' ||
+		    strchr(name, ':') != NULL ||
+		    strlen(name) >= sizeof(spec.devname)))
+		{
+			if (if_nametospec(name, &spec) == -1)
+				return NULL;
+			name = spec.devname;
+		}
 
-		if (name && if_nametospec(name, &spec) == -1)
-			return NULL;
+		ifp = TAILQ_FIRST(ifaces);
+		ctx = ifp != NULL ? ifp->ctx : NULL;
+		if (ctx != NULL && ifaces == ctx->ifaces &&
+		    (ctx->if_hashlen != 0 || if_hashbuild(ctx) == 0))
+			return if_hashfind(ctx, idx, name);
 
 		TAILQ_FOREACH(ifp, ifaces, next) {
-			if ((name && strcmp(ifp->name, spec.devname) == 0) ||
+			if ((name && strcmp(ifp->name, name) == 0) ||
 			    (!name && ifp->index == idx))
 				return ifp;
 		}
@@ -865,6 +1131,58 @@ if_domtu(const struct interface *ifp, short int mtu)
 	return ifr.ifr_mtu;
 }
 
+/*
+ * Route and address changes made between if_batch_begin and
+ * if_batch_end are sent together, to the privileged proxy if
+ * we have one, otherwise to the kernel if it supports it.
+ * Each change reports success when queued and its real result
+ * is in results, in the order made.
+ */
+int
+if_batch_begin(struct dhcpcd_ctx *ctx)
+{
+
+#ifdef PRIVSEP
+	if (IN_PRIVSEP_SE(ctx))
+		return ps_root_batch_begin(ctx);
+#endif
+	return if_txn_begin(ctx);
+}
+
+bool
+if_batching(const struct dhcpcd_ctx *ctx)
+{
+
+#ifdef PRIVSEP
+	if (IN_PRIVSEP_SE(ctx))
+		return ps_root_batching(ctx);
+#endif
+	return if_txn_active(ctx);
+}
+
+/* The index the next change will have in the results. */
+size_t
+if_batch_count(const struct dhcpcd_ctx *ctx)
+{
+
+#ifdef PRIVSEP
+	if (IN_PRIVSEP_SE(ctx))
+		return ps_root_batch_count(ctx);
+#endif
+	return if_txn_count(ctx);
+}
+
+ssize_t
+if_batch_end(struct dhcpcd_ctx *ctx, const struct psr_result **results)
+{
+
+#ifdef PRIVSEP
+	if (IN_PRIVSEP_SE(ctx))
+		return ps_root_batch_end(ctx, results);
+#endif
+	return if_txn_end(ctx, results);
+}
+
 #ifdef ALIAS_ADDR
 int
 if_makealias(char *alias, size_t alias_len, const char *ifname, int lun)
@@ -133,10 +133,27 @@ struct priv {
 };
 #endif
 #ifdef __linux__
+struct nltxn;
+struct nexthop;
+struct nlbuf {
+	uint8_t *nb_buf;
+	size_t nb_len;
+};
 struct priv {
 	int route_fd;
 	int generic_fd;
 	uint32_t route_pid;
+	struct nlbuf nl_buf;	/* see if_getnetlink */
+	struct nlbuf nl_linkbuf;
+#ifdef HAVE_NL80211_H
+	int nl80211_family;	/* see if_getssid_nl80211 */
+	int nl80211_fd;		/* see if_opennl80211 */
+	struct nlbuf nl80211_buf;
+#endif
+	struct nltxn *nltxn;	/* see if_txn_begin */
+	TAILQ_HEAD(, nexthop) nexthops;	/* see if_nexthop */
+	uint32_t nh_nextid;
+	int nh_state;
 };
 #endif
 #ifdef __sun
@@ -156,6 +173,16 @@ int if_getifaddrs(struct ifaddrs **);
 int if_getsubnet(struct dhcpcd_ctx *, const char *, int, void *, size_t);
 #endif
 
+#ifdef __linux__
+/* glibc getifaddrs dumps links and addresses over netlink to build a
+ * list dhcpcd then walks, so dhcpcd reads the dumps itself.
+ * See if-linux.c for details. */
+#define	IF_NETLINK_DUMP
+int if_dumplinks(struct dhcpcd_ctx *, const char *,
+    void (*)(struct dhcpcd_ctx *, void *, const struct ifaddrs *), void *);
+int if_dumpaddrs(struct dhcpcd_ctx *, struct if_head *);
+#endif
+
 int if_ioctl(struct dhcpcd_ctx *, ioctl_request_t, void *, size_t);
 #ifdef HAVE_PLEDGE
 #define	pioctl(ctx, req, data, len) if_ioctl((ctx), (req), (data), (len))
@@ -175,6 +202,9 @@ void if_learnaddrs(struct dhcpcd_ctx *, struct if_head *, struct ifaddrs **);
 void if_deletestaleaddrs(struct if_head *);
 struct interface *if_find(struct if_head *, const char *);
 struct interface *if_findindex(struct if_head *, unsigned int);
+void if_insert(struct dhcpcd_ctx *, struct interface *);
+void if_remove(struct interface *);
+void if_hashfree(struct dhcpcd_ctx *);
 struct interface *if_loopback(struct dhcpcd_ctx *);
 void if_free(struct interface *);
 int if_domtu(const struct interface *, short int);
@@ -252,6 +282,21 @@ int xsocketpair(int, int, int, int[2]);
 
 int if_route(unsigned char, const struct rt *rt);
 int if_initrt(struct dhcpcd_ctx *, rb_tree_t *, int);
+#ifdef HAVE_ROUTE_NEXTHOP
+int if_nexthop(struct rt *);
+int if_nexthop_move(struct dhcpcd_ctx *, uint32_t, const struct sockaddr *);
+void if_nexthop_prune(struct dhcpcd_ctx *, int);
+#endif
+
+struct psr_result;
+int if_batch_begin(struct dhcpcd_ctx *);
+bool if_batching(const struct dhcpcd_ctx *);
+size_t if_batch_count(const struct dhcpcd_ctx *);
+ssize_t if_batch_end(struct dhcpcd_ctx *, const struct psr_result **);
+int if_txn_begin(struct dhcpcd_ctx *);
+bool if_txn_active(const struct dhcpcd_ctx *);
+size_t if_txn_count(const struct dhcpcd_ctx *);
+ssize_t if_txn_end(struct dhcpcd_ctx *, const struct psr_result **);
 
 int if_missfilter(struct interface *, struct sockaddr *);
 int if_missfilter_apply(struct dhcpcd_ctx *);
@@ -287,7 +332,8 @@ struct interface *if_findifpfromcmsg(struct dhcpcd_ctx *,
 
 #ifdef __linux__
 int if_linksocket(struct sockaddr_nl *, int, int);
-int if_getnetlink(struct dhcpcd_ctx *, struct iovec *, int, int,
+int if_getnetlink(struct dhcpcd_ctx *, int, int,
     int (*)(struct dhcpcd_ctx *, void *, struct nlmsghdr *), void *);
+int if_txn_queue(struct dhcpcd_ctx *, void *, size_t);
 #endif
 #endif
@@ -119,6 +119,144 @@ ipv4_getnetmask(uint32_t addr)
 	return 0;
 }
 
+/*
+ * Every address in an ipv4_state is also indexed by address in an open
+ * addressing hash of ia_hashlen slots, a power of two kept at most half
+ * full, so finding an address does not walk every interface.
+ * The hash is kept by ipv4_insertaddr and ipv4_removeaddr, so anything
+ * else changing state->addrs must use them.
+ * If the hash cannot grow it is dropped and lookups walk the lists
+ * until the last address is removed.
+ */
+#define	IA_HASH_MIN	16
+
+static size_t
+ipv4_addrslot(const struct dhcpcd_ctx *ctx, const struct in_addr *addr)
+{
+	uint32_t h = (uint32_t)addr->s_addr * 0x9e3779b1U;
+
+	return (h ^ (h >> 16)) & (ctx->ia_hashlen - 1);
+}
+
+static void
+ipv4_hashinsert(struct dhcpcd_ctx *ctx, struct ipv4_addr *ia)
+{
+	size_t mask = ctx->ia_hashlen - 1, i;
+
+	for (i = ipv4_addrslot(ctx, &ia->addr);
+	    ctx->ia_hash[i] != NULL;
+	    i = (i + 1) & mask)
+		;
+	ctx->ia_hash[i] = ia;
+}
+
+static void
+ipv4_hashfree(struct dhcpcd_ctx *ctx)
+{
+
+	free(ctx->ia_hash);
+	ctx->ia_hash = NULL;
+	ctx->ia_hashlen = 0;
+}
+
+static int
+ipv4_hashgrow(struct dhcpcd_ctx *ctx)
+{
+	struct ipv4_addr **hash, **ohash = ctx->ia_hash;
+	size_t len, olen = ctx->ia_hashlen, i;
+
+	len = olen == 0 ? IA_HASH_MIN : olen * 2;
+	if ((hash = calloc(len, sizeof(*hash))) == NULL)
+		return -1;
+	ctx->ia_hash = hash;
+	ctx->ia_hashlen = len;
+	for (i = 0; i < olen; i++) {
+		if (ohash[i] != NULL)
+			ipv4_hashinsert(ctx, ohash[i]);
+	}
+	free(ohash);
+	return 0;
+}
+
+/* Add ia to state->addrs. */
+static void
+ipv4_insertaddr(struct ipv4_state *state, struct ipv4_addr *ia)
+{
+	struct dhcpcd_ctx *ctx = ia->iface->ctx;
+
+	TAILQ_INSERT_TAIL(&state->addrs, ia, next);
+	if (ctx->ia_hashlen != 0 || ctx->ia_naddrs == 0) {
+		if ((ctx->ia_naddrs + 1) * 2 > ctx->ia_hashlen &&
+		    ipv4_hashgrow(ctx) == -1)
+		{
+			logerr(__func__);
+			ipv4_hashfree(ctx);
+		} else
+			ipv4_hashinsert(ctx, ia);
+	}
+	ctx->ia_naddrs++;
+}
+
+/* Remove ia from state->addrs, but don't free it. */
+static void
+ipv4_removeaddr(struct ipv4_state *state, struct ipv4_addr *ia)
+{
+	struct dhcpcd_ctx *ctx = ia->iface->ctx;
+	struct ipv4_addr **hash = ctx->ia_hash;
+	size_t mask = ctx->ia_hashlen - 1, i, j, k;
+
+	TAILQ_REMOVE(&state->addrs, ia, next);
+	if (--ctx->ia_naddrs == 0) {
+		ipv4_hashfree(ctx);
+		return;
+	}
+	if (ctx->ia_hashlen == 0)
+		return;
+
+	for (i = ipv4_addrslot(ctx, &ia->addr);
+	    hash[i] != ia;
+	    i = (i + 1) & mask)
+	{
+		if (hash[i] == NULL)
+			return;
+	}
+	hash[i] = NULL;
+
+	/* Shift back any following entries that can no longer be reached
+	 * so lookups can still stop at the first empty slot. */
+	for (j = (i + 1) & mask; hash[j] != NULL; j = (j + 1) & mask) {
+		k = ipv4_addrslot(ctx, &hash[j]->addr);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		hash[i] = hash[j];
+		hash[j] = NULL;
+		i = j;
+	}
+}
+
+/* Find addr on ifp, or on any interface in ctx->ifaces if ifp is NULL. */
+static struct ipv4_addr *
+ipv4_hashfind(struct dhcpcd_ctx *ctx, const struct interface *ifp,
+    const struct in_addr *addr)
+{
+	struct ipv4_addr *ia;
+	size_t mask = ctx->ia_hashlen - 1, i;
+
+	for (i = ipv4_addrslot(ctx, addr);
+	    (ia = ctx->ia_hash[i]) != NULL;
+	    i = (i + 1) & mask)
+	{
+		if (ia->addr.s_addr != addr->s_addr)
+			continue;
+		/* Interfaces being discovered have addresses too. */
+		if (ifp == NULL ?
+		    if_findindex(ctx->ifaces, ia->iface->index) == ia->iface :
+		    ia->iface == ifp)
+			return ia;
+	}
+	return NULL;
+}
+
 struct ipv4_addr *
 ipv4_iffindaddr(struct interface *ifp,
     const struct in_addr *addr, const struct in_addr *mask)
@@ -126,6 +264,14 @@ ipv4_iffindaddr(struct interface *ifp,
 	struct ipv4_state *state;
 	struct ipv4_addr *ap;
 
+	if (addr != NULL && ifp->ctx->ia_hashlen != 0) {
+		ap = ipv4_hashfind(ifp->ctx, ifp, addr);
+		if (ap != NULL && mask != NULL &&
+		    ap->mask.s_addr != mask->s_addr)
+			return NULL;
+		return ap;
+	}
+
 	state = IPV4_STATE(ifp);
 	if (state) {
 		TAILQ_FOREACH(ap, &state->addrs, next) {
@@ -153,7 +299,7 @@ ipv4_iffindlladdr(struct interface *ifp)
 	return NULL;
 }
 
-static struct ipv4_addr *
+struct ipv4_addr *
 ipv4_iffindmaskaddr(struct interface *ifp, const struct in_addr *addr)
 {
 	struct ipv4_state *state;
@@ -193,6 +339,9 @@ ipv4_findaddr(struct dhcpcd_ctx *ctx, const struct in_addr *addr)
 	struct interface *ifp;
 	struct ipv4_addr *ap;
 
+	if (ctx->ia_hashlen != 0)
+		return ipv4_hashfind(ctx, NULL, addr);
+
 	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
 		ap = ipv4_iffindaddr(ifp, addr, NULL);
 		if (ap)
@@ -422,6 +571,11 @@ inet_routerhostroute(rb_tree_t *routes, struct interface *ifp)
 		}
 		if (rth != rt)
 			continue;
+		/* The route to the router could be on a clean interface. */
+		if (ifp->ctx->rt_scoped) {
+			ifp->ctx->rt_scoped = false;
+			return 0;
+		}
 		if ((state = D_CSTATE(ifp)) == NULL)
 			continue;
 		ifo = ifp->options;
@@ -490,7 +644,7 @@ inet_getroutes(struct dhcpcd_ctx *ctx, rb_tree_t *routes)
 	bool have_default = false;
 
 	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
-		if (!ifp->active)
+		if (!ifp->active || !rt_ifdirty(ifp))
 			continue;
 		if (inet_dhcproutes(routes, ifp, &have_default) == -1)
 			return false;
@@ -503,6 +657,27 @@ inet_getroutes(struct dhcpcd_ctx *ctx, rb_tree_t *routes)
 	}
 
 #ifdef IPV4LL
+	/* A scoped build keeps the default routes of clean interfaces.
+	 * If one of them is IPv4LL, or there is no default route at all,
+	 * every interface needs to be considered. */
+	if (ctx->rt_scoped) {
+		struct rt *rt;
+		bool ll_default = false;
+
+		RB_TREE_FOREACH(rt, &ctx->routes) {
+			if (rt->rt_dest.sa_family != AF_INET ||
+			    rt_ifdirty(rt->rt_ifp) || !rt_is_default(rt))
+				continue;
+			if (rt->rt_dflags & RTDF_IPV4LL)
+				ll_default = true;
+			else
+				have_default = true;
+		}
+		if (ll_default || !have_default)
+			ctx->rt_scoped = false;
+		return true;
+	}
+
 	/* If there is no default route, see if we can use an IPv4LL one. */
 	if (have_default)
 		return true;
@@ -546,8 +721,8 @@ ipv4_deladdr(struct ipv4_addr *addr, int keeparp)
 			struct dhcp_state *dstate;
 
 			dstate = D_STATE(ap->iface);
-			TAILQ_REMOVE(&state->addrs, ap, next);
-			free(ap);
+			ipv4_removeaddr(state, ap);
+			pool_put(&ap->iface->ctx->ia_pool, ap);
 
 			if (dstate && dstate->addr == ap) {
 				dstate->added = 0;
@@ -675,7 +850,7 @@ ipv4_addaddr(struct interface *ifp, const struct in_addr *addr,
 
 	ia = ipv4_iffindaddr(ifp, addr, NULL);
 	if (ia == NULL) {
-		ia = malloc(sizeof(*ia));
+		ia = pool_get(&ifp->ctx->ia_pool);
 		if (ia == NULL) {
 			logerr(__func__);
 			return NULL;
@@ -710,7 +885,7 @@ ipv4_addaddr(struct interface *ifp, const struct in_addr *addr,
 	blank = (ia->alias[0] == '\0');
 	if ((replaced = ipv4_aliasaddr(ia, &replaced_ia)) == -1) {
 		logerr("%s: ipv4_aliasaddr", ifp->name);
-		free(ia);
+		pool_put(&ifp->ctx->ia_pool, ia);
 		return NULL;
 	}
 	if (blank)
@@ -726,19 +901,19 @@ ipv4_addaddr(struct interface *ifp, const struct in_addr *addr,
 			logerr("%s: if_addaddress",
 			    __func__);
 		if (ia->flags & IPV4_AF_NEW)
-			free(ia);
+			pool_put(&ifp->ctx->ia_pool, ia);
 		return NULL;
 	}
 
 #ifdef ALIAS_ADDR
 	if (replaced) {
-		TAILQ_REMOVE(&state->addrs, replaced_ia, next);
+		ipv4_removeaddr(state, replaced_ia);
 		free(replaced_ia);
 	}
 #endif
 
 	if (ia->flags & IPV4_AF_NEW)
-		TAILQ_INSERT_TAIL(&state->addrs, ia, next);
+		ipv4_insertaddr(state, ia);
 	return ia;
 }
 
@@ -778,7 +953,7 @@ ipv4_applyaddr(void *arg)
 		{
 			if (state->added) {
 				delete_address(ifp);
-				rt_build(ifp->ctx, AF_INET);
+				rt_deferif(ifp, AF_INET);
 #ifdef ARP
 				/* Announce the preferred address to
 				 * kick ARP caches. */
@@ -787,7 +962,7 @@ ipv4_applyaddr(void *arg)
 			}
 			script_runreason(ifp, state->reason);
 		} else
-			rt_build(ifp->ctx, AF_INET);
+			rt_deferif(ifp, AF_INET);
 		return NULL;
 	}
 
@@ -841,15 +1016,17 @@ ipv4_applyaddr(void *arg)
 	state->addr = ia;
 	state->added = STATE_ADDED;
 
-	rt_build(ifp->ctx, AF_INET);
+	rt_deferif(ifp, AF_INET);
 
 #ifdef ARP
-	arp_announceaddr(ifp->ctx, &state->addr->addr);
+	/* Caches already know a resumed address. */
+	if (!ifp->warm)
+		arp_announceaddr(ifp->ctx, &state->addr->addr);
 #endif
 
 	if (state->state == DHS_BOUND) {
 		script_runreason(ifp, state->reason);
-		dhcpcd_daemonise(ifp->ctx);
+		dhcpcd_bound(ifp);
 	}
 	return ia;
 }
@@ -930,7 +1107,7 @@ ipv4_handleifa(struct dhcpcd_ctx *ctx,
 	switch (cmd) {
 	case RTM_NEWADDR:
 		if (ia == NULL) {
-			if ((ia = malloc(sizeof(*ia))) == NULL) {
+			if ((ia = pool_get(&ifp->ctx->ia_pool)) == NULL) {
 				logerr(__func__);
 				return;
 			}
@@ -942,7 +1119,7 @@ ipv4_handleifa(struct dhcpcd_ctx *ctx,
 #ifdef ALIAS_ADDR
 			strlcpy(ia->alias, ifname, sizeof(ia->alias));
 #endif
-			TAILQ_INSERT_TAIL(&state->addrs, ia, next);
+			ipv4_insertaddr(state, ia);
 		} else
 			ia_is_new = false;
 		/* Mask could have changed */
@@ -967,7 +1144,7 @@ ipv4_handleifa(struct dhcpcd_ctx *ctx,
 		if (mask->s_addr != INADDR_ANY &&
 		    mask->s_addr != ia->mask.s_addr)
 			return;
-		TAILQ_REMOVE(&state->addrs, ia, next);
+		ipv4_removeaddr(state, ia);
 		break;
 	default:
 		return;
@@ -982,7 +1159,7 @@ ipv4_handleifa(struct dhcpcd_ctx *ctx,
 	}
 
 	if (cmd == RTM_DELADDR)
-		free(ia);
+		pool_put(&ifp->ctx->ia_pool, ia);
 }
 
 void
@@ -995,8 +1172,8 @@ ipv4_free(struct interface *ifp)
 		return;
 
 	while ((ia = TAILQ_FIRST(&state->addrs))) {
-		TAILQ_REMOVE(&state->addrs, ia, next);
-		free(ia);
+		ipv4_removeaddr(state, ia);
+		pool_put(&ifp->ctx->ia_pool, ia);
 	}
 	free(state);
 }
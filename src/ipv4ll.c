@@ -206,7 +206,6 @@ ipv4ll_freearp(struct interface *ifp)
 	if (state == NULL || state->arp == NULL)
 		return;
 
-	eloop_timeout_delete(ifp->ctx->eloop, NULL, state->arp);
 	arp_free(state->arp);
 	state->arp = NULL;
 }
@@ -253,13 +252,13 @@ test:
 		eloop_exit(ifp->ctx->eloop, EXIT_SUCCESS);
 		return;
 	}
-	rt_build(ifp->ctx, AF_INET);
+	rt_deferif(ifp, AF_INET);
 run:
 	astate = arp_announceaddr(ifp->ctx, &ia->addr);
 	if (astate != NULL)
 		astate->announced_cb = ipv4ll_announced_arp;
 	script_runreason(ifp, "IPV4LL");
-	dhcpcd_daemonise(ifp->ctx);
+	dhcpcd_bound(ifp);
 }
 
 static void
@@ -287,7 +286,7 @@ ipv4ll_defend_failed(struct interface *ifp)
 	if (ifp->options->options & DHCPCD_CONFIGURE)
 		ipv4_deladdr(state->addr, 1);
 	state->addr = NULL;
-	rt_build(ifp->ctx, AF_INET);
+	rt_deferif(ifp, AF_INET);
 	script_runreason(ifp, "IPV4LL");
 	ipv4ll_pickaddr(ifp);
 	ipv4ll_start(ifp);
@@ -456,7 +455,7 @@ ipv4ll_drop(struct interface *ifp)
 	}
 
 	if (dropped) {
-		rt_build(ifp->ctx, AF_INET);
+		rt_deferif(ifp, AF_INET);
 		script_runreason(ifp, "IPV4LL");
 	}
 }
@@ -501,7 +500,7 @@ ipv4ll_recvrt(__unused int cmd, const struct rt *rt)
 	ctx = rt->rt_ifp->ctx;
 	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
 		if (IPV4LL_STATE_RUNNING(ifp)) {
-			rt_build(ctx, AF_INET);
+			rt_defer(ctx, AF_INET);
 			break;
 		}
 	}
@@ -544,7 +543,7 @@ ipv4ll_handleifa(int cmd, struct ipv4_addr *ia, pid_t pid)
 		if (ifp->options->options & DHCPCD_CONFIGURE)
 			ipv4_deladdr(ia, 1);
 		state->addr = NULL;
-		rt_build(ifp->ctx, AF_INET);
+		rt_deferif(ifp, AF_INET);
 		ipv4ll_found(ifp);
 		return NULL;
 	}
@@ -124,6 +124,7 @@
 #ifdef IPV6_MANAGETEMPADDR
 static void ipv6_regentempaddr(void *);
 #endif
+static void ipv6_daddone(void *);
 
 int
 ipv6_init(struct dhcpcd_ctx *ctx)
@@ -136,6 +137,7 @@ ipv6_init(struct dhcpcd_ctx *ctx)
 	if (ctx->ra_routers == NULL)
 		return -1;
 	TAILQ_INIT(ctx->ra_routers);
+	rb_tree_init(&ctx->ra_tree, &ipv6nd_ra_ops);
 
 #ifndef __sun
 	ctx->nd_fd = -1;
@@ -313,21 +315,79 @@ ipv6_makestableprivate(struct in6_addr *addr,
     const struct interface *ifp,
     int *dad_counter)
 {
+	struct ipv6_state *state = IPV6_STATE(ifp);
+	struct ipv6_stableprivate *sp;
 	uint32_t dad;
-	int r;
 
 	dad = (uint32_t)*dad_counter;
 
+	/* The digest is the same every time we see the prefix,
+	 * so only work it out again if the inputs have changed. */
+	if (state != NULL) {
+		TAILQ_FOREACH(sp, &state->stableprivate, next) {
+			if (sp->dad_counter == dad &&
+			    sp->prefix_len == prefix_len &&
+			    IN6_ARE_ADDR_EQUAL(&sp->prefix, prefix))
+				break;
+		}
+		if (sp != NULL) {
+			if (sp != TAILQ_FIRST(&state->stableprivate)) {
+				TAILQ_REMOVE(&state->stableprivate, sp, next);
+				TAILQ_INSERT_HEAD(&state->stableprivate,
+				    sp, next);
+			}
+			*addr = sp->addr;
+			*dad_counter = (int)sp->dad_used;
+			return 0;
+		}
+	}
+
 	/* For our implementation, we shall set the hardware address
 	 * as the interface identifier */
-	r = ipv6_makestableprivate1(ifp->ctx, addr, prefix, prefix_len,
+	if (ipv6_makestableprivate1(ifp->ctx, addr, prefix, prefix_len,
 	    ifp->hwaddr, ifp->hwlen,
 	    ifp->ssid, ifp->ssid_len,
-	    ifp->vlanid, &dad);
+	    ifp->vlanid, &dad) == -1)
+		return -1;
 
-	if (r == 0)
-		*dad_counter = (int)dad;
-	return r;
+	if (state != NULL) {
+		if (state->stableprivate_len == IPV6_STABLEPRIVATE_MAX) {
+			sp = TAILQ_LAST(&state->stableprivate,
+			    ipv6_stableprivatehead);
+			TAILQ_REMOVE(&state->stableprivate, sp, next);
+		} else if ((sp = malloc(sizeof(*sp))) != NULL)
+			state->stableprivate_len++;
+		if (sp != NULL) {
+			sp->prefix = *prefix;
+			sp->prefix_len = prefix_len;
+			sp->dad_counter = (uint32_t)*dad_counter;
+			sp->dad_used = dad;
+			sp->addr = *addr;
+			TAILQ_INSERT_HEAD(&state->stableprivate, sp, next);
+		}
+	}
+
+	*dad_counter = (int)dad;
+	return 0;
+}
+
+/* Forget the addresses made by ipv6_makestableprivate when the
+ * hardware address or SSID they were made from changes.
+ * The secret is created once and never changes after that. */
+void
+ipv6_flushstableprivate(struct interface *ifp)
+{
+	struct ipv6_state *state = IPV6_STATE(ifp);
+	struct ipv6_stableprivate *sp;
+
+	if (state == NULL)
+		return;
+
+	while ((sp = TAILQ_FIRST(&state->stableprivate)) != NULL) {
+		TAILQ_REMOVE(&state->stableprivate, sp, next);
+		free(sp);
+	}
+	state->stableprivate_len = 0;
 }
 
 #ifdef IPV6_AF_TEMPORARY
@@ -344,8 +404,8 @@ ipv6_maketemporaryaddress(struct in6_addr *addr,
 	*addr = *prefix;
 
 again:
-	addr->s6_addr32[2] |= (arc4random() & ~mask.s6_addr32[2]);
-	addr->s6_addr32[3] |= (arc4random() & ~mask.s6_addr32[3]);
+	addr->s6_addr32[2] |= (rndpool_u32(ifp->ctx) & ~mask.s6_addr32[2]);
+	addr->s6_addr32[3] |= (rndpool_u32(ifp->ctx) & ~mask.s6_addr32[3]);
 
 	TAILQ_FOREACH(ifpn, ifp->ctx->ifaces, next) {
 		if (ipv6_iffindaddr(ifpn, addr, 0) != NULL)
@@ -607,6 +667,147 @@ ipv6_checkaddrflags(void *arg)
 }
 #endif
 
+/*
+ * Every address in an ipv6_state is also indexed by address in an open
+ * addressing hash of ia6_hashlen slots, a power of two kept at most half
+ * full, so finding an address does not walk the interface list.
+ * The hash is kept by ipv6_insertaddr and ipv6_removeaddr, so anything
+ * else changing state->addrs must use them.
+ * If the hash cannot grow it is dropped and lookups walk the lists
+ * until the last address is removed.
+ */
+#define	IA6_HASH_MIN	16
+
+static size_t
+ipv6_addrslot(const struct dhcpcd_ctx *ctx, const struct in6_addr *addr)
+{
+	uint32_t w[4], h = 0;
+	size_t i;
+
+	memcpy(w, addr->s6_addr, sizeof(w));
+	for (i = 0; i < __arraycount(w); i++)
+		h = (h ^ w[i]) * 0x9e3779b1U;
+	return (h ^ (h >> 16)) & (ctx->ia6_hashlen - 1);
+}
+
+static void
+ipv6_hashinsert(struct dhcpcd_ctx *ctx, struct ipv6_addr *ia)
+{
+	size_t mask = ctx->ia6_hashlen - 1, i;
+
+	for (i = ipv6_addrslot(ctx, &ia->addr);
+	    ctx->ia6_hash[i] != NULL;
+	    i = (i + 1) & mask)
+		;
+	ctx->ia6_hash[i] = ia;
+}
+
+static void
+ipv6_hashfree(struct dhcpcd_ctx *ctx)
+{
+
+	free(ctx->ia6_hash);
+	ctx->ia6_hash = NULL;
+	ctx->ia6_hashlen = 0;
+}
+
+static int
+ipv6_hashgrow(struct dhcpcd_ctx *ctx)
+{
+	struct ipv6_addr **hash, **ohash = ctx->ia6_hash;
+	size_t len, olen = ctx->ia6_hashlen, i;
+
+	len = olen == 0 ? IA6_HASH_MIN : olen * 2;
+	if ((hash = calloc(len, sizeof(*hash))) == NULL)
+		return -1;
+	ctx->ia6_hash = hash;
+	ctx->ia6_hashlen = len;
+	for (i = 0; i < olen; i++) {
+		if (ohash[i] != NULL)
+			ipv6_hashinsert(ctx, ohash[i]);
+	}
+	free(ohash);
+	return 0;
+}
+
+/* Add ia to state->addrs. */
+static void
+ipv6_insertaddr(struct ipv6_state *state, struct ipv6_addr *ia)
+{
+	struct dhcpcd_ctx *ctx = ia->iface->ctx;
+
+	TAILQ_INSERT_TAIL(&state->addrs, ia, next);
+	if (ctx->ia6_hashlen != 0 || ctx->ia6_naddrs == 0) {
+		if ((ctx->ia6_naddrs + 1) * 2 > ctx->ia6_hashlen &&
+		    ipv6_hashgrow(ctx) == -1)
+		{
+			logerr(__func__);
+			ipv6_hashfree(ctx);
+		} else
+			ipv6_hashinsert(ctx, ia);
+	}
+	ctx->ia6_naddrs++;
+}
+
+/* Remove ia from addrs, but don't free it.
+ * addrs need not be a state->addrs as ipv6_freedrop_addrs
+ * serves the other address lists as well. */
+static void
+ipv6_removeaddr(struct ipv6_addrhead *addrs, struct ipv6_addr *ia)
+{
+	struct dhcpcd_ctx *ctx = ia->iface->ctx;
+	struct ipv6_state *state = IPV6_STATE(ia->iface);
+	struct ipv6_addr **hash = ctx->ia6_hash;
+	size_t mask = ctx->ia6_hashlen - 1, i, j, k;
+
+	TAILQ_REMOVE(addrs, ia, next);
+	if (state == NULL || addrs != &state->addrs)
+		return;
+	if (--ctx->ia6_naddrs == 0) {
+		ipv6_hashfree(ctx);
+		return;
+	}
+	if (ctx->ia6_hashlen == 0)
+		return;
+
+	for (i = ipv6_addrslot(ctx, &ia->addr);
+	    hash[i] != ia;
+	    i = (i + 1) & mask)
+	{
+		if (hash[i] == NULL)
+			return;
+	}
+	hash[i] = NULL;
+
+	/* Shift back any following entries that can no longer be reached
+	 * so lookups can still stop at the first empty slot. */
+	for (j = (i + 1) & mask; hash[j] != NULL; j = (j + 1) & mask) {
+		k = ipv6_addrslot(ctx, &hash[j]->addr);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		hash[i] = hash[j];
+		hash[j] = NULL;
+		i = j;
+	}
+}
+
+static struct ipv6_addr *
+ipv6_hashfind(struct dhcpcd_ctx *ctx, const struct interface *ifp,
+    const struct in6_addr *addr)
+{
+	struct ipv6_addr *ia;
+	size_t mask = ctx->ia6_hashlen - 1, i;
+
+	for (i = ipv6_addrslot(ctx, addr);
+	    (ia = ctx->ia6_hash[i]) != NULL;
+	    i = (i + 1) & mask)
+	{
+		if (ia->iface == ifp && IN6_ARE_ADDR_EQUAL(&ia->addr, addr))
+			return ia;
+	}
+	return NULL;
+}
+
 static void
 ipv6_deletedaddr(struct ipv6_addr *ia)
 {
@@ -645,12 +846,10 @@ ipv6_deleteaddr(struct ipv6_addr *ia)
 	ipv6_deletedaddr(ia);
 
 	state = IPV6_STATE(ia->iface);
-	TAILQ_FOREACH(ap, &state->addrs, next) {
-		if (IN6_ARE_ADDR_EQUAL(&ap->addr, &ia->addr)) {
-			TAILQ_REMOVE(&state->addrs, ap, next);
-			ipv6_freeaddr(ap);
-			break;
-		}
+	ap = ipv6_iffindaddr(ia->iface, &ia->addr, 0);
+	if (ap != NULL) {
+		ipv6_removeaddr(&state->addrs, ap);
+		ipv6_freeaddr(ap);
 	}
 
 #ifdef ND6_ADVERTISE
@@ -754,7 +953,10 @@ ipv6_addaddr1(struct ipv6_addr *ia, const struct timespec *now)
 		    " seconds",
 		    ifp->name, ia->prefix_pltime, ia->prefix_vltime);
 
+	if (if_batching(ifp->ctx))
+		ia->batch_cmd = (ssize_t)if_batch_count(ifp->ctx);
 	if (if_address6(RTM_NEWADDR, ia) == -1) {
+		ia->batch_cmd = -1;
 		logerr(__func__);
 		/* Restore real pltime and vltime */
 		ia->prefix_pltime = pltime;
@@ -805,12 +1007,12 @@ ipv6_addaddr1(struct ipv6_addr *ia, const struct timespec *now)
 			break;
 	}
 	if (ia2 == NULL) {
-		if ((ia2 = malloc(sizeof(*ia2))) == NULL) {
+		if ((ia2 = pool_get(&ifp->ctx->ia6_pool)) == NULL) {
 			logerr(__func__);
 			return 0; /* Well, we did add the address */
 		}
 		memcpy(ia2, ia, sizeof(*ia2));
-		TAILQ_INSERT_TAIL(&state->addrs, ia2, next);
+		ipv6_insertaddr(state, ia2);
 	}
 #endif
 
@@ -818,8 +1020,9 @@ ipv6_addaddr1(struct ipv6_addr *ia, const struct timespec *now)
 #ifdef __sun
 advertise:
 #endif
-	/* Re-advertise the preferred address to be safe. */
-	if (!vltime_was_zero)
+	/* Re-advertise the preferred address to be safe,
+	 * unless resumed when neighbours already know it. */
+	if (!vltime_was_zero && !ia->iface->warm)
 		ipv6nd_advertise(ia);
 #endif
 
@@ -909,7 +1112,7 @@ ipv6_addaddr(struct ipv6_addr *ia, const struct timespec *now)
 			struct ipv6_state *state;
 
 			state = IPV6_STATE(ia->iface);
-			TAILQ_REMOVE(&state->addrs, replaced_ia, next);
+			ipv6_removeaddr(&state->addrs, replaced_ia);
 			ipv6_freeaddr(replaced_ia);
 		}
 #endif
@@ -995,7 +1198,21 @@ ipv6_addaddrs(struct ipv6_addrhead *iaddrs)
 {
 	struct timespec now;
 	struct ipv6_addr *ia, *ian;
-	ssize_t i, r;
+	ssize_t i, r, n;
+	const struct psr_result *results;
+	struct dhcpcd_ctx *ctx;
+	bool batch;
+
+	ia = TAILQ_FIRST(iaddrs);
+	if (ia == NULL)
+		return 0;
+	ctx = ia->iface->ctx;
+
+	/* Send the changes to the addresses in one batch. */
+	TAILQ_FOREACH(ia, iaddrs, next) {
+		ia->batch_cmd = -1;
+	}
+	batch = if_batch_begin(ctx) != -1;
 
 	i = 0;
 	timespecclear(&now);
@@ -1008,6 +1225,33 @@ ipv6_addaddrs(struct ipv6_addrhead *iaddrs)
 			ipv6_freeaddr(ia);
 		}
 	}
+
+	if (!batch)
+		return i;
+	n = if_batch_end(ctx, &results);
+	if (n == -1)
+		logerr("%s: if_batch_end", __func__);
+	for (r = 0; r < n; r++) {
+		if (results[r].psr_result != -1)
+			continue;
+		errno = results[r].psr_errno;
+		TAILQ_FOREACH(ia, iaddrs, next) {
+			if (ia->batch_cmd == r)
+				break;
+		}
+		if (ia == NULL) {
+			/* Deleted addresses are already forgotten. */
+			if (errno != EADDRNOTAVAIL && errno != ESRCH &&
+			    errno != ENXIO && errno != ENODEV)
+				logerr("ipv6_deleteaddr");
+			continue;
+		}
+		logerr("%s: %s", __func__, ia->saddr);
+		ia->flags &= ~IPV6_AF_ADDED;
+	}
+	TAILQ_FOREACH(ia, iaddrs, next) {
+		ia->batch_cmd = -1;
+	}
 	return i;
 }
 
@@ -1035,7 +1279,7 @@ ipv6_freeaddr(struct ipv6_addr *ia)
 
 	eloop_q_timeout_delete(eloop, ELOOP_QUEUE_ALL, NULL, ia);
 	free(ia->na);
-	free(ia);
+	pool_put(&ia->iface->ctx->ia6_pool, ia);
 }
 
 void
@@ -1057,7 +1301,7 @@ ipv6_freedrop_addrs(struct ipv6_addrhead *addrs, int drop,
 			continue;
 #endif
 		if (drop != 2)
-			TAILQ_REMOVE(addrs, ap, next);
+			ipv6_removeaddr(addrs, ap);
 		if (drop && ap->flags & IPV6_AF_ADDED &&
 		    (ap->iface->options->options &
 		    (DHCPCD_EXITING | DHCPCD_PERSISTENT)) !=
@@ -1068,7 +1312,7 @@ ipv6_freedrop_addrs(struct ipv6_addrhead *addrs, int drop,
 			    CAN_DROP_LLADDR(ap->iface))
 			{
 				if (drop == 2)
-					TAILQ_REMOVE(addrs, ap, next);
+					ipv6_removeaddr(addrs, ap);
 				/* Find the same address somewhere else */
 				apf = ipv6_findaddr(ap->iface->ctx, &ap->addr,
 				    0);
@@ -1105,8 +1349,10 @@ ipv6_getstate(struct interface *ifp)
 			logerr(__func__);
 			return NULL;
 		}
+		state->iface = ifp;
 		TAILQ_INIT(&state->addrs);
 		TAILQ_INIT(&state->ll_callbacks);
+		TAILQ_INIT(&state->stableprivate);
 	}
 	return state;
 }
@@ -1196,22 +1442,37 @@ ipv6_handleifa(struct dhcpcd_ctx *ctx,
 	if ((state = ipv6_getstate(ifp)) == NULL)
 		return;
 	anyglobal = ipv6_anyglobal(ifp) != NULL;
-
-	TAILQ_FOREACH(ia, &state->addrs, next) {
-		if (IN6_ARE_ADDR_EQUAL(&ia->addr, addr))
-			break;
-	}
+	ia = ipv6_iffindaddr(ifp, addr, 0);
+
+#ifdef IN6_IFF_OPTIMISTIC
+	/* RFC 4429 allows an optimistic address to be used while DAD
+	 * runs, so treat it as done unless DAD has already failed. */
+	if (cmd == RTM_NEWADDR &&
+	    ifp->options != NULL && ifp->options->optimistic_dad &&
+	    (addrflags & (IN6_IFF_OPTIMISTIC | IN6_IFF_DUPLICATED)) ==
+	    IN6_IFF_OPTIMISTIC)
+		addrflags &= ~IN6_IFF_TENTATIVE;
+#endif
 
 	switch (cmd) {
 	case RTM_DELADDR:
 		if (ia != NULL) {
-			TAILQ_REMOVE(&state->addrs, ia, next);
+			ipv6_removeaddr(&state->addrs, ia);
 #ifdef ND6_ADVERTISE
 			/* Advertise the address if it exists on
 			 * another interface. */
 			ipv6nd_advertise(ia);
 #endif
 			/* We'll free it at the end of the function. */
+		} else {
+			/* An address can fail optimistic DAD and be removed
+			 * before we read the kernel announcing it. */
+			struct ipv6_addr ia0 = { .iface = ifp, .addr = *addr };
+
+			ipv6nd_handleifa(cmd, &ia0, pid);
+#ifdef DHCP6
+			dhcp6_handleifa(cmd, &ia0, pid);
+#endif
 		}
 		break;
 	case RTM_NEWADDR:
@@ -1244,7 +1505,7 @@ ipv6_handleifa(struct dhcpcd_ctx *ctx,
 			 * generate a new temporary address on
 			 * restart. */
 			ia->acquired = ia->created;
-			TAILQ_INSERT_TAIL(&state->addrs, ia, next);
+			ipv6_insertaddr(state, ia);
 		}
 		ia->addr_flags = addrflags;
 		ia->flags &= ~IPV6_AF_STALE;
@@ -1299,16 +1560,16 @@ ipv6_handleifa(struct dhcpcd_ctx *ctx,
 	else if (!(ia->addr_flags & IN6_IFF_NOTUSEABLE))
 		ia->flags |= IPV6_AF_DADCOMPLETED;
 
-	/* If we've not already called rt_build via the IPv6ND
+	/* If we've not already called rt_defer via the IPv6ND
 	 * or DHCP6 handlers and the existance of any useable
 	 * global address on the interface has changed,
-	 * call rt_build to add/remove the default route. */
+	 * call rt_defer to add/remove the default route. */
 	if (ifp->active &&
 	    ((ifp->options != NULL && ifp->options->options & DHCPCD_IPV6) ||
 	     (ifp->options == NULL && ctx->options & DHCPCD_IPV6)) &&
 	    !(ctx->options & DHCPCD_RTBUILD) &&
 	    (ipv6_anyglobal(ifp) != NULL) != anyglobal)
-		rt_build(ctx, AF_INET6);
+		rt_defer(ctx, AF_INET6);
 }
 
 int
@@ -1331,6 +1592,13 @@ ipv6_iffindaddr(struct interface *ifp, const struct in6_addr *addr,
 	struct ipv6_state *state;
 	struct ipv6_addr *ap;
 
+	if (addr != NULL && ifp->ctx->ia6_hashlen != 0) {
+		ap = ipv6_hashfind(ifp->ctx, ifp, addr);
+		if (ap != NULL && revflags && ap->addr_flags & revflags)
+			return NULL;
+		return ap;
+	}
+
 	state = IPV6_STATE(ifp);
 	if (state) {
 		TAILQ_FOREACH(ap, &state->addrs, next) {
@@ -1472,7 +1740,7 @@ nextslaacprivate:
 		if (ipv6_makestableprivate(&ap->addr,
 			&ap->prefix, ap->prefix_len, ifp, &dadcounter) == -1)
 		{
-			free(ap);
+			ipv6_freeaddr(ap);
 			return -1;
 		}
 		ap->dadcounter = dadcounter;
@@ -1492,7 +1760,7 @@ nextslaacprivate:
 			} else if (ifp->hwlen == 8)
 				memcpy(&ap->addr.s6_addr[8], ifp->hwaddr, 8);
 			else {
-				free(ap);
+				ipv6_freeaddr(ap);
 				errno = ENOTSUP;
 				return -1;
 			}
@@ -1501,7 +1769,7 @@ nextslaacprivate:
 
 		/* Sanity check: g bit must not indciate "group" */
 		if (EUI64_GROUP(&ap->addr)) {
-			free(ap);
+			ipv6_freeaddr(ap);
 			errno = EINVAL;
 			return -1;
 		}
@@ -1518,21 +1786,21 @@ nextslaacprivate:
 					dadcounter++;
 					goto nextslaacprivate;
 				}
-				free(ap);
+				ipv6_freeaddr(ap);
 				errno = EADDRNOTAVAIL;
 				return -1;
 			}
 
 			logwarnx("%s: waiting for %s to complete",
 			    ap2->iface->name, ap2->saddr);
-			free(ap);
+			ipv6_freeaddr(ap);
 			errno =	EEXIST;
 			return 0;
 		}
 	}
 
 	inet_ntop(AF_INET6, &ap->addr, ap->saddr, sizeof(ap->saddr));
-	TAILQ_INSERT_TAIL(&state->addrs, ap, next);
+	ipv6_insertaddr(state, ap);
 	ipv6_addaddr(ap, NULL);
 	return 1;
 }
@@ -1632,7 +1900,7 @@ ipv6_newaddr(struct interface *ifp, const struct in6_addr *addr,
 	} else
 		addr_flags = IN6_IFF_TENTATIVE;
 
-	ia = calloc(1, sizeof(*ia));
+	ia = pool_get(&ifp->ctx->ia6_pool);
 	if (ia == NULL)
 		goto err;
 
@@ -1643,6 +1911,7 @@ ipv6_newaddr(struct interface *ifp, const struct in6_addr *addr,
 		ia->flags |= IPV6_AF_DADCOMPLETED;
 	ia->prefix_len = prefix_len;
 	ia->dhcp6_fd = -1;
+	ia->batch_cmd = -1;
 
 #ifndef SMALL
 	TAILQ_INIT(&ia->pd_pfxs);
@@ -1693,7 +1962,8 @@ paddr:
 
 err:
 	logerr(__func__);
-	free(ia);
+	if (ia != NULL)
+		pool_put(&ifp->ctx->ia6_pool, ia);
 	return NULL;
 }
 
@@ -1792,7 +2062,7 @@ ipv6_startstatic(struct interface *ifp)
 		if (ia == NULL)
 			return -1;
 		state = IPV6_STATE(ifp);
-		TAILQ_INSERT_TAIL(&state->addrs, ia, next);
+		ipv6_insertaddr(state, ia);
 		run_script = 0;
 	} else
 		run_script = 1;
@@ -1801,7 +2071,7 @@ ipv6_startstatic(struct interface *ifp)
 	ia->prefix_pltime = ND6_INFINITE_LIFETIME;
 	ia->dadcallback = ipv6_staticdadcallback;
 	ipv6_addaddr(ia, NULL);
-	rt_build(ifp->ctx, AF_INET6);
+	rt_deferif(ifp, AF_INET6);
 	if (run_script)
 		script_runreason(ifp, "STATIC6");
 	return 1;
@@ -1860,10 +2130,12 @@ ipv6_freedrop(struct interface *ifp, int drop)
 	ipv6_freedrop_addrs(&state->addrs, drop ? 2 : 0, NULL);
 	if (drop) {
 		if (ifp->ctx->ra_routers != NULL)
-			rt_build(ifp->ctx, AF_INET6);
+			rt_defer(ifp->ctx, AF_INET6);
 	} else {
 		/* Because we need to cache the addresses we don't control,
 		 * we only free the state on when NOT dropping addresses. */
+		eloop_timeout_delete(ifp->ctx->eloop, ipv6_daddone, state);
+		ipv6_flushstableprivate(ifp);
 		free(state);
 		ifp->if_data[IF_DATA_IPV6] = NULL;
 		eloop_timeout_delete(ifp->ctx->eloop, NULL, ifp);
@@ -1878,6 +2150,32 @@ ipv6_ctxfree(struct dhcpcd_ctx *ctx)
 	free(ctx->secret);
 }
 
+/*
+ * RA and DHCPv6 addresses which finish DAD are handed to their callbacks
+ * together once the kernel messages read this eloop tick are processed,
+ * so each set is checked for completion and reported once per batch
+ * rather than once per address.
+ */
+static void
+ipv6_daddone(void *arg)
+{
+	struct ipv6_state *state = arg;
+
+	ipv6nd_daddone(state->iface);
+#ifdef DHCP6
+	dhcp6_daddone(state->iface);
+#endif
+}
+
+static void
+ipv6_dadqueue(struct ipv6_addr *ia)
+{
+	struct ipv6_state *state = IPV6_STATE(ia->iface);
+
+	ia->flags |= IPV6_AF_DADPENDING;
+	eloop_timeout_add_sec(ia->iface->ctx->eloop, 0, ipv6_daddone, state);
+}
+
 int
 ipv6_handleifa_addrs(int cmd,
     struct ipv6_addrhead *addrs, const struct ipv6_addr *addr, pid_t pid)
@@ -1896,6 +2194,17 @@ ipv6_handleifa_addrs(int cmd,
 		}
 		switch (cmd) {
 		case RTM_DELADDR:
+			/* The kernel removes an optimistic address
+			 * which fails DAD rather than marking it. */
+			if ((ia->flags & (IPV6_AF_ADDED |
+			    IPV6_AF_DADCOMPLETED | IPV6_AF_DELEGATED)) ==
+			    IPV6_AF_ADDED &&
+			    ia->iface->options->optimistic_dad)
+			{
+				ia->addr_flags |= IN6_IFF_DUPLICATED;
+				found++;
+				ipv6_dadqueue(ia);
+			}
 			if (ia->flags & IPV6_AF_ADDED) {
 				logwarnx("%s: pid %d deleted address %s",
 				    ia->iface->name, pid, ia->saddr);
@@ -1908,6 +2217,19 @@ ipv6_handleifa_addrs(int cmd,
 			}
 			break;
 		case RTM_NEWADDR:
+			/* An address used optimistically can still fail
+			 * DAD, so let the callback deal with it. */
+			if (ia->flags & IPV6_AF_DADCOMPLETED &&
+			    addr->addr_flags & IN6_IFF_DUPLICATED &&
+			    !(ia->addr_flags & IN6_IFF_DUPLICATED) &&
+			    ia->iface->options->optimistic_dad)
+			{
+				ia->addr_flags = addr->addr_flags;
+				ia->flags &= ~IPV6_AF_DADCOMPLETED;
+				found++;
+				ipv6_dadqueue(ia);
+				break;
+			}
 			ia->addr_flags = addr->addr_flags;
 			/* Safety - ignore tentative announcements */
 			if (ia->addr_flags &
@@ -1915,11 +2237,7 @@ ipv6_handleifa_addrs(int cmd,
 				break;
 			if ((ia->flags & IPV6_AF_DADCOMPLETED) == 0) {
 				found++;
-				if (ia->dadcallback)
-					ia->dadcallback(ia);
-				/* We need to set this here in-case the
-				 * dadcallback function checks it */
-				ia->flags |= IPV6_AF_DADCOMPLETED;
+				ipv6_dadqueue(ia);
 			}
 			break;
 		}
@@ -1946,7 +2264,7 @@ ipv6_regen_desync(struct interface *ifp, bool force)
 		return;
 	if (state->desync_factor == 0)
 		state->desync_factor =
-		    arc4random_uniform(MIN(MAX_DESYNC_FACTOR, max));
+		    rndpool_uniform(ifp->ctx, MIN(MAX_DESYNC_FACTOR, max));
 	max = TEMP_PREFERRED_LIFETIME - state->desync_factor - REGEN_ADVANCE;
 	eloop_timeout_add_sec(ifp->ctx->eloop, max, ipv6_regentempaddrs, ifp);
 }
@@ -2004,11 +2322,11 @@ ipv6_createtempaddr(struct ipv6_addr *ia0, const struct timespec *now)
 	    ia->prefix_pltime > ia0->prefix_vltime)
 	{
 		errno =	EINVAL;
-		free(ia);
+		ipv6_freeaddr(ia);
 		return NULL;
 	}
 
-	TAILQ_INSERT_TAIL(&state->addrs, ia, next);
+	ipv6_insertaddr(state, ia);
 	return ia;
 }
 
@@ -2298,7 +2616,7 @@ inet6_staticroutes(rb_tree_t *routes, struct dhcpcd_ctx *ctx)
 	struct rt *rt;
 
 	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
-		if ((state = IPV6_STATE(ifp)) == NULL)
+		if (!rt_ifdirty(ifp) || (state = IPV6_STATE(ifp)) == NULL)
 			continue;
 		TAILQ_FOREACH(ia, &state->addrs, next) {
 			if ((ia->flags & (IPV6_AF_ADDED | IPV6_AF_STATIC)) ==
@@ -2324,7 +2642,7 @@ inet6_raroutes(rb_tree_t *routes, struct dhcpcd_ctx *ctx)
 		return 0;
 
 	TAILQ_FOREACH(rap, ctx->ra_routers, next) {
-		if (rap->expired)
+		if (rap->expired || !rt_ifdirty(rap->iface))
 			continue;
 		TAILQ_FOREACH(addr, &rap->addrs, next) {
 			if (addr->prefix_vltime == 0)
@@ -2365,6 +2683,8 @@ inet6_dhcproutes(rb_tree_t *routes, struct dhcpcd_ctx *ctx,
 	struct rt *rt;
 
 	TAILQ_FOREACH(ifp, ctx->ifaces, next) {
+		if (!rt_ifdirty(ifp))
+			continue;
 		d6_state = D6_CSTATE(ifp);
 		if (d6_state && d6_state->state == dstate) {
 			TAILQ_FOREACH(addr, &d6_state->addrs, next) {
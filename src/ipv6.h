@@ -147,6 +147,7 @@
 #  endif
 #  ifdef IFA_F_OPTIMISTIC
 #    define IN6_IFF_TENTATIVE	(IFA_F_TENTATIVE | IFA_F_OPTIMISTIC)
+#    define IN6_IFF_OPTIMISTIC	IFA_F_OPTIMISTIC
 #  else
 #    define IN6_IFF_TENTATIVE   (IFA_F_TENTATIVE | 0x04)
 #  endif
@@ -189,6 +190,8 @@ struct ipv6_addr {
 	uint8_t iaid[4];
 	uint16_t ia_type;
 	int dhcp6_fd;
+	ssize_t batch_cmd;	/* where RTM_NEWADDR is in the batch */
+	rb_node_t ia_tree;	/* see dhcp6_findia */
 
 #ifndef SMALL
 	struct ipv6_addr *delegating_prefix;
@@ -222,7 +225,6 @@ struct ipv6_addr {
 #define	IPV6_AF_NOREJECT	(1U << 8)
 #define	IPV6_AF_REQUEST		(1U << 9)
 #define	IPV6_AF_STATIC		(1U << 10)
-#define	IPV6_AF_DELEGATEDLOG	(1U << 11)
 #define	IPV6_AF_RAPFX		(1U << 12)
 #define	IPV6_AF_EXTENDED	(1U << 13)
 #define	IPV6_AF_REGEN		(1U << 14)
@@ -230,6 +232,7 @@ struct ipv6_addr {
 #ifdef IPV6_MANAGETEMPADDR
 #define	IPV6_AF_TEMPORARY	(1U << 16)
 #endif
+#define	IPV6_AF_DADPENDING	(1U << 17)	/* see ipv6_daddone */
 
 struct ll_callback {
 	TAILQ_ENTRY(ll_callback) next;
@@ -238,9 +241,24 @@ struct ll_callback {
 };
 TAILQ_HEAD(ll_callback_head, ll_callback);
 
+/* RFC 7217 addresses already made, see ipv6_makestableprivate */
+struct ipv6_stableprivate {
+	TAILQ_ENTRY(ipv6_stableprivate) next;
+	struct in6_addr prefix;
+	int prefix_len;
+	uint32_t dad_counter;
+	uint32_t dad_used;
+	struct in6_addr addr;
+};
+TAILQ_HEAD(ipv6_stableprivatehead, ipv6_stableprivate);
+#define	IPV6_STABLEPRIVATE_MAX	16
+
 struct ipv6_state {
+	struct interface *iface;
 	struct ipv6_addrhead addrs;
 	struct ll_callback_head ll_callbacks;
+	struct ipv6_stableprivatehead stableprivate;
+	size_t stableprivate_len;
 
 #ifdef IPV6_MANAGETEMPADDR
 	uint32_t desync_factor;
@@ -257,6 +275,7 @@ struct ipv6_state {
 int ipv6_init(struct dhcpcd_ctx *);
 int ipv6_makestableprivate(struct in6_addr *,
     const struct in6_addr *, int, const struct interface *, int *);
+void ipv6_flushstableprivate(struct interface *);
 int ipv6_makeaddr(struct in6_addr *, struct interface *,
     const struct in6_addr *, int, unsigned int);
 int ipv6_mask(struct in6_addr *, int);
@@ -50,6 +50,7 @@
 #include "dhcp-common.h"
 #include "dhcp6.h"
 #include "eloop.h"
+#include "handoff.h"
 #include "if.h"
 #include "ipv6.h"
 #include "ipv6nd.h"
@@ -132,6 +133,8 @@ __CTASSERT(sizeof(struct nd_opt_rdnss) == 8);
 //
 
 static void ipv6nd_handledata(void *, unsigned short);
+static void ipv6nd_sortifrouters(struct interface *);
+static void ipv6nd_expirerouter(void *);
 
 /*
  * Android ships buggy ICMP6 filter headers.
@@ -324,29 +327,157 @@ ipv6nd_makersprobe(struct interface *ifp)
 	return 0;
 }
 
-static void
-ipv6nd_sendrsprobe(void *arg)
-{
-	struct interface *ifp = arg;
-	struct rs_state *state = RS_STATE(ifp);
-	struct sockaddr_in6 dst = {
-		.sin6_family = AF_INET6,
-		.sin6_addr = IN6ADDR_LINKLOCAL_ALLROUTERS_INIT,
-		.sin6_scope_id = ifp->index,
-	};
-	struct iovec iov = { .iov_base = state->rs, .iov_len = state->rslen };
+/* A Router Solicitation ready for sendmsg(2). */
+struct ipv6nd_rsmsg {
+	struct sockaddr_in6 dst;
+	struct iovec iov;
 	union {
 		struct cmsghdr hdr;
 		uint8_t buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-	} cmsgbuf = { .buf = { 0 } };
-	struct msghdr msg = {
-	    .msg_name = &dst, .msg_namelen = sizeof(dst),
-	    .msg_iov = &iov, .msg_iovlen = 1,
-	    .msg_control = cmsgbuf.buf, .msg_controllen = sizeof(cmsgbuf.buf),
-	};
+	} cmsgbuf;
+	struct msghdr msg;
+};
+
+static void
+ipv6nd_makersmsg(struct interface *ifp, struct ipv6nd_rsmsg *rm)
+{
+	struct rs_state *state = RS_STATE(ifp);
 	struct cmsghdr *cm;
 	struct in6_pktinfo pi = { .ipi6_ifindex = ifp->index };
-	int s;
+
+	memset(rm, 0, sizeof(*rm));
+	rm->dst.sin6_family = AF_INET6;
+	rm->dst.sin6_addr = (struct in6_addr)IN6ADDR_LINKLOCAL_ALLROUTERS_INIT;
+	rm->dst.sin6_scope_id = ifp->index;
+#ifdef HAVE_SA_LEN
+	rm->dst.sin6_len = sizeof(rm->dst);
+#endif
+	rm->iov.iov_base = state->rs;
+	rm->iov.iov_len = state->rslen;
+	rm->msg.msg_name = &rm->dst;
+	rm->msg.msg_namelen = sizeof(rm->dst);
+	rm->msg.msg_iov = &rm->iov;
+	rm->msg.msg_iovlen = 1;
+	rm->msg.msg_control = rm->cmsgbuf.buf;
+	rm->msg.msg_controllen = sizeof(rm->cmsgbuf.buf);
+
+	/* Set the outbound interface */
+	cm = CMSG_FIRSTHDR(&rm->msg);
+	assert(cm != NULL);
+	cm->cmsg_level = IPPROTO_IPV6;
+	cm->cmsg_type = IPV6_PKTINFO;
+	cm->cmsg_len = CMSG_LEN(sizeof(pi));
+	memcpy(CMSG_DATA(cm), &pi, sizeof(pi));
+}
+
+#ifndef __sun
+/*
+ * Every interface solicits on the one socket, so solicitations due
+ * together, such as when many interfaces start at once, are queued
+ * for up to ND_RSQ_WAIT milliseconds and sent with as few syscalls
+ * as possible.
+ */
+#define	ND_RSQ_WAIT	1	/* milliseconds */
+
+static void
+ipv6nd_flushrs(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	struct ipv6nd_rsmsg rms[ND_RSQ_LEN];
+	struct interface *ifps[ND_RSQ_LEN], *ifp;
+	struct rs_state *state;
+	size_t i, n;
+#ifdef __linux__
+	struct mmsghdr mm[ND_RSQ_LEN];
+	int r;
+#endif
+
+	eloop_timeout_delete(ctx->eloop, ipv6nd_flushrs, ctx);
+	for (i = n = 0; i < ctx->nd_rsq_len; i++) {
+		ifp = ctx->nd_rsq[i];
+		state = RS_STATE(ifp);
+		state->rs_queued = false;
+		if (state->rs == NULL)
+			continue;
+		ipv6nd_makersmsg(ifp, &rms[n]);
+		ifps[n++] = ifp;
+	}
+	ctx->nd_rsq_len = 0;
+	if (n == 0 || ctx->nd_fd == -1)
+		return;
+
+	/* Allow IPv6ND to continue .... at most a few errors
+	 * would be logged.
+	 * Generally the error is ENOBUFS when struggling to
+	 * associate with an access point. */
+#ifdef __linux__
+	memset(mm, 0, sizeof(mm[0]) * n);
+	for (i = 0; i < n; i++)
+		mm[i].msg_hdr = rms[i].msg;
+	for (i = 0; i < n; i += (size_t)r) {
+		r = sendmmsg(ctx->nd_fd, mm + i, (unsigned int)(n - i), 0);
+		if (r == -1) {
+			/* Only the first message failed, skip it. */
+			logerr("%s: %s", __func__, ifps[i]->name);
+			r = 1;
+		}
+	}
+#else
+	for (i = 0; i < n; i++) {
+		if (sendmsg(ctx->nd_fd, &rms[i].msg, 0) == -1)
+			logerr("%s: %s", __func__, ifps[i]->name);
+	}
+#endif
+}
+
+static void
+ipv6nd_queuers(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct rs_state *state = RS_STATE(ifp);
+
+	if (state->rs_queued)
+		return;
+	if (ctx->nd_rsq_len == ND_RSQ_LEN)
+		ipv6nd_flushrs(ctx);
+	ctx->nd_rsq[ctx->nd_rsq_len++] = ifp;
+	state->rs_queued = true;
+	if (ctx->nd_rsq_len == 1)
+		eloop_timeout_add_msec(ctx->eloop, ND_RSQ_WAIT,
+		    ipv6nd_flushrs, ctx);
+}
+
+static void
+ipv6nd_unqueuers(struct interface *ifp)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct rs_state *state = RS_STATE(ifp);
+	size_t i;
+
+	if (!state->rs_queued)
+		return;
+	for (i = 0; i < ctx->nd_rsq_len; i++) {
+		if (ctx->nd_rsq[i] == ifp)
+			break;
+	}
+	assert(i != ctx->nd_rsq_len);
+	ctx->nd_rsq_len--;
+	memmove(&ctx->nd_rsq[i], &ctx->nd_rsq[i + 1],
+	    (ctx->nd_rsq_len - i) * sizeof(ctx->nd_rsq[0]));
+	state->rs_queued = false;
+	if (ctx->nd_rsq_len == 0)
+		eloop_timeout_delete(ctx->eloop, ipv6nd_flushrs, ctx);
+}
+#endif
+
+static void
+ipv6nd_sendrsprobe(void *arg)
+{
+	struct interface *ifp = arg;
+	struct rs_state *state = RS_STATE(ifp);
+#if defined(PRIVSEP) || defined(__sun)
+	struct ipv6nd_rsmsg rm;
+#endif
 #ifndef __sun
 	struct dhcpcd_ctx *ctx = ifp->ctx;
 #endif
@@ -358,23 +489,15 @@ ipv6nd_sendrsprobe(void *arg)
 		return;
 	}
 
-#ifdef HAVE_SA_LEN
-	dst.sin6_len = sizeof(dst);
-#endif
-
-	/* Set the outbound interface */
-	cm = CMSG_FIRSTHDR(&msg);
-	if (cm == NULL) /* unlikely */
-		return;
-	cm->cmsg_level = IPPROTO_IPV6;
-	cm->cmsg_type = IPV6_PKTINFO;
-	cm->cmsg_len = CMSG_LEN(sizeof(pi));
-	memcpy(CMSG_DATA(cm), &pi, sizeof(pi));
-
 	logdebugx("%s: sending Router Solicitation", ifp->name);
 #ifdef PRIVSEP
 	if (IN_PRIVSEP(ifp->ctx)) {
-		if (ps_inet_sendnd(ifp, &msg) == -1)
+#ifndef __sun
+		if (ps_inet_listen(ctx, PS_ND) == -1)
+			logerr("%s: ps_inet_listen", __func__);
+#endif
+		ipv6nd_makersmsg(ifp, &rm);
+		if (ps_inet_sendnd(ifp, &rm.msg) == -1)
 			logerr(__func__);
 		goto sent;
 	}
@@ -386,7 +509,14 @@ ipv6nd_sendrsprobe(void *arg)
 			return;
 		}
 	}
-	s = state->nd_fd;
+	ipv6nd_makersmsg(ifp, &rm);
+	if (sendmsg(state->nd_fd, &rm.msg, 0) == -1) {
+		logerr(__func__);
+		/* Allow IPv6ND to continue .... at most a few errors
+		 * would be logged.
+		 * Generally the error is ENOBUFS when struggling to
+		 * associate with an access point. */
+	}
 #else
 	if (ctx->nd_fd == -1) {
 		ctx->nd_fd = ipv6nd_open(true);
@@ -398,19 +528,15 @@ ipv6nd_sendrsprobe(void *arg)
 		    ipv6nd_handledata, ctx) == -1)
 			logerr("%s: eloop_event_add", __func__);
 	}
-	s = ifp->ctx->nd_fd;
+	ipv6nd_queuers(ifp);
 #endif
-	if (sendmsg(s, &msg, 0) == -1) {
-		logerr(__func__);
-		/* Allow IPv6ND to continue .... at most a few errors
-		 * would be logged.
-		 * Generally the error is ENOBUFS when struggling to
-		 * associate with an access point. */
-	}
 
 #ifdef PRIVSEP
 sent:
 #endif
+	ifp->stats.tx[IF_STAT_ND]++;
+	if (state->rsprobes != 0)
+		ifp->stats.retrans[IF_STAT_ND]++;
 	if (state->rsprobes++ < MAX_RTR_SOLICITATIONS)
 		eloop_timeout_add_sec(ifp->ctx->eloop,
 		    RTR_SOLICITATION_INTERVAL, ipv6nd_sendrsprobe, ifp);
@@ -479,6 +605,7 @@ ipv6nd_sendadvertisement(void *arg)
 #ifdef PRIVSEP
 sent:
 #endif
+	ifp->stats.tx[IF_STAT_ND]++;
 	if (++ia->na_count < MAX_NEIGHBOR_ADVERTISEMENT) {
 		eloop_timeout_add_sec(ctx->eloop,
 		    state->retrans / 1000, ipv6nd_sendadvertisement, ia);
@@ -607,6 +734,7 @@ ipv6nd_startexpire(struct interface *ifp)
 		if (rap->iface == ifp)
 			rap->willexpire = true;
 	}
+	ipv6nd_sortifrouters(ifp);
 	eloop_q_timeout_add_sec(ifp->ctx->eloop, ELOOP_IPV6RA_EXPIRE,
 	    RTR_CARRIER_EXPIRE, ipv6nd_expire, ifp);
 }
@@ -630,39 +758,94 @@ ipv6nd_rtpref(struct ra *rap)
 	/* NOTREACHED */
 }
 
+/*
+ * ra_routers is kept in order of preference.
+ * The tree orders routers by the key they had when last placed, so a
+ * change of state cannot upset it and ipv6nd_sortrouter moves a router
+ * to its new place in O(log n).
+ */
+static int
+ipv6nd_racompare(__unused void *context, const void *n1, const void *n2)
+{
+	const struct ra *ra1 = n1, *ra2 = n2;
+
+	if (ra1->sort_metric != ra2->sort_metric)
+		return ra1->sort_metric < ra2->sort_metric ? -1 : 1;
+	if (ra1->sort_state != ra2->sort_state)
+		return ra1->sort_state < ra2->sort_state ? -1 : 1;
+	if (ra1->sort_pref != ra2->sort_pref)
+		return ra1->sort_pref > ra2->sort_pref ? -1 : 1;
+	/* All things being equal, prefer older routers. */
+	if (ra1->sort_seq != ra2->sort_seq)
+		return ra1->sort_seq < ra2->sort_seq ? -1 : 1;
+	return 0;
+}
+
+const rb_tree_ops_t ipv6nd_ra_ops = {
+	.rbto_compare_nodes = ipv6nd_racompare,
+	.rbto_compare_key = ipv6nd_racompare,
+	.rbto_node_offset = offsetof(struct ra, sort_tree),
+	.rbto_context = NULL
+};
+
+/* The worse off a router is, the higher this is. */
+static unsigned int
+ipv6nd_rastate(const struct ra *rap)
+{
+	unsigned int state = 0;
+
+	if (rap->expired)
+		state |= 0x08;
+	if (rap->willexpire)
+		state |= 0x04;
+	if (rap->lifetime == 0)
+		state |= 0x02;
+	if (!rap->isreachable)
+		state |= 0x01;
+	return state;
+}
+
+/* Inserts rap into ra_routers, or moves it if its state has changed. */
 static void
-ipv6nd_sortrouters(struct dhcpcd_ctx *ctx)
+ipv6nd_sortrouter(struct ra *rap)
 {
-	struct ra_head sorted_routers = TAILQ_HEAD_INITIALIZER(sorted_routers);
-	struct ra *ra1, *ra2;
+	struct dhcpcd_ctx *ctx = rap->iface->ctx;
+	unsigned int metric = rap->iface->metric;
+	unsigned int state = ipv6nd_rastate(rap);
+	int pref = ipv6nd_rtpref(rap);
+	struct ra *ran;
+
+	if (rap->sort_seq != 0) {
+		if (rap->sort_metric == metric && rap->sort_state == state &&
+		    rap->sort_pref == pref)
+			return;
+		rb_tree_remove_node(&ctx->ra_tree, rap);
+		TAILQ_REMOVE(ctx->ra_routers, rap, next);
+	} else
+		rap->sort_seq = ++ctx->ra_seq;
+
+	rap->sort_metric = metric;
+	rap->sort_state = state;
+	rap->sort_pref = pref;
+	rb_tree_insert_node(&ctx->ra_tree, rap);
+	ran = RB_TREE_NEXT(&ctx->ra_tree, rap);
+	if (ran != NULL)
+		TAILQ_INSERT_BEFORE(ran, rap, next);
+	else
+		TAILQ_INSERT_TAIL(ctx->ra_routers, rap, next);
+}
 
-	while ((ra1 = TAILQ_FIRST(ctx->ra_routers)) != NULL) {
-		TAILQ_REMOVE(ctx->ra_routers, ra1, next);
-		TAILQ_FOREACH(ra2, &sorted_routers, next) {
-			if (ra1->iface->metric > ra2->iface->metric)
-				continue;
-			if (ra1->expired && !ra2->expired)
-				continue;
-			if (ra1->willexpire && !ra2->willexpire)
-				continue;
-			if (ra1->lifetime == 0 && ra2->lifetime != 0)
-				continue;
-			if (!ra1->isreachable && ra2->reachable)
-				continue;
-			if (ipv6nd_rtpref(ra1) <= ipv6nd_rtpref(ra2))
-				continue;
-			/* All things being equal, prefer older routers. */
-			/* We don't need to check time, becase newer
-			 * routers are always added to the tail and then
-			 * sorted. */
-			TAILQ_INSERT_BEFORE(ra2, ra1, next);
-			break;
-		}
-		if (ra2 == NULL)
-			TAILQ_INSERT_TAIL(&sorted_routers, ra1, next);
-	}
+/* A router moved by ipv6nd_sortrouter is met again when walking
+ * ra_routers, but is then in place so is not moved again. */
+static void
+ipv6nd_sortifrouters(struct interface *ifp)
+{
+	struct ra *rap, *ran;
 
-	TAILQ_CONCAT(ctx->ra_routers, &sorted_routers, next);
+	TAILQ_FOREACH_SAFE(rap, ifp->ctx->ra_routers, next, ran) {
+		if (rap->iface == ifp)
+			ipv6nd_sortrouter(rap);
+	}
 }
 
 static void
@@ -725,9 +908,9 @@ ipv6nd_neighbour(struct dhcpcd_ctx *ctx, struct in6_addr *addr, bool reachable)
 	    reachable ? "reachable again" : "unreachable");
 
 	/* See if we can install a reachable default router. */
-	ipv6nd_sortrouters(ctx);
+	ipv6nd_sortrouter(rap);
 	ipv6nd_applyra(rap->iface);
-	rt_build(ctx, AF_INET6);
+	rt_deferif(rap->iface, AF_INET6);
 
 	if (reachable)
 		return;
@@ -824,8 +1007,10 @@ ipv6nd_removefreedrop_ra(struct ra *rap, int remove_ra, int drop_ra)
 
 	eloop_timeout_delete(rap->iface->ctx->eloop, NULL, rap->iface);
 	eloop_timeout_delete(rap->iface->ctx->eloop, NULL, rap);
-	if (remove_ra)
+	if (remove_ra) {
+		rb_tree_remove_node(&rap->iface->ctx->ra_tree, rap);
 		TAILQ_REMOVE(rap->iface->ctx->ra_routers, rap, next);
+	}
 	ipv6_freedrop_addrs(&rap->addrs, drop_ra, NULL);
 	free(rap->data);
 	free(rap);
@@ -854,6 +1039,8 @@ ipv6nd_free(struct interface *ifp)
 #ifdef __sun
 	eloop_event_delete(ctx->eloop, state->nd_fd);
 	close(state->nd_fd);
+#else
+	ipv6nd_unqueuers(ifp);
 #endif
 	free(state->rs);
 	free(state);
@@ -921,7 +1108,7 @@ ipv6nd_scriptrun(struct ra *rap)
 	script_runreason(rap->iface, "ROUTERADVERT");
 	if (hasdns && (hasaddress ||
 	    !(rap->flags & (ND_RA_FLAG_MANAGED | ND_RA_FLAG_OTHER))))
-		dhcpcd_daemonise(rap->iface->ctx);
+		dhcpcd_bound(rap->iface);
 #if 0
 	else if (options & DHCPCD_DAEMONISE &&
 	    !(options & DHCPCD_DAEMONISED) && new_data)
@@ -961,10 +1148,9 @@ ipv6nd_dadcompleted(const struct interface *ifp)
 static void
 ipv6nd_dadcallback(void *arg)
 {
-	struct ipv6_addr *ia = arg, *rapap;
+	struct ipv6_addr *ia = arg;
 	struct interface *ifp;
-	struct ra *rap;
-	int wascompleted, found;
+	int wascompleted;
 	char buf[INET6_ADDRSTRLEN];
 	const char *p;
 	int dadcounter;
@@ -989,7 +1175,7 @@ ipv6nd_dadcallback(void *arg)
 				logerrx("%s: unable to obtain a"
 				    " stable private address",
 				    ifp->name);
-				goto try_script;
+				goto advertise;
 			}
 			loginfox("%s: deleting address %s",
 			    ifp->name, ia->saddr);
@@ -1015,42 +1201,70 @@ ipv6nd_dadcallback(void *arg)
 				    p, ia->prefix_len);
 			else
 				ia->saddr[0] = '\0';
-			delay = arc4random_uniform(IDGEN_DELAY * MSEC_PER_SEC);
+			delay = rndpool_uniform(ifp->ctx,
+			    IDGEN_DELAY * MSEC_PER_SEC);
 			eloop_timeout_add_msec(ifp->ctx->eloop, delay,
 			    ipv6nd_addaddr, ia);
 			return;
 		}
 	}
 
-try_script:
-	if (!wascompleted) {
-		TAILQ_FOREACH(rap, ifp->ctx->ra_routers, next) {
-			if (rap->iface != ifp)
+advertise:
+#ifdef ND6_ADVERTISE
+	if (!wascompleted)
+		ipv6nd_advertise(ia);
+#else
+	UNUSED(wascompleted);
+#endif
+}
+
+/* Called by ipv6_daddone for the addresses which have
+ * finished DAD since the last time. */
+void
+ipv6nd_daddone(struct interface *ifp)
+{
+	struct ra *rap;
+	struct ipv6_addr *ia, *ian;
+	bool found, completed;
+
+	if (ifp->ctx->ra_routers == NULL)
+		return;
+
+	TAILQ_FOREACH(rap, ifp->ctx->ra_routers, next) {
+		if (rap->iface != ifp)
+			continue;
+		found = false;
+		TAILQ_FOREACH_SAFE(ia, &rap->addrs, next, ian) {
+			if (!(ia->flags & IPV6_AF_DADPENDING))
 				continue;
-			wascompleted = 1;
-			found = 0;
-			TAILQ_FOREACH(rapap, &rap->addrs, next) {
-				if (rapap->flags & IPV6_AF_AUTOCONF &&
-				    rapap->flags & IPV6_AF_ADDED &&
-				    (rapap->flags & IPV6_AF_DADCOMPLETED) == 0)
-				{
-					wascompleted = 0;
-					break;
-				}
-				if (rapap == ia)
-					found = 1;
-			}
+			ia->flags &= ~IPV6_AF_DADPENDING;
+			if (ia->flags & IPV6_AF_DADCOMPLETED)
+				continue;
+			found = true;
+			if (ia->dadcallback)
+				ia->dadcallback(ia);
+			/* We need to set this here in-case the
+			 * dadcallback function checks it */
+			ia->flags |= IPV6_AF_DADCOMPLETED;
+		}
+		if (!found)
+			continue;
 
-			if (wascompleted && found) {
-				logdebugx("%s: Router Advertisement DAD "
-				    "completed",
-				    rap->iface->name);
-				ipv6nd_scriptrun(rap);
+		completed = true;
+		TAILQ_FOREACH(ia, &rap->addrs, next) {
+			if (ia->flags & IPV6_AF_AUTOCONF &&
+			    ia->flags & IPV6_AF_ADDED &&
+			    !(ia->flags & IPV6_AF_DADCOMPLETED))
+			{
+				completed = false;
+				break;
 			}
 		}
-#ifdef ND6_ADVERTISE
-		ipv6nd_advertise(ia);
-#endif
+		if (completed) {
+			logdebugx("%s: Router Advertisement DAD completed",
+			    ifp->name);
+			ipv6nd_scriptrun(rap);
+		}
 	}
 }
 
@@ -1094,10 +1308,188 @@ dhcp6_start(__unused struct interface *ifp, __unused enum DH6S init_state)
 }
 #endif
 
+static void
+ipv6nd_prefixtime(const struct ra *rap, struct ipv6_addr *ia,
+    uint32_t vltime, uint32_t pltime)
+{
+	uint32_t rmtime;
+
+	/*
+	 * RFC 4862 5.5.3.e
+	 * Don't terminate existing connections.
+	 * This means that to actually remove the
+	 * existing prefix, the RA needs to stop
+	 * broadcasting the prefix and just let it
+	 * expire in 2 hours.
+	 * It might want to broadcast it to reduce
+	 * the vltime if it was greater than 2 hours
+	 * to start with/
+	 */
+	ia->prefix_pltime = pltime;
+	if (ia->prefix_vltime) {
+		uint32_t elapsed;
+
+		elapsed = (uint32_t)eloop_timespec_diff(
+			&rap->acquired, &ia->acquired,
+			NULL);
+		rmtime = ia->prefix_vltime - elapsed;
+		if (rmtime > ia->prefix_vltime)
+			rmtime = 0;
+	} else
+		rmtime = 0;
+	if (vltime > MIN_EXTENDED_VLTIME ||
+	    vltime > rmtime)
+		ia->prefix_vltime = vltime;
+	else if (rmtime <= MIN_EXTENDED_VLTIME)
+		/* No SEND support from RFC 3971 so
+		 * leave vltime alone */
+		ia->prefix_vltime = rmtime;
+	else
+		ia->prefix_vltime = MIN_EXTENDED_VLTIME;
+
+	/* Ensure pltime still fits */
+	if (pltime < ia->prefix_vltime)
+		ia->prefix_pltime = pltime;
+	else
+		ia->prefix_pltime = ia->prefix_vltime;
+}
+
+/*
+ * Routers repeat the same RA every few seconds and some count the
+ * lifetimes down as they go.
+ * Two RAs are the same if they only differ by checksum and lifetimes,
+ * as long as no lifetime has become or stopped being zero and no
+ * prefix has gained or lost a preferred time beyond its valid time.
+ */
+static bool
+ipv6nd_rasame(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	struct nd_router_advert ra1, ra2;
+	struct nd_opt_hdr ndo;
+	size_t olen, lt, lte;
+	uint32_t l1, l2, v1, v2;
+
+	memcpy(&ra1, a, sizeof(ra1));
+	memcpy(&ra2, b, sizeof(ra2));
+	ra1.nd_ra_cksum = ra2.nd_ra_cksum = 0;
+	ra1.nd_ra_router_lifetime = ra1.nd_ra_router_lifetime ? 0xffff : 0;
+	ra2.nd_ra_router_lifetime = ra2.nd_ra_router_lifetime ? 0xffff : 0;
+	if (memcmp(&ra1, &ra2, sizeof(ra1)) != 0)
+		return false;
+
+	a += sizeof(ra1);
+	b += sizeof(ra2);
+	len -= sizeof(ra1);
+	for (; len > 0; a += olen, b += olen, len -= olen) {
+		if (len < sizeof(ndo))
+			return memcmp(a, b, len) == 0;
+		memcpy(&ndo, a, sizeof(ndo));
+		olen = (size_t)ndo.nd_opt_len * 8;
+		if (olen == 0 || olen > len)
+			return memcmp(a, b, len) == 0;
+
+		/* Lifetimes are 32 bits starting at lt and ending at lte. */
+		switch (ndo.nd_opt_type) {
+		case ND_OPT_PREFIX_INFORMATION:
+			lt = offsetof(struct nd_opt_prefix_info,
+			    nd_opt_pi_valid_time);
+			lte = lt + sizeof(uint32_t) * 2;
+			break;
+		case ND_OPT_RDNSS:
+		case ND_OPT_DNSSL:
+			lt = offsetof(struct nd_opt_rdnss,
+			    nd_opt_rdnss_lifetime);
+			lte = lt + sizeof(uint32_t);
+			break;
+		default:
+			lt = lte = olen;
+			break;
+		}
+		if (lte > olen)
+			lt = lte = olen;
+		if (memcmp(a, b, lt) != 0 ||
+		    memcmp(a + lte, b + lte, olen - lte) != 0)
+			return false;
+
+		for (; lt < lte; lt += sizeof(uint32_t)) {
+			memcpy(&l1, a + lt, sizeof(l1));
+			memcpy(&l2, b + lt, sizeof(l2));
+			if ((l1 == 0) != (l2 == 0))
+				return false;
+		}
+		if (ndo.nd_opt_type == ND_OPT_PREFIX_INFORMATION &&
+		    olen >= sizeof(struct nd_opt_prefix_info))
+		{
+			lt = offsetof(struct nd_opt_prefix_info,
+			    nd_opt_pi_valid_time);
+			memcpy(&v1, a + lt, sizeof(v1));
+			memcpy(&v2, b + lt, sizeof(v2));
+			lt = offsetof(struct nd_opt_prefix_info,
+			    nd_opt_pi_preferred_time);
+			memcpy(&l1, a + lt, sizeof(l1));
+			memcpy(&l2, b + lt, sizeof(l2));
+			if ((ntohl(l1) > ntohl(v1)) != (ntohl(l2) > ntohl(v2)))
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Take the lifetimes from an RA which ipv6nd_rasame matched
+ * against the last one from this router. */
+static void
+ipv6nd_refreshra(struct ra *rap, const uint8_t *data, size_t len)
+{
+	struct interface *ifp = rap->iface;
+	struct nd_router_advert nd_ra;
+	struct nd_opt_hdr ndo;
+	struct nd_opt_prefix_info pi;
+	struct in6_addr pi_prefix;
+	struct ipv6_addr *ia;
+	const uint8_t *p;
+	size_t olen;
+	uint32_t vltime, pltime;
+
+	clock_gettime(CLOCK_MONOTONIC, &rap->acquired);
+	memcpy(rap->data, data, len);
+	memcpy(&nd_ra, data, sizeof(nd_ra));
+	rap->lifetime = ntohs(nd_ra.nd_ra_router_lifetime);
+
+	len -= sizeof(nd_ra);
+	p = data + sizeof(nd_ra);
+	for (; len >= sizeof(ndo); p += olen, len -= olen) {
+		memcpy(&ndo, p, sizeof(ndo));
+		olen = (size_t)ndo.nd_opt_len * 8;
+		if (olen == 0 || olen > len)
+			break;
+		if (ndo.nd_opt_type != ND_OPT_PREFIX_INFORMATION ||
+		    ndo.nd_opt_len != 4 ||
+		    has_option_mask(ifp->options->optmasks->nomasknd,
+		    ndo.nd_opt_type))
+			continue;
+
+		memcpy(&pi, p, sizeof(pi));
+		vltime = ntohl(pi.nd_opt_pi_valid_time);
+		pltime = ntohl(pi.nd_opt_pi_preferred_time);
+		if (pltime > vltime)
+			continue;
+		/* nd_opt_pi_prefix is not aligned. */
+		memcpy(&pi_prefix, &pi.nd_opt_pi_prefix, sizeof(pi_prefix));
+		ia = ipv6nd_rapfindprefix(rap,
+		    &pi_prefix, pi.nd_opt_pi_prefix_len);
+		if (ia == NULL)
+			continue;
+		ipv6nd_prefixtime(rap, ia, vltime, pltime);
+		ia->acquired = rap->acquired;
+	}
+}
+
+/* acquired is when the RA was received if not now, see ipv6nd_resume. */
 static void
 ipv6nd_handlera(struct dhcpcd_ctx *ctx,
     const struct sockaddr_in6 *from, const char *sfrom,
-    struct interface *ifp, struct icmp6_hdr *icp, size_t len, int hoplimit)
+    struct interface *ifp, struct icmp6_hdr *icp, size_t len, int hoplimit,
+    const struct timespec *acquired)
 {
 	size_t i, olen;
 	struct nd_router_advert *nd_ra;
@@ -1182,6 +1574,30 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 			break;
 	}
 
+	/* Nothing but the lifetimes changed, so there is nothing to
+	 * reparse, no routes to rebuild and no reason to run the script. */
+	if (rap != NULL && rap->data_len == len &&
+	    !rap->expired && !rap->willexpire && !rap->doexpire &&
+	    rap->isreachable &&
+	    !(ctx->options & DHCPCD_TEST) &&
+#ifdef IPV6_MANAGETEMPADDR
+	    /* Temporary addresses are extended by the full parse. */
+	    !(ifp->options->options & DHCPCD_SLAACTEMP) &&
+#endif
+	    ipv6nd_rasame(rap->data, (const uint8_t *)icp, len))
+	{
+		logdebugx("%s: Router Advertisement from %s",
+		    ifp->name, rap->sfrom);
+		ipv6nd_refreshra(rap, (const uint8_t *)icp, len);
+		ifp->stats.ra_unchanged++;
+		if (ifp->options->options & DHCPCD_CONFIGURE)
+			ipv6_addaddrs(&rap->addrs);
+		eloop_timeout_delete(ctx->eloop, NULL, ifp);
+		eloop_timeout_delete(ctx->eloop, NULL, rap);
+		ipv6nd_expirerouter(rap);
+		return;
+	}
+
 	nd_ra = (struct nd_router_advert *)icp;
 
 	/* We don't want to spam the log with the fact we got an RA every
@@ -1220,6 +1636,7 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 		}
 		memcpy(rap->data, icp, len);
 		rap->data_len = len;
+		MEMSAMPLE(ctx, MEM_RA);
 	}
 
 	/* We could change the debug level based on new_data, but some
@@ -1233,7 +1650,10 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 	logmessage(loglevel, "%s: Router Advertisement from %s",
 	    ifp->name, rap->sfrom);
 
-	clock_gettime(CLOCK_MONOTONIC, &rap->acquired);
+	if (acquired != NULL)
+		rap->acquired = *acquired;
+	else
+		clock_gettime(CLOCK_MONOTONIC, &rap->acquired);
 	rap->flags = nd_ra->nd_ra_flags_reserved;
 	old_lifetime = rap->lifetime;
 	rap->lifetime = ntohs(nd_ra->nd_ra_router_lifetime);
@@ -1286,7 +1706,7 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 			break;
 		}
 
-		if (has_option_mask(ifp->options->rejectmasknd,
+		if (has_option_mask(ifp->options->optmasks->rejectmasknd,
 		    ndo.nd_opt_type))
 		{
 			for (i = 0, dho = ctx->nd_opts;
@@ -1309,7 +1729,8 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 			return;
 		}
 
-		if (has_option_mask(ifp->options->nomasknd, ndo.nd_opt_type))
+		if (has_option_mask(ifp->options->optmasks->nomasknd,
+		    ndo.nd_opt_type))
 			continue;
 
 		switch (ndo.nd_opt_type) {
@@ -1395,47 +1816,7 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 #endif
 
 			} else {
-				uint32_t rmtime;
-
-				/*
-				 * RFC 4862 5.5.3.e
-				 * Don't terminate existing connections.
-				 * This means that to actually remove the
-				 * existing prefix, the RA needs to stop
-				 * broadcasting the prefix and just let it
-				 * expire in 2 hours.
-				 * It might want to broadcast it to reduce
-				 * the vltime if it was greater than 2 hours
-				 * to start with/
-				 */
-				ia->prefix_pltime = pltime;
-				if (ia->prefix_vltime) {
-					uint32_t elapsed;
-
-					elapsed = (uint32_t)eloop_timespec_diff(
-						&rap->acquired, &ia->acquired,
-						NULL);
-					rmtime = ia->prefix_vltime - elapsed;
-					if (rmtime > ia->prefix_vltime)
-						rmtime = 0;
-				} else
-					rmtime = 0;
-				if (vltime > MIN_EXTENDED_VLTIME ||
-				    vltime > rmtime)
-					ia->prefix_vltime = vltime;
-				else if (rmtime <= MIN_EXTENDED_VLTIME)
-					/* No SEND support from RFC 3971 so
-					 * leave vltime alone */
-					ia->prefix_vltime = rmtime;
-				else
-					ia->prefix_vltime = MIN_EXTENDED_VLTIME;
-
-				/* Ensure pltime still fits */
-				if (pltime < ia->prefix_vltime)
-					ia->prefix_pltime = pltime;
-				else
-					ia->prefix_pltime = ia->prefix_vltime;
-
+				ipv6nd_prefixtime(rap, ia, vltime, pltime);
 				ia->flags |= flags;
 				ia->flags &= ~IPV6_AF_STALE;
 				ia->acquired = rap->acquired;
@@ -1511,7 +1892,7 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 	    i < ctx->nd_opts_len;
 	    i++, dho++)
 	{
-		if (has_option_mask(ifp->options->requiremasknd,
+		if (has_option_mask(ifp->options->optmasks->requiremasknd,
 		    dho->option))
 		{
 			logwarnx("%s: reject RA (no option %s) from %s",
@@ -1541,10 +1922,7 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 		logwarnx("%s: no global addresses for default route",
 		    ifp->name);
 
-	if (new_rap)
-		TAILQ_INSERT_TAIL(ctx->ra_routers, rap, next);
-	if (new_data)
-		ipv6nd_sortrouters(ifp->ctx);
+	ipv6nd_sortrouter(rap);
 
 	if (ifp->ctx->options & DHCPCD_TEST) {
 		script_runreason(ifp, "TEST");
@@ -1559,7 +1937,7 @@ ipv6nd_handlera(struct dhcpcd_ctx *ctx,
 #ifdef IPV6_MANAGETEMPADDR
 	ipv6_addtempaddrs(ifp, &rap->acquired);
 #endif
-	rt_build(ifp->ctx, AF_INET6);
+	rt_deferif(ifp, AF_INET6);
 
 run:
 	ipv6nd_scriptrun(rap);
@@ -1594,8 +1972,9 @@ nodhcp6:
 		}
 	}
 
-	/* Expire should be called last as the rap object could be destroyed */
-	ipv6nd_expirera(ifp);
+	/* Expire should be called last as the rap object could be destroyed.
+	 * Only this router changed, the others keep their own timers. */
+	ipv6nd_expirerouter(rap);
 }
 
 bool
@@ -1655,14 +2034,10 @@ ipv6nd_getoption(struct dhcpcd_ctx *ctx,
 		*code = ndo.nd_opt_type;
 	}
 
-	for (i = 0, opt = ctx->nd_opts;
-	    i < ctx->nd_opts_len; i++, opt++)
-	{
-		if (opt->option == *code) {
-			*oopt = opt;
-			break;
-		}
-	}
+	opt = dhcp_optsearch(NULL, ctx->nd_optsort,
+	    ctx->nd_opts, ctx->nd_opts_len, *code);
+	if (opt != NULL)
+		*oopt = opt;
 
 	if (od)
 		return od + sizeof(ndo);
@@ -1730,11 +2105,12 @@ ipv6nd_env(FILE *fp, const struct interface *ifp)
 		{
 			memcpy(&ndo, p, sizeof(ndo));
 			olen = (size_t)(ndo.nd_opt_len * 8);
-			if (olen > len) {
+			if (olen == 0 || olen > len) {
 				errno =	EINVAL;
 				break;
 			}
-			if (has_option_mask(rap->iface->options->nomasknd,
+			if (has_option_mask(
+			    rap->iface->options->optmasks->nomasknd,
 			    ndo.nd_opt_type))
 				continue;
 			for (j = 0, opt = rap->iface->options->nd_override;
@@ -1795,12 +2171,16 @@ ipv6nd_handleifa(int cmd, struct ipv6_addr *addr, pid_t pid)
 	}
 }
 
-void
-ipv6nd_expirera(void *arg)
+/*
+ * Expire what is due in rap and set a timer for its next deadline.
+ * Each router has its own timer so the eloop timeout heap keeps them
+ * ordered by deadline and a wakeup only looks at the router which is due.
+ * Returns true if anything expired.
+ */
+static bool
+ipv6nd_expirera1(struct ra *rap, const struct timespec *now)
 {
-	struct interface *ifp;
-	struct ra *rap, *ran;
-	struct timespec now;
+	struct interface *ifp = rap->iface;
 	uint32_t elapsed;
 	bool expired, valid;
 	struct ipv6_addr *ia;
@@ -1813,162 +2193,213 @@ ipv6nd_expirera(void *arg)
 	struct nd_opt_dnssl dnssl;
 	struct nd_opt_rdnss rdnss;
 	unsigned int next = 0, ltime;
-	size_t nexpired = 0;
 
-	ifp = arg;
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	expired = false;
+	expired = valid = false;
+	if (rap->lifetime) {
+		elapsed = (uint32_t)eloop_timespec_diff(now,
+		    &rap->acquired, NULL);
+		if (elapsed >= rap->lifetime || rap->doexpire) {
+			logwarnx("%s: %s: router expired",
+			    ifp->name, rap->sfrom);
+			rap->lifetime = 0;
+			expired = true;
+		} else {
+			valid = true;
+			ltime = rap->lifetime - elapsed;
+			if (next == 0 || ltime < next)
+				next = ltime;
+		}
+	}
 
-	TAILQ_FOREACH_SAFE(rap, ifp->ctx->ra_routers, next, ran) {
-		if (rap->iface != ifp || rap->expired)
+	/* Not every prefix is tied to an address which
+	 * the kernel can expire, so we need to handle it ourself.
+	 * Also, some OS don't support address lifetimes (Solaris). */
+	TAILQ_FOREACH(ia, &rap->addrs, next) {
+		if (ia->prefix_vltime == 0)
+			continue;
+		if (ia->prefix_vltime == ND6_INFINITE_LIFETIME &&
+		    !rap->doexpire)
+		{
+			valid = true;
 			continue;
-		valid = false;
-		if (rap->lifetime) {
-			elapsed = (uint32_t)eloop_timespec_diff(&now,
-			    &rap->acquired, NULL);
-			if (elapsed >= rap->lifetime || rap->doexpire) {
-				if (!rap->expired) {
-					logwarnx("%s: %s: router expired",
-					    ifp->name, rap->sfrom);
-					rap->lifetime = 0;
-					expired = true;
-				}
-			} else {
-				valid = true;
-				ltime = rap->lifetime - elapsed;
-				if (next == 0 || ltime < next)
-					next = ltime;
-			}
 		}
-
-		/* Not every prefix is tied to an address which
-		 * the kernel can expire, so we need to handle it ourself.
-		 * Also, some OS don't support address lifetimes (Solaris). */
-		TAILQ_FOREACH(ia, &rap->addrs, next) {
-			if (ia->prefix_vltime == 0)
-				continue;
-			if (ia->prefix_vltime == ND6_INFINITE_LIFETIME &&
-			    !rap->doexpire)
-			{
-				valid = true;
-				continue;
-			}
-			elapsed = (uint32_t)eloop_timespec_diff(&now,
-			    &ia->acquired, NULL);
-			if (elapsed >= ia->prefix_vltime || rap->doexpire) {
-				if (ia->flags & IPV6_AF_ADDED) {
-					logwarnx("%s: expired %s %s",
-					    ia->iface->name,
-					    ia->flags & IPV6_AF_AUTOCONF ?
-					    "address" : "prefix",
-					    ia->saddr);
-					if (if_address6(RTM_DELADDR, ia)== -1 &&
-					    errno != EADDRNOTAVAIL &&
-					    errno != ENXIO)
-						logerr(__func__);
-				}
-				ia->prefix_vltime = ia->prefix_pltime = 0;
-				ia->flags &=
-				    ~(IPV6_AF_ADDED | IPV6_AF_DADCOMPLETED);
-				expired = true;
-			} else {
-				valid = true;
-				ltime = ia->prefix_vltime - elapsed;
-				if (next == 0 || ltime < next)
-					next = ltime;
+		elapsed = (uint32_t)eloop_timespec_diff(now,
+		    &ia->acquired, NULL);
+		if (elapsed >= ia->prefix_vltime || rap->doexpire) {
+			if (ia->flags & IPV6_AF_ADDED) {
+				logwarnx("%s: expired %s %s",
+				    ia->iface->name,
+				    ia->flags & IPV6_AF_AUTOCONF ?
+				    "address" : "prefix",
+				    ia->saddr);
+				if (if_address6(RTM_DELADDR, ia)== -1 &&
+				    errno != EADDRNOTAVAIL &&
+				    errno != ENXIO)
+					logerr(__func__);
 			}
+			ia->prefix_vltime = ia->prefix_pltime = 0;
+			ia->flags &=
+			    ~(IPV6_AF_ADDED | IPV6_AF_DADCOMPLETED);
+			expired = true;
+		} else {
+			valid = true;
+			ltime = ia->prefix_vltime - elapsed;
+			if (next == 0 || ltime < next)
+				next = ltime;
 		}
+	}
 
-		/* Work out expiry for ND options */
-		elapsed = (uint32_t)eloop_timespec_diff(&now,
-		    &rap->acquired, NULL);
-		len = rap->data_len - sizeof(struct nd_router_advert);
-		for (p = rap->data + sizeof(struct nd_router_advert);
-		    len >= sizeof(ndo);
-		    p += olen, len -= olen)
-		{
-			memcpy(&ndo, p, sizeof(ndo));
-			olen = (size_t)(ndo.nd_opt_len * 8);
-			if (olen > len) {
-				errno =	EINVAL;
-				break;
-			}
+	/* Work out expiry for ND options */
+	elapsed = (uint32_t)eloop_timespec_diff(now, &rap->acquired, NULL);
+	len = rap->data_len - sizeof(struct nd_router_advert);
+	for (p = rap->data + sizeof(struct nd_router_advert);
+	    len >= sizeof(ndo);
+	    p += olen, len -= olen)
+	{
+		memcpy(&ndo, p, sizeof(ndo));
+		olen = (size_t)(ndo.nd_opt_len * 8);
+		if (olen == 0 || olen > len) {
+			errno =	EINVAL;
+			break;
+		}
 
-			if (has_option_mask(rap->iface->options->nomasknd,
-			    ndo.nd_opt_type))
-				continue;
+		if (has_option_mask(rap->iface->options->optmasks->nomasknd,
+		    ndo.nd_opt_type))
+			continue;
 
-			switch (ndo.nd_opt_type) {
-			/* Prefix info is already checked in the above loop. */
+		switch (ndo.nd_opt_type) {
+		/* Prefix info is already checked in the above loop. */
 #if 0
-			case ND_OPT_PREFIX_INFORMATION:
-				if (len < sizeof(pi))
-					break;
-				memcpy(&pi, p, sizeof(pi));
-				ltime = pi.nd_opt_pi_valid_time;
+		case ND_OPT_PREFIX_INFORMATION:
+			if (len < sizeof(pi))
 				break;
+			memcpy(&pi, p, sizeof(pi));
+			ltime = pi.nd_opt_pi_valid_time;
+			break;
 #endif
-			case ND_OPT_DNSSL:
-				if (len < sizeof(dnssl))
-					continue;
-				memcpy(&dnssl, p, sizeof(dnssl));
-				ltime = dnssl.nd_opt_dnssl_lifetime;
-				break;
-			case ND_OPT_RDNSS:
-				if (len < sizeof(rdnss))
-					continue;
-				memcpy(&rdnss, p, sizeof(rdnss));
-				ltime = rdnss.nd_opt_rdnss_lifetime;
-				break;
-			default:
-				continue;
-			}
-
-			if (ltime == 0)
-				continue;
-			if (rap->doexpire) {
-				expired = true;
-				continue;
-			}
-			if (ltime == ND6_INFINITE_LIFETIME) {
-				valid = true;
+		case ND_OPT_DNSSL:
+			if (len < sizeof(dnssl))
 				continue;
-			}
-
-			ltime = ntohl(ltime);
-			if (elapsed >= ltime) {
-				expired = true;
+			memcpy(&dnssl, p, sizeof(dnssl));
+			ltime = dnssl.nd_opt_dnssl_lifetime;
+			break;
+		case ND_OPT_RDNSS:
+			if (len < sizeof(rdnss))
 				continue;
-			}
+			memcpy(&rdnss, p, sizeof(rdnss));
+			ltime = rdnss.nd_opt_rdnss_lifetime;
+			break;
+		default:
+			continue;
+		}
 
+		if (ltime == 0)
+			continue;
+		if (rap->doexpire) {
+			expired = true;
+			continue;
+		}
+		if (ltime == ND6_INFINITE_LIFETIME) {
 			valid = true;
-			ltime -= elapsed;
-			if (next == 0 || ltime < next)
-				next = ltime;
+			continue;
 		}
 
-		if (valid)
+		ltime = ntohl(ltime);
+		if (elapsed >= ltime) {
+			expired = true;
 			continue;
+		}
 
-		/* Router has expired. Let's not keep a lot of them. */
-		rap->expired = true;
-		if (++nexpired > EXPIRED_MAX)
-			ipv6nd_free_ra(rap);
+		valid = true;
+		ltime -= elapsed;
+		if (next == 0 || ltime < next)
+			next = ltime;
 	}
 
 	if (next != 0)
 		eloop_timeout_add_sec(ifp->ctx->eloop,
-		    next, ipv6nd_expirera, ifp);
+		    next, ipv6nd_expirerouter, rap);
+	else
+		eloop_timeout_delete(ifp->ctx->eloop,
+		    ipv6nd_expirerouter, rap);
+
+	if (!valid)
+		rap->expired = true;
+	return expired;
+}
+
+static void
+ipv6nd_expiredone(struct interface *ifp, bool expired)
+{
+
+	ipv6nd_sortifrouters(ifp);
 	if (expired) {
 		logwarnx("%s: part of a Router Advertisement expired",
 		    ifp->name);
-		ipv6nd_sortrouters(ifp->ctx);
 		ipv6nd_applyra(ifp);
-		rt_build(ifp->ctx, AF_INET6);
+		rt_deferif(ifp, AF_INET6);
 		script_runreason(ifp, "ROUTERADVERT");
 	}
 }
 
+/* Expire a single router, either when its timer fires or
+ * after it sent us a Router Advertisement. */
+static void
+ipv6nd_expirerouter(void *arg)
+{
+	struct ra *rap = arg, *rap2;
+	struct interface *ifp = rap->iface;
+	struct timespec now;
+	size_t nexpired;
+	bool expired;
+
+	if (rap->expired)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	expired = ipv6nd_expirera1(rap, &now);
+	if (rap->expired) {
+		/* Router has expired. Let's not keep a lot of them. */
+		nexpired = 0;
+		TAILQ_FOREACH(rap2, ifp->ctx->ra_routers, next) {
+			if (rap2->iface == ifp && rap2->expired)
+				nexpired++;
+		}
+		if (nexpired > EXPIRED_MAX)
+			ipv6nd_free_ra(rap);
+	} else if (!expired)
+		return;
+	ipv6nd_expiredone(ifp, expired);
+}
+
+void
+ipv6nd_expirera(void *arg)
+{
+	struct interface *ifp;
+	struct ra *rap, *ran;
+	struct timespec now;
+	bool expired;
+	size_t nexpired = 0;
+
+	ifp = arg;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	expired = false;
+
+	TAILQ_FOREACH_SAFE(rap, ifp->ctx->ra_routers, next, ran) {
+		if (rap->iface != ifp || rap->expired)
+			continue;
+		if (ipv6nd_expirera1(rap, &now))
+			expired = true;
+		if (!rap->expired)
+			continue;
+
+		/* Router has expired. Let's not keep a lot of them. */
+		if (++nexpired > EXPIRED_MAX)
+			ipv6nd_free_ra(rap);
+	}
+	ipv6nd_expiredone(ifp, expired);
+}
+
 void
 ipv6nd_drop(struct interface *ifp)
 {
@@ -1987,7 +2418,7 @@ ipv6nd_drop(struct interface *ifp)
 	}
 	if (expired) {
 		ipv6nd_applyra(ifp);
-		rt_build(ifp->ctx, AF_INET6);
+		rt_deferif(ifp, AF_INET6);
 		if ((ifp->options->options & DHCPCD_NODROP) != DHCPCD_NODROP)
 			script_runreason(ifp, "ROUTERADVERT");
 	}
@@ -2015,23 +2446,40 @@ ipv6nd_recvmsg(struct dhcpcd_ctx *ctx, struct msghdr *msg)
 		return;
 	}
 
+	ifp->stats.rx[IF_STAT_ND]++;
+
 	/* Don't do anything if the user hasn't configured it. */
 	if (ifp->active != IF_ACTIVE_USER ||
 	    !(ifp->options->options & DHCPCD_IPV6))
+	{
+		ifp->stats.dropped[IF_STAT_ND]++;
 		return;
+	}
 
 	icp = (struct icmp6_hdr *)msg->msg_iov[0].iov_base;
 	if (icp->icmp6_code == 0) {
 		switch(icp->icmp6_type) {
 			case ND_ROUTER_ADVERT:
+				TRACE_EVENT(ctx, TRACE_RA_BEGIN, ifp,
+				    (uint32_t)len);
 				ipv6nd_handlera(ctx, from, sfrom,
-				    ifp, icp, (size_t)len, hoplimit);
+				    ifp, icp, (size_t)len, hoplimit, NULL);
+				/* ifp may not survive handling the RA. */
+				TRACE_EVENT(ctx, TRACE_RA_END, NULL, 0);
 				return;
 		}
 	}
 
 	logerrx("invalid IPv6 type %d or code %d from %s",
 	    icp->icmp6_type, icp->icmp6_code, sfrom);
+	ifp->stats.dropped[IF_STAT_ND]++;
+}
+
+static void
+ipv6nd_recvmsgcb(void *arg, struct msghdr *msg)
+{
+
+	ipv6nd_recvmsg(arg, msg);
 }
 
 static void
@@ -2039,25 +2487,6 @@ ipv6nd_handledata(void *arg, unsigned short events)
 {
 	struct dhcpcd_ctx *ctx;
 	int fd;
-	struct sockaddr_in6 from;
-	union {
-		struct icmp6_hdr hdr;
-		uint8_t buf[64 * 1024]; /* Maximum ICMPv6 size */
-	} iovbuf;
-	struct iovec iov = {
-		.iov_base = iovbuf.buf, .iov_len = sizeof(iovbuf.buf),
-	};
-	union {
-		struct cmsghdr hdr;
-		uint8_t buf[CMSG_SPACE(sizeof(struct in6_pktinfo)) +
-		    CMSG_SPACE(sizeof(int))];
-	} cmsgbuf = { .buf = { 0 } };
-	struct msghdr msg = {
-	    .msg_name = &from, .msg_namelen = sizeof(from),
-	    .msg_iov = &iov, .msg_iovlen = 1,
-	    .msg_control = cmsgbuf.buf, .msg_controllen = sizeof(cmsgbuf.buf),
-	};
-	ssize_t len;
 
 #ifdef __sun
 	struct interface *ifp;
@@ -2075,14 +2504,26 @@ ipv6nd_handledata(void *arg, unsigned short events)
 	if (events != ELE_READ)
 		logerrx("%s: unexpected event 0x%04x", __func__, events);
 
-	len = recvmsg(fd, &msg, 0);
-	if (len == -1) {
+	if (recvmsgs(ctx, fd, RECVMSGS_MAX, ipv6nd_recvmsgcb, ctx) == -1)
 		logerr(__func__);
-		return;
-	}
+}
 
-	iov.iov_len = (size_t)len;
-	ipv6nd_recvmsg(ctx, &msg);
+static struct rs_state *
+ipv6nd_initstate(struct interface *ifp)
+{
+	struct rs_state *state;
+
+	state = RS_STATE(ifp);
+	if (state != NULL)
+		return state;
+	ifp->if_data[IF_DATA_IPV6ND] = calloc(1, sizeof(*state));
+	state = RS_STATE(ifp);
+	if (state == NULL)
+		return NULL;
+#ifdef __sun
+	state->nd_fd = -1;
+#endif
+	return state;
 }
 
 static void
@@ -2092,17 +2533,10 @@ ipv6nd_startrs1(void *arg)
 	struct rs_state *state;
 
 	loginfox("%s: soliciting an IPv6 router", ifp->name);
-	state = RS_STATE(ifp);
+	state = ipv6nd_initstate(ifp);
 	if (state == NULL) {
-		ifp->if_data[IF_DATA_IPV6ND] = calloc(1, sizeof(*state));
-		state = RS_STATE(ifp);
-		if (state == NULL) {
-			logerr(__func__);
-			return;
-		}
-#ifdef __sun
-		state->nd_fd = -1;
-#endif
+		logerr(__func__);
+		return;
 	}
 
 	/* Always make a new probe as the underlying hardware
@@ -2118,20 +2552,95 @@ ipv6nd_startrs1(void *arg)
 	ipv6nd_sendrsprobe(ifp);
 }
 
+/* Replay the Router Advertisements the last dhcpcd handed off,
+ * which starts DHCPv6 from its handoff as well.
+ * This is not done from ipv6nd_startrs so that dhcpcd_startinterface
+ * finds no DHCPv6 state to confirm. */
+static void
+ipv6nd_resume(void *arg)
+{
+	struct interface *ifp = arg;
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	const struct handoff_msg *hm = NULL;
+	struct sockaddr_in6 from = { .sin6_family = AF_INET6 };
+	char sfrom[INET6_ADDRSTRLEN];
+	bool warm = ifp->warm;
+
+	ifp->warm = true;
+	while ((hm = handoff_find(ifp, HANDOFF_RA, hm)) != NULL) {
+		from.sin6_addr = hm->from;
+		inet_ntop(AF_INET6, &from.sin6_addr, sfrom, sizeof(sfrom));
+		ipv6nd_handlera(ctx, &from, sfrom, ifp, hm->data, hm->len,
+		    255, &hm->acquired);
+	}
+	ifp->warm = warm;
+	handoff_free(ifp);
+
+	if (!ipv6nd_hasralifetime(ifp, false))
+		ipv6nd_startrs1(ifp);
+}
+
 void
 ipv6nd_startrs(struct interface *ifp)
 {
 	unsigned int delay;
+#ifndef __sun
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct timespec now, ts;
+#endif
 
 	eloop_timeout_delete(ifp->ctx->eloop, NULL, ifp);
+	if (handoff_find(ifp, HANDOFF_RA, NULL) != NULL) {
+		if (ipv6nd_initstate(ifp) == NULL) {
+			logerr(__func__);
+			return;
+		}
+		ifp->handoff->held = true;
+		eloop_timeout_add_sec(ifp->ctx->eloop, 0, ipv6nd_resume, ifp);
+		return;
+	}
+
 	if (!(ifp->options->options & DHCPCD_INITIAL_DELAY)) {
 		ipv6nd_startrs1(ifp);
 		return;
 	}
 
-	delay = arc4random_uniform(MAX_RTR_SOLICITATION_DELAY * MSEC_PER_SEC);
+#ifndef __sun
+	/* Each interface is on its own link, so joining a delay which
+	 * is still to come keeps within MAX_RTR_SOLICITATION_DELAY
+	 * for this link and lets the solicitations go out together. */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ctx->nd_rsstart.tv_sec > now.tv_sec ||
+	    (ctx->nd_rsstart.tv_sec == now.tv_sec &&
+	    ctx->nd_rsstart.tv_nsec > now.tv_nsec))
+	{
+		ts.tv_sec = ctx->nd_rsstart.tv_sec - now.tv_sec;
+		ts.tv_nsec = ctx->nd_rsstart.tv_nsec - now.tv_nsec;
+		if (ts.tv_nsec < 0) {
+			ts.tv_sec--;
+			ts.tv_nsec += NSEC_PER_SEC;
+		}
+		logdebugx("%s: delaying IPv6 router solicitation for %0.1f"
+		    " seconds", ifp->name,
+		    (float)ts.tv_sec + (float)ts.tv_nsec / NSEC_PER_SEC);
+		eloop_timeout_add_tv(ctx->eloop, &ts, ipv6nd_startrs1, ifp);
+		return;
+	}
+#endif
+
+	delay = rndpool_uniform(ifp->ctx,
+	    MAX_RTR_SOLICITATION_DELAY * MSEC_PER_SEC);
 	logdebugx("%s: delaying IPv6 router solicitation for %0.1f seconds",
 	    ifp->name, (float)delay / MSEC_PER_SEC);
 	eloop_timeout_add_msec(ifp->ctx->eloop, delay, ipv6nd_startrs1, ifp);
+#ifndef __sun
+	ctx->nd_rsstart = now;
+	ctx->nd_rsstart.tv_sec += (time_t)(delay / MSEC_PER_SEC);
+	ctx->nd_rsstart.tv_nsec += (long)(delay % MSEC_PER_SEC) * NSEC_PER_MSEC;
+	if (ctx->nd_rsstart.tv_nsec >= NSEC_PER_SEC) {
+		ctx->nd_rsstart.tv_sec++;
+		ctx->nd_rsstart.tv_nsec -= NSEC_PER_SEC;
+	}
+#endif
 	return;
 }
@@ -57,9 +57,15 @@ struct ra {
 	bool willexpire;
 	bool doexpire;
 	bool isreachable;
+	rb_node_t sort_tree;	/* see ipv6nd_sortrouter */
+	uint64_t sort_seq;
+	unsigned int sort_metric;
+	unsigned int sort_state;
+	int sort_pref;
 };
 
 TAILQ_HEAD(ra_head, ra);
+extern const rb_tree_ops_t ipv6nd_ra_ops;
 
 struct rs_state {
 	struct nd_router_solicit *rs;
@@ -68,6 +74,8 @@ struct rs_state {
 	uint32_t retrans;
 #ifdef __sun
 	int nd_fd;
+#else
+	bool rs_queued;
 #endif
 };
 
@@ -123,6 +131,7 @@ bool ipv6nd_hasralifetime(const struct interface *, bool);
 bool ipv6nd_hasradhcp(const struct interface *, bool);
 void ipv6nd_handleifa(int, struct ipv6_addr *, pid_t);
 int ipv6nd_dadcompleted(const struct interface *);
+void ipv6nd_daddone(struct interface *);
 void ipv6nd_advertise(struct ipv6_addr *);
 void ipv6nd_startexpire(struct interface *);
 void ipv6nd_drop(struct interface *);
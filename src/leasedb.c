@@ -0,0 +1,531 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcpcd.h"
+#include "if-options.h"
+#include "leasedb.h"
+#include "logerr.h"
+#include "shard.h"
+
+/*
+ * All leases live in one file of records which are only ever appended.
+ * A record is a header, the key (the lease file name, which already
+ * encodes the interface, ssid and family) and the lease itself.
+ * A record without data removes the key.
+ * The last record for a key wins.
+ *
+ * Each commit is a single write followed by fdatasync, so a crash can
+ * only leave a partial record at the end of the file; the checksum
+ * catches that and the tail is discarded when the file is next opened.
+ * Once the file is more than twice the size of the live records it's
+ * rewritten to a new file which is synced and then renamed over the old,
+ * then the directory is synced so the rename survives a crash.
+ */
+
+#define	LEASEDB_MAGIC		0x6463646cU	/* dcdl */
+#define	LEASEDB_ALIGN		8
+#define	LEASEDB_COMPACT_MIN	(64 * 1024)
+#define	LEASEDB_KEY_MAX		255
+
+struct leasedb_hdr {
+	uint32_t ldh_magic;
+	uint32_t ldh_cksum;
+	uint32_t ldh_keylen;
+	uint32_t ldh_datalen;
+	int64_t ldh_mtime;
+};
+
+struct leasedb_ent {
+	rb_node_t lde_tree;
+	char lde_key[LEASEDB_KEY_MAX + 1];
+	size_t lde_off;		/* of the data in the map */
+	size_t lde_len;
+	size_t lde_reclen;
+	time_t lde_mtime;
+};
+
+struct leasedb {
+	char ldb_path[sizeof(LEASEDB) + 8];	/* each shard has its own */
+	char ldb_newpath[sizeof(LEASEDB) + 12];
+	int ldb_fd;
+	uint8_t *ldb_map;
+	size_t ldb_maplen;
+	size_t ldb_size;	/* end of the last good record */
+	size_t ldb_live;	/* bytes used by records still wanted */
+	rb_tree_t ldb_ents;
+};
+
+static int
+leasedb_compare(__unused void *context, const void *n1, const void *n2)
+{
+	const struct leasedb_ent *e1 = n1, *e2 = n2;
+
+	return strcmp(e1->lde_key, e2->lde_key);
+}
+
+static int
+leasedb_compare_key(__unused void *context, const void *n, const void *key)
+{
+	const struct leasedb_ent *e = n;
+
+	return strcmp(e->lde_key, key);
+}
+
+static const rb_tree_ops_t leasedb_ops = {
+	.rbto_compare_nodes = leasedb_compare,
+	.rbto_compare_key = leasedb_compare_key,
+	.rbto_node_offset = offsetof(struct leasedb_ent, lde_tree),
+	.rbto_context = NULL
+};
+
+static size_t
+leasedb_reclen(size_t keylen, size_t datalen)
+{
+	size_t len = sizeof(struct leasedb_hdr) + keylen + datalen;
+
+	return (len + LEASEDB_ALIGN - 1) & ~(size_t)(LEASEDB_ALIGN - 1);
+}
+
+/* FNV-1a over the header, with the checksum zeroed, then the payload. */
+static uint32_t
+leasedb_cksum(const struct leasedb_hdr *hdr, const uint8_t *p, size_t len)
+{
+	struct leasedb_hdr h = *hdr;
+	const uint8_t *hp = (const uint8_t *)&h;
+	uint32_t sum = 2166136261U;
+	size_t i;
+
+	h.ldh_cksum = 0;
+	for (i = 0; i < sizeof(h); i++)
+		sum = (sum ^ hp[i]) * 16777619U;
+	for (i = 0; i < len; i++)
+		sum = (sum ^ p[i]) * 16777619U;
+	return sum;
+}
+
+/* Returns the key to store a file under, or NULL if it's not ours. */
+const char *
+leasedb_key(const struct dhcpcd_ctx *ctx, const char *file)
+{
+	size_t dirlen = strlen(DBDIR), len;
+	const char *key;
+
+	if ((ctx->options & (DHCPCD_LEASEDB | DHCPCD_MANAGER)) !=
+	    (DHCPCD_LEASEDB | DHCPCD_MANAGER))
+		return NULL;
+	if (strncmp(file, DBDIR, dirlen) != 0 || file[dirlen] != '/')
+		return NULL;
+	key = file + dirlen + 1;
+	if (strchr(key, '/') != NULL)
+		return NULL;
+	len = strlen(key);
+	if (len > LEASEDB_KEY_MAX)
+		return NULL;
+	if ((len > 6 && strcmp(key + len - 6, ".lease") == 0) ||
+	    (len > 7 && strcmp(key + len - 7, ".lease6") == 0))
+		return key;
+	return NULL;
+}
+
+static int
+leasedb_map(struct leasedb *db, size_t len)
+{
+	void *map;
+
+	if (db->ldb_map != NULL) {
+		munmap(db->ldb_map, db->ldb_maplen);
+		db->ldb_map = NULL;
+		db->ldb_maplen = 0;
+	}
+	if (len == 0)
+		return 0;
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, db->ldb_fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	db->ldb_map = map;
+	db->ldb_maplen = len;
+	return 0;
+}
+
+static void
+leasedb_clear(struct leasedb *db)
+{
+	struct leasedb_ent *ent;
+
+	while ((ent = RB_TREE_MIN(&db->ldb_ents)) != NULL) {
+		rb_tree_remove_node(&db->ldb_ents, ent);
+		free(ent);
+	}
+	db->ldb_live = 0;
+}
+
+/* Record that key now has len bytes at off or, if len is 0, is gone. */
+static int
+leasedb_apply(struct leasedb *db, const char *key, size_t off, size_t len,
+    size_t reclen, time_t mtime)
+{
+	struct leasedb_ent *ent;
+
+	ent = rb_tree_find_node(&db->ldb_ents, key);
+	if (len == 0) {
+		if (ent != NULL) {
+			db->ldb_live -= ent->lde_reclen;
+			rb_tree_remove_node(&db->ldb_ents, ent);
+			free(ent);
+		}
+		return 0;
+	}
+	if (ent == NULL) {
+		ent = malloc(sizeof(*ent));
+		if (ent == NULL)
+			return -1;
+		strlcpy(ent->lde_key, key, sizeof(ent->lde_key));
+		rb_tree_insert_node(&db->ldb_ents, ent);
+	} else
+		db->ldb_live -= ent->lde_reclen;
+	ent->lde_off = off;
+	ent->lde_len = len;
+	ent->lde_reclen = reclen;
+	ent->lde_mtime = mtime;
+	db->ldb_live += reclen;
+	return 0;
+}
+
+/* Walk the records, stopping at the first one which doesn't check out. */
+static int
+leasedb_load(struct leasedb *db)
+{
+	struct stat st;
+	struct leasedb_hdr hdr;
+	size_t off, reclen;
+	char key[LEASEDB_KEY_MAX + 1];
+	const uint8_t *p;
+
+	if (fstat(db->ldb_fd, &st) == -1)
+		return -1;
+	if (leasedb_map(db, (size_t)st.st_size) == -1)
+		return -1;
+
+	leasedb_clear(db);
+	off = 0;
+	while (db->ldb_maplen - off >= sizeof(hdr)) {
+		memcpy(&hdr, db->ldb_map + off, sizeof(hdr));
+		if (hdr.ldh_magic != LEASEDB_MAGIC ||
+		    hdr.ldh_keylen == 0 || hdr.ldh_keylen > LEASEDB_KEY_MAX ||
+		    hdr.ldh_datalen > db->ldb_maplen)
+			break;
+		reclen = leasedb_reclen(hdr.ldh_keylen, hdr.ldh_datalen);
+		if (reclen > db->ldb_maplen - off)
+			break;
+		p = db->ldb_map + off + sizeof(hdr);
+		if (leasedb_cksum(&hdr, p, hdr.ldh_keylen + hdr.ldh_datalen) !=
+		    hdr.ldh_cksum)
+			break;
+		memcpy(key, p, hdr.ldh_keylen);
+		key[hdr.ldh_keylen] = '\0';
+		if (leasedb_apply(db, key, off + sizeof(hdr) + hdr.ldh_keylen,
+		    hdr.ldh_datalen, reclen, (time_t)hdr.ldh_mtime) == -1)
+			return -1;
+		off += reclen;
+	}
+
+	db->ldb_size = off;
+	if (off != db->ldb_maplen) {
+		logwarnx("%s: discarding %zu bytes of a partial record",
+		    db->ldb_path, db->ldb_maplen - off);
+		if (ftruncate(db->ldb_fd, (off_t)off) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static struct leasedb *
+leasedb_open(struct dhcpcd_ctx *ctx)
+{
+	struct leasedb *db;
+
+	if (ctx->leasedb != NULL)
+		return ctx->leasedb;
+
+	db = calloc(1, sizeof(*db));
+	if (db == NULL)
+		return NULL;
+	rb_tree_init(&db->ldb_ents, &leasedb_ops);
+#ifdef SHARDS
+	if (SHARD_WORKER(ctx))
+		snprintf(db->ldb_path, sizeof(db->ldb_path), "%s.%d",
+		    LEASEDB, ctx->shard);
+	else
+#endif
+		strlcpy(db->ldb_path, LEASEDB, sizeof(db->ldb_path));
+	snprintf(db->ldb_newpath, sizeof(db->ldb_newpath), "%s.new",
+	    db->ldb_path);
+	db->ldb_fd = open(db->ldb_path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (db->ldb_fd == -1) {
+		free(db);
+		return NULL;
+	}
+	if (leasedb_load(db) == -1) {
+		logerr("%s: %s", __func__, db->ldb_path);
+		leasedb_clear(db);
+		leasedb_map(db, 0);
+		close(db->ldb_fd);
+		free(db);
+		return NULL;
+	}
+	ctx->leasedb = db;
+	return db;
+}
+
+static ssize_t
+leasedb_put(int fd, off_t off, const char *key, const void *data, size_t len,
+    time_t mtime)
+{
+	struct leasedb_hdr hdr;
+	size_t keylen = strlen(key), reclen = leasedb_reclen(keylen, len);
+	uint8_t *rec;
+	ssize_t bytes;
+
+	rec = calloc(1, reclen);
+	if (rec == NULL)
+		return -1;
+	hdr.ldh_magic = LEASEDB_MAGIC;
+	hdr.ldh_keylen = (uint32_t)keylen;
+	hdr.ldh_datalen = (uint32_t)len;
+	hdr.ldh_mtime = (int64_t)mtime;
+	memcpy(rec + sizeof(hdr), key, keylen);
+	if (len != 0)
+		memcpy(rec + sizeof(hdr) + keylen, data, len);
+	hdr.ldh_cksum = leasedb_cksum(&hdr, rec + sizeof(hdr), keylen + len);
+	memcpy(rec, &hdr, sizeof(hdr));
+
+	bytes = pwrite(fd, rec, reclen, off);
+	free(rec);
+	if (bytes == -1)
+		return -1;
+	if ((size_t)bytes != reclen) {
+		errno = EIO;
+		return -1;
+	}
+	return bytes;
+}
+
+/* The rename is only durable once the directory holding it is synced. */
+static int
+leasedb_syncdir(const struct leasedb *db)
+{
+	char dir[sizeof(db->ldb_path)], *p;
+	int fd, r;
+
+	strlcpy(dir, db->ldb_path, sizeof(dir));
+	p = strrchr(dir, '/');
+	if (p == NULL)
+		strlcpy(dir, ".", sizeof(dir));
+	else if (p == dir)
+		p[1] = '\0';
+	else
+		*p = '\0';
+#ifdef O_DIRECTORY
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#else
+	fd = open(dir, O_RDONLY | O_CLOEXEC);
+#endif
+	if (fd == -1)
+		return -1;
+	r = fsync(fd);
+	close(fd);
+	return r;
+}
+
+/* Write the live records to a new file and swap it in. */
+static int
+leasedb_compact(struct leasedb *db)
+{
+	struct leasedb_ent *ent;
+	int fd;
+	off_t off;
+	ssize_t bytes;
+
+	fd = open(db->ldb_newpath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0640);
+	if (fd == -1)
+		return -1;
+	off = 0;
+	RB_TREE_FOREACH(ent, &db->ldb_ents) {
+		bytes = leasedb_put(fd, off, ent->lde_key,
+		    db->ldb_map + ent->lde_off, ent->lde_len, ent->lde_mtime);
+		if (bytes == -1)
+			goto err;
+		off += bytes;
+	}
+	if (fdatasync(fd) == -1 || rename(db->ldb_newpath, db->ldb_path) == -1)
+		goto err;
+	/* The new file is in place either way, so carry on. */
+	if (leasedb_syncdir(db) == -1)
+		logerr("%s: fsync directory of %s", __func__, db->ldb_path);
+
+	close(db->ldb_fd);
+	db->ldb_fd = fd;
+	return leasedb_load(db);
+
+err:
+	close(fd);
+	unlink(db->ldb_newpath);
+	return -1;
+}
+
+static int
+leasedb_commit(struct leasedb *db, const char *key, const void *data,
+    size_t len)
+{
+	time_t mtime = time(NULL);
+	ssize_t bytes;
+	size_t off = db->ldb_size, keylen = strlen(key);
+
+	bytes = leasedb_put(db->ldb_fd, (off_t)off, key, data, len, mtime);
+	if (bytes == -1 || fdatasync(db->ldb_fd) == -1) {
+		/* Don't leave half a record for the next commit to follow */
+		if (ftruncate(db->ldb_fd, (off_t)off) == -1)
+			logerr("%s: ftruncate", __func__);
+		return -1;
+	}
+	db->ldb_size += (size_t)bytes;
+	if (leasedb_map(db, db->ldb_size) == -1 ||
+	    leasedb_apply(db, key, off + sizeof(struct leasedb_hdr) + keylen,
+	    len, (size_t)bytes, mtime) == -1)
+	{
+		/* What's on disk is fine, rebuild from that. */
+		return leasedb_load(db);
+	}
+
+	if (db->ldb_size > LEASEDB_COMPACT_MIN &&
+	    db->ldb_size / 2 > db->ldb_live &&
+	    leasedb_compact(db) == -1)
+		logerr("%s: compact", __func__);
+	return 0;
+}
+
+/*
+ * Leases not in the database yet are read from the file they would have
+ * been in before, which lets lease_db be turned on without losing them.
+ * The file is removed once the lease has been committed.
+ */
+
+ssize_t
+leasedb_read(struct dhcpcd_ctx *ctx, const char *file, const char *key,
+    void *data, size_t len)
+{
+	struct leasedb *db = leasedb_open(ctx);
+	struct leasedb_ent *ent;
+
+	if (db == NULL ||
+	    (ent = rb_tree_find_node(&db->ldb_ents, key)) == NULL)
+		return readfile(file, data, len);
+	if (ent->lde_len > len) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	memcpy(data, db->ldb_map + ent->lde_off, ent->lde_len);
+	return (ssize_t)ent->lde_len;
+}
+
+ssize_t
+leasedb_write(struct dhcpcd_ctx *ctx, const char *file, const char *key,
+    const void *data, size_t len)
+{
+	struct leasedb *db = leasedb_open(ctx);
+	bool had;
+
+	if (db == NULL)
+		return -1;
+	if (len == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	had = rb_tree_find_node(&db->ldb_ents, key) != NULL;
+	if (leasedb_commit(db, key, data, len) == -1)
+		return -1;
+	if (!had && unlink(file) == -1 && errno != ENOENT)
+		logerr("%s: unlink: %s", __func__, file);
+	return (ssize_t)len;
+}
+
+int
+leasedb_mtime(struct dhcpcd_ctx *ctx, const char *file, const char *key,
+    time_t *mtime)
+{
+	struct leasedb *db = leasedb_open(ctx);
+	struct leasedb_ent *ent;
+
+	if (db == NULL ||
+	    (ent = rb_tree_find_node(&db->ldb_ents, key)) == NULL)
+		return filemtime(file, mtime);
+	*mtime = ent->lde_mtime;
+	return 0;
+}
+
+int
+leasedb_unlink(struct dhcpcd_ctx *ctx, const char *file, const char *key)
+{
+	struct leasedb *db = leasedb_open(ctx);
+
+	if (db == NULL ||
+	    rb_tree_find_node(&db->ldb_ents, key) == NULL)
+		return unlink(file);
+	return leasedb_commit(db, key, NULL, 0);
+}
+
+void
+leasedb_free(struct dhcpcd_ctx *ctx)
+{
+	struct leasedb *db = ctx->leasedb;
+
+	if (db == NULL)
+		return;
+	leasedb_clear(db);
+	leasedb_map(db, 0);
+	close(db->ldb_fd);
+	free(db);
+	ctx->leasedb = NULL;
+}
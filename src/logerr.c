@@ -54,6 +54,8 @@
 
 struct logctx {
 	char		 log_buf[BUFSIZ];
+	char		 log_msg[BUFSIZ];	/* see vlogmessage */
+	unsigned long long log_dropped;
 	unsigned int	 log_opts;
 	int		 log_fd;
 	pid_t		 log_pid;
@@ -102,14 +104,13 @@ getprogname(void)
 #endif
 
 #ifndef SMALL
-/* Write the time, syslog style. month day time - */
+/* Format the time, syslog style. month day time - */
 static int
-logprintdate(FILE *stream)
+logformatdate(char *buf, size_t len)
 {
 	struct timeval tv;
 	time_t now;
 	struct tm tmnow;
-	char buf[32];
 
 	if (gettimeofday(&tv, NULL) == -1)
 		return -1;
@@ -117,18 +118,24 @@ logprintdate(FILE *stream)
 	now = tv.tv_sec;
 	if (localtime_r(&now, &tmnow) == NULL)
 		return -1;
-	if (strftime(buf, sizeof(buf), "%b %d %T ", &tmnow) == 0)
+	if (strftime(buf, len, "%b %d %T ", &tmnow) == 0)
 		return -1;
-	return fprintf(stream, "%s", buf);
+	return 0;
 }
 #endif
 
-__printflike(3, 0) static int
-vlogprintf_r(struct logctx *ctx, FILE *stream, const char *fmt, va_list args)
+/*
+ * Write msg, already formatted by vlogmessage, with the prefix stream
+ * wants as a single call so the line buffered stream writes it in one go.
+ * date is formatted on first use so it is only worked out once per line.
+ */
+static int
+logprintline(struct logctx *ctx, FILE *stream, char *date, size_t datelen,
+    const char *msg)
 {
-	int len = 0, e;
-	va_list a;
 #ifndef SMALL
+	const char *d = "", *tag = "", *sep = "";
+	char pid[sizeof("[]") + sizeof(pid_t) * 3] = "";
 	bool log_pid;
 #ifdef LOGERR_TAG
 	bool log_tag;
@@ -137,9 +144,9 @@ vlogprintf_r(struct logctx *ctx, FILE *stream, const char *fmt, va_list args)
 	if ((stream == stderr && ctx->log_opts & LOGERR_ERR_DATE) ||
 	    (stream != stderr && ctx->log_opts & LOGERR_LOG_DATE))
 	{
-		if ((e = logprintdate(stream)) == -1)
+		if (*date == '\0' && logformatdate(date, datelen) == -1)
 			return -1;
-		len += e;
+		d = date;
 	}
 
 #ifdef LOGERR_TAG
@@ -148,49 +155,27 @@ vlogprintf_r(struct logctx *ctx, FILE *stream, const char *fmt, va_list args)
 	if (log_tag) {
 		if (ctx->log_tag == NULL)
 			ctx->log_tag = getprogname();
-		if ((e = fprintf(stream, "%s", ctx->log_tag)) == -1)
-			return -1;
-		len += e;
+		if (ctx->log_tag != NULL)
+			tag = ctx->log_tag;
+		sep = ": ";
 	}
 #endif
 
 	log_pid = ((stream == stderr && ctx->log_opts & LOGERR_ERR_PID) ||
 	    (stream != stderr && ctx->log_opts & LOGERR_LOG_PID));
 	if (log_pid) {
-		pid_t pid;
-
-		if (ctx->log_pid == 0)
-			pid = getpid();
-		else
-			pid = ctx->log_pid;
-		if ((e = fprintf(stream, "[%d]", pid)) == -1)
-			return -1;
-		len += e;
+		snprintf(pid, sizeof(pid), "[%d]",
+		    ctx->log_pid == 0 ? getpid() : ctx->log_pid);
+		sep = ": ";
 	}
 
-#ifdef LOGERR_TAG
-	if (log_tag || log_pid)
-#else
-	if (log_pid)
-#endif
-	{
-		if ((e = fprintf(stream, ": ")) == -1)
-			return -1;
-		len += e;
-	}
+	return fprintf(stream, "%s%s%s%s%s\n", d, tag, pid, sep, msg);
 #else
 	UNUSED(ctx);
+	UNUSED(date);
+	UNUSED(datelen);
+	return fprintf(stream, "%s\n", msg);
 #endif
-
-	va_copy(a, args);
-	e = vfprintf(stream, fmt, a);
-	if (fputc('\n', stream) == EOF)
-		e = -1;
-	else if (e != -1)
-		e++;
-	va_end(a);
-
-	return e == -1 ? -1 : len + e;
 }
 
 /*
@@ -213,6 +198,11 @@ vlogmessage(int pri, const char *fmt, va_list args)
 {
 	struct logctx *ctx = &_logctx;
 	int len = 0;
+	bool log_err;
+#ifndef SMALL
+	bool log_file;
+#endif
+	char date[32] = "";
 
 	if (ctx->log_fd != -1) {
 		char buf[LOGERR_SYSLOGBUF];
@@ -227,23 +217,41 @@ vlogmessage(int pri, const char *fmt, va_list args)
 		if (len != -1)
 			len = (int)write(ctx->log_fd, buf,
 			    ((size_t)++len) + sizeof(pri) + sizeof(pid));
+		/* The socket is non blocking so we cannot wait. */
+		if (len == -1)
+			ctx->log_dropped++;
 		return len;
 	}
 
-	if (ctx->log_opts & LOGERR_ERR &&
+	log_err = ctx->log_opts & LOGERR_ERR &&
 	    (pri <= LOG_ERR ||
 	    (!(ctx->log_opts & LOGERR_QUIET) && pri <= LOG_INFO) ||
-	    (ctx->log_opts & LOGERR_DEBUG && pri <= LOG_DEBUG)))
-		len = vlogprintf_r(ctx, stderr, fmt, args);
+	    (ctx->log_opts & LOGERR_DEBUG && pri <= LOG_DEBUG));
+#ifndef SMALL
+	log_file = ctx->log_file != NULL &&
+	    (pri != LOG_DEBUG || (ctx->log_opts & LOGERR_DEBUG));
+	if (!log_err && !log_file && !(ctx->log_opts & LOGERR_LOG))
+#else
+	if (!log_err && !(ctx->log_opts & LOGERR_LOG))
+#endif
+		return 0;
+
+	/* Format the message once for every destination. */
+	if (vsnprintf(ctx->log_msg, sizeof(ctx->log_msg), fmt, args) == -1)
+		return -1;
+
+	if (log_err)
+		len = logprintline(ctx, stderr, date, sizeof(date),
+		    ctx->log_msg);
 
 #ifndef SMALL
-	if (ctx->log_file != NULL &&
-	    (pri != LOG_DEBUG || (ctx->log_opts & LOGERR_DEBUG)))
-		len = vlogprintf_r(ctx, ctx->log_file, fmt, args);
+	if (log_file)
+		len = logprintline(ctx, ctx->log_file, date, sizeof(date),
+		    ctx->log_msg);
 #endif
 
 	if (ctx->log_opts & LOGERR_LOG)
-		vsyslog(pri, fmt, args);
+		syslog(pri, "%s", ctx->log_msg);
 
 	return len;
 }
@@ -410,6 +418,14 @@ logreadfd(int fd)
 	return len;
 }
 
+unsigned long long
+loggetdropped(void)
+{
+	struct logctx *ctx = &_logctx;
+
+	return ctx->log_dropped;
+}
+
 unsigned int
 loggetopts(void)
 {
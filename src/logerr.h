@@ -80,6 +80,8 @@ __printflike(2, 3) void logerrmessage(int pri, const char *fmt, ...);
 int loggetfd(void);
 void logsetfd(int);
 int logreadfd(int);
+/* Lines lost as the fd would block. */
+unsigned long long loggetdropped(void);
 
 unsigned int loggetopts(void);
 void logsetopts(unsigned int);
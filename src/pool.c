@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "pool.h"
+
+void
+pool_init(struct pool *pl, const char *name, size_t size)
+{
+
+	assert(size >= sizeof(struct pool_item));
+	memset(pl, 0, sizeof(*pl));
+	pl->pl_name = name;
+	pl->pl_size = size;
+}
+
+/* Returns a zeroed object. */
+void *
+pool_get(struct pool *pl)
+{
+	struct pool_item *pi;
+
+	pl->pl_gets++;
+	if ((pi = pl->pl_free) != NULL) {
+		pl->pl_free = pi->pi_next;
+		pl->pl_nfree--;
+		pl->pl_hits++;
+		memset(pi, 0, pl->pl_size);
+	} else if ((pi = calloc(1, pl->pl_size)) == NULL)
+		return NULL;
+
+	if (++pl->pl_inuse > pl->pl_peak)
+		pl->pl_peak = pl->pl_inuse;
+	return pi;
+}
+
+void
+pool_put(struct pool *pl, void *obj)
+{
+	struct pool_item *pi = obj;
+
+	if (pi == NULL)
+		return;
+	pi->pi_next = pl->pl_free;
+	pl->pl_free = pi;
+	pl->pl_nfree++;
+	if (pl->pl_inuse != 0)
+		pl->pl_inuse--;
+}
+
+void
+pool_clear(struct pool *pl)
+{
+	struct pool_item *pi;
+
+	while ((pi = pl->pl_free) != NULL) {
+		pl->pl_free = pi->pi_next;
+		free(pi);
+	}
+	pl->pl_nfree = 0;
+}
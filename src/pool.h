@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * A pool keeps freed objects of one size on a free list to be handed
+ * out again, so rebuilding routes and addresses doesn't churn malloc.
+ * Each object is still its own allocation, so free(3) is always safe
+ * on one and the free list is released by pool_clear.
+ */
+struct pool_item {
+	struct pool_item *pi_next;
+};
+
+struct pool {
+	const char *pl_name;
+	size_t pl_size;
+	struct pool_item *pl_free;
+	size_t pl_nfree;
+	size_t pl_inuse;		/* taken and not put back */
+	size_t pl_peak;
+	unsigned long long pl_gets;
+	unsigned long long pl_hits;	/* gets from the free list */
+};
+
+void pool_init(struct pool *, const char *, size_t);
+void *pool_get(struct pool *);
+void pool_put(struct pool *, void *);
+void pool_clear(struct pool *);
+
+#endif
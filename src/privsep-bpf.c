@@ -159,7 +159,7 @@ ps_bpf_start_bpf(struct ps_process *psp)
 	    addr != NULL ? " " : "", addr != NULL ? addr : "");
 	ps_freeprocesses(ctx, psp);
 
-	psp->psp_bpf = bpf_open(&psp->psp_ifp, psp->psp_filter, ia);
+	psp->psp_bpf = bpf_open(ctx, &psp->psp_ifp, psp->psp_filter, ia);
 	if (psp->psp_bpf == NULL)
 		logerr("%s: bpf_open",__func__);
 #ifdef PRIVSEP_RIGHTS
@@ -254,7 +254,7 @@ ps_bpf_cmd(struct dhcpcd_ctx *ctx, struct ps_msghdr *psm, struct msghdr *msg)
 	    addr != NULL ? " " : "", addr != NULL ? addr : "");
 
 	start = ps_startprocess(psp, ps_bpf_recvmsg, NULL,
-	    ps_bpf_start_bpf, NULL, PSF_DROPPRIVS);
+	    ps_bpf_start_bpf, NULL, PSF_DROPPRIVS | PSF_RING);
 	switch (start) {
 	case -1:
 		ps_freeprocess(psp);
@@ -270,6 +270,348 @@ ps_bpf_cmd(struct dhcpcd_ctx *ctx, struct ps_msghdr *psm, struct msghdr *msg)
 	return start;
 }
 
+#ifdef BPF_SHARED_SOCKET
+/*
+ * With shared_bpf, one helper per protocol owns a packet socket which
+ * is not bound to any interface rather than one helper per interface.
+ * Each frame read says which interface it arrived on.
+ * The sandbox cannot refilter the ARP socket by address, so all ARP
+ * is passed up and the manager checks the addresses itself.
+ */
+struct ps_bpf_if {
+	TAILQ_ENTRY(ps_bpf_if) next;
+	struct ps_id id;
+	struct interface ifp;
+	struct bpf *bpf;	/* send handle on psp_bpf */
+};
+TAILQ_HEAD(ps_bpf_head, ps_bpf_if);
+
+static struct ps_bpf_if *
+ps_bpf_findshared(struct ps_process *psp, const struct ps_id *psi, bool exact)
+{
+	struct ps_bpf_if *bif;
+
+	TAILQ_FOREACH(bif, psp->psp_bpf_ifs, next) {
+		if (exact ? memcmp(&bif->id, psi, sizeof(bif->id)) == 0 :
+		    bif->id.psi_ifindex == psi->psi_ifindex)
+			return bif;
+	}
+	return NULL;
+}
+
+static void
+ps_bpf_recvshared(void *arg, unsigned short events)
+{
+	struct ps_process *psp = arg;
+	struct bpf *bpf = psp->psp_bpf;
+	struct ps_id psi = { .psi_ifindex = 0 };
+	struct ps_bpf_if *bif;
+	uint8_t buf[FRAMELEN_MAX];
+	ssize_t len;
+	struct ps_msghdr psm = {
+		.ps_cmd = psp->psp_id.psi_cmd,
+	};
+
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	bpf->bpf_flags &= ~BPF_EOF;
+	while (!(bpf->bpf_flags & BPF_EOF)) {
+		len = bpf_read(bpf, buf, sizeof(buf));
+		if (len == -1) {
+			logerr(__func__);
+			break;
+		}
+		if (len == 0)
+			break;
+		/* Only pass it on if the interface is using this socket. */
+		psi.psi_ifindex = bpf->bpf_ifindex;
+		bif = ps_bpf_findshared(psp, &psi, false);
+		if (bif == NULL)
+			continue;
+		psm.ps_id = bif->id;
+		psm.ps_flags = bpf->bpf_flags;
+		len = ps_sendpsmdata(psp->psp_ctx, psp->psp_ctx->ps_data_fd,
+		    &psm, buf, (size_t)len);
+		if (len == -1)
+			logerr(__func__);
+		if (len == -1 || len == 0)
+			break;
+	}
+}
+
+#ifdef ARP
+/* Match the addresses of all interfaces on the shared socket,
+ * as arp_filtershared does when the manager owns it.
+ * This runs once per eloop iteration after the addresses change. */
+static void
+ps_bpf_filtershared(void *arg)
+{
+	struct ps_process *psp = arg;
+	struct ps_bpf_if *bif;
+	struct in_addr addrs[BPF_ARP_ADDRS_MAX];
+	size_t naddrs = 0;
+
+	TAILQ_FOREACH(bif, psp->psp_bpf_ifs, next) {
+		/* Too many, so pass up all ARP. */
+		if (naddrs == BPF_ARP_ADDRS_MAX) {
+			naddrs++;
+			break;
+		}
+		addrs[naddrs++] = bif->id.psi_addr.psa_in_addr;
+	}
+
+	if (bpf_arp_addrs(psp->psp_bpf, addrs, naddrs) == -1)
+		logerr(__func__);
+}
+
+static void
+ps_bpf_sharedchanged(struct ps_process *psp)
+{
+
+	if (psp->psp_id.psi_cmd == PS_BPF_ARP &&
+	    eloop_timeout_add_sec(psp->psp_ctx->eloop, 0,
+	    ps_bpf_filtershared, psp) == -1)
+		logerr("%s: eloop_timeout_add_sec", __func__);
+}
+#endif
+
+static ssize_t
+ps_bpf_recvsharedmsgcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
+{
+	struct ps_process *psp = arg;
+	struct iovec *iov = msg->msg_iov;
+	struct ps_bpf_if *bif;
+
+#ifdef PRIVSEP_DEBUG
+	logerrx("%s: IN cmd %x, psp %p", __func__, psm->ps_cmd, psp);
+#endif
+
+	if ((psm->ps_cmd & ~(PS_START | PS_STOP)) != psp->psp_id.psi_cmd) {
+		/* IPC failure, we should not be processing any commands
+		 * at this point!/ */
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (psm->ps_cmd & PS_START) {
+		if (ps_bpf_findshared(psp, &psm->ps_id, true) != NULL)
+			return 0;
+		if (msg->msg_iovlen != 1 ||
+		    iov->iov_len != sizeof(bif->ifp)) {
+			errno = EINVAL;
+			return -1;
+		}
+		bif = malloc(sizeof(*bif));
+		if (bif == NULL)
+			return -1;
+		bif->id = psm->ps_id;
+		memcpy(&bif->ifp, iov->iov_base, sizeof(bif->ifp));
+		bif->ifp.ctx = psp->psp_ctx;
+		bif->ifp.options = NULL;
+		memset(bif->ifp.if_data, 0, sizeof(bif->ifp.if_data));
+		bif->bpf = bpf_share(psp->psp_bpf, &bif->ifp);
+		if (bif->bpf == NULL) {
+			free(bif);
+			return -1;
+		}
+		TAILQ_INSERT_TAIL(psp->psp_bpf_ifs, bif, next);
+#ifdef ARP
+		ps_bpf_sharedchanged(psp);
+#endif
+		logdebugx("%s: using %s", bif->ifp.name, psp->psp_name);
+		return 0;
+	}
+
+	if (psm->ps_cmd & PS_STOP) {
+		bif = ps_bpf_findshared(psp, &psm->ps_id, true);
+		if (bif == NULL)
+			return 0;
+		TAILQ_REMOVE(psp->psp_bpf_ifs, bif, next);
+		bpf_close(bif->bpf);
+		free(bif);
+#ifdef ARP
+		ps_bpf_sharedchanged(psp);
+#endif
+		return 0;
+	}
+
+	/* Any address on the interface sends the same frame. */
+	bif = ps_bpf_findshared(psp, &psm->ps_id, false);
+	if (bif == NULL) {
+		errno = ENXIO;
+		return -1;
+	}
+	return bpf_send(bif->bpf, psp->psp_proto,
+	    iov->iov_base, iov->iov_len);
+}
+
+static void
+ps_bpf_recvsharedmsg(void *arg, unsigned short events)
+{
+	struct ps_process *psp = arg;
+
+	if (ps_recvpsmsg(psp->psp_ctx, psp->psp_fd, events,
+	    ps_bpf_recvsharedmsgcb, arg) == -1)
+		logerr(__func__);
+}
+
+static int
+ps_bpf_start_shared(struct ps_process *psp)
+{
+	struct dhcpcd_ctx *ctx = psp->psp_ctx;
+
+	setproctitle("[BPF %s] shared", psp->psp_protostr);
+	ps_freeprocesses(ctx, psp);
+
+	psp->psp_bpf_ifs = malloc(sizeof(*psp->psp_bpf_ifs));
+	if (psp->psp_bpf_ifs == NULL) {
+		logerr(__func__);
+		goto err;
+	}
+	TAILQ_INIT(psp->psp_bpf_ifs);
+
+	psp->psp_bpf = bpf_open(ctx, NULL, psp->psp_filter, NULL);
+	if (psp->psp_bpf == NULL)
+		logerr("%s: bpf_open",__func__);
+#ifdef PRIVSEP_RIGHTS
+	else if (ps_rights_limit_fd(psp->psp_bpf->bpf_fd) == -1)
+		logerr("%s: ps_rights_limit_fd", __func__);
+#endif
+	else if (eloop_event_add(ctx->eloop, psp->psp_bpf->bpf_fd, ELE_READ,
+	    ps_bpf_recvshared, psp) == -1)
+		logerr("%s: eloop_event_add", __func__);
+	else {
+		psp->psp_work_fd = psp->psp_bpf->bpf_fd;
+		return 0;
+	}
+
+err:
+	eloop_exit(ctx->eloop, EXIT_FAILURE);
+	return -1;
+}
+
+ssize_t
+ps_bpf_sharedcmd(struct dhcpcd_ctx *ctx,
+    struct ps_msghdr *psm, struct msghdr *msg)
+{
+	uint16_t cmd;
+	struct ps_id psi = { .psi_ifindex = 0 };
+	struct ps_process *psp;
+	struct iovec *iov = msg->msg_iov;
+	const struct interface *ifp;
+	pid_t start;
+	ssize_t err;
+
+	cmd = (uint16_t)(psm->ps_cmd & ~(PS_START | PS_STOP));
+	switch (cmd) {
+#ifdef ARP
+	case PS_BPF_ARP:	/* FALLTHROUGH */
+#endif
+	case PS_BPF_BOOTP:
+		break;
+	default:
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* Other link types keep a helper per interface. */
+	if (psm->ps_cmd & PS_START) {
+		ifp = iov->iov_base;
+		if (msg->msg_iovlen != 1 || iov->iov_len != sizeof(*ifp) ||
+		    ifp->hwtype != ARPHRD_ETHER) {
+			errno = ENOTSUP;
+			return -1;
+		}
+	}
+
+	psi.psi_cmd = cmd;
+	psp = ps_findprocess(ctx, &psi);
+	if (psp != NULL) {
+		err = ps_sendpsmmsg(ctx, psp->psp_fd, psm, msg);
+		if (err == -1) {
+			logerr("%s: failed to send message to pid %d",
+			    __func__, psp->psp_pid);
+			ps_freeprocess(psp);
+		}
+		return 0;
+	}
+
+	if (!(psm->ps_cmd & PS_START)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	psp = ps_newprocess(ctx, &psi);
+	if (psp == NULL)
+		return -1;
+
+	switch (cmd) {
+#ifdef ARP
+	case PS_BPF_ARP:
+		psp->psp_proto = ETHERTYPE_ARP;
+		psp->psp_protostr = "ARP";
+		psp->psp_filter = bpf_arp;
+		break;
+#endif
+	case PS_BPF_BOOTP:
+		psp->psp_proto = ETHERTYPE_IP;
+		psp->psp_protostr = "BOOTP";
+		psp->psp_filter = bpf_bootp;
+		break;
+	}
+	snprintf(psp->psp_name, sizeof(psp->psp_name), "BPF %s shared",
+	    psp->psp_protostr);
+
+	start = ps_startprocess(psp, ps_bpf_recvsharedmsg, NULL,
+	    ps_bpf_start_shared, NULL, PSF_DROPPRIVS | PSF_RING);
+	switch (start) {
+	case -1:
+		ps_freeprocess(psp);
+		return -1;
+	case 0:
+		ps_entersandbox("stdio", NULL);
+		/* Add the interface which started us. */
+		if (ps_bpf_recvsharedmsgcb(psp, psm, msg) == -1)
+			logerr(__func__);
+		break;
+	default:
+		logdebugx("spawned %s on PID %d", psp->psp_name, psp->psp_pid);
+		break;
+	}
+	return start;
+}
+
+void
+ps_bpf_freeshared(struct ps_process *psp)
+{
+	struct ps_bpf_if *bif;
+
+	while ((bif = TAILQ_FIRST(psp->psp_bpf_ifs)) != NULL) {
+		TAILQ_REMOVE(psp->psp_bpf_ifs, bif, next);
+		bpf_close(bif->bpf);
+		free(bif);
+	}
+	free(psp->psp_bpf_ifs);
+	psp->psp_bpf_ifs = NULL;
+}
+#else
+ssize_t
+ps_bpf_sharedcmd(__unused struct dhcpcd_ctx *ctx,
+    __unused struct ps_msghdr *psm, __unused struct msghdr *msg)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+void
+ps_bpf_freeshared(__unused struct ps_process *psp)
+{
+
+}
+#endif
+
 ssize_t
 ps_bpf_dispatch(struct dhcpcd_ctx *ctx,
     struct ps_msghdr *psm, struct msghdr *msg)
@@ -31,6 +31,9 @@
 
 ssize_t ps_bpf_cmd(struct dhcpcd_ctx *,
     struct ps_msghdr *, struct msghdr *);
+ssize_t ps_bpf_sharedcmd(struct dhcpcd_ctx *,
+    struct ps_msghdr *, struct msghdr *);
+void ps_bpf_freeshared(struct ps_process *);
 ssize_t ps_bpf_dispatch(struct dhcpcd_ctx *,
     struct ps_msghdr *, struct msghdr *);
 
@@ -327,6 +327,12 @@ ssize_t
 ps_root_route(struct dhcpcd_ctx *ctx, void *data, size_t len)
 {
 
+	if (ps_root_batching(ctx)) {
+		struct iovec iov = { .iov_base = data, .iov_len = len };
+		struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+		return ps_root_batchmsg(ctx, PS_ROUTE, 0, &msg);
+	}
 	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd, PS_ROUTE, 0, data, len) == -1)
 		return -1;
 	return ps_root_readerror(ctx, data, len);
@@ -103,8 +103,24 @@ ps_ctl_handleargs(struct fd_list *fd, char *data, size_t len)
 		    strlen(fd->ctx->cffile) + 1);
 	} else if (strncmp(data, "--listen",
 	    MIN(strlen("--listen"), len)) == 0) {
-		fd->flags |= FD_LISTEN;
-		return 0;
+		char *argv[32], *p, *e;
+		int argc = 0;
+
+		/* Arguments are NUL separated, skip --listen itself. */
+		e = data + len;
+		p = memchr(data, '\0', len);
+		while (p != NULL && ++p < e) {
+			if ((size_t)argc == __arraycount(argv)) {
+				errno = E2BIG;
+				return -1;
+			}
+			argv[argc++] = p;
+			p = memchr(p, '\0', (size_t)(e - p));
+		}
+		/* The last argument may not have been terminated. */
+		if (argc != 0 && p == NULL)
+			data[len] = '\0';
+		return control_listen(fd, argc, argv);
 	}
 
 	if (fd->ctx->ps_control_client != NULL &&
@@ -197,14 +213,19 @@ static void
 ps_ctl_listen(void *arg, unsigned short events)
 {
 	struct dhcpcd_ctx *ctx = arg;
-	char buf[BUFSIZ];
+	struct fd_buf *b = NULL;
+	size_t data_len;
 	ssize_t len;
 	struct fd_list *fd;
 
 	if (!(events & ELE_READ))
 		logerrx("%s: unexpected event 0x%04x", __func__, events);
 
-	len = read(ctx->ps_control->fd, buf, sizeof(buf));
+	/*
+	 * Read one event at a time rather than passing the stream along
+	 * so that delta listeners can compare whole events.
+	 */
+	len = read(ctx->ps_control->fd, &data_len, sizeof(data_len));
 	if (len == 0)
 		return;
 	if (len == -1) {
@@ -212,14 +233,42 @@ ps_ctl_listen(void *arg, unsigned short events)
 		eloop_exit(ctx->eloop, EXIT_FAILURE);
 		return;
 	}
+	if ((size_t)len != sizeof(data_len) || data_len == 0)
+		goto truncated;
+
+	/* Read into a buffer all our listeners can share */
+	b = control_buf_new(NULL, data_len);
+	if (b == NULL) {
+		logerr(__func__);
+		eloop_exit(ctx->eloop, EXIT_FAILURE);
+		return;
+	}
+	len = read(ctx->ps_control->fd, b->data, data_len);
+	if (len == -1) {
+		logerr("%s: read", __func__);
+		goto out;
+	}
+	if ((size_t)len != data_len)
+		goto truncated;
 
 	/* Send to our listeners */
 	TAILQ_FOREACH(fd, &ctx->control_fds, next) {
-		if (!(fd->flags & FD_LISTEN))
+		if (!control_wants_event(fd, b->data, b->len))
 			continue;
-		if (control_queue(fd, buf, (size_t)len)== -1)
-			logerr("%s: control_queue", __func__);
+		fd->flags |= FD_SENDLEN;
+		if (control_queue_event(fd, b) == -1)
+			logerr("%s: control_queue_event", __func__);
+		fd->flags &= ~FD_SENDLEN;
 	}
+	goto done;
+
+truncated:
+	logerrx("%s: truncated event", __func__);
+out:
+	eloop_exit(ctx->eloop, EXIT_FAILURE);
+done:
+	if (b != NULL)
+		control_buf_free(b);
 }
 
 pid_t
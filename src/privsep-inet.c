@@ -47,170 +47,67 @@
 #include "logerr.h"
 #include "privsep.h"
 
-#ifdef INET
-static void
-ps_inet_recvbootp(void *arg, unsigned short events)
+/*
+ * The generic listeners take anything for their protocol which the
+ * address specific listeners below do not.
+ * Like those, they are spawned by the privileged proxy when the manager
+ * first needs them rather than at startup.
+ * The socket is opened before forking, so nothing sent in the meantime,
+ * such as the reply to the first Router Solicitation, is missed.
+ */
+static int
+ps_inet_openany(uint16_t cmd)
 {
-	struct dhcpcd_ctx *ctx = arg;
 
-	if (ps_recvmsg(ctx, ctx->udp_rfd, events,
-	    PS_BOOTP, ctx->ps_inet->psp_fd) == -1)
-		logerr(__func__);
-}
+	switch (cmd) {
+#ifdef INET
+	case PS_BOOTP:
+		return dhcp_openudp(NULL);
 #endif
-
-#ifdef INET6
-static void
-ps_inet_recvra(void *arg, unsigned short events)
-{
-#ifdef __sun
-	struct interface *ifp = arg;
-	struct rs_state *state = RS_STATE(ifp);
-	struct dhcpcd_ctx *ctx = ifp->ctx;
-
-	if (ps_recvmsg(ctx, state->nd_fd, events,
-	    PS_ND, ctx->ps_inet->psp_fd) == -1)
-		logerr(__func__);
-#else
-	struct dhcpcd_ctx *ctx = arg;
-
-	if (ps_recvmsg(ctx, ctx->nd_fd, events,
-	    PS_ND, ctx->ps_inet->psp_fd) == -1)
-		logerr(__func__);
+#if defined(INET6) && !defined(__sun)
+	case PS_ND:
+		return ipv6nd_open(true);
 #endif
-}
+#ifdef DHCP6
+	case PS_DHCP6:
+		return dhcp6_openudp(0, NULL);
 #endif
+	default:
+		errno = ENOTSUP;
+		return -1;
+	}
+}
 
-#ifdef DHCP6
 static void
-ps_inet_recvdhcp6(void *arg, unsigned short events)
+ps_inet_recvany(void *arg, unsigned short events)
 {
-	struct dhcpcd_ctx *ctx = arg;
+	struct ps_process *psp = arg;
 
-	if (ps_recvmsg(ctx, ctx->dhcp6_rfd, events,
-	    PS_DHCP6, ctx->ps_inet->psp_fd) == -1)
+	if (ps_recvmsg(psp->psp_ctx, psp->psp_work_fd, events,
+	    psp->psp_id.psi_cmd, psp->psp_ctx->ps_data_fd) == -1)
 		logerr(__func__);
 }
-#endif
-
-bool
-ps_inet_canstart(const struct dhcpcd_ctx *ctx)
-{
-
-#ifdef INET
-	if ((ctx->options & (DHCPCD_IPV4 | DHCPCD_MANAGER)) ==
-	    (DHCPCD_IPV4 | DHCPCD_MANAGER))
-		return true;
-#endif
-#if defined(INET6) && !defined(__sun)
-	if (ctx->options & DHCPCD_IPV6)
-		return true;
-#endif
-#ifdef DHCP6
-	if ((ctx->options & (DHCPCD_IPV6 | DHCPCD_MANAGER)) ==
-	    (DHCPCD_IPV6 | DHCPCD_MANAGER))
-		return true;
-#endif
-
-	return false;
-}
 
 static int
-ps_inet_startcb(struct ps_process *psp)
+ps_inet_listenany(struct ps_process *psp)
 {
-	struct dhcpcd_ctx *ctx = psp->psp_ctx;
-	int ret = 0;
-
-	if (ctx->options & DHCPCD_MANAGER)
-		setproctitle("[network proxy]");
-	else
-		setproctitle("[network proxy] %s%s%s",
-		    ctx->ifc != 0 ? ctx->ifv[0] : "",
-		    ctx->options & DHCPCD_IPV4 ? " [ip4]" : "",
-		    ctx->options & DHCPCD_IPV6 ? " [ip6]" : "");
 
-	/* This end is the main engine, so it's useless for us. */
-	close(ctx->ps_data_fd);
-	ctx->ps_data_fd = -1;
+	setproctitle("[%s proxy]", psp->psp_protostr);
 
-	errno = 0;
-
-#ifdef INET
-	if ((ctx->options & (DHCPCD_IPV4 | DHCPCD_MANAGER)) ==
-	    (DHCPCD_IPV4 | DHCPCD_MANAGER))
-	{
-		ctx->udp_rfd = dhcp_openudp(NULL);
-		if (ctx->udp_rfd == -1)
-			logerr("%s: dhcp_open", __func__);
-#ifdef PRIVSEP_RIGHTS
-		else if (ps_rights_limit_fd_rdonly(ctx->udp_rfd) == -1) {
-			logerr("%s: ps_rights_limit_fd_rdonly", __func__);
-			close(ctx->udp_rfd);
-			ctx->udp_rfd = -1;
-		}
-#endif
-		else if (eloop_event_add(ctx->eloop, ctx->udp_rfd, ELE_READ,
-		    ps_inet_recvbootp, ctx) == -1)
-		{
-			logerr("%s: eloop_event_add DHCP", __func__);
-			close(ctx->udp_rfd);
-			ctx->udp_rfd = -1;
-		} else
-			ret++;
-	}
-#endif
-#if defined(INET6) && !defined(__sun)
-	if (ctx->options & DHCPCD_IPV6) {
-		ctx->nd_fd = ipv6nd_open(true);
-		if (ctx->nd_fd == -1)
-			logerr("%s: ipv6nd_open", __func__);
-#ifdef PRIVSEP_RIGHTS
-		else if (ps_rights_limit_fd_rdonly(ctx->nd_fd) == -1) {
-			logerr("%s: ps_rights_limit_fd_rdonly", __func__);
-			close(ctx->nd_fd);
-			ctx->nd_fd = -1;
-		}
-#endif
-		else if (eloop_event_add(ctx->eloop, ctx->nd_fd, ELE_READ,
-		    ps_inet_recvra, ctx) == -1)
-		{
-			logerr("%s: eloop_event_add RA", __func__);
-			close(ctx->nd_fd);
-			ctx->nd_fd = -1;
-		} else
-			ret++;
-	}
-#endif
-#ifdef DHCP6
-	if ((ctx->options & (DHCPCD_IPV6 | DHCPCD_MANAGER)) ==
-	    (DHCPCD_IPV6 | DHCPCD_MANAGER))
-	{
-		ctx->dhcp6_rfd = dhcp6_openudp(0, NULL);
-		if (ctx->dhcp6_rfd == -1)
-			logerr("%s: dhcp6_open", __func__);
 #ifdef PRIVSEP_RIGHTS
-		else if (ps_rights_limit_fd_rdonly(ctx->dhcp6_rfd) == -1) {
-			logerr("%s: ps_rights_limit_fd_rdonly", __func__);
-			close(ctx->dhcp6_rfd);
-			ctx->dhcp6_rfd = -1;
-		}
-#endif
-		else if (eloop_event_add(ctx->eloop, ctx->dhcp6_rfd, ELE_READ,
-		    ps_inet_recvdhcp6, ctx) == -1)
-		{
-			logerr("%s: eloop_event_add DHCP6", __func__);
-			close(ctx->dhcp6_rfd);
-			ctx->dhcp6_rfd = -1;
-		} else
-			ret++;
+	if (ps_rights_limit_fd_rdonly(psp->psp_work_fd) == -1) {
+		logerr("%s: ps_rights_limit_fd_rdonly", __func__);
+		return -1;
 	}
 #endif
 
-	if (ret == 0 && errno == 0) {
-		errno = ENXIO;
+	if (eloop_event_add(psp->psp_ctx->eloop, psp->psp_work_fd, ELE_READ,
+	    ps_inet_recvany, psp) == -1)
+	{
+		logerr("%s: eloop_event_add %s", __func__, psp->psp_protostr);
 		return -1;
 	}
-	return ret;
+	return 0;
 }
 
 static bool
@@ -302,21 +199,18 @@ dosend:
 	return sendmsg(s, msg, 0);
 }
 
-static void
-ps_inet_recvmsg(void *arg, unsigned short events)
-{
-	struct ps_process *psp = arg;
-
-	/* Receive shutdown */
-	if (ps_recvpsmsg(psp->psp_ctx, psp->psp_fd, events, NULL, NULL) == -1)
-		logerr(__func__);
-}
-
 ssize_t
 ps_inet_dispatch(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 {
 	struct dhcpcd_ctx *ctx = arg;
 
+	/* The privileged proxy reaped a generic listener. */
+	if (psm->ps_cmd & PS_STOP) {
+		ctx->ps_inet_listening &=
+		    ~(1U << (psm->ps_cmd & ~PS_STOP));
+		return 1;
+	}
+
 	switch (psm->ps_cmd) {
 #ifdef INET
 	case PS_BOOTP:
@@ -340,47 +234,6 @@ ps_inet_dispatch(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 	return 1;
 }
 
-static void
-ps_inet_dodispatch(void *arg, unsigned short events)
-{
-	struct ps_process *psp = arg;
-
-	if (ps_recvpsmsg(psp->psp_ctx, psp->psp_fd, events,
-	    ps_inet_dispatch, psp->psp_ctx) == -1)
-		logerr(__func__);
-}
-
-pid_t
-ps_inet_start(struct dhcpcd_ctx *ctx)
-{
-	struct ps_id id = {
-		.psi_ifindex = 0,
-		.psi_cmd = PS_INET,
-	};
-	struct ps_process *psp;
-	pid_t pid;
-
-	psp = ctx->ps_inet = ps_newprocess(ctx, &id);
-	if (psp == NULL)
-		return -1;
-
-	strlcpy(psp->psp_name, "network proxy", sizeof(psp->psp_name));
-	pid = ps_startprocess(psp, ps_inet_recvmsg, ps_inet_dodispatch,
-	    ps_inet_startcb, NULL, PSF_DROPPRIVS);
-
-	if (pid == 0)
-		ps_entersandbox("stdio", NULL);
-
-	return pid;
-}
-
-int
-ps_inet_stop(struct dhcpcd_ctx *ctx)
-{
-
-	return ps_stopprocess(ctx->ps_inet);
-}
-
 #ifdef INET
 static void
 ps_inet_recvinbootp(void *arg, unsigned short events)
@@ -527,6 +380,7 @@ ps_inet_cmd(struct dhcpcd_ctx *ctx, struct ps_msghdr *psm, struct msghdr *msg)
 	struct ps_addr *psa = &psm->ps_id.psi_addr;
 	void *ia;
 	char buf[INET_MAX_ADDRSTRLEN];
+	bool any = psm->ps_id.psi_ifindex == 0;
 
 	cmd = (uint16_t)(psm->ps_cmd & ~(PS_START | PS_STOP));
 	if (cmd == psm->ps_cmd)
@@ -559,38 +413,50 @@ ps_inet_cmd(struct dhcpcd_ctx *ctx, struct ps_msghdr *psm, struct msghdr *msg)
 	switch (cmd) {
 #ifdef INET
 	case PS_BOOTP:
-		start_func = ps_inet_listenin;
+		start_func = any ? ps_inet_listenany : ps_inet_listenin;
 		psp->psp_protostr = "BOOTP";
 		ia = &psa->psa_in_addr;
 		break;
 #endif
 #ifdef INET6
-#ifdef __sun
 	case PS_ND:
+#ifdef __sun
 		start_func = ps_inet_listennd;
+#else
+		if (!any)
+			goto unknown;
+		start_func = ps_inet_listenany;
+#endif
 		psp->psp_protostr = "ND";
 		ia = &psa->psa_in6_addr;
 		break;
-#endif
 #ifdef DHCP6
 	case PS_DHCP6:
-		start_func = ps_inet_listenin6;
+		start_func = any ? ps_inet_listenany : ps_inet_listenin6;
 		psp->psp_protostr = "DHCP6";
 		ia = &psa->psa_in6_addr;
 		break;
 #endif
 #endif
 	default:
-		logerrx("%s: unknown command %x", __func__, psm->ps_cmd);
-		errno = ENOTSUP;
-		return -1;
+		goto unknown;
 	}
 
-	snprintf(psp->psp_name, sizeof(psp->psp_name),
-	    "%s proxy %s", psp->psp_protostr,
-	    inet_ntop(psa->psa_family, ia, buf, sizeof(buf)));
+	if (any) {
+		psp->psp_work_fd = ps_inet_openany(cmd);
+		if (psp->psp_work_fd == -1) {
+			logerr("%s: %s", __func__, psp->psp_protostr);
+			ps_freeprocess(psp);
+			return -1;
+		}
+		snprintf(psp->psp_name, sizeof(psp->psp_name),
+		    "%s proxy", psp->psp_protostr);
+	} else
+		snprintf(psp->psp_name, sizeof(psp->psp_name),
+		    "%s proxy %s", psp->psp_protostr,
+		    inet_ntop(psa->psa_family, ia, buf, sizeof(buf)));
 	start = ps_startprocess(psp, ps_inet_recvmsgpsp, NULL,
-	    start_func, NULL, PSF_DROPPRIVS);
+	    start_func, NULL, PSF_DROPPRIVS | PSF_RING);
 	switch (start) {
 	case -1:
 		ps_freeprocess(psp);
@@ -599,11 +465,81 @@ ps_inet_cmd(struct dhcpcd_ctx *ctx, struct ps_msghdr *psm, struct msghdr *msg)
 		ps_entersandbox("stdio", NULL);
 		break;
 	default:
-		logdebugx("%s: spawned %s on PID %d",
-		    psp->psp_ifname, psp->psp_name, psp->psp_pid);
+		/* The socket is the listener's now. */
+		if (any) {
+			close(psp->psp_work_fd);
+			psp->psp_work_fd = -1;
+		}
+		logdebugx("%s%sspawned %s on PID %d",
+		    psp->psp_ifname, psp->psp_ifname[0] != '\0' ? ": " : "",
+		    psp->psp_name, psp->psp_pid);
 		break;
 	}
 	return start;
+
+unknown:
+	logerrx("%s: unknown command %x", __func__, psm->ps_cmd);
+	ps_freeprocess(psp);
+	errno = ENOTSUP;
+	return -1;
+}
+
+/* True if psi is a generic listener started by ps_inet_listen. */
+bool
+ps_inet_islistener(const struct ps_id *psi)
+{
+
+	if (psi->psi_ifindex != 0)
+		return false;
+	switch (psi->psi_cmd) {
+#ifdef INET
+	case PS_BOOTP:
+#endif
+#ifdef INET6
+	case PS_ND:
+#ifdef DHCP6
+	case PS_DHCP6:
+#endif
+#endif
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Tell the manager a generic listener has gone so that the next
+ * ps_inet_listen starts another one. */
+void
+ps_inet_reaped(struct ps_process *psp)
+{
+	struct dhcpcd_ctx *ctx = psp->psp_ctx;
+
+	if (!ps_inet_islistener(&psp->psp_id) ||
+	    ctx->options & DHCPCD_EXITING)
+		return;
+	if (ps_sendcmd(ctx, ctx->ps_data_fd,
+	    PS_STOP | psp->psp_id.psi_cmd, 0, NULL, 0) == -1)
+		logerr(__func__);
+}
+
+/* Have the privileged proxy start the generic listener for cmd.
+ * The proxy replies once the listener is running or has failed. */
+ssize_t
+ps_inet_listen(struct dhcpcd_ctx *ctx, uint16_t cmd)
+{
+	struct ps_msghdr psm = {
+		.ps_cmd = PS_START | cmd,
+		.ps_id = { .psi_cmd = cmd },
+	};
+	unsigned int bit = 1U << cmd;
+
+	if (ctx->ps_inet_listening & bit)
+		return 0;
+	if (ps_sendpsmmsg(ctx, ctx->ps_root->psp_fd, &psm, NULL) == -1 ||
+	    ps_root_readerror(ctx, NULL, 0) == -1)
+		return -1;
+	ctx->ps_inet_listening |= bit;
+	return 0;
 }
 
 #ifdef INET
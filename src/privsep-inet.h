@@ -29,9 +29,9 @@
 #ifndef PRIVSEP_INET_H
 #define PRIVSEP_INET_H
 
-bool ps_inet_canstart(const struct dhcpcd_ctx *);
-pid_t ps_inet_start(struct dhcpcd_ctx *);
-int ps_inet_stop(struct dhcpcd_ctx *);
+bool ps_inet_islistener(const struct ps_id *);
+void ps_inet_reaped(struct ps_process *);
+ssize_t ps_inet_listen(struct dhcpcd_ctx *, uint16_t);
 ssize_t ps_inet_cmd(struct dhcpcd_ctx *, struct ps_msghdr *, struct msghdr *);
 ssize_t ps_inet_dispatch(void *, struct ps_msghdr *, struct msghdr *);
 
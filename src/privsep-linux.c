@@ -64,11 +64,6 @@ ps_root_dosendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct msghdr *msg)
 {
 	struct priv *priv = (struct priv *)ctx->priv;
 	int s;
-	unsigned char buf[16 * 1024];
-	struct iovec riov = {
-		.iov_base = buf,
-		.iov_len = sizeof(buf),
-	};
 
 	switch(protocol) {
 	case NETLINK_GENERIC:
@@ -82,10 +77,15 @@ ps_root_dosendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct msghdr *msg)
 		return -1;
 	}
 
+	if (protocol == NETLINK_ROUTE && if_txn_active(ctx) &&
+	    msg->msg_iovlen == 1)
+		return if_txn_queue(ctx, msg->msg_iov[0].iov_base,
+		    msg->msg_iov[0].iov_len);
+
 	if (sendmsg(s, msg, 0) == -1)
 		return -1;
 
-	return if_getnetlink(NULL, &riov, s, 0, NULL, NULL);
+	return if_getnetlink(ctx, s, 0, NULL, NULL);
 }
 
 ssize_t
@@ -106,6 +106,9 @@ ssize_t
 ps_root_sendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct msghdr *msg)
 {
 
+	if (ps_root_batching(ctx))
+		return ps_root_batchmsg(ctx, PS_ROUTE,
+		    (unsigned long)protocol, msg);
 	if (ps_sendmsg(ctx, ctx->ps_root->psp_fd, PS_ROUTE,
 	    (unsigned long)protocol, msg) == -1)
 		return -1;
@@ -122,23 +125,27 @@ ps_root_sendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct msghdr *msg)
 # error "Uknown endian"
 #endif
 
+/*
+ * The allowed syscalls are listed as rules and ps_seccomp_build turns
+ * them into a binary search over the syscall number, so any syscall is
+ * found in about log2 of the number of rules comparisons rather than
+ * walking a list where the last entries pay for all the others.
+ */
+struct ps_seccomp_rule {
+	uint32_t nr;
+	int arg;		/* -1 for any arguments */
+	uint64_t val;
+};
+
+#define SECCOMP_ARG(_arg)						    \
+	(offsetof(struct seccomp_data, args) +				    \
+	    (size_t)(_arg) * sizeof(uint64_t))
+
 #define SECCOMP_ALLOW(_nr)						    \
-	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, (_nr), 0, 1),		    \
-	BPF_STMT(BPF_RET + BPF_K, SECCOMP_RET_ALLOW)
+	{ .nr = (uint32_t)(_nr), .arg = -1 }
 
 #define SECCOMP_ALLOW_ARG(_nr, _arg, _val)				    \
-	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, (_nr), 0, 6),		    \
-	BPF_STMT(BPF_LD + BPF_W + BPF_ABS,				    \
-	    offsetof(struct seccomp_data, args[(_arg)]) + SECCOMP_ARG_LO),  \
-	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K,				    \
-	    ((_val) & 0xffffffff), 0, 3),				    \
-	BPF_STMT(BPF_LD + BPF_W + BPF_ABS,				    \
-	    offsetof(struct seccomp_data, args[(_arg)]) + SECCOMP_ARG_HI),  \
-	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K,				    \
-	    (((uint32_t)((uint64_t)(_val) >> 32)) & 0xffffffff), 0, 1),	    \
-	BPF_STMT(BPF_RET + BPF_K, SECCOMP_RET_ALLOW),			\
-	BPF_STMT(BPF_LD + BPF_W + BPF_ABS,				\
-		offsetof(struct seccomp_data, nr))
+	{ .nr = (uint32_t)(_nr), .arg = (_arg), .val = (uint64_t)(_val) }
 
 #ifdef SECCOMP_FILTER_DEBUG
 #define SECCOMP_FILTER_FAIL	SECCOMP_RET_TRAP
@@ -271,15 +278,7 @@ ps_root_sendnetlink(struct dhcpcd_ctx *ctx, int protocol, struct msghdr *msg)
 #  error "Platform does not support seccomp filter yet"
 #endif
 
-static struct sock_filter ps_seccomp_filter[] = {
-	/* Check syscall arch */
-	BPF_STMT(BPF_LD + BPF_W + BPF_ABS,
-	    offsetof(struct seccomp_data, arch)),
-	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, SECCOMP_AUDIT_ARCH, 1, 0),
-	BPF_STMT(BPF_RET + BPF_K, SECCOMP_FILTER_FAIL),
-	/* Allow syscalls */
-	BPF_STMT(BPF_LD + BPF_W + BPF_ABS,
-		offsetof(struct seccomp_data, nr)),
+static struct ps_seccomp_rule ps_seccomp_rules[] = {
 #ifdef __NR_accept
 	SECCOMP_ALLOW(__NR_accept),
 #endif
@@ -322,6 +321,12 @@ static struct sock_filter ps_seccomp_filter[] = {
 #ifdef __NR_fstat64
 	SECCOMP_ALLOW(__NR_fstat64),
 #endif
+#ifdef __NR_ftruncate
+	SECCOMP_ALLOW(__NR_ftruncate),
+#endif
+#ifdef __NR_ftruncate64
+	SECCOMP_ALLOW(__NR_ftruncate64),
+#endif
 #ifdef __NR_gettimeofday
 	SECCOMP_ALLOW(__NR_gettimeofday),
 #endif
@@ -336,6 +341,9 @@ static struct sock_filter ps_seccomp_filter[] = {
 	SECCOMP_ALLOW_ARG(__NR_getsockopt, 1, SOL_SOCKET),
 	SECCOMP_ALLOW_ARG(__NR_getsockopt, 2, SO_RCVBUF),
 #endif
+#if defined(HAVE_IO_URING) && defined(__NR_io_uring_enter)
+	SECCOMP_ALLOW(__NR_io_uring_enter),
+#endif
 #ifdef __NR_ioctl
 	SECCOMP_ALLOW_ARG(__NR_ioctl, 1, SIOCGIFFLAGS),
 	SECCOMP_ALLOW_ARG(__NR_ioctl, 1, SIOCGIFHWADDR),
@@ -350,6 +358,10 @@ static struct sock_filter ps_seccomp_filter[] = {
 #ifdef __NR_mmap
 	SECCOMP_ALLOW(__NR_mmap),
 #endif
+#ifdef __NR_mremap
+	/* realloc(3) of a large buffer, such as a link dump */
+	SECCOMP_ALLOW(__NR_mremap),
+#endif
 #ifdef __NR_munmap
 	SECCOMP_ALLOW(__NR_munmap),
 #endif
@@ -362,12 +374,18 @@ static struct sock_filter ps_seccomp_filter[] = {
 #ifdef __NR_ppoll_time64
 	SECCOMP_ALLOW(__NR_ppoll_time64),
 #endif
+#ifdef __NR_pread64
+	SECCOMP_ALLOW(__NR_pread64),
+#endif
 #ifdef __NR_pselect6
 	SECCOMP_ALLOW(__NR_pselect6),
 #endif
 #ifdef __NR_pselect6_time64
 	SECCOMP_ALLOW(__NR_pselect6_time64),
 #endif
+#ifdef __NR_pwrite64
+	SECCOMP_ALLOW(__NR_pwrite64),
+#endif
 #ifdef __NR_read
 	SECCOMP_ALLOW(__NR_read),
 #endif
@@ -380,6 +398,9 @@ static struct sock_filter ps_seccomp_filter[] = {
 #ifdef __NR_recvfrom
 	SECCOMP_ALLOW(__NR_recvfrom),
 #endif
+#ifdef __NR_recvmmsg
+	SECCOMP_ALLOW(__NR_recvmmsg),
+#endif
 #ifdef __NR_recvmsg
 	SECCOMP_ALLOW(__NR_recvmsg),
 #endif
@@ -406,6 +427,7 @@ static struct sock_filter ps_seccomp_filter[] = {
 	SECCOMP_ALLOW_ARG(__NR_socketcall, 0, SYS_GETSOCKOPT),	/* overflow */
 	SECCOMP_ALLOW_ARG(__NR_socketcall, 0, SYS_RECV),
 	SECCOMP_ALLOW_ARG(__NR_socketcall, 0, SYS_RECVFROM),
+	SECCOMP_ALLOW_ARG(__NR_socketcall, 0, SYS_RECVMMSG),
 	SECCOMP_ALLOW_ARG(__NR_socketcall, 0, SYS_RECVMSG),
 	SECCOMP_ALLOW_ARG(__NR_socketcall, 0, SYS_SEND),
 	SECCOMP_ALLOW_ARG(__NR_socketcall, 0, SYS_SENDMSG),
@@ -418,6 +440,9 @@ static struct sock_filter ps_seccomp_filter[] = {
 #ifdef __NR_time
 	SECCOMP_ALLOW(__NR_time),
 #endif
+#if defined(HAVE_TIMERFD) && defined(__NR_timerfd_settime)
+	SECCOMP_ALLOW(__NR_timerfd_settime),
+#endif
 #ifdef __NR_wait4
 	SECCOMP_ALLOW(__NR_wait4),
 #endif
@@ -433,16 +458,153 @@ static struct sock_filter ps_seccomp_filter[] = {
 #ifdef __NR_uname
 	SECCOMP_ALLOW(__NR_uname),
 #endif
-
-	/* Deny everything else */
-	BPF_STMT(BPF_RET + BPF_K, SECCOMP_FILTER_FAIL),
 };
 
+/* Header, then at most two jumps for each branch of the search
+ * and a leaf of three, or two plus five for each argument checked. */
+#define SECCOMP_FILTER_MAX	(4 + 10 * __arraycount(ps_seccomp_rules))
+static struct sock_filter ps_seccomp_filter[SECCOMP_FILTER_MAX];
+static size_t ps_seccomp_group[__arraycount(ps_seccomp_rules) + 1];
+
 static struct sock_fprog ps_seccomp_prog = {
-	.len = (unsigned short)__arraycount(ps_seccomp_filter),
 	.filter = ps_seccomp_filter,
 };
 
+static int
+ps_seccomp_cmp(const void *a, const void *b)
+{
+	const struct ps_seccomp_rule *ra = a, *rb = b;
+
+	if (ra->nr != rb->nr)
+		return ra->nr < rb->nr ? -1 : 1;
+	/* Any arguments sorts first so it decides the leaf. */
+	return ra->arg - rb->arg;
+}
+
+/* Size of the leaf for the rules with the same nr as group g. */
+static size_t
+ps_seccomp_leafsize(size_t g)
+{
+	size_t r = ps_seccomp_group[g], n = ps_seccomp_group[g + 1] - r;
+
+	if (ps_seccomp_rules[r].arg == -1)
+		return 3;
+	return 2 + 5 * n;
+}
+
+static size_t
+ps_seccomp_treesize(size_t lo, size_t hi)
+{
+	size_t mid, left;
+
+	if (hi - lo == 1)
+		return ps_seccomp_leafsize(lo);
+	mid = lo + (hi - lo) / 2;
+	left = ps_seccomp_treesize(lo, mid);
+	/* Conditional jumps only reach 255 instructions. */
+	return (left > UINT8_MAX ? 2 : 1) + left +
+	    ps_seccomp_treesize(mid, hi);
+}
+
+static struct sock_filter *
+ps_seccomp_emit(struct sock_filter *f, size_t lo, size_t hi)
+{
+	const struct ps_seccomp_rule *r, *re;
+	size_t mid, left;
+
+	if (hi - lo == 1) {
+		r = &ps_seccomp_rules[ps_seccomp_group[lo]];
+		re = &ps_seccomp_rules[ps_seccomp_group[lo + 1]];
+		if (r->arg == -1) {
+			*f++ = (struct sock_filter)
+			    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, r->nr, 0, 1);
+			*f++ = (struct sock_filter)
+			    BPF_STMT(BPF_RET + BPF_K, SECCOMP_RET_ALLOW);
+		} else {
+			*f++ = (struct sock_filter)
+			    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, r->nr,
+			    0, (uint8_t)(5 * (size_t)(re - r)));
+			for (; r < re; r++) {
+				*f++ = (struct sock_filter)
+				    BPF_STMT(BPF_LD + BPF_W + BPF_ABS,
+				    (uint32_t)(SECCOMP_ARG(r->arg) +
+				    SECCOMP_ARG_LO));
+				*f++ = (struct sock_filter)
+				    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K,
+				    (uint32_t)(r->val & 0xffffffff), 0, 3);
+				*f++ = (struct sock_filter)
+				    BPF_STMT(BPF_LD + BPF_W + BPF_ABS,
+				    (uint32_t)(SECCOMP_ARG(r->arg) +
+				    SECCOMP_ARG_HI));
+				*f++ = (struct sock_filter)
+				    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K,
+				    (uint32_t)(r->val >> 32), 0, 1);
+				*f++ = (struct sock_filter)
+				    BPF_STMT(BPF_RET + BPF_K,
+				    SECCOMP_RET_ALLOW);
+			}
+		}
+		*f++ = (struct sock_filter)
+		    BPF_STMT(BPF_RET + BPF_K, SECCOMP_FILTER_FAIL);
+		return f;
+	}
+
+	/* Below mid falls through to the left, otherwise jump right. */
+	mid = lo + (hi - lo) / 2;
+	left = ps_seccomp_treesize(lo, mid);
+	r = &ps_seccomp_rules[ps_seccomp_group[mid]];
+	if (left > UINT8_MAX) {
+		*f++ = (struct sock_filter)
+		    BPF_JUMP(BPF_JMP + BPF_JGE + BPF_K, r->nr, 0, 1);
+		*f++ = (struct sock_filter)
+		    BPF_JUMP(BPF_JMP + BPF_JA, (uint32_t)left, 0, 0);
+	} else
+		*f++ = (struct sock_filter)
+		    BPF_JUMP(BPF_JMP + BPF_JGE + BPF_K, r->nr,
+		    (uint8_t)left, 0);
+	f = ps_seccomp_emit(f, lo, mid);
+	return ps_seccomp_emit(f, mid, hi);
+}
+
+static int
+ps_seccomp_build(void)
+{
+	struct sock_filter *f = ps_seccomp_filter;
+	size_t i, ngroups = 0, nargs = 0;
+
+	qsort(ps_seccomp_rules, __arraycount(ps_seccomp_rules),
+	    sizeof(ps_seccomp_rules[0]), ps_seccomp_cmp);
+	for (i = 0; i < __arraycount(ps_seccomp_rules); i++) {
+		if (i == 0 ||
+		    ps_seccomp_rules[i].nr != ps_seccomp_rules[i - 1].nr)
+		{
+			ps_seccomp_group[ngroups++] = i;
+			nargs = 0;
+		}
+		/* The leaf jumps over its argument checks to deny. */
+		if (++nargs * 5 > UINT8_MAX) {
+			errno = E2BIG;
+			return -1;
+		}
+	}
+	ps_seccomp_group[ngroups] = i;
+
+	/* Check syscall arch */
+	*f++ = (struct sock_filter)BPF_STMT(BPF_LD + BPF_W + BPF_ABS,
+	    offsetof(struct seccomp_data, arch));
+	*f++ = (struct sock_filter)
+	    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, SECCOMP_AUDIT_ARCH, 1, 0);
+	*f++ = (struct sock_filter)
+	    BPF_STMT(BPF_RET + BPF_K, SECCOMP_FILTER_FAIL);
+	/* Allow syscalls, everything else is denied at the leaves */
+	*f++ = (struct sock_filter)BPF_STMT(BPF_LD + BPF_W + BPF_ABS,
+	    offsetof(struct seccomp_data, nr));
+	f = ps_seccomp_emit(f, 0, ngroups);
+
+	ps_seccomp_prog.len = (unsigned short)(f - ps_seccomp_filter);
+	return 0;
+}
+
 #ifdef SECCOMP_FILTER_DEBUG
 static void
 ps_seccomp_violation(__unused int signum, siginfo_t *si, __unused void *context)
@@ -481,6 +643,8 @@ ps_seccomp_enter(void)
 	ps_seccomp_debug();
 #endif
 
+	if (ps_seccomp_build() == -1)
+		return -1;
 	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1 ||
 	    prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &ps_seccomp_prog) == -1)
 	{
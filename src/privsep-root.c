@@ -36,6 +36,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stddef.h>
@@ -47,10 +48,12 @@
 #include "common.h"
 #include "dev.h"
 #include "dhcpcd.h"
+#include "dhcp-common.h"
 #include "dhcp6.h"
 #include "eloop.h"
 #include "if.h"
 #include "ipv6nd.h"
+#include "leasedb.h"
 #include "logerr.h"
 #include "privsep.h"
 #include "sa.h"
@@ -71,8 +74,149 @@ struct psr_ctx {
 	struct psr_error psr_error;
 	size_t psr_datalen;
 	void *psr_data;
+	int psr_fd;		/* passed with the reply */
 };
 
+/* Read the reply to the oldest command sent by ps_root_sendasync
+ * and queue it for dispatch. The privileged proxy replies in the order
+ * it was sent commands, so the reply always belongs to that command. */
+static void
+ps_root_asyncread(struct dhcpcd_ctx *ctx)
+{
+	struct ps_async *psa = TAILQ_FIRST(&ctx->ps_async);
+	int fd = ctx->ps_root->psp_fd;
+	struct psr_error psr;
+	struct iovec iov[] = {
+		{ .iov_base = &psr, .iov_len = sizeof(psr) },
+		{ .iov_base = NULL, .iov_len = 0 },
+	};
+	ssize_t len;
+	int err = 0;
+
+	if (psa == NULL)
+		return;
+
+	len = recv(fd, &psr, sizeof(psr), MSG_PEEK);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len == (ssize_t)sizeof(psr) && psr.psr_datalen != 0) {
+		if (psr.psr_datalen > SSIZE_MAX)
+			err = ENOBUFS;
+		else if ((psa->psa_data = malloc(psr.psr_datalen)) == NULL)
+			err = errno;
+		else {
+			iov[1].iov_base = psa->psa_data;
+			iov[1].iov_len = psr.psr_datalen;
+		}
+	}
+
+	/* Always read so the reply is consumed, even if we cannot use it. */
+	len = readv(fd, iov, __arraycount(iov));
+	if (len == -1)
+		err = errno;
+	else if ((size_t)len != sizeof(psr) + iov[1].iov_len && err == 0)
+		err = EINVAL;
+
+	TAILQ_REMOVE(&ctx->ps_async, psa, psa_next);
+	if (err != 0) {
+		free(psa->psa_data);
+		psa->psa_data = NULL;
+		psa->psa_result = -1;
+		psa->psa_errno = err;
+	} else {
+		psa->psa_result = psr.psr_result;
+		psa->psa_errno = psr.psr_errno;
+		psa->psa_datalen = iov[1].iov_len;
+	}
+#ifdef PS_STATS
+	ps_stats_add(ctx, PS_STAT_ROOT, psa->psa_cmd, psa->psa_result,
+	    psa->psa_len, len == -1 ? 0 : (size_t)len, &psa->psa_started);
+#endif
+	TAILQ_INSERT_TAIL(&ctx->ps_async_done, psa, psa_next);
+}
+
+static void
+ps_root_asyncdispatch(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	struct ps_async *psa;
+
+	while ((psa = TAILQ_FIRST(&ctx->ps_async_done)) != NULL) {
+		TAILQ_REMOVE(&ctx->ps_async_done, psa, psa_next);
+		if (psa->psa_cb != NULL) {
+			errno = psa->psa_errno;
+			psa->psa_cb(psa->psa_arg, psa->psa_result,
+			    psa->psa_data, psa->psa_datalen);
+		}
+		free(psa->psa_data);
+		free(psa);
+	}
+}
+
+static void
+ps_root_asynccb(void *arg, unsigned short events)
+{
+	struct dhcpcd_ctx *ctx = arg;
+
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	ps_root_asyncread(ctx);
+	if (TAILQ_FIRST(&ctx->ps_async) == NULL)
+		eloop_event_delete(ctx->eloop, ctx->ps_root->psp_fd);
+	ps_root_asyncdispatch(ctx);
+}
+
+static void
+ps_root_asyncwaitcb(void *arg, unsigned short events)
+{
+	struct dhcpcd_ctx *ctx = arg;
+
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	ps_root_asyncread(ctx);
+	eloop_exit(ctx->ps_eloop, EXIT_SUCCESS);
+}
+
+/* Collect the replies to any commands sent by ps_root_sendasync so the
+ * next reply read is for the command just sent.
+ * The callbacks are dispatched later from the main eloop as we may be
+ * deep inside some other operation. */
+static int
+ps_root_asyncwait(struct dhcpcd_ctx *ctx)
+{
+	int fd = ctx->ps_root->psp_fd;
+
+	if (TAILQ_FIRST(&ctx->ps_async) == NULL)
+		return 0;
+
+	eloop_event_delete(ctx->eloop, fd);
+	if (eloop_event_add(ctx->ps_eloop, fd, ELE_READ,
+	    ps_root_asyncwaitcb, ctx) == -1)
+		return -1;
+	while (TAILQ_FIRST(&ctx->ps_async) != NULL) {
+		eloop_enter(ctx->ps_eloop);
+		if (eloop_start(ctx->ps_eloop, &ctx->sigset) != EXIT_SUCCESS)
+			break;
+	}
+	eloop_event_delete(ctx->ps_eloop, fd);
+
+	if (TAILQ_FIRST(&ctx->ps_async_done) != NULL &&
+	    eloop_timeout_add_sec(ctx->eloop, 0,
+	    ps_root_asyncdispatch, ctx) == -1)
+		logerr("%s: eloop_timeout_add_sec", __func__);
+
+	if (TAILQ_FIRST(&ctx->ps_async) != NULL) {
+		if (eloop_event_add(ctx->eloop, fd, ELE_READ,
+		    ps_root_asynccb, ctx) == -1)
+			logerr("%s: eloop_event_add", __func__);
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
 static void
 ps_root_readerrorcb(void *arg, unsigned short events)
 {
@@ -84,6 +228,17 @@ ps_root_readerrorcb(void *arg, unsigned short events)
 		{ .iov_base = psr_ctx->psr_data,
 		  .iov_len = psr_ctx->psr_datalen },
 	};
+	union {
+		struct cmsghdr hdr;
+		uint8_t buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf = { .buf = { 0 } };
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = __arraycount(iov),
+		.msg_control = cmsgbuf.buf,
+		.msg_controllen = sizeof(cmsgbuf.buf),
+	};
+	struct cmsghdr *cmsg;
 	ssize_t len;
 	int exit_code = EXIT_FAILURE;
 
@@ -97,10 +252,19 @@ ps_root_readerrorcb(void *arg, unsigned short events)
 		goto out;			\
 	} while (0 /* CONSTCOND */)
 
-	len = readv(ctx->ps_root->psp_fd, iov, __arraycount(iov));
+#ifdef MSG_CMSG_CLOEXEC
+	len = recvmsg(ctx->ps_root->psp_fd, &msg, MSG_CMSG_CLOEXEC);
+#else
+	len = recvmsg(ctx->ps_root->psp_fd, &msg, 0);
+#endif
 	if (len == -1)
 		PSR_ERROR(errno);
-	else if ((size_t)len < sizeof(*psr_error))
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+		memcpy(&psr_ctx->psr_fd, CMSG_DATA(cmsg), sizeof(int));
+	if ((size_t)len < sizeof(*psr_error))
 		PSR_ERROR(EINVAL);
 	exit_code = EXIT_SUCCESS;
 
@@ -108,14 +272,18 @@ out:
 	eloop_exit(ctx->ps_eloop, exit_code);
 }
 
-ssize_t
-ps_root_readerror(struct dhcpcd_ctx *ctx, void *data, size_t len)
+/* As ps_root_readerror, but also returns any descriptor passed back. */
+static ssize_t
+ps_root_readerrorfd(struct dhcpcd_ctx *ctx, void *data, size_t len, int *fd)
 {
 	struct psr_ctx psr_ctx = {
 	    .psr_ctx = ctx,
 	    .psr_data = data, .psr_datalen = len,
+	    .psr_fd = -1,
 	};
 
+	if (ps_root_asyncwait(ctx) == -1)
+		return -1;
 	if (eloop_event_add(ctx->ps_eloop, ctx->ps_root->psp_fd, ELE_READ,
 	    ps_root_readerrorcb, &psr_ctx) == -1)
 		return -1;
@@ -124,10 +292,27 @@ ps_root_readerror(struct dhcpcd_ctx *ctx, void *data, size_t len)
 	eloop_start(ctx->ps_eloop, &ctx->sigset);
 	eloop_event_delete(ctx->ps_eloop, ctx->ps_root->psp_fd);
 
+#ifdef PS_STATS
+	ps_stats_add(ctx, PS_STAT_ROOT, ctx->ps_stat_cmd,
+	    psr_ctx.psr_error.psr_result, ctx->ps_stat_len,
+	    sizeof(psr_ctx.psr_error) + psr_ctx.psr_error.psr_datalen,
+	    &ctx->ps_stat_started);
+#endif
+	if (fd != NULL)
+		*fd = psr_ctx.psr_fd;
+	else if (psr_ctx.psr_fd != -1)
+		close(psr_ctx.psr_fd);
 	errno = psr_ctx.psr_error.psr_errno;
 	return psr_ctx.psr_error.psr_result;
 }
 
+ssize_t
+ps_root_readerror(struct dhcpcd_ctx *ctx, void *data, size_t len)
+{
+
+	return ps_root_readerrorfd(ctx, data, len, NULL);
+}
+
 #ifdef PRIVSEP_GETIFADDRS
 static void
 ps_root_mreaderrorcb(void *arg, unsigned short events)
@@ -179,8 +364,11 @@ ps_root_mreaderror(struct dhcpcd_ctx *ctx, void **data, size_t *len)
 {
 	struct psr_ctx psr_ctx = {
 	    .psr_ctx = ctx,
+	    .psr_fd = -1,
 	};
 
+	if (ps_root_asyncwait(ctx) == -1)
+		return -1;
 	if (eloop_event_add(ctx->ps_eloop, ctx->ps_root->psp_fd, ELE_READ,
 	    ps_root_mreaderrorcb, &psr_ctx) == -1)
 		return -1;
@@ -189,6 +377,12 @@ ps_root_mreaderror(struct dhcpcd_ctx *ctx, void **data, size_t *len)
 	eloop_start(ctx->ps_eloop, &ctx->sigset);
 	eloop_event_delete(ctx->ps_eloop, ctx->ps_root->psp_fd);
 
+#ifdef PS_STATS
+	ps_stats_add(ctx, PS_STAT_ROOT, ctx->ps_stat_cmd,
+	    psr_ctx.psr_error.psr_result, ctx->ps_stat_len,
+	    sizeof(psr_ctx.psr_error) + psr_ctx.psr_datalen,
+	    &ctx->ps_stat_started);
+#endif
 	errno = psr_ctx.psr_error.psr_errno;
 	*data = psr_ctx.psr_data;
 	*len = psr_ctx.psr_datalen;
@@ -217,6 +411,34 @@ ps_root_writeerror(struct dhcpcd_ctx *ctx, ssize_t result,
 	return writev(ctx->ps_root->psp_fd, iov, __arraycount(iov));
 }
 
+/* Reply with fd attached, if it is valid. */
+static ssize_t
+ps_root_writeerrorfd(struct dhcpcd_ctx *ctx, ssize_t result, int fd)
+{
+	struct psr_error psr = {
+		.psr_result = result,
+		.psr_errno = errno,
+	};
+	struct iovec iov = { .iov_base = &psr, .iov_len = sizeof(psr) };
+	union {
+		struct cmsghdr hdr;
+		uint8_t buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf = { .buf = { 0 } };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+
+	if (fd != -1) {
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(ctx->ps_root->psp_fd, &msg, 0);
+}
+
 static ssize_t
 ps_root_doioctl(unsigned long req, void *data, size_t len)
 {
@@ -265,30 +487,24 @@ ps_root_doioctl(unsigned long req, void *data, size_t len)
 static ssize_t
 ps_root_run_script(struct dhcpcd_ctx *ctx, const void *data, size_t len)
 {
-	const char *envbuf = data;
-	char * const argv[] = { ctx->script, NULL };
-	pid_t pid;
-	int status;
-
-	if (len == 0)
-		return 0;
 
-	if (script_buftoenv(ctx, UNCONST(envbuf), len) == NULL)
-		return -1;
+	/* The script is reaped in ps_root_signalcb. */
+	return script_queue(ctx, data, len);
+}
 
-	pid = script_exec(argv, ctx->script_env);
-	if (pid == -1)
-		return -1;
+/*
+ * Leases, the DUID and the secret live under DBDIR.
+ * Rather than copying them through the privileged proxy each time,
+ * it opens them for us and we do the I/O on the descriptor.
+ * The lease database keeps leases elsewhere so is excluded.
+ */
+static bool
+ps_root_fdfile(const struct dhcpcd_ctx *ctx, const char *path)
+{
 
-	/* Wait for the script to finish */
-	while (waitpid(pid, &status, 0) == -1) {
-		if (errno != EINTR) {
-			logerr(__func__);
-			status = 0;
-			break;
-		}
-	}
-	return status;
+	if (strncmp(DBDIR, path, strlen(DBDIR)) != 0)
+		return false;
+	return leasedb_key(ctx, path) == NULL;
 }
 
 static bool
@@ -300,6 +516,14 @@ ps_root_validpath(const struct dhcpcd_ctx *ctx, uint16_t cmd, const char *path)
 	if (strstr(path, "..") != NULL)
 		return false;
 
+	/* Only hand out descriptors for our own files. */
+	if (cmd == PS_OPENFILE) {
+		if (ps_root_fdfile(ctx, path))
+			return true;
+		errno = EPERM;
+		return false;
+	}
+
 	if (cmd == PS_READFILE) {
 #ifdef EMBEDDED_CONFIG
 		if (strcmp(ctx->cffile, EMBEDDED_CONFIG) == 0)
@@ -325,7 +549,7 @@ ps_root_validpath(const struct dhcpcd_ctx *ctx, uint16_t cmd, const char *path)
 }
 
 static ssize_t
-ps_root_dowritefile(const struct dhcpcd_ctx *ctx,
+ps_root_dowritefile(struct dhcpcd_ctx *ctx,
     mode_t mode, void *data, size_t len)
 {
 	char *file = data, *nc;
@@ -339,7 +563,31 @@ ps_root_dowritefile(const struct dhcpcd_ctx *ctx,
 	if (!ps_root_validpath(ctx, PS_WRITEFILE, file))
 		return -1;
 	nc++;
-	return writefile(file, mode, nc, len - (size_t)(nc - file));
+	return dhcp_writefile(ctx, file, mode, nc, len - (size_t)(nc - file));
+}
+
+/* A mode of 0 opens file for reading, otherwise it's created. */
+static ssize_t
+ps_root_doopenfile(struct dhcpcd_ctx *ctx, mode_t mode, void *data, size_t len)
+{
+	char *file = data;
+	int fd;
+	ssize_t err;
+
+	if (len == 0 || file[len - 1] != '\0') {
+		errno = EINVAL;
+		fd = -1;
+	} else if (!ps_root_validpath(ctx, PS_OPENFILE, file))
+		fd = -1;
+	else if (mode == 0)
+		fd = open(file, O_RDONLY | O_CLOEXEC);
+	else
+		fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, mode);
+
+	err = ps_root_writeerrorfd(ctx, fd == -1 ? -1 : 0, fd);
+	if (fd != -1)
+		close(fd);
+	return err;
 }
 
 #ifdef AUTH
@@ -357,21 +605,65 @@ ps_root_monordm(uint64_t *rdm, size_t len)
 
 #ifdef PRIVSEP_GETIFADDRS
 #define	IFA_NADDRS	4
+
+/*
+ * Asks for the addresses of just one interface and or family.
+ * Otherwise the result is given a generation. If it's unchanged from
+ * the generation the manager already has, no data is sent back.
+ */
+struct ps_ifaddrs_req {
+	char pir_ifname[IF_NAMESIZE];
+	int pir_family;
+	unsigned int pir_gen;
+};
+
+static bool
+ps_root_ifaddrs_match(const struct ifaddrs *ifa,
+    const struct ps_ifaddrs_req *req)
+{
+	size_t nlen;
+
+	if (req->pir_ifname[0] != '\0') {
+		/* Match any alias as if_nametospec would. */
+		nlen = strlen(req->pir_ifname);
+		if (strncmp(ifa->ifa_name, req->pir_ifname, nlen) != 0 ||
+		    (ifa->ifa_name[nlen] != '\0' &&
+		    ifa->ifa_name[nlen] != ':'))
+			return false;
+	}
+	if (req->pir_family != AF_UNSPEC &&
+	    (ifa->ifa_addr == NULL ||
+	    ifa->ifa_addr->sa_family != req->pir_family))
+		return false;
+	return true;
+}
+
 static ssize_t
-ps_root_dogetifaddrs(void **rdata, size_t *rlen)
+ps_root_dogetifaddrs(struct dhcpcd_ctx *ctx, const void *data, size_t dlen,
+    void **rdata, size_t *rlen)
 {
-	struct ifaddrs *ifaddrs, *ifa;
+	struct ps_ifaddrs_req req = { .pir_family = AF_UNSPEC };
+	struct ifaddrs *ifaddrs, *ifa, *ifc;
 	size_t len;
 	uint8_t *buf, *sap;
 	socklen_t salen;
+	bool cache;
+
+	if (dlen == sizeof(req))
+		memcpy(&req, data, sizeof(req));
+	else if (dlen != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	req.pir_ifname[sizeof(req.pir_ifname) - 1] = '\0';
+	cache = req.pir_ifname[0] == '\0' && req.pir_family == AF_UNSPEC;
 
+	*rdata = NULL;
+	*rlen = 0;
 	if (getifaddrs(&ifaddrs) == -1)
 		return -1;
-	if (ifaddrs == NULL) {
-		*rdata = NULL;
-		*rlen = 0;
+	if (ifaddrs == NULL)
 		return 0;
-	}
 
 	/* Work out the buffer length required.
 	 * Ensure everything is aligned correctly, which does
@@ -380,6 +672,8 @@ ps_root_dogetifaddrs(void **rdata, size_t *rlen)
 	 * much easier. */
 	len = 0;
 	for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
+		if (!ps_root_ifaddrs_match(ifa, &req))
+			continue;
 		len += ALIGN(sizeof(*ifa));
 		len += ALIGN(IFNAMSIZ);
 		len += ALIGN(sizeof(salen) * IFA_NADDRS);
@@ -400,6 +694,11 @@ ps_root_dogetifaddrs(void **rdata, size_t *rlen)
 #endif
 	}
 
+	if (len == 0) {
+		freeifaddrs(ifaddrs);
+		return 0;
+	}
+
 	/* Use calloc to set everything to zero.
 	 * This satisfies memory sanitizers because don't write
 	 * where we don't need to. */
@@ -412,7 +711,15 @@ ps_root_dogetifaddrs(void **rdata, size_t *rlen)
 	*rlen = len;
 
 	for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
-		memcpy(buf, ifa, sizeof(*ifa));
+		if (!ps_root_ifaddrs_match(ifa, &req))
+			continue;
+		/* Our pointers mean nothing to the manager, so copy just
+		 * the values and an unchanged result compares equal. */
+		ifc = (struct ifaddrs *)(void *)buf;
+		ifc->ifa_flags = ifa->ifa_flags;
+#ifdef HAVE_IFADDRS_ADDRFLAGS
+		ifc->ifa_addrflags = ifa->ifa_addrflags;
+#endif
 		buf += ALIGN(sizeof(*ifa));
 
 		strlcpy((char *)buf, ifa->ifa_name, IFNAMSIZ);
@@ -452,77 +759,51 @@ ps_root_dogetifaddrs(void **rdata, size_t *rlen)
 	}
 
 	freeifaddrs(ifaddrs);
-	return 0;
+	if (!cache)
+		return 0;
+
+	if (req.pir_gen != 0 && req.pir_gen == ctx->ps_ifaddrs_gen &&
+	    len == ctx->ps_ifaddrs_len &&
+	    memcmp(*rdata, ctx->ps_ifaddrs, len) == 0)
+	{
+		free(*rdata);
+		*rdata = NULL;
+		*rlen = 0;
+		return (ssize_t)req.pir_gen;
+	}
+
+	/* Remember what was sent to compare with next time. */
+	free(ctx->ps_ifaddrs);
+	ctx->ps_ifaddrs = malloc(len);
+	if (ctx->ps_ifaddrs == NULL) {
+		ctx->ps_ifaddrs_len = 0;
+		ctx->ps_ifaddrs_gen = 0;
+		return 0;
+	}
+	memcpy(ctx->ps_ifaddrs, *rdata, len);
+	ctx->ps_ifaddrs_len = len;
+	if (++ctx->ps_ifaddrs_gen > INT_MAX)
+		ctx->ps_ifaddrs_gen = 1;
+	return (ssize_t)ctx->ps_ifaddrs_gen;
 }
 #endif
 
+static ssize_t ps_root_dobatch(struct dhcpcd_ctx *, void *, size_t,
+    uint8_t *, void **, size_t *);
+
+/* Run a command which is not for a process we started.
+ * buf is PS_BUFLEN long and may be used for the reply. */
 static ssize_t
-ps_root_recvmsgcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
+ps_root_docmd(struct dhcpcd_ctx *ctx, struct ps_msghdr *psm,
+    struct msghdr *msg, bool batched, uint8_t *buf,
+    void **rdata, size_t *rlen, bool *free_rdata)
 {
-	struct dhcpcd_ctx *ctx = arg;
-	uint16_t cmd;
 	struct ps_process *psp;
 	struct iovec *iov = msg->msg_iov;
-	void *data = iov->iov_base, *rdata = NULL;
-	size_t len = iov->iov_len, rlen = 0;
-	uint8_t buf[PS_BUFLEN];
+	void *data = iov->iov_base;
+	size_t len = iov->iov_len;
 	time_t mtime;
 	ssize_t err;
-	bool free_rdata = false;
-
-	cmd = (uint16_t)(psm->ps_cmd & ~(PS_START | PS_STOP));
-	psp = ps_findprocess(ctx, &psm->ps_id);
-
-#ifdef PRIVSEP_DEBUG
-	logerrx("%s: IN cmd %x, psp %p", __func__, psm->ps_cmd, psp);
-#endif
-
-	if (psp != NULL) {
-		if (psm->ps_cmd & PS_STOP) {
-			return ps_stopprocess(psp);
-		} else if (psm->ps_cmd & PS_START) {
-			/* Process has already started .... */
-			logdebugx("%s%sprocess %s already started on pid %d",
-			    psp->psp_ifname,
-			    psp->psp_ifname[0] != '\0' ? ": " : "",
-			    psp->psp_name, psp->psp_pid);
-			return 0;
-		}
-
-		err = ps_sendpsmmsg(ctx, psp->psp_fd, psm, msg);
-		if (err == -1) {
-			logerr("%s: failed to send message to pid %d",
-			    __func__, psp->psp_pid);
-			ps_freeprocess(psp);
-		}
-		return 0;
-	}
-
-	if (psm->ps_cmd & PS_STOP && psp == NULL)
-		return 0;
-
-	switch (cmd) {
-#ifdef INET
-#ifdef ARP
-	case PS_BPF_ARP:	/* FALLTHROUGH */
-#endif
-	case PS_BPF_BOOTP:
-		return ps_bpf_cmd(ctx, psm, msg);
-#endif
-#ifdef INET
-	case PS_BOOTP:
-		return ps_inet_cmd(ctx, psm, msg);
-#endif
-#ifdef INET6
-#ifdef DHCP6
-	case PS_DHCP6:	/* FALLTHROUGH */
-#endif
-	case PS_ND:
-		return ps_inet_cmd(ctx, psm, msg);
-#endif
-	default:
-		break;
-	}
 
 	assert(msg->msg_iovlen == 0 || msg->msg_iovlen == 1);
 
@@ -530,17 +811,31 @@ ps_root_recvmsgcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 	errno = 0;
 
 	switch (psm->ps_cmd) {
+	case PS_BATCH:
+		if (batched) {
+			errno = EINVAL;
+			err = -1;
+			break;
+		}
+		err = ps_root_dobatch(ctx, data, len, buf, rdata, rlen);
+		*free_rdata = true;
+		break;
 	case PS_IOCTL:
 		err = ps_root_doioctl(psm->ps_flags, data, len);
 		if (err != -1) {
-			rdata = data;
-			rlen = len;
+			*rdata = data;
+			*rlen = len;
 		}
 		break;
 	case PS_SCRIPT:
 		err = ps_root_run_script(ctx, data, len);
 		break;
 	case PS_STOPPROCS:
+		if (batched) {
+			errno = EINVAL;
+			err = -1;
+			break;
+		}
 		ctx->options |= DHCPCD_EXITING;
 		TAILQ_FOREACH(psp, &ctx->ps_processes, next) {
 			if (psp != ctx->ps_root)
@@ -553,17 +848,17 @@ ps_root_recvmsgcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 			err = -1;
 			break;
 		}
-		err = unlink(data);
+		err = dhcp_unlink(ctx, data);
 		break;
 	case PS_READFILE:
 		if (!ps_root_validpath(ctx, psm->ps_cmd, data)) {
 			err = -1;
 			break;
 		}
-		err = readfile(data, buf, sizeof(buf));
+		err = dhcp_readfile(ctx, data, buf, PS_BUFLEN);
 		if (err != -1) {
-			rdata = buf;
-			rlen = (size_t)err;
+			*rdata = buf;
+			*rlen = (size_t)err;
 		}
 		break;
 	case PS_WRITEFILE:
@@ -571,10 +866,11 @@ ps_root_recvmsgcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 		    data, len);
 		break;
 	case PS_FILEMTIME:
-		err = filemtime(data, &mtime);
+		err = dhcp_filemtime(ctx, data, &mtime);
 		if (err != -1) {
-			rdata = &mtime;
-			rlen = sizeof(mtime);
+			memcpy(buf, &mtime, sizeof(mtime));
+			*rdata = buf;
+			*rlen = sizeof(mtime);
 		}
 		break;
 	case PS_LOGREOPEN:
@@ -584,15 +880,15 @@ ps_root_recvmsgcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 	case PS_AUTH_MONORDM:
 		err = ps_root_monordm(data, len);
 		if (err != -1) {
-			rdata = data;
-			rlen = len;
+			*rdata = data;
+			*rlen = len;
 		}
 		break;
 #endif
 #ifdef PRIVSEP_GETIFADDRS
 	case PS_GETIFADDRS:
-		err = ps_root_dogetifaddrs(&rdata, &rlen);
-		free_rdata = true;
+		err = ps_root_dogetifaddrs(ctx, data, len, rdata, rlen);
+		*free_rdata = true;
 		break;
 #endif
 #if defined(INET6) && (defined(__linux__) || defined(HAVE_PLEDGE))
@@ -609,10 +905,191 @@ ps_root_recvmsgcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 		break;
 #endif
 	default:
-		err = ps_root_os(ctx, psm, msg, &rdata, &rlen, &free_rdata);
+		err = ps_root_os(ctx, psm, msg, rdata, rlen, free_rdata);
+		break;
+	}
+
+	return err;
+}
+
+/* Run each command in a PS_BATCH message, replying with how many
+ * were run and a struct psr_result for each one. */
+static ssize_t
+ps_root_dobatch(struct dhcpcd_ctx *ctx, void *data, size_t len,
+    uint8_t *buf, void **rdata, size_t *rlen)
+{
+	struct psr_result *results;
+	const struct psr_result *tresults;
+	struct ps_msghdr psm;
+	struct iovec iov[1];
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 1 };
+	uint8_t *p = data;
+	size_t n = 0, i, elen;
+	void *erdata;
+	size_t erlen;
+	bool efree;
+	ssize_t err, ntxn;
+	/* Where each command's result is in the transaction, or -1. */
+	ssize_t txnidx[PS_BATCH_MAX];
+	size_t tcount;
+	bool txn;
+
+	results = calloc(PS_BATCH_MAX, sizeof(*results));
+	if (results == NULL)
+		return -1;
+
+	/* Kernel changes the batch makes are sent to the kernel as one
+	 * transaction as well, if it supports them. */
+	txn = if_txn_begin(ctx) == 0;
+
+	while (len != 0) {
+		if (n == PS_BATCH_MAX || len < sizeof(psm))
+			goto invalid;
+		memcpy(&psm, p, sizeof(psm));
+		elen = len - sizeof(psm);
+		if (psm.ps_controllen != 0 ||
+		    psm.ps_namelen > elen ||
+		    psm.ps_datalen > elen - psm.ps_namelen)
+			goto invalid;
+		elen = PS_BATCH_ALIGN(sizeof(psm) +
+		    psm.ps_namelen + psm.ps_datalen);
+		if (elen > len ||
+		    ps_unrollmsg(&msg, &psm, p + sizeof(psm),
+		    psm.ps_namelen + psm.ps_datalen) == -1)
+			goto invalid;
+
+		erdata = NULL;
+		erlen = 0;
+		efree = false;
+		tcount = txn ? if_txn_count(ctx) : 0;
+		err = ps_root_docmd(ctx, &psm, &msg, true, buf,
+		    &erdata, &erlen, &efree);
+		results[n].psr_result = err;
+		results[n].psr_errno = err == -1 ? errno : 0;
+		if (err != -1 && txn && if_txn_count(ctx) != tcount)
+			txnidx[n] = (ssize_t)tcount;
+		else
+			txnidx[n] = -1;
+		/* Commands in a batch don't return data. */
+		if (efree)
+			free(erdata);
+		n++;
+		p += elen;
+		len -= elen;
+	}
+
+	goto out;
+
+invalid:
+	/* The manager treats the commands we didn't run as failed. */
+	logerrx("%s: invalid command %zu", __func__, n);
+out:
+	if (txn) {
+		ntxn = if_txn_end(ctx, &tresults);
+		for (i = 0; i < n; i++) {
+			if (txnidx[i] == -1)
+				continue;
+			if (ntxn == -1) {
+				results[i].psr_result = -1;
+				results[i].psr_errno = errno;
+			} else if (txnidx[i] < ntxn)
+				results[i] = tresults[txnidx[i]];
+		}
+	}
+	*rdata = results;
+	*rlen = n * sizeof(*results);
+	return (ssize_t)n;
+}
+
+static ssize_t
+ps_root_recvmsgcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	uint16_t cmd;
+	struct ps_process *psp;
+	void *rdata = NULL;
+	size_t rlen = 0;
+	uint8_t buf[PS_BUFLEN];
+	ssize_t err;
+	bool free_rdata = false;
+
+	cmd = (uint16_t)(psm->ps_cmd & ~(PS_START | PS_STOP));
+	psp = ps_findprocess(ctx, &psm->ps_id);
+
+#ifdef PRIVSEP_DEBUG
+	logerrx("%s: IN cmd %x, psp %p", __func__, psm->ps_cmd, psp);
+#endif
+
+	/* ps_inet_listen waits to hear if the listener started.
+	 * A forked listener unwinds through here as well, without ps_root. */
+	if (psm->ps_cmd & PS_START && ps_inet_islistener(&psm->ps_id)) {
+		err = psp != NULL ? 0 : ps_inet_cmd(ctx, psm, msg);
+		if (ctx->ps_root == NULL)
+			return err;
+		return ps_root_writeerror(ctx, err == -1 ? -1 : 0, NULL, 0);
+	}
+
+	if (psp != NULL) {
+		if (psm->ps_cmd & PS_STOP) {
+			return ps_stopprocess(psp);
+		} else if (psm->ps_cmd & PS_START) {
+			/* Process has already started .... */
+			logdebugx("%s%sprocess %s already started on pid %d",
+			    psp->psp_ifname,
+			    psp->psp_ifname[0] != '\0' ? ": " : "",
+			    psp->psp_name, psp->psp_pid);
+			return 0;
+		}
+
+		err = ps_sendpsmmsg(ctx, psp->psp_fd, psm, msg);
+		if (err == -1) {
+			logerr("%s: failed to send message to pid %d",
+			    __func__, psp->psp_pid);
+			ps_freeprocess(psp);
+		}
+		return 0;
+	}
+
+#ifdef INET
+	/* One helper per protocol serves every interface. */
+	if (ctx->options & DHCPCD_SHARED_BPF) {
+		err = ps_bpf_sharedcmd(ctx, psm, msg);
+		if (err != -1 || errno != ENOTSUP)
+			return err;
+	}
+#endif
+
+	if (psm->ps_cmd & PS_STOP && psp == NULL)
+		return 0;
+
+	switch (cmd) {
+#ifdef INET
+#ifdef ARP
+	case PS_BPF_ARP:	/* FALLTHROUGH */
+#endif
+	case PS_BPF_BOOTP:
+		return ps_bpf_cmd(ctx, psm, msg);
+#endif
+	case PS_OPENFILE:
+		return ps_root_doopenfile(ctx, (mode_t)psm->ps_flags,
+		    msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+#ifdef INET
+	case PS_BOOTP:
+		return ps_inet_cmd(ctx, psm, msg);
+#endif
+#ifdef INET6
+#ifdef DHCP6
+	case PS_DHCP6:	/* FALLTHROUGH */
+#endif
+	case PS_ND:
+		return ps_inet_cmd(ctx, psm, msg);
+#endif
+	default:
 		break;
 	}
 
+	err = ps_root_docmd(ctx, psm, msg, false, buf,
+	    &rdata, &rlen, &free_rdata);
 	err = ps_root_writeerror(ctx, err, rlen != 0 ? rdata : 0, rlen);
 	if (free_rdata)
 		free(rdata);
@@ -755,6 +1232,12 @@ ps_root_signalcb(int sig, void *arg)
 		if (psp != NULL) {
 			ifname = psp->psp_ifname;
 			name = psp->psp_name;
+		} else if (script_reap(ctx, pid, status)) {
+			continue;
+		} else if (pid == ctx->hook_runner_pid) {
+			ctx->hook_runner_pid = 0;
+			ifname = "";
+			name = "hook runner";
 		} else {
 			/* Ignore logging the double fork */
 			if (ctx->options & DHCPCD_LAUNCHER)
@@ -778,8 +1261,10 @@ ps_root_signalcb(int sig, void *arg)
 			    ifname, ifname[0] != '\0' ? ": " : "",
 			    name, pid);
 
-		if (psp != NULL)
+		if (psp != NULL) {
+			ps_inet_reaped(psp);
 			ps_freeprocess(psp);
+		}
 	}
 
 	if (!(ctx->options & DHCPCD_EXITING))
@@ -826,6 +1311,12 @@ ps_root_dispatchcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 {
 	struct dhcpcd_ctx *ctx = arg;
 	ssize_t err;
+#ifdef PS_STATS
+	struct timespec started;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &started) == -1)
+		timespecclear(&started);
+#endif
 
 	switch(psm->ps_cmd) {
 #ifdef PLUGIN_DEV
@@ -840,6 +1331,10 @@ ps_root_dispatchcb(void *arg, struct ps_msghdr *psm, struct msghdr *msg)
 #endif
 			err = ps_inet_dispatch(ctx, psm, msg);
 	}
+#ifdef PS_STATS
+	ps_stats_add(ctx, PS_STAT_DISPATCH, psm->ps_cmd, err,
+	    0, psm->ps_datalen, &started);
+#endif
 	return err;
 }
 
@@ -853,6 +1348,17 @@ ps_root_dispatch(void *arg, unsigned short events)
 		logerr(__func__);
 }
 
+static void
+ps_root_dispatchring(void *arg, unsigned short events)
+{
+	struct dhcpcd_ctx *ctx = arg;
+
+	if (events != ELE_READ)
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	ps_ring_recv(ctx, ps_root_dispatchcb, ctx);
+}
+
 static void
 ps_root_log(void *arg, unsigned short events)
 {
@@ -892,6 +1398,10 @@ ps_root_start(struct dhcpcd_ctx *ctx)
 		return -1;
 #endif
 
+	/* Not fatal, helpers just use ps_data_fd. */
+	if (ps_ring_init(ctx) == -1 && errno != ENOTSUP)
+		logerr("%s: ps_ring_init", __func__);
+
 	psp = ctx->ps_root = ps_newprocess(ctx, &id);
 	strlcpy(psp->psp_name, "privileged proxy", sizeof(psp->psp_name));
 	pid = ps_startprocess(psp, ps_root_recvmsg, NULL,
@@ -917,6 +1427,10 @@ ps_root_start(struct dhcpcd_ctx *ctx)
 	if (eloop_event_add(ctx->eloop, ctx->ps_data_fd, ELE_READ,
 	    ps_root_dispatch, ctx) == -1)
 		return 1;
+	if (ctx->ps_rings != NULL &&
+	    eloop_event_add(ctx->eloop, ctx->ps_ring_bell[0], ELE_READ,
+	    ps_root_dispatchring, ctx) == -1)
+		return -1;
 
 	return pid;
 }
@@ -930,8 +1444,9 @@ ps_root_stop(struct dhcpcd_ctx *ctx)
 	    ctx->eloop == NULL)
 		return 0;
 
-	/* If we are the root process then remove the pidfile */
-	if (ctx->options & DHCPCD_PRIVSEPROOT) {
+	/* If we are the root process then remove the pidfile.
+	 * A shard has none, the coordinator does. */
+	if (ctx->options & DHCPCD_PRIVSEPROOT && ctx->pidfile[0] != '\0') {
 		if (unlink(ctx->pidfile) == -1)
 			logerr("%s: unlink: %s", __func__, ctx->pidfile);
 	}
@@ -940,6 +1455,19 @@ ps_root_stop(struct dhcpcd_ctx *ctx)
 	if (ctx->options & DHCPCD_FORKED)
 		return 0;
 
+	/* Run the callbacks for anything still in flight. */
+	if (ps_root_asyncwait(ctx) == -1)
+		logerr("%s: ps_root_asyncwait", __func__);
+	eloop_timeout_delete(ctx->eloop, ps_root_asyncdispatch, ctx);
+	ps_root_asyncdispatch(ctx);
+
+	if (ctx->ps_batch != NULL) {
+		free(ctx->ps_batch->psb_buf);
+		free(ctx->ps_batch->psb_results);
+		free(ctx->ps_batch);
+		ctx->ps_batch = NULL;
+	}
+
 	/* We cannot log the root process exited before we
 	 * log dhcpcd exits because the latter requires the former.
 	 * So we just log the intent to exit.
@@ -968,14 +1496,208 @@ ps_root_stopprocesses(struct dhcpcd_ctx *ctx)
 	return ps_root_readerror(ctx, NULL, 0);
 }
 
+bool
+ps_root_batching(const struct dhcpcd_ctx *ctx)
+{
+
+	return ctx->ps_batch != NULL && ctx->ps_batch->psb_active;
+}
+
+/* The index the next queued command will have in the results. */
+size_t
+ps_root_batch_count(const struct dhcpcd_ctx *ctx)
+{
+	const struct ps_batch *psb = ctx->ps_batch;
+
+	return psb->psb_nresults + psb->psb_count;
+}
+
+/* Until ps_root_batch_end, commands which support it are queued
+ * rather than sent and report success. */
+int
+ps_root_batch_begin(struct dhcpcd_ctx *ctx)
+{
+	struct ps_batch *psb = ctx->ps_batch;
+
+	if (!(IN_PRIVSEP_SE(ctx))) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (psb == NULL) {
+		psb = calloc(1, sizeof(*psb));
+		if (psb == NULL)
+			return -1;
+		psb->psb_buf = malloc(PS_BUFLEN);
+		if (psb->psb_buf == NULL) {
+			free(psb);
+			return -1;
+		}
+		ctx->ps_batch = psb;
+	} else if (psb->psb_active) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	psb->psb_active = true;
+	psb->psb_len = 0;
+	psb->psb_count = 0;
+	psb->psb_nresults = 0;
+	return 0;
+}
+
+static int
+ps_root_batchflush(struct dhcpcd_ctx *ctx)
+{
+	struct ps_batch *psb = ctx->ps_batch;
+	struct psr_result *results;
+	size_t need, i;
+	ssize_t n;
+	int error;
+
+	if (psb->psb_count == 0)
+		return 0;
+
+	need = psb->psb_nresults + psb->psb_count;
+	if (need > psb->psb_resultslen) {
+		results = reallocarray(psb->psb_results,
+		    need, sizeof(*results));
+		if (results == NULL)
+			return -1;
+		psb->psb_results = results;
+		psb->psb_resultslen = need;
+	}
+
+	results = psb->psb_results + psb->psb_nresults;
+	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd, PS_BATCH, 0,
+	    psb->psb_buf, psb->psb_len) == -1)
+		n = -1;
+	else
+		n = ps_root_readerror(ctx, results,
+		    psb->psb_count * sizeof(*results));
+	if (n == -1) {
+		error = errno;
+		n = 0;
+	} else
+		error = EINVAL;
+	for (i = (size_t)n; i < psb->psb_count; i++) {
+		results[i].psr_result = -1;
+		results[i].psr_errno = error;
+	}
+
+	psb->psb_nresults = need;
+	psb->psb_len = 0;
+	psb->psb_count = 0;
+	return 0;
+}
+
+/* Queue a command for ps_root_batch_end. */
 ssize_t
-ps_root_script(struct dhcpcd_ctx *ctx, const void *data, size_t len)
+ps_root_batchmsg(struct dhcpcd_ctx *ctx, uint16_t cmd, unsigned long flags,
+    const struct msghdr *msg)
 {
+	struct ps_batch *psb = ctx->ps_batch;
+	struct ps_msghdr psm = {
+		.ps_cmd = cmd,
+		.ps_flags = flags,
+	};
+	ssize_t len;
 
-	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd, PS_SCRIPT,
-	    0, data, len) == -1)
+	/* Nothing batched needs ancillary data. */
+	if (msg->msg_controllen != 0) {
+		errno = ENOTSUP;
 		return -1;
-	return ps_root_readerror(ctx, NULL, 0);
+	}
+
+	if (psb->psb_count == PS_BATCH_MAX && ps_root_batchflush(ctx) == -1)
+		return -1;
+	len = ps_rollmsg(psb->psb_buf + psb->psb_len,
+	    PS_BUFLEN - psb->psb_len, &psm, msg);
+	if (len == -1 && errno == ENOBUFS && psb->psb_count != 0) {
+		if (ps_root_batchflush(ctx) == -1)
+			return -1;
+		len = ps_rollmsg(psb->psb_buf, PS_BUFLEN, &psm, msg);
+	}
+	if (len == -1)
+		return -1;
+
+	/* Zero the padding so we don't leak the stack of old commands. */
+	memset(psb->psb_buf + psb->psb_len + len, 0,
+	    PS_BATCH_ALIGN((size_t)len) - (size_t)len);
+	psb->psb_len += PS_BATCH_ALIGN((size_t)len);
+	psb->psb_count++;
+	return 0;
+}
+
+/* Send what's queued and stop queueing.
+ * results points to a result for each command queued, in order,
+ * and is valid until the next ps_root_batch_begin. */
+ssize_t
+ps_root_batch_end(struct dhcpcd_ctx *ctx, const struct psr_result **results)
+{
+	struct ps_batch *psb = ctx->ps_batch;
+	int r;
+
+	if (psb == NULL || !psb->psb_active) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	psb->psb_active = false;
+	r = ps_root_batchflush(ctx);
+	*results = psb->psb_results;
+	return r == -1 ? -1 : (ssize_t)psb->psb_nresults;
+}
+
+/* Send a command to the privileged proxy without waiting for the reply.
+ * cb is called from the eloop once it arrives. Commands are still run
+ * in the order sent, and any synchronous command waits for the replies
+ * to those sent before it. */
+ssize_t
+ps_root_sendasync(struct dhcpcd_ctx *ctx, uint16_t cmd, unsigned long flags,
+    const void *data, size_t len, ps_root_async_cb *cb, void *arg)
+{
+	struct ps_async *psa;
+	int fd = ctx->ps_root->psp_fd;
+
+	psa = calloc(1, sizeof(*psa));
+	if (psa == NULL)
+		return -1;
+	if (ps_sendcmd(ctx, fd, cmd, flags, data, len) == -1) {
+		free(psa);
+		return -1;
+	}
+	psa->psa_cb = cb;
+	psa->psa_arg = arg;
+#ifdef PS_STATS
+	psa->psa_cmd = ctx->ps_stat_cmd;
+	psa->psa_len = ctx->ps_stat_len;
+	psa->psa_started = ctx->ps_stat_started;
+#endif
+
+	if (TAILQ_FIRST(&ctx->ps_async) == NULL &&
+	    eloop_event_add(ctx->eloop, fd, ELE_READ,
+	    ps_root_asynccb, ctx) == -1)
+		logerr("%s: eloop_event_add", __func__);
+	TAILQ_INSERT_TAIL(&ctx->ps_async, psa, psa_next);
+	return 0;
+}
+
+static void
+ps_root_scriptcb(__unused void *arg, ssize_t result,
+    __unused void *data, __unused size_t len)
+{
+
+	if (result == -1)
+		logerr("ps_root_script");
+}
+
+ssize_t
+ps_root_script(struct dhcpcd_ctx *ctx, const void *data, size_t len)
+{
+
+	return ps_root_sendasync(ctx, PS_SCRIPT, 0, data, len,
+	    ps_root_scriptcb, NULL);
 }
 
 ssize_t
@@ -996,9 +1718,124 @@ ps_root_ioctl(struct dhcpcd_ctx *ctx, ioctl_request_t req, void *data,
 	return ps_root_readerror(ctx, data, len);
 }
 
+static struct ps_file *
+ps_root_findfile(struct dhcpcd_ctx *ctx, const char *file)
+{
+	struct ps_file *psf;
+
+	TAILQ_FOREACH(psf, &ctx->ps_files, psf_next) {
+		if (strcmp(psf->psf_path, file) == 0)
+			return psf;
+	}
+	return NULL;
+}
+
+static void
+ps_root_closefile(struct dhcpcd_ctx *ctx, struct ps_file *psf)
+{
+
+	TAILQ_REMOVE(&ctx->ps_files, psf, psf_next);
+	close(psf->psf_fd);
+	free(psf->psf_path);
+	free(psf);
+}
+
+void
+ps_root_closefiles(struct dhcpcd_ctx *ctx)
+{
+	struct ps_file *psf;
+
+	while ((psf = TAILQ_FIRST(&ctx->ps_files)) != NULL)
+		ps_root_closefile(ctx, psf);
+}
+
+static int
+ps_root_openfile(struct dhcpcd_ctx *ctx, const char *file, mode_t mode)
+{
+	int fd;
+
+	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd, PS_OPENFILE, mode,
+	    file, strlen(file) + 1) == -1)
+		return -1;
+	if (ps_root_readerrorfd(ctx, NULL, 0, &fd) == -1) {
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	if (fd == -1)
+		errno = EBADF;
+	return fd;
+}
+
+/* The first write opens file, later ones reuse the descriptor. */
+static int
+ps_root_filefd(struct dhcpcd_ctx *ctx, const char *file, mode_t mode)
+{
+	struct ps_file *psf;
+	int fd;
+
+	psf = ps_root_findfile(ctx, file);
+	if (psf != NULL)
+		return psf->psf_fd;
+
+	fd = ps_root_openfile(ctx, file, mode);
+	if (fd == -1)
+		return -1;
+	psf = malloc(sizeof(*psf));
+	if (psf == NULL || (psf->psf_path = strdup(file)) == NULL) {
+		free(psf);
+		close(fd);
+		return -1;
+	}
+	psf->psf_fd = fd;
+	TAILQ_INSERT_TAIL(&ctx->ps_files, psf, psf_next);
+	return fd;
+}
+
+static ssize_t
+ps_root_readfilefd(struct dhcpcd_ctx *ctx, const char *file,
+    void *data, size_t len)
+{
+	struct ps_file *psf;
+	int fd;
+	ssize_t bytes;
+
+	psf = ps_root_findfile(ctx, file);
+	if (psf != NULL)
+		fd = psf->psf_fd;
+	else if ((fd = ps_root_openfile(ctx, file, 0)) == -1)
+		return -1;
+	bytes = pread(fd, data, len, 0);
+	if (psf == NULL)
+		close(fd);
+	if ((size_t)bytes == len) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	return bytes;
+}
+
+static ssize_t
+ps_root_writefilefd(struct dhcpcd_ctx *ctx, const char *file, mode_t mode,
+    const void *data, size_t len)
+{
+	int fd;
+
+	fd = ps_root_filefd(ctx, file, mode);
+	if (fd == -1 || ftruncate(fd, 0) == -1)
+		return -1;
+	return pwrite(fd, data, len, 0);
+}
+
 ssize_t
 ps_root_unlink(struct dhcpcd_ctx *ctx, const char *file)
 {
+	struct ps_file *psf;
+
+	/* Don't keep writing to a file that's gone. */
+	psf = ps_root_findfile(ctx, file);
+	if (psf != NULL)
+		ps_root_closefile(ctx, psf);
 
 	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd, PS_UNLINK, 0,
 	    file, strlen(file) + 1) == -1)
@@ -1010,37 +1847,99 @@ ssize_t
 ps_root_readfile(struct dhcpcd_ctx *ctx, const char *file,
     void *data, size_t len)
 {
+
+	if (ps_root_fdfile(ctx, file))
+		return ps_root_readfilefd(ctx, file, data, len);
 	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd, PS_READFILE, 0,
 	    file, strlen(file) + 1) == -1)
 		return -1;
 	return ps_root_readerror(ctx, data, len);
 }
 
-ssize_t
-ps_root_writefile(struct dhcpcd_ctx *ctx, const char *file, mode_t mode,
+static ssize_t
+ps_root_writefilebuf(char *buf, size_t buflen, const char *file,
     const void *data, size_t len)
 {
-	char buf[PS_BUFLEN];
 	size_t flen;
 
-	flen = strlcpy(buf, file, sizeof(buf));
+	flen = strlcpy(buf, file, buflen);
 	flen += 1;
-	if (flen > sizeof(buf) || flen + len > sizeof(buf)) {
+	if (flen > buflen || flen + len > buflen) {
 		errno = ENOBUFS;
 		return -1;
 	}
 	memcpy(buf + flen, data, len);
+	return (ssize_t)(flen + len);
+}
+
+ssize_t
+ps_root_writefile(struct dhcpcd_ctx *ctx, const char *file, mode_t mode,
+    const void *data, size_t len)
+{
+	char buf[PS_BUFLEN];
+	ssize_t blen;
 
+	if (ps_root_fdfile(ctx, file))
+		return ps_root_writefilefd(ctx, file, mode, data, len);
+	blen = ps_root_writefilebuf(buf, sizeof(buf), file, data, len);
+	if (blen == -1)
+		return -1;
 	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd, PS_WRITEFILE, mode,
-	    buf, flen + len) == -1)
+	    buf, (size_t)blen) == -1)
 		return -1;
 	return ps_root_readerror(ctx, NULL, 0);
 }
 
+static void
+ps_root_writefilecb(void *arg, ssize_t result,
+    __unused void *data, __unused size_t len)
+{
+	char *file = arg;
+
+	if (result == -1)
+		logerr("ps_root_writefile: %s", file ? file : "");
+	free(file);
+}
+
+/* For writes nothing is waiting on, such as leases. */
+ssize_t
+ps_root_writefileasync(struct dhcpcd_ctx *ctx, const char *file, mode_t mode,
+    const void *data, size_t len)
+{
+	char buf[PS_BUFLEN], *arg;
+	ssize_t blen;
+
+	/* With a descriptor the write is local, nothing to wait for. */
+	if (ps_root_fdfile(ctx, file))
+		return ps_root_writefilefd(ctx, file, mode, data, len) == -1 ?
+		    -1 : 0;
+	blen = ps_root_writefilebuf(buf, sizeof(buf), file, data, len);
+	if (blen == -1)
+		return -1;
+	/* Only used to log an error, so carry on without it. */
+	arg = strdup(file);
+	if (ps_root_sendasync(ctx, PS_WRITEFILE, mode, buf, (size_t)blen,
+	    ps_root_writefilecb, arg) == -1)
+	{
+		free(arg);
+		return -1;
+	}
+	return 0;
+}
+
 ssize_t
 ps_root_filemtime(struct dhcpcd_ctx *ctx, const char *file, time_t *time)
 {
+	struct ps_file *psf;
+	struct stat st;
 
+	psf = ps_root_findfile(ctx, file);
+	if (psf != NULL) {
+		if (fstat(psf->psf_fd, &st) == -1)
+			return -1;
+		*time = st.st_mtime;
+		return 0;
+	}
 	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd, PS_FILEMTIME, 0,
 	    file, strlen(file) + 1) == -1)
 		return -1;
@@ -1058,24 +1957,54 @@ ps_root_logreopen(struct dhcpcd_ctx *ctx)
 }
 
 #ifdef PRIVSEP_GETIFADDRS
+/* ifname and family, if not NULL and AF_UNSPEC, filter the result. */
 int
-ps_root_getifaddrs(struct dhcpcd_ctx *ctx, struct ifaddrs **ifahead)
+ps_root_getifaddrs(struct dhcpcd_ctx *ctx, const char *ifname, int family,
+    struct ifaddrs **ifahead)
 {
+	struct ps_ifaddrs_req req = { .pir_family = family };
 	struct ifaddrs *ifa;
 	void *buf = NULL;
 	char *bp, *sap;
 	socklen_t salen;
 	size_t len;
 	ssize_t err;
+	bool cache;
+
+	cache = ifname == NULL && family == AF_UNSPEC;
+	if (ifname != NULL)
+		strlcpy(req.pir_ifname, ifname, sizeof(req.pir_ifname));
+	else if (cache)
+		req.pir_gen = ctx->ps_ifaddrs_gen;
 
 	if (ps_sendcmd(ctx, ctx->ps_root->psp_fd,
-	    PS_GETIFADDRS, 0, NULL, 0) == -1)
+	    PS_GETIFADDRS, 0, &req, sizeof(req)) == -1)
 		return -1;
 	err = ps_root_mreaderror(ctx, &buf, &len);
 
 	if (err == -1)
 		return -1;
 
+	if (cache && err != 0) {
+		if (len == 0 && (unsigned int)err == ctx->ps_ifaddrs_gen) {
+			/* Unchanged since we last asked. */
+			len = ctx->ps_ifaddrs_len;
+			buf = malloc(len);
+			if (buf == NULL)
+				return -1;
+			memcpy(buf, ctx->ps_ifaddrs, len);
+		} else if (len != 0) {
+			free(ctx->ps_ifaddrs);
+			ctx->ps_ifaddrs = malloc(len);
+			if (ctx->ps_ifaddrs != NULL) {
+				memcpy(ctx->ps_ifaddrs, buf, len);
+				ctx->ps_ifaddrs_len = len;
+				ctx->ps_ifaddrs_gen = (unsigned int)err;
+			} else
+				ctx->ps_ifaddrs_gen = 0;
+		}
+	}
+
 	/* Should be impossible - lo0 will always exist. */
 	if (len == 0) {
 		*ifahead = NULL;
@@ -31,16 +31,76 @@
 
 #include "if.h"
 
-#if defined(PRIVSEP) && (defined(HAVE_CAPSICUM) || defined(__linux__))
+/* Linux reads links and addresses from netlink itself, see if-linux.c */
+#if defined(PRIVSEP) && defined(HAVE_CAPSICUM)
 #define PRIVSEP_GETIFADDRS
 #endif
 
+/* Commands queued by ps_root_batchmsg are sent in one message of up to
+ * PS_BATCH_MAX commands. The privileged proxy replies with a result for
+ * each one, so N commands cost one round trip rather than N. */
+#define	PS_BATCH_MAX		256
+#define	PS_BATCH_ALIGN(n)	(((n) + sizeof(size_t) - 1) & \
+				 ~(sizeof(size_t) - 1))
+
+struct psr_result {
+	ssize_t psr_result;
+	int psr_errno;
+	char psr_pad[sizeof(ssize_t) - sizeof(int)];
+};
+
+struct ps_batch {
+	bool psb_active;
+	uint8_t *psb_buf;		/* commands not yet sent */
+	size_t psb_len;
+	size_t psb_count;
+	struct psr_result *psb_results;	/* of commands sent */
+	size_t psb_nresults;
+	size_t psb_resultslen;
+};
+
+/* Called from the eloop with errno set when the privileged proxy replies
+ * to a command sent by ps_root_sendasync. data is freed on return. */
+typedef void ps_root_async_cb(void *, ssize_t, void *, size_t);
+
+struct ps_async {
+	TAILQ_ENTRY(ps_async) psa_next;
+	ps_root_async_cb *psa_cb;
+	void *psa_arg;
+	ssize_t psa_result;
+	int psa_errno;
+	void *psa_data;
+	size_t psa_datalen;
+#ifdef PS_STATS
+	uint16_t psa_cmd;
+	size_t psa_len;
+	struct timespec psa_started;
+#endif
+};
+TAILQ_HEAD(ps_async_head, ps_async);
+
+/* A file under DBDIR the privileged proxy opened for us. */
+struct ps_file {
+	TAILQ_ENTRY(ps_file) psf_next;
+	char *psf_path;
+	int psf_fd;
+};
+TAILQ_HEAD(ps_file_head, ps_file);
+
 pid_t ps_root_start(struct dhcpcd_ctx *ctx);
 int ps_root_stop(struct dhcpcd_ctx *ctx);
 void ps_root_signalcb(int, void *);
 
 ssize_t ps_root_readerror(struct dhcpcd_ctx *, void *, size_t);
 ssize_t ps_root_mreaderror(struct dhcpcd_ctx *, void **, size_t *);
+int ps_root_batch_begin(struct dhcpcd_ctx *);
+ssize_t ps_root_batch_end(struct dhcpcd_ctx *, const struct psr_result **);
+bool ps_root_batching(const struct dhcpcd_ctx *);
+size_t ps_root_batch_count(const struct dhcpcd_ctx *);
+ssize_t ps_root_batchmsg(struct dhcpcd_ctx *, uint16_t, unsigned long,
+    const struct msghdr *);
+ssize_t ps_root_sendasync(struct dhcpcd_ctx *, uint16_t, unsigned long,
+    const void *, size_t, ps_root_async_cb *, void *);
 ssize_t ps_root_ioctl(struct dhcpcd_ctx *, ioctl_request_t, void *, size_t);
 ssize_t ps_root_ip6forwarding(struct dhcpcd_ctx *, const char *);
 ssize_t ps_root_unlink(struct dhcpcd_ctx *, const char *);
@@ -48,12 +108,16 @@ ssize_t ps_root_filemtime(struct dhcpcd_ctx *, const char *, time_t *);
 ssize_t ps_root_readfile(struct dhcpcd_ctx *, const char *, void *, size_t);
 ssize_t ps_root_writefile(struct dhcpcd_ctx *, const char *, mode_t,
     const void *, size_t);
+ssize_t ps_root_writefileasync(struct dhcpcd_ctx *, const char *, mode_t,
+    const void *, size_t);
+void ps_root_closefiles(struct dhcpcd_ctx *);
 ssize_t ps_root_logreopen(struct dhcpcd_ctx *);
 ssize_t ps_root_script(struct dhcpcd_ctx *, const void *, size_t);
 ssize_t ps_root_stopprocesses(struct dhcpcd_ctx *);
 int ps_root_getauthrdm(struct dhcpcd_ctx *, uint64_t *);
 #ifdef PRIVSEP_GETIFADDRS
-int ps_root_getifaddrs(struct dhcpcd_ctx *, struct ifaddrs **);
+int ps_root_getifaddrs(struct dhcpcd_ctx *, const char *, int,
+    struct ifaddrs **);
 #endif
 
 ssize_t ps_root_os(struct dhcpcd_ctx *, struct ps_msghdr *, struct msghdr *,
@@ -40,6 +40,7 @@
  * this in a script or something.
  */
 
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -72,6 +73,7 @@
 #include "ipv6nd.h"
 #include "logerr.h"
 #include "privsep.h"
+#include "script.h"
 
 #ifdef HAVE_CAPSICUM
 #include <sys/capsicum.h>
@@ -91,6 +93,36 @@
 #define CALC_CMSG_PADLEN(has_cmsg, pos) \
     ((has_cmsg) ? (socklen_t)(CMSG_ALIGN((pos)) - (pos)) : 0)
 
+/*
+ * Helpers which only forward packets to the manager can do so over a
+ * single producer, single consumer ring in memory shared before forking.
+ * The manager sleeps on a doorbell which a helper only rings when the
+ * manager has said it is waiting, so a burst of packets costs one wakeup.
+ * If the ring is full the helper falls back to its socket.
+ */
+#if defined(MAP_ANON) && defined(__ATOMIC_SEQ_CST)
+#define PRIVSEP_RING
+#endif
+
+#define	PS_RING_MAX		16	/* must fit in ctx->ps_ring_used */
+#define	PS_RING_MANAGER		1	/* rings the manager hands out */
+#define	PS_RING_SIZE		(128 * 1024)	/* must be a power of 2 */
+#define	PS_RING_WRAP		UINT32_MAX
+#define	PS_RING_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+struct ps_ringhdr {
+	uint32_t psr_len;
+	uint32_t psr_pad;
+};
+
+struct ps_ring {
+	uint32_t psr_head;	/* written by the helper */
+	uint32_t psr_tail;	/* written by the manager */
+	uint32_t psr_wait;	/* the manager wants the doorbell rung */
+	uint32_t psr_pad;
+	uint8_t psr_data[PS_RING_SIZE];
+};
+
 int
 ps_init(struct dhcpcd_ctx *ctx)
 {
@@ -122,7 +154,7 @@ ps_init(struct dhcpcd_ctx *ctx)
 }
 
 static int
-ps_dropprivs(struct dhcpcd_ctx *ctx)
+ps_dropprivs(struct dhcpcd_ctx *ctx, rlim_t fsize)
 {
 	struct passwd *pw = ctx->ps_user;
 
@@ -168,14 +200,17 @@ ps_dropprivs(struct dhcpcd_ctx *ctx)
 #endif
 
 #define DHC_NOCHKIO	(DHCPCD_STARTED | DHCPCD_DAEMONISE)
-	/* Prohibit writing to files.
+	/* Prohibit writing to files, other than those root opened for
+	 * the manager which are no bigger than a message to root.
 	 * Obviously this won't work if we are using a logfile
 	 * or redirecting stderr to a file. */
 	if ((ctx->options & DHC_NOCHKIO) == DHC_NOCHKIO ||
 	    (ctx->logfile == NULL &&
 	    (!ctx->stderr_valid || isatty(STDERR_FILENO) == 1)))
 	{
-		if (setrlimit(RLIMIT_FSIZE, &rzero) == -1)
+		struct rlimit rfsize = { .rlim_cur = fsize, .rlim_max = fsize };
+
+		if (setrlimit(RLIMIT_FSIZE, &rfsize) == -1)
 			logerr("setrlimit RLIMIT_FSIZE");
 	}
 
@@ -319,6 +354,275 @@ ps_rights_limit_stdio(struct dhcpcd_ctx *ctx)
 }
 #endif
 
+int
+ps_ring_init(struct dhcpcd_ctx *ctx)
+{
+#ifdef PRIVSEP_RING
+	struct ps_ring *rings;
+	size_t i;
+
+	rings = mmap(NULL, sizeof(*rings) * PS_RING_MAX,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (rings == MAP_FAILED)
+		return -1;
+	if (xsocketpair(AF_UNIX, SOCK_STREAM | SOCK_CXNB, 0,
+	    ctx->ps_ring_bell) == -1)
+	{
+		munmap(rings, sizeof(*rings) * PS_RING_MAX);
+		return -1;
+	}
+#ifdef PRIVSEP_RIGHTS
+	if (ps_rights_limit_fdpair(ctx->ps_ring_bell) == -1) {
+		ps_ring_free(ctx);
+		return -1;
+	}
+#endif
+
+	/* Nothing has been sent yet, so we are waiting on every ring. */
+	for (i = 0; i < PS_RING_MAX; i++)
+		rings[i].psr_wait = 1;
+	ctx->ps_rings = rings;
+	/* The privileged proxy hands out the rings we don't. */
+	ctx->ps_ring_used = ~((1U << PS_RING_MANAGER) - 1);
+	return 0;
+#else
+	UNUSED(ctx);
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+void
+ps_ring_free(struct dhcpcd_ctx *ctx)
+{
+
+#ifdef PRIVSEP_RING
+	if (ctx->ps_rings != NULL) {
+		munmap(ctx->ps_rings, sizeof(*ctx->ps_rings) * PS_RING_MAX);
+		ctx->ps_rings = NULL;
+		ctx->ps_ring = NULL;
+	}
+#endif
+	if (ctx->ps_ring_bell[0] != -1) {
+		eloop_event_delete(ctx->eloop, ctx->ps_ring_bell[0]);
+		close(ctx->ps_ring_bell[0]);
+		ctx->ps_ring_bell[0] = -1;
+	}
+	if (ctx->ps_ring_bell[1] != -1) {
+		close(ctx->ps_ring_bell[1]);
+		ctx->ps_ring_bell[1] = -1;
+	}
+}
+
+#ifdef PRIVSEP_RING
+static int
+ps_ring_claim(struct dhcpcd_ctx *ctx)
+{
+	int i;
+
+	if (ctx->ps_rings == NULL)
+		return -1;
+	for (i = 0; i < PS_RING_MAX; i++) {
+		if (!(ctx->ps_ring_used & (1U << i))) {
+			ctx->ps_ring_used |= 1U << i;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void
+ps_ring_release(struct dhcpcd_ctx *ctx, int ring)
+{
+
+	if (ring != -1)
+		ctx->ps_ring_used &= ~(1U << ring);
+}
+
+static void
+ps_ring_forked(struct ps_process *psp, int wfd)
+{
+	struct dhcpcd_ctx *ctx = psp->psp_ctx;
+
+	if (ctx->ps_rings == NULL)
+		return;
+
+	/* Only the manager reads the doorbell.
+	 * If it's listening to it already then eloop_clear closes it. */
+	if (psp == ctx->ps_root)
+		close(ctx->ps_ring_bell[0]);
+	ctx->ps_ring_bell[0] = -1;
+
+	if (psp == ctx->ps_root) {
+		/* Keep the rings to hand out to our helpers. */
+		ctx->ps_ring_used = (1U << PS_RING_MANAGER) - 1;
+		return;
+	}
+	if (psp->psp_ring == -1) {
+		ps_ring_free(ctx);
+		return;
+	}
+	ctx->ps_ring = &ctx->ps_rings[psp->psp_ring];
+	ctx->ps_ring_wfd = wfd;
+}
+
+static ssize_t
+ps_ring_write(struct dhcpcd_ctx *ctx, const struct iovec *iov, int iovcnt)
+{
+	struct ps_ring *ring = ctx->ps_ring;
+	struct ps_ringhdr rh = { .psr_len = 0 };
+	uint32_t head, tail;
+	size_t len = 0, flen, off, pad;
+	uint8_t *p;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	flen = PS_RING_ALIGN(sizeof(rh) + len);
+	if (flen > PS_RING_SIZE / 2) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/* We are the only writer of head. */
+	head = ring->psr_head;
+	tail = __atomic_load_n(&ring->psr_tail, __ATOMIC_ACQUIRE);
+	off = head & (PS_RING_SIZE - 1);
+	/* Frames never wrap, so skip the tail end of the ring if needed. */
+	pad = off + flen > PS_RING_SIZE ? PS_RING_SIZE - off : 0;
+	if ((uint32_t)(head - tail) + pad + flen > PS_RING_SIZE) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (pad != 0) {
+		rh.psr_len = PS_RING_WRAP;
+		memcpy(ring->psr_data + off, &rh, sizeof(rh));
+		head += (uint32_t)pad;
+		off = 0;
+	}
+
+	rh.psr_len = (uint32_t)len;
+	p = ring->psr_data + off;
+	memcpy(p, &rh, sizeof(rh));
+	p += sizeof(rh);
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	__atomic_store_n(&ring->psr_head, head + (uint32_t)flen,
+	    __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&ring->psr_wait, 0, __ATOMIC_SEQ_CST)) {
+		uint8_t bell = 0;
+
+		/* If the doorbell is full the manager is awake anyway. */
+		if (write(ctx->ps_ring_bell[1], &bell, sizeof(bell)) == -1 &&
+		    errno != EAGAIN)
+			logerr("%s: write", __func__);
+	}
+	return (ssize_t)len;
+}
+#endif
+
+ssize_t
+ps_ring_recv(struct dhcpcd_ctx *ctx,
+    ssize_t (*callback)(void *, struct ps_msghdr *, struct msghdr *),
+    void *cbctx)
+{
+#ifdef PRIVSEP_RING
+	struct ps_msg psm;
+	struct ps_ringhdr rh;
+	struct iovec iov[1];
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 1 };
+	struct ps_ring *ring;
+	uint8_t bell[64];
+	uint32_t head, tail;
+	size_t i, off, flen, dlen;
+	ssize_t n = 0;
+	bool again;
+
+	if (ctx->ps_rings == NULL)
+		return 0;
+
+	while (read(ctx->ps_ring_bell[0], bell, sizeof(bell)) > 0)
+		;
+
+drain:
+	for (i = 0; i < PS_RING_MAX; i++) {
+		ring = &ctx->ps_rings[i];
+		/* We are the only writer of tail. */
+		tail = ring->psr_tail;
+		for (;;) {
+			head = __atomic_load_n(&ring->psr_head,
+			    __ATOMIC_ACQUIRE);
+			if (head == tail)
+				break;
+			if ((uint32_t)(head - tail) > PS_RING_SIZE)
+				goto corrupt;
+
+			/* Copy out of the ring before looking at the frame
+			 * as the helper could change it under us. */
+			off = tail & (PS_RING_SIZE - 1);
+			memcpy(&rh, ring->psr_data + off, sizeof(rh));
+			if (rh.psr_len == PS_RING_WRAP) {
+				tail += (uint32_t)(PS_RING_SIZE - off);
+				continue;
+			}
+			flen = PS_RING_ALIGN(sizeof(rh) + rh.psr_len);
+			if (rh.psr_len < sizeof(psm.psm_hdr) ||
+			    rh.psr_len > sizeof(psm) ||
+			    off + flen > PS_RING_SIZE ||
+			    flen > (uint32_t)(head - tail))
+				goto corrupt;
+			memcpy(&psm, ring->psr_data + off + sizeof(rh),
+			    rh.psr_len);
+			tail += (uint32_t)flen;
+			__atomic_store_n(&ring->psr_tail, tail,
+			    __ATOMIC_RELEASE);
+
+			n++;
+			ctx->stats.ps_msgs_recv++;
+			ctx->stats.ps_ring_recv++;
+			TRACE_EVENT(ctx, TRACE_PS_RECV, NULL,
+			    psm.psm_hdr.ps_cmd);
+			dlen = rh.psr_len - sizeof(psm.psm_hdr);
+			if (ps_unrollmsg(&msg, &psm.psm_hdr,
+			    psm.psm_data, dlen) == -1 ||
+			    callback(cbctx, &psm.psm_hdr, &msg) == -1)
+				logerr(__func__);
+		}
+		__atomic_store_n(&ring->psr_tail, tail, __ATOMIC_RELEASE);
+		continue;
+
+corrupt:
+		logerrx("%s: ring %zu is corrupt, discarding it",
+		    __func__, i);
+		__atomic_store_n(&ring->psr_tail, head, __ATOMIC_RELEASE);
+	}
+
+	/* Ask to be woken, then check nothing arrived while asking. */
+	again = false;
+	for (i = 0; i < PS_RING_MAX; i++) {
+		ring = &ctx->ps_rings[i];
+		__atomic_store_n(&ring->psr_wait, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->psr_head, __ATOMIC_SEQ_CST) !=
+		    ring->psr_tail)
+			again = true;
+	}
+	if (again)
+		goto drain;
+	return n;
+#else
+	UNUSED(ctx);
+	UNUSED(callback);
+	UNUSED(cbctx);
+	return 0;
+#endif
+}
+
 #ifdef HAVE_CAPSICUM
 static void
 ps_processhangup(void *arg, unsigned short events)
@@ -352,6 +656,12 @@ ps_startprocess(struct ps_process *psp,
 	struct dhcpcd_ctx *ctx = psp->psp_ctx;
 	int fd[2];
 	pid_t pid;
+#ifdef PRIVSEP_RING
+	bool inroot = ctx->options & DHCPCD_PRIVSEPROOT;
+
+	if (flags & PSF_RING)
+		psp->psp_ring = ps_ring_claim(ctx);
+#endif
 
 	if (xsocketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CXNB, 0, fd) == -1) {
 		logerr("%s: socketpair", __func__);
@@ -385,6 +695,16 @@ ps_startprocess(struct ps_process *psp,
 		psp->psp_pid = getpid();
 		psp->psp_fd = fd[1];
 		close(fd[0]);
+		rndpool_forked(ctx);
+		/* Our parent builds the routes it deferred. */
+		ctx->rt_pending = ctx->rt_pendfull = 0;
+#ifdef TRACE
+		trace_forked(ctx);
+#endif
+#ifdef PRIVSEP_RING
+		/* Helpers of the privileged proxy send on ps_data_fd. */
+		ps_ring_forked(psp, inroot ? ctx->ps_data_fd : psp->psp_fd);
+#endif
 		break;
 	default:
 		psp->psp_pid = pid;
@@ -431,6 +751,8 @@ ps_startprocess(struct ps_process *psp,
 		ctx->fork_fd = -1;
 	}
 
+	script_forked(ctx);
+
 	/* This process has no need of the blocking inner eloop. */
 	if (!(flags & PSF_ELOOP)) {
 		eloop_free(ctx->ps_eloop);
@@ -457,8 +779,6 @@ ps_startprocess(struct ps_process *psp,
 #endif
 	}
 
-	if (ctx->ps_inet != psp)
-		ctx->ps_inet = NULL;
 	if (ctx->ps_ctl != psp)
 		ctx->ps_ctl = NULL;
 
@@ -480,7 +800,7 @@ ps_startprocess(struct ps_process *psp,
 		goto errexit;
 
 	if (flags & PSF_DROPPRIVS)
-		ps_dropprivs(ctx);
+		ps_dropprivs(ctx, 0);
 
 	psp->psp_started = true;
 	return 0;
@@ -542,6 +862,51 @@ ps_stopprocess(struct ps_process *psp)
 	return err;
 }
 
+static void
+ps_signal_deferred(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	unsigned int sigs = ctx->ps_sigdeferred;
+	int sig;
+
+	ctx->ps_sigdeferred = 0;
+	for (sig = 1; sigs != 0; sig++) {
+		if (!(sigs & (1U << sig)))
+			continue;
+		sigs &= ~(1U << sig);
+		dhcpcd_signal_cb(sig, ctx);
+	}
+}
+
+/*
+ * The inner eloop runs while we wait for a reply from another process.
+ * Acting on a signal there could send more commands, such as when
+ * stopping interfaces, which would then read the reply we are waiting
+ * for. So only reap children and leave the rest to our own eloop.
+ */
+static void
+ps_signal_cb(int sig, void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+
+	if (sig == SIGCHLD ||
+	    (unsigned int)sig >= sizeof(ctx->ps_sigdeferred) * NBBY)
+	{
+		dhcpcd_signal_cb(sig, ctx);
+		return;
+	}
+
+	if (ctx->ps_sigdeferred == 0 &&
+	    eloop_timeout_add_sec(ctx->eloop, 0,
+	    ps_signal_deferred, ctx) == -1)
+	{
+		logerr("%s: eloop_timeout_add_sec", __func__);
+		dhcpcd_signal_cb(sig, ctx);
+		return;
+	}
+	ctx->ps_sigdeferred |= 1U << sig;
+}
+
 int
 ps_start(struct dhcpcd_ctx *ctx)
 {
@@ -554,7 +919,7 @@ ps_start(struct dhcpcd_ctx *ctx)
 		return -1;
 	eloop_signal_set_cb(ctx->ps_eloop,
 	    dhcpcd_signals, dhcpcd_signals_len,
-	    dhcpcd_signal_cb, ctx);
+	    ps_signal_cb, ctx);
 
 	switch (pid = ps_root_start(ctx)) {
 	case -1:
@@ -566,21 +931,8 @@ ps_start(struct dhcpcd_ctx *ctx)
 		logdebugx("spawned privileged proxy on PID %d", pid);
 	}
 
-	/* No point in spawning the generic network listener if we're
-	 * not going to use it. */
-	if (!ps_inet_canstart(ctx))
-		goto started_net;
-
-	switch (pid = ps_inet_start(ctx)) {
-	case -1:
-		return -1;
-	case 0:
-		return 0;
-	default:
-		logdebugx("spawned network proxy on PID %d", pid);
-	}
-
-started_net:
+	/* The network proxies are spawned by the privileged proxy
+	 * when first needed, see ps_inet_listen. */
 	if (!(ctx->options & DHCPCD_TEST)) {
 		switch (pid = ps_ctl_start(ctx)) {
 		case -1:
@@ -637,7 +989,7 @@ ps_managersandbox(struct dhcpcd_ctx *ctx, const char *_pledge)
 
 	forked = ctx->options & DHCPCD_FORKED;
 	ctx->options &= ~DHCPCD_FORKED;
-	dropped = ps_dropprivs(ctx);
+	dropped = ps_dropprivs(ctx, PS_BUFLEN);
 	if (forked)
 		ctx->options |= DHCPCD_FORKED;
 
@@ -668,8 +1020,9 @@ ps_managersandbox(struct dhcpcd_ctx *ctx, const char *_pledge)
 	}
 #endif
 
+	/* recvfd for files under DBDIR, see ps_root_openfile. */
 	if (_pledge == NULL)
-		_pledge = "stdio";
+		_pledge = "stdio recvfd";
 	if (ps_entersandbox(_pledge, &sandbox) == -1) {
 		if (errno == ENOSYS) {
 			if (sandbox != NULL)
@@ -701,12 +1054,6 @@ ps_stop(struct dhcpcd_ctx *ctx)
 			ret = r;
 	}
 
-	if (ctx->ps_inet != NULL) {
-		r = ps_inet_stop(ctx);
-		if (r != 0)
-			ret = r;
-	}
-
 	if (ctx->ps_root != NULL) {
 		if (ps_root_stopprocesses(ctx) == -1)
 			ret = -1;
@@ -781,6 +1128,9 @@ ps_freeprocess(struct ps_process *psp)
 		eloop_event_delete(ctx->eloop, psp->psp_work_fd);
 		close(psp->psp_work_fd);
 	}
+#ifdef PRIVSEP_RING
+	ps_ring_release(ctx, psp->psp_ring);
+#endif
 #ifdef HAVE_CAPSICUM
 	if (psp->psp_pfd != -1) {
 		eloop_event_delete(ctx->eloop, psp->psp_pfd);
@@ -791,11 +1141,11 @@ ps_freeprocess(struct ps_process *psp)
 #endif
 	if (ctx->ps_root == psp)
 		ctx->ps_root = NULL;
-	if (ctx->ps_inet == psp)
-		ctx->ps_inet = NULL;
 	if (ctx->ps_ctl == psp)
 		ctx->ps_ctl = NULL;
 #ifdef INET
+	if (psp->psp_bpf_ifs != NULL)
+		ps_bpf_freeshared(psp);
 	if (psp->psp_bpf != NULL)
 		bpf_close(psp->psp_bpf);
 #endif
@@ -872,6 +1222,213 @@ ps_unrollmsg(struct msghdr *msg, struct ps_msghdr *psm,
 	return 0;
 }
 
+/* The reverse of ps_unrollmsg, writing psm and msg to buf as they
+ * would be sent by ps_sendpsmmsg. Returns the length written. */
+ssize_t
+ps_rollmsg(void *buf, size_t len, struct ps_msghdr *psm,
+    const struct msghdr *msg)
+{
+	uint8_t *p = buf;
+	socklen_t cmsg_padlen =
+	    CALC_CMSG_PADLEN(msg->msg_controllen, msg->msg_namelen);
+	size_t i, need;
+
+	psm->ps_namelen = msg->msg_namelen;
+	psm->ps_controllen = (socklen_t)msg->msg_controllen;
+	psm->ps_datalen = 0;
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++)
+		psm->ps_datalen += msg->msg_iov[i].iov_len;
+
+	need = sizeof(*psm) + psm->ps_namelen + cmsg_padlen +
+	    psm->ps_controllen + psm->ps_datalen;
+	if (need > len) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	memcpy(p, psm, sizeof(*psm));
+	p += sizeof(*psm);
+	if (psm->ps_namelen != 0) {
+		memcpy(p, msg->msg_name, psm->ps_namelen);
+		p += psm->ps_namelen;
+	}
+	if (psm->ps_controllen != 0) {
+		memset(p, 0, cmsg_padlen);
+		p += cmsg_padlen;
+		memcpy(p, msg->msg_control, psm->ps_controllen);
+		p += psm->ps_controllen;
+	}
+	for (i = 0; i < (size_t)msg->msg_iovlen; i++) {
+		if (msg->msg_iov[i].iov_len == 0)
+			continue;
+		memcpy(p, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		p += msg->msg_iov[i].iov_len;
+	}
+	return (ssize_t)need;
+}
+
+#ifdef PS_STATS
+static const char *
+ps_stat_cmdname(uint16_t cmd)
+{
+
+	switch (cmd) {
+	case PS_BOOTP:		return "bootp";
+	case PS_ND:		return "nd";
+	case PS_DHCP6:		return "dhcp6";
+	case PS_BPF_BOOTP:	return "bpf_bootp";
+	case PS_BPF_ARP:	return "bpf_arp";
+	case PS_IOCTL:		return "ioctl";
+	case PS_ROUTE:		return "route";
+	case PS_SCRIPT:		return "script";
+	case PS_UNLINK:		return "unlink";
+	case PS_READFILE:	return "readfile";
+	case PS_WRITEFILE:	return "writefile";
+	case PS_FILEMTIME:	return "filemtime";
+	case PS_OPENFILE:	return "openfile";
+	case PS_AUTH_MONORDM:	return "auth_monordm";
+	case PS_LOGREOPEN:	return "logreopen";
+	case PS_STOPPROCS:	return "stopprocs";
+	case PS_BATCH:		return "batch";
+	case PS_IOCTLLINK:	return "ioctllink";
+	case PS_IOCTL6:		return "ioctl6";
+	case PS_IOCTLINDIRECT:	return "ioctlindirect";
+	case PS_IP6FORWARDING:	return "ip6forwarding";
+	case PS_GETIFADDRS:	return "getifaddrs";
+	case PS_IFIGNOREGRP:	return "ifignoregrp";
+	case PS_SYSCTL:		return "sysctl";
+	case PS_DEV_LISTENING:	return "dev_listening";
+	case PS_DEV_INITTED:	return "dev_initted";
+	case PS_DEV_IFCMD:	return "dev_ifcmd";
+	default:		return NULL;
+	}
+}
+
+/* Account for one command or message. Statistics are best effort,
+ * so errors are ignored and errno is preserved for the caller. */
+void
+ps_stats_add(struct dhcpcd_ctx *ctx, int type, uint16_t cmd, ssize_t result,
+    size_t bytes_out, size_t bytes_in, const struct timespec *started)
+{
+	struct ps_stat *st;
+	struct timespec now;
+	unsigned long long secs, usec;
+	unsigned int nsecs;
+	size_t bucket;
+	int serrno = errno;
+
+	if (!timespecisset(started) ||
+	    clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		goto out;
+	secs = eloop_timespec_diff(&now, started, &nsecs);
+	usec = secs * 1000000ULL + nsecs / 1000;
+
+	TAILQ_FOREACH(st, &ctx->ps_stats, next) {
+		if (st->type == type && st->cmd == cmd)
+			break;
+	}
+	if (st == NULL) {
+		st = calloc(1, sizeof(*st));
+		if (st == NULL)
+			goto out;
+		st->type = type;
+		st->cmd = cmd;
+		TAILQ_INSERT_TAIL(&ctx->ps_stats, st, next);
+	}
+
+	for (bucket = 0; usec >> bucket != 0 &&
+	    bucket < PS_STATS_NHIST - 1; bucket++)
+		;
+	st->count++;
+	if (result == -1)
+		st->errors++;
+	st->bytes_out += bytes_out;
+	st->bytes_in += bytes_in;
+	st->total_usec += usec;
+	if (usec > st->max_usec)
+		st->max_usec = usec;
+	st->hist[bucket]++;
+
+out:
+	errno = serrno;
+}
+
+void
+ps_stats_free(struct dhcpcd_ctx *ctx)
+{
+	struct ps_stat *st;
+
+	while ((st = TAILQ_FIRST(&ctx->ps_stats)) != NULL) {
+		TAILQ_REMOVE(&ctx->ps_stats, st, next);
+		free(st);
+	}
+}
+
+/* Write the statistics to buf as NUL separated key=value pairs,
+ * like eloop_stats_format. */
+ssize_t
+ps_stats_format(const struct dhcpcd_ctx *ctx, char *buf, size_t len)
+{
+	const struct ps_stat *st;
+	const char *name;
+	size_t i, j, idx = 0, pos = 0;
+	int n;
+
+#define	STATPF(...)							      \
+	do {								      \
+		n = snprintf(pos < len ? buf + pos : NULL,		      \
+		    pos < len ? len - pos : 0, __VA_ARGS__);		      \
+		if (n == -1)						      \
+			return -1;					      \
+		pos += (size_t)n;					      \
+	} while (0 /* CONSTCOND */)
+
+	TAILQ_FOREACH(st, &ctx->ps_stats, next) {
+		STATPF("privsep_stat%zu_type=%s", idx,
+		    st->type == PS_STAT_ROOT ? "root" : "dispatch");
+		pos++;
+		name = ps_stat_cmdname(st->cmd);
+		if (name != NULL)
+			STATPF("privsep_stat%zu_cmd=%s", idx, name);
+		else
+			STATPF("privsep_stat%zu_cmd=0x%04x", idx, st->cmd);
+		pos++;
+		STATPF("privsep_stat%zu_count=%llu", idx, st->count);
+		pos++;
+		STATPF("privsep_stat%zu_errors=%llu", idx, st->errors);
+		pos++;
+		STATPF("privsep_stat%zu_bytes_out=%llu", idx, st->bytes_out);
+		pos++;
+		STATPF("privsep_stat%zu_bytes_in=%llu", idx, st->bytes_in);
+		pos++;
+		STATPF("privsep_stat%zu_total_usec=%llu", idx,
+		    st->total_usec);
+		pos++;
+		STATPF("privsep_stat%zu_max_usec=%llu", idx, st->max_usec);
+		pos++;
+		/* Trailing empty buckets are omitted. */
+		for (i = PS_STATS_NHIST; i > 1; i--) {
+			if (st->hist[i - 1] != 0)
+				break;
+		}
+		STATPF("privsep_stat%zu_histogram=%llu", idx, st->hist[0]);
+		for (j = 1; j < i; j++)
+			STATPF(" %llu", st->hist[j]);
+		pos++;
+		idx++;
+	}
+	STATPF("privsep_stats=%zu", idx);
+	pos++;
+#undef STATPF
+
+	if (pos > SSIZE_MAX) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	return (ssize_t)pos;
+}
+#endif
+
 ssize_t
 ps_sendpsmmsg(struct dhcpcd_ctx *ctx, int fd,
     struct ps_msghdr *psm, const struct msghdr *msg)
@@ -888,6 +1445,9 @@ ps_sendpsmmsg(struct dhcpcd_ctx *ctx, int fd,
 	};
 	int iovlen;
 	ssize_t len;
+#ifdef PS_STATS
+	bool stat;
+#endif
 
 	if (msg != NULL) {
 		struct iovec *iovp = &iov[1];
@@ -925,12 +1485,42 @@ ps_sendpsmmsg(struct dhcpcd_ctx *ctx, int fd,
 	} else
 		iovlen = 1;
 
+	TRACE_EVENT(ctx, TRACE_PS_SEND, NULL, psm->ps_cmd);
+#ifdef PRIVSEP_RING
+	if (ctx->ps_ring != NULL && fd == ctx->ps_ring_wfd) {
+		len = ps_ring_write(ctx, iov, iovlen);
+		if (len != -1) {
+			ctx->stats.ps_msgs_sent++;
+			return len;
+		}
+	}
+#endif
+
+#ifdef PS_STATS
+	/* Timed until ps_root_readerror reads the reply.
+	 * Start before writing as the privileged proxy may well run
+	 * and reply before writev returns. */
+	stat = IN_PRIVSEP_SE(ctx) &&
+	    ctx->ps_root != NULL && fd == ctx->ps_root->psp_fd;
+	if (stat) {
+		ctx->ps_stat_cmd = psm->ps_cmd;
+		if (clock_gettime(CLOCK_MONOTONIC,
+		    &ctx->ps_stat_started) == -1)
+			timespecclear(&ctx->ps_stat_started);
+	}
+#endif
+
 	len = writev(fd, iov, iovlen);
 	if (len == -1) {
 		if (ctx->options & DHCPCD_FORKED &&
 		    !(ctx->options & DHCPCD_PRIVSEPROOT))
 			eloop_exit(ctx->eloop, EXIT_FAILURE);
-	}
+	} else
+		ctx->stats.ps_msgs_sent++;
+#ifdef PS_STATS
+	if (stat)
+		ctx->ps_stat_len = len == -1 ? 0 : (size_t)len;
+#endif
 	return len;
 }
 
@@ -1011,7 +1601,8 @@ ps_sendcmd(struct dhcpcd_ctx *ctx, int fd, uint16_t cmd, unsigned long flags,
 }
 
 static ssize_t
-ps_sendcmdmsg(int fd, uint16_t cmd, const struct msghdr *msg)
+ps_sendcmdmsg(struct dhcpcd_ctx *ctx, int fd, uint16_t cmd,
+    const struct msghdr *msg)
 {
 	struct ps_msghdr psm = { .ps_cmd = cmd };
 	uint8_t data[PS_BUFLEN], *p = data;
@@ -1023,6 +1614,14 @@ ps_sendcmdmsg(int fd, uint16_t cmd, const struct msghdr *msg)
 	socklen_t cmsg_padlen =
 	    CALC_CMSG_PADLEN(msg->msg_controllen, msg->msg_namelen);
 
+#ifdef PRIVSEP_RING
+	/* Gather straight into the ring rather than via data. */
+	if (ctx->ps_ring != NULL && fd == ctx->ps_ring_wfd)
+		return ps_sendmsg(ctx, fd, cmd, 0, msg);
+#else
+	UNUSED(ctx);
+#endif
+
 	if (msg->msg_namelen != 0) {
 		if (msg->msg_namelen > dl)
 			goto nobufs;
@@ -1061,44 +1660,50 @@ nobufs:
 	return -1;
 }
 
+struct ps_recvmsgarg {
+	struct dhcpcd_ctx *ctx;
+	uint16_t cmd;
+	int wfd;
+	ssize_t len;
+};
+
+static void
+ps_recvmsgcb(void *arg, struct msghdr *msg)
+{
+	struct ps_recvmsgarg *rm = arg;
+
+	/* Stop forwarding once the other side has gone. */
+	if (rm->len == -1)
+		return;
+	rm->len = ps_sendcmdmsg(rm->ctx, rm->wfd, rm->cmd, msg);
+}
+
 ssize_t
 ps_recvmsg(struct dhcpcd_ctx *ctx, int rfd, unsigned short events,
     uint16_t cmd, int wfd)
 {
-	struct sockaddr_storage ss = { .ss_family = AF_UNSPEC };
-	uint8_t controlbuf[sizeof(struct sockaddr_storage)] = { 0 };
-	uint8_t databuf[64 * 1024];
-	struct iovec iov[] = {
-	    { .iov_base = databuf, .iov_len = sizeof(databuf) }
-	};
-	struct msghdr msg = {
-		.msg_name = &ss, .msg_namelen = sizeof(ss),
-		.msg_control = controlbuf, .msg_controllen = sizeof(controlbuf),
-		.msg_iov = iov, .msg_iovlen = 1,
+	struct ps_recvmsgarg rm = {
+		.ctx = ctx, .cmd = cmd, .wfd = wfd, .len = 0,
 	};
-	ssize_t len;
+	ssize_t n;
 
 	if (!(events & ELE_READ))
 		logerrx("%s: unexpected event 0x%04x", __func__, events);
 
-	len = recvmsg(rfd, &msg, 0);
-	if (len == -1)
+	n = recvmsgs(ctx, rfd, RECVMSGS_MAX, ps_recvmsgcb, &rm);
+	if (n == -1) {
 		logerr("%s: recvmsg", __func__);
-	if (len == -1 || len == 0) {
 		if (ctx->options & DHCPCD_FORKED)
-			eloop_exit(ctx->eloop,
-			    len != -1 ? EXIT_SUCCESS : EXIT_FAILURE);
-		return len;
+			eloop_exit(ctx->eloop, EXIT_FAILURE);
+		return -1;
 	}
 
-	iov[0].iov_len = (size_t)len;
-	len = ps_sendcmdmsg(wfd, cmd, &msg);
-	if (len == -1) {
+	if (rm.len == -1) {
 		logerr("%s: ps_sendcmdmsg", __func__);
 		if (ctx->options & DHCPCD_FORKED)
 			eloop_exit(ctx->eloop, EXIT_FAILURE);
 	}
-	return len;
+	return rm.len;
 }
 
 ssize_t
@@ -1149,6 +1754,8 @@ ps_recvpsmsg(struct dhcpcd_ctx *ctx, int fd, unsigned short events,
 		return len;
 	}
 	dlen -= sizeof(psm.psm_hdr);
+	ctx->stats.ps_msgs_recv++;
+	TRACE_EVENT(ctx, TRACE_PS_RECV, NULL, psm.psm_hdr.ps_cmd);
 
 	if (ps_unrollmsg(&msg, &psm.psm_hdr, psm.psm_data, dlen) == -1)
 		return -1;
@@ -1199,6 +1806,7 @@ ps_newprocess(struct dhcpcd_ctx *ctx, struct ps_id *psid)
 	psp->psp_ctx = ctx;
 	memcpy(&psp->psp_id, psid, sizeof(psp->psp_id));
 	psp->psp_work_fd = -1;
+	psp->psp_ring = -1;
 #ifdef HAVE_CAPSICUM
 	psp->psp_pfd = -1;
 #endif
@@ -34,6 +34,7 @@
 /* Start flags */
 #define	PSF_DROPPRIVS		0x01
 #define	PSF_ELOOP		0x02
+#define	PSF_RING		0x04	/* Hand packets over by ring */
 
 /* Protocols */
 #define	PS_BOOTP		0x0001
@@ -55,6 +56,8 @@
 #define	PS_CTL_EOF		0x0019
 #define	PS_LOGREOPEN		0x0020
 #define	PS_STOPPROCS		0x0021
+#define	PS_BATCH		0x0022
+#define	PS_OPENFILE		0x0023
 
 /* Domains */
 #define	PS_ROOT			0x0101
@@ -109,6 +112,10 @@
 
 #define	PS_PROCESS_TIMEOUT	5	/* seconds to stop all processes */
 
+#if defined(PRIVSEP) && !defined(SMALL)
+#define	PS_STATS
+#endif
+
 #if defined(PRIVSEP) && defined(HAVE_CAPSICUM)
 #define PRIVSEP_RIGHTS
 #endif
@@ -161,6 +168,7 @@ struct ps_msg {
 };
 
 struct bpf;
+struct ps_bpf_head;
 
 struct ps_process {
 	TAILQ_ENTRY(ps_process) next;
@@ -175,11 +183,13 @@ struct ps_process {
 	uint16_t psp_proto;
 	const char *psp_protostr;
 	bool psp_started;
+	int psp_ring;		/* index into ctx->ps_rings or -1 */
 
 #ifdef INET
 	int (*psp_filter)(const struct bpf *, const struct in_addr *);
 	struct interface psp_ifp; /* Move BPF gubbins elsewhere */
 	struct bpf *psp_bpf;
+	struct ps_bpf_head *psp_bpf_ifs; /* interfaces of a shared helper */
 #endif
 
 #ifdef HAVE_CAPSICUM
@@ -188,6 +198,36 @@ struct ps_process {
 };
 TAILQ_HEAD(ps_process_head, ps_process);
 
+#ifdef PS_STATS
+/*
+ * What privilege separation costs the manager, per command, for
+ * dhcpcd --stats privsep.
+ * PS_STAT_ROOT is a command sent to the privileged proxy, timed until
+ * the reply is read. PS_STAT_DISPATCH is a message from a helper, timed
+ * while the manager handles it.
+ * The histogram buckets match eloop's: bucket 0 is under 1us and
+ * bucket n is under 2^n us.
+ */
+#define	PS_STATS_NHIST		24
+
+#define	PS_STAT_ROOT		1
+#define	PS_STAT_DISPATCH	2
+
+struct ps_stat {
+	TAILQ_ENTRY(ps_stat) next;
+	int type;
+	uint16_t cmd;
+	unsigned long long count;
+	unsigned long long errors;
+	unsigned long long bytes_out;
+	unsigned long long bytes_in;
+	unsigned long long total_usec;
+	unsigned long long max_usec;
+	unsigned long long hist[PS_STATS_NHIST];
+};
+TAILQ_HEAD(ps_stat_head, ps_stat);
+#endif
+
 #include "privsep-control.h"
 #include "privsep-inet.h"
 #include "privsep-root.h"
@@ -203,6 +243,7 @@ int ps_entersandbox(const char *, const char **);
 int ps_managersandbox(struct dhcpcd_ctx *, const char *);
 
 int ps_unrollmsg(struct msghdr *, struct ps_msghdr *, const void *, size_t);
+ssize_t ps_rollmsg(void *, size_t, struct ps_msghdr *, const struct msghdr *);
 ssize_t ps_sendpsmmsg(struct dhcpcd_ctx *, int,
     struct ps_msghdr *, const struct msghdr *);
 ssize_t ps_sendpsmdata(struct dhcpcd_ctx *, int,
@@ -215,6 +256,18 @@ ssize_t ps_recvmsg(struct dhcpcd_ctx *, int, unsigned short, uint16_t, int);
 ssize_t ps_recvpsmsg(struct dhcpcd_ctx *, int, unsigned short,
     ssize_t (*callback)(void *, struct ps_msghdr *, struct msghdr *), void *);
 
+int ps_ring_init(struct dhcpcd_ctx *);
+void ps_ring_free(struct dhcpcd_ctx *);
+ssize_t ps_ring_recv(struct dhcpcd_ctx *,
+    ssize_t (*callback)(void *, struct ps_msghdr *, struct msghdr *), void *);
+
+#ifdef PS_STATS
+void ps_stats_add(struct dhcpcd_ctx *, int, uint16_t, ssize_t,
+    size_t, size_t, const struct timespec *);
+ssize_t ps_stats_format(const struct dhcpcd_ctx *, char *, size_t);
+void ps_stats_free(struct dhcpcd_ctx *);
+#endif
+
 /* Internal privsep functions. */
 int ps_setbuf_fdpair(int []);
 
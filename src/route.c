@@ -38,12 +38,14 @@
 #include "config.h"
 #include "common.h"
 #include "dhcpcd.h"
+#include "eloop.h"
 #include "if.h"
 #include "if-options.h"
 #include "ipv4.h"
 #include "ipv4ll.h"
 #include "ipv6.h"
 #include "logerr.h"
+#include "privsep.h"
 #include "route.h"
 #include "sa.h"
 
@@ -63,13 +65,6 @@
         (N) = (S))
 #endif
 
-#ifdef RT_FREE_ROUTE_TABLE_STATS
-static size_t croutes;
-static size_t nroutes;
-static size_t froutes;
-static size_t mroutes;
-#endif
-
 static void
 rt_maskedaddr(struct sockaddr *dst,
 	const struct sockaddr *addr, const struct sockaddr *netmask)
@@ -111,13 +106,97 @@ rt_cmp_netmask(const struct rt *rt1, const struct rt *rt2)
 	return sa_cmp(&rt1->rt_netmask, &rt2->rt_netmask);
 }
 
+/* The address bytes of a route destination and what masks them. */
+struct rt_dkey {
+	const uint8_t	*dk_addr;
+	const uint8_t	*dk_mask;	/* NULL if unmasked */
+	size_t		dk_len;
+	size_t		dk_masklen;	/* bytes beyond this mask to 0 */
+};
+
+/*
+ * Point at the destination and netmask bytes in place so the comparator
+ * doesn't have to build masked copies for every node it visits.
+ * Returns false if the route needs the general path.
+ */
+static bool
+rt_dkey(const struct rt *rt, struct rt_dkey *dk)
+{
+	const struct sockaddr *dest = &rt->rt_dest, *mask = &rt->rt_netmask;
+	size_t offset;
+
+	switch (dest->sa_family) {
+#ifdef INET
+	case AF_INET:
+		offset = offsetof(struct sockaddr_in, sin_addr);
+		dk->dk_len = sizeof(struct in_addr);
+		break;
+#endif
+#ifdef INET6
+	case AF_INET6:
+		offset = offsetof(struct sockaddr_in6, sin6_addr);
+		dk->dk_len = sizeof(struct in6_addr);
+		break;
+#endif
+	default:
+		return false;
+	}
+#ifdef HAVE_SA_LEN
+	if (dest->sa_len < offset + dk->dk_len)
+		return false;
+#endif
+	dk->dk_addr = (const uint8_t *)dest + offset;
+
+	if (mask->sa_family != AF_UNSPEC &&
+	    mask->sa_family != dest->sa_family)
+		return false;
+	if (sa_is_unspecified(mask)) {
+		dk->dk_mask = NULL;
+		return true;
+	}
+	dk->dk_mask = (const uint8_t *)mask + offset;
+#ifdef HAVE_SA_LEN
+	dk->dk_masklen = mask->sa_len > offset ? mask->sa_len - offset : 0;
+	if (dk->dk_masklen > dk->dk_len)
+		dk->dk_masklen = dk->dk_len;
+#else
+	dk->dk_masklen = dk->dk_len;
+#endif
+	return true;
+}
+
+static inline uint8_t
+rt_dkey_byte(const struct rt_dkey *dk, size_t i)
+{
+
+	if (dk->dk_mask == NULL)
+		return dk->dk_addr[i];
+	if (i >= dk->dk_masklen)
+		return 0;
+	return dk->dk_addr[i] & dk->dk_mask[i];
+}
+
 int
 rt_cmp_dest(const struct rt *rt1, const struct rt *rt2)
 {
 	union sa_ss ma1 = { .sa.sa_family = AF_UNSPEC };
 	union sa_ss ma2 = { .sa.sa_family = AF_UNSPEC };
+	struct rt_dkey dk1, dk2;
+	size_t i;
 	int c;
 
+	/* Same order as the masked sa_cmp below, without the copies. */
+	if (rt1->rt_dest.sa_family == rt2->rt_dest.sa_family &&
+	    rt_dkey(rt1, &dk1) && rt_dkey(rt2, &dk2))
+	{
+		for (i = 0; i < dk1.dk_len; i++) {
+			c = rt_dkey_byte(&dk1, i) - rt_dkey_byte(&dk2, i);
+			if (c != 0)
+				return c;
+		}
+		return rt_cmp_netmask(rt1, rt2);
+	}
+
 	rt_maskedaddr(&ma1.sa, &rt1->rt_dest, &rt1->rt_netmask);
 	rt_maskedaddr(&ma2.sa, &rt2->rt_dest, &rt2->rt_netmask);
 	c = sa_cmp(&ma1.sa, &ma2.sa);
@@ -220,30 +299,17 @@ const rb_tree_ops_t rt_compare_proto_ops = {
 	.rbto_context = NULL
 };
 
-#ifdef RT_FREE_ROUTE_TABLE
-static int
-rt_compare_free(__unused void *context, const void *node1, const void *node2)
-{
-
-	return node1 == node2 ? 0 : node1 < node2 ? -1 : 1;
-}
-
-static const rb_tree_ops_t rt_compare_free_ops = {
-	.rbto_compare_nodes = rt_compare_free,
-	.rbto_compare_key = rt_compare_free,
-	.rbto_node_offset = offsetof(struct rt, rt_tree),
-	.rbto_context = NULL
-};
-#endif
+/* Each address family gets a bit in ctx->rt_shadowed and ctx->rt_kvalid. */
+#define	RT_AFBIT(af)	\
+	((af) == AF_INET ? 0x01U : (af) == AF_INET6 ? 0x02U : 0x03U)
 
 void
 rt_init(struct dhcpcd_ctx *ctx)
 {
 
 	rb_tree_init(&ctx->routes, &rt_compare_os_ops);
-#ifdef RT_FREE_ROUTE_TABLE
-	rb_tree_init(&ctx->froutes, &rt_compare_free_ops);
-#endif
+	rb_tree_init(&ctx->kroutes, &rt_compare_os_ops);
+	pool_init(&ctx->rt_pool, "route", sizeof(struct rt));
 }
 
 bool
@@ -295,6 +361,28 @@ rt_desc(const char *cmd, const struct rt *rt)
 		    ifname, cmd,
 		    rt->rt_flags & RTF_REJECT ? " reject" : "",
 		    dest, prefix, gateway);
+
+#ifdef HAVE_ROUTE_MULTIPATH
+	for (rt = rt->rt_mpath; rt != NULL; rt = rt->rt_mpath) {
+		sa_addrtop(&rt->rt_gateway, gateway, sizeof(gateway));
+		loginfox("%s: %s path via %s", rt->rt_ifp->name, cmd, gateway);
+	}
+#endif
+}
+
+static void
+rt_free0(struct dhcpcd_ctx *ctx, struct rt *rt)
+{
+
+#ifdef HAVE_ROUTE_MULTIPATH
+	rt_mpfree(rt);
+#endif
+#ifdef RT_FREE_ROUTE_TABLE
+	pool_put(&ctx->rt_pool, rt);
+#else
+	UNUSED(ctx);
+	free(rt);
+#endif
 }
 
 void
@@ -305,9 +393,6 @@ rt_headclear0(struct dhcpcd_ctx *ctx, rb_tree_t *rts, int af)
 	if (rts == NULL)
 		return;
 	assert(ctx != NULL);
-#ifdef RT_FREE_ROUTE_TABLE
-	assert(&ctx->froutes != rts);
-#endif
 
 	RB_TREE_FOREACH_SAFE(rt, rts, rtn) {
 		if (af != AF_UNSPEC &&
@@ -315,7 +400,7 @@ rt_headclear0(struct dhcpcd_ctx *ctx, rb_tree_t *rts, int af)
 		    rt->rt_gateway.sa_family != af)
 			continue;
 		rb_tree_remove_node(rts, rt);
-		rt_free(rt);
+		rt_free0(ctx, rt);
 	}
 }
 
@@ -333,9 +418,18 @@ static void
 rt_headfree(rb_tree_t *rts)
 {
 	struct rt *rt;
+#ifdef HAVE_ROUTE_MULTIPATH
+	struct rt *mp;
+#endif
 
 	while ((rt = RB_TREE_MIN(rts)) != NULL) {
 		rb_tree_remove_node(rts, rt);
+#ifdef HAVE_ROUTE_MULTIPATH
+		while ((mp = rt->rt_mpath) != NULL) {
+			rt->rt_mpath = mp->rt_mpath;
+			free(mp);
+		}
+#endif
 		free(rt);
 	}
 }
@@ -346,14 +440,8 @@ rt_dispose(struct dhcpcd_ctx *ctx)
 
 	assert(ctx != NULL);
 	rt_headfree(&ctx->routes);
-#ifdef RT_FREE_ROUTE_TABLE
-	rt_headfree(&ctx->froutes);
-#ifdef RT_FREE_ROUTE_TABLE_STATS
-	logdebugx("free route list used %zu times", froutes);
-	logdebugx("new routes from route free list %zu", nroutes);
-	logdebugx("maximum route free list size %zu", mroutes);
-#endif
-#endif
+	rt_headfree(&ctx->kroutes);
+	pool_clear(&ctx->rt_pool);
 }
 
 struct rt *
@@ -363,19 +451,12 @@ rt_new0(struct dhcpcd_ctx *ctx)
 
 	assert(ctx != NULL);
 #ifdef RT_FREE_ROUTE_TABLE
-	if ((rt = RB_TREE_MIN(&ctx->froutes)) != NULL) {
-		rb_tree_remove_node(&ctx->froutes, rt);
-#ifdef RT_FREE_ROUTE_TABLE_STATS
-		croutes--;
-		nroutes++;
-#endif
-	} else
+	rt = pool_get(&ctx->rt_pool);
+#else
+	rt = calloc(1, sizeof(*rt));
 #endif
-	if ((rt = malloc(sizeof(*rt))) == NULL) {
+	if (rt == NULL)
 		logerr(__func__);
-		return NULL;
-	}
-	memset(rt, 0, sizeof(*rt));
 	return rt;
 }
 
@@ -429,25 +510,67 @@ rt_proto_add(rb_tree_t *tree, struct rt *rt)
 void
 rt_free(struct rt *rt)
 {
-#ifdef RT_FREE_ROUTE_TABLE
-	struct dhcpcd_ctx *ctx;
 
 	assert(rt != NULL);
+	/* Without an interface we don't know the pool.
+	 * rt_headclear0 is given it for routes from the options. */
 	if (rt->rt_ifp == NULL) {
 		free(rt);
 		return;
 	}
+	rt_free0(rt->rt_ifp->ctx, rt);
+}
 
-	ctx = rt->rt_ifp->ctx;
-	rb_tree_insert_node(&ctx->froutes, rt);
-#ifdef RT_FREE_ROUTE_TABLE_STATS
-	croutes++;
-	froutes++;
-	if (croutes > mroutes)
-		mroutes = croutes;
+#ifdef HAVE_ROUTE_MULTIPATH
+/* Free the other paths of a multipath route, leaving the route. */
+void
+rt_mpfree(struct rt *rt)
+{
+	struct rt *mp;
+
+	while ((mp = rt->rt_mpath) != NULL) {
+		rt->rt_mpath = mp->rt_mpath;
+		mp->rt_mpath = NULL;
+		rt_free(mp);
+	}
+}
+
+/* Give dst, a copy of src, paths of its own. */
+static int
+rt_mpcopy(struct rt *dst, const struct rt *src)
+{
+	const struct rt *mp;
+	struct rt **tail, *np;
+
+	dst->rt_mpath = NULL;
+	tail = &dst->rt_mpath;
+	for (mp = src->rt_mpath; mp != NULL; mp = mp->rt_mpath) {
+		if ((np = rt_new0(mp->rt_ifp->ctx)) == NULL) {
+			rt_mpfree(dst);
+			return -1;
+		}
+		memcpy(np, mp, sizeof(*np));
+		np->rt_mpath = NULL;
+		*tail = np;
+		tail = &np->rt_mpath;
+	}
+	return 0;
+}
 #endif
+
+/* Does any path of the route go through ifp? */
+static bool
+rt_hasif(const struct rt *rt, const struct interface *ifp)
+{
+
+#ifdef HAVE_ROUTE_MULTIPATH
+	for (; rt != NULL; rt = rt->rt_mpath) {
+		if (rt->rt_ifp == ifp)
+			return true;
+	}
+	return false;
 #else
-	free(rt);
+	return rt->rt_ifp == ifp;
 #endif
 }
 
@@ -460,12 +583,138 @@ rt_freeif(struct interface *ifp)
 	if (ifp == NULL)
 		return;
 	ctx = ifp->ctx;
+	/* Remove the routes a pending build would remove for us. */
+	rt_buildpending(ctx);
 	RB_TREE_FOREACH_SAFE(rt, &ctx->routes, rtn) {
-		if (rt->rt_ifp == ifp) {
+		if (rt_hasif(rt, ifp)) {
 			rb_tree_remove_node(&ctx->routes, rt);
 			rt_free(rt);
 		}
 	}
+	RB_TREE_FOREACH_SAFE(rt, &ctx->kroutes, rtn) {
+		if (rt_hasif(rt, ifp)) {
+			rb_tree_remove_node(&ctx->kroutes, rt);
+			rt_free(rt);
+		}
+	}
+}
+
+#ifdef HAVE_ROUTE_MULTIPATH
+/* Do the routes have the same other paths, in the same order? */
+static bool
+rt_mpcmp(const struct rt *r1, const struct rt *r2)
+{
+
+	for (r1 = r1->rt_mpath, r2 = r2->rt_mpath;
+	    r1 != NULL && r2 != NULL;
+	    r1 = r1->rt_mpath, r2 = r2->rt_mpath)
+	{
+		if (r1->rt_ifp != r2->rt_ifp ||
+		    sa_cmp(&r1->rt_gateway, &r2->rt_gateway) != 0)
+			return false;
+	}
+	return r1 == r2;
+}
+#endif
+
+static bool
+rt_cmp(const struct rt *r1, const struct rt *r2)
+{
+
+	return (r1->rt_ifp == r2->rt_ifp &&
+#ifdef HAVE_ROUTE_METRIC
+	    r1->rt_metric == r2->rt_metric &&
+#endif
+#ifdef HAVE_ROUTE_MULTIPATH
+	    rt_mpcmp(r1, r2) &&
+#endif
+	    sa_cmp(&r1->rt_gateway, &r2->rt_gateway) == 0);
+}
+
+/*
+ * ctx->kroutes mirrors the kernel routes on our interfaces so that
+ * rt_build does not need to dump the kernel routing table each time.
+ * It is kept up to date from the routes we change and the route
+ * messages we receive from others.
+ * If the route socket overflows or the kernel could have removed
+ * routes without telling us, such as when an interface goes down
+ * or an IPv4 address is deleted, the next rt_build dumps again.
+ */
+void
+rt_kinvalidate(struct dhcpcd_ctx *ctx, int af)
+{
+
+	ctx->rt_kvalid &= ~RT_AFBIT(af);
+}
+
+/* If strict, a route that does not match the one we have means
+ * the kernel has more than one route we cannot tell apart. */
+static void
+rt_kadd(struct dhcpcd_ctx *ctx, const struct rt *rt, bool strict)
+{
+	struct rt *krt;
+	int af = rt->rt_dest.sa_family;
+
+	if (!(ctx->rt_kvalid & RT_AFBIT(af)))
+		return;
+
+	krt = rb_tree_find_node(&ctx->kroutes, rt);
+	if (krt == NULL) {
+		if ((krt = rt_new0(ctx)) == NULL) {
+			logerr(__func__);
+			rt_kinvalidate(ctx, af);
+			return;
+		}
+		memcpy(krt, rt, sizeof(*krt));
+#ifdef HAVE_ROUTE_MULTIPATH
+		if (rt_mpcopy(krt, rt) == -1) {
+			logerr(__func__);
+			rt_free(krt);
+			rt_kinvalidate(ctx, af);
+			return;
+		}
+#endif
+		rb_tree_insert_node(&ctx->kroutes, krt);
+		return;
+	}
+
+	if (strict && !rt_cmp(krt, rt)) {
+		rt_kinvalidate(ctx, af);
+		return;
+	}
+	/* The key is the same, so we can replace it in place.
+	 * rt_tree is the last member of struct rt. */
+#ifdef HAVE_ROUTE_MULTIPATH
+	rt_mpfree(krt);
+#endif
+	memcpy(krt, rt, offsetof(struct rt, rt_tree));
+#ifdef HAVE_ROUTE_MULTIPATH
+	if (rt_mpcopy(krt, rt) == -1) {
+		logerr(__func__);
+		rt_kinvalidate(ctx, af);
+	}
+#endif
+}
+
+static void
+rt_kdel(struct dhcpcd_ctx *ctx, const struct rt *rt, bool strict)
+{
+	struct rt *krt;
+	int af = rt->rt_dest.sa_family;
+
+	if (!(ctx->rt_kvalid & RT_AFBIT(af)))
+		return;
+
+	krt = rb_tree_find_node(&ctx->kroutes, rt);
+	if (krt == NULL)
+		return;
+	if (!rt_cmp(krt, rt)) {
+		if (strict)
+			rt_kinvalidate(ctx, af);
+		return;
+	}
+	rb_tree_remove_node(&ctx->kroutes, krt);
+	rt_free(krt);
 }
 
 /* If something other than dhcpcd removes a route,
@@ -483,7 +732,12 @@ rt_recvrt(int cmd, const struct rt *rt, pid_t pid)
 	ctx = rt->rt_ifp->ctx;
 
 	switch(cmd) {
+	case RTM_ADD:
+	case RTM_CHANGE:
+		rt_kadd(ctx, rt, true);
+		break;
 	case RTM_DELETE:
+		rt_kdel(ctx, rt, true);
 		f = rb_tree_find_node(&ctx->routes, rt);
 		if (f != NULL) {
 			char buf[32];
@@ -502,48 +756,138 @@ rt_recvrt(int cmd, const struct rt *rt, pid_t pid)
 #endif
 }
 
+/* if_route, counted for dhcpcd --stats counters. */
+static int
+rt_ifroute(unsigned char cmd, const struct rt *rt)
+{
+	struct dhcpcd_stats *stats = &rt->rt_ifp->ctx->stats;
+	int r;
+
+	switch (cmd) {
+	case RTM_ADD:
+		stats->route_adds++;
+		break;
+	case RTM_CHANGE:
+		stats->route_changes++;
+		break;
+	case RTM_DELETE:
+		stats->route_deletes++;
+		break;
+	}
+	r = if_route(cmd, rt);
+	if (r == -1)
+		stats->route_errors++;
+
+	/* Keep our copy of the kernel routes in step. */
+	if (cmd == RTM_DELETE) {
+		if (r != -1 || errno == ESRCH || errno == ENOENT) {
+			int serrno = errno;
+
+			rt_kdel(rt->rt_ifp->ctx, rt, false);
+			errno = serrno;
+		}
+	} else if (r != -1)
+		rt_kadd(rt->rt_ifp->ctx, rt, false);
+	return r;
+}
+
+/* Can the kernel change ort into nrt in place?
+ * This saves deleting and adding the route, and the window
+ * without a route between the two. */
 static bool
-rt_add(rb_tree_t *kroutes, struct rt *nrt, struct rt *ort)
+rt_canchange(const struct rt *ort, const struct rt *nrt)
+{
+
+#ifdef HAVE_ROUTE_METRIC
+	/* The metric is part of what identifies the route. */
+	if (ort->rt_metric != nrt->rt_metric)
+		return false;
+#endif
+#ifdef ROUTE_PER_GATEWAY
+	/* As is the gateway. */
+	if (sa_cmp(&ort->rt_gateway, &nrt->rt_gateway) != 0)
+		return false;
+#endif
+#ifndef HAVE_ROUTE_REPLACE
+	/* Only Linux can replace it with a route through
+	 * another interface. */
+	if (ort->rt_ifp != nrt->rt_ifp)
+		return false;
+#endif
+	/* Changing the type of route needs a new one. */
+	return (ort->rt_flags & RTF_REJECT) == (nrt->rt_flags & RTF_REJECT) &&
+	    sa_is_unspecified(&ort->rt_gateway) ==
+	    sa_is_unspecified(&nrt->rt_gateway);
+}
+
+/*
+ * Don't install a gateway if not asked to.
+ * This option is mainly for VPN users who want their VPN to be the
+ * default route.
+ * Because VPN's generally don't care about route management
+ * beyond their own, a longer term solution would be to remove this
+ * and get the VPN to inject the default route into dhcpcd somehow.
+ */
+static bool
+rt_nogateway(const struct rt *rt)
+{
+	const struct interface *ifp = rt->rt_ifp;
+
+	return ((ifp->active &&
+	    !(ifp->options->options & DHCPCD_GATEWAY)) ||
+	    (!ifp->active && !(ifp->ctx->options & DHCPCD_GATEWAY))) &&
+	    sa_is_unspecified(&rt->rt_dest) &&
+	    sa_is_unspecified(&rt->rt_netmask);
+}
+
+static bool
+rt_add(struct rt *nrt, struct rt *ort)
 {
 	struct dhcpcd_ctx *ctx;
-	bool change, kroute, result;
+	struct rt krt;
+	bool change, result;
 
 	assert(nrt != NULL);
 	ctx = nrt->rt_ifp->ctx;
 
-	/*
-	 * Don't install a gateway if not asked to.
-	 * This option is mainly for VPN users who want their VPN to be the
-	 * default route.
-	 * Because VPN's generally don't care about route management
-	 * beyond their own, a longer term solution would be to remove this
-	 * and get the VPN to inject the default route into dhcpcd somehow.
-	 */
-	if (((nrt->rt_ifp->active &&
-	    !(nrt->rt_ifp->options->options & DHCPCD_GATEWAY)) ||
-	    (!nrt->rt_ifp->active && !(ctx->options & DHCPCD_GATEWAY))) &&
-	    sa_is_unspecified(&nrt->rt_dest) &&
-	    sa_is_unspecified(&nrt->rt_netmask))
+	if (rt_nogateway(nrt))
 		return false;
 
 	rt_desc(ort == NULL ? "adding" : "changing", nrt);
 
-	change = kroute = result = false;
+#ifdef HAVE_ROUTE_NEXTHOP
+	if (if_nexthop(nrt) == -1)
+		logerr("if_nexthop");
+#endif
+
+	change = result = false;
 	if (ort == NULL) {
-		ort = rb_tree_find_node(kroutes, nrt);
-		if (ort != NULL &&
-		    ((ort->rt_flags & RTF_REJECT &&
-		      nrt->rt_flags & RTF_REJECT) ||
-		     (ort->rt_ifp == nrt->rt_ifp &&
-#ifdef HAVE_ROUTE_METRIC
-		    ort->rt_metric == nrt->rt_metric &&
+		/* Work on a copy as changing the kernel route
+		 * updates ctx->kroutes. */
+		ort = rb_tree_find_node(&ctx->kroutes, nrt);
+		if (ort == NULL) {
+			/* Nothing to replace, so rt_build can send it
+			 * along with the other additions. */
+			nrt->rt_dflags |= RTDF_QUEUED;
+			return true;
+		}
+		memcpy(&krt, ort, sizeof(krt));
+#ifdef HAVE_ROUTE_MULTIPATH
+		if (rt_mpcopy(&krt, ort) == -1) {
+			logerr(__func__);
+			return false;
+		}
 #endif
-		    sa_cmp(&ort->rt_gateway, &nrt->rt_gateway) == 0)))
+		ort = &krt;
+		if ((ort->rt_flags & RTF_REJECT &&
+		     nrt->rt_flags & RTF_REJECT) ||
+		    rt_cmp(ort, nrt))
 		{
-			if (ort->rt_mtu == nrt->rt_mtu)
-				return true;
+			if (ort->rt_mtu == nrt->rt_mtu) {
+				result = true;
+				goto out;
+			}
 			change = true;
-			kroute = true;
 		}
 	} else if (ort->rt_dflags & RTDF_FAKE &&
 	    !(nrt->rt_dflags & RTDF_FAKE) &&
@@ -560,6 +904,9 @@ rt_add(rb_tree_t *kroutes, struct rt *nrt, struct rt *ort)
 		change = true;
 	}
 
+	if (!change && ort != NULL && rt_canchange(ort, nrt))
+		change = true;
+
 #ifdef RTF_CLONING
 	/* BSD can set routes to be cloning routes.
 	 * Cloned routes inherit the parent flags.
@@ -570,7 +917,15 @@ rt_add(rb_tree_t *kroutes, struct rt *nrt, struct rt *ort)
 #endif
 
 	if (change) {
-		if (if_route(RTM_CHANGE, nrt) != -1) {
+#ifdef HAVE_ROUTE_REPLACE
+		/* This cannot fail for want of the old route, so send it
+		 * with the additions in the order rt_build made them.
+		 * The new gateway may need one of them. */
+		nrt->rt_dflags |= RTDF_QUEUED | RTDF_CHANGE;
+		result = true;
+		goto out;
+#endif
+		if (rt_ifroute(RTM_CHANGE, nrt) != -1) {
 			result = true;
 			goto out;
 		}
@@ -581,9 +936,9 @@ rt_add(rb_tree_t *kroutes, struct rt *nrt, struct rt *ort)
 #ifdef HAVE_ROUTE_METRIC
 	/* With route metrics, we can safely add the new route before
 	 * deleting the old route. */
-	if (if_route(RTM_ADD, nrt) != -1) {
+	if (rt_ifroute(RTM_ADD, nrt) != -1) {
 		if (ort != NULL) {
-			if (if_route(RTM_DELETE, ort) == -1 && errno != ESRCH)
+			if (rt_ifroute(RTM_DELETE, ort) == -1 && errno != ESRCH)
 				logerr("if_route (DEL)");
 		}
 		result = true;
@@ -602,10 +957,8 @@ rt_add(rb_tree_t *kroutes, struct rt *nrt, struct rt *ort)
 	errno = 0;
 #endif
 	if (ort != NULL) {
-		if (if_route(RTM_DELETE, ort) == -1 && errno != ESRCH)
+		if (rt_ifroute(RTM_DELETE, ort) == -1 && errno != ESRCH)
 			logerr("if_route (DEL)");
-		else
-			kroute = false;
 	}
 #ifdef ROUTE_PER_GATEWAY
 	/* The OS allows many routes to the same dest with different gateways.
@@ -613,7 +966,7 @@ rt_add(rb_tree_t *kroutes, struct rt *nrt, struct rt *ort)
 	 * deleting the route until there is an error. */
 	if (ort != NULL && errno == 0) {
 		for (;;) {
-			if (if_route(RTM_DELETE, ort) == -1)
+			if (rt_ifroute(RTM_DELETE, ort) == -1)
 				break;
 		}
 	}
@@ -621,7 +974,7 @@ rt_add(rb_tree_t *kroutes, struct rt *nrt, struct rt *ort)
 
 	/* Shouldn't need to check for EEXIST, but some kernels don't
 	 * dump the subnet route just after we added the address. */
-	if (if_route(RTM_ADD, nrt) != -1 || errno == EEXIST) {
+	if (rt_ifroute(RTM_ADD, nrt) != -1 || errno == EEXIST) {
 		result = true;
 		goto out;
 	}
@@ -632,10 +985,10 @@ logerr:
 	logerr("if_route (ADD)");
 
 out:
-	if (kroute) {
-		rb_tree_remove_node(kroutes, ort);
-		rt_free(ort);
-	}
+#ifdef HAVE_ROUTE_MULTIPATH
+	if (ort == &krt)
+		rt_mpfree(&krt);
+#endif
 	return result;
 }
 
@@ -645,25 +998,14 @@ rt_delete(struct rt *rt)
 	int retval;
 
 	rt_desc("deleting", rt);
-	retval = if_route(RTM_DELETE, rt) == -1 ? false : true;
+	retval = rt_ifroute(RTM_DELETE, rt) == -1 ? false : true;
 	if (!retval && errno != ENOENT && errno != ESRCH)
 		logerr(__func__);
 	return retval;
 }
 
 static bool
-rt_cmp(const struct rt *r1, const struct rt *r2)
-{
-
-	return (r1->rt_ifp == r2->rt_ifp &&
-#ifdef HAVE_ROUTE_METRIC
-	    r1->rt_metric == r2->rt_metric &&
-#endif
-	    sa_cmp(&r1->rt_gateway, &r2->rt_gateway) == 0);
-}
-
-static bool
-rt_doroute(rb_tree_t *kroutes, struct rt *rt)
+rt_doroute(struct rt *rt)
 {
 	struct dhcpcd_ctx *ctx;
 	struct rt *or;
@@ -678,22 +1020,25 @@ rt_doroute(rb_tree_t *kroutes, struct rt *rt)
 		    !rt_cmp(rt, or) ||
 		    (rt->rt_ifa.sa_family != AF_UNSPEC &&
 		    sa_cmp(&or->rt_ifa, &rt->rt_ifa) != 0) ||
+#ifdef HAVE_ROUTE_PREF
+		    or->rt_pref != rt->rt_pref ||
+#endif
 		    or->rt_mtu != rt->rt_mtu)
 		{
-			if (!rt_add(kroutes, rt, or))
+			if (!rt_add(rt, or))
 				return false;
 		}
 		rb_tree_remove_node(&ctx->routes, or);
 		rt_free(or);
 	} else {
 		if (rt->rt_dflags & RTDF_FAKE) {
-			or = rb_tree_find_node(kroutes, rt);
+			or = rb_tree_find_node(&ctx->kroutes, rt);
 			if (or == NULL)
 				return false;
 			if (!rt_cmp(rt, or))
 				return false;
 		} else {
-			if (!rt_add(kroutes, rt, NULL))
+			if (!rt_add(rt, NULL))
 				return false;
 		}
 	}
@@ -701,21 +1046,318 @@ rt_doroute(rb_tree_t *kroutes, struct rt *rt)
 	return true;
 }
 
+/* Move a route rt_add queued to added once we know the kernel has it. */
+static void
+rt_addqueued(rb_tree_t *queued, rb_tree_t *added, struct rt *rt, bool ok)
+{
+	struct dhcpcd_ctx *ctx = rt->rt_ifp->ctx;
+	int serrno = errno;
+	bool change = rt->rt_dflags & RTDF_CHANGE;
+
+	rb_tree_remove_node(queued, rt);
+	rt->rt_dflags &= (unsigned int)~(RTDF_QUEUED | RTDF_CHANGE);
+
+#ifndef HAVE_ROUTE_METRIC
+	/* Shouldn't need to check for EEXIST, but some kernels don't
+	 * dump the subnet route just after we added the address. */
+	if (!ok && serrno == EEXIST)
+		ok = true;
+#endif
+	if (!ok) {
+		errno = serrno;
+		logerr(change ? "if_route (CHG)" : "if_route (ADD)");
+		/* We told our copy of the kernel routes it was added.
+		 * A failed change leaves the old route we no longer have. */
+		if (change || serrno == EEXIST)
+			rt_kinvalidate(ctx, rt->rt_dest.sa_family);
+		else
+			rt_kdel(ctx, rt, false);
+		rt_free(rt);
+		return;
+	}
+
+	if (rb_tree_insert_node(added, rt) != rt) {
+		errno = EEXIST;
+		logerr(__func__);
+		rt_free(rt);
+	}
+}
+
+/* Report the changes rt_build batched.
+ * The additions come first, in the order of queued.
+ * deleted is in the same order as ctx->routes, so walking it in
+ * reverse gives the order the deletions were queued in. */
+static void
+rt_endbatch(struct dhcpcd_ctx *ctx, rb_tree_t *queued, rb_tree_t *added,
+    rb_tree_t *deleted)
+{
+	const struct psr_result *results;
+	struct rt *rt, *rtn;
+	ssize_t n, i = 0;
+	bool ok;
+
+	n = if_batch_end(ctx, &results);
+	if (n == -1)
+		logerr("%s: if_batch_end", __func__);
+	RB_TREE_FOREACH_SAFE(rt, queued, rtn) {
+		ok = i >= n || results[i].psr_result != -1;
+		if (!ok) {
+			ctx->stats.route_errors++;
+			errno = results[i].psr_errno;
+		}
+		rt_addqueued(queued, added, rt, ok);
+		i++;
+	}
+	RB_TREE_FOREACH_REVERSE_SAFE(rt, deleted, rtn) {
+		rb_tree_remove_node(deleted, rt);
+		if (i < n && results[i].psr_result == -1) {
+			ctx->stats.route_errors++;
+			errno = results[i].psr_errno;
+			if (errno != ENOENT && errno != ESRCH)
+				logerr("rt_delete");
+		}
+		i++;
+		rt_free(rt);
+	}
+}
+
+static bool
+rt_isaf(const struct rt *rt, int af)
+{
+
+	return (rt->rt_dest.sa_family == af ||
+	    rt->rt_dest.sa_family == AF_UNSPEC) &&
+	    (rt->rt_gateway.sa_family == af ||
+	    rt->rt_gateway.sa_family == AF_UNSPEC);
+}
+
+/* Returns true if the routes for the interface should be
+ * generated in this build. */
+bool
+rt_ifdirty(const struct interface *ifp)
+{
+
+	return !ifp->ctx->rt_scoped || ifp->rt_dirty;
+}
+
+/* A scoped build leaves routes for clean interfaces alone,
+ * so it cannot replace any of them. */
+static bool
+rt_scopeclash(struct dhcpcd_ctx *ctx, rb_tree_t *routes, int af)
+{
+	struct rt *rt, *or;
+
+	RB_TREE_FOREACH(rt, routes) {
+		if (!rt_isaf(rt, af))
+			continue;
+		or = rb_tree_find_node(&ctx->routes, rt);
+		if (or != NULL && !rt_ifdirty(or->rt_ifp))
+			return true;
+	}
+	return false;
+}
+
+#ifdef HAVE_ROUTE_NEXTHOP
+/* Can every kernel route through the nexthop move to gw? */
+static bool
+rt_nhcanmove(struct dhcpcd_ctx *ctx, rb_tree_t *routes,
+    const struct rt *krt, const struct sockaddr *gw)
+{
+	struct rt *rt, *kr;
+
+	/* A route we still want through the old gateway would go
+	 * with it. */
+	RB_TREE_FOREACH(rt, routes) {
+		if (rt->rt_ifp == krt->rt_ifp &&
+		    sa_cmp(&rt->rt_gateway, &krt->rt_gateway) == 0)
+			return false;
+	}
+
+	RB_TREE_FOREACH(kr, &ctx->kroutes) {
+		if (kr->rt_nhid != krt->rt_nhid)
+			continue;
+		RB_TREE_FOREACH(rt, routes) {
+			if (rt_compare_os(NULL, rt, kr) == 0 &&
+			    rt->rt_ifp == kr->rt_ifp)
+				break;
+		}
+		if (rt == NULL ||
+		    !rt_ifdirty(rt->rt_ifp) ||
+		    rt->rt_flags & RTF_REJECT ||
+		    rt->rt_metric != kr->rt_metric ||
+		    sa_cmp(&rt->rt_gateway, gw) != 0)
+			return false;
+	}
+	return true;
+}
+
+/* When a gateway changes, move the nexthop its routes share rather
+ * than replacing each route. Our copies of the routes are moved too
+ * so rt_doroute finds nothing to change. */
+static void
+rt_nhmove(struct dhcpcd_ctx *ctx, rb_tree_t *routes, int af)
+{
+	struct rt *rt, *krt, *kr, *or;
+	union sa_ss ogw;
+	uint32_t nhid;
+
+	if ((ctx->rt_kvalid & RT_AFBIT(af)) != RT_AFBIT(af))
+		return;
+
+	RB_TREE_FOREACH(rt, routes) {
+		if (!rt_isaf(rt, af) || !rt_ifdirty(rt->rt_ifp) ||
+#ifdef HAVE_ROUTE_MULTIPATH
+		    /* Each path has its own gateway. */
+		    rt->rt_mpath != NULL ||
+#endif
+		    sa_is_unspecified(&rt->rt_gateway))
+			continue;
+		krt = rb_tree_find_node(&ctx->kroutes, rt);
+		if (krt == NULL || krt->rt_nhid == 0 ||
+		    krt->rt_ifp != rt->rt_ifp ||
+		    krt->rt_metric != rt->rt_metric ||
+		    sa_cmp(&krt->rt_gateway, &rt->rt_gateway) == 0 ||
+		    !rt_nhcanmove(ctx, routes, krt, &rt->rt_gateway))
+			continue;
+
+		nhid = krt->rt_nhid;
+		/* The routes are replaced as normal if it cannot move. */
+		if (if_nexthop_move(ctx, nhid, &rt->rt_gateway) == -1) {
+			if (errno != EEXIST && errno != ENETUNREACH)
+				logerr("if_nexthop_move");
+			continue;
+		}
+		ctx->stats.route_nhmoves++;
+		memcpy(&ogw, &krt->rt_ss_gateway, sizeof(ogw));
+		RB_TREE_FOREACH(kr, &ctx->kroutes) {
+			if (kr->rt_nhid != nhid)
+				continue;
+			memcpy(&kr->rt_ss_gateway, &rt->rt_ss_gateway,
+			    sizeof(kr->rt_ss_gateway));
+			or = rb_tree_find_node(&ctx->routes, kr);
+			if (or != NULL && or->rt_ifp == kr->rt_ifp &&
+			    sa_cmp(&or->rt_gateway, &ogw.sa) == 0)
+			{
+				memcpy(&or->rt_ss_gateway, &rt->rt_ss_gateway,
+				    sizeof(or->rt_ss_gateway));
+				rt_desc("changing", or);
+			}
+		}
+	}
+}
+#endif
+
+/* Is the route one we install? */
+static bool
+rt_configure(const struct rt *rt)
+{
+	const struct interface *ifp = rt->rt_ifp;
+
+	if (ifp->active)
+		return ifp->options->options & DHCPCD_CONFIGURE;
+	return ifp->ctx->options & DHCPCD_CONFIGURE;
+}
+
+#ifdef HAVE_ROUTE_MULTIPATH
+/* Can rt be another path of the multipath route mp? */
+static bool
+rt_mpcan(const struct rt *mp, const struct rt *rt)
+{
+	const struct rt *p;
+	int npaths = 0;
+
+	if (rt_nogateway(mp) || rt_nogateway(rt) ||
+	    (mp->rt_flags | rt->rt_flags) & RTF_REJECT ||
+	    (mp->rt_dflags | rt->rt_dflags) & RTDF_FAKE ||
+	    sa_is_unspecified(&mp->rt_gateway) ||
+	    sa_is_unspecified(&rt->rt_gateway) ||
+	    mp->rt_metric != rt->rt_metric ||
+#ifdef HAVE_ROUTE_PREF
+	    mp->rt_pref != rt->rt_pref ||
+#endif
+	    mp->rt_mtu != rt->rt_mtu)
+		return false;
+
+	for (p = mp; p != NULL; p = p->rt_mpath) {
+		if (p->rt_ifp == rt->rt_ifp &&
+		    sa_cmp(&p->rt_gateway, &rt->rt_gateway) == 0)
+			return false;
+		npaths++;
+	}
+	return npaths < RT_MAXPATHS;
+}
+
+/*
+ * Merge routes to the same destination with the same metric and
+ * preference into one multipath route so the kernel spreads
+ * connections over all the gateways rather than using just one.
+ * The merged route takes the place of its last path in the build
+ * order so the routes each gateway needs are added first.
+ * The source address is left for the kernel to pick for each path.
+ */
+static void
+rt_mpmerge(struct dhcpcd_ctx *ctx, rb_tree_t *routes, int af)
+{
+	rb_tree_t heads;
+	struct rt *rt, *rtn, *mp, **tail;
+
+	rb_tree_init(&heads, &rt_compare_os_ops);
+	RB_TREE_FOREACH_SAFE(rt, routes, rtn) {
+		if (!rt_isaf(rt, af) || !rt_configure(rt))
+			continue;
+		rb_tree_remove_node(routes, rt);
+		mp = rb_tree_insert_node(&heads, rt);
+		if (mp == rt)
+			continue;
+		if (!rt_mpcan(mp, rt)) {
+			/* rt_build will find it shadowed as before. */
+			rb_tree_insert_node(routes, rt);
+			continue;
+		}
+
+		for (tail = &mp->rt_mpath; *tail != NULL;
+		    tail = &(*tail)->rt_mpath)
+			;
+		*tail = rt;
+		mp->rt_order = rt->rt_order;
+		memset(&mp->rt_ss_ifa, 0, sizeof(mp->rt_ss_ifa));
+		if (mp->rt_ifp != rt->rt_ifp)
+			ctx->rt_shadowed |= RT_AFBIT(af);
+	}
+
+	while ((rt = RB_TREE_MIN(&heads)) != NULL) {
+		rb_tree_remove_node(&heads, rt);
+		rb_tree_insert_node(routes, rt);
+	}
+}
+#endif
+
 void
 rt_build(struct dhcpcd_ctx *ctx, int af)
 {
-	rb_tree_t routes, added, kroutes;
-	struct rt *rt, *rtn;
+	rb_tree_t routes, added;
+	struct rt *rt, *rtn, *or;
 	unsigned long long o;
+	bool scoped, batch;
+	rb_tree_t queued, deleted;
 
 	rb_tree_init(&routes, &rt_compare_proto_ops);
 	rb_tree_init(&added, &rt_compare_os_ops);
-	rb_tree_init(&kroutes, &rt_compare_os_ops);
-	if (if_initrt(ctx, &kroutes, af) != 0)
-		logerr("%s: if_initrt", __func__);
-	ctx->rt_order = 0;
+	TRACE_EVENT(ctx, TRACE_RT_BEGIN, NULL, (uint32_t)af);
+	ctx->stats.route_builds++;
+	if ((ctx->rt_kvalid & RT_AFBIT(af)) != RT_AFBIT(af)) {
+		rt_headclear0(ctx, &ctx->kroutes, af);
+		ctx->stats.route_dumps++;
+		if (if_initrt(ctx, &ctx->kroutes, af) != 0)
+			logerr("%s: if_initrt", __func__);
+		else
+			ctx->rt_kvalid |= RT_AFBIT(af);
+	}
 	ctx->options |= DHCPCD_RTBUILD;
 
+again:
+	ctx->rt_order = 0;
+	scoped = ctx->rt_scoped;
 #ifdef INET
 	if (!inet_getroutes(ctx, &routes))
 		goto getfail;
@@ -725,31 +1367,59 @@ rt_build(struct dhcpcd_ctx *ctx, int af)
 		goto getfail;
 #endif
 
+	/* The route generators clear rt_scoped if routes for the
+	 * clean interfaces could change as well. */
+	if (scoped &&
+	    (!ctx->rt_scoped || rt_scopeclash(ctx, &routes, af)))
+	{
+		ctx->rt_scoped = false;
+		rt_headclear(&routes, AF_UNSPEC);
+		goto again;
+	}
+	if (!ctx->rt_scoped)
+		ctx->rt_shadowed &= ~RT_AFBIT(af);
+
+#ifdef HAVE_ROUTE_MULTIPATH
+	if (ctx->rt_multipath)
+		rt_mpmerge(ctx, &routes, af);
+#endif
+
+#ifdef HAVE_ROUTE_NEXTHOP
+	rt_nhmove(ctx, &routes, af);
+#endif
+
 #ifdef BSD
 	/* Rewind the miss filter */
 	ctx->rt_missfilterlen = 0;
+	if (ctx->rt_scoped) {
+		RB_TREE_FOREACH(rt, &ctx->routes) {
+			if (!rt_ifdirty(rt->rt_ifp) && rt_is_default(rt) &&
+			    if_missfilter(rt->rt_ifp, &rt->rt_gateway) == -1)
+				logerr("if_missfilter");
+		}
+	}
 #endif
 
 	RB_TREE_FOREACH_SAFE(rt, &routes, rtn) {
-		if (rt->rt_ifp->active) {
-			if (!(rt->rt_ifp->options->options & DHCPCD_CONFIGURE))
-				continue;
-		} else if (!(ctx->options & DHCPCD_CONFIGURE))
+		if (!rt_configure(rt))
 			continue;
 #ifdef BSD
 		if (rt_is_default(rt) &&
 		    if_missfilter(rt->rt_ifp, &rt->rt_gateway) == -1)
 			logerr("if_missfilter");
 #endif
-		if ((rt->rt_dest.sa_family != af &&
-		    rt->rt_dest.sa_family != AF_UNSPEC) ||
-		    (rt->rt_gateway.sa_family != af &&
-		    rt->rt_gateway.sa_family != AF_UNSPEC))
+		if (!rt_isaf(rt, af))
 			continue;
-		/* Is this route already in our table? */
-		if (rb_tree_find_node(&added, rt) != NULL)
+		/* Is this route already in our table?
+		 * If another interface has it then only a full build
+		 * can work out which one wins. */
+		if ((or = rb_tree_find_node(&added, rt)) != NULL) {
+			if (or->rt_ifp != rt->rt_ifp)
+				ctx->rt_shadowed |=
+				    RT_AFBIT(rt->rt_dest.sa_family);
 			continue;
-		if (rt_doroute(&kroutes, rt)) {
+		}
+		if (rt_doroute(rt)) {
 			rb_tree_remove_node(&routes, rt);
 			if (rb_tree_insert_node(&added, rt) != rt) {
 				errno = EEXIST;
@@ -764,12 +1434,28 @@ rt_build(struct dhcpcd_ctx *ctx, int af)
 		logerr("if_missfilter_apply");
 #endif
 
-	/* Remove old routes we used to manage. */
+	/* Add or change the routes rt_add queued and then remove old routes
+	 * we used to manage, sending them all in one batch if we can.
+	 * The additions go in the order generated as a gateway needs
+	 * its subnet route first. */
+	rb_tree_init(&queued, &rt_compare_proto_ops);
+	rb_tree_init(&deleted, &rt_compare_os_ops);
+	RB_TREE_FOREACH_SAFE(rt, &added, rtn) {
+		if (rt->rt_dflags & RTDF_QUEUED) {
+			rb_tree_remove_node(&added, rt);
+			rb_tree_insert_node(&queued, rt);
+		}
+	}
+	batch = if_batch_begin(ctx) != -1;
+	RB_TREE_FOREACH_SAFE(rt, &queued, rtn) {
+		if (rt_ifroute(rt->rt_dflags & RTDF_CHANGE ?
+		    RTM_CHANGE : RTM_ADD, rt) == -1)
+			rt_addqueued(&queued, &added, rt, false);
+		else if (!batch)
+			rt_addqueued(&queued, &added, rt, true);
+	}
 	RB_TREE_FOREACH_REVERSE_SAFE(rt, &ctx->routes, rtn) {
-		if ((rt->rt_dest.sa_family != af &&
-		    rt->rt_dest.sa_family != AF_UNSPEC) ||
-		    (rt->rt_gateway.sa_family != af &&
-		    rt->rt_gateway.sa_family != AF_UNSPEC))
+		if (!rt_isaf(rt, af) || !rt_ifdirty(rt->rt_ifp))
 			continue;
 		rb_tree_remove_node(&ctx->routes, rt);
 		if (rb_tree_find_node(&added, rt) == NULL) {
@@ -779,12 +1465,20 @@ rt_build(struct dhcpcd_ctx *ctx, int af)
 			if ((o &
 				(DHCPCD_EXITING | DHCPCD_PERSISTENT)) !=
 				(DHCPCD_EXITING | DHCPCD_PERSISTENT))
+			{
 				rt_delete(rt);
+				if (batch) {
+					rb_tree_insert_node(&deleted, rt);
+					continue;
+				}
+			}
 		}
 		rt_free(rt);
 	}
+	if (batch)
+		rt_endbatch(ctx, &queued, &added, &deleted);
 
-	/* XXX This needs to be optimised. */
+	/* A scoped build only has the dirty interfaces to put back. */
 	while ((rt = RB_TREE_MIN(&added)) != NULL) {
 		rb_tree_remove_node(&added, rt);
 		if (rb_tree_insert_node(&ctx->routes, rt) != rt) {
@@ -794,7 +1488,131 @@ rt_build(struct dhcpcd_ctx *ctx, int af)
 		}
 	}
 
+#ifdef HAVE_ROUTE_NEXTHOP
+	if ((ctx->rt_kvalid & RT_AFBIT(af)) == RT_AFBIT(af))
+		if_nexthop_prune(ctx, af);
+#endif
+
 getfail:
+	ctx->rt_scoped = false;
 	rt_headclear(&routes, AF_UNSPEC);
-	rt_headclear(&kroutes, AF_UNSPEC);
+	TRACE_EVENT(ctx, TRACE_RT_END, NULL, (uint32_t)af);
+}
+
+/* Rebuild routes after a change to a single interface.
+ * Routes for the other interfaces are kept as they are unless
+ * they share a destination, in which case we need a full build
+ * to work out which interface the route belongs to. */
+void
+rt_buildif(struct interface *ifp, int af)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+
+	ifp->rt_dirty = true;
+	ctx->rt_scoped = !(ctx->rt_shadowed & RT_AFBIT(af));
+	rt_build(ctx, af);
+	ifp->rt_dirty = false;
+}
+
+/*
+ * One event can ask for several builds of the same family: a netlink
+ * message carrying many addresses, or an RA whose options each change
+ * something. Rather than building each time, rt_defer and rt_deferif
+ * note the family and the interface and rt_buildpending does it once
+ * when the events seen in this pass of the event loop have been handled.
+ * It runs sooner when something must see the routes as they should
+ * be: before the script runs, before an interface is freed, and
+ * when exiting.
+ */
+static void
+rt_buildpendingcb(void *arg)
+{
+
+	rt_buildpending(arg);
+}
+
+void
+rt_buildpending(struct dhcpcd_ctx *ctx)
+{
+	struct interface *ifp;
+	unsigned int pending = ctx->rt_pending, full = ctx->rt_pendfull;
+	int af;
+
+	if (pending == 0)
+		return;
+	eloop_timeout_delete(ctx->eloop, rt_buildpendingcb, ctx);
+	ctx->rt_pending = ctx->rt_pendfull = 0;
+
+	/* Both families can be built together unless only one of
+	 * them has to be built in full. */
+	if (pending == RT_AFBIT(AF_UNSPEC) && (full == 0 || full == pending)) {
+		ctx->rt_scoped = full == 0 &&
+		    !(ctx->rt_shadowed & RT_AFBIT(AF_UNSPEC));
+		rt_build(ctx, AF_UNSPEC);
+	} else {
+		for (af = AF_INET; ; af = AF_INET6) {
+			if (pending & RT_AFBIT(af)) {
+				ctx->rt_scoped = !(full & RT_AFBIT(af)) &&
+				    !(ctx->rt_shadowed & RT_AFBIT(af));
+				rt_build(ctx, af);
+			}
+			if (af == AF_INET6)
+				break;
+		}
+	}
+
+	if (ctx->ifaces != NULL) {
+		TAILQ_FOREACH(ifp, ctx->ifaces, next)
+			ifp->rt_dirty = false;
+	}
+}
+
+static void
+rt_defer0(struct dhcpcd_ctx *ctx, int af, bool full)
+{
+
+	/* Let ipv6_handleifa know routes are being taken care of. */
+	ctx->options |= DHCPCD_RTBUILD;
+	if (ctx->rt_pending & RT_AFBIT(af) &&
+	    (!full || ctx->rt_pendfull & RT_AFBIT(af)))
+		ctx->stats.route_coalesced++;
+	if (full)
+		ctx->rt_pendfull |= RT_AFBIT(af);
+	if (ctx->rt_pending == 0 &&
+	    eloop_timeout_add_sec(ctx->eloop, 0, rt_buildpendingcb, ctx) == -1)
+	{
+		logerr(__func__);
+		ctx->rt_pending |= RT_AFBIT(af);
+		rt_buildpending(ctx);
+		return;
+	}
+	ctx->rt_pending |= RT_AFBIT(af);
+}
+
+/* rt_build when this pass of the event loop is done. */
+void
+rt_defer(struct dhcpcd_ctx *ctx, int af)
+{
+
+	if (ctx->options & DHCPCD_EXITING) {
+		rt_buildpending(ctx);
+		rt_build(ctx, af);
+		return;
+	}
+	rt_defer0(ctx, af, true);
+}
+
+/* rt_buildif when this pass of the event loop is done. */
+void
+rt_deferif(struct interface *ifp, int af)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+
+	if (ctx->options & DHCPCD_EXITING) {
+		rt_buildpending(ctx);
+		rt_buildif(ifp, af);
+		return;
+	}
+	ifp->rt_dirty = true;
+	rt_defer0(ctx, af, false);
 }
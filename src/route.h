@@ -65,8 +65,17 @@
 # if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
 #  define HAVE_ROUTE_PREF
 # endif
+# if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+#  define HAVE_ROUTE_NEXTHOP
+# endif
+# define HAVE_ROUTE_MULTIPATH
+/* RTM_CHANGE adds the route if it has gone. */
+# define HAVE_ROUTE_REPLACE
 #endif
 
+/* Most paths dhcpcd puts in one multipath route. */
+#define RT_MAXPATHS	8
+
 #if defined(__OpenBSD__) || defined (__sun)
 #  define ROUTE_PER_GATEWAY
 /* XXX dhcpcd doesn't really support this yet.
@@ -110,6 +119,12 @@ struct rt {
 #define RTPREF_LOW	(-1)
 #define RTPREF_RESERVED	(-2)
 #define RTPREF_INVALID	(-3)	/* internal */
+#ifdef HAVE_ROUTE_NEXTHOP
+	uint32_t		rt_nhid;	/* kernel nexthop object */
+#endif
+#ifdef HAVE_ROUTE_MULTIPATH
+	struct rt		*rt_mpath;	/* next path, see rt_mpmerge */
+#endif
 	unsigned int		rt_dflags;
 #define	RTDF_IFA_ROUTE		0x01		/* Address generated route */
 #define	RTDF_FAKE		0x02		/* Maybe us on lease reboot */
@@ -118,6 +133,8 @@ struct rt {
 #define	RTDF_DHCP		0x10		/* DHCP route */
 #define	RTDF_STATIC		0x20		/* Configured in dhcpcd */
 #define	RTDF_GATELINK		0x40		/* Gateway is on link */
+#define	RTDF_QUEUED		0x80		/* rt_build to add */
+#define	RTDF_CHANGE		0x100		/* rt_build to change */
 	size_t			rt_order;
 	rb_node_t		rt_tree;
 };
@@ -128,6 +145,9 @@ extern const rb_tree_ops_t rt_compare_proto_ops;
 void rt_init(struct dhcpcd_ctx *);
 void rt_dispose(struct dhcpcd_ctx *);
 void rt_free(struct rt *);
+#ifdef HAVE_ROUTE_MULTIPATH
+void rt_mpfree(struct rt *);
+#endif
 void rt_freeif(struct interface *);
 bool rt_is_default(const struct rt *);
 void rt_headclear0(struct dhcpcd_ctx *, rb_tree_t *, int);
@@ -140,6 +160,12 @@ struct rt * rt_proto_add_ctx(rb_tree_t *, struct rt *, struct dhcpcd_ctx *);
 struct rt * rt_proto_add(rb_tree_t *, struct rt *);
 int rt_cmp_dest(const struct rt *, const struct rt *);
 void rt_recvrt(int, const struct rt *, pid_t);
+void rt_kinvalidate(struct dhcpcd_ctx *, int);
+bool rt_ifdirty(const struct interface *);
 void rt_build(struct dhcpcd_ctx *, int);
+void rt_buildif(struct interface *, int);
+void rt_defer(struct dhcpcd_ctx *, int);
+void rt_deferif(struct interface *, int);
+void rt_buildpending(struct dhcpcd_ctx *);
 
 #endif
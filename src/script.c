@@ -26,6 +26,7 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
@@ -47,8 +48,10 @@
 #include "config.h"
 #include "common.h"
 #include "dhcp.h"
+#include "dhcp-common.h"
 #include "dhcp6.h"
 #include "eloop.h"
+#include "hooks.h"
 #include "if.h"
 #include "if-options.h"
 #include "ipv4ll.h"
@@ -59,6 +62,10 @@
 
 #define DEFAULT_PATH	"/usr/bin:/usr/sbin:/bin:/sbin"
 
+/* Events are wanted by the script or our builtin hooks. */
+#define	SCRIPT_RUNS(ctx)	\
+	((ctx)->script != NULL || (ctx)->builtin_hooks != 0)
+
 static const char * const if_params[] = {
 	"interface",
 	"protocol",
@@ -86,27 +93,36 @@ if_printoptions(void)
 		printf(" -  %s\n", *p);
 }
 
-pid_t
-script_exec(char *const *argv, char *const *env)
+static pid_t
+script_spawn(char *const *argv, char *const *env,
+    const posix_spawn_file_actions_t *fa, short flags)
 {
 	pid_t pid = 0;
 	posix_spawnattr_t attr;
 	int r;
 #ifdef USE_SIGNALS
 	size_t i;
-	short flags;
 	sigset_t defsigs;
-#else
-	UNUSED(ctx);
 #endif
 
 	/* posix_spawn is a safe way of executing another image
-	 * and changing signals back to how they should be. */
-	if (posix_spawnattr_init(&attr) == -1)
+	 * and changing signals back to how they should be.
+	 * It also avoids copying our page tables like fork does,
+	 * so the cost of starting a script does not grow with us. */
+	if ((r = posix_spawnattr_init(&attr)) != 0) {
+		errno = r;
 		return -1;
+	}
+	posix_spawnattr_setpgroup(&attr, 0);
 #ifdef USE_SIGNALS
-	flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	flags |= POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#endif
+#ifdef POSIX_SPAWN_USEVFORK
+	/* Older glibc only uses vfork when asked. */
+	flags |= POSIX_SPAWN_USEVFORK;
+#endif
 	posix_spawnattr_setflags(&attr, flags);
+#ifdef USE_SIGNALS
 	sigemptyset(&defsigs);
 	posix_spawnattr_setsigmask(&attr, &defsigs);
 	for (i = 0; i < dhcpcd_signals_len; i++)
@@ -116,7 +132,7 @@ script_exec(char *const *argv, char *const *env)
 	posix_spawnattr_setsigdefault(&attr, &defsigs);
 #endif
 	errno = 0;
-	r = posix_spawn(&pid, argv[0], NULL, &attr, argv, env);
+	r = posix_spawn(&pid, argv[0], fa, &attr, argv, env);
 	posix_spawnattr_destroy(&attr);
 	if (r) {
 		errno = r;
@@ -125,6 +141,218 @@ script_exec(char *const *argv, char *const *env)
 	return pid;
 }
 
+pid_t
+script_exec(char *const *argv, char *const *env)
+{
+
+	return script_spawn(argv, env, NULL, 0);
+}
+
+/*
+ * With hook_runner the script is started once with --runner.
+ * Its stdin and fd 3 are one end of a socket pair and each event is
+ * written as shell assignments, one per line, ending with a line
+ * holding a single dot. The runner replies with the exit status.
+ */
+static int
+script_runner_start(struct dhcpcd_ctx *ctx)
+{
+	char *const argv[] = { ctx->script, UNCONST("--runner"), NULL };
+	char *const env[] = { UNCONST("PATH=" DEFAULT_PATH), NULL };
+	posix_spawn_file_actions_t fa;
+	int fds[2], r;
+	pid_t pid;
+
+	if (xsocketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+		return -1;
+	if ((r = posix_spawn_file_actions_init(&fa)) != 0) {
+		errno = r;
+		goto err;
+	}
+	if ((r = posix_spawn_file_actions_adddup2(&fa, fds[1],
+	    STDIN_FILENO)) != 0 ||
+	    (r = posix_spawn_file_actions_adddup2(&fa, fds[1], 3)) != 0)
+	{
+		posix_spawn_file_actions_destroy(&fa);
+		errno = r;
+		goto err;
+	}
+	/* The runner outlives each event, so keep it out of our process
+	 * group or a signal meant for us would kill it before the
+	 * STOP hooks can run. */
+	pid = script_spawn(argv, env, &fa, POSIX_SPAWN_SETPGROUP);
+	posix_spawn_file_actions_destroy(&fa);
+	if (pid == -1)
+		goto err;
+
+	close(fds[1]);
+	ctx->hook_runner_fd = fds[0];
+	ctx->hook_runner_pid = pid;
+	logdebugx("started hook runner on PID %d", pid);
+	return 0;
+
+err:
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+}
+
+void
+script_runner_stop(struct dhcpcd_ctx *ctx)
+{
+
+	if (ctx->hook_runner_fd == -1)
+		return;
+
+	/* The runner exits when it reads EOF. */
+	close(ctx->hook_runner_fd);
+	ctx->hook_runner_fd = -1;
+	if (ctx->hook_runner_pid == 0)
+		return;
+	while (waitpid(ctx->hook_runner_pid, NULL, 0) == -1) {
+		/* ECHILD if SIGCHLD reaped it first */
+		if (errno != EINTR)
+			break;
+	}
+	ctx->hook_runner_pid = 0;
+}
+
+static bool
+script_validname(const char *name, size_t len)
+{
+	size_t i;
+
+	if (len == 0 || isdigit((unsigned char)name[0]))
+		return false;
+	for (i = 0; i < len; i++) {
+		if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+			return false;
+	}
+	return true;
+}
+
+/* Quote env as export lines the runner can eval. */
+static ssize_t
+script_runner_env(struct dhcpcd_ctx *ctx, char *const *env)
+{
+	char *const *envp;
+	const char *var, *eq, *p;
+	char *bp;
+	size_t n;
+
+	ctx->opt_bufpos = 0;
+	for (envp = env; *envp != NULL; envp++) {
+		var = *envp;
+		/* The shell would not import these either. */
+		if ((eq = strchr(var, '=')) == NULL ||
+		    !script_validname(var, (size_t)(eq - var)))
+			continue;
+		n = (size_t)(eq - var);
+		if ((bp = dhcp_optbuf_reserve(ctx, n + 10)) == NULL)
+			return -1;
+		memcpy(bp, "export ", 7);
+		memcpy(bp + 7, var, n);
+		memcpy(bp + 7 + n, "='", 2);
+		ctx->opt_bufpos += n + 9;
+		for (p = eq + 1; *p != '\0'; p += n) {
+			n = strcspn(p, "'\n");
+			if (n != 0) {
+				if ((bp = dhcp_optbuf_reserve(ctx, n)) == NULL)
+					return -1;
+				memcpy(bp, p, n);
+				ctx->opt_bufpos += n;
+			}
+			if (p[n] == '\0')
+				break;
+			/* A newline would end the line and the dot which
+			 * ends the event could be mistaken for a value. */
+			if (dhcp_optbuf_puts(ctx, p[n] == '\'' ?
+			    "'\\''" : "'\"$_nl\"'") == -1)
+				return -1;
+			n++;
+		}
+		if (dhcp_optbuf_puts(ctx, "'\n") == -1)
+			return -1;
+	}
+	if (dhcp_optbuf_puts(ctx, ".\n") == -1)
+		return -1;
+	return (ssize_t)ctx->opt_bufpos;
+}
+
+/*
+ * Run one event through the hook runner, starting it if needed.
+ * Returns the exit status of the hooks or -1 if the runner could
+ * not be used, in which case the caller should execute the script.
+ */
+static int
+script_runner_run(struct dhcpcd_ctx *ctx, char *const *env)
+{
+	ssize_t len, r;
+	size_t pos;
+	char buf[16], *nl;
+	int status, e;
+
+	if (ctx->hook_runner_fd == -1 && script_runner_start(ctx) == -1) {
+		logerr("%s: %s", __func__, ctx->script);
+		goto disable;
+	}
+
+	if ((len = script_runner_env(ctx, env)) == -1) {
+		logerr(__func__);
+		return -1;
+	}
+	for (pos = 0; pos < (size_t)len; pos += (size_t)r) {
+		/* SIGPIPE is ignored so a dead runner is just EPIPE */
+		r = write(ctx->hook_runner_fd, ctx->opt_buf + pos,
+		    (size_t)len - pos);
+		if (r == -1) {
+			if (errno == EINTR)
+				r = 0;
+			else {
+				logerr("%s: write", __func__);
+				goto stop;
+			}
+		}
+	}
+
+	/* Wait for the hooks to finish, as we would for the script */
+	pos = 0;
+	for (;;) {
+		r = read(ctx->hook_runner_fd, buf + pos, sizeof(buf) - pos - 1);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1) {
+			logerr("%s: read", __func__);
+			goto stop;
+		}
+		if (r == 0) {
+			logerrx("%s: hook runner exited", __func__);
+			goto stop;
+		}
+		pos += (size_t)r;
+		buf[pos] = '\0';
+		if ((nl = strchr(buf, '\n')) != NULL)
+			break;
+		if (pos == sizeof(buf) - 1) {
+			logerrx("%s: invalid reply", __func__);
+			goto stop;
+		}
+	}
+	*nl = '\0';
+	status = (int)strtoi(buf, NULL, 10, 0, 255, &e);
+	if (e) {
+		logerrx("%s: invalid reply", __func__);
+		goto stop;
+	}
+	return status;
+
+stop:
+	script_runner_stop(ctx);
+disable:
+	ctx->hook_runner = false;
+	return -1;
+}
+
 #ifdef INET
 static int
 append_config(FILE *fp, const char *prefix, const char *const *config)
@@ -176,46 +404,42 @@ efprintf(FILE *fp, const char *fmt, ...)
 	return r;
 }
 
+/*
+ * Point script_env at each NUL terminated string in buf, in one pass.
+ * The array is kept between calls so it only grows when an event has
+ * more variables than any before it.
+ */
 char **
 script_buftoenv(struct dhcpcd_ctx *ctx, char *buf, size_t len)
 {
-	char **env, **envp, *bufp, *endp;
-	size_t nenv;
+	char **env, *bufp, *endp, *nul;
+	size_t nenv, n;
 
-	/* Count the terminated env strings.
-	 * Assert that the terminations are correct. */
 	nenv = 0;
 	endp = buf + len;
-	for (bufp = buf; bufp < endp; bufp++) {
-		if (*bufp == '\0') {
-#ifndef NDEBUG
-			if (bufp + 1 < endp)
-				assert(*(bufp + 1) != '\0');
-#endif
-			nenv++;
+	for (bufp = buf; bufp < endp; bufp = nul + 1) {
+		nul = memchr(bufp, '\0', (size_t)(endp - bufp));
+		/* The buffer may come from an unprivileged process. */
+		if (nul == NULL) {
+			errno = EINVAL;
+			return NULL;
 		}
+		assert(nul != bufp || bufp == buf);
+		if (nenv == ctx->script_envlen) {
+			n = nenv == 0 ? 32 : nenv * 2;
+			env = reallocarray(ctx->script_env, n + 1,
+			    sizeof(*env));
+			if (env == NULL)
+				return NULL;
+			ctx->script_env = env;
+			ctx->script_envlen = n;
+			MEMSAMPLE(ctx, MEM_SCRIPT);
+		}
+		ctx->script_env[nenv++] = bufp;
 	}
-	assert(*(bufp - 1) == '\0');
 	if (nenv == 0)
 		return NULL;
-
-	if (ctx->script_envlen < nenv) {
-		env = reallocarray(ctx->script_env, nenv + 1, sizeof(*env));
-		if (env == NULL)
-			return NULL;
-		ctx->script_env = env;
-		ctx->script_envlen = nenv;
-	}
-
-	bufp = buf;
-	envp = ctx->script_env;
-	*envp++ = bufp++;
-	endp--; /* Avoid setting the last \0 to an invalid pointer */
-	for (; bufp < endp; bufp++) {
-		if (*bufp == '\0')
-			*envp++ = bufp + 1;
-	}
-	*envp = NULL;
+	ctx->script_env[nenv] = NULL;
 
 	return ctx->script_env;
 }
@@ -233,6 +457,7 @@ make_env(struct dhcpcd_ctx *ctx, const struct interface *ifp,
 	int af;
 	bool is_stdin = ifp->name[0] == '\0';
 	const char *if_up, *if_down;
+	bool skip;
 	rb_tree_t ifaces;
 	struct rt *rt;
 #ifdef INET
@@ -245,33 +470,35 @@ make_env(struct dhcpcd_ctx *ctx, const struct interface *ifp,
 	const struct dhcp6_state *d6_state;
 #endif
 
-#ifdef HAVE_OPEN_MEMSTREAM
+	/* The stream and the buffers behind it are kept between events,
+	 * so in the steady state building the environment allocates
+	 * nothing. */
 	if (ctx->script_fp == NULL) {
+#ifdef HAVE_OPEN_MEMSTREAM
 		fp = open_memstream(&ctx->script_buf, &ctx->script_buflen);
 		if (fp == NULL)
 			goto eexit;
+#else
+		char tmpfile[] = "/tmp/dhcpcd-script-env-XXXXXX";
+		int tmpfd;
+
+		tmpfd = mkstemp(tmpfile);
+		if (tmpfd == -1) {
+			logerr("%s: mkstemp", __func__);
+			return -1;
+		}
+		unlink(tmpfile);
+		fp = fdopen(tmpfd, "w+");
+		if (fp == NULL) {
+			close(tmpfd);
+			goto eexit;
+		}
+#endif
 		ctx->script_fp = fp;
 	} else {
 		fp = ctx->script_fp;
 		rewind(fp);
 	}
-#else
-	char tmpfile[] = "/tmp/dhcpcd-script-env-XXXXXX";
-	int tmpfd;
-
-	fp = NULL;
-	tmpfd = mkstemp(tmpfile);
-	if (tmpfd == -1) {
-		logerr("%s: mkstemp", __func__);
-		return -1;
-	}
-	unlink(tmpfile);
-	fp = fdopen(tmpfd, "w+");
-	if (fp == NULL) {
-		close(tmpfd);
-		goto eexit;
-	}
-#endif
 
 	if (!(ifp->ctx->options & DHCPCD_DUMPLEASE)) {
 		/* Needed for scripts */
@@ -529,11 +756,26 @@ dumplease:
 #endif
 
 	/* Add our base environment */
+	skip = false;
 	if (ifo->environ) {
-		for (i = 0; ifo->environ[i] != NULL; i++)
+		for (i = 0; ifo->environ[i] != NULL; i++) {
+			if (ctx->builtin_hooks != 0 &&
+			    strncmp(ifo->environ[i], "skip_hooks=", 11) == 0)
+			{
+				if (hooks_skip(ctx, fp,
+				    ifo->environ[i] + 11) == -1)
+					goto eexit;
+				skip = true;
+				continue;
+			}
 			if (efprintf(fp, "%s", ifo->environ[i]) == -1)
 				goto eexit;
+		}
 	}
+	/* Don't run the hooks we run ourselves. */
+	if (ctx->builtin_hooks != 0 && !skip &&
+	    hooks_skip(ctx, fp, NULL) == -1)
+		goto eexit;
 
 	/* Convert buffer to argv */
 	fflush(fp);
@@ -556,42 +798,27 @@ dumplease:
 	rewind(fp);
 	if (fread(ctx->script_buf, sizeof(char), buf_len, fp) != buf_len)
 		goto eexit;
-	fclose(fp);
-	fp = NULL;
 #endif
 
+	MEMSAMPLE(ctx, MEM_SCRIPT);
 	if (is_stdin)
 		return buf_pos;
 
-	if (script_buftoenv(ctx, ctx->script_buf, (size_t)buf_pos) == NULL)
-		goto eexit;
-
 	return buf_pos;
 
 eexit:
 	logerr(__func__);
-#ifndef HAVE_OPEN_MEMSTREAM
-	if (fp != NULL)
-		fclose(fp);
-#endif
 	return -1;
 }
 
+/*
+ * Call cb with the reason for each protocol running on ifp.
+ * Returns the number of reasons, or -1 if cb failed.
+ * cb may be NULL just to count them.
+ */
 static int
-send_interface1(struct fd_list *fd, const struct interface *ifp,
-    const char *reason)
-{
-	struct dhcpcd_ctx *ctx = ifp->ctx;
-	long len;
-
-	len = make_env(ifp->ctx, ifp, reason);
-	if (len == -1)
-		return -1;
-	return control_queue(fd, ctx->script_buf, (size_t)len);
-}
-
-int
-send_interface(struct fd_list *fd, const struct interface *ifp, int af)
+script_reasons(const struct interface *ifp, int af,
+    int (*cb)(const struct interface *, const char *, void *), void *arg)
 {
 	int retval = 0;
 #ifdef INET
@@ -605,93 +832,350 @@ send_interface(struct fd_list *fd, const struct interface *ifp, int af)
 #define	AF_LINK	AF_PACKET
 #endif
 
-	if (af == AF_UNSPEC || af == AF_LINK) {
-		const char *reason;
+#define	REASON(r)							      \
+	do {								      \
+		if (cb != NULL && cb(ifp, (r), arg) == -1)		      \
+			return -1;					      \
+		retval++;						      \
+	} while (0 /* CONSTCOND */)
 
+	if (af == AF_UNSPEC || af == AF_LINK) {
 		switch (ifp->carrier) {
 		case LINK_UP:
-			reason = "CARRIER";
+			REASON("CARRIER");
 			break;
 		case LINK_DOWN:
-			reason = "NOCARRIER";
+			REASON("NOCARRIER");
 			break;
 		default:
-			reason = "UNKNOWN";
+			REASON("UNKNOWN");
 			break;
 		}
-		if (fd != NULL) {
-			if (send_interface1(fd, ifp, reason) == -1)
-				retval = -1;
-		} else
-			retval++;
 	}
 
 #ifdef INET
 	if (af == AF_UNSPEC || af == AF_INET) {
 		if (D_STATE_RUNNING(ifp)) {
 			d = D_CSTATE(ifp);
-			if (fd != NULL) {
-				if (send_interface1(fd, ifp, d->reason) == -1)
-					retval = -1;
-			} else
-				retval++;
+			REASON(d->reason);
 		}
 #ifdef IPV4LL
-		if (IPV4LL_STATE_RUNNING(ifp)) {
-			if (fd != NULL) {
-				if (send_interface1(fd, ifp, "IPV4LL") == -1)
-					retval = -1;
-			} else
-				retval++;
-		}
+		if (IPV4LL_STATE_RUNNING(ifp))
+			REASON("IPV4LL");
 #endif
 	}
 #endif
 
 #ifdef INET6
 	if (af == AF_UNSPEC || af == AF_INET6) {
-		if (IPV6_STATE_RUNNING(ifp)) {
-			if (fd != NULL) {
-				if (send_interface1(fd, ifp, "STATIC6") == -1)
-					retval = -1;
-			} else
-				retval++;
-		}
-		if (RS_STATE_RUNNING(ifp)) {
-			if (fd != NULL) {
-				if (send_interface1(fd, ifp,
-				    "ROUTERADVERT") == -1)
-					retval = -1;
-			} else
-				retval++;
-		}
+		if (IPV6_STATE_RUNNING(ifp))
+			REASON("STATIC6");
+		if (RS_STATE_RUNNING(ifp))
+			REASON("ROUTERADVERT");
 #ifdef DHCP6
 		if (D6_STATE_RUNNING(ifp)) {
 			d6 = D6_CSTATE(ifp);
-			if (fd != NULL) {
-				if (send_interface1(fd, ifp, d6->reason) == -1)
-					retval = -1;
-			} else
-				retval++;
+			REASON(d6->reason);
 		}
 #endif
 	}
 #endif
+#undef REASON
 
 	return retval;
 }
 
 static int
-script_run(struct dhcpcd_ctx *ctx, char **argv)
+send_interface1(const struct interface *ifp, const char *reason, void *arg)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct fd_list *fd = arg;
+	long len;
+
+	len = make_env(ifp->ctx, ifp, reason);
+	if (len == -1)
+		return -1;
+	return control_queue(fd, ctx->script_buf, (size_t)len);
+}
+
+int
+send_interface(struct fd_list *fd, const struct interface *ifp, int af)
+{
+
+	return script_reasons(ifp, af, fd != NULL ? send_interface1 : NULL, fd);
+}
+
+static int
+dump_append(struct dump_buf *db, const void *data, size_t len)
+{
+	size_t need, size;
+	char *buf;
+
+	need = db->len + sizeof(len) + len;
+	if (need > db->size) {
+		for (size = db->size != 0 ? db->size : BUFSIZ;
+		    size < need;
+		    size *= 2)
+			;
+		buf = realloc(db->buf, size);
+		if (buf == NULL)
+			return -1;
+		db->buf = buf;
+		db->size = size;
+	}
+	memcpy(db->buf + db->len, &len, sizeof(len));
+	db->len += sizeof(len);
+	if (len != 0) {
+		memcpy(db->buf + db->len, data, len);
+		db->len += len;
+	}
+	return 0;
+}
+
+static int
+dump_interface1(const struct interface *ifp, const char *reason, void *arg)
 {
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	long len;
+
+	len = make_env(ifp->ctx, ifp, reason);
+	if (len == -1)
+		return -1;
+	return dump_append(arg, ctx->script_buf, (size_t)len);
+}
+
+/*
+ * Append the state of ifp to db for dhcpcd --dumpleases.
+ * Each reason is a size_t length followed by its environment, so
+ * every interface can be sent back as one reply.
+ */
+int
+dump_interface(struct dump_buf *db, const struct interface *ifp, int af)
+{
+
+	return script_reasons(ifp, af, dump_interface1, db);
+}
+
+/* A zero length ends the reply. */
+int
+dump_interface_end(struct dump_buf *db)
+{
+
+	return dump_append(db, NULL, 0);
+}
+
+/* Print each environment in a buffer built by dump_interface. */
+int
+script_dumpbulk(const char *buf, size_t len)
+{
+	const char *end = buf + len;
+	size_t l;
+	bool first = true;
+
+	while ((size_t)(end - buf) >= sizeof(l)) {
+		memcpy(&l, buf, sizeof(l));
+		buf += sizeof(l);
+		if (l == 0)	/* terminator */
+			return 0;
+		if (l > (size_t)(end - buf)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (!first)
+			putchar('\n');
+		first = false;
+		if (script_dump(buf, l) == -1)
+			return -1;
+		buf += l;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Scripts are run in the background so a slow hook does not hold up
+ * the event loop. Each event is kept here until its script exits so
+ * that events for one interface still see their scripts run in order.
+ */
+struct script_job {
+	TAILQ_ENTRY(script_job) next;
+	char ifname[IF_NAMESIZE];
 	pid_t pid;
-	int status = 0;
+	char *env;
+	size_t len;
+	struct timespec started;	/* for dhcpcd --stats counters */
+};
+
+/* See script_debounce below. */
+struct script_hold {
+	TAILQ_ENTRY(script_hold) next;
+	struct dhcpcd_ctx *ctx;
+	char ifname[IF_NAMESIZE];
+	int protocol;
+	char reason[16];
+};
+
+static void
+script_freejob(struct dhcpcd_ctx *ctx, struct script_job *job)
+{
+	struct timespec now;
+	unsigned long long usec;
+	unsigned int nsecs;
+
+	if (timespecisset(&job->started) &&
+	    clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+	{
+		usec = eloop_timespec_diff(&now, &job->started, &nsecs);
+		usec = usec * 1000000ULL + nsecs / 1000;
+		TRACE_EVENT(ctx, TRACE_SCRIPT_STOP,
+		    if_find(ctx->ifaces, job->ifname),
+		    usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec);
+		ctx->stats.script_runs++;
+		ctx->stats.script_usec += usec;
+		if (usec > ctx->stats.script_max_usec)
+			ctx->stats.script_max_usec = usec;
+	}
+
+	TAILQ_REMOVE(&ctx->script_jobs, job, next);
+	free(job->env);
+	free(job);
+}
+
+static void
+script_start(struct dhcpcd_ctx *ctx, struct script_job *job)
+{
+	char *const argv[] = { ctx->script, NULL };
+	pid_t pid;
+	int status;
+
+	if (script_buftoenv(ctx, job->env, job->len) == NULL) {
+		logerr(__func__);
+		goto done;
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, &job->started) == -1)
+		timespecclear(&job->started);
+	TRACE_EVENT(ctx, TRACE_SCRIPT_START,
+	    if_find(ctx->ifaces, job->ifname), 0);
+
+	if (ctx->hook_runner) {
+		status = script_runner_run(ctx, ctx->script_env);
+		if (status > 0)
+			logerrx("%s: %s: WEXITSTATUS %d",
+			    job->ifname, argv[0], status);
+		if (status != -1)
+			goto done;
+	}
 
 	pid = script_exec(argv, ctx->script_env);
 	if (pid == -1)
 		logerr("%s: %s", __func__, argv[0]);
 	else if (pid != 0) {
-		/* Wait for the script to finish */
+		job->pid = pid;
+		return;
+	}
+
+done:
+	script_freejob(ctx, job);
+}
+
+/* Start each job which has no earlier job for the same interface. */
+static void
+script_next(struct dhcpcd_ctx *ctx)
+{
+	struct script_job *job, *jobn, *j;
+
+	TAILQ_FOREACH_SAFE(job, &ctx->script_jobs, next, jobn) {
+		if (job->pid != 0)
+			continue;
+		TAILQ_FOREACH(j, &ctx->script_jobs, next) {
+			if (j == job || strcmp(j->ifname, job->ifname) == 0)
+				break;
+		}
+		if (j == job)
+			script_start(ctx, job);
+	}
+}
+
+int
+script_queue(struct dhcpcd_ctx *ctx, const char *env, size_t len)
+{
+	struct script_job *job;
+	const char *ep = env + len, *p;
+
+	if (len == 0)
+		return 0;
+	if (env[len - 1] != '\0') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ctx->builtin_hooks != 0)
+		hooks_run(ctx, env, len);
+	if (ctx->script == NULL)
+		return 0;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		return -1;
+	job->env = malloc(len);
+	if (job->env == NULL) {
+		free(job);
+		return -1;
+	}
+	memcpy(job->env, env, len);
+	job->len = len;
+	for (p = env; p < ep; p += strlen(p) + 1) {
+		if (strncmp(p, "interface=", 10) == 0) {
+			strlcpy(job->ifname, p + 10, sizeof(job->ifname));
+			break;
+		}
+	}
+
+	TAILQ_INSERT_TAIL(&ctx->script_jobs, job, next);
+	script_next(ctx);
+	return 0;
+}
+
+/* Called for each child reaped on SIGCHLD. */
+bool
+script_reap(struct dhcpcd_ctx *ctx, pid_t pid, int status)
+{
+	struct script_job *job;
+
+	TAILQ_FOREACH(job, &ctx->script_jobs, next) {
+		if (job->pid == pid)
+			break;
+	}
+	if (job == NULL)
+		return false;
+
+	if (WIFEXITED(status)) {
+		if (WEXITSTATUS(status))
+			logerrx("%s: %s: WEXITSTATUS %d",
+			    job->ifname, ctx->script, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status))
+		logerrx("%s: %s: %s",
+		    job->ifname, ctx->script, strsignal(WTERMSIG(status)));
+
+	script_freejob(ctx, job);
+	script_next(ctx);
+	return true;
+}
+
+/* Run everything left in the queue to completion, used when exiting. */
+void
+script_wait(struct dhcpcd_ctx *ctx)
+{
+	struct script_job *job;
+	pid_t pid;
+	int status;
+
+	while ((job = TAILQ_FIRST(&ctx->script_jobs)) != NULL) {
+		if (job->pid == 0) {
+			script_next(ctx);
+			continue;
+		}
+		pid = job->pid;
 		while (waitpid(pid, &status, 0) == -1) {
 			if (errno != EINTR) {
 				logerr("%s: waitpid", __func__);
@@ -699,16 +1183,31 @@ script_run(struct dhcpcd_ctx *ctx, char **argv)
 				break;
 			}
 		}
-		if (WIFEXITED(status)) {
-			if (WEXITSTATUS(status))
-				logerrx("%s: %s: WEXITSTATUS %d",
-				    __func__, argv[0], WEXITSTATUS(status));
-		} else if (WIFSIGNALED(status))
-			logerrx("%s: %s: %s",
-			    __func__, argv[0], strsignal(WTERMSIG(status)));
+		script_reap(ctx, pid, status);
+	}
+}
+
+/* A forked process must not run or wait for our scripts. */
+void
+script_forked(struct dhcpcd_ctx *ctx)
+{
+	struct script_job *job;
+	struct script_hold *hold;
+
+	while ((job = TAILQ_FIRST(&ctx->script_jobs)) != NULL)
+		script_freejob(ctx, job);
+	/* Their timeouts went with eloop_clear. */
+	while ((hold = TAILQ_FIRST(&ctx->script_holds)) != NULL) {
+		TAILQ_REMOVE(&ctx->script_holds, hold, next);
+		free(hold);
 	}
 
-	return WEXITSTATUS(status);
+	/* The hook runner belongs to our parent as well. */
+	if (ctx->hook_runner_fd != -1) {
+		close(ctx->hook_runner_fd);
+		ctx->hook_runner_fd = -1;
+	}
+	ctx->hook_runner_pid = 0;
 }
 
 int
@@ -732,17 +1231,44 @@ script_dump(const char *env, size_t len)
 	return 0;
 }
 
-int
-script_runreason(const struct interface *ifp, const char *reason)
+/*
+ * With script_debounce a lease or RA being confirmed again is held back
+ * and merged with any more of the same protocol for the interface, so the
+ * script runs once with the final state.
+ */
+static int
+script_holdprotocol(const char *reason)
+{
+
+	if (strcmp(reason, "BOUND") == 0 ||
+	    strcmp(reason, "RENEW") == 0 ||
+	    strcmp(reason, "REBIND") == 0 ||
+	    strcmp(reason, "REBOOT") == 0 ||
+	    strcmp(reason, "INFORM") == 0)
+		return PROTO_DHCP;
+	if (strcmp(reason, "BOUND6") == 0 ||
+	    strcmp(reason, "RENEW6") == 0 ||
+	    strcmp(reason, "REBIND6") == 0 ||
+	    strcmp(reason, "REBOOT6") == 0 ||
+	    strcmp(reason, "INFORM6") == 0 ||
+	    strcmp(reason, "DELEGATED6") == 0)
+		return PROTO_DHCP6;
+	if (strcmp(reason, "ROUTERADVERT") == 0)
+		return PROTO_RA;
+	return -1;
+}
+
+static int
+script_send(const struct interface *ifp, const char *reason,
+    bool run, bool listen)
 {
 	struct dhcpcd_ctx *ctx = ifp->ctx;
-	char *argv[2];
 	int status = 0;
 	struct fd_list *fd;
+	struct fd_buf *b = NULL;
 	long buflen;
 
-	if (ctx->script == NULL &&
-	    TAILQ_FIRST(&ifp->ctx->control_fds) == NULL)
+	if (!run && (!listen || TAILQ_FIRST(&ctx->control_fds) == NULL))
 		return 0;
 
 	/* Make our env */
@@ -754,35 +1280,153 @@ script_runreason(const struct interface *ifp, const char *reason)
 	if (strncmp(reason, "DUMP", 4) == 0)
 		return script_dump(ctx->script_buf, (size_t)buflen);
 
-	if (ctx->script == NULL)
+	if (!run)
 		goto send_listeners;
 
-	argv[0] = ctx->script;
-	argv[1] = NULL;
-	logdebugx("%s: executing: %s %s", ifp->name, argv[0], reason);
+	/* Hooks expect the routes for the event to be in place. */
+	rt_buildpending(ctx);
+
+	if (ctx->script != NULL)
+		logdebugx("%s: executing: %s %s",
+		    ifp->name, ctx->script, reason);
 
 #ifdef PRIVSEP
 	if (ctx->options & DHCPCD_PRIVSEP) {
-		if (ps_root_script(ctx,
-		    ctx->script_buf, ctx->script_buflen) == -1)
+		if (ps_root_script(ctx, ctx->script_buf, (size_t)buflen) == -1)
 			logerr(__func__);
 		goto send_listeners;
 	}
 #endif
 
-	script_run(ctx, argv);
+	if (script_queue(ctx, ctx->script_buf, (size_t)buflen) == -1)
+		logerr(__func__);
 
 send_listeners:
-	/* Send to our listeners */
-	status = 0;
+	if (!listen)
+		return 0;
+
+	/* Send to our listeners, sharing one copy of the event */
 	TAILQ_FOREACH(fd, &ctx->control_fds, next) {
-		if (!(fd->flags & FD_LISTEN))
+		if (!control_wants_event(fd, ctx->script_buf, (size_t)buflen))
 			continue;
-		if (control_queue(fd, ctx->script_buf, ctx->script_buflen)== -1)
-			logerr("%s: control_queue", __func__);
+		if (b == NULL) {
+			b = control_buf_new(ctx->script_buf,
+			    ctx->script_buflen);
+			if (b == NULL) {
+				logerr(__func__);
+				break;
+			}
+		}
+		if (control_queue_event(fd, b) == -1)
+			logerr("%s: control_queue_event", __func__);
 		else
 			status = 1;
 	}
+	if (b != NULL)
+		control_buf_free(b);
 
 	return status;
 }
+
+static void script_holdcb(void *);
+
+static void
+script_runhold(struct script_hold *hold)
+{
+	struct dhcpcd_ctx *ctx = hold->ctx;
+	struct interface *ifp;
+
+	eloop_timeout_delete(ctx->eloop, script_holdcb, hold);
+	TAILQ_REMOVE(&ctx->script_holds, hold, next);
+	ifp = if_find(ctx->ifaces, hold->ifname);
+	/* Listeners were sent the event when it happened. */
+	if (ifp != NULL && SCRIPT_RUNS(ctx))
+		script_send(ifp, hold->reason, true, false);
+	free(hold);
+}
+
+static void
+script_holdcb(void *arg)
+{
+
+	script_runhold(arg);
+}
+
+/* Returns true if the script for reason is held back. */
+static bool
+script_hold(const struct interface *ifp, const char *reason)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	struct script_hold *hold, *hn;
+	int protocol;
+
+	if (ifp->options == NULL || ifp->options->script_debounce == 0 ||
+	    strncmp(reason, "DUMP", 4) == 0)
+		return false;
+
+	protocol = script_holdprotocol(reason);
+	TAILQ_FOREACH_SAFE(hold, &ctx->script_holds, next, hn) {
+		if (strcmp(hold->ifname, ifp->name) != 0)
+			continue;
+		if (protocol == -1) {
+			/* Anything else runs what we held first. */
+			script_runhold(hold);
+			continue;
+		}
+		if (hold->protocol == protocol) {
+			logdebugx("%s: merging %s into %s",
+			    ifp->name, hold->reason, reason);
+			strlcpy(hold->reason, reason, sizeof(hold->reason));
+			return true;
+		}
+	}
+	if (protocol == -1)
+		return false;
+
+	hold = malloc(sizeof(*hold));
+	if (hold == NULL) {
+		logerr(__func__);
+		return false;
+	}
+	hold->ctx = ctx;
+	strlcpy(hold->ifname, ifp->name, sizeof(hold->ifname));
+	hold->protocol = protocol;
+	strlcpy(hold->reason, reason, sizeof(hold->reason));
+	if (eloop_timeout_add_msec(ctx->eloop, ifp->options->script_debounce,
+	    script_holdcb, hold) == -1)
+	{
+		logerr(__func__);
+		free(hold);
+		return false;
+	}
+	TAILQ_INSERT_TAIL(&ctx->script_holds, hold, next);
+	logdebugx("%s: holding %s for %u ms",
+	    ifp->name, reason, ifp->options->script_debounce);
+	return true;
+}
+
+/* Run everything held back now, used when exiting. */
+void
+script_runholds(struct dhcpcd_ctx *ctx)
+{
+	struct script_hold *hold;
+
+	while ((hold = TAILQ_FIRST(&ctx->script_holds)) != NULL)
+		script_runhold(hold);
+}
+
+int
+script_runreason(const struct interface *ifp, const char *reason)
+{
+	struct dhcpcd_ctx *ctx = ifp->ctx;
+	bool run;
+
+	if (!SCRIPT_RUNS(ctx) &&
+	    TAILQ_FIRST(&ifp->ctx->control_fds) == NULL)
+		return 0;
+
+	/* The hooks already know state resumed from or handed off
+	 * to another dhcpcd, see warm_restart. */
+	run = SCRIPT_RUNS(ctx) && !ifp->warm && !script_hold(ifp, reason);
+	return script_send(ifp, reason, run, true);
+}
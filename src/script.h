@@ -31,11 +31,27 @@
 
 #include "control.h"
 
+/* See dump_interface */
+struct dump_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
 __printflike(2, 3) int efprintf(FILE *, const char *, ...);
 void if_printoptions(void);
 char ** script_buftoenv(struct dhcpcd_ctx *, char *, size_t);
 pid_t script_exec(char *const *, char *const *);
+void script_runner_stop(struct dhcpcd_ctx *);
+int script_queue(struct dhcpcd_ctx *, const char *, size_t);
+bool script_reap(struct dhcpcd_ctx *, pid_t, int);
+void script_wait(struct dhcpcd_ctx *);
+void script_forked(struct dhcpcd_ctx *);
+void script_runholds(struct dhcpcd_ctx *);
 int send_interface(struct fd_list *, const struct interface *, int);
+int dump_interface(struct dump_buf *, const struct interface *, int);
+int dump_interface_end(struct dump_buf *);
+int script_dumpbulk(const char *, size_t);
 int script_dump(const char *, size_t);
 int script_runreason(const struct interface *, const char *);
 #endif
@@ -0,0 +1,1208 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcpcd.h"
+#include "control.h"
+#include "duid.h"
+#include "eloop.h"
+#include "if.h"
+#include "if-options.h"
+#include "logerr.h"
+#include "shard.h"
+
+#ifdef HAVE_UTIL_H
+#include <util.h>
+#endif
+
+#ifdef SHARDS
+/*
+ * With shards the manager forks a worker for each shard and stays on as
+ * the coordinator.
+ * A worker is a manager in its own right, with its own eloop, privsep
+ * helpers, lease database and control socket, but only activates the
+ * interfaces whose name hashes to its shard.
+ * There is no coordinator wide rt_build, each worker builds the routes
+ * for the interfaces it has into the one kernel table.
+ * Multipath across workers and equal routes without metrics are not
+ * supported, see shards in dhcpcd.conf(5).
+ *
+ * The coordinator has the pidfile, the DUID and the manager control socket.
+ * Commands are sent to every worker and the replies merged so that
+ * dhcpcd -U, --stats and --listen work as they always have.
+ * Signals are passed on. A worker that exits without being told to
+ * after it has started is restarted, one that fails to start stops
+ * the others as well.
+ */
+
+struct shard {
+	struct dhcpcd_ctx *sh_ctx;
+	unsigned int sh_index;
+	pid_t sh_pid;		/* 0 once reaped */
+	int sh_fd;		/* written to when the worker daemonises */
+	int sh_listen_fd;	/* events for our listeners */
+	bool sh_daemonised;
+};
+
+#define	SHARD_TIMEOUT	3000	/* msec to wait for the workers to reply */
+#define	SHARD_RELISTEN	1	/* seconds between listen attempts */
+#define	SHARD_RESTART	5	/* seconds before restarting a worker */
+
+/* Replies to the commands we merge */
+#define	SHARD_NOREPLY	0
+#define	SHARD_DUMP	1	/* --dumpleases */
+#define	SHARD_IFACES	2	/* --getinterfaces and -U */
+#define	SHARD_STATS	3	/* --stats */
+
+/* A worker's reply is read as it comes in, see shard_collect. */
+struct shard_reply {
+	int sr_fd;
+	char *sr_buf;
+	size_t sr_len;		/* read so far */
+	size_t sr_size;
+	size_t sr_off;		/* of the next frame to check */
+	size_t sr_frames;	/* still to come */
+	bool sr_done;
+};
+
+/* FNV-1a, so an interface keeps its shard as others come and go. */
+bool
+shard_owns(const struct dhcpcd_ctx *ctx, const char *ifname)
+{
+	uint32_t h = 2166136261U;
+
+	if (!SHARD_WORKER(ctx))
+		return true;
+	for (; *ifname != '\0'; ifname++) {
+		h ^= (uint8_t)*ifname;
+		h *= 16777619U;
+	}
+	return h % ctx->shards == (unsigned int)ctx->shard;
+}
+
+static int
+shard_open(unsigned int shard, bool unpriv)
+{
+	char ifname[IF_NAMESIZE];
+
+	snprintf(ifname, sizeof(ifname), SHARD_IFNAME, (int)shard);
+	return control_open(ifname, AF_UNSPEC, unpriv);
+}
+
+/* Read all of len from a worker or fail after SHARD_TIMEOUT. */
+static int
+shard_read(int fd, void *data, size_t len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char *p = data;
+	ssize_t n;
+
+	while (len != 0) {
+		n = read(fd, p, len);
+		if (n == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				return -1;
+			switch (poll(&pfd, 1, SHARD_TIMEOUT)) {
+			case -1:
+				return -1;
+			case 0:
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			continue;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/*
+ * Check the frames of a reply as they come in, each a size_t length and
+ * then that much data.
+ * Interfaces have a count of frames first, anything else has one frame.
+ */
+static int
+shard_parse(struct shard_reply *r, int reply)
+{
+	size_t len;
+
+	if (reply == SHARD_IFACES && r->sr_off == 0) {
+		if (r->sr_len < sizeof(r->sr_frames))
+			return 0;
+		memcpy(&r->sr_frames, r->sr_buf, sizeof(r->sr_frames));
+		r->sr_off = sizeof(r->sr_frames);
+	}
+	while (r->sr_frames != 0) {
+		if (r->sr_len - r->sr_off < sizeof(len))
+			return 0;
+		memcpy(&len, r->sr_buf + r->sr_off, sizeof(len));
+		if (len > SSIZE_MAX) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		if (r->sr_len - r->sr_off - sizeof(len) < len)
+			return 0;
+		r->sr_off += sizeof(len) + len;
+		r->sr_frames--;
+	}
+	return 1;
+}
+
+/* Walk the frames of a reply shard_parse has checked. */
+static const char *
+shard_nextframe(const struct shard_reply *r, size_t *off, size_t *lenp)
+{
+	const char *data;
+
+	memcpy(lenp, r->sr_buf + *off, sizeof(*lenp));
+	data = r->sr_buf + *off + sizeof(*lenp);
+	*off += sizeof(*lenp) + *lenp;
+	return data;
+}
+
+static int
+shard_readreply(struct shard_reply *r, int reply)
+{
+	char *nbuf;
+	size_t size;
+	ssize_t n;
+
+	if (r->sr_len == r->sr_size) {
+		size = r->sr_size != 0 ? r->sr_size * 2 : BUFSIZ;
+		nbuf = realloc(r->sr_buf, size);
+		if (nbuf == NULL)
+			return -1;
+		r->sr_buf = nbuf;
+		r->sr_size = size;
+	}
+	n = read(r->sr_fd, r->sr_buf + r->sr_len, r->sr_size - r->sr_len);
+	if (n == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	if (n == -1)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	r->sr_len += (size_t)n;
+	switch (shard_parse(r, reply)) {
+	case -1:
+		return -1;
+	case 1:
+		r->sr_done = true;
+		break;
+	}
+	return 0;
+}
+
+/* msec left of SHARD_TIMEOUT from start. */
+static int
+shard_remaining(const struct timespec *start)
+{
+	struct timespec now;
+	long long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (long long)(now.tv_sec - start->tv_sec) * 1000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000000;
+	return ms >= SHARD_TIMEOUT ? 0 : SHARD_TIMEOUT - (int)ms;
+}
+
+/*
+ * Read the replies of every worker in one poll(2) with one deadline,
+ * so a wedged worker holds us up for SHARD_TIMEOUT once, not each.
+ * A worker that fails to reply is logged and left out.
+ */
+static void
+shard_collect(struct dhcpcd_ctx *ctx, struct shard_reply *rs, int reply)
+{
+	struct pollfd *pfds;
+	struct shard_reply *r;
+	struct timespec start;
+	unsigned int i, n;
+	int timeout;
+
+	pfds = calloc(ctx->shards, sizeof(*pfds));
+	if (pfds == NULL) {
+		logerr(__func__);
+		return;
+	}
+	for (i = 0; i < ctx->shards; i++) {
+		rs[i].sr_frames = 1;
+		pfds[i].events = POLLIN;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		/* poll(2) skips a negative fd. */
+		for (i = 0, n = 0; i < ctx->shards; i++) {
+			r = &rs[i];
+			if (r->sr_fd == -1 || r->sr_done)
+				pfds[i].fd = -1;
+			else {
+				pfds[i].fd = r->sr_fd;
+				n++;
+			}
+		}
+		if (n == 0)
+			break;
+		if ((timeout = shard_remaining(&start)) == 0)
+			break;
+		if (poll(pfds, ctx->shards, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			logerr("%s: poll", __func__);
+			break;
+		}
+		for (i = 0; i < ctx->shards; i++) {
+			r = &rs[i];
+			if (pfds[i].fd == -1 || pfds[i].revents == 0 ||
+			    shard_readreply(r, reply) != -1)
+				continue;
+			logerr("%s: shard %u", __func__, i);
+			close(r->sr_fd);
+			r->sr_fd = -1;
+		}
+	}
+	free(pfds);
+
+	for (i = 0; i < ctx->shards; i++) {
+		r = &rs[i];
+		if (r->sr_fd != -1 && !r->sr_done)
+			logerrx("%s: shard %u: timed out", __func__, i);
+	}
+}
+
+static void
+shard_kill(struct dhcpcd_ctx *ctx, int sig)
+{
+	struct shard *sh;
+	unsigned int i;
+
+	for (i = 0; i < ctx->shards; i++) {
+		sh = &ctx->shard_procs[i];
+		if (sh->sh_pid != 0 && kill(sh->sh_pid, sig) == -1 &&
+		    errno != ESRCH)
+			logerr("%s: shard %u", __func__, i);
+	}
+}
+
+static void shard_listen(void *);
+
+static void
+shard_listencb(void *arg, unsigned short events)
+{
+	struct shard *sh = arg;
+	struct dhcpcd_ctx *ctx = sh->sh_ctx;
+	struct fd_buf *b = NULL;
+	struct fd_list *fd;
+	size_t len;
+
+	if (!(events & (ELE_READ | ELE_HANGUP)))
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	/* Read one event at a time, as ps_ctl_listen does. */
+	if (shard_read(sh->sh_listen_fd, &len, sizeof(len)) == -1)
+		goto lost;
+	if (len == 0 || len > SSIZE_MAX) {
+		errno = EINVAL;
+		goto lost;
+	}
+	b = control_buf_new(NULL, len);
+	if (b == NULL ||
+	    shard_read(sh->sh_listen_fd, b->data, len) == -1)
+		goto lost;
+
+	TAILQ_FOREACH(fd, &ctx->control_fds, next) {
+		if (!control_wants_event(fd, b->data, b->len))
+			continue;
+		if (control_queue_event(fd, b) == -1)
+			logerr("%s: control_queue_event", __func__);
+	}
+	control_buf_free(b);
+	return;
+
+lost:
+	if (errno != ECONNRESET)
+		logerr("%s: shard %u", __func__, sh->sh_index);
+	if (b != NULL)
+		control_buf_free(b);
+	eloop_event_delete(ctx->eloop, sh->sh_listen_fd);
+	close(sh->sh_listen_fd);
+	sh->sh_listen_fd = -1;
+	if (sh->sh_pid != 0 && !ctx->shard_exiting)
+		eloop_timeout_add_sec(ctx->eloop, SHARD_RELISTEN,
+		    shard_listen, ctx);
+}
+
+/*
+ * Listen to every worker once we have a listener of our own.
+ * Each worker sends us every event and our listeners filter them
+ * as they asked, so one connection serves them all.
+ */
+static void
+shard_listen(void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	char *argv[] = { UNCONST("--listen"), NULL };
+	struct shard *sh;
+	unsigned int i;
+	bool retry = false;
+
+	for (i = 0; i < ctx->shards; i++) {
+		sh = &ctx->shard_procs[i];
+		if (sh->sh_pid == 0 || sh->sh_listen_fd != -1)
+			continue;
+		/* The worker may not have its socket yet. */
+		sh->sh_listen_fd = shard_open(i, false);
+		if (sh->sh_listen_fd == -1) {
+			retry = true;
+			continue;
+		}
+		if (control_write(sh->sh_listen_fd, 1, argv) == -1 ||
+		    eloop_event_add(ctx->eloop, sh->sh_listen_fd, ELE_READ,
+		    shard_listencb, sh) == -1)
+		{
+			logerr("%s: shard %u", __func__, i);
+			close(sh->sh_listen_fd);
+			sh->sh_listen_fd = -1;
+			retry = true;
+		}
+	}
+	if (retry)
+		eloop_timeout_add_sec(ctx->eloop, SHARD_RELISTEN,
+		    shard_listen, ctx);
+}
+
+/* A dump is records ending with a zero length, so join them up
+ * and end with one zero length. */
+static int
+shard_dumpleases(struct dhcpcd_ctx *ctx, struct fd_list *fd,
+    const struct shard_reply *rs)
+{
+	const size_t end = 0;
+	const char *data;
+	char *buf = NULL, *nbuf;
+	size_t len = 0, dlen, off;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < ctx->shards; i++) {
+		if (!rs[i].sr_done)
+			continue;
+		off = 0;
+		data = shard_nextframe(&rs[i], &off, &dlen);
+		if (dlen >= sizeof(end))
+			dlen -= sizeof(end);
+		nbuf = realloc(buf, len + dlen + sizeof(end));
+		if (nbuf == NULL) {
+			free(buf);
+			return -1;
+		}
+		buf = nbuf;
+		memcpy(buf + len, data, dlen);
+		len += dlen;
+	}
+	if (buf == NULL && (buf = malloc(sizeof(end))) == NULL)
+		return -1;
+	memcpy(buf + len, &end, sizeof(end));
+	len += sizeof(end);
+	err = control_queue_bulk(fd, buf, len);
+	free(buf);
+	return err;
+}
+
+/* The count of interfaces is written first, then each of them. */
+static int
+shard_getinterfaces(struct dhcpcd_ctx *ctx, struct fd_list *fd,
+    const struct shard_reply *rs)
+{
+	const char *data;
+	size_t nifaces = 0, n, len, off;
+	unsigned int i;
+
+	for (i = 0; i < ctx->shards; i++) {
+		if (!rs[i].sr_done)
+			continue;
+		memcpy(&n, rs[i].sr_buf, sizeof(n));
+		nifaces += n;
+	}
+	if (write(fd->fd, &nifaces, sizeof(nifaces)) != sizeof(nifaces))
+		return -1;
+
+	for (i = 0; i < ctx->shards; i++) {
+		if (!rs[i].sr_done)
+			continue;
+		memcpy(&n, rs[i].sr_buf, sizeof(n));
+		for (off = sizeof(n); n != 0; n--) {
+			data = shard_nextframe(&rs[i], &off, &len);
+			if (control_queue(fd, UNCONST(data), len) == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Keys numbered per item, the numbers are made unique across workers. */
+static const char * const shard_indexed[] = {
+	"if", "eloop_stat", "privsep_stat", "trace",
+};
+
+struct shard_stats {
+	char **kv;
+	size_t len;
+	size_t size;
+	size_t offset[__arraycount(shard_indexed)];
+	size_t next[__arraycount(shard_indexed)];
+};
+
+static int
+shard_statsadd(struct shard_stats *st, char *kv)
+{
+	char **nkv;
+	size_t size;
+
+	if (st->len == st->size) {
+		size = st->size != 0 ? st->size * 2 : 64;
+		nkv = reallocarray(st->kv, size, sizeof(*nkv));
+		if (nkv == NULL) {
+			free(kv);
+			return -1;
+		}
+		st->kv = nkv;
+		st->size = size;
+	}
+	st->kv[st->len++] = kv;
+	return 0;
+}
+
+static bool
+shard_statsnum(const char *val, unsigned long long *num)
+{
+	char *ep;
+
+	if (!isdigit((unsigned char)*val))
+		return false;
+	errno = 0;
+	*num = strtoull(val, &ep, 10);
+	return errno == 0 && *ep == '\0';
+}
+
+static bool
+shard_statsmax(const char *kv, size_t keylen)
+{
+	static const char * const maxes[] = { "_max_usec", "_peak" };
+	size_t i, l;
+
+	for (i = 0; i < __arraycount(maxes); i++) {
+		l = strlen(maxes[i]);
+		if (keylen > l && strncmp(kv + keylen - l, maxes[i], l) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Counters are summed, maximums kept and anything else is
+ * the first worker's.
+ * Numbered keys are renumbered after those of the workers before.
+ */
+static int
+shard_statsmerge(struct shard_stats *st, const char *kv, size_t kvlen)
+{
+	const char *eq, *p;
+	char *ep, *nkv;
+	size_t keylen, i, idx, l;
+	unsigned long long a, b;
+
+	if ((eq = memchr(kv, '=', kvlen)) == NULL)
+		return 0;
+	keylen = (size_t)(eq - kv);
+
+	for (i = 0; i < __arraycount(shard_indexed); i++) {
+		l = strlen(shard_indexed[i]);
+		p = kv + l;
+		if (keylen <= l || strncmp(kv, shard_indexed[i], l) != 0 ||
+		    !isdigit((unsigned char)*p))
+			continue;
+		idx = (size_t)strtoul(p, &ep, 10);
+		if (*ep != '_')
+			continue;
+		if (idx + 1 > st->next[i])
+			st->next[i] = idx + 1;
+		if (asprintf(&nkv, "%s%zu%.*s", shard_indexed[i],
+		    idx + st->offset[i], (int)(kvlen - (size_t)(ep - kv)),
+		    ep) == -1)
+			return -1;
+		return shard_statsadd(st, nkv);
+	}
+
+	for (i = 0; i < st->len; i++) {
+		if (strncmp(st->kv[i], kv, keylen + 1) == 0)
+			break;
+	}
+	if (i == st->len) {
+		if (asprintf(&nkv, "%.*s", (int)kvlen, kv) == -1)
+			return -1;
+		return shard_statsadd(st, nkv);
+	}
+
+	if (!shard_statsnum(st->kv[i] + keylen + 1, &a) ||
+	    !shard_statsnum(eq + 1, &b))
+		return 0;
+	if (shard_statsmax(kv, keylen))
+		a = a > b ? a : b;
+	else
+		a += b;
+	if (asprintf(&nkv, "%.*s=%llu", (int)keylen, kv, a) == -1)
+		return -1;
+	free(st->kv[i]);
+	st->kv[i] = nkv;
+	return 0;
+}
+
+static int
+shard_stats(struct dhcpcd_ctx *ctx, struct fd_list *fd,
+    const struct shard_reply *rs)
+{
+	struct shard_stats st = { .kv = NULL };
+	const char *p, *end;
+	char *buf = NULL, *bp;
+	size_t dlen, l, len = 0, off;
+	unsigned int i, j;
+	int err = -1;
+
+	for (i = 0; i < ctx->shards; i++) {
+		if (!rs[i].sr_done)
+			continue;
+		off = 0;
+		p = shard_nextframe(&rs[i], &off, &dlen);
+		for (end = p + dlen; p < end; p += l + 1) {
+			l = strnlen(p, (size_t)(end - p));
+			if (shard_statsmerge(&st, p, l) == -1)
+				goto out;
+		}
+		for (j = 0; j < __arraycount(shard_indexed); j++) {
+			st.offset[j] += st.next[j];
+			st.next[j] = 0;
+		}
+	}
+
+	for (i = 0; i < st.len; i++)
+		len += strlen(st.kv[i]) + 1;
+	if (len == 0) {
+		errno = ESRCH;
+		goto out;
+	}
+	if ((buf = malloc(len)) == NULL)
+		goto out;
+	for (i = 0, bp = buf; i < st.len; i++) {
+		l = strlen(st.kv[i]) + 1;
+		memcpy(bp, st.kv[i], l);
+		bp += l;
+	}
+	err = control_queue(fd, buf, len);
+
+out:
+	free(buf);
+	for (i = 0; i < st.len; i++)
+		free(st.kv[i]);
+	free(st.kv);
+	return err;
+}
+
+/* We have our own control socket statistics. */
+static int
+shard_controlstats(struct dhcpcd_ctx *ctx, struct fd_list *fd)
+{
+	ssize_t len;
+	char *buf;
+	int err;
+
+	len = control_stats_format(ctx, NULL, 0);
+	if (len == -1)
+		return -1;
+	buf = malloc((size_t)len);
+	if (buf == NULL)
+		return -1;
+	if (control_stats_format(ctx, buf, (size_t)len) == -1) {
+		free(buf);
+		return -1;
+	}
+	err = control_queue(fd, buf, (size_t)len);
+	free(buf);
+	return err;
+}
+
+/*
+ * Pass a command from our control socket to every worker and
+ * merge what they reply.
+ * Like dhcpcd_handleargs, but the interfaces are the workers' business.
+ */
+int
+shard_handleargs(struct dhcpcd_ctx *ctx, struct fd_list *fd,
+    int argc, char **argv)
+{
+	struct shard *sh;
+	struct shard_reply *rs, *r;
+	int opt, oi = 0, reply = SHARD_NOREPLY, err = 0;
+	unsigned int i;
+	bool stop = false;
+
+	if (strcmp(*argv, "--listen") == 0) {
+		if (control_listen(fd, argc - 1, argv + 1) == -1)
+			return -1;
+		shard_listen(ctx);
+		return 0;
+	} else if (strcmp(*argv, "--stats") == 0) {
+		if (argc == 2 && strcmp(argv[1], "control") == 0)
+			return shard_controlstats(ctx, fd);
+		reply = SHARD_STATS;
+	} else if (strcmp(*argv, "--dumpleases") == 0)
+		reply = SHARD_DUMP;
+	else if (strcmp(*argv, "--getinterfaces") == 0)
+		reply = SHARD_IFACES;
+	else {
+		optind = 0;
+		while ((opt = getopt_long(argc, argv, IF_OPTS, cf_options,
+		    &oi)) != -1)
+		{
+			switch (opt) {
+			case 'U':
+				reply = SHARD_IFACES;
+				break;
+			case 'k': /* FALLTHROUGH */
+			case 'x':
+				stop = true;
+				break;
+			}
+		}
+		/* Only privileged users can control dhcpcd via the socket. */
+		if (reply == SHARD_NOREPLY && fd->flags & FD_UNPRIV) {
+			errno = EPERM;
+			return -1;
+		}
+		/* Every worker is about to exit, don't mistake it
+		 * for a failure or restart it. */
+		if (reply == SHARD_NOREPLY && stop && optind == argc)
+			ctx->shard_exiting = true;
+	}
+
+	rs = calloc(ctx->shards, sizeof(*rs));
+	if (rs == NULL)
+		return -1;
+	for (i = 0; i < ctx->shards; i++) {
+		sh = &ctx->shard_procs[i];
+		r = &rs[i];
+		r->sr_fd = -1;
+		if (sh->sh_pid == 0)
+			continue;
+		r->sr_fd = shard_open(i, fd->flags & FD_UNPRIV);
+		if (r->sr_fd == -1 ||
+		    control_write(r->sr_fd, argc, argv) == -1)
+		{
+			logerr("%s: shard %u", __func__, i);
+			if (r->sr_fd != -1) {
+				close(r->sr_fd);
+				r->sr_fd = -1;
+			}
+		}
+	}
+
+	/* Every worker has the command, so they work on it together. */
+	if (reply != SHARD_NOREPLY)
+		shard_collect(ctx, rs, reply);
+	switch (reply) {
+	case SHARD_DUMP:
+		err = shard_dumpleases(ctx, fd, rs);
+		break;
+	case SHARD_IFACES:
+		err = shard_getinterfaces(ctx, fd, rs);
+		break;
+	case SHARD_STATS:
+		err = shard_stats(ctx, fd, rs);
+		break;
+	}
+
+	for (i = 0; i < ctx->shards; i++) {
+		r = &rs[i];
+		if (r->sr_fd != -1)
+			close(r->sr_fd);
+		free(r->sr_buf);
+	}
+	free(rs);
+	return err;
+}
+
+/* We daemonise once every worker has. */
+static void
+shard_daemonise(struct dhcpcd_ctx *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->shards; i++) {
+		if (!ctx->shard_procs[i].sh_daemonised)
+			return;
+	}
+	/* Each worker has waited for its own addresses. */
+	ctx->options |= DHCPCD_NOWAITIP;
+	dhcpcd_daemonise(ctx);
+}
+
+/* A worker writes EXIT_SUCCESS when it daemonises,
+ * otherwise its exit code if it fails before then. */
+static void
+shard_forkcb(void *arg, unsigned short events)
+{
+	struct shard *sh = arg;
+	struct dhcpcd_ctx *ctx = sh->sh_ctx;
+	ssize_t len;
+	int status;
+
+	if (!(events & (ELE_READ | ELE_HANGUP)))
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	len = read(sh->sh_fd, &status, sizeof(status));
+	if (len == sizeof(status) && status == EXIT_SUCCESS) {
+		sh->sh_daemonised = true;
+		shard_daemonise(ctx);
+		return;
+	}
+	if (len == -1)
+		logerr("%s: shard %u", __func__, sh->sh_index);
+	eloop_event_delete(ctx->eloop, sh->sh_fd);
+	close(sh->sh_fd);
+	sh->sh_fd = -1;
+}
+
+static void shard_restart(void *);
+
+static void
+shard_reap(struct dhcpcd_ctx *ctx)
+{
+	struct shard *sh;
+	pid_t pid;
+	int status;
+	unsigned int i, running;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < ctx->shards; i++) {
+			if (ctx->shard_procs[i].sh_pid == pid)
+				break;
+		}
+		if (i == ctx->shards)
+			continue;
+		sh = &ctx->shard_procs[i];
+		sh->sh_pid = 0;
+		if (ctx->shard_exiting) {
+			if (!WIFEXITED(status) ||
+			    WEXITSTATUS(status) != EXIT_SUCCESS)
+				ctx->shard_status = EXIT_FAILURE;
+			continue;
+		}
+		if (WIFSIGNALED(status))
+			logerrx("shard %u exited unexpectedly"
+			    " from PID %d, signal=%s",
+			    i, pid, strsignal(WTERMSIG(status)));
+		else
+			logerrx("shard %u exited unexpectedly"
+			    " from PID %d, code=%d",
+			    i, pid, WEXITSTATUS(status));
+		/* Unless we are still waiting for it to start. */
+		if (sh->sh_daemonised ||
+		    !(ctx->options & DHCPCD_DAEMONISE))
+		{
+			loginfox("restarting shard %u in %d seconds",
+			    i, SHARD_RESTART);
+			eloop_timeout_add_sec(ctx->eloop, SHARD_RESTART,
+			    shard_restart, sh);
+			continue;
+		}
+		ctx->shard_exiting = true;
+		ctx->shard_status = EXIT_FAILURE;
+		shard_kill(ctx, SIGTERM);
+	}
+
+	if (!ctx->shard_exiting)
+		return;
+	running = 0;
+	for (i = 0; i < ctx->shards; i++) {
+		if (ctx->shard_procs[i].sh_pid != 0)
+			running++;
+	}
+	if (running == 0)
+		eloop_exit(ctx->eloop, ctx->shard_status);
+}
+
+static void
+shard_signal_cb(int sig, void *arg)
+{
+	struct dhcpcd_ctx *ctx = arg;
+
+	switch (sig) {
+	case SIGCHLD:
+		shard_reap(ctx);
+		return;
+	case SIGINT:
+	case SIGTERM:
+	case SIGALRM:
+		ctx->shard_exiting = true;
+		break;
+	case SIGUSR2:
+		if (logopen(ctx->logfile) == -1)
+			logerr("logopen");
+		break;
+	}
+	/* Each worker logs what it does with it. */
+	shard_kill(ctx, sig);
+	/* None may be running while waiting to restart. */
+	if (ctx->shard_exiting)
+		shard_reap(ctx);
+}
+
+/* The launcher passes on any signal it gets. */
+static void
+shard_launchercb(void *arg, unsigned short events)
+{
+	struct dhcpcd_ctx *ctx = arg;
+	ssize_t len;
+	int sig;
+
+	if (!(events & (ELE_READ | ELE_HANGUP)))
+		logerrx("%s: unexpected event 0x%04x", __func__, events);
+
+	len = read(ctx->fork_fd, &sig, sizeof(sig));
+	if (len == sizeof(sig)) {
+		shard_signal_cb(sig, ctx);
+		return;
+	}
+	if (len == -1)
+		logerr(__func__);
+	eloop_event_delete(ctx->eloop, ctx->fork_fd);
+	close(ctx->fork_fd);
+	ctx->fork_fd = -1;
+}
+
+/*
+ * Workers inherit our DUID so they don't race to create one.
+ * Without a DUID file or machine UUID, make one from an interface
+ * as dhcpcd_startinterface would.
+ */
+static void
+shard_initduid(struct dhcpcd_ctx *ctx)
+{
+	unsigned long long options = ctx->options;
+	struct ifaddrs *ifaddrs = NULL;
+	struct if_head *ifaces;
+	struct interface *ifp;
+
+	/* Our workers have not started privsep yet. */
+	ctx->options &= ~DHCPCD_PRIVSEP;
+	if (duid_init(ctx, NULL) != 0 ||
+	    !(ctx->options & (DHCPCD_DUID | DHCPCD_IPV6)))
+	{
+		ctx->options = options;
+		return;
+	}
+
+	if (if_opensockets(ctx) == -1) {
+		logerr("%s: if_opensockets", __func__);
+		goto out;
+	}
+	ifaces = if_discover(ctx, &ifaddrs, ctx->ifc, ctx->ifv);
+	if (ifaces == NULL) {
+		logerr("%s: if_discover", __func__);
+		goto out;
+	}
+	TAILQ_FOREACH(ifp, ifaces, next) {
+		if (ifp->active && ifp->hwlen != 0)
+			break;
+	}
+	if (ifp == NULL)
+		ifp = TAILQ_FIRST(ifaces);
+	if (ifp != NULL) {
+		/* duid_get looks for another interface if it must. */
+		ctx->ifaces = ifaces;
+		duid_init(ctx, ifp);
+		ctx->ifaces = NULL;
+	}
+	while ((ifp = TAILQ_FIRST(ifaces)) != NULL) {
+		TAILQ_REMOVE(ifaces, ifp, next);
+		if_free(ifp);
+	}
+	free(ifaces);
+
+out:
+	if (ifaddrs != NULL)
+		freeifaddrs(ifaddrs);
+	if (ctx->link_fd != -1) {
+		close(ctx->link_fd);
+		ctx->link_fd = -1;
+	}
+	if_closesockets(ctx);
+	ctx->priv = NULL;
+	ctx->pf_inet_fd = -1;
+#ifdef PF_LINK
+	ctx->pf_link_fd = -1;
+#endif
+	ctx->options = options;
+}
+
+static int
+shard_worker(struct dhcpcd_ctx *ctx, unsigned int shard, int fd)
+{
+	struct shard *sh;
+	unsigned int i;
+
+	if (eloop_forked(ctx->eloop) == -1)
+		return -1;
+	rndpool_forked(ctx);
+	/* Our parent builds the routes it deferred. */
+	ctx->rt_pending = ctx->rt_pendfull = 0;
+#ifdef TRACE
+	trace_forked(ctx);
+#endif
+
+	/* The other workers are the coordinator's business. */
+	for (i = 0; i < ctx->shards; i++) {
+		sh = &ctx->shard_procs[i];
+		if (sh->sh_fd != -1)
+			close(sh->sh_fd);
+	}
+	free(ctx->shard_procs);
+	ctx->shard_procs = NULL;
+	ctx->shard = (int)shard;
+
+	/* The coordinator stands in for the launcher. */
+	if (ctx->fork_fd != -1) {
+		eloop_event_delete(ctx->eloop, ctx->fork_fd);
+		close(ctx->fork_fd);
+	}
+	ctx->fork_fd = fd;
+
+	/* The coordinator has the pidfile. */
+	pidfile_clean();
+	ctx->pidfile[0] = '\0';
+	return 0;
+}
+
+/* Returns the PID of the worker, or 0 in the worker with *fdp
+ * to write to the coordinator. */
+static pid_t
+shard_fork(struct shard *sh, int *fdp)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (xsocketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CXNB, 0, fds) == -1)
+		return -1;
+	switch (pid = fork()) {
+	case -1:
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	case 0:
+		close(fds[0]);
+		*fdp = fds[1];
+		return 0;
+	}
+	close(fds[1]);
+	sh->sh_pid = pid;
+	sh->sh_fd = fds[0];
+	logdebugx("spawned shard %u on PID %d", sh->sh_index, pid);
+	return pid;
+}
+
+/*
+ * Start a worker again in place of one that exited.
+ * We are deep in our eloop, so the new worker forgets it was the
+ * coordinator and leaves it for main to start it as the others were,
+ * see shard_restarted.
+ */
+static void
+shard_restart(void *arg)
+{
+	struct shard *sh = arg;
+	struct dhcpcd_ctx *ctx = sh->sh_ctx;
+	struct fd_list *fd;
+	unsigned int i;
+	int fork_fd;
+
+	if (ctx->shard_exiting || sh->sh_pid != 0)
+		return;
+
+	switch (shard_fork(sh, &fork_fd)) {
+	case -1:
+		logerr("%s: shard %u", __func__, sh->sh_index);
+		eloop_timeout_add_sec(ctx->eloop, SHARD_RESTART,
+		    shard_restart, sh);
+		return;
+	case 0:
+		/* Closes every fd we were listening to. */
+		while ((fd = TAILQ_FIRST(&ctx->control_fds)) != NULL)
+			control_free(fd);
+		eloop_clear(ctx->eloop, -1);
+		ctx->control_fd = ctx->control_unpriv_fd = -1;
+		ctx->fork_fd = -1;
+		for (i = 0; i < ctx->shards; i++)
+			ctx->shard_procs[i].sh_fd = -1;
+		ctx->options = ctx->shard_options;
+		if (shard_worker(ctx, sh->sh_index, fork_fd) == -1) {
+			logerr("%s: shard_worker", __func__);
+			eloop_exit(ctx->eloop, EXIT_FAILURE);
+			return;
+		}
+		ctx->shard_restart = true;
+		eloop_exit(ctx->eloop, EXIT_SUCCESS);
+		return;
+	}
+
+	if (eloop_event_add(ctx->eloop, sh->sh_fd, ELE_READ,
+	    shard_forkcb, sh) == -1)
+		logerr("%s: eloop_event_add", __func__);
+	/* Our listeners want its events as well. */
+	TAILQ_FOREACH(fd, &ctx->control_fds, next) {
+		if (fd->flags & FD_LISTEN)
+			break;
+	}
+	if (fd != NULL)
+		eloop_timeout_add_sec(ctx->eloop, SHARD_RELISTEN,
+		    shard_listen, ctx);
+}
+
+/*
+ * Fork a worker for each shard.
+ * Returns 0 in a worker or when not sharding, 1 in the coordinator which
+ * has nothing more to start, otherwise -1.
+ */
+int
+shard_start(struct dhcpcd_ctx *ctx)
+{
+	struct shard *sh;
+	unsigned int i;
+	int fd;
+
+	if (ctx->shards < 2 || !(ctx->options & DHCPCD_MANAGER) ||
+	    ctx->options & DHCPCD_TEST)
+	{
+		ctx->shards = 0;
+		return 0;
+	}
+
+	shard_initduid(ctx);
+
+	ctx->shard_procs = calloc(ctx->shards, sizeof(*ctx->shard_procs));
+	if (ctx->shard_procs == NULL)
+		return -1;
+	for (i = 0; i < ctx->shards; i++) {
+		sh = &ctx->shard_procs[i];
+		sh->sh_ctx = ctx;
+		sh->sh_index = i;
+		sh->sh_fd = sh->sh_listen_fd = -1;
+	}
+
+	/* Workers we restart start as these do. */
+	ctx->shard_options = ctx->options;
+	for (i = 0; i < ctx->shards; i++) {
+		switch (shard_fork(&ctx->shard_procs[i], &fd)) {
+		case -1:
+			return -1;
+		case 0:
+			return shard_worker(ctx, i, fd);
+		}
+	}
+
+	/* Our workers do the privileged work. */
+	ctx->options &= ~DHCPCD_PRIVSEP;
+	eloop_signal_set_cb(ctx->eloop,
+	    dhcpcd_signals, dhcpcd_signals_len, shard_signal_cb, ctx);
+	if (ctx->fork_fd != -1 &&
+	    eloop_event_add(ctx->eloop, ctx->fork_fd, ELE_READ,
+	    shard_launchercb, ctx) == -1)
+		logerr("%s: eloop_event_add", __func__);
+	for (i = 0; i < ctx->shards; i++) {
+		sh = &ctx->shard_procs[i];
+		if (eloop_event_add(ctx->eloop, sh->sh_fd, ELE_READ,
+		    shard_forkcb, sh) == -1)
+			logerr("%s: eloop_event_add", __func__);
+	}
+
+	if (control_start(ctx, NULL, AF_UNSPEC) == -1)
+		return -1;
+	setproctitle("[coordinator] %u shards", ctx->shards);
+	return 1;
+}
+
+void
+shard_stop(struct dhcpcd_ctx *ctx)
+{
+	struct shard *sh;
+	unsigned int i;
+
+	if (ctx->shard_procs == NULL)
+		return;
+
+	/* We only get here with workers running if we failed. */
+	shard_kill(ctx, SIGTERM);
+	for (i = 0; i < ctx->shards; i++) {
+		sh = &ctx->shard_procs[i];
+		if (sh->sh_fd != -1) {
+			eloop_event_delete(ctx->eloop, sh->sh_fd);
+			close(sh->sh_fd);
+		}
+		if (sh->sh_listen_fd != -1) {
+			eloop_event_delete(ctx->eloop, sh->sh_listen_fd);
+			close(sh->sh_listen_fd);
+		}
+	}
+	free(ctx->shard_procs);
+	ctx->shard_procs = NULL;
+}
+#endif
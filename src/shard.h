@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdbool.h>
+
+#include "dhcpcd.h"
+
+/* Workers are forked and signalled, so not for small or fork-less builds */
+#if !defined(SMALL) && !defined(THERE_IS_NO_FORK)
+#define	SHARDS
+#endif
+
+#define	SHARDS_MAX	64
+
+/* A worker's control socket is named as an interface could never be. */
+#define	SHARD_IFNAME	"shard:%d"
+
+#ifdef SHARDS
+#define	SHARD_WORKER(ctx)	((ctx)->shard != -1)
+#define	SHARD_COORDINATOR(ctx)	((ctx)->shards != 0 && (ctx)->shard == -1)
+/* A worker forked again by the coordinator, for main to start. */
+#define	shard_restarted(ctx)	((ctx)->shard_restart)
+
+bool shard_owns(const struct dhcpcd_ctx *, const char *);
+int shard_start(struct dhcpcd_ctx *);
+void shard_stop(struct dhcpcd_ctx *);
+int shard_handleargs(struct dhcpcd_ctx *, struct fd_list *, int, char **);
+#else
+#define	SHARD_WORKER(ctx)	(false)
+#define	SHARD_COORDINATOR(ctx)	(false)
+#define	shard_owns(ctx, ifname)	(true)
+#define	shard_start(ctx)	(0)
+#define	shard_stop(ctx)		do { } while (0 /* CONSTCOND */)
+#endif
+
+#endif
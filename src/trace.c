@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcpcd.h"
+#include "eloop.h"
+#include "if.h"
+#include "trace.h"
+
+#ifdef TRACE
+static const char * const trace_events[TRACE_EVENT_MAX] = {
+	NULL,
+	"dhcp_recv", "dhcp6_recv", "ra_begin", "ra_end",
+	"rt_build_begin", "rt_build_end", "ps_send", "ps_recv",
+	"script_start", "script_stop",
+};
+
+/* Record an event. The ring is mapped on first use so processes
+ * which never trace anything don't pay for it.
+ * Tracing is best effort, so errno is preserved for the caller. */
+void
+trace_event(struct dhcpcd_ctx *ctx, unsigned int event,
+    const struct interface *ifp, uint32_t arg)
+{
+	struct trace_ring *ring = ctx->trace_ring;
+	struct trace_rec *tr;
+	struct timespec ts;
+	int serrno = errno;
+
+	if (ring == NULL) {
+		ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (ring == MAP_FAILED) {
+			/* Don't keep trying. */
+			ctx->trace = false;
+			goto out;
+		}
+		ctx->trace_ring = ring;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		timespecclear(&ts);
+	tr = &ring->tr_recs[ring->tr_head++ & (TRACE_RING_LEN - 1)];
+	tr->tr_when = (uint64_t)ts.tv_sec * NSEC_PER_SEC +
+	    (uint64_t)ts.tv_nsec;
+	tr->tr_ifindex = ifp != NULL ? ifp->index : 0;
+	tr->tr_arg = arg;
+	tr->tr_event = (uint16_t)event;
+
+out:
+	errno = serrno;
+}
+
+/* A new process starts with an empty ring rather than a copy of
+ * what its parent recorded. */
+void
+trace_forked(struct dhcpcd_ctx *ctx)
+{
+
+	if (ctx->trace_ring != NULL)
+		ctx->trace_ring->tr_head = 0;
+}
+
+/* Write the ring, oldest first, to buf as NUL separated key=value
+ * pairs, like eloop_stats_format. */
+ssize_t
+trace_format(const struct dhcpcd_ctx *ctx, char *buf, size_t len)
+{
+	const struct trace_ring *ring = ctx->trace_ring;
+	const struct trace_rec *tr;
+	const struct interface *ifp;
+	uint64_t head, i, first;
+	size_t idx = 0, pos = 0;
+	int n;
+
+#define	STATPF(...)							      \
+	do {								      \
+		n = snprintf(pos < len ? buf + pos : NULL,		      \
+		    pos < len ? len - pos : 0, __VA_ARGS__);		      \
+		if (n == -1)						      \
+			return -1;					      \
+		pos += (size_t)n + 1;					      \
+	} while (0 /* CONSTCOND */)
+
+	head = ring != NULL ? ring->tr_head : 0;
+	first = head > TRACE_RING_LEN ? head - TRACE_RING_LEN : 0;
+	STATPF("trace_enabled=%d", ctx->trace ? 1 : 0);
+	STATPF("trace_records=%llu", (unsigned long long)head);
+	STATPF("trace_overwritten=%llu", (unsigned long long)first);
+
+	for (i = first; i < head; i++, idx++) {
+		tr = &ring->tr_recs[i & (TRACE_RING_LEN - 1)];
+		STATPF("trace%zu_nsec=%llu", idx,
+		    (unsigned long long)tr->tr_when);
+		if (tr->tr_event < TRACE_EVENT_MAX &&
+		    trace_events[tr->tr_event] != NULL)
+			STATPF("trace%zu_event=%s", idx,
+			    trace_events[tr->tr_event]);
+		else
+			STATPF("trace%zu_event=%u", idx, tr->tr_event);
+		if (tr->tr_ifindex != 0) {
+			ifp = if_findindex(ctx->ifaces, tr->tr_ifindex);
+			if (ifp != NULL)
+				STATPF("trace%zu_if=%s", idx, ifp->name);
+			else
+				STATPF("trace%zu_if=%u", idx, tr->tr_ifindex);
+		}
+		STATPF("trace%zu_arg=%u", idx, tr->tr_arg);
+	}
+#undef STATPF
+
+	if (pos > SSIZE_MAX) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	return (ssize_t)pos;
+}
+
+void
+trace_free(struct dhcpcd_ctx *ctx)
+{
+
+	if (ctx->trace_ring != NULL) {
+		munmap(ctx->trace_ring, sizeof(*ctx->trace_ring));
+		ctx->trace_ring = NULL;
+	}
+}
+#endif
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <unistd.h>
+
+#ifndef SMALL
+#define	TRACE
+#endif
+
+/*
+ * Trace points record key transitions as fixed size binary records
+ * in a ring private to each process, which is much cheaper than
+ * debug logging when timing what dhcpcd does.
+ * They are enabled by the trace option and read by dhcpcd --stats trace.
+ * What tr_arg holds is noted for each event.
+ */
+#define	TRACE_DHCP_RECV		1	/* message type << 8 | state */
+#define	TRACE_DHCP6_RECV	2	/* message type << 8 | state */
+#define	TRACE_RA_BEGIN		3	/* length */
+#define	TRACE_RA_END		4
+#define	TRACE_RT_BEGIN		5	/* address family */
+#define	TRACE_RT_END		6	/* address family */
+#define	TRACE_PS_SEND		7	/* command */
+#define	TRACE_PS_RECV		8	/* command */
+#define	TRACE_SCRIPT_START	9
+#define	TRACE_SCRIPT_STOP	10	/* microseconds run */
+#define	TRACE_EVENT_MAX		11
+
+struct trace_rec {
+	uint64_t tr_when;	/* nanoseconds, CLOCK_MONOTONIC */
+	uint32_t tr_ifindex;	/* 0 if not for an interface */
+	uint32_t tr_arg;
+	uint16_t tr_event;
+	uint16_t tr_spare[3];
+};
+
+#define	TRACE_RING_LEN	1024	/* records, a power of 2 */
+
+struct trace_ring {
+	uint64_t tr_head;	/* records ever written */
+	struct trace_rec tr_recs[TRACE_RING_LEN];
+};
+
+#ifdef TRACE
+struct dhcpcd_ctx;
+struct interface;
+
+void trace_event(struct dhcpcd_ctx *, unsigned int,
+    const struct interface *, uint32_t);
+void trace_forked(struct dhcpcd_ctx *);
+ssize_t trace_format(const struct dhcpcd_ctx *, char *, size_t);
+void trace_free(struct dhcpcd_ctx *);
+
+#define	TRACE_EVENT(ctx, ev, ifp, arg)					      \
+	do {								      \
+		if ((ctx)->trace)					      \
+			trace_event((ctx), (ev), (ifp), (arg));		      \
+	} while (0 /* CONSTCOND */)
+#else
+#define	TRACE_EVENT(ctx, ev, ifp, arg)	do { } while (0 /* CONSTCOND */)
+#endif
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2018 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <dlfcn.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "test.h"
+
+#ifdef HAVE_HMAC_H
+#include <hmac.h>
+#endif
+#if defined(HAVE_MD5_H) && !defined(DEPGEN)
+#include <md5.h>
+#endif
+#ifdef SHA2_H
+#include SHA2_H
+#endif
+
+#ifndef timespecsub
+#define timespecsub(tsp, usp, vsp)                                      \
+        do {                                                            \
+                (vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;          \
+                (vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;       \
+                if ((vsp)->tv_nsec < 0) {                               \
+                        (vsp)->tv_sec--;                                \
+                        (vsp)->tv_nsec += 1000000000L;                  \
+                }                                                       \
+        } while (/* CONSTCOND */ 0)
+#endif
+
+/* A DHCP auth key is 16 bytes, see RFC 3118. */
+#define	KEY_LEN		16
+#define	DIGEST_MAX	32
+
+/* The smallest and largest DHCP messages we see, then bulk sizes. */
+static const size_t sizes[] = { 300, 576, 1500, 16384, 1048576 };
+
+/* The few libcrypto one shot functions we compare with.
+ * They are found at run time so building does not depend on it. */
+typedef unsigned char *(*digest_fn)(const unsigned char *, size_t,
+    unsigned char *);
+typedef const void *(*evp_md_fn)(void);
+typedef unsigned char *(*hmac_fn)(const void *, const void *, int,
+    const unsigned char *, size_t, unsigned char *, unsigned int *);
+
+static struct {
+	digest_fn md5;
+	digest_fn sha256;
+	hmac_fn hmac;
+	const void *evp_md5;
+} lc;
+
+static uint8_t key[KEY_LEN];
+
+static void
+compat_md5(const uint8_t *data, size_t len, uint8_t *digest)
+{
+	MD5_CTX ctx;
+
+	MD5Init(&ctx);
+	MD5Update(&ctx, data, (unsigned int)len);
+	MD5Final(digest, &ctx);
+}
+
+static void
+compat_sha256(const uint8_t *data, size_t len, uint8_t *digest)
+{
+	SHA256_CTX ctx;
+
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, data, (unsigned int)len);
+	SHA256_Final(digest, &ctx);
+}
+
+static void
+compat_hmac_md5(const uint8_t *data, size_t len, uint8_t *digest)
+{
+
+	hmac("md5", key, sizeof(key), data, len, digest, MD5_DIGEST_LENGTH);
+}
+
+static void
+libcrypto_md5(const uint8_t *data, size_t len, uint8_t *digest)
+{
+
+	lc.md5(data, len, digest);
+}
+
+static void
+libcrypto_sha256(const uint8_t *data, size_t len, uint8_t *digest)
+{
+
+	lc.sha256(data, len, digest);
+}
+
+static void
+libcrypto_hmac_md5(const uint8_t *data, size_t len, uint8_t *digest)
+{
+	unsigned int dlen;
+
+	lc.hmac(lc.evp_md5, key, sizeof(key), data, len, digest, &dlen);
+}
+
+struct bench {
+	const char *name;
+	const char *impl;
+	size_t digsize;
+	void (*fn)(const uint8_t *, size_t, uint8_t *);
+};
+
+static const struct bench benches[] = {
+	{ "md5", "compat", MD5_DIGEST_LENGTH, compat_md5 },
+	{ "md5", "libcrypto", MD5_DIGEST_LENGTH, libcrypto_md5 },
+	{ "sha256", "compat", SHA256_DIGEST_LENGTH, compat_sha256 },
+	{ "sha256", "libcrypto", SHA256_DIGEST_LENGTH, libcrypto_sha256 },
+	{ "hmac-md5", "compat", MD5_DIGEST_LENGTH, compat_hmac_md5 },
+	{ "hmac-md5", "libcrypto", MD5_DIGEST_LENGTH, libcrypto_hmac_md5 },
+};
+
+static int
+bench_avail(const struct bench *b)
+{
+
+	if (b->fn == libcrypto_md5)
+		return lc.md5 != NULL;
+	if (b->fn == libcrypto_sha256)
+		return lc.sha256 != NULL;
+	if (b->fn == libcrypto_hmac_md5)
+		return lc.evp_md5 != NULL;
+	return 1;
+}
+
+static void
+libcrypto_open(void)
+{
+	static const char * const libs[] = {
+		"libcrypto.so", "libcrypto.so.3", "libcrypto.so.1.1", NULL,
+	};
+	const char * const *lib;
+	evp_md_fn evp_md5;
+	void *h;
+
+	for (lib = libs; *lib != NULL; lib++) {
+		if ((h = dlopen(*lib, RTLD_NOW)) != NULL)
+			break;
+	}
+	if (h == NULL) {
+		printf("libcrypto not found, only benching compat\n");
+		return;
+	}
+
+	lc.md5 = (digest_fn)dlsym(h, "MD5");
+	lc.sha256 = (digest_fn)dlsym(h, "SHA256");
+	lc.hmac = (hmac_fn)dlsym(h, "HMAC");
+	evp_md5 = (evp_md_fn)dlsym(h, "EVP_md5");
+	if (lc.hmac != NULL && evp_md5 != NULL)
+		lc.evp_md5 = evp_md5();
+}
+
+static double
+elapsed(const struct timespec *ts)
+{
+	struct timespec te, t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &te) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	timespecsub(&te, ts, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec / 1000000000.0;
+}
+
+static void
+bench(const struct bench *b, const uint8_t *data, size_t len, double secs)
+{
+	struct timespec ts;
+	uint8_t digest[DIGEST_MAX];
+	size_t i, n, batch;
+	double t;
+
+	/* Check the clock every 64k or so hashed. */
+	batch = len >= 65536 ? 1 : 65536 / len;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	n = 0;
+	do {
+		for (i = 0; i < batch; i++)
+			b->fn(data, len, digest);
+		n += batch;
+	} while ((t = elapsed(&ts)) < secs);
+
+	printf("%-8s %-9s %7zu bytes %10.0f ops/sec %8.1f MB/sec\n",
+	    b->name, b->impl, len, (double)n / t,
+	    (double)n * (double)len / t / (1024.0 * 1024.0));
+}
+
+/* The compat and libcrypto digests must agree before we time them. */
+static int
+bench_check(const struct bench *b, const uint8_t *data, size_t len)
+{
+	const struct bench *c;
+	uint8_t d1[DIGEST_MAX], d2[DIGEST_MAX];
+
+	for (c = benches; c < b; c++) {
+		if (strcmp(c->name, b->name) == 0)
+			break;
+	}
+	if (c == b)
+		return 0;
+
+	c->fn(data, len, d1);
+	b->fn(data, len, d2);
+	if (memcmp(d1, d2, b->digsize) == 0)
+		return 0;
+	fprintf(stderr, "%s: %s and %s differ for %zu bytes\n",
+	    b->name, c->impl, b->impl, len);
+	return -1;
+}
+
+int
+bench_crypt(double secs)
+{
+	const struct bench *b;
+	uint8_t *data;
+	size_t i, maxlen;
+	int r = 0;
+
+	libcrypto_open();
+
+	maxlen = 0;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (sizes[i] > maxlen)
+			maxlen = sizes[i];
+	}
+	if ((data = malloc(maxlen)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	for (i = 0; i < maxlen; i++)
+		data[i] = (uint8_t)(i * 31 + 7);
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = (uint8_t)(i + 1);
+
+	for (b = benches;
+	    b < benches + sizeof(benches) / sizeof(benches[0]);
+	    b++)
+	{
+		if (!bench_avail(b))
+			continue;
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			if (bench_check(b, data, sizes[i]) == -1) {
+				r = -1;
+				continue;
+			}
+			bench(b, data, sizes[i], secs);
+		}
+	}
+
+	free(data);
+	return r;
+}
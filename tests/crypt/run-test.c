@@ -25,14 +25,34 @@
  * SUCH DAMAGE.
  */
 
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "test.h"
 
-int main(void)
+int main(int argc, char **argv)
 {
-	int r = 0;
+	int c, r = 0, b = 0;
+	double secs = 1.0;
+
+	while ((c = getopt(argc, argv, "bt:")) != -1) {
+		switch (c) {
+		case 'b':
+			b = 1;
+			break;
+		case 't':
+			secs = atof(optarg);
+			break;
+		default:
+			errx(EXIT_FAILURE, "illegal argument `%c'", c);
+		}
+	}
 
 	if (test_hmac_md5())
 		r = -1;
+	if (r == 0 && b && bench_crypt(secs))
+		r = -1;
 
 	return r;
 }
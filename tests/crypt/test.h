@@ -28,5 +28,6 @@
 #ifndef TEST_H
 
 int test_hmac_md5(void);
+int bench_crypt(double);
 
 #endif
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Run every eloop-bench-<backend> binary built by `make backends`
+# with the given arguments and print the results as a JSON array.
+
+bench="$(dirname "$0")/eloop-bench"
+status=0
+sep=
+
+echo "["
+for b in "$bench"-*; do
+	[ -f "$b" ] && [ -x "$b" ] || continue
+	if ! out=$("$b" -j "$@"); then
+		echo "${b##*/}: failed" >&2
+		status=1
+	fi
+	[ -n "$out" ] || continue
+	printf '%s  %s' "$sep" "$out"
+	sep=",
+"
+done
+[ -n "$sep" ] && echo
+echo "]"
+exit $status
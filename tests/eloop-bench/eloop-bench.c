@@ -29,8 +29,10 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -48,14 +50,166 @@
         } while (/* CONSTCOND */ 0)
 #endif
 
+/* Set by the Makefile when building a binary per backend. */
+#ifndef ELOOP_BACKEND
+#define	ELOOP_BACKEND	"default"
+#endif
+
 struct pipe {
 	int fd[2];
+	struct timespec sent;
+};
+
+struct timer {
+	size_t id;
+};
+
+enum mode {
+	MODE_PIPE,
+	MODE_TIMER,
+	MODE_MIXED,
+	MODE_DELETE,
 };
 
+static const char * const modes[] = {
+	"pipe", "timer", "mixed", "delete", NULL
+};
+
+/* Timers in a delete group share the arg but have unique callbacks. */
+#define	DELETE_GROUP	4
+
 static size_t good, bad, writes, fired;
 static size_t npipes = 100, nwrites = 100, nactive = 1;
+static size_t ntimers = 1000;
+static unsigned int spread = 3600;
+static enum mode mode = MODE_PIPE;
+static uint32_t seed = 1;
 static struct pipe *pipes;
+static struct timer *timers;
 static struct eloop *e;
+static struct timespec churn_sent;
+
+/* Per event latency samples in nanoseconds. */
+static unsigned long long *samples;
+static size_t nsamples, samples_len;
+static int json;
+
+static void
+sample_start(struct timespec *ts)
+{
+
+	if (clock_gettime(CLOCK_MONOTONIC, ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+}
+
+static void
+sample_add(const struct timespec *start)
+{
+	struct timespec now, d;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	timespecsub(&now, start, &d);
+
+	if (nsamples == samples_len) {
+		size_t n = samples_len == 0 ? 1024 : samples_len * 2;
+		unsigned long long *ns;
+
+		ns = realloc(samples, n * sizeof(*samples));
+		if (ns == NULL)
+			err(EXIT_FAILURE, "realloc");
+		samples = ns;
+		samples_len = n;
+	}
+	samples[nsamples++] = (unsigned long long)d.tv_sec * NSEC_PER_SEC +
+	    (unsigned long long)d.tv_nsec;
+}
+
+static int
+sample_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Nearest rank percentile of the sorted samples. */
+static unsigned long long
+sample_pct(unsigned int pct)
+{
+	size_t rank;
+
+	if (nsamples == 0)
+		return 0;
+	rank = (nsamples * pct + 99) / 100;
+	return samples[rank == 0 ? 0 : rank - 1];
+}
+
+/* Small deterministic PRNG so runs are comparable between backends. */
+static uint32_t
+bench_random(void)
+{
+
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void
+timer_cb(void *arg)
+{
+	struct timer *t = arg;
+
+	/* Only reached if spread is tiny, just keep the timer armed. */
+	if (eloop_timeout_add_sec(e, spread, timer_cb, t) == -1)
+		bad++;
+}
+
+static void timer_cb1(void *arg) { timer_cb(arg); }
+static void timer_cb2(void *arg) { timer_cb(arg); }
+static void timer_cb3(void *arg) { timer_cb(arg); }
+
+static void (* const timer_cbs[DELETE_GROUP])(void *) = {
+	timer_cb, timer_cb1, timer_cb2, timer_cb3
+};
+
+/* Re-arm a random timer at a random deadline. */
+static void
+timer_rearm(void)
+{
+	struct timer *t;
+	unsigned long ms;
+
+	if (ntimers == 0)
+		return;
+	t = &timers[bench_random() % ntimers];
+	ms = MSEC_PER_SEC +
+	    bench_random() % ((unsigned long)spread * MSEC_PER_SEC);
+	if (eloop_timeout_add_msec(e, ms, timer_cb, t) == -1) {
+		warn("%s: eloop_timeout_add_msec", __func__);
+		bad++;
+	}
+}
+
+static void
+churn_cb(void *arg)
+{
+
+	sample_add(&churn_sent);
+	timer_rearm();
+	good++;
+	if (--writes == 0) {
+		eloop_exit(e, bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+		return;
+	}
+	sample_start(&churn_sent);
+	if (eloop_timeout_add_msec(e, 0, churn_cb, arg) == -1) {
+		warn("%s: eloop_timeout_add_msec", __func__);
+		eloop_exit(e, EXIT_FAILURE);
+	}
+}
 
 static void
 read_cb(void *arg, unsigned short events)
@@ -69,11 +223,17 @@ read_cb(void *arg, unsigned short events)
 	if (read(p->fd[0], buf, 1) != 1) {
 		warn("%s: read", __func__);
 		bad++;
-	} else
+	} else {
+		sample_add(&p->sent);
 		good++;
+	}
+
+	if (mode == MODE_MIXED)
+		timer_rearm();
 
 	if (writes != 0) {
 		writes--;
+		sample_start(&p->sent);
 		if (write(p->fd[1], "e", 1) != 1) {
 			warn("%s: write", __func__);
 			bad++;
@@ -88,6 +248,31 @@ read_cb(void *arg, unsigned short events)
 	}
 }
 
+/* Add a group of timers for each arg and then delete them by arg. */
+static int
+delete_run(void)
+{
+	size_t i, j;
+	unsigned int sec;
+	struct timespec ts;
+
+	for (i = 0; i < ntimers; i++) {
+		for (j = 0; j < DELETE_GROUP; j++) {
+			sec = 1 + bench_random() % spread;
+			if (eloop_timeout_add_sec(e, sec, timer_cbs[j],
+			    &timers[i]) == -1)
+				err(EXIT_FAILURE, "eloop_timeout_add_sec");
+		}
+	}
+	for (i = 0; i < ntimers; i++) {
+		sample_start(&ts);
+		if (eloop_timeout_delete(e, NULL, &timers[i]) != DELETE_GROUP)
+			bad++;
+		sample_add(&ts);
+	}
+	return bad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 static int
 runone(struct timespec *t)
 {
@@ -97,18 +282,38 @@ runone(struct timespec *t)
 	int result;
 
 	writes = nwrites;
-	fired = good = 0;
+	fired = good = bad = 0;
 
-	for (i = 0, p = pipes; i < nactive; i++, p++) {
-		if (write(p->fd[1], "e", 1) != 1)
-			err(EXIT_FAILURE, "send");
-		writes--;
-		fired++;
+	switch (mode) {
+	case MODE_PIPE: /* FALLTHROUGH */
+	case MODE_MIXED:
+		for (i = 0, p = pipes; i < nactive; i++, p++) {
+			sample_start(&p->sent);
+			if (write(p->fd[1], "e", 1) != 1)
+				err(EXIT_FAILURE, "send");
+			writes--;
+			fired++;
+		}
+		break;
+	case MODE_TIMER:
+		if (writes == 0)
+			return EXIT_SUCCESS;
+		sample_start(&churn_sent);
+		if (eloop_timeout_add_msec(e, 0, churn_cb, NULL) == -1)
+			err(EXIT_FAILURE, "eloop_timeout_add_msec");
+		break;
+	case MODE_DELETE:
+		break;
 	}
 
 	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
 		err(EXIT_FAILURE, "clock_gettime");
-	result = eloop_start(e, NULL);
+	if (mode == MODE_DELETE)
+		result = delete_run();
+	else {
+		eloop_enter(e);
+		result = eloop_start(e, NULL);
+	}
 	if (clock_gettime(CLOCK_MONOTONIC, &te) == -1)
 		err(EXIT_FAILURE, "clock_gettime");
 
@@ -123,18 +328,45 @@ main(int argc, char **argv)
 	size_t i, nruns = 25;
 	struct pipe *p;
 	struct timespec ts, te, t;
+	unsigned long long sum, mean;
+	uint32_t seed0;
 
-	while ((c = getopt(argc, argv, "a:n:r:w:")) != -1) {
+	while ((c = getopt(argc, argv, "a:d:jm:n:r:s:t:w:")) != -1) {
 		switch (c) {
 		case 'a':
 			nactive = (size_t)atoi(optarg);
 			break;
+		case 'd':
+			spread = (unsigned int)atoi(optarg);
+			if (spread == 0)
+				errx(EXIT_FAILURE, "spread must be positive");
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'm':
+			for (i = 0; modes[i] != NULL; i++) {
+				if (strcmp(modes[i], optarg) == 0)
+					break;
+			}
+			if (modes[i] == NULL)
+				errx(EXIT_FAILURE, "unknown mode `%s'", optarg);
+			mode = (enum mode)i;
+			break;
 		case 'n':
 			npipes = (size_t)atoi(optarg);
 			break;
 		case 'r':
 			nruns = (size_t)atoi(optarg);
 			break;
+		case 's':
+			seed = (uint32_t)strtoul(optarg, NULL, 0);
+			if (seed == 0)
+				errx(EXIT_FAILURE, "seed must be non zero");
+			break;
+		case 't':
+			ntimers = (size_t)atoi(optarg);
+			break;
 		case 'w':
 			nwrites = (size_t)atoi(optarg);
 			break;
@@ -143,6 +375,7 @@ main(int argc, char **argv)
 		}
 	}
 
+	seed0 = seed;
 	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
 		err(EXIT_FAILURE, "clock_gettime");
 
@@ -163,25 +396,73 @@ main(int argc, char **argv)
 			err(EXIT_FAILURE, "eloop_event_add");
 	}
 
-	printf("active = %zu, pipes = %zu, runs = %zu, writes = %zu\n",
-	    nactive, npipes, nruns, nwrites);
+	if (mode != MODE_PIPE) {
+		timers = calloc(ntimers, sizeof(*timers));
+		if (timers == NULL && ntimers != 0)
+			err(EXIT_FAILURE, "malloc");
+		for (i = 0; i < ntimers; i++)
+			timers[i].id = i;
+	}
+	if (mode == MODE_TIMER || mode == MODE_MIXED) {
+		for (i = 0; i < ntimers; i++) {
+			if (eloop_timeout_add_sec(e,
+			    1 + bench_random() % spread,
+			    timer_cb, &timers[i]) == -1)
+				err(EXIT_FAILURE, "eloop_timeout_add_sec");
+		}
+	}
+
+	if (!json)
+		printf("backend = %s, mode = %s, active = %zu, pipes = %zu, "
+		    "timers = %zu, runs = %zu, writes = %zu\n",
+		    ELOOP_BACKEND, modes[mode], nactive, npipes, ntimers,
+		    nruns, nwrites);
 
 	exit_code = EXIT_SUCCESS;
 	for (i = 0; i < nruns; i++) {
 		result = runone(&t);
 		if (result != EXIT_SUCCESS)
 			exit_code = result;
-		printf("run %zu took %lld.%.9ld seconds, result %d\n",
-		    i + 1, (long long)t.tv_sec, t.tv_nsec, result);
+		if (!json)
+			printf("run %zu took %lld.%.9ld seconds, result %d\n",
+			    i + 1, (long long)t.tv_sec, t.tv_nsec, result);
 	}
 
 	eloop_free(e);
 	free(pipes);
+	free(timers);
 
 	if (clock_gettime(CLOCK_MONOTONIC, &te) == -1)
 		err(EXIT_FAILURE, "clock_gettime");
 	timespecsub(&te, &ts, &t);
-	printf("total %lld.%.9ld seconds, result %d\n",
-	    (long long)t.tv_sec, t.tv_nsec, exit_code);
+
+	qsort(samples, nsamples, sizeof(*samples), sample_cmp);
+	for (i = 0, sum = 0; i < nsamples; i++)
+		sum += samples[i];
+	mean = nsamples == 0 ? 0 : sum / nsamples;
+
+	if (json) {
+		printf("{\"backend\": \"%s\", \"mode\": \"%s\", "
+		    "\"active\": %zu, \"pipes\": %zu, \"timers\": %zu, "
+		    "\"runs\": %zu, \"writes\": %zu, \"seed\": %u, "
+		    "\"result\": %d, \"total_ns\": %llu, \"events\": %zu, "
+		    "\"latency_ns\": {\"min\": %llu, \"median\": %llu, "
+		    "\"p95\": %llu, \"p99\": %llu, \"max\": %llu, "
+		    "\"mean\": %llu}}\n",
+		    ELOOP_BACKEND, modes[mode], nactive, npipes, ntimers,
+		    nruns, nwrites, seed0, exit_code,
+		    (unsigned long long)t.tv_sec * NSEC_PER_SEC +
+		    (unsigned long long)t.tv_nsec, nsamples,
+		    sample_pct(0), sample_pct(50), sample_pct(95),
+		    sample_pct(99), sample_pct(100), mean);
+	} else {
+		printf("latency (ns) min %llu, median %llu, p95 %llu, "
+		    "p99 %llu, max %llu over %zu events\n",
+		    sample_pct(0), sample_pct(50), sample_pct(95),
+		    sample_pct(99), sample_pct(100), nsamples);
+		printf("total %lld.%.9ld seconds, result %d\n",
+		    (long long)t.tv_sec, t.tv_nsec, exit_code);
+	}
+	free(samples);
 	exit(exit_code);
 }
@@ -0,0 +1,323 @@
+/*
+ * dhcpcd - DHCP client daemon
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcpcd.h"
+#include "if-options.h"
+#include "leasedb.h"
+#include "logerr.h"
+#include "shard.h"
+#include "test.h"
+
+/* The Makefile builds leasedb.c with LEASEDB set to this. */
+#define	DB		"leases.db"
+#define	LEASE_MAX	1500
+
+#define	CHECK(x)							\
+	do {								\
+		if (!(x))						\
+			failed(__func__, __LINE__, #x);			\
+	} while (/* CONSTCOND */ 0)
+
+static struct dhcpcd_ctx ctx;
+
+static void
+failed(const char *func, int line, const char *expr)
+{
+	fprintf(stderr, "FAILED! %s:%d: %s\n", func, line, expr);
+	exit(EXIT_FAILURE);
+}
+
+static void
+lease(uint8_t *data, size_t len, const char *key, unsigned int gen)
+{
+	size_t i, keylen = strlen(key);
+
+	for (i = 0; i < len; i++)
+		data[i] = (uint8_t)((uint8_t)key[i % keylen] + gen + i);
+}
+
+/* The legacy file is named as the key, so the tests see it. */
+static ssize_t
+put(const char *key, const uint8_t *data, size_t len)
+{
+
+	return leasedb_write(&ctx, key, key, data, len);
+}
+
+static bool
+has(const char *key, const uint8_t *data, size_t len)
+{
+	uint8_t buf[LEASE_MAX];
+	ssize_t bytes;
+
+	bytes = leasedb_read(&ctx, key, key, buf, sizeof(buf));
+	return bytes != -1 && (size_t)bytes == len &&
+	    memcmp(buf, data, len) == 0;
+}
+
+static bool
+gone(const char *key)
+{
+	uint8_t buf[LEASE_MAX];
+
+	return leasedb_read(&ctx, key, key, buf, sizeof(buf)) == -1 &&
+	    errno == ENOENT;
+}
+
+static off_t
+dbsize(void)
+{
+	struct stat st;
+
+	CHECK(stat(DB, &st) == 0);
+	return st.st_size;
+}
+
+/* Drop what's held so the next call loads the file again. */
+static void
+reopen(void)
+{
+
+	leasedb_free(&ctx);
+}
+
+static void
+fresh(void)
+{
+
+	leasedb_free(&ctx);
+	CHECK(unlink(DB) == 0 || errno == ENOENT);
+}
+
+static void
+append(const void *data, size_t len)
+{
+	int fd;
+
+	fd = open(DB, O_WRONLY | O_APPEND);
+	CHECK(fd != -1);
+	CHECK(write(fd, data, len) == (ssize_t)len);
+	close(fd);
+}
+
+static void
+test_exact(void)
+{
+	uint8_t data[64], buf[64];
+
+	fresh();
+	lease(data, sizeof(data), "exact.lease", 0);
+	CHECK(put("exact.lease", data, sizeof(data)) == sizeof(data));
+	CHECK(leasedb_read(&ctx, "exact.lease", "exact.lease",
+	    buf, sizeof(buf)) == sizeof(buf));
+	CHECK(memcmp(buf, data, sizeof(data)) == 0);
+	CHECK(leasedb_read(&ctx, "exact.lease", "exact.lease",
+	    buf, sizeof(buf) - 1) == -1 && errno == ENOBUFS);
+	printf("%s: ok\n", __func__);
+}
+
+/* A crash mid write leaves part of a record at the end. */
+static void
+test_torn(void)
+{
+	uint8_t a[100], b[200], head[sizeof(a) + 64];
+	off_t asize, size;
+	int fd;
+
+	fresh();
+	lease(a, sizeof(a), "a.lease", 0);
+	lease(b, sizeof(b), "b.lease6", 0);
+	CHECK(put("a.lease", a, sizeof(a)) == sizeof(a));
+	asize = dbsize();
+	CHECK(put("b.lease6", b, sizeof(b)) == sizeof(b));
+	size = dbsize();
+
+	/* The first record, less its last byte, is a whole header
+	 * followed by too little to fill it. */
+	CHECK((size_t)asize <= sizeof(head));
+	fd = open(DB, O_RDONLY);
+	CHECK(fd != -1);
+	CHECK(read(fd, head, (size_t)asize) == asize);
+	close(fd);
+	append(head, (size_t)asize - 1);
+	reopen();
+	CHECK(has("a.lease", a, sizeof(a)));
+	CHECK(has("b.lease6", b, sizeof(b)));
+	CHECK(dbsize() == size);
+
+	/* And a header cut short. */
+	append(head, 10);
+	reopen();
+	CHECK(has("a.lease", a, sizeof(a)));
+	CHECK(has("b.lease6", b, sizeof(b)));
+	CHECK(dbsize() == size);
+
+	/* Commits carry on from the end of the good records. */
+	lease(a, sizeof(a), "a.lease", 1);
+	CHECK(put("a.lease", a, sizeof(a)) == sizeof(a));
+	reopen();
+	CHECK(has("a.lease", a, sizeof(a)));
+	CHECK(has("b.lease6", b, sizeof(b)));
+	printf("%s: ok\n", __func__);
+}
+
+/* Nothing after a bad record can be trusted, so it all goes. */
+static void
+test_cksum(void)
+{
+	uint8_t a[100], c[100], d[300], e[50], byte;
+	off_t coff, cend;
+	int fd;
+
+	fresh();
+	lease(a, sizeof(a), "a.lease", 0);
+	lease(c, sizeof(c), "c.lease", 0);
+	lease(d, sizeof(d), "d.lease6", 0);
+	lease(e, sizeof(e), "e.lease", 0);
+	CHECK(put("a.lease", a, sizeof(a)) == sizeof(a));
+	coff = dbsize();
+	CHECK(put("c.lease", c, sizeof(c)) == sizeof(c));
+	cend = dbsize();
+	CHECK(put("d.lease6", d, sizeof(d)) == sizeof(d));
+	CHECK(put("e.lease", e, sizeof(e)) == sizeof(e));
+
+	/* Flip a bit in the middle of the lease in the second record. */
+	fd = open(DB, O_RDWR);
+	CHECK(fd != -1);
+	CHECK(pread(fd, &byte, 1, coff + (cend - coff) / 2) == 1);
+	byte ^= 0x10;
+	CHECK(pwrite(fd, &byte, 1, coff + (cend - coff) / 2) == 1);
+	close(fd);
+
+	reopen();
+	CHECK(has("a.lease", a, sizeof(a)));
+	CHECK(gone("c.lease"));
+	CHECK(gone("d.lease6"));
+	CHECK(gone("e.lease"));
+	CHECK(dbsize() == coff);
+
+	CHECK(put("d.lease6", d, sizeof(d)) == sizeof(d));
+	reopen();
+	CHECK(has("a.lease", a, sizeof(a)));
+	CHECK(has("d.lease6", d, sizeof(d)));
+	printf("%s: ok\n", __func__);
+}
+
+/* Rewriting one lease over and over gets the file rewritten. */
+static void
+test_compact(void)
+{
+	uint8_t a[1024], b[200];
+	unsigned int i, n = 160;
+
+	fresh();
+	lease(b, sizeof(b), "b.lease6", 0);
+	CHECK(put("b.lease6", b, sizeof(b)) == sizeof(b));
+	for (i = 0; i < n; i++) {
+		lease(a, sizeof(a), "a.lease", i);
+		CHECK(put("a.lease", a, sizeof(a)) == sizeof(a));
+	}
+	/* Without compaction this would be over twice the limit. */
+	CHECK(n * sizeof(a) > 2 * 64 * 1024);
+	CHECK(dbsize() < 64 * 1024);
+	CHECK(access(DB ".new", F_OK) == -1 && errno == ENOENT);
+	CHECK(has("a.lease", a, sizeof(a)));
+	CHECK(has("b.lease6", b, sizeof(b)));
+
+	reopen();
+	CHECK(has("a.lease", a, sizeof(a)));
+	CHECK(has("b.lease6", b, sizeof(b)));
+	printf("%s: ok\n", __func__);
+}
+
+/* Leases from before lease_db are read from their files. */
+static void
+test_legacy(void)
+{
+	uint8_t l[80], l2[80];
+	struct stat st;
+	time_t mtime;
+	int fd;
+
+	fresh();
+	lease(l, sizeof(l), "l.lease", 0);
+	fd = open("l.lease", O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	CHECK(fd != -1);
+	CHECK(write(fd, l, sizeof(l)) == sizeof(l));
+	close(fd);
+	CHECK(stat("l.lease", &st) == 0);
+
+	CHECK(has("l.lease", l, sizeof(l)));
+	CHECK(leasedb_mtime(&ctx, "l.lease", "l.lease", &mtime) == 0);
+	CHECK(mtime == st.st_mtime);
+
+	/* Once committed the file goes and the database answers. */
+	lease(l2, sizeof(l2), "l.lease", 1);
+	CHECK(put("l.lease", l2, sizeof(l2)) == sizeof(l2));
+	CHECK(access("l.lease", F_OK) == -1 && errno == ENOENT);
+	CHECK(has("l.lease", l2, sizeof(l2)));
+
+	CHECK(leasedb_unlink(&ctx, "l.lease", "l.lease") == 0);
+	CHECK(gone("l.lease"));
+	reopen();
+	CHECK(gone("l.lease"));
+	printf("%s: ok\n", __func__);
+}
+
+int
+test_leasedb(void)
+{
+
+	logsetopts(LOGERR_ERR);
+	ctx.options = DHCPCD_LEASEDB | DHCPCD_MANAGER;
+#ifdef SHARDS
+	ctx.shard = -1;
+#endif
+
+	test_exact();
+	test_torn();
+	test_cksum();
+	test_compact();
+	test_legacy();
+
+	fresh();
+	return 0;
+}
@@ -0,0 +1,746 @@
+/*
+ * dhcpcd packet parsing benchmark and fuzz target
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcpcd.h"
+#include "dhcp.h"
+#include "dhcp6.h"
+#include "eloop.h"
+#include "if-options.h"
+#include "ipv6nd.h"
+#include "logerr.h"
+
+#ifndef timespecsub
+#define timespecsub(tsp, usp, vsp)                                      \
+        do {                                                            \
+                (vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;          \
+                (vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;       \
+                if ((vsp)->tv_nsec < 0) {                               \
+                        (vsp)->tv_sec--;                                \
+                        (vsp)->tv_nsec += 1000000000L;                  \
+                }                                                       \
+        } while (/* CONSTCOND */ 0)
+#endif
+
+/* Largest packet we build or accept from a corpus file. */
+#define	PKT_MAX		UDPLEN_MAX
+
+#ifndef ND_OPT_RDNSS
+#define ND_OPT_RDNSS			25
+#endif
+#ifndef ND_OPT_DNSSL
+#define ND_OPT_DNSSL			31
+#endif
+
+/* Packets built for each kind. Each one differs in its option counts
+ * so the parsers cannot settle on a single shape. */
+#define	NPKTS		8
+
+enum kind {
+	KIND_DHCP,
+	KIND_DHCP6,
+	KIND_RA,
+	KIND_MAX,
+};
+
+struct pkt {
+	enum kind kind;
+	size_t len;
+	union {
+		uint32_t align;
+		uint8_t data[PKT_MAX];
+	} u;
+};
+
+static struct dhcpcd_ctx ctx;
+static struct interface *ifp;
+static struct ra ra;
+static FILE *devnull;
+
+static void
+bench_init(const char *cffile)
+{
+	struct dhcp6_state *state;
+
+	logsetopts(LOGERR_QUIET);
+
+	/* An empty name fails to open, leaving just the embedded config. */
+	ctx.cffile = cffile == NULL ? "" : cffile;
+	TAILQ_INIT(&ctx.optmasks);
+
+	if ((ifp = calloc(1, sizeof(*ifp))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	ifp->ctx = &ctx;
+	strlcpy(ifp->name, "bench0", sizeof(ifp->name));
+	if ((ifp->options = read_config(&ctx, NULL, NULL, NULL)) == NULL)
+		errx(EXIT_FAILURE, "read_config");
+
+	/* dhcp6_env walks our addresses for delegated prefixes. */
+	if ((state = calloc(1, sizeof(*state))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	TAILQ_INIT(&state->addrs);
+	ifp->if_data[IF_DATA_DHCP6] = state;
+
+	/* ipv6nd_env walks every router for the interface. */
+	if ((ctx.ra_routers = malloc(sizeof(*ctx.ra_routers))) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	TAILQ_INIT(ctx.ra_routers);
+	ra.iface = ifp;
+	strlcpy(ra.sfrom, "fe80::1", sizeof(ra.sfrom));
+	TAILQ_INIT(&ra.addrs);
+	TAILQ_INSERT_TAIL(ctx.ra_routers, &ra, next);
+
+	if ((devnull = fopen("/dev/null", "w")) == NULL)
+		err(EXIT_FAILURE, "/dev/null");
+}
+
+static ssize_t
+parse(FILE *fp, enum kind kind, uint8_t *data, size_t len)
+{
+
+	switch (kind) {
+	case KIND_DHCP:
+		/* dhcp_handlepacket discards anything shorter */
+		if (len < DHCP_MIN_LEN)
+			return 0;
+		return dhcp_env(fp, "new", ifp, (struct bootp *)data, len);
+	case KIND_DHCP6:
+		return dhcp6_env(fp, "new", ifp,
+		    (struct dhcp6_message *)data, len);
+	case KIND_RA:
+		/* ipv6nd_handlera discards anything shorter */
+		if (len < sizeof(struct nd_router_advert))
+			return 0;
+		ra.data = data;
+		ra.data_len = len;
+		return ipv6nd_env(fp, ifp);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+#ifdef FUZZ
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+/* The first byte picks the parser, the rest is the packet. */
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+	static struct pkt pkt;
+
+	if (ifp == NULL)
+		bench_init(NULL);
+	if (len < 1 || len - 1 > sizeof(pkt.u.data))
+		return 0;
+	pkt.kind = (enum kind)(data[0] % KIND_MAX);
+	pkt.len = len - 1;
+	memcpy(pkt.u.data, data + 1, pkt.len);
+	parse(devnull, pkt.kind, pkt.u.data, pkt.len);
+	return 0;
+}
+#else
+static const char * const kinds[] = {
+	"dhcp", "dhcp6", "ra", NULL
+};
+
+static struct pkt *pkts;
+static size_t npkts, pkts_len;
+static uint32_t seed = 1;
+
+/* Same PRNG as eloop-bench so runs can be repeated. */
+static uint32_t
+bench_random(void)
+{
+
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static struct pkt *
+pkt_new(enum kind kind)
+{
+	struct pkt *p;
+
+	if (npkts == pkts_len) {
+		size_t n = pkts_len == 0 ? 16 : pkts_len * 2;
+
+		p = reallocarray(pkts, n, sizeof(*pkts));
+		if (p == NULL)
+			err(EXIT_FAILURE, "reallocarray");
+		pkts = p;
+		pkts_len = n;
+	}
+	p = &pkts[npkts++];
+	memset(p, 0, sizeof(*p));
+	p->kind = kind;
+	return p;
+}
+
+static uint8_t *
+put(uint8_t *p, const void *data, size_t len)
+{
+
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static uint8_t *
+put16(uint8_t *p, uint16_t v)
+{
+
+	v = htons(v);
+	return put(p, &v, sizeof(v));
+}
+
+static uint8_t *
+put32(uint8_t *p, uint32_t v)
+{
+
+	v = htonl(v);
+	return put(p, &v, sizeof(v));
+}
+
+static uint8_t *
+put_dhcpopt(uint8_t *p, uint8_t opt, const void *data, size_t len)
+{
+
+	*p++ = opt;
+	*p++ = (uint8_t)len;
+	return put(p, data, len);
+}
+
+/*
+ * An ACK carrying RFC 3442 classless routes split over several options
+ * (RFC 3396 concatenation) with the file and sname fields overloaded
+ * to hold more options.
+ */
+static void
+build_dhcp(size_t nroutes)
+{
+	struct pkt *pkt;
+	struct bootp *bootp;
+	uint8_t *p, *e, buf[255], *r;
+	uint8_t dns[12] = { 10, 0, 0, 1, 10, 0, 0, 2, 10, 0, 0, 3 };
+	uint8_t gw[8] = { 10, 0, 0, 1, 10, 0, 0, 254 };
+	const uint8_t search[] = "\007example\003com\000\003lab\300\000";
+	size_t i, len;
+
+	pkt = pkt_new(KIND_DHCP);
+	bootp = (struct bootp *)pkt->u.data;
+	bootp->op = BOOTREPLY;
+	bootp->htype = 1;
+	bootp->hlen = 6;
+	bootp->xid = htonl(0x12345678);
+	bootp->yiaddr = htonl(0x0a000032);
+	bootp->siaddr = htonl(0x0a000001);
+
+	p = bootp->vend;
+	p = put32(p, MAGIC_COOKIE);
+	buf[0] = DHCP_ACK;
+	p = put_dhcpopt(p, DHO_MESSAGETYPE, buf, 1);
+	buf[0] = 3; /* both file and sname */
+	p = put_dhcpopt(p, DHO_OPTSOVERLOADED, buf, 1);
+	p = put_dhcpopt(p, DHO_SERVERID, gw, 4);
+	put32(buf, 3600);
+	p = put_dhcpopt(p, DHO_LEASETIME, buf, 4);
+	put32(buf, 0xffffff00);
+	p = put_dhcpopt(p, DHO_SUBNETMASK, buf, 4);
+	p = put_dhcpopt(p, DHO_ROUTER, gw, sizeof(gw));
+	p = put_dhcpopt(p, DHO_DNSSERVER, dns, sizeof(dns));
+	p = put_dhcpopt(p, DHO_DNSDOMAIN, "example.com", 11);
+	p = put_dhcpopt(p, DHO_DNSSEARCH, search, sizeof(search) - 1);
+
+	/* Each route is 10.n.0.0/16 via 10.0.0.254, 7 bytes.
+	 * Keep the chunks small enough that the last one fits in
+	 * the overloaded file and sname fields. */
+	for (i = 0, r = buf; i < nroutes; i++) {
+		if (r - buf > 98 - 7) {
+			p = put_dhcpopt(p, DHO_CSR, buf, (size_t)(r - buf));
+			r = buf;
+		}
+		*r++ = 16;
+		*r++ = 10;
+		*r++ = (uint8_t)i;
+		r = put(r, gw + 4, 4);
+	}
+	/* Leave the last chunk to continue in the file field. */
+	e = r;
+
+	*p++ = DHO_END;
+	pkt->len = (size_t)(p - pkt->u.data);
+
+	/* Split the last chunk mid route over file and sname. */
+	len = (size_t)(e - buf);
+	p = bootp->file;
+	p = put_dhcpopt(p, DHO_CSR, buf, len > 63 ? 63 : len);
+	p = put_dhcpopt(p, DHO_HOSTNAME, "bench0", 6);
+	*p++ = DHO_END;
+
+	p = bootp->sname;
+	if (len > 63)
+		p = put_dhcpopt(p, DHO_CSR, buf + 63, len - 63);
+	p = put_dhcpopt(p, DHO_NTPSERVER, dns, 8);
+	*p++ = DHO_END;
+}
+
+static uint8_t *
+put_dhcp6opt(uint8_t *p, uint16_t code, const void *data, size_t len)
+{
+
+	p = put16(p, code);
+	p = put16(p, (uint16_t)len);
+	return put(p, data, len);
+}
+
+/* A REPLY delegating many prefixes in their own IA_PDs. */
+static void
+build_dhcp6(size_t npds, size_t nprefixes)
+{
+	struct pkt *pkt;
+	uint8_t *p, *ia, *o, addr[16];
+	const uint8_t duid[] = { 0, 3, 0, 1, 2, 0, 0, 0, 0, 1 };
+	const uint8_t domains[] = "\007example\003com\000\003lab\003net";
+	size_t i, j;
+
+	pkt = pkt_new(KIND_DHCP6);
+	p = pkt->u.data;
+	*p++ = DHCP6_REPLY;
+	*p++ = 0x12;
+	*p++ = 0x34;
+	*p++ = 0x56;
+
+	p = put_dhcp6opt(p, D6_OPTION_CLIENTID, duid, sizeof(duid));
+	p = put_dhcp6opt(p, D6_OPTION_SERVERID, duid, sizeof(duid));
+	*addr = 255;
+	p = put_dhcp6opt(p, D6_OPTION_PREFERENCE, addr, 1);
+
+	memset(addr, 0, sizeof(addr));
+	addr[0] = 0x20;
+	addr[1] = 0x01;
+	addr[2] = 0x0d;
+	addr[3] = 0xb8;
+	o = p;
+	p += 4;
+	for (i = 0; i < 4; i++) {
+		addr[15] = (uint8_t)(i + 1);
+		p = put(p, addr, sizeof(addr));
+	}
+	put16(o, D6_OPTION_DNS_SERVERS);
+	put16(o + 2, (uint16_t)(p - o - 4));
+	p = put_dhcp6opt(p, D6_OPTION_DOMAIN_LIST, domains,
+	    sizeof(domains) - 1);
+
+	/* IA_NA with one address */
+	ia = p;
+	p += 4;
+	p = put32(p, 1);
+	p = put32(p, 1800);
+	p = put32(p, 2880);
+	o = p;
+	p += 4;
+	addr[15] = 0x50;
+	p = put(p, addr, sizeof(addr));
+	p = put32(p, 3600);
+	p = put32(p, 7200);
+	put16(o, D6_OPTION_IA_ADDR);
+	put16(o + 2, (uint16_t)(p - o - 4));
+	put16(ia, D6_OPTION_IA_NA);
+	put16(ia + 2, (uint16_t)(p - ia - 4));
+
+	addr[15] = 0;
+	for (i = 0; i < npds; i++) {
+		ia = p;
+		p += 4;
+		p = put32(p, (uint32_t)(i + 2));
+		p = put32(p, 1800);
+		p = put32(p, 2880);
+		for (j = 0; j < nprefixes; j++) {
+			o = p;
+			p += 4;
+			p = put32(p, 3600);
+			p = put32(p, 7200);
+			*p++ = 56;
+			addr[4] = (uint8_t)i;
+			addr[6] = (uint8_t)(j << 1);
+			p = put(p, addr, sizeof(addr));
+			put16(o, D6_OPTION_IAPREFIX);
+			put16(o + 2, (uint16_t)(p - o - 4));
+		}
+		put16(ia, D6_OPTION_IA_PD);
+		put16(ia + 2, (uint16_t)(p - ia - 4));
+	}
+
+	pkt->len = (size_t)(p - pkt->u.data);
+}
+
+/* A router advertisement with many prefixes and RDNSS servers. */
+static void
+build_ra(size_t nprefixes, size_t nrdnss)
+{
+	struct pkt *pkt;
+	struct nd_router_advert *nd_ra;
+	struct nd_opt_prefix_info *pi;
+	uint8_t *p, *o, addr[16];
+	const uint8_t hwaddr[6] = { 0x02, 0, 0, 0, 0, 1 };
+	const uint8_t dnssl[] = "\007example\003com\000\003lab\003net\000";
+	size_t i, j, len;
+
+	pkt = pkt_new(KIND_RA);
+	nd_ra = (struct nd_router_advert *)pkt->u.data;
+	nd_ra->nd_ra_type = ND_ROUTER_ADVERT;
+	nd_ra->nd_ra_curhoplimit = 64;
+	nd_ra->nd_ra_flags_reserved = ND_RA_FLAG_OTHER;
+	nd_ra->nd_ra_router_lifetime = htons(1800);
+	p = (uint8_t *)(nd_ra + 1);
+
+	*p++ = ND_OPT_SOURCE_LINKADDR;
+	*p++ = 1;
+	p = put(p, hwaddr, sizeof(hwaddr));
+
+	*p++ = ND_OPT_MTU;
+	*p++ = 1;
+	p = put16(p, 0);
+	p = put32(p, 1500);
+
+	memset(addr, 0, sizeof(addr));
+	addr[0] = 0x20;
+	addr[1] = 0x01;
+	addr[2] = 0x0d;
+	addr[3] = 0xb8;
+	for (i = 0; i < nprefixes; i++) {
+		pi = (struct nd_opt_prefix_info *)p;
+		memset(pi, 0, sizeof(*pi));
+		pi->nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION;
+		pi->nd_opt_pi_len = sizeof(*pi) / 8;
+		pi->nd_opt_pi_prefix_len = 64;
+		pi->nd_opt_pi_flags_reserved =
+		    ND_OPT_PI_FLAG_ONLINK | ND_OPT_PI_FLAG_AUTO;
+		pi->nd_opt_pi_valid_time = htonl(86400);
+		pi->nd_opt_pi_preferred_time = htonl(14400);
+		addr[7] = (uint8_t)i;
+		memcpy(&pi->nd_opt_pi_prefix, addr, sizeof(addr));
+		p += sizeof(*pi);
+	}
+
+	/* RDNSS in groups of 3 servers per option */
+	for (i = 0; i < nrdnss; i += 3) {
+		o = p;
+		p += 2;
+		p = put16(p, 0);
+		p = put32(p, 1800);
+		for (j = i; j < nrdnss && j < i + 3; j++) {
+			addr[7] = 0;
+			addr[15] = (uint8_t)(j + 1);
+			p = put(p, addr, sizeof(addr));
+		}
+		o[0] = ND_OPT_RDNSS;
+		o[1] = (uint8_t)((p - o) / 8);
+	}
+
+	o = p;
+	p += 2;
+	p = put16(p, 0);
+	p = put32(p, 1800);
+	p = put(p, dnssl, sizeof(dnssl) - 1);
+	len = (size_t)(p - o);
+	len = (len + 7) & ~(size_t)7;
+	memset(p, 0, len - (size_t)(p - o));
+	p = o + len;
+	o[0] = ND_OPT_DNSSL;
+	o[1] = (uint8_t)(len / 8);
+
+	pkt->len = (size_t)(p - pkt->u.data);
+}
+
+static void
+build_corpus(void)
+{
+	size_t i;
+
+	for (i = 0; i < NPKTS; i++) {
+		build_dhcp(8 + i * 8);
+		build_dhcp6(2 + i * 2, 1 + i % 3);
+		build_ra(2 + i * 2, 3 + i);
+	}
+}
+
+static void
+load_corpus(enum kind kind, const char *file)
+{
+	struct pkt *pkt;
+	FILE *fp;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		err(EXIT_FAILURE, "%s", file);
+	pkt = pkt_new(kind);
+	pkt->len = fread(pkt->u.data, 1, sizeof(pkt->u.data), fp);
+	if (ferror(fp))
+		err(EXIT_FAILURE, "%s", file);
+	fclose(fp);
+}
+
+/* FNV-1a over the environment, ignoring variables which hold the time. */
+static uint32_t
+digest(FILE *fp)
+{
+	uint32_t h = 2166136261U;
+	char var[4096];
+	size_t len;
+	int c;
+
+	rewind(fp);
+	len = 0;
+	while ((c = fgetc(fp)) != EOF) {
+		if (len < sizeof(var) - 1)
+			var[len++] = (char)c;
+		if (c != '\0')
+			continue;
+		var[len] = '\0';
+		if (strstr(var, "_now=") == NULL) {
+			size_t i;
+
+			for (i = 0; i < len; i++) {
+				h ^= (uint8_t)var[i];
+				h *= 16777619U;
+			}
+		}
+		len = 0;
+	}
+	return h;
+}
+
+/* Print the environment of each packet, one variable per line. */
+static void
+dump(void)
+{
+	struct pkt *pkt;
+	size_t i;
+	FILE *fp;
+	int c;
+
+	for (i = 0, pkt = pkts; i < npkts; i++, pkt++) {
+		if ((fp = tmpfile()) == NULL)
+			err(EXIT_FAILURE, "tmpfile");
+		if (parse(fp, pkt->kind, pkt->u.data, pkt->len) == -1)
+			warn("%s: packet %zu", kinds[pkt->kind], i);
+		printf("# %s packet %zu, %zu bytes\n",
+		    kinds[pkt->kind], i, pkt->len);
+		rewind(fp);
+		while ((c = fgetc(fp)) != EOF)
+			putchar(c == '\0' ? '\n' : c);
+		fclose(fp);
+	}
+}
+
+static uint32_t
+parse_digest(struct pkt *pkt)
+{
+	FILE *fp;
+	uint32_t h;
+
+	if ((fp = tmpfile()) == NULL)
+		err(EXIT_FAILURE, "tmpfile");
+	if (parse(fp, pkt->kind, pkt->u.data, pkt->len) == -1)
+		fputs("error", fp);
+	h = digest(fp);
+	fclose(fp);
+	return h;
+}
+
+/*
+ * Flip random bytes in each packet and check that parsing the result
+ * twice gives the same environment, which catches state leaking
+ * between calls as well as crashes when built with sanitizers.
+ */
+static int
+mutate(size_t nrounds)
+{
+	struct pkt *pkt, m;
+	size_t i, j, n, nflips;
+	int failed = 0;
+
+	for (i = 0; i < nrounds; i++) {
+		pkt = &pkts[bench_random() % npkts];
+		m = *pkt;
+		if (bench_random() % 8 == 0)
+			m.len = bench_random() % (pkt->len + 1);
+		if (m.len == 0)
+			continue;
+		nflips = 1 + bench_random() % 8;
+		for (j = 0; j < nflips; j++)
+			m.u.data[bench_random() % m.len] =
+			    (uint8_t)bench_random();
+		n = parse_digest(&m);
+		if (parse_digest(&m) != n) {
+			warnx("%s: round %zu parsed differently",
+			    kinds[m.kind], i);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+static double
+elapsed(const struct timespec *ts)
+{
+	struct timespec te, t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &te) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	timespecsub(&te, ts, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec / NSEC_PER_SEC;
+}
+
+static void
+bench(enum kind kind, double secs)
+{
+	struct timespec ts;
+	struct pkt *pkt;
+	size_t i, n, bytes;
+	uint32_t h;
+	double t;
+
+	/* Digest the first pass so parser changes can be compared. */
+	h = 2166136261U;
+	bytes = 0;
+	for (i = 0, pkt = pkts; i < npkts; i++, pkt++) {
+		if (pkt->kind != kind)
+			continue;
+		h ^= parse_digest(pkt);
+		h *= 16777619U;
+		bytes += pkt->len;
+	}
+	if (bytes == 0)
+		return;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	n = 0;
+	do {
+		for (i = 0, pkt = pkts; i < npkts; i++, pkt++) {
+			if (pkt->kind != kind)
+				continue;
+			parse(devnull, kind, pkt->u.data, pkt->len);
+			n++;
+		}
+	} while ((t = elapsed(&ts)) < secs);
+
+	printf("%-5s %zu packets in %.3f seconds, %.0f packets/sec, "
+	    "digest 0x%08x\n", kinds[kind], n, t, (double)n / t, h);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *cffile = NULL;
+	double secs = 1.0;
+	size_t i, nmutate = 0;
+	int c, k = -1, dumpenv = 0;
+
+	while ((c = getopt(argc, argv, "c:df:m:s:t:")) != -1) {
+		switch (c) {
+		case 'c':
+			cffile = optarg;
+			break;
+		case 'd':
+			dumpenv = 1;
+			break;
+		case 'f':
+			for (k = 0; kinds[k] != NULL; k++) {
+				if (strcmp(kinds[k], optarg) == 0)
+					break;
+			}
+			if (kinds[k] == NULL)
+				errx(EXIT_FAILURE, "unknown kind `%s'", optarg);
+			break;
+		case 'm':
+			nmutate = (size_t)atoi(optarg);
+			break;
+		case 's':
+			seed = (uint32_t)strtoul(optarg, NULL, 0);
+			if (seed == 0)
+				errx(EXIT_FAILURE, "seed must be non zero");
+			break;
+		case 't':
+			secs = atof(optarg);
+			break;
+		default:
+			errx(EXIT_FAILURE, "illegal argument `%c'", c);
+		}
+	}
+
+	bench_init(cffile);
+	if (k == -1) {
+		if (optind != argc)
+			errx(EXIT_FAILURE, "corpus files need -f kind");
+		build_corpus();
+	} else {
+		if (optind == argc)
+			errx(EXIT_FAILURE, "no corpus files given");
+		for (; optind < argc; optind++)
+			load_corpus((enum kind)k, argv[optind]);
+	}
+
+	if (dumpenv) {
+		dump();
+		goto out;
+	}
+
+	for (i = 0; i < KIND_MAX; i++)
+		bench((enum kind)i, secs);
+
+	if (nmutate != 0) {
+		if (mutate(nmutate) != 0)
+			return EXIT_FAILURE;
+		printf("mutated %zu packets, parsing was stable\n", nmutate);
+	}
+
+out:
+	free(pkts);
+	fclose(devnull);
+	return EXIT_SUCCESS;
+}
+#endif
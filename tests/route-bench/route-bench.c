@@ -0,0 +1,573 @@
+/*
+ * dhcpcd route reconciliation benchmark
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcpcd.h"
+#include "eloop.h"
+#include "if.h"
+#include "if-options.h"
+#include "ipv4.h"
+#include "ipv4ll.h"
+#include "ipv6.h"
+#include "logerr.h"
+#include "privsep-root.h"
+#include "route.h"
+#include "sa.h"
+
+#ifndef timespecsub
+#define timespecsub(tsp, usp, vsp)                                      \
+        do {                                                            \
+                (vsp)->tv_sec = (tsp)->tv_sec - (usp)->tv_sec;          \
+                (vsp)->tv_nsec = (tsp)->tv_nsec - (usp)->tv_nsec;       \
+                if ((vsp)->tv_nsec < 0) {                               \
+                        (vsp)->tv_sec--;                                \
+                        (vsp)->tv_nsec += 1000000000L;                  \
+                }                                                       \
+        } while (/* CONSTCOND */ 0)
+#endif
+
+/* The addressing below gives each interface a /24 in 10/8 and
+ * its other routes host routes in 64.0.0.0/6. */
+#define	IFACES_MAX	1024
+#define	ROUTES_MAX	65536
+
+static struct dhcpcd_ctx ctx;
+static struct interface *ifaces;
+static unsigned int nifaces = 8, nroutes = 32;
+
+/* Bumping an interface generation moves its gateway. */
+static unsigned int *gens;
+
+/* The mock kernel routing table and netlink transaction. */
+static rb_tree_t kernel;
+static size_t nkernel;
+static bool nobatch, batching;
+static struct psr_result *results;
+static size_t nresults, results_len;
+
+/*
+ * The backend route.c expects from if-*.c, ipv4.c and friends.
+ */
+
+bool
+if_roaming(__unused struct interface *ifp)
+{
+
+	return false;
+}
+
+int
+if_batch_begin(__unused struct dhcpcd_ctx *dctx)
+{
+
+	if (nobatch) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	batching = true;
+	nresults = 0;
+	return 0;
+}
+
+ssize_t
+if_batch_end(__unused struct dhcpcd_ctx *dctx,
+    const struct psr_result **res)
+{
+
+	batching = false;
+	*res = results;
+	return (ssize_t)nresults;
+}
+
+static int
+kernel_route(unsigned char cmd, const struct rt *rt)
+{
+	struct rt *krt;
+
+	krt = rb_tree_find_node(&kernel, rt);
+	switch (cmd) {
+	case RTM_ADD:
+		if (krt != NULL) {
+			errno = EEXIST;
+			return -1;
+		}
+		if ((krt = malloc(sizeof(*krt))) == NULL)
+			return -1;
+		memcpy(krt, rt, sizeof(*krt));
+#ifdef HAVE_ROUTE_MULTIPATH
+		krt->rt_mpath = NULL;
+#endif
+		rb_tree_insert_node(&kernel, krt);
+		nkernel++;
+		return 0;
+	case RTM_CHANGE:
+		if (krt == NULL) {
+			errno = ESRCH;
+			return -1;
+		}
+		memcpy(krt, rt, offsetof(struct rt, rt_tree));
+#ifdef HAVE_ROUTE_MULTIPATH
+		krt->rt_mpath = NULL;
+#endif
+		return 0;
+	case RTM_DELETE:
+		if (krt == NULL) {
+			errno = ESRCH;
+			return -1;
+		}
+		rb_tree_remove_node(&kernel, krt);
+		free(krt);
+		nkernel--;
+		return 0;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+int
+if_route(unsigned char cmd, const struct rt *rt)
+{
+	struct psr_result *r;
+	int serrno;
+
+	if (!batching)
+		return kernel_route(cmd, rt);
+
+	/* Like a netlink transaction, the result comes at the end. */
+	if (nresults == results_len) {
+		size_t len = results_len == 0 ? 64 : results_len * 2;
+
+		r = reallocarray(results, len, sizeof(*r));
+		if (r == NULL)
+			return -1;
+		results = r;
+		results_len = len;
+	}
+	serrno = errno;
+	r = &results[nresults++];
+	memset(r, 0, sizeof(*r));
+	r->psr_result = kernel_route(cmd, rt);
+	r->psr_errno = r->psr_result == -1 ? errno : 0;
+	errno = serrno;
+	return 0;
+}
+
+int
+if_initrt(struct dhcpcd_ctx *dctx, rb_tree_t *kroutes, int af)
+{
+	struct rt *rt, *krt;
+
+	RB_TREE_FOREACH(rt, &kernel) {
+		if (rt->rt_dest.sa_family != af)
+			continue;
+		if ((krt = rt_new0(dctx)) == NULL)
+			return -1;
+		memcpy(krt, rt, sizeof(*krt));
+		rb_tree_insert_node(kroutes, krt);
+	}
+	return 0;
+}
+
+#ifdef HAVE_ROUTE_NEXTHOP
+int
+if_nexthop(__unused struct rt *rt)
+{
+
+	return 0;
+}
+
+int
+if_nexthop_move(__unused struct dhcpcd_ctx *dctx, __unused uint32_t nhid,
+    __unused const struct sockaddr *gw)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+void
+if_nexthop_prune(__unused struct dhcpcd_ctx *dctx, __unused int af)
+{
+
+}
+#endif
+
+#ifdef BSD
+int
+if_missfilter(__unused struct interface *ifp, __unused struct sockaddr *sa)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+int
+if_missfilter_apply(__unused struct dhcpcd_ctx *dctx)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+#ifdef TRACE
+void
+trace_event(__unused struct dhcpcd_ctx *dctx, __unused unsigned int event,
+    __unused const struct interface *ifp, __unused uint32_t arg)
+{
+
+}
+#endif
+
+/* The benchmark calls rt_build itself so nothing is deferred. */
+int
+eloop_q_timeout_add_sec(__unused struct eloop *eloop, __unused int queue,
+    __unused unsigned int seconds, __unused void (*cb)(void *),
+    __unused void *arg)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+int
+eloop_q_timeout_delete(__unused struct eloop *eloop, __unused int queue,
+    __unused void (*cb)(void *), __unused void *arg)
+{
+
+	return 0;
+}
+
+#if defined(IPV4LL) && defined(HAVE_ROUTE_METRIC)
+int
+ipv4ll_recvrt(__unused int cmd, __unused const struct rt *rt)
+{
+
+	return 0;
+}
+#endif
+
+static struct rt *
+bench_rt(rb_tree_t *routes, struct interface *ifp,
+    uint32_t dest, uint32_t mask, uint32_t gw)
+{
+	struct rt *rt;
+	struct in_addr in;
+	uint32_t net = 0x0a000000U | (ifp->index << 8);
+
+	if ((rt = rt_new(ifp)) == NULL)
+		return NULL;
+	in.s_addr = htonl(dest);
+	sa_in_init(&rt->rt_dest, &in);
+	in.s_addr = htonl(mask);
+	sa_in_init(&rt->rt_netmask, &in);
+	if (gw == INADDR_ANY) {
+		rt->rt_dflags |= RTDF_IFA_ROUTE;
+		rt->rt_gateway.sa_family = AF_UNSPEC;
+	} else {
+		rt->rt_dflags |= RTDF_DHCP;
+		in.s_addr = htonl(gw);
+		sa_in_init(&rt->rt_gateway, &in);
+	}
+	in.s_addr = htonl(net | 10);
+	sa_in_init(&rt->rt_ifa, &in);
+	return rt_proto_add(routes, rt);
+}
+
+/* Each active interface has a subnet route, a default route and
+ * host routes via a gateway to make up nroutes. */
+bool
+inet_getroutes(struct dhcpcd_ctx *dctx, rb_tree_t *routes)
+{
+	struct interface *ifp;
+	uint32_t net, gw, dest;
+	unsigned int i;
+
+	TAILQ_FOREACH(ifp, dctx->ifaces, next) {
+		if (!ifp->active || !rt_ifdirty(ifp))
+			continue;
+		net = 0x0a000000U | (ifp->index << 8);
+		gw = net | (1 + (gens[ifp->index - 1] & 1));
+		if (bench_rt(routes, ifp, net, 0xffffff00U, INADDR_ANY) == NULL)
+			return false;
+		if (nroutes > 1 &&
+		    bench_rt(routes, ifp, INADDR_ANY, INADDR_ANY, gw) == NULL)
+			return false;
+		for (i = 2; i < nroutes; i++) {
+			dest = 0x40000000U + (ifp->index << 16) + i;
+			if (bench_rt(routes, ifp, dest, INADDR_BROADCAST,
+			    gw) == NULL)
+				return false;
+		}
+	}
+	return true;
+}
+
+#ifdef INET6
+bool
+inet6_getroutes(__unused struct dhcpcd_ctx *dctx,
+    __unused rb_tree_t *routes)
+{
+
+	return true;
+}
+#endif
+
+static void
+bench_init(void)
+{
+	struct interface *ifp;
+	unsigned int i;
+
+	logsetopts(LOGERR_QUIET);
+	ctx.options = DHCPCD_CONFIGURE | DHCPCD_GATEWAY;
+	if ((ctx.ifaces = malloc(sizeof(*ctx.ifaces))) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	TAILQ_INIT(ctx.ifaces);
+	rt_init(&ctx);
+	/* rt_compare_os is private to route.c, so borrow it. */
+	rb_tree_init(&kernel, ctx.kroutes.rbt_ops);
+
+	ifaces = calloc(nifaces, sizeof(*ifaces));
+	gens = calloc(nifaces, sizeof(*gens));
+	if (ifaces == NULL || gens == NULL)
+		err(EXIT_FAILURE, "calloc");
+	for (i = 0; i < nifaces; i++) {
+		ifp = &ifaces[i];
+		ifp->ctx = &ctx;
+		ifp->index = i + 1;
+		snprintf(ifp->name, sizeof(ifp->name), "bench%u", ifp->index);
+		ifp->metric = RTMETRIC_BASE + ifp->index;
+		ifp->active = IF_ACTIVE;
+		ifp->carrier = LINK_UP;
+		if ((ifp->options = calloc(1, sizeof(*ifp->options))) == NULL)
+			err(EXIT_FAILURE, "calloc");
+		ifp->options->options = ctx.options;
+		rb_tree_init(&ifp->options->routes, &rt_compare_list_ops);
+		TAILQ_INSERT_TAIL(ctx.ifaces, ifp, next);
+	}
+}
+
+static void
+bench_free(void)
+{
+	struct rt *rt;
+	unsigned int i;
+
+	rt_dispose(&ctx);
+	while ((rt = RB_TREE_MIN(&kernel)) != NULL) {
+		rb_tree_remove_node(&kernel, rt);
+		free(rt);
+	}
+	for (i = 0; i < nifaces; i++)
+		free(ifaces[i].options);
+	free(ifaces);
+	free(gens);
+	free(ctx.ifaces);
+	free(results);
+}
+
+static double
+elapsed(const struct timespec *ts)
+{
+	struct timespec te, t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &te) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	timespecsub(&te, ts, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec / NSEC_PER_SEC;
+}
+
+enum scenario {
+	SC_STEADY,
+	SC_CHANGE,
+	SC_SCOPED,
+	SC_DUMP,
+	SC_FLAP,
+	SC_MAX
+};
+
+static const char * const scenarios[] = {
+	"steady", "change", "scoped", "dump", "flap", NULL
+};
+
+/* Run one round of the scenario, returning the number of rebuilds. */
+static unsigned int
+bench_round(enum scenario sc, unsigned int n)
+{
+	struct interface *ifp = &ifaces[n % nifaces];
+
+	switch (sc) {
+	case SC_STEADY:
+		rt_build(&ctx, AF_INET);
+		return 1;
+	case SC_CHANGE:
+		gens[ifp->index - 1]++;
+		rt_build(&ctx, AF_INET);
+		return 1;
+	case SC_SCOPED:
+		gens[ifp->index - 1]++;
+		rt_buildif(ifp, AF_INET);
+		return 1;
+	case SC_DUMP:
+		rt_kinvalidate(&ctx, AF_INET);
+		rt_build(&ctx, AF_INET);
+		return 1;
+	case SC_FLAP:
+		ifp->active = 0;
+		rt_build(&ctx, AF_INET);
+		ifp->active = IF_ACTIVE;
+		rt_build(&ctx, AF_INET);
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/* Every scenario ends with all the routes in the kernel. */
+static void
+bench_check(const char *what)
+{
+	size_t want = (size_t)nifaces * nroutes;
+
+	if (nkernel != want)
+		errx(EXIT_FAILURE, "%s: kernel has %zu routes, expected %zu",
+		    what, nkernel, want);
+	if (ctx.stats.route_errors != 0)
+		errx(EXIT_FAILURE, "%s: %llu route errors",
+		    what, ctx.stats.route_errors);
+}
+
+static void
+bench(enum scenario sc, double secs)
+{
+	struct timespec ts;
+	struct dhcpcd_stats st;
+	struct pool pl;
+	unsigned int n, rounds;
+	double t, r;
+
+	st = ctx.stats;
+	pl = ctx.rt_pool;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	n = rounds = 0;
+	do {
+		n += bench_round(sc, rounds++);
+	} while ((t = elapsed(&ts)) < secs);
+	bench_check(scenarios[sc]);
+
+	r = (double)n;
+	printf("%-6s %u rebuilds in %.3f seconds, %.1f usec/rebuild, "
+	    "%.1f gets %.1f allocs, %.1f adds %.1f changes %.1f deletes "
+	    "%.1f dumps per rebuild\n",
+	    scenarios[sc], n, t, t * 1000000.0 / r,
+	    (double)(ctx.rt_pool.pl_gets - pl.pl_gets) / r,
+	    (double)((ctx.rt_pool.pl_gets - ctx.rt_pool.pl_hits) -
+	    (pl.pl_gets - pl.pl_hits)) / r,
+	    (double)(ctx.stats.route_adds - st.route_adds) / r,
+	    (double)(ctx.stats.route_changes - st.route_changes) / r,
+	    (double)(ctx.stats.route_deletes - st.route_deletes) / r,
+	    (double)(ctx.stats.route_dumps - st.route_dumps) / r);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct timespec ts;
+	double secs = 1.0, t;
+	int c, sc = -1;
+
+	while ((c = getopt(argc, argv, "bi:r:s:t:")) != -1) {
+		switch (c) {
+		case 'b':
+			nobatch = true;
+			break;
+		case 'i':
+			nifaces = (unsigned int)atoi(optarg);
+			break;
+		case 'r':
+			nroutes = (unsigned int)atoi(optarg);
+			break;
+		case 's':
+			for (sc = 0; scenarios[sc] != NULL; sc++) {
+				if (strcmp(scenarios[sc], optarg) == 0)
+					break;
+			}
+			if (scenarios[sc] == NULL)
+				errx(EXIT_FAILURE, "unknown scenario `%s'",
+				    optarg);
+			break;
+		case 't':
+			secs = atof(optarg);
+			break;
+		default:
+			errx(EXIT_FAILURE, "illegal argument `%c'", c);
+		}
+	}
+	if (nifaces == 0 || nifaces > IFACES_MAX)
+		errx(EXIT_FAILURE, "interfaces must be 1 to %d", IFACES_MAX);
+	if (nroutes == 0 || nroutes > ROUTES_MAX)
+		errx(EXIT_FAILURE, "routes must be 1 to %d", ROUTES_MAX);
+
+	bench_init();
+
+	/* The first build adds every route. */
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(EXIT_FAILURE, "clock_gettime");
+	rt_build(&ctx, AF_INET);
+	t = elapsed(&ts);
+	bench_check("initial");
+	printf("%u interfaces, %u routes each, first build %.1f usec, "
+	    "%llu adds\n", nifaces, nroutes, t * 1000000.0,
+	    ctx.stats.route_adds);
+
+	if (sc != -1)
+		bench((enum scenario)sc, secs);
+	else {
+		for (sc = 0; sc < SC_MAX; sc++)
+			bench((enum scenario)sc, secs);
+	}
+
+	bench_free();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+#!/bin/sh
+# Start dhcpcd on many veth interfaces served by scale-server and report
+# how long each took to bind and what it cost.  See README.md.
+# Needs root, util-linux unshare and nsenter, and iproute2.
+
+usage()
+{
+	cat <<EOF >&2
+usage: scale-bench.sh [-46Rs] [-i interfaces] [-l leasetime] [-L loss]
+	[-m privsep | noprivsep | both] [-r routes] [-t timeout] [-w window]
+EOF
+	exit 1
+}
+
+# Everything happens in new network, mount and pid namespaces
+# so nothing on the host is touched.
+if [ -z "$SCALE_BENCH_NS" ]; then
+	if [ "$(id -u)" != 0 ]; then
+		echo "scale-bench.sh must be run as root" >&2
+		exit 1
+	fi
+	SCALE_BENCH_NS=1 exec unshare -n -m -p -f --mount-proc \
+	    /bin/sh "$0" "$@"
+fi
+
+: ${DHCPCD:=../../src/dhcpcd}
+: ${SERVER:=./scale-server}
+: ${PRIVSEP_USER:=dhcpcd}
+TOP=../..
+
+IFACES=16
+LEASE=60
+LOSS=0
+MODES=both
+ROUTES=4
+TIMEOUT=60
+WINDOW=0
+STRACE=
+DO4=true
+DO6=true
+DORA=true
+SERVER_ARGS=
+while getopts 46Ri:l:L:m:r:st:w: OPT; do
+	case "$OPT" in
+	4)	DO4=false; SERVER_ARGS="$SERVER_ARGS -4";;
+	6)	DO6=false; SERVER_ARGS="$SERVER_ARGS -6";;
+	R)	DORA=false; SERVER_ARGS="$SERVER_ARGS -R";;
+	i)	IFACES="$OPTARG";;
+	l)	LEASE="$OPTARG";;
+	L)	LOSS="$OPTARG";;
+	m)	MODES="$OPTARG";;
+	r)	ROUTES="$OPTARG";;
+	s)	STRACE=strace;;
+	t)	TIMEOUT="$OPTARG";;
+	w)	WINDOW="$OPTARG";;
+	*)	usage;;
+	esac
+done
+shift $(($OPTIND - 1))
+[ $# = 0 ] || usage
+case "$MODES" in
+privsep|noprivsep)	;;
+both)			MODES="privsep noprivsep";;
+*)			usage;;
+esac
+if [ "$IFACES" -lt 1 ] || [ "$IFACES" -gt 4096 ]; then
+	echo "interfaces must be 1 to 4096" >&2
+	exit 1
+fi
+if ! $DO4 && ! $DO6 && ! $DORA; then
+	echo "nothing to serve" >&2
+	exit 1
+fi
+if [ -n "$STRACE" ] && ! type strace >/dev/null 2>&1; then
+	echo "strace not found, not counting syscalls" >&2
+	STRACE=
+fi
+for f in "$DHCPCD" "$SERVER"; do
+	if [ ! -x "$f" ]; then
+		echo "$f not found, run make first" >&2
+		exit 1
+	fi
+done
+DHCPCD=$(cd "${DHCPCD%/*}" && pwd)/${DHCPCD##*/}
+SERVER=$(cd "${SERVER%/*}" && pwd)/${SERVER##*/}
+
+# dhcpcd keeps its state where it was built to, give it empty ones.
+RUNDIR=$(sed -n 's/^#define[[:space:]]*RUNDIR[[:space:]]*"\(.*\)"/\1/p' \
+    "$TOP/config.h")
+DBDIR=$(sed -n 's/^#define[[:space:]]*DBDIR[[:space:]]*"\(.*\)"/\1/p' \
+    "$TOP/config.h")
+mount --make-rprivate /
+for d in ${RUNDIR:-/var/run/dhcpcd} ${DBDIR:-/var/db/dhcpcd}; do
+	mkdir -p "$d" && mount -t tmpfs tmpfs "$d" || exit 1
+done
+mount -t tmpfs tmpfs /tmp
+WORK=$(mktemp -d /tmp/scale-bench.XXXXXX) || exit 1
+
+SRVPID=
+SPID=
+cleanup()
+{
+	[ -n "$SPID" ] && kill "$SPID" 2>/dev/null
+	[ -n "$SRVPID" ] && kill "$SRVPID" 2>/dev/null
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# The server has its own network namespace, held open by a sleep.
+ip link set lo up
+unshare -n sleep 1000000 &
+SRVPID=$!
+sleep 0.2
+NS="nsenter -t $SRVPID -n"
+$NS ip link set lo up
+$NS sysctl -qw net.ipv6.conf.default.accept_dad=0
+
+i=0
+: >"$WORK/client.batch"
+: >"$WORK/server.batch"
+while [ $i -lt "$IFACES" ]; do
+	cat <<EOF >>"$WORK/client.batch"
+link add c$i type veth peer name s$i
+link set s$i netns $SRVPID
+link set c$i up
+EOF
+	cat <<EOF >>"$WORK/server.batch"
+link set s$i addrgenmode none
+addr add 10.$(($i >> 8)).$(($i & 255)).1/24 dev s$i
+addr add fe80::1/64 dev s$i nodad
+link set s$i up
+EOF
+	i=$(($i + 1))
+done
+ip -batch "$WORK/client.batch" || exit 1
+$NS ip -batch "$WORK/server.batch" || exit 1
+
+$NS "$SERVER" -p s -l "$LEASE" -L "$LOSS" -r "$ROUTES" $SERVER_ARGS \
+    >"$WORK/server.log" 2>&1 &
+SPID=$!
+while ! grep -q serving "$WORK/server.log"; do
+	if ! kill -0 $SPID 2>/dev/null; then
+		cat "$WORK/server.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+# Each interface is bound once every protocol served has reported.
+REASONS=
+WANT=0
+if $DO4; then
+	REASONS="$REASONS BOUND REBOOT"
+	WANT=$(($WANT + 1))
+fi
+if $DO6; then
+	REASONS="$REASONS BOUND6 REBOOT6"
+	WANT=$(($WANT + 1))
+elif $DORA; then
+	REASONS="$REASONS ROUTERADVERT"
+	WANT=$(($WANT + 1))
+fi
+
+cat <<EOF >"$WORK/dhcpcd.conf"
+allowinterfaces c*
+noipv4ll
+script "$WORK/hook"
+EOF
+$DO4 || echo noipv4 >>"$WORK/dhcpcd.conf"
+$DO6 || echo nodhcp6 >>"$WORK/dhcpcd.conf"
+$DORA || echo noipv6rs >>"$WORK/dhcpcd.conf"
+$DO6 && ! $DORA && echo ia_na >>"$WORK/dhcpcd.conf"
+! $DO6 && ! $DORA && echo noipv6 >>"$WORK/dhcpcd.conf"
+
+cat <<EOF >"$WORK/hook"
+#!/bin/sh
+echo "\$(date +%s.%N) \$interface \$reason" >>"$WORK/events"
+EOF
+chmod +x "$WORK/hook"
+
+# Privilege separation is used when its user exists.
+cp /etc/passwd "$WORK/passwd.noprivsep"
+sed -i "/^$PRIVSEP_USER:/d" "$WORK/passwd.noprivsep"
+cp "$WORK/passwd.noprivsep" "$WORK/passwd.privsep"
+mkdir -p "$WORK/chroot"
+echo "$PRIVSEP_USER:x:65533:65533::$WORK/chroot:/bin/false" \
+    >>"$WORK/passwd.privsep"
+
+HZ=$(getconf CLK_TCK)
+
+dhcpcd_pids()
+{
+	for p in /proc/[0-9]*; do
+		[ "$(cat $p/comm 2>/dev/null)" = dhcpcd ] && echo ${p#/proc/}
+	done
+}
+
+# Seconds of CPU used by dhcpcd and by the scripts it has reaped.
+dhcpcd_cpu()
+{
+	for p in $(dhcpcd_pids); do
+		cat /proc/$p/stat 2>/dev/null
+	done | awk -v hz=$HZ '
+	    { self += $14 + $15; kids += $16 + $17 }
+	    END { printf "%.3f %.3f\n", self / hz, kids / hz }'
+}
+
+dhcpcd_status()
+{
+	for p in $(dhcpcd_pids); do
+		cat /proc/$p/status 2>/dev/null
+	done | awk '
+	    /^VmHWM:/ { n++; sum += $2; if ($2 > max) max = $2 }
+	    /ctxt_switches:/ { cs += $2 }
+	    END { printf "%d %d %d %d\n", n, max, sum, cs }'
+}
+
+bound_count()
+{
+	[ -f "$WORK/events" ] || { echo 0; return; }
+	awk -v reasons="$REASONS" -v want=$WANT '
+	    BEGIN { n = split(reasons, r); for (i = 1; i <= n; i++) ok[r[i]] = 1 }
+	    ok[$3] {
+		    p = $3; sub("REBOOT", "BOUND", p)
+		    if (!(($2, p) in seen)) { seen[$2, p] = 1; got[$2]++ }
+	    }
+	    END { for (i in got) if (got[i] >= want) c++; print c + 0 }' \
+	    "$WORK/events"
+}
+
+run()
+{
+	mode=$1
+
+	rm -f "$WORK/events"
+	rm -rf "${DBDIR:-/var/db/dhcpcd}"/* "${RUNDIR:-/var/run/dhcpcd}"/*
+	mount --bind "$WORK/passwd.$mode" /etc/passwd
+
+	START=$(date +%s.%N)
+	if [ -n "$STRACE" ]; then
+		strace -f -c -o "$WORK/strace.$mode" \
+		    "$DHCPCD" -B -f "$WORK/dhcpcd.conf" \
+		    >"$WORK/dhcpcd.$mode.log" 2>&1 &
+	else
+		"$DHCPCD" -B -f "$WORK/dhcpcd.conf" \
+		    >"$WORK/dhcpcd.$mode.log" 2>&1 &
+	fi
+	DPID=$!
+
+	waited=0
+	while [ "$(bound_count)" -lt "$IFACES" ]; do
+		if ! kill -0 $DPID 2>/dev/null; then
+			echo "dhcpcd exited" >&2
+			cat "$WORK/dhcpcd.$mode.log" >&2
+			break
+		fi
+		if [ $waited -ge $(($TIMEOUT * 10)) ]; then
+			echo "timed out waiting for interfaces to bind" >&2
+			tail -n 20 "$WORK/dhcpcd.$mode.log" >&2
+			break
+		fi
+		sleep 0.1
+		waited=$(($waited + 1))
+	done
+	BOUND=$(bound_count)
+	CPU=$(dhcpcd_cpu)
+	STATUS=$(dhcpcd_status)
+	MEM=$("$DHCPCD" --stats memory 2>/dev/null |
+	    sed -n 's/^mem_total_bytes=//p')
+
+	echo "$mode: $BOUND of $IFACES interfaces bound"
+	awk -v start=$START -v reasons="$REASONS" -v want=$WANT '
+	    BEGIN { n = split(reasons, r); for (i = 1; i <= n; i++) ok[r[i]] = 1 }
+	    ok[$3] {
+		    p = $3; sub("REBOOT", "BOUND", p)
+		    if (!(($2, p) in seen)) {
+			    seen[$2, p] = 1
+			    got[$2]++
+			    if ($1 - start > t[$2]) t[$2] = $1 - start
+		    }
+	    }
+	    END { for (i in got) if (got[i] >= want) print t[i] }' \
+	    "$WORK/events" 2>/dev/null | sort -n | awk '
+	    { t[NR] = $1 }
+	    function pct(p,  i) { i = int((NR * p + 99) / 100); return t[i < 1 ? 1 : i] }
+	    END {
+		    if (NR == 0) exit
+		    printf "  time to bound p50 %.3fs p90 %.3fs p99 %.3fs max %.3fs\n",
+			pct(50), pct(90), pct(99), t[NR]
+	    }'
+	echo "$CPU" | awk '{ printf "  cpu %.3fs, scripts %.3fs\n", $1, $2 }'
+	echo "$STATUS" | awk '{
+	    printf "  %d processes, peak rss %d KiB max %d KiB total\n", $1, $2, $3
+	    printf "  %d context switches\n", $4 }'
+	[ -n "$MEM" ] && echo "  dhcpcd memory $MEM bytes"
+
+	if [ "$WINDOW" -gt 0 ]; then
+		renews=$(wc -l <"$WORK/events")
+		sleep "$WINDOW"
+		renews=$(sed -n "$(($renews + 1)),\$p" "$WORK/events" |
+		    grep -c ' RENEW6*$')
+		echo "$(dhcpcd_cpu) $CPU $renews" | awk '{
+		    cpu = $1 + $2 - $3 - $4
+		    if ($5 == 0)
+			    printf "  no renewals in the window\n"
+		    else
+			    printf "  %d renewals, %.3fms cpu each with scripts\n",
+				$5, cpu * 1000 / $5 }'
+	fi
+
+	"$DHCPCD" -x >/dev/null 2>&1
+	waited=0
+	while kill -0 $DPID 2>/dev/null; do
+		if [ $waited -ge 100 ]; then
+			kill -9 $DPID 2>/dev/null
+			break
+		fi
+		sleep 0.1
+		waited=$(($waited + 1))
+	done
+	wait $DPID 2>/dev/null
+	umount /etc/passwd
+
+	if [ -n "$STRACE" ]; then
+		awk '$NF == "total" { printf "  %d syscalls\n", $4 }' \
+		    "$WORK/strace.$mode"
+	fi
+}
+
+for mode in $MODES; do
+	run $mode
+done
+kill -INT $SPID
+wait $SPID
+SPID=
+tail -n 1 "$WORK/server.log"
@@ -0,0 +1,754 @@
+/*
+ * dhcpcd scale benchmark DHCP, DHCPv6 and RA server
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A minimal server for scale-bench.sh.
+ * It hands out one address per link over DHCP and DHCPv6 and sends
+ * Router Advertisements, with optional routes and packet loss.
+ * It knows only enough of each protocol to satisfy dhcpcd.
+ */
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+#include <ifaddrs.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	IFACES_MAX	4096
+
+#define	BOOTP_REQUEST	1
+#define	BOOTP_REPLY	2
+#define	BOOTP_VEND	236	/* offset of the magic cookie */
+#define	MAGIC_COOKIE	0x63825363
+
+#define	DHO_SUBNETMASK	1
+#define	DHO_ROUTER	3
+#define	DHO_IPADDRESS	50
+#define	DHO_LEASETIME	51
+#define	DHO_MESSAGETYPE	53
+#define	DHO_SERVERID	54
+#define	DHO_RENEWALTIME	58
+#define	DHO_REBINDTIME	59
+#define	DHO_CSR		121
+#define	DHO_END		255
+
+#define	DHCP_DISCOVER	1
+#define	DHCP_OFFER	2
+#define	DHCP_REQUEST	3
+#define	DHCP_ACK	5
+#define	DHCP_NAK	6
+#define	DHCP_INFORM	8
+
+#define	D6_SOLICIT	1
+#define	D6_ADVERTISE	2
+#define	D6_REQUEST	3
+#define	D6_CONFIRM	4
+#define	D6_RENEW	5
+#define	D6_REBIND	6
+#define	D6_REPLY	7
+#define	D6_RELEASE	8
+#define	D6_DECLINE	9
+#define	D6_INFORM	11
+
+#define	D6O_CLIENTID	1
+#define	D6O_SERVERID	2
+#define	D6O_IA_NA	3
+#define	D6O_IAADDR	5
+#define	D6O_STATUSCODE	13
+
+#define	ND_OPT_ROUTE_INFO	24
+
+/* Most routes that fit one 1500 byte DHCP message or a 1280 byte RA. */
+#define	ROUTES4_MAX	128
+#define	ROUTES6_MAX	64
+
+struct link {
+	char name[IF_NAMESIZE];
+	unsigned int index;
+	unsigned int pos;	/* order given, used to number prefixes */
+	struct in_addr addr;	/* ours, the client gets the next one */
+	uint8_t hwaddr[6];
+	int fd4, fd6, fdra;
+};
+
+static struct link *links;
+static size_t nlinks;
+static uint32_t leasetime = 600;
+static unsigned int nroutes, loss, rainterval;
+static bool do4 = true, do6 = true, dora = true;
+static unsigned long long nrecv, ndropped, nsent;
+static volatile sig_atomic_t done;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: scale-server [-46R] [-a interval] "
+	    "[-l leasetime] [-L loss%%]\n"
+	    "\t\t[-p prefix] [-r routes] [interface ...]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+sigdone(__attribute__((unused)) int sig)
+{
+
+	done = 1;
+}
+
+/* Drop received packets at random to simulate a lossy network. */
+static bool
+lost(void)
+{
+
+	nrecv++;
+	if (loss == 0 || (unsigned int)(random() % 100) >= loss)
+		return false;
+	ndropped++;
+	return true;
+}
+
+static int
+link_socket(const struct link *l, int domain, int type, int proto)
+{
+	int s, on = 1;
+
+	if ((s = socket(domain, type | SOCK_CLOEXEC, proto)) == -1)
+		err(EXIT_FAILURE, "socket");
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE,
+	    l->name, (socklen_t)strlen(l->name)) == -1)
+		err(EXIT_FAILURE, "%s: setsockopt", l->name);
+	return s;
+}
+
+static void
+link_open4(struct link *l)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port = htons(67),
+	};
+	int on = 1;
+
+	l->fd4 = link_socket(l, AF_INET, SOCK_DGRAM, 0);
+	if (setsockopt(l->fd4, SOL_SOCKET, SO_BROADCAST,
+	    &on, sizeof(on)) == -1)
+		err(EXIT_FAILURE, "%s: SO_BROADCAST", l->name);
+	if (bind(l->fd4, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(EXIT_FAILURE, "%s: bind 67", l->name);
+}
+
+static void
+link_open6(struct link *l)
+{
+	struct sockaddr_in6 sin6 = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(547),
+	};
+	struct ipv6_mreq mreq = { .ipv6mr_interface = l->index };
+
+	l->fd6 = link_socket(l, AF_INET6, SOCK_DGRAM, 0);
+	if (bind(l->fd6, (struct sockaddr *)&sin6, sizeof(sin6)) == -1)
+		err(EXIT_FAILURE, "%s: bind 547", l->name);
+	inet_pton(AF_INET6, "ff02::1:2", &mreq.ipv6mr_multiaddr);
+	if (setsockopt(l->fd6, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+	    &mreq, sizeof(mreq)) == -1)
+		err(EXIT_FAILURE, "%s: join ff02::1:2", l->name);
+}
+
+static void
+link_openra(struct link *l)
+{
+	struct icmp6_filter filt;
+	struct ipv6_mreq mreq = { .ipv6mr_interface = l->index };
+	int hops = 255;
+
+	l->fdra = link_socket(l, AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+	ICMP6_FILTER_SETBLOCKALL(&filt);
+	ICMP6_FILTER_SETPASS(ND_ROUTER_SOLICIT, &filt);
+	if (setsockopt(l->fdra, IPPROTO_ICMPV6, ICMP6_FILTER,
+	    &filt, sizeof(filt)) == -1 ||
+	    setsockopt(l->fdra, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+	    &hops, sizeof(hops)) == -1 ||
+	    setsockopt(l->fdra, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
+	    &hops, sizeof(hops)) == -1)
+		err(EXIT_FAILURE, "%s: setsockopt", l->name);
+	inet_pton(AF_INET6, "ff02::2", &mreq.ipv6mr_multiaddr);
+	if (setsockopt(l->fdra, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+	    &mreq, sizeof(mreq)) == -1)
+		err(EXIT_FAILURE, "%s: join ff02::2", l->name);
+}
+
+/* The prefix for link pos is 2001:db8:pos::/64. */
+static void
+link_prefix(const struct link *l, struct in6_addr *prefix)
+{
+
+	memset(prefix, 0, sizeof(*prefix));
+	prefix->s6_addr[0] = 0x20;
+	prefix->s6_addr[1] = 0x01;
+	prefix->s6_addr[2] = 0x0d;
+	prefix->s6_addr[3] = 0xb8;
+	prefix->s6_addr[4] = (uint8_t)(l->pos >> 8);
+	prefix->s6_addr[5] = (uint8_t)l->pos;
+}
+
+static uint8_t *
+opt4_add(uint8_t *p, uint8_t code, const void *data, size_t len)
+{
+
+	*p++ = code;
+	*p++ = (uint8_t)len;
+	memcpy(p, data, len);
+	return p + len;
+}
+
+static uint8_t *
+opt4_add32(uint8_t *p, uint8_t code, uint32_t val)
+{
+
+	val = htonl(val);
+	return opt4_add(p, code, &val, sizeof(val));
+}
+
+/* Classless static routes 172.16.0.0/24 and up via us,
+ * split into as many options as needed, see RFC 3396. */
+static uint8_t *
+opt4_addroutes(uint8_t *p, const struct link *l)
+{
+	uint8_t csr[ROUTES4_MAX * 8], *r = csr;
+	size_t len, left;
+	unsigned int i;
+
+	for (i = 0; i < nroutes; i++) {
+		*r++ = 24;
+		*r++ = 172;
+		*r++ = (uint8_t)(16 + (i >> 8));
+		*r++ = (uint8_t)i;
+		memcpy(r, &l->addr, sizeof(l->addr));
+		r += sizeof(l->addr);
+	}
+	left = (size_t)(r - csr);
+	for (r = csr; left != 0; left -= len, r += len) {
+		len = left > 255 ? 255 : left;
+		p = opt4_add(p, DHO_CSR, r, len);
+	}
+	return p;
+}
+
+static void
+dhcp_recv(struct link *l)
+{
+	uint8_t buf[1500], out[1500], *p, *e, *o;
+	uint8_t type = 0;
+	struct in_addr yiaddr, reqaddr = { .s_addr = INADDR_ANY };
+	struct in_addr ciaddr, mask = { .s_addr = htonl(0xffffff00U) };
+	struct sockaddr_in to = { .sin_family = AF_INET,
+	    .sin_port = htons(68) };
+	uint32_t cookie;
+	ssize_t len;
+
+	if ((len = recv(l->fd4, buf, sizeof(buf), 0)) == -1) {
+		warn("%s: recv", l->name);
+		return;
+	}
+	if (lost())
+		return;
+	if (len < BOOTP_VEND + 4 || buf[0] != BOOTP_REQUEST)
+		return;
+	memcpy(&cookie, buf + BOOTP_VEND, sizeof(cookie));
+	if (ntohl(cookie) != MAGIC_COOKIE)
+		return;
+
+	for (p = buf + BOOTP_VEND + 4, e = buf + len; p < e; ) {
+		if (*p == 0) {
+			p++;
+			continue;
+		}
+		if (*p == DHO_END || p + 2 > e || p + 2 + p[1] > e)
+			break;
+		if (p[0] == DHO_MESSAGETYPE && p[1] == 1)
+			type = p[2];
+		else if (p[0] == DHO_IPADDRESS && p[1] == 4)
+			memcpy(&reqaddr, p + 2, sizeof(reqaddr));
+		p += 2 + p[1];
+	}
+	memcpy(&ciaddr, buf + 12, sizeof(ciaddr));
+
+	yiaddr.s_addr = htonl(ntohl(l->addr.s_addr) + 1);
+	memset(out, 0, BOOTP_VEND);
+	out[0] = BOOTP_REPLY;
+	memcpy(out + 1, buf + 1, 3);		/* htype, hlen, hops */
+	memcpy(out + 4, buf + 4, 8);		/* xid, secs, flags */
+	memcpy(out + 12, &ciaddr, 4);
+	memcpy(out + 20, &l->addr, 4);		/* siaddr */
+	memcpy(out + 28, buf + 28, 16);		/* chaddr */
+	cookie = htonl(MAGIC_COOKIE);
+	memcpy(out + BOOTP_VEND, &cookie, sizeof(cookie));
+	o = out + BOOTP_VEND + 4;
+
+	switch (type) {
+	case DHCP_DISCOVER:
+		type = DHCP_OFFER;
+		break;
+	case DHCP_REQUEST:
+		if (reqaddr.s_addr == INADDR_ANY)
+			reqaddr = ciaddr;
+		type = reqaddr.s_addr == yiaddr.s_addr ? DHCP_ACK : DHCP_NAK;
+		break;
+	case DHCP_INFORM:
+		type = DHCP_ACK;
+		yiaddr.s_addr = INADDR_ANY;
+		break;
+	default:
+		return;
+	}
+	if (type != DHCP_NAK)
+		memcpy(out + 16, &yiaddr, 4);
+
+	o = opt4_add(o, DHO_MESSAGETYPE, &type, 1);
+	o = opt4_add(o, DHO_SERVERID, &l->addr, sizeof(l->addr));
+	if (type != DHCP_NAK) {
+		if (yiaddr.s_addr != INADDR_ANY) {
+			o = opt4_add32(o, DHO_LEASETIME, leasetime);
+			o = opt4_add32(o, DHO_RENEWALTIME, leasetime / 2);
+			o = opt4_add32(o, DHO_REBINDTIME,
+			    leasetime / 8 * 7);
+		}
+		o = opt4_add(o, DHO_SUBNETMASK, &mask, sizeof(mask));
+		o = opt4_add(o, DHO_ROUTER, &l->addr, sizeof(l->addr));
+		if (nroutes != 0)
+			o = opt4_addroutes(o, l);
+	}
+	*o++ = DHO_END;
+
+	/* Renewals are unicast, everything else is broadcast. */
+	if (ciaddr.s_addr != INADDR_ANY && type != DHCP_NAK)
+		to.sin_addr = ciaddr;
+	else
+		to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+	if (sendto(l->fd4, out, (size_t)(o - out), 0,
+	    (struct sockaddr *)&to, sizeof(to)) == -1)
+		warn("%s: sendto", l->name);
+	else
+		nsent++;
+}
+
+static uint8_t *
+opt6_add(uint8_t *p, uint16_t code, const void *data, size_t len)
+{
+	uint16_t v;
+
+	v = htons(code);
+	memcpy(p, &v, sizeof(v));
+	v = htons((uint16_t)len);
+	memcpy(p + 2, &v, sizeof(v));
+	if (len != 0)
+		memcpy(p + 4, data, len);
+	return p + 4 + len;
+}
+
+/* Our DUID is DUID-LL from the link's hardware address. */
+static uint8_t *
+opt6_addserverid(uint8_t *p, const struct link *l)
+{
+	uint8_t duid[4 + sizeof(l->hwaddr)] = { 0, 3, 0, 1 };
+
+	memcpy(duid + 4, l->hwaddr, sizeof(l->hwaddr));
+	return opt6_add(p, D6O_SERVERID, duid, sizeof(duid));
+}
+
+static uint8_t *
+opt6_addstatus(uint8_t *p, uint16_t status)
+{
+
+	status = htons(status);
+	return opt6_add(p, D6O_STATUSCODE, &status, sizeof(status));
+}
+
+static uint8_t *
+opt6_addia(uint8_t *p, const struct link *l, const uint8_t *iaid)
+{
+	uint8_t ia[12 + 4 + 24], *a = ia;
+	uint32_t v;
+
+	memcpy(a, iaid, 4);
+	v = htonl(leasetime / 2);
+	memcpy(a + 4, &v, 4);
+	v = htonl(leasetime / 8 * 7);
+	memcpy(a + 8, &v, 4);
+	a += 12;
+	a[0] = 0;
+	a[1] = D6O_IAADDR;
+	a[2] = 0;
+	a[3] = 24;
+	link_prefix(l, (struct in6_addr *)(void *)(a + 4));
+	a[4 + 15] = 0x64;
+	v = htonl(leasetime);
+	memcpy(a + 20, &v, 4);
+	memcpy(a + 24, &v, 4);
+	return opt6_add(p, D6O_IA_NA, ia, sizeof(ia));
+}
+
+static void
+dhcp6_recv(struct link *l)
+{
+	uint8_t buf[1500], out[1500], *p, *e, *o;
+	struct sockaddr_in6 from;
+	socklen_t fromlen = sizeof(from);
+	uint16_t code, olen;
+	ssize_t len;
+	uint8_t type;
+
+	len = recvfrom(l->fd6, buf, sizeof(buf), 0,
+	    (struct sockaddr *)&from, &fromlen);
+	if (len == -1) {
+		warn("%s: recvfrom", l->name);
+		return;
+	}
+	if (lost() || len < 4)
+		return;
+
+	switch (buf[0]) {
+	case D6_SOLICIT:
+		type = D6_ADVERTISE;
+		break;
+	case D6_REQUEST:	/* FALLTHROUGH */
+	case D6_CONFIRM:	/* FALLTHROUGH */
+	case D6_RENEW:		/* FALLTHROUGH */
+	case D6_REBIND:		/* FALLTHROUGH */
+	case D6_RELEASE:	/* FALLTHROUGH */
+	case D6_DECLINE:	/* FALLTHROUGH */
+	case D6_INFORM:
+		type = D6_REPLY;
+		break;
+	default:
+		return;
+	}
+
+	out[0] = type;
+	memcpy(out + 1, buf + 1, 3);		/* xid */
+	o = opt6_addserverid(out + 4, l);
+	for (p = buf + 4, e = buf + len; p + 4 <= e; p += 4 + olen) {
+		code = (uint16_t)(p[0] << 8 | p[1]);
+		olen = (uint16_t)(p[2] << 8 | p[3]);
+		if (p + 4 + olen > e)
+			return;
+		if (code == D6O_CLIENTID)
+			o = opt6_add(o, code, p + 4, olen);
+		else if (code == D6O_IA_NA && olen >= 12 &&
+		    (buf[0] == D6_SOLICIT || buf[0] == D6_REQUEST ||
+		    buf[0] == D6_RENEW || buf[0] == D6_REBIND))
+			o = opt6_addia(o, l, p + 4);
+	}
+	if (type == D6_REPLY)
+		o = opt6_addstatus(o, 0);
+
+	from.sin6_port = htons(546);
+	if (sendto(l->fd6, out, (size_t)(o - out), 0,
+	    (struct sockaddr *)&from, sizeof(from)) == -1)
+		warn("%s: sendto", l->name);
+	else
+		nsent++;
+}
+
+static void
+ra_send(struct link *l)
+{
+	uint8_t out[1280], *o = out;
+	struct nd_router_advert *ra;
+	struct nd_opt_prefix_info *pi;
+	struct sockaddr_in6 to = {
+		.sin6_family = AF_INET6,
+		.sin6_scope_id = l->index,
+	};
+	unsigned int i, n;
+
+	memset(out, 0, sizeof(out));
+	ra = (struct nd_router_advert *)(void *)o;
+	ra->nd_ra_type = ND_ROUTER_ADVERT;
+	ra->nd_ra_curhoplimit = 64;
+	if (do6)
+		ra->nd_ra_flags_reserved = ND_RA_FLAG_MANAGED;
+	ra->nd_ra_router_lifetime = htons(1800);
+	o += sizeof(*ra);
+
+	pi = (struct nd_opt_prefix_info *)(void *)o;
+	pi->nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION;
+	pi->nd_opt_pi_len = 4;
+	pi->nd_opt_pi_prefix_len = 64;
+	pi->nd_opt_pi_flags_reserved =
+	    ND_OPT_PI_FLAG_ONLINK | ND_OPT_PI_FLAG_AUTO;
+	pi->nd_opt_pi_valid_time = htonl(leasetime);
+	pi->nd_opt_pi_preferred_time = htonl(leasetime);
+	link_prefix(l, &pi->nd_opt_pi_prefix);
+	o += sizeof(*pi);
+
+	/* Route Information, RFC 4191, for fd00:0:i::/64. */
+	n = nroutes > ROUTES6_MAX ? ROUTES6_MAX : nroutes;
+	for (i = 0; i < n; i++) {
+		uint32_t lifetime = htonl(leasetime);
+
+		o[0] = ND_OPT_ROUTE_INFO;
+		o[1] = 2;
+		o[2] = 64;
+		memcpy(o + 4, &lifetime, sizeof(lifetime));
+		o[8] = 0xfd;
+		o[12] = (uint8_t)(i >> 8);
+		o[13] = (uint8_t)i;
+		o += 16;
+	}
+
+	inet_pton(AF_INET6, "ff02::1", &to.sin6_addr);
+	if (sendto(l->fdra, out, (size_t)(o - out), 0,
+	    (struct sockaddr *)&to, sizeof(to)) == -1)
+		warn("%s: sendto", l->name);
+	else
+		nsent++;
+}
+
+static void
+ra_recv(struct link *l)
+{
+	uint8_t buf[1500];
+	ssize_t len;
+
+	if ((len = recv(l->fdra, buf, sizeof(buf), 0)) == -1) {
+		warn("%s: recv", l->name);
+		return;
+	}
+	if (lost() || len < 8 || buf[0] != ND_ROUTER_SOLICIT)
+		return;
+	ra_send(l);
+}
+
+static void
+link_add(const char *name)
+{
+	struct link *l;
+	struct ifaddrs *ifaddrs, *ifa;
+	struct ifreq ifr;
+	int s;
+
+	if (nlinks == IFACES_MAX)
+		errx(EXIT_FAILURE, "too many interfaces");
+	l = &links[nlinks];
+	memset(l, 0, sizeof(*l));
+	l->fd4 = l->fd6 = l->fdra = -1;
+	if (strlen(name) >= sizeof(l->name))
+		errx(EXIT_FAILURE, "%s: name too long", name);
+	strcpy(l->name, name);
+	if ((l->index = if_nametoindex(name)) == 0)
+		err(EXIT_FAILURE, "%s", name);
+	l->pos = (unsigned int)nlinks;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+		err(EXIT_FAILURE, "socket");
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, name);
+	if (ioctl(s, SIOCGIFHWADDR, &ifr) == -1)
+		err(EXIT_FAILURE, "%s: SIOCGIFHWADDR", name);
+	memcpy(l->hwaddr, ifr.ifr_hwaddr.sa_data, sizeof(l->hwaddr));
+	close(s);
+
+	if (do4) {
+		if (getifaddrs(&ifaddrs) == -1)
+			err(EXIT_FAILURE, "getifaddrs");
+		for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
+			if (ifa->ifa_addr != NULL &&
+			    ifa->ifa_addr->sa_family == AF_INET &&
+			    strcmp(ifa->ifa_name, name) == 0)
+			{
+				l->addr = ((struct sockaddr_in *)(void *)
+				    ifa->ifa_addr)->sin_addr;
+				break;
+			}
+		}
+		freeifaddrs(ifaddrs);
+		if (l->addr.s_addr == INADDR_ANY)
+			errx(EXIT_FAILURE, "%s: no IPv4 address", name);
+		link_open4(l);
+	}
+	if (do6)
+		link_open6(l);
+	if (dora)
+		link_openra(l);
+	nlinks++;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct pollfd *pfds;
+	struct if_nameindex *ifn, *ifni;
+	struct timespec now, lastra = { 0, 0 };
+	const char *prefix = NULL;
+	size_t i, n;
+	int c;
+
+	while ((c = getopt(argc, argv, "46Ra:l:L:p:r:")) != -1) {
+		switch (c) {
+		case '4':
+			do4 = false;
+			break;
+		case '6':
+			do6 = false;
+			break;
+		case 'R':
+			dora = false;
+			break;
+		case 'a':
+			rainterval = (unsigned int)atoi(optarg);
+			break;
+		case 'l':
+			leasetime = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			loss = (unsigned int)atoi(optarg);
+			break;
+		case 'p':
+			prefix = optarg;
+			break;
+		case 'r':
+			nroutes = (unsigned int)atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if ((argc == 0) == (prefix == NULL))
+		usage();
+	if (loss > 100)
+		errx(EXIT_FAILURE, "loss must be 0 to 100");
+	if (nroutes > ROUTES4_MAX)
+		errx(EXIT_FAILURE, "routes must be 0 to %d", ROUTES4_MAX);
+	if (dora && nroutes > ROUTES6_MAX)
+		warnx("only %d routes fit in a RA", ROUTES6_MAX);
+
+	if ((links = calloc(IFACES_MAX, sizeof(*links))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	if (prefix != NULL) {
+		if ((ifn = if_nameindex()) == NULL)
+			err(EXIT_FAILURE, "if_nameindex");
+		for (ifni = ifn; ifni->if_index != 0; ifni++) {
+			if (strncmp(ifni->if_name, prefix,
+			    strlen(prefix)) == 0)
+				link_add(ifni->if_name);
+		}
+		if_freenameindex(ifn);
+	}
+	for (; argc != 0; argc--, argv++)
+		link_add(*argv);
+	if (nlinks == 0)
+		errx(EXIT_FAILURE, "no interfaces");
+
+	if ((pfds = calloc(nlinks * 3, sizeof(*pfds))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	for (i = 0; i < nlinks; i++) {
+		pfds[i * 3].fd = links[i].fd4;
+		pfds[i * 3 + 1].fd = links[i].fd6;
+		pfds[i * 3 + 2].fd = links[i].fdra;
+	}
+	n = nlinks * 3;
+	for (i = 0; i < n; i++)
+		pfds[i].events = POLLIN;
+
+	signal(SIGINT, sigdone);
+	signal(SIGTERM, sigdone);
+	srandom((unsigned int)getpid());
+	printf("serving %zu interfaces\n", nlinks);
+	fflush(stdout);
+
+	while (!done) {
+		if (dora) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (lastra.tv_sec == 0 || (rainterval != 0 &&
+			    now.tv_sec - lastra.tv_sec >= rainterval))
+			{
+				for (i = 0; i < nlinks; i++)
+					ra_send(&links[i]);
+				lastra = now;
+			}
+		}
+		if (poll(pfds, (nfds_t)n, 1000) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "poll");
+		}
+		for (i = 0; i < n; i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			switch (i % 3) {
+			case 0:
+				dhcp_recv(&links[i / 3]);
+				break;
+			case 1:
+				dhcp6_recv(&links[i / 3]);
+				break;
+			case 2:
+				ra_recv(&links[i / 3]);
+				break;
+			}
+		}
+	}
+
+	printf("received %llu, dropped %llu, sent %llu\n",
+	    nrecv, ndropped, nsent);
+	return EXIT_SUCCESS;
+}
+#else
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Network namespaces and SO_BINDTODEVICE are Linux only. */
+int
+main(void)
+{
+
+	fprintf(stderr, "scale-server only runs on Linux\n");
+	return EXIT_FAILURE;
+}
+#endif
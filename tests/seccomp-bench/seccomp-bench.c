@@ -0,0 +1,295 @@
+/*
+ * dhcpcd seccomp filter benchmark
+ * Copyright (c) 2006-2021 Roy Marples <roy@marples.name>
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <net/if.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "common.h"
+#include "dhcpcd.h"
+#include "if.h"
+#include "privsep.h"
+
+/*
+ * What privsep-linux.c calls out to, none of which is reached here.
+ */
+
+bool
+if_txn_active(__unused const struct dhcpcd_ctx *ctx)
+{
+
+	return false;
+}
+
+int
+if_txn_queue(__unused struct dhcpcd_ctx *ctx, __unused void *data,
+    __unused size_t len)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+int
+if_getnetlink(__unused struct dhcpcd_ctx *ctx, __unused int fd,
+    __unused int protocol,
+    __unused int (*cb)(struct dhcpcd_ctx *, void *, struct nlmsghdr *),
+    __unused void *cbarg)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+bool
+ps_root_batching(__unused const struct dhcpcd_ctx *ctx)
+{
+
+	return false;
+}
+
+ssize_t
+ps_root_batchmsg(__unused struct dhcpcd_ctx *ctx, __unused uint16_t cmd,
+    __unused unsigned long flags, __unused const struct msghdr *msg)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t
+ps_root_readerror(__unused struct dhcpcd_ctx *ctx, __unused void *data,
+    __unused size_t len)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t
+ps_sendmsg(__unused struct dhcpcd_ctx *ctx, __unused int fd,
+    __unused uint16_t cmd, __unused unsigned long flags,
+    __unused const struct msghdr *msg)
+{
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+/*
+ * The syscalls timed, each made so it returns at once.
+ * The ones dhcpcd makes for every message come first.
+ */
+
+static int pfd[2], sfd[2], efd, ifd;
+static char buf[1];
+
+static void
+call_read(void)
+{
+
+	(void)read(pfd[0], buf, 0);
+}
+
+static void
+call_write(void)
+{
+
+	(void)write(pfd[1], buf, 0);
+}
+
+static void
+call_recvmsg(void)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	(void)recvmsg(sfd[0], &msg, MSG_DONTWAIT);
+}
+
+static void
+call_sendmsg(void)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = 0 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	(void)sendmsg(sfd[1], &msg, 0);
+}
+
+static void
+call_epoll_pwait(void)
+{
+	struct epoll_event ev;
+
+	(void)epoll_pwait(efd, &ev, 1, 0, NULL);
+}
+
+static void
+call_writev(void)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = 0 };
+
+	(void)writev(pfd[1], &iov, 1);
+}
+
+static void
+call_getpid(void)
+{
+
+	(void)syscall(SYS_getpid);
+}
+
+static void
+call_uname(void)
+{
+	struct utsname uts;
+
+	(void)uname(&uts);
+}
+
+static void
+call_ioctl(void)
+{
+	struct ifreq ifr = { .ifr_name = "lo" };
+
+	(void)ioctl(ifd, SIOCGIFMTU, &ifr);
+}
+
+static void
+call_getsockopt(void)
+{
+	int n;
+	socklen_t len = sizeof(n);
+
+	(void)getsockopt(ifd, SOL_SOCKET, SO_RCVBUF, &n, &len);
+}
+
+static const struct {
+	const char *name;
+	void (*call)(void);
+} calls[] = {
+	{ "read", call_read },
+	{ "write", call_write },
+	{ "recvmsg", call_recvmsg },
+	{ "sendmsg", call_sendmsg },
+	{ "epoll_pwait", call_epoll_pwait },
+	{ "writev", call_writev },
+	{ "getpid", call_getpid },
+	{ "uname", call_uname },
+	{ "ioctl", call_ioctl },
+	{ "getsockopt", call_getsockopt },
+};
+
+#define	RUNS	5
+
+/* Best of RUNS runs of n calls, in nanoseconds per call. */
+static double
+bench(void (*call)(void), unsigned int n)
+{
+	struct timespec t0, t1;
+	double ns, best = 0;
+	unsigned int i, r;
+
+	for (r = 0; r < RUNS; r++) {
+		if (clock_gettime(CLOCK_MONOTONIC, &t0) == -1)
+			err(EXIT_FAILURE, "clock_gettime");
+		for (i = 0; i < n; i++)
+			call();
+		if (clock_gettime(CLOCK_MONOTONIC, &t1) == -1)
+			err(EXIT_FAILURE, "clock_gettime");
+		ns = ((double)(t1.tv_sec - t0.tv_sec) * 1000000000.0 +
+		    (double)(t1.tv_nsec - t0.tv_nsec)) / n;
+		if (r == 0 || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+int
+main(int argc, char **argv)
+{
+	double before[__arraycount(calls)], after;
+	unsigned int n = 100000;
+	size_t i;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = (unsigned int)atoi(optarg);
+			break;
+		default:
+			errx(EXIT_FAILURE, "illegal argument `%c'", c);
+		}
+	}
+	if (n == 0)
+		errx(EXIT_FAILURE, "calls must be at least 1");
+
+	if (pipe2(pfd, O_NONBLOCK) == -1)
+		err(EXIT_FAILURE, "pipe2");
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sfd) == -1)
+		err(EXIT_FAILURE, "socketpair");
+	if ((efd = epoll_create1(0)) == -1)
+		err(EXIT_FAILURE, "epoll_create1");
+	if ((ifd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(EXIT_FAILURE, "socket");
+
+	for (i = 0; i < __arraycount(calls); i++)
+		before[i] = bench(calls[i].call, n);
+
+	/* From here on this process can only make the syscalls
+	 * a privsep helper can. */
+	if (ps_seccomp_enter() == -1)
+		err(EXIT_FAILURE, "ps_seccomp_enter");
+
+	printf("%u calls, best of %d, nsec/call\n", n, RUNS);
+	printf("%-12s %9s %9s %9s\n", "syscall", "unfiltered", "filtered",
+	    "cost");
+	for (i = 0; i < __arraycount(calls); i++) {
+		after = bench(calls[i].call, n);
+		printf("%-12s %9.1f %9.1f %9.1f\n", calls[i].name,
+		    before[i], after, after - before[i]);
+	}
+	return EXIT_SUCCESS;
+}